@@ -0,0 +1,327 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "CodedStreamInfo"
+
+#include <v4l2_codec2/common/CodedStreamInfo.h>
+
+#include <algorithm>
+
+#include <media/stagefright/foundation/ABitReader.h>
+#include <utils/Log.h>
+
+#include <v4l2_codec2/common/NalParser.h>
+
+namespace android {
+namespace {
+
+// The number of reference frames of VP8 (last, golden and altref), VP9 and AV1.
+constexpr size_t kVp8NumRefFrames = 3;
+constexpr size_t kVp9NumRefFrames = 8;
+constexpr size_t kAv1NumRefFrames = 8;
+
+bool findH264StreamInfo(const uint8_t* data, size_t size, CodedStreamInfo* info) {
+    NalParser parser(data, size);
+    return parser.locateSPS() && parser.findCodedStreamInfo(info);
+}
+
+bool findHEVCStreamInfo(const uint8_t* data, size_t size, CodedStreamInfo* info) {
+    HEVCNalParser parser(data, size);
+    while (parser.locateNextNal()) {
+        // The parameter sets come before the first slice.
+        if (parser.length() < 2 || parser.isSlice()) break;
+        if (parser.type() == HEVCNalParser::kSPSType) return parser.findCodedStreamInfo(info);
+    }
+    return false;
+}
+
+bool findVp8StreamInfo(const uint8_t* data, size_t size, CodedStreamInfo* info) {
+    // The frame tag, followed on key frames by the start code and the dimensions with their
+    // scaling, see RFC 6386 section 9.1.
+    constexpr size_t kKeyFrameHeaderSize = 10;
+    if (size < kKeyFrameHeaderSize || (data[0] & 0x1) || data[3] != 0x9d || data[4] != 0x01 ||
+        data[5] != 0x2a) {
+        return false;
+    }
+    const uint32_t width = (data[6] | (data[7] << 8)) & 0x3fff;
+    const uint32_t height = (data[8] | (data[9] << 8)) & 0x3fff;
+    if (width == 0 || height == 0) return false;
+
+    info->codedSize = ui::Size(width, height);
+    info->maxDpbFrames = kVp8NumRefFrames;
+    return true;
+}
+
+bool findVp9StreamInfo(const uint8_t* data, size_t size, CodedStreamInfo* info) {
+    // The uncompressed header of a key frame, up to frame_size(), see section 6.2 of the VP9
+    // bitstream specification. The first frame of a superframe is at its start.
+    ABitReader br(data, size);
+    uint32_t frameMarker, profileLowBit, profileHighBit;
+    if (!br.getBitsGraceful(2, &frameMarker) || frameMarker != 2 ||
+        !br.getBitsGraceful(1, &profileLowBit) || !br.getBitsGraceful(1, &profileHighBit)) {
+        return false;
+    }
+    const uint32_t profile = (profileHighBit << 1) | profileLowBit;
+    uint32_t unused;
+    if (profile == 3 && !br.getBitsGraceful(1, &unused)) return false;  // reserved_zero
+
+    uint32_t showExistingFrame, frameType, syncCode;
+    if (!br.getBitsGraceful(1, &showExistingFrame) || showExistingFrame ||
+        !br.getBitsGraceful(1, &frameType) || frameType != 0 /* KEY_FRAME */) {
+        return false;
+    }
+    br.skipBits(2);  // show_frame, error_resilient_mode
+    constexpr uint32_t kSyncCode = 0x498342;
+    if (!br.getBitsGraceful(24, &syncCode) || syncCode != kSyncCode) return false;
+
+    // color_config()
+    constexpr uint32_t kColorSpaceRGB = 7;
+    uint32_t colorSpace;
+    uint32_t tenOrTwelveBit = 0;
+    if (profile >= 2 && !br.getBitsGraceful(1, &tenOrTwelveBit)) return false;
+    if (!br.getBitsGraceful(3, &colorSpace)) return false;
+    if (colorSpace != kColorSpaceRGB) {
+        br.skipBits(1);  // color_range
+        // subsampling_x, subsampling_y and reserved_zero
+        if (profile == 1 || profile == 3) br.skipBits(3);
+    } else if (profile == 1 || profile == 3) {
+        br.skipBits(1);  // reserved_zero
+    }
+
+    uint32_t widthMinus1, heightMinus1;
+    if (!br.getBitsGraceful(16, &widthMinus1) || !br.getBitsGraceful(16, &heightMinus1)) {
+        return false;
+    }
+    info->codedSize = ui::Size(widthMinus1 + 1, heightMinus1 + 1);
+    info->maxDpbFrames = kVp9NumRefFrames;
+    info->bitDepth = profile >= 2 ? (tenOrTwelveBit ? 12 : 10) : 8;
+    return true;
+}
+
+// Read the leb128() value at |*offset| of |data|, see section 4.10.5 of the AV1 bitstream
+// specification, and advance |*offset| past it.
+bool readLeb128(const uint8_t* data, size_t size, size_t* offset, uint64_t* value) {
+    *value = 0;
+    for (size_t i = 0; i < 8 && *offset < size; i++) {
+        const uint8_t byte = data[(*offset)++];
+        *value |= static_cast<uint64_t>(byte & 0x7f) << (i * 7);
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// Skip the uvlc() value of |br|, see section 4.10.3 of the AV1 bitstream specification.
+bool skipUvlc(ABitReader* br) {
+    uint32_t leadingZeros = 0;
+    uint32_t done = 0;
+    while (!done) {
+        if (!br->getBitsGraceful(1, &done)) return false;
+        if (!done) leadingZeros++;
+    }
+    if (leadingZeros >= 32) return true;
+    uint32_t unused;
+    return leadingZeros == 0 || br->getBitsGraceful(leadingZeros, &unused);
+}
+
+// Parse the sequence_header_obu() of |data|, see section 5.5 of the AV1 bitstream specification.
+bool parseAv1SequenceHeader(const uint8_t* data, size_t size, CodedStreamInfo* info) {
+    ABitReader br(data, size);
+    uint32_t seqProfile, stillPicture, reducedStillPictureHeader;
+    if (!br.getBitsGraceful(3, &seqProfile) || !br.getBitsGraceful(1, &stillPicture) ||
+        !br.getBitsGraceful(1, &reducedStillPictureHeader)) {
+        return false;
+    }
+
+    uint32_t unused;
+    if (reducedStillPictureHeader) {
+        br.skipBits(5);  // seq_level_idx[0]
+    } else {
+        uint32_t timingInfoPresent, decoderModelInfoPresent = 0, bufferDelayLengthMinus1 = 0;
+        if (!br.getBitsGraceful(1, &timingInfoPresent)) return false;
+        if (timingInfoPresent) {
+            // timing_info()
+            uint32_t equalPictureInterval;
+            br.skipBits(64);  // num_units_in_display_tick, time_scale
+            if (!br.getBitsGraceful(1, &equalPictureInterval)) return false;
+            if (equalPictureInterval && !skipUvlc(&br)) return false;
+
+            if (!br.getBitsGraceful(1, &decoderModelInfoPresent)) return false;
+            if (decoderModelInfoPresent) {
+                // decoder_model_info(), followed by num_units_in_decoding_tick,
+                // buffer_removal_time_length_minus_1 and frame_presentation_time_length_minus_1.
+                if (!br.getBitsGraceful(5, &bufferDelayLengthMinus1)) return false;
+                br.skipBits(32 + 5 + 5);
+            }
+        }
+
+        uint32_t initialDisplayDelayPresent, operatingPointsCntMinus1;
+        if (!br.getBitsGraceful(1, &initialDisplayDelayPresent) ||
+            !br.getBitsGraceful(5, &operatingPointsCntMinus1)) {
+            return false;
+        }
+        for (uint32_t i = 0; i <= operatingPointsCntMinus1; i++) {
+            uint32_t seqLevelIdx;
+            br.skipBits(12);  // operating_point_idc[i]
+            if (!br.getBitsGraceful(5, &seqLevelIdx)) return false;
+            if (seqLevelIdx > 7) br.skipBits(1);  // seq_tier[i]
+            if (decoderModelInfoPresent) {
+                uint32_t decoderModelPresent;
+                if (!br.getBitsGraceful(1, &decoderModelPresent)) return false;
+                // operating_parameters_info(): decoder_buffer_delay, encoder_buffer_delay and
+                // low_delay_mode_flag.
+                if (decoderModelPresent) br.skipBits(2 * (bufferDelayLengthMinus1 + 1) + 1);
+            }
+            if (initialDisplayDelayPresent) {
+                uint32_t initialDisplayDelayPresentForOp;
+                if (!br.getBitsGraceful(1, &initialDisplayDelayPresentForOp)) return false;
+                if (initialDisplayDelayPresentForOp) br.skipBits(4);
+            }
+        }
+    }
+
+    uint32_t frameWidthBitsMinus1, frameHeightBitsMinus1, maxWidthMinus1, maxHeightMinus1;
+    if (!br.getBitsGraceful(4, &frameWidthBitsMinus1) ||
+        !br.getBitsGraceful(4, &frameHeightBitsMinus1) ||
+        !br.getBitsGraceful(frameWidthBitsMinus1 + 1, &maxWidthMinus1) ||
+        !br.getBitsGraceful(frameHeightBitsMinus1 + 1, &maxHeightMinus1)) {
+        return false;
+    }
+
+    if (!reducedStillPictureHeader) {
+        uint32_t frameIdNumbersPresent;
+        if (!br.getBitsGraceful(1, &frameIdNumbersPresent)) return false;
+        // delta_frame_id_length_minus_2, additional_frame_id_length_minus_1
+        if (frameIdNumbersPresent) br.skipBits(4 + 3);
+    }
+    // use_128x128_superblock, enable_filter_intra, enable_intra_edge_filter
+    br.skipBits(3);
+    if (!reducedStillPictureHeader) {
+        // enable_interintra_compound, enable_masked_compound, enable_warped_motion,
+        // enable_dual_filter
+        br.skipBits(4);
+        uint32_t enableOrderHint, seqChooseScreenContentTools, seqForceScreenContentTools = 2;
+        if (!br.getBitsGraceful(1, &enableOrderHint)) return false;
+        if (enableOrderHint) br.skipBits(2);  // enable_jnt_comp, enable_ref_frame_mvs
+        if (!br.getBitsGraceful(1, &seqChooseScreenContentTools)) return false;
+        if (!seqChooseScreenContentTools && !br.getBitsGraceful(1, &seqForceScreenContentTools)) {
+            return false;
+        }
+        if (seqForceScreenContentTools > 0) {
+            uint32_t seqChooseIntegerMv;
+            if (!br.getBitsGraceful(1, &seqChooseIntegerMv)) return false;
+            if (!seqChooseIntegerMv) br.skipBits(1);  // seq_force_integer_mv
+        }
+        if (enableOrderHint) br.skipBits(3);  // order_hint_bits_minus_1
+    }
+    // enable_superres, enable_cdef, enable_restoration
+    br.skipBits(3);
+
+    // color_config()
+    uint32_t highBitdepth, twelveBit = 0, monoChrome = 0, colorDescriptionPresent;
+    if (!br.getBitsGraceful(1, &highBitdepth)) return false;
+    if (seqProfile == 2 && highBitdepth && !br.getBitsGraceful(1, &twelveBit)) return false;
+    if (seqProfile != 1 && !br.getBitsGraceful(1, &monoChrome)) return false;
+    if (!br.getBitsGraceful(1, &colorDescriptionPresent)) return false;
+    constexpr uint32_t kUnspecified = 2;
+    uint32_t colorPrimaries = kUnspecified, transferCharacteristics = kUnspecified,
+             matrixCoefficients = kUnspecified;
+    if (colorDescriptionPresent &&
+        (!br.getBitsGraceful(8, &colorPrimaries) ||
+         !br.getBitsGraceful(8, &transferCharacteristics) ||
+         !br.getBitsGraceful(8, &matrixCoefficients))) {
+        return false;
+    }
+    constexpr uint32_t kPrimariesBt709 = 1;
+    constexpr uint32_t kTransferSrgb = 13;
+    constexpr uint32_t kMatrixIdentity = 0;
+    if (monoChrome) {
+        br.skipBits(1);  // color_range
+    } else {
+        if (colorPrimaries != kPrimariesBt709 || transferCharacteristics != kTransferSrgb ||
+            matrixCoefficients != kMatrixIdentity) {
+            br.skipBits(1);  // color_range
+            uint32_t subsamplingX = 1, subsamplingY = 1;
+            if (seqProfile == 1) {
+                subsamplingX = subsamplingY = 0;
+            } else if (seqProfile == 2) {
+                subsamplingY = 0;
+                if (twelveBit) {
+                    if (!br.getBitsGraceful(1, &subsamplingX)) return false;
+                    if (subsamplingX && !br.getBitsGraceful(1, &subsamplingY)) return false;
+                }
+            }
+            if (subsamplingX && subsamplingY) br.skipBits(2);  // chroma_sample_position
+        }
+        br.skipBits(1);  // separate_uv_delta_q
+    }
+
+    uint32_t filmGrainParamsPresent;
+    if (!br.getBitsGraceful(1, &filmGrainParamsPresent)) return false;
+
+    info->codedSize = ui::Size(maxWidthMinus1 + 1, maxHeightMinus1 + 1);
+    info->maxDpbFrames = kAv1NumRefFrames;
+    info->hasFilmGrain = filmGrainParamsPresent;
+    info->bitDepth = highBitdepth ? (twelveBit ? 12 : 10) : 8;
+    return true;
+}
+
+bool findAv1StreamInfo(const uint8_t* data, size_t size, CodedStreamInfo* info) {
+    // The sequence header comes before the frames of the temporal unit.
+    uint32_t obuType;
+    const uint8_t* obu;
+    size_t obuSize;
+    return findAv1Obu(data, size, {kAv1ObuSequenceHeader}, &obuType, &obu, &obuSize) &&
+           parseAv1SequenceHeader(obu, obuSize, info);
+}
+
+}  // namespace
+
+bool findAv1Obu(const uint8_t* data, size_t size, std::initializer_list<uint32_t> obuTypes,
+                uint32_t* obuType, const uint8_t** obu, size_t* obuSize) {
+    // The OBUs of the temporal unit, see section 5.3 of the AV1 bitstream specification.
+    size_t offset = 0;
+    while (offset < size) {
+        const uint8_t header = data[offset++];
+        const uint32_t type = (header >> 3) & 0xf;
+        const bool hasExtension = header & 0x4;
+        const bool hasSizeField = header & 0x2;
+        if (header & 0x80) return false;  // obu_forbidden_bit
+        if (hasExtension) offset++;
+
+        uint64_t payloadSize = size - std::min(offset, size);
+        if (hasSizeField && !readLeb128(data, size, &offset, &payloadSize)) return false;
+        if (offset > size || payloadSize > size - offset) return false;
+
+        if (std::find(obuTypes.begin(), obuTypes.end(), type) != obuTypes.end()) {
+            *obuType = type;
+            *obu = data + offset;
+            *obuSize = payloadSize;
+            return true;
+        }
+        offset += payloadSize;
+    }
+    return false;
+}
+
+bool findCodedStreamInfo(VideoCodec codec, const uint8_t* data, size_t size,
+                         CodedStreamInfo* info) {
+    ALOG_ASSERT(info);
+
+    switch (codec) {
+    case VideoCodec::H264:
+        return findH264StreamInfo(data, size, info);
+    case VideoCodec::HEVC:
+        return findHEVCStreamInfo(data, size, info);
+    case VideoCodec::VP8:
+        return findVp8StreamInfo(data, size, info);
+    case VideoCodec::VP9:
+        return findVp9StreamInfo(data, size, info);
+    case VideoCodec::AV1:
+        return findAv1StreamInfo(data, size, info);
+    }
+    return false;
+}
+
+}  // namespace android
@@ -0,0 +1,27 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "ConversionBackend"
+
+#include <v4l2_codec2/common/ConversionBackend.h>
+
+#include <log/log.h>
+
+#include <v4l2_codec2/common/V4L2ImageProcessor.h>
+
+namespace android {
+
+std::unique_ptr<ConversionBackend> createConversionBackend(VideoPixelFormat outFormat) {
+    // Backends are tried in order of preference, new backends can be added here.
+    if (std::unique_ptr<ConversionBackend> backend = V4L2ImageProcessor::Create(outFormat)) {
+        ALOGV("Using V4L2 image processor to convert frames to %s",
+              videoPixelFormatToString(outFormat).c_str());
+        return backend;
+    }
+
+    return nullptr;
+}
+
+}  // namespace android
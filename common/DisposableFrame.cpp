@@ -0,0 +1,284 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "DisposableFrame"
+
+#include <v4l2_codec2/common/DisposableFrame.h>
+
+#include <media/stagefright/foundation/ABitReader.h>
+#include <utils/Log.h>
+
+#include <v4l2_codec2/common/CodedStreamInfo.h>
+#include <v4l2_codec2/common/NalParser.h>
+
+namespace android {
+namespace {
+
+bool isDisposableH264Frame(const uint8_t* data, size_t size) {
+    NalParser parser(data, size);
+    bool hasSlice = false;
+    while (parser.locateNextNal()) {
+        if (parser.type() == NalParser::kSPSType || parser.type() == NalParser::kPPSType) {
+            return false;
+        }
+        if (!parser.isSlice()) continue;
+        if (parser.refIdc() != 0) return false;
+        hasSlice = true;
+    }
+    return hasSlice;
+}
+
+// The boolean entropy decoder of the VP8 frame headers, see RFC 6386 section 7.3.
+class Vp8BoolDecoder {
+public:
+    Vp8BoolDecoder(const uint8_t* data, size_t size) : mData(data), mEnd(data + size) {
+        for (int i = 0; i < 2; i++) mValue = (mValue << 8) | nextByte();
+    }
+
+    bool readBool(uint32_t probability = 128) {
+        const uint32_t split = 1 + (((mRange - 1) * probability) >> 8);
+        const uint32_t bigSplit = split << 8;
+        bool bit;
+        if (mValue >= bigSplit) {
+            bit = true;
+            mRange -= split;
+            mValue -= bigSplit;
+        } else {
+            bit = false;
+            mRange = split;
+        }
+        while (mRange < 128) {
+            mValue <<= 1;
+            mRange <<= 1;
+            if (++mBitCount == 8) {
+                mBitCount = 0;
+                mValue |= nextByte();
+            }
+        }
+        return bit;
+    }
+
+    uint32_t readLiteral(int numBits) {
+        uint32_t value = 0;
+        while (numBits-- > 0) value = (value << 1) | readBool();
+        return value;
+    }
+
+    // Skip a flag, followed by |numBits| bits and a sign if set.
+    void skipOptionalSigned(int numBits) {
+        if (readBool()) readLiteral(numBits + 1);
+    }
+
+    // Whether the header is truncated, in which case the values read are meaningless.
+    bool overrun() const { return mOverrun; }
+
+private:
+    uint32_t nextByte() {
+        if (mData == mEnd) {
+            mOverrun = true;
+            return 0;
+        }
+        return *mData++;
+    }
+
+    const uint8_t* mData;
+    const uint8_t* const mEnd;
+    uint32_t mValue = 0;
+    uint32_t mRange = 255;
+    int mBitCount = 0;
+    bool mOverrun = false;
+};
+
+bool isDisposableVp8Frame(const uint8_t* data, size_t size) {
+    // The uncompressed frame tag, see RFC 6386 section 9.1.
+    constexpr size_t kFrameTagSize = 3;
+    if (size < kFrameTagSize) return false;
+    const uint32_t frameTag = data[0] | (data[1] << 8) | (data[2] << 16);
+    const bool keyFrame = !(frameTag & 0x1);
+    if (keyFrame) return false;
+
+    // The first partition, up to the flags of the refreshed buffers, see RFC 6386 section 19.2.
+    Vp8BoolDecoder bd(data + kFrameTagSize, size - kFrameTagSize);
+    if (bd.readBool()) {  // segmentation_enabled
+        const bool updateMap = bd.readBool();
+        const bool updateData = bd.readBool();
+        // The segmentation map and feature data are kept for the next frames.
+        if (updateMap || updateData) return false;
+    }
+    bd.readLiteral(1 + 6 + 3);  // filter_type, loop_filter_level, sharpness_level
+    if (bd.readBool()) {        // loop_filter_adj_enable
+        // The loop filter deltas are kept for the next frames.
+        if (bd.readBool()) return false;  // mode_ref_lf_delta_update
+    }
+    bd.readLiteral(2);  // log2_nbr_of_dct_partitions
+    bd.readLiteral(7);  // y_ac_qi
+    for (int i = 0; i < 5; i++) bd.skipOptionalSigned(4);  // The quantizer index deltas.
+
+    const bool refreshGolden = bd.readBool();
+    const bool refreshAlternate = bd.readBool();
+    const uint32_t copyToGolden = refreshGolden ? 0 : bd.readLiteral(2);
+    const uint32_t copyToAlternate = refreshAlternate ? 0 : bd.readLiteral(2);
+    bd.readLiteral(2);  // sign_bias_golden, sign_bias_alternate
+    const bool refreshEntropyProbs = bd.readBool();
+    const bool refreshLast = bd.readBool();
+    return !bd.overrun() && !refreshGolden && !refreshAlternate && copyToGolden == 0 &&
+           copyToAlternate == 0 && !refreshEntropyProbs && !refreshLast;
+}
+
+bool isDisposableVp9Frame(const uint8_t* data, size_t size) {
+    if (size == 0) return false;
+    // A superframe carries a frame not shown followed by the one shown, which both refresh a
+    // reference buffer.
+    constexpr uint8_t kSuperframeMarkerMask = 0xe0;
+    constexpr uint8_t kSuperframeMarker = 0xc0;
+    if ((data[size - 1] & kSuperframeMarkerMask) == kSuperframeMarker) return false;
+
+    // The uncompressed header, up to refresh_frame_flags, see section 6.2 of the VP9 bitstream
+    // specification.
+    ABitReader br(data, size);
+    uint32_t frameMarker, profileLowBit, profileHighBit;
+    if (!br.getBitsGraceful(2, &frameMarker) || frameMarker != 2 ||
+        !br.getBitsGraceful(1, &profileLowBit) || !br.getBitsGraceful(1, &profileHighBit)) {
+        return false;
+    }
+    uint32_t reservedZero;
+    if (profileLowBit && profileHighBit && !br.getBitsGraceful(1, &reservedZero)) return false;
+
+    uint32_t showExistingFrame, frameType, showFrame, errorResilientMode;
+    if (!br.getBitsGraceful(1, &showExistingFrame) || showExistingFrame ||
+        !br.getBitsGraceful(1, &frameType) || frameType == 0 /* KEY_FRAME */ ||
+        !br.getBitsGraceful(1, &showFrame) || !showFrame ||
+        !br.getBitsGraceful(1, &errorResilientMode) || !errorResilientMode) {
+        return false;
+    }
+    // intra_only is only present in the frames not shown, and reset_frame_context in the ones
+    // which aren't error resilient.
+    uint32_t refreshFrameFlags;
+    return br.getBitsGraceful(8, &refreshFrameFlags) && refreshFrameFlags == 0;
+}
+
+bool isVp9FrameIndependentOfPreviousFrame(const uint8_t* data, size_t size) {
+    // The first frame of a superframe is at its start, and the frame not shown it carries doesn't
+    // use the motion vectors of the previous frame either.
+    ABitReader br(data, size);
+    uint32_t frameMarker, profileLowBit, profileHighBit;
+    if (!br.getBitsGraceful(2, &frameMarker) || frameMarker != 2 ||
+        !br.getBitsGraceful(1, &profileLowBit) || !br.getBitsGraceful(1, &profileHighBit)) {
+        return false;
+    }
+    uint32_t reservedZero;
+    if (profileLowBit && profileHighBit && !br.getBitsGraceful(1, &reservedZero)) return false;
+
+    uint32_t showExistingFrame, frameType, showFrame, errorResilientMode;
+    if (!br.getBitsGraceful(1, &showExistingFrame) || showExistingFrame ||
+        !br.getBitsGraceful(1, &frameType)) {
+        return false;
+    }
+    if (frameType == 0 /* KEY_FRAME */) return true;
+    return br.getBitsGraceful(1, &showFrame) && br.getBitsGraceful(1, &errorResilientMode) &&
+           errorResilientMode;
+}
+
+bool isH264KeyFrame(const uint8_t* data, size_t size) {
+    NalParser parser(data, size);
+    while (parser.locateNextNal()) {
+        if (parser.isSlice()) return parser.type() == NalParser::kIDRType;
+    }
+    return false;
+}
+
+bool isHEVCKeyFrame(const uint8_t* data, size_t size) {
+    // The IDR_W_RADL and IDR_N_LP NAL unit types. The leading pictures of the CRA and BLA ones
+    // reference the pictures before them, so decoding can't start from them without losing frames.
+    constexpr uint8_t kIDRWRADLType = 19;
+    constexpr uint8_t kIDRNLPType = 20;
+    HEVCNalParser parser(data, size);
+    while (parser.locateNextNal()) {
+        if (parser.isSlice()) {
+            return parser.type() == kIDRWRADLType || parser.type() == kIDRNLPType;
+        }
+    }
+    return false;
+}
+
+bool isVp9KeyFrame(const uint8_t* data, size_t size) {
+    // The first frame of a superframe is at its start, so its header is parsed the same way.
+    ABitReader br(data, size);
+    uint32_t frameMarker, profileLowBit, profileHighBit;
+    if (!br.getBitsGraceful(2, &frameMarker) || frameMarker != 2 ||
+        !br.getBitsGraceful(1, &profileLowBit) || !br.getBitsGraceful(1, &profileHighBit)) {
+        return false;
+    }
+    uint32_t reservedZero;
+    if (profileLowBit && profileHighBit && !br.getBitsGraceful(1, &reservedZero)) return false;
+
+    uint32_t showExistingFrame, frameType;
+    return br.getBitsGraceful(1, &showExistingFrame) && !showExistingFrame &&
+           br.getBitsGraceful(1, &frameType) && frameType == 0 /* KEY_FRAME */;
+}
+
+bool isAv1KeyFrame(const uint8_t* data, size_t size) {
+    // Decoding can only restart from a temporal unit carrying the sequence header. The frames of
+    // the streams with a reduced still picture header are all key frames.
+    uint32_t obuType;
+    const uint8_t* obu;
+    size_t obuSize;
+    if (!findAv1Obu(data, size, {kAv1ObuSequenceHeader}, &obuType, &obu, &obuSize) ||
+        obuSize == 0) {
+        return false;
+    }
+    const bool reducedStillPictureHeader = obu[0] & 0x8;
+    if (reducedStillPictureHeader) return true;
+
+    // The uncompressed header of the first frame, up to frame_type, see section 5.9.2 of the AV1
+    // bitstream specification.
+    if (!findAv1Obu(data, size, {kAv1ObuFrameHeader, kAv1ObuFrame}, &obuType, &obu, &obuSize)) {
+        return false;
+    }
+    ABitReader br(obu, obuSize);
+    uint32_t showExistingFrame, frameType;
+    return br.getBitsGraceful(1, &showExistingFrame) && !showExistingFrame &&
+           br.getBitsGraceful(2, &frameType) && frameType == 0 /* KEY_FRAME */;
+}
+
+}  // namespace
+
+bool isDisposableFrame(VideoCodec codec, const uint8_t* data, size_t size) {
+    switch (codec) {
+    case VideoCodec::H264:
+        return isDisposableH264Frame(data, size);
+    case VideoCodec::VP8:
+        return isDisposableVp8Frame(data, size);
+    case VideoCodec::VP9:
+        return isDisposableVp9Frame(data, size);
+    default:
+        return false;
+    }
+}
+
+bool isIndependentOfPreviousFrame(VideoCodec codec, const uint8_t* data, size_t size) {
+    if (codec == VideoCodec::VP9) return isVp9FrameIndependentOfPreviousFrame(data, size);
+    return true;
+}
+
+bool isKeyFrame(VideoCodec codec, const uint8_t* data, size_t size) {
+    switch (codec) {
+    case VideoCodec::H264:
+        return isH264KeyFrame(data, size);
+    case VideoCodec::HEVC:
+        return isHEVCKeyFrame(data, size);
+    case VideoCodec::VP8:
+        // The key frames have the bit 0 of the frame tag unset, see RFC 6386 section 9.1.
+        return size >= 3 && !(data[0] & 0x1);
+    case VideoCodec::VP9:
+        return isVp9KeyFrame(data, size);
+    case VideoCodec::AV1:
+        return isAv1KeyFrame(data, size);
+    default:
+        return false;
+    }
+}
+
+}  // namespace android
@@ -9,11 +9,14 @@
 
 #include <linux/v4l2-controls.h>
 
+#include <utility>
+
 #include <C2AllocatorGralloc.h>
 #include <cutils/native_handle.h>
 #include <ui/GraphicBuffer.h>
 #include <utils/Log.h>
 
+#include <v4l2_codec2/common/FormatConverter.h>
 #include <v4l2_codec2/common/NalParser.h>
 
 namespace android {
@@ -23,6 +26,8 @@ namespace {
 // Android frameworks needs 4 bytes start code.
 constexpr uint8_t kH264StartCode[] = {0x00, 0x00, 0x00, 0x01};
 constexpr size_t kH264StartCodeSize = 4;
+// The size of the shortest start code the NalParser accepts in front of a NAL unit.
+constexpr size_t kH264ShortStartCodeSize = 3;
 
 // Copy an H.264 NAL unit with size |srcSize| (without a start code) into a buffer with size
 // |dstSize|. An H.264 start code is prepended to the NAL unit. After copying |dst| is adjusted to
@@ -42,6 +47,158 @@ bool copyNALUPrependingStartCode(const uint8_t* src, size_t srcSize, uint8_t** d
     return true;
 }
 
+// The NAL unit syntax of the codecs supported by the parameter set helpers below. The parameter
+// sets are indexed in the order they need to be sent in.
+struct H264Syntax {
+    using Parser = NalParser;
+    static constexpr size_t kNumParamSets = 2;
+
+    static int paramSetIndex(const Parser& parser) {
+        switch (parser.type()) {
+        case NalParser::kSPSType:
+            return 0;
+        case NalParser::kPPSType:
+            return 1;
+        default:
+            return -1;
+        }
+    }
+    static bool isKeyFrame(const Parser& parser) { return parser.type() == NalParser::kIDRType; }
+};
+
+struct HEVCSyntax {
+    using Parser = HEVCNalParser;
+    static constexpr size_t kNumParamSets = 3;
+
+    static int paramSetIndex(const Parser& parser) {
+        switch (parser.type()) {
+        case HEVCNalParser::kVPSType:
+            return 0;
+        case HEVCNalParser::kSPSType:
+            return 1;
+        case HEVCNalParser::kPPSType:
+            return 2;
+        default:
+            return -1;
+        }
+    }
+    static bool isKeyFrame(const Parser& parser) { return parser.isIRAP(); }
+};
+
+// Extract all the parameter sets of |Syntax| from the |data| stream into |paramSets|.
+template <typename Syntax>
+bool extractParamSets(const uint8_t* data, size_t length,
+                      std::vector<uint8_t>* const (&paramSets)[Syntax::kNumParamSets],
+                      bool stopAtFirstSlice) {
+    constexpr uint32_t kAllFound = (1u << Syntax::kNumParamSets) - 1;
+    uint32_t found = 0;
+    typename Syntax::Parser parser(data, length);
+    while (found != kAllFound && parser.locateNextNal()) {
+        if (stopAtFirstSlice && parser.isSlice()) break;
+        const int index = Syntax::paramSetIndex(parser);
+        if (index < 0) continue;
+        paramSets[index]->assign(parser.data(), parser.data() + parser.length());
+        found |= 1u << index;
+    }
+    return found == kAllFound;
+}
+
+// Extract the parameter sets of |Syntax| from the |data| stream into a CSD parameter.
+template <typename Syntax>
+bool extractCSD(std::unique_ptr<C2StreamInitDataInfo::output>* const csd, const uint8_t* data,
+                size_t length) {
+    csd->reset();
+
+    std::vector<uint8_t> paramSets[Syntax::kNumParamSets];
+    std::vector<uint8_t>* paramSetPtrs[Syntax::kNumParamSets];
+    for (size_t i = 0; i < Syntax::kNumParamSets; ++i) paramSetPtrs[i] = &paramSets[i];
+    if (!extractParamSets<Syntax>(data, length, paramSetPtrs, false)) {
+        return false;
+    }
+
+    size_t configDataLength = 0;
+    for (const std::vector<uint8_t>& paramSet : paramSets) {
+        configDataLength += paramSet.size() + kH264StartCodeSize;
+    }
+    ALOGV("Extracted codec config data: length=%zu", configDataLength);
+
+    *csd = C2StreamInitDataInfo::output::AllocUnique(configDataLength, 0u);
+    uint8_t* csdBuffer = (*csd)->m.value;
+    for (const std::vector<uint8_t>& paramSet : paramSets) {
+        if (!copyNALUPrependingStartCode(paramSet.data(), paramSet.size(), &csdBuffer,
+                                        &configDataLength)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Insert the cached |paramSets| of |Syntax| in place in front of the first key frame slice.
+template <typename Syntax>
+size_t insertParamSetsBeforeKeyFrame(
+        uint8_t* buffer, size_t bufferSize, size_t* offset, size_t size,
+        std::vector<uint8_t>* const (&paramSets)[Syntax::kNumParamSets]) {
+    uint8_t* const data = buffer + *offset;
+    bool foundStreamParams = false;
+    typename Syntax::Parser parser(data, size);
+    while (parser.locateNextNal()) {
+        const int index = Syntax::paramSetIndex(parser);
+        if (index >= 0) {
+            ALOGV("Found parameter set %d (length %zu)", index, parser.length());
+            paramSets[index]->assign(parser.data(), parser.data() + parser.length());
+            foundStreamParams = true;
+            continue;
+        }
+        if (!parser.isSlice()) continue;
+        // A frame starting with a non-key frame slice contains no key frame.
+        if (!Syntax::isKeyFrame(parser)) return size;
+
+        ALOGV("Found key frame slice (length %zu)", parser.length());
+        if (foundStreamParams) {
+            ALOGV("Not injecting parameter sets before key frame, already present");
+            return size;
+        }
+
+        size_t paramsSize = 0;
+        for (const std::vector<uint8_t>* paramSet : paramSets) {
+            if (paramSet->empty()) {
+                ALOGE("No cached parameter sets available to inject before key frame");
+                return 0;
+            }
+            paramsSize += paramSet->size() + kH264StartCodeSize;
+        }
+
+        // The NAL units in front of the slice (e.g. an access unit delimiter) need to stay in
+        // front of the injected parameter sets. The start code of the slice can be 3 or 4 bytes.
+        const uint8_t* sliceStart = parser.data() - kH264ShortStartCodeSize;
+        if (sliceStart > data && *(sliceStart - 1) == 0x00) sliceStart--;
+        const size_t leadingSize = sliceStart - data;
+        uint8_t* dst;
+        if (*offset >= paramsSize) {
+            // Only the leading NAL units are moved back into the headroom.
+            memmove(data - paramsSize, data, leadingSize);
+            *offset -= paramsSize;
+            dst = buffer + *offset + leadingSize;
+        } else if (*offset + size + paramsSize <= bufferSize) {
+            // Not enough headroom, move the slices forward in the buffer instead.
+            memmove(data + leadingSize + paramsSize, data + leadingSize, size - leadingSize);
+            dst = data + leadingSize;
+        } else {
+            ALOGE("Not enough space to inject parameter sets before key frame");
+            return 0;
+        }
+
+        size_t remainingSize = paramsSize;
+        for (const std::vector<uint8_t>* paramSet : paramSets) {
+            copyNALUPrependingStartCode(paramSet->data(), paramSet->size(), &dst, &remainingSize);
+        }
+        ALOGV("Stream header injected before key frame");
+        return size + paramsSize;
+    }
+
+    return size;
+}
+
 }  // namespace
 
 uint8_t c2LevelToV4L2Level(C2Config::level_t level) {
@@ -78,6 +235,33 @@ uint8_t c2LevelToV4L2Level(C2Config::level_t level) {
         return V4L2_MPEG_VIDEO_H264_LEVEL_5_0;
     case C2Config::LEVEL_AVC_5_1:
         return V4L2_MPEG_VIDEO_H264_LEVEL_5_1;
+    // Only main tier HEVC levels are supported.
+    case C2Config::LEVEL_HEVC_MAIN_1:
+        return V4L2_MPEG_VIDEO_HEVC_LEVEL_1;
+    case C2Config::LEVEL_HEVC_MAIN_2:
+        return V4L2_MPEG_VIDEO_HEVC_LEVEL_2;
+    case C2Config::LEVEL_HEVC_MAIN_2_1:
+        return V4L2_MPEG_VIDEO_HEVC_LEVEL_2_1;
+    case C2Config::LEVEL_HEVC_MAIN_3:
+        return V4L2_MPEG_VIDEO_HEVC_LEVEL_3;
+    case C2Config::LEVEL_HEVC_MAIN_3_1:
+        return V4L2_MPEG_VIDEO_HEVC_LEVEL_3_1;
+    case C2Config::LEVEL_HEVC_MAIN_4:
+        return V4L2_MPEG_VIDEO_HEVC_LEVEL_4;
+    case C2Config::LEVEL_HEVC_MAIN_4_1:
+        return V4L2_MPEG_VIDEO_HEVC_LEVEL_4_1;
+    case C2Config::LEVEL_HEVC_MAIN_5:
+        return V4L2_MPEG_VIDEO_HEVC_LEVEL_5;
+    case C2Config::LEVEL_HEVC_MAIN_5_1:
+        return V4L2_MPEG_VIDEO_HEVC_LEVEL_5_1;
+    case C2Config::LEVEL_HEVC_MAIN_5_2:
+        return V4L2_MPEG_VIDEO_HEVC_LEVEL_5_2;
+    case C2Config::LEVEL_HEVC_MAIN_6:
+        return V4L2_MPEG_VIDEO_HEVC_LEVEL_6;
+    case C2Config::LEVEL_HEVC_MAIN_6_1:
+        return V4L2_MPEG_VIDEO_HEVC_LEVEL_6_1;
+    case C2Config::LEVEL_HEVC_MAIN_6_2:
+        return V4L2_MPEG_VIDEO_HEVC_LEVEL_6_2;
     default:
         ALOGE("Unrecognizable C2 level (value = 0x%x)...", level);
         return 0;
@@ -110,101 +294,130 @@ android_ycbcr getGraphicBlockInfo(const C2ConstGraphicBlock& block) {
     return ycbcr;
 }
 
-bool extractSPSPPS(const uint8_t* data, size_t length, std::vector<uint8_t>* sps,
-                   std::vector<uint8_t>* pps) {
-    bool foundSPS = false;
-    bool foundPPS = false;
-    NalParser parser(data, length);
-    while (!(foundSPS && foundPPS) && parser.locateNextNal()) {
-        switch (parser.type()) {
-        case NalParser::kSPSType:
-            sps->resize(parser.length());
-            memcpy(sps->data(), parser.data(), parser.length());
-            foundSPS = true;
-            break;
-        case NalParser::kPPSType:
-            pps->resize(parser.length());
-            memcpy(pps->data(), parser.data(), parser.length());
-            foundPPS = true;
-            break;
+// TODO(dstaessens): Clean up code extracting layout from a C2GraphicBlock.
+std::optional<VideoFramePlanes> getVideoFrameLayout(const C2ConstGraphicBlock& block,
+                                                    VideoPixelFormat* format) {
+    ALOGV("%s()", __func__);
+
+    // Get the C2PlanarLayout from the graphics block. The C2GraphicView returned by block.map()
+    // needs to be released before calling getGraphicBlockInfo(), or the lockYCbCr() call will block
+    // Indefinitely.
+    C2PlanarLayout layout = block.map().get().layout();
+
+    // The above layout() cannot fill layout information and memset 0 instead if the input format is
+    // IMPLEMENTATION_DEFINED and its backed format is RGB. We fill the layout by using
+    // ImplDefinedToRGBXMap in the case.
+    if (layout.type == C2PlanarLayout::TYPE_UNKNOWN) {
+        std::unique_ptr<ImplDefinedToRGBXMap> idMap = ImplDefinedToRGBXMap::Create(block);
+        if (idMap == nullptr) {
+            ALOGE("Unable to parse RGBX_8888 from IMPLEMENTATION_DEFINED");
+            return std::nullopt;
         }
+        layout.type = C2PlanarLayout::TYPE_RGB;
+        // These parameters would be used in TYPE_GRB case below.
+        layout.numPlanes = 3;   // same value as in C2AllocationGralloc::map()
+        layout.rootPlanes = 1;  // same value as in C2AllocationGralloc::map()
+        layout.planes[C2PlanarLayout::PLANE_R].offset = idMap->offset();
+        layout.planes[C2PlanarLayout::PLANE_R].rowInc = idMap->rowInc();
     }
-    return foundSPS && foundPPS;
-}
 
-bool extractCSDInfo(std::unique_ptr<C2StreamInitDataInfo::output>* const csd, const uint8_t* data,
-                    size_t length) {
-    csd->reset();
+    uint32_t offsets[C2PlanarLayout::MAX_NUM_PLANES] = {};
+    uint32_t strides[C2PlanarLayout::MAX_NUM_PLANES] = {};
+    switch (layout.type) {
+    case C2PlanarLayout::TYPE_YUV: {
+        android_ycbcr ycbcr = getGraphicBlockInfo(block);
+        offsets[C2PlanarLayout::PLANE_Y] =
+                static_cast<uint32_t>(reinterpret_cast<uintptr_t>(ycbcr.y));
+        offsets[C2PlanarLayout::PLANE_U] =
+                static_cast<uint32_t>(reinterpret_cast<uintptr_t>(ycbcr.cb));
+        offsets[C2PlanarLayout::PLANE_V] =
+                static_cast<uint32_t>(reinterpret_cast<uintptr_t>(ycbcr.cr));
+        strides[C2PlanarLayout::PLANE_Y] = static_cast<uint32_t>(ycbcr.ystride);
+        strides[C2PlanarLayout::PLANE_U] = static_cast<uint32_t>(ycbcr.cstride);
+        strides[C2PlanarLayout::PLANE_V] = static_cast<uint32_t>(ycbcr.cstride);
 
-    std::vector<uint8_t> sps;
-    std::vector<uint8_t> pps;
-    if (!extractSPSPPS(data, length, &sps, &pps)) {
-        return false;
+        bool crcb = false;
+        if (offsets[C2PlanarLayout::PLANE_U] > offsets[C2PlanarLayout::PLANE_V]) {
+            // Swap offsets, no need to swap strides as they are identical for both chroma planes.
+            std::swap(offsets[C2PlanarLayout::PLANE_U], offsets[C2PlanarLayout::PLANE_V]);
+            crcb = true;
+        }
+
+        bool semiplanar = false;
+        if (ycbcr.chroma_step >
+            offsets[C2PlanarLayout::PLANE_V] - offsets[C2PlanarLayout::PLANE_U]) {
+            semiplanar = true;
+        }
+
+        if (!crcb && !semiplanar) {
+            *format = VideoPixelFormat::I420;
+        } else if (!crcb && semiplanar) {
+            *format = VideoPixelFormat::NV12;
+        } else if (crcb && !semiplanar) {
+            // HACK: pretend YV12 is I420 now since VEA only accepts I420. (YV12 will be used
+            //       for input byte-buffer mode).
+            // TODO(dstaessens): Is this hack still necessary now we're not using the VEA directly?
+            //format = VideoPixelFormat::YV12;
+            *format = VideoPixelFormat::I420;
+        } else {
+            *format = VideoPixelFormat::NV21;
+        }
+        break;
+    }
+    case C2PlanarLayout::TYPE_RGB: {
+        offsets[C2PlanarLayout::PLANE_R] = layout.planes[C2PlanarLayout::PLANE_R].offset;
+        strides[C2PlanarLayout::PLANE_R] =
+                static_cast<uint32_t>(layout.planes[C2PlanarLayout::PLANE_R].rowInc);
+        *format = VideoPixelFormat::ARGB;
+        break;
+    }
+    default:
+        ALOGW("Unknown layout type: %u", static_cast<uint32_t>(layout.type));
+        return std::nullopt;
     }
 
-    size_t configDataLength = sps.size() + pps.size() + (2u * kH264StartCodeSize);
-    ALOGV("Extracted codec config data: length=%zu", configDataLength);
+    VideoFramePlanes planes;
+    for (uint32_t i = 0; i < layout.rootPlanes && i < C2PlanarLayout::MAX_NUM_PLANES; ++i) {
+        // The mSize field is not used in our case, so we can safely set it to zero.
+        planes.push_back({strides[i], offsets[i], 0});
+    }
+    return planes;
+}
 
-    *csd = C2StreamInitDataInfo::output::AllocUnique(configDataLength, 0u);
-    uint8_t* csdBuffer = (*csd)->m.value;
-    return copyNALUPrependingStartCode(sps.data(), sps.size(), &csdBuffer, &configDataLength) &&
-           copyNALUPrependingStartCode(pps.data(), pps.size(), &csdBuffer, &configDataLength);
+bool extractSPSPPS(const uint8_t* data, size_t length, std::vector<uint8_t>* sps,
+                   std::vector<uint8_t>* pps, bool stopAtFirstSlice) {
+    std::vector<uint8_t>* const paramSets[] = {sps, pps};
+    return extractParamSets<H264Syntax>(data, length, paramSets, stopAtFirstSlice);
 }
 
-size_t prependSPSPPSToIDR(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize,
-                          std::vector<uint8_t>* sps, std::vector<uint8_t>* pps) {
-    bool foundStreamParams = false;
-    size_t remainingDstSize = dstSize;
-    NalParser parser(src, srcSize);
-    while (parser.locateNextNal()) {
-        switch (parser.type()) {
-        case NalParser::kSPSType:
-            // SPS found, copy to cache.
-            ALOGV("Found SPS (length %zu)", parser.length());
-            sps->resize(parser.length());
-            memcpy(sps->data(), parser.data(), parser.length());
-            foundStreamParams = true;
-            break;
-        case NalParser::kPPSType:
-            // PPS found, copy to cache.
-            ALOGV("Found PPS (length %zu)", parser.length());
-            pps->resize(parser.length());
-            memcpy(pps->data(), parser.data(), parser.length());
-            foundStreamParams = true;
-            break;
-        case NalParser::kIDRType:
-            ALOGV("Found IDR (length %zu)", parser.length());
-            if (foundStreamParams) {
-                ALOGV("Not injecting SPS and PPS before IDR, already present");
-                break;
-            }
+bool extractHEVCParamSets(const uint8_t* data, size_t length, std::vector<uint8_t>* vps,
+                          std::vector<uint8_t>* sps, std::vector<uint8_t>* pps,
+                          bool stopAtFirstSlice) {
+    std::vector<uint8_t>* const paramSets[] = {vps, sps, pps};
+    return extractParamSets<HEVCSyntax>(data, length, paramSets, stopAtFirstSlice);
+}
 
-            // Prepend the cached SPS and PPS to the IDR NAL unit.
-            if (sps->empty() || pps->empty()) {
-                ALOGE("No cached SPS or PPS NAL unit available to inject before IDR");
-                return 0;
-            }
-            if (!copyNALUPrependingStartCode(sps->data(), sps->size(), &dst, &remainingDstSize)) {
-                ALOGE("Not enough space to inject SPS NAL unit before IDR");
-                return 0;
-            }
-            if (!copyNALUPrependingStartCode(pps->data(), pps->size(), &dst, &remainingDstSize)) {
-                ALOGE("Not enough space to inject PPS NAL unit before IDR");
-                return 0;
-            }
+bool extractCSDInfo(std::unique_ptr<C2StreamInitDataInfo::output>* const csd, const uint8_t* data,
+                    size_t length) {
+    return extractCSD<H264Syntax>(csd, data, length);
+}
 
-            ALOGV("Stream header injected before IDR");
-            break;
-        }
+bool extractHEVCCSDInfo(std::unique_ptr<C2StreamInitDataInfo::output>* const csd,
+                        const uint8_t* data, size_t length) {
+    return extractCSD<HEVCSyntax>(csd, data, length);
+}
 
-        // Copy the NAL unit to the new output buffer.
-        if (!copyNALUPrependingStartCode(parser.data(), parser.length(), &dst, &remainingDstSize)) {
-            ALOGE("NAL unit does not fit in the provided output buffer");
-            return 0;
-        }
-    }
+size_t insertSPSPPSBeforeIDR(uint8_t* buffer, size_t bufferSize, size_t* offset, size_t size,
+                             std::vector<uint8_t>* sps, std::vector<uint8_t>* pps) {
+    std::vector<uint8_t>* const paramSets[] = {sps, pps};
+    return insertParamSetsBeforeKeyFrame<H264Syntax>(buffer, bufferSize, offset, size, paramSets);
+}
 
-    return dstSize - remainingDstSize;
+size_t insertHEVCParamSetsBeforeIRAP(uint8_t* buffer, size_t bufferSize, size_t* offset,
+                                     size_t size, std::vector<uint8_t>* vps,
+                                     std::vector<uint8_t>* sps, std::vector<uint8_t>* pps) {
+    std::vector<uint8_t>* const paramSets[] = {vps, sps, pps};
+    return insertParamSetsBeforeKeyFrame<HEVCSyntax>(buffer, bufferSize, offset, size, paramSets);
 }
 
 }  // namespace android
@@ -4,22 +4,31 @@
 
 //#define LOG_NDEBUG 0
 #define LOG_TAG "FormatConverter"
+#define ATRACE_TAG ATRACE_TAG_VIDEO
 
 #include <v4l2_codec2/common/FormatConverter.h>
 
 #include <inttypes.h>
+#include <linux/dma-buf.h>
+#include <sys/ioctl.h>
 
+#include <algorithm>
 #include <memory>
+#include <optional>
 #include <string>
+#include <vector>
 
 #include <C2AllocatorGralloc.h>
 #include <C2PlatformSupport.h>
 #include <android/hardware/graphics/common/1.0/types.h>
+#include <base/posix/eintr_wrapper.h>
 #include <inttypes.h>
 #include <libyuv.h>
 #include <ui/GraphicBuffer.h>
 #include <utils/Log.h>
+#include <utils/Trace.h>
 
+#include <v4l2_codec2/common/SwapUVPlane.h>
 #include <v4l2_codec2/common/VideoTypes.h>  // for HalPixelFormat
 
 using android::hardware::graphics::common::V1_0::BufferUsage;
@@ -34,22 +43,134 @@ constexpr int convertMap(VideoPixelFormat src, VideoPixelFormat dst) {
            static_cast<int>(dst);
 }
 
-// The helper function to copy a plane pixel by pixel. It assumes bytesPerPixel is 1.
-void copyPlaneByPixel(const uint8_t* src, int srcStride, int srcColInc, uint8_t* dst, int dstStride,
-                      int dstColInc, int width, int height) {
-    for (int row = 0; row < height; row++) {
-        const uint8_t* srcRow = src;
-        uint8_t* dstRow = dst;
-        for (int col = 0; col < width; col++) {
-            memcpy(dstRow, srcRow, 1);
-            srcRow += srcColInc;
-            dstRow += dstColInc;
-        }
-        src += srcStride;
-        dst += dstStride;
+// Get the layout of the |size| area of |view|, with the planes sorted by offset relative to the
+// first plane, assuming all the planes are stored in the first buffer of the block. |idMap| is only
+// set for RGB-backed IMPLEMENTATION_DEFINED blocks. Returns nullopt if the layout isn't supported.
+std::optional<VideoFrameLayout> getFrameLayout(const C2GraphicView& view,
+                                               const C2PlanarLayout& layout,
+                                               const ImplDefinedToRGBXMap* idMap,
+                                               const ui::Size& size) {
+    VideoFrameLayout frameLayout;
+    frameLayout.mCodedSize = size;
+
+    if (layout.type == C2PlanarLayout::TYPE_RGB) {
+        frameLayout.mFormat = VideoPixelFormat::ABGR;
+        const int stride = idMap ? idMap->rowInc() : layout.planes[C2PlanarLayout::PLANE_R].rowInc;
+        frameLayout.mPlanes.push_back({static_cast<uint32_t>(stride), 0u, 0u});
+        return frameLayout;
+    }
+    if (layout.type != C2PlanarLayout::TYPE_YUV) {
+        return std::nullopt;
     }
+
+    const uint8_t* y = view.data()[C2PlanarLayout::PLANE_Y];
+    const uint8_t* u = view.data()[C2PlanarLayout::PLANE_U];
+    const uint8_t* v = view.data()[C2PlanarLayout::PLANE_V];
+    if (u < y || v < y) {
+        return std::nullopt;
+    }
+    const uint32_t strideY = layout.planes[C2PlanarLayout::PLANE_Y].rowInc;
+    const uint32_t strideUV = layout.planes[C2PlanarLayout::PLANE_U].rowInc;
+    frameLayout.mPlanes.push_back({strideY, 0u, 0u});
+    if (layout.rootPlanes == 3) {
+        frameLayout.mFormat = (u < v) ? VideoPixelFormat::I420 : VideoPixelFormat::YV12;
+        frameLayout.mPlanes.push_back({strideUV, static_cast<size_t>(std::min(u, v) - y), 0u});
+        frameLayout.mPlanes.push_back({strideUV, static_cast<size_t>(std::max(u, v) - y), 0u});
+    } else if (layout.rootPlanes == 2 && u < v) {
+        frameLayout.mFormat = VideoPixelFormat::NV12;
+        frameLayout.mPlanes.push_back({strideUV, static_cast<size_t>(u - y), 0u});
+    } else {
+        return std::nullopt;
+    }
+    return frameLayout;
+}
+
+// The number of rows convertABGRToNV12() converts to I420 at a time.
+constexpr int kABGRToNV12RowsPerChunk = 16;
+
+// The size of the scratch buffer convertABGRToNV12() needs for |width| wide frames, zero if libyuv
+// converts ABGR to NV12 directly.
+size_t abgrToNV12ScratchSize(int width) {
+#if LIBYUV_VERSION >= 1780
+    (void)width;
+    return 0;
+#else
+    return static_cast<size_t>((width + 1) / 2) * kABGRToNV12RowsPerChunk;
+#endif
 }
 
+// Convert ABGR to NV12 in a single pass over the source, writing the interleaved UV plane straight
+// into |dstUV|. |scratch| holds abgrToNV12ScratchSize(width) bytes.
+void convertABGRToNV12(const uint8_t* srcABGR, int srcStrideABGR, uint8_t* dstY, int dstStrideY,
+                       uint8_t* dstUV, int dstStrideUV, int width, int height, uint8_t* scratch) {
+#if LIBYUV_VERSION >= 1780
+    (void)scratch;
+    libyuv::ABGRToNV12(srcABGR, srcStrideABGR, dstY, dstStrideY, dstUV, dstStrideUV, width, height);
+#else
+    // This libyuv doesn't provide ABGRToNV12. Convert a few rows at a time to I420 into a small
+    // scratch buffer that stays in cache, then interleave its U and V rows into |dstUV|.
+    constexpr int kRowsPerChunk = kABGRToNV12RowsPerChunk;
+    const int halfWidth = (width + 1) / 2;
+    uint8_t* tempU = scratch;
+    uint8_t* tempV = scratch + halfWidth * kRowsPerChunk / 2;
+    for (int row = 0; row < height; row += kRowsPerChunk) {
+        const int rows = std::min(kRowsPerChunk, height - row);
+        libyuv::ABGRToI420(srcABGR + row * srcStrideABGR, srcStrideABGR, dstY + row * dstStrideY,
+                           dstStrideY, tempU, halfWidth, tempV, halfWidth, width, rows);
+        libyuv::MergeUVPlane(tempU, halfWidth, tempV, halfWidth, dstUV + row / 2 * dstStrideUV,
+                             dstStrideUV, halfWidth, (rows + 1) / 2);
+    }
+#endif
+}
+
+// Scale the |srcSize| 4:2:0 frame stored as |format| into the |dstSize| frame stored in the same
+// format. The chroma planes of NV12 and NV21 frames are passed as |srcU| and |dstU|, whichever
+// chroma sample comes first.
+void scaleYUVFrame(VideoPixelFormat format, const uint8_t* srcY, int srcStrideY,
+                   const uint8_t* srcU, int srcStrideU, const uint8_t* srcV, int srcStrideV,
+                   const ui::Size& srcSize, uint8_t* dstY, int dstStrideY, uint8_t* dstU,
+                   int dstStrideU, uint8_t* dstV, int dstStrideV, const ui::Size& dstSize) {
+    // The box filter averages all the source pixels covered by a destination pixel, which avoids
+    // aliasing on the large downscaling factors used by simulcast.
+    if (format == VideoPixelFormat::NV12 || format == VideoPixelFormat::NV21) {
+        libyuv::NV12Scale(srcY, srcStrideY, srcU, srcStrideU, srcSize.width, srcSize.height, dstY,
+                          dstStrideY, dstU, dstStrideU, dstSize.width, dstSize.height,
+                          libyuv::kFilterBox);
+    } else {
+        libyuv::I420Scale(srcY, srcStrideY, srcU, srcStrideU, srcV, srcStrideV, srcSize.width,
+                          srcSize.height, dstY, dstStrideY, dstU, dstStrideU, dstV, dstStrideV,
+                          dstSize.width, dstSize.height, libyuv::kFilterBox);
+    }
+}
+
+// The time to wait for the producer of an input block to finish writing it.
+constexpr c2_nsecs_t kInputFenceTimeoutNs = 1000000000;  // 1 second
+
+// Brackets the CPU reads of the dmabufs of a block with DMA_BUF_IOCTL_SYNC. A cached mapping isn't
+// locked again for each frame, so this is what makes the pixels written since the block was mapped
+// visible to the CPU.
+class ScopedDmabufReadAccess {
+public:
+    explicit ScopedDmabufReadAccess(const C2Handle* handle) : mHandle(handle) {
+        sync(DMA_BUF_SYNC_START);
+    }
+    ~ScopedDmabufReadAccess() { sync(DMA_BUF_SYNC_END); }
+
+private:
+    void sync(uint64_t flags) {
+        for (int i = 0; i < mHandle->numFds; i++) {
+            struct dma_buf_sync sync = {};
+            sync.flags = flags | DMA_BUF_SYNC_READ;
+            // The fds of the handle which aren't dmabufs, e.g. for metadata, reject the ioctl.
+            if (HANDLE_EINTR(ioctl(mHandle->data[i], DMA_BUF_IOCTL_SYNC, &sync)) != 0) {
+                ALOGV("Failed to sync fd %d of the input block", mHandle->data[i]);
+            }
+        }
+    }
+
+    const C2Handle* const mHandle;
+};
+
 }  // namespace
 
 ImplDefinedToRGBXMap::ImplDefinedToRGBXMap(sp<GraphicBuffer> buf, uint8_t* addr, int rowInc)
@@ -95,14 +216,17 @@ std::unique_ptr<ImplDefinedToRGBXMap> ImplDefinedToRGBXMap::Create(
 std::unique_ptr<FormatConverter> FormatConverter::Create(VideoPixelFormat outFormat,
                                                          const ui::Size& visibleSize,
                                                          uint32_t inputCount,
-                                                         const ui::Size& codedSize) {
+                                                         const ui::Size& codedSize,
+                                                         size_t maxConversionThreads,
+                                                         bool scaleInput) {
     if (outFormat != VideoPixelFormat::I420 && outFormat != VideoPixelFormat::NV12) {
         ALOGE("Unsupported output format: %d", static_cast<int32_t>(outFormat));
         return nullptr;
     }
 
     std::unique_ptr<FormatConverter> converter(new FormatConverter);
-    if (converter->initialize(outFormat, visibleSize, inputCount, codedSize) != C2_OK) {
+    if (converter->initialize(outFormat, visibleSize, inputCount, codedSize, maxConversionThreads,
+                              scaleInput) != C2_OK) {
         ALOGE("Failed to initialize FormatConverter");
         return nullptr;
     }
@@ -110,13 +234,14 @@ std::unique_ptr<FormatConverter> FormatConverter::Create(VideoPixelFormat outFor
 }
 
 c2_status_t FormatConverter::initialize(VideoPixelFormat outFormat, const ui::Size& visibleSize,
-                                        uint32_t inputCount, const ui::Size& codedSize) {
-    ALOGV("initialize(out_format=%s, visible_size=%dx%d, input_count=%u, coded_size=%dx%d)",
+                                        uint32_t inputCount, const ui::Size& codedSize,
+                                        size_t maxConversionThreads, bool scaleInput) {
+    ALOGV("initialize(out_format=%s, visible_size=%dx%d, input_count=%u, coded_size=%dx%d, "
+          "max_conversion_threads=%zu, scale_input=%d)",
           videoPixelFormatToString(outFormat).c_str(), visibleSize.width, visibleSize.height,
-          inputCount, codedSize.width, codedSize.height);
+          inputCount, codedSize.width, codedSize.height, maxConversionThreads, scaleInput);
 
-    std::shared_ptr<C2BlockPool> pool;
-    c2_status_t status = GetCodec2BlockPool(C2BlockPool::BASIC_GRAPHIC, nullptr, &pool);
+    c2_status_t status = GetCodec2BlockPool(C2BlockPool::BASIC_GRAPHIC, nullptr, &mPool);
     if (status != C2_OK) {
         ALOGE("Failed to get basic graphic block pool (err=%d)", status);
         return status;
@@ -131,36 +256,166 @@ c2_status_t FormatConverter::initialize(VideoPixelFormat outFormat, const ui::Si
         halFormat = HalPixelFormat::YCBCR_420_888;  // will allocate NV12 by minigbm.
     }
 
-    uint32_t bufferCount = std::max(inputCount, kMinInputBufferCount);
-    for (uint32_t i = 0; i < bufferCount; i++) {
+    mHalFormat = static_cast<uint32_t>(halFormat);
+    mCodedSize = codedSize;
+    status = allocateBlocks(std::max(inputCount, kMinInputBufferCount));
+    if (status != C2_OK) return status;
+
+    mOutFormat = outFormat;
+    mVisibleSize = visibleSize;
+    mBackend = createConversionBackend(outFormat);
+
+    // Choose the number of stripes from the visible area, so small frames are still converted
+    // inline. The calling thread converts one of the stripes itself.
+    const size_t wantedStripes = std::min(
+            static_cast<size_t>(mVisibleSize.width * mVisibleSize.height / kMinPixelsPerStripe),
+            static_cast<size_t>(mVisibleSize.height / 2));
+    if (maxConversionThreads > 0 && wantedStripes > 1) {
+        mWorkerPool = WorkerPool::Create(std::min(wantedStripes - 1, maxConversionThreads),
+                                         "V4L2Convert");
+    }
+    mNumStripes = mWorkerPool ? mWorkerPool->numThreads() + 1 : 1;
+    ALOGV("Converting %dx%d frames in %zu stripes", mVisibleSize.width, mVisibleSize.height,
+          mNumStripes);
+
+    // The scale buffer is large enough for an ABGR frame, with even dimensions so the chroma
+    // planes of 4:2:0 frames are laid out like in the output blocks.
+    mScaleInput = scaleInput;
+    if (mScaleInput) {
+        const size_t alignedWidth = (mVisibleSize.width + 1) & ~1;
+        const size_t alignedHeight = (mVisibleSize.height + 1) & ~1;
+        mScaleBuffer.resize(alignedWidth * alignedHeight * 4);
+    }
+
+    // Each stripe gets its own part of the ABGR to NV12 scratch buffer, as stripes are converted
+    // concurrently.
+    if (mOutFormat == VideoPixelFormat::NV12) {
+        mABGRToNV12Scratch.resize(abgrToNV12ScratchSize(mVisibleSize.width) * mNumStripes);
+    }
+
+    return C2_OK;
+}
+
+c2_status_t FormatConverter::growBlockPool(uint32_t inputCount) {
+    if (inputCount <= mNumBlocks) return C2_OK;
+
+    ALOGV("Growing the conversion block pool from %u to %u blocks", mNumBlocks, inputCount);
+    return allocateBlocks(inputCount - mNumBlocks);
+}
+
+c2_status_t FormatConverter::allocateBlocks(uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
         std::shared_ptr<C2GraphicBlock> block;
-        status = pool->fetchGraphicBlock(codedSize.width, codedSize.height,
-                                         static_cast<uint32_t>(halFormat),
-                                         {(C2MemoryUsage::CPU_READ | C2MemoryUsage::CPU_WRITE),
-                                          static_cast<uint64_t>(BufferUsage::VIDEO_ENCODER)},
-                                         &block);
+        c2_status_t status = mPool->fetchGraphicBlock(
+                mCodedSize.width, mCodedSize.height, mHalFormat,
+                {(C2MemoryUsage::CPU_READ | C2MemoryUsage::CPU_WRITE),
+                 static_cast<uint64_t>(BufferUsage::VIDEO_ENCODER)},
+                &block);
         if (status != C2_OK) {
             ALOGE("Failed to fetch graphic block (err=%d)", status);
             return status;
         }
-        mGraphicBlocks.emplace_back(new BlockEntry(std::move(block)));
+        auto view = std::make_unique<C2GraphicView>(block->map().get());
+        if (view->error() != C2_OK) {
+            ALOGE("Failed to map graphic block (err=%d)", view->error());
+            return view->error();
+        }
+        mGraphicBlocks.emplace_back(new BlockEntry(std::move(block), std::move(view)));
         mAvailableQueue.push(mGraphicBlocks.back().get());
+        mNumBlocks++;
     }
+    return C2_OK;
+}
 
-    mOutFormat = outFormat;
-    mVisibleSize = visibleSize;
+void FormatConverter::convertStripes(const std::function<void(int top, int height)>& convertRows) {
+    if (mNumStripes <= 1) {
+        convertRows(0, mVisibleSize.height);
+        return;
+    }
 
-    mTempPlaneU =
-            std::unique_ptr<uint8_t[]>(new uint8_t[mVisibleSize.width * mVisibleSize.height / 4]);
-    mTempPlaneV =
-            std::unique_ptr<uint8_t[]>(new uint8_t[mVisibleSize.width * mVisibleSize.height / 4]);
+    const int height = stripeHeight();
+    mWorkerPool->parallelFor(mNumStripes, [&](size_t index) {
+        const int top = static_cast<int>(index) * height;
+        if (top >= mVisibleSize.height) return;
+        convertRows(top, std::min(height, mVisibleSize.height - top));
+    });
+}
 
-    return C2_OK;
+int FormatConverter::stripeHeight() const {
+    // Keep the stripe height even so each stripe starts at a chroma row boundary of 4:2:0 formats.
+    return ((mVisibleSize.height + static_cast<int>(mNumStripes) - 1) / mNumStripes + 1) & ~1;
+}
+
+bool FormatConverter::convertWithBackend(const C2ConstGraphicBlock& inputBlock,
+                                         const C2GraphicView& inputView,
+                                         const C2PlanarLayout& inputLayout,
+                                         const ImplDefinedToRGBXMap* idMap,
+                                         const BlockEntry& entry) {
+    std::optional<VideoFrameLayout> inputFrameLayout =
+            getFrameLayout(inputView, inputLayout, idMap, mVisibleSize);
+    // Frames already in the output format are zero-copied by the software path.
+    if (!inputFrameLayout || inputFrameLayout->mFormat == mOutFormat) {
+        return false;
+    }
+
+    const C2GraphicView& outputView = *entry.mView;
+    std::optional<VideoFrameLayout> outputFrameLayout =
+            getFrameLayout(outputView, outputView.layout(), nullptr,
+                           ui::Size(entry.mBlock->width(), entry.mBlock->height()));
+    if (!outputFrameLayout || outputFrameLayout->mPlanes.size() != numPlanes(mOutFormat)) {
+        return false;
+    }
+    // I420 is allocated as YV12 and the chroma planes are swapped, see initialize().
+    outputFrameLayout->mFormat = mOutFormat;
+
+    if (!mBackend->convert(inputBlock.handle()->data[0], *inputFrameLayout,
+                           entry.mBlock->handle()->data[0], *outputFrameLayout)) {
+        ALOGW("Conversion backend failed to convert %s frame, falling back to libyuv",
+              videoPixelFormatToString(inputFrameLayout->mFormat).c_str());
+        mBackend.reset();
+        return false;
+    }
+    return true;
+}
+
+std::shared_ptr<const C2GraphicView> FormatConverter::mapInputBlock(
+        const C2ConstGraphicBlock& block) {
+    const std::optional<unique_id_t> id = getDmabufId(block.handle()->data[0]);
+    const C2Rect crop = block.crop();
+    if (id) {
+        auto it = std::find_if(mInputMappings.begin(), mInputMappings.end(),
+                               [&](const InputMapping& mapping) { return mapping.mId == *id; });
+        if (it != mInputMappings.end()) {
+            if (it->mCrop == crop) {
+                mInputMappings.splice(mInputMappings.begin(), mInputMappings, it);
+                return it->mView;
+            }
+            mInputMappings.erase(it);
+        }
+    }
+
+    auto view = std::make_shared<const C2GraphicView>(block.map().get());
+    // A failed mapping, e.g. of an RGB-backed IMPLEMENTATION_DEFINED block, is not cached.
+    if (!id || view->error() != C2_OK || view->layout().type == C2PlanarLayout::TYPE_UNKNOWN) {
+        return view;
+    }
+
+    ALOGV("%s(): Caching mapping of dmabuf %u", __func__, *id);
+    mInputMappings.push_front({*id, crop, view});
+    if (mInputMappings.size() > kMaxInputMappings) {
+        mInputMappings.pop_back();
+    }
+    return view;
 }
 
 C2ConstGraphicBlock FormatConverter::convertBlock(uint64_t frameIndex,
                                                   const C2ConstGraphicBlock& inputBlock,
                                                   c2_status_t* status) {
+    // The slice is named after the frame only while tracing, to keep the formatting cost off.
+    const std::string traceName =
+            ATRACE_ENABLED() ? "convertBlock #" + std::to_string(frameIndex) : std::string();
+    ATRACE_NAME(traceName.c_str());
+
     if (!isReady()) {
         ALOGV("There is no available block for conversion");
         *status = C2_NO_MEMORY;
@@ -170,14 +425,24 @@ C2ConstGraphicBlock FormatConverter::convertBlock(uint64_t frameIndex,
     BlockEntry* entry = mAvailableQueue.front();
     std::shared_ptr<C2GraphicBlock> outputBlock = entry->mBlock;
 
-    const C2GraphicView& inputView = inputBlock.map().get();
+    // The block is only mapped once while its mapping is cached, so the fence of each frame is
+    // waited for and the reads are synced here rather than by the lock of the mapping.
+    const c2_status_t fenceStatus = inputBlock.fence().wait(kInputFenceTimeoutNs);
+    if (fenceStatus != C2_OK) {
+        ALOGE("Failed to wait for the fence of the input block (err=%d)", fenceStatus);
+        *status = fenceStatus;
+        return inputBlock;  // This is actually redundant and should not be used.
+    }
+    std::shared_ptr<const C2GraphicView> inputMapping = mapInputBlock(inputBlock);
+    const ScopedDmabufReadAccess inputAccess(inputBlock.handle());
+    const C2GraphicView& inputView = *inputMapping;
     C2PlanarLayout inputLayout = inputView.layout();
 
     // The above layout() cannot fill layout information and memset 0 instead if the input format is
     // IMPLEMENTATION_DEFINED and its backed format is RGB. We fill the layout by using
     // ImplDefinedToRGBXMap in the case.
     std::unique_ptr<ImplDefinedToRGBXMap> idMap;
-    if (static_cast<uint32_t>(inputLayout.type) == 0u) {
+    if (inputLayout.type == C2PlanarLayout::TYPE_UNKNOWN) {
         idMap = ImplDefinedToRGBXMap::Create(inputBlock);
         if (idMap == nullptr) {
             ALOGE("Unable to parse RGBX_8888 from IMPLEMENTATION_DEFINED");
@@ -187,7 +452,22 @@ C2ConstGraphicBlock FormatConverter::convertBlock(uint64_t frameIndex,
         inputLayout.type = C2PlanarLayout::TYPE_RGB;
     }
 
-    C2GraphicView outputView = outputBlock->map().get();
+    // Frames of another size than the visible size are scaled in software, either into the output
+    // block when it has the layout of the input frame, or into |mScaleBuffer| before conversion.
+    const C2Rect crop = inputBlock.crop();
+    const ui::Size inputSize(crop.width, crop.height);
+    const bool scale = mScaleInput && inputSize != mVisibleSize;
+    const int scaleStride = (mVisibleSize.width + 1) & ~1;
+
+    if (mBackend && !scale &&
+        convertWithBackend(inputBlock, inputView, inputLayout, idMap.get(), *entry)) {
+        ALOGV("convertBlock(frame_index=%" PRIu64 ") by conversion backend", frameIndex);
+        entry->mAssociatedFrameIndex = frameIndex;
+        mAvailableQueue.pop();
+        return outputBlock->share(C2Rect(mVisibleSize.width, mVisibleSize.height), C2Fence());
+    }
+
+    C2GraphicView& outputView = *entry->mView;
     C2PlanarLayout outputLayout = outputView.layout();
     uint8_t* dstY = outputView.data()[C2PlanarLayout::PLANE_Y];
     uint8_t* dstU = outputView.data()[C2PlanarLayout::PLANE_V];   // only for I420
@@ -204,50 +484,125 @@ C2ConstGraphicBlock FormatConverter::convertBlock(uint64_t frameIndex,
         const uint8_t* srcY = inputView.data()[C2PlanarLayout::PLANE_Y];
         const uint8_t* srcU = inputView.data()[C2PlanarLayout::PLANE_U];
         const uint8_t* srcV = inputView.data()[C2PlanarLayout::PLANE_V];
-        const int srcStrideY = inputLayout.planes[C2PlanarLayout::PLANE_Y].rowInc;
-        const int srcStrideU = inputLayout.planes[C2PlanarLayout::PLANE_U].rowInc;
-        const int srcStrideV = inputLayout.planes[C2PlanarLayout::PLANE_V].rowInc;
+        int srcStrideY = inputLayout.planes[C2PlanarLayout::PLANE_Y].rowInc;
+        int srcStrideU = inputLayout.planes[C2PlanarLayout::PLANE_U].rowInc;
+        int srcStrideV = inputLayout.planes[C2PlanarLayout::PLANE_V].rowInc;
         if (inputLayout.rootPlanes == 3) {
             inputFormat = VideoPixelFormat::YV12;
         } else if (inputLayout.rootPlanes == 2) {
             inputFormat = (srcV > srcU) ? VideoPixelFormat::NV12 : VideoPixelFormat::NV21;
         }
 
-        if (inputFormat == mOutFormat) {
+        if (scale && (inputFormat == mOutFormat || (inputFormat == VideoPixelFormat::YV12 &&
+                                                    mOutFormat == VideoPixelFormat::I420))) {
+            const bool isNV12 = mOutFormat == VideoPixelFormat::NV12;
+            scaleYUVFrame(inputFormat, srcY, srcStrideY, srcU, srcStrideU, srcV, srcStrideV,
+                          inputSize, dstY, dstStrideY, isNV12 ? dstUV : dstU,
+                          isNV12 ? dstStrideUV : dstStrideU, dstV, dstStrideV, mVisibleSize);
+            ALOGV("convertBlock(frame_index=%" PRIu64 ", format=%s) scaled from %dx%d",
+                  frameIndex, videoPixelFormatToString(inputFormat).c_str(), inputSize.width,
+                  inputSize.height);
+            entry->mAssociatedFrameIndex = frameIndex;
+            mAvailableQueue.pop();
+            return outputBlock->share(C2Rect(mVisibleSize.width, mVisibleSize.height), C2Fence());
+        }
+        if (scale && inputFormat != VideoPixelFormat::UNKNOWN) {
+            uint8_t* scaledY = mScaleBuffer.data();
+            uint8_t* scaledChroma = scaledY + scaleStride * ((mVisibleSize.height + 1) & ~1);
+            if (inputFormat == VideoPixelFormat::YV12) {
+                uint8_t* scaledU = scaledChroma;
+                uint8_t* scaledV = scaledU + scaleStride / 2 * ((mVisibleSize.height + 1) / 2);
+                scaleYUVFrame(inputFormat, srcY, srcStrideY, srcU, srcStrideU, srcV, srcStrideV,
+                              inputSize, scaledY, scaleStride, scaledU, scaleStride / 2, scaledV,
+                              scaleStride / 2, mVisibleSize);
+                srcU = scaledU;
+                srcV = scaledV;
+                srcStrideU = srcStrideV = scaleStride / 2;
+            } else {
+                // The interleaved chroma plane of NV21 starts at the V sample.
+                const bool isNV12 = inputFormat == VideoPixelFormat::NV12;
+                scaleYUVFrame(inputFormat, srcY, srcStrideY, isNV12 ? srcU : srcV, srcStrideU,
+                              nullptr, 0, inputSize, scaledY, scaleStride, scaledChroma,
+                              scaleStride, nullptr, 0, mVisibleSize);
+                srcU = isNV12 ? scaledChroma : scaledChroma + 1;
+                srcV = isNV12 ? scaledChroma + 1 : scaledChroma;
+                srcStrideU = srcStrideV = scaleStride;
+            }
+            srcY = scaledY;
+            srcStrideY = scaleStride;
+        }
+
+        // The device reads the frames with the strides of the output blocks, so the frames of
+        // other producers might have to be copied even if they have the output format.
+        const bool sameStrides =
+                srcStrideY == dstStrideY &&
+                (inputLayout.rootPlanes != 2 || srcStrideU == dstStrideUV);
+        if (!scale && inputFormat == mOutFormat && sameStrides) {
             ALOGV("Zero-Copy is applied");
             mGraphicBlocks.emplace_back(new BlockEntry(frameIndex));
             return inputBlock;
         }
 
+        // Each conversion below converts the visible rows [top, top + h). The chroma planes are
+        // vertically subsampled, so their rows start at |top| / 2.
+        const int width = mVisibleSize.width;
         switch (convertMap(inputFormat, mOutFormat)) {
         case convertMap(VideoPixelFormat::YV12, VideoPixelFormat::I420):
-            libyuv::I420Copy(srcY, srcStrideY, srcU, srcStrideU, srcV, srcStrideV, dstY, dstStrideY,
-                             dstU, dstStrideU, dstV, dstStrideV, mVisibleSize.width,
-                             mVisibleSize.height);
+            convertStripes([&](int top, int h) {
+                libyuv::I420Copy(srcY + top * srcStrideY, srcStrideY,
+                                 srcU + top / 2 * srcStrideU, srcStrideU,
+                                 srcV + top / 2 * srcStrideV, srcStrideV,
+                                 dstY + top * dstStrideY, dstStrideY,
+                                 dstU + top / 2 * dstStrideU, dstStrideU,
+                                 dstV + top / 2 * dstStrideV, dstStrideV, width, h);
+            });
             break;
         case convertMap(VideoPixelFormat::YV12, VideoPixelFormat::NV12):
-            libyuv::I420ToNV12(srcY, srcStrideY, srcU, srcStrideU, srcV, srcStrideV, dstY,
-                               dstStrideY, dstUV, dstStrideUV, mVisibleSize.width,
-                               mVisibleSize.height);
+            convertStripes([&](int top, int h) {
+                libyuv::I420ToNV12(srcY + top * srcStrideY, srcStrideY,
+                                   srcU + top / 2 * srcStrideU, srcStrideU,
+                                   srcV + top / 2 * srcStrideV, srcStrideV,
+                                   dstY + top * dstStrideY, dstStrideY,
+                                   dstUV + top / 2 * dstStrideUV, dstStrideUV, width, h);
+            });
             break;
         case convertMap(VideoPixelFormat::NV12, VideoPixelFormat::I420):
-            libyuv::NV12ToI420(srcY, srcStrideY, srcU, srcStrideU, dstY, dstStrideY, dstU,
-                               dstStrideU, dstV, dstStrideV, mVisibleSize.width,
-                               mVisibleSize.height);
+            convertStripes([&](int top, int h) {
+                libyuv::NV12ToI420(srcY + top * srcStrideY, srcStrideY,
+                                   srcU + top / 2 * srcStrideU, srcStrideU,
+                                   dstY + top * dstStrideY, dstStrideY,
+                                   dstU + top / 2 * dstStrideU, dstStrideU,
+                                   dstV + top / 2 * dstStrideV, dstStrideV, width, h);
+            });
             break;
         case convertMap(VideoPixelFormat::NV21, VideoPixelFormat::I420):
-            libyuv::NV21ToI420(srcY, srcStrideY, srcV, srcStrideV, dstY, dstStrideY, dstU,
-                               dstStrideU, dstV, dstStrideV, mVisibleSize.width,
-                               mVisibleSize.height);
+            convertStripes([&](int top, int h) {
+                libyuv::NV21ToI420(srcY + top * srcStrideY, srcStrideY,
+                                   srcV + top / 2 * srcStrideV, srcStrideV,
+                                   dstY + top * dstStrideY, dstStrideY,
+                                   dstU + top / 2 * dstStrideU, dstStrideU,
+                                   dstV + top / 2 * dstStrideV, dstStrideV, width, h);
+            });
+            break;
+        case convertMap(VideoPixelFormat::NV12, VideoPixelFormat::NV12):
+            convertStripes([&](int top, int h) {
+                libyuv::CopyPlane(srcY + top * srcStrideY, srcStrideY, dstY + top * dstStrideY,
+                                  dstStrideY, width, h);
+                // The interleaved UV rows are as long as the luma rows, rounded up to a UV pair.
+                libyuv::CopyPlane(srcU + top / 2 * srcStrideU, srcStrideU,
+                                  dstUV + top / 2 * dstStrideUV, dstStrideUV, (width + 1) & ~1,
+                                  (h + 1) / 2);
+            });
             break;
         case convertMap(VideoPixelFormat::NV21, VideoPixelFormat::NV12):
             ALOGV("%s(): Converting PIXEL_FORMAT_NV21 -> PIXEL_FORMAT_NV12", __func__);
-            libyuv::CopyPlane(srcY, srcStrideY, dstY, dstStrideY, mVisibleSize.width,
-                              mVisibleSize.height);
-            copyPlaneByPixel(srcU, srcStrideU, 2, dstUV, dstStrideUV, 2, mVisibleSize.width / 2,
-                             mVisibleSize.height / 2);
-            copyPlaneByPixel(srcV, srcStrideV, 2, dstUV + 1, dstStrideUV, 2, mVisibleSize.width / 2,
-                             mVisibleSize.height / 2);
+            convertStripes([&](int top, int h) {
+                libyuv::CopyPlane(srcY + top * srcStrideY, srcStrideY, dstY + top * dstStrideY,
+                                  dstStrideY, width, h);
+                // The VU plane of NV21 starts at the V sample.
+                swapUVPlane(srcV + top / 2 * srcStrideV, srcStrideV,
+                            dstUV + top / 2 * dstStrideUV, dstStrideUV, width / 2, (h + 1) / 2);
+            });
             break;
         default:
             ALOGE("Unsupported pixel format conversion from %s to %s",
@@ -262,25 +617,35 @@ C2ConstGraphicBlock FormatConverter::convertBlock(uint64_t frameIndex,
         inputFormat = VideoPixelFormat::ABGR;
 
         const uint8_t* srcRGB = (idMap) ? idMap->addr() : inputView.data()[C2PlanarLayout::PLANE_R];
-        const int srcStrideRGB =
+        int srcStrideRGB =
                 (idMap) ? idMap->rowInc() : inputLayout.planes[C2PlanarLayout::PLANE_R].rowInc;
+        if (scale) {
+            libyuv::ARGBScale(srcRGB, srcStrideRGB, inputSize.width, inputSize.height,
+                              mScaleBuffer.data(), scaleStride * 4, mVisibleSize.width,
+                              mVisibleSize.height, libyuv::kFilterBox);
+            srcRGB = mScaleBuffer.data();
+            srcStrideRGB = scaleStride * 4;
+        }
 
+        const int width = mVisibleSize.width;
         switch (convertMap(inputFormat, mOutFormat)) {
         case convertMap(VideoPixelFormat::ABGR, VideoPixelFormat::I420):
-            libyuv::ABGRToI420(srcRGB, srcStrideRGB, dstY, dstStrideY, dstU, dstStrideU, dstV,
-                               dstStrideV, mVisibleSize.width, mVisibleSize.height);
+            convertStripes([&](int top, int h) {
+                libyuv::ABGRToI420(srcRGB + top * srcStrideRGB, srcStrideRGB,
+                                   dstY + top * dstStrideY, dstStrideY,
+                                   dstU + top / 2 * dstStrideU, dstStrideU,
+                                   dstV + top / 2 * dstStrideV, dstStrideV, width, h);
+            });
             break;
         case convertMap(VideoPixelFormat::ABGR, VideoPixelFormat::NV12): {
-            // There is no libyuv function to convert ABGR to NV12. Therefore, we first convert to
-            // I420 on dst-Y plane and temporary U/V plane. Then we copy U and V pixels from
-            // temporary planes to dst-UV interleavedly.
-            const int tempStride = mVisibleSize.width / 2;
-            libyuv::ABGRToI420(srcRGB, srcStrideRGB, dstY, dstStrideY, mTempPlaneU.get(),
-                               tempStride, mTempPlaneV.get(), tempStride, mVisibleSize.width,
-                               mVisibleSize.height);
-            libyuv::MergeUVPlane(mTempPlaneU.get(), tempStride, mTempPlaneV.get(), tempStride,
-                                 dstUV, dstStrideUV, mVisibleSize.width / 2,
-                                 mVisibleSize.height / 2);
+            const size_t scratchSize = abgrToNV12ScratchSize(width);
+            const int height = stripeHeight();
+            convertStripes([&](int top, int h) {
+                uint8_t* scratch = mABGRToNV12Scratch.data() + top / height * scratchSize;
+                convertABGRToNV12(srcRGB + top * srcStrideRGB, srcStrideRGB,
+                                  dstY + top * dstStrideY, dstStrideY,
+                                  dstUV + top / 2 * dstStrideUV, dstStrideUV, width, h, scratch);
+            });
             break;
         }
         default:
@@ -38,6 +38,9 @@ std::optional<Fourcc> Fourcc::fromUint32(uint32_t fourcc) {
     case YM16:
     case MT21:
     case MM21:
+    case QC08:
+    case P010:
+    case QC10:
         return Fourcc(static_cast<Value>(fourcc));
     }
     ALOGV("Unmapped fourcc: %s", fourccToString(fourcc).c_str());
@@ -179,7 +182,15 @@ VideoPixelFormat Fourcc::toVideoPixelFormat() const {
     // similar to V4L2_PIX_FMT_MT21C but is not compressed ; thus it can also
     // be mapped to PIXEL_FORMAT_NV12.
     case MM21:
+    // V4L2_PIX_FMT_QC08C is compressed, the NV12 mapping only sizes the frame layout. The actual
+    // layout of the buffers is private to the gralloc implementation.
+    case QC08:
         return VideoPixelFormat::NV12;
+    // P010 has the layout of P016LE, with the samples stored in the 10 MSBs.
+    case P010:
+    // Like V4L2_PIX_FMT_QC08C, the mapping of V4L2_PIX_FMT_QC10C only sizes the frame layout.
+    case QC10:
+        return VideoPixelFormat::P016LE;
     }
 
     ALOGE("Unmapped Fourcc: %s", toString().c_str());
@@ -212,6 +223,9 @@ std::optional<Fourcc> Fourcc::toSinglePlanar() const {
     case YUYV:
     case NV12:
     case NV21:
+    case QC08:
+    case P010:
+    case QC10:
         return Fourcc(mValue);
     case YM12:
         return Fourcc(YU12);
@@ -245,6 +259,9 @@ bool Fourcc::isMultiPlanar() const {
     case YUYV:
     case NV12:
     case NV21:
+    case QC08:
+    case P010:
+    case QC10:
         return false;
     case YM12:
     case YM21:
@@ -288,5 +305,17 @@ static_assert(Fourcc::MT21 == V4L2_PIX_FMT_MT21C, "Mismatch Fourcc");
 // V4L2_PIX_FMT_MM21 is not yet upstreamed.
 static_assert(Fourcc::MM21 == V4L2_PIX_FMT_MM21, "Mismatch Fourcc");
 #endif  // V4L2_PIX_FMT_MM21
+#ifdef V4L2_PIX_FMT_QC08C
+// V4L2_PIX_FMT_QC08C is defined since v5.18
+static_assert(Fourcc::QC08 == V4L2_PIX_FMT_QC08C, "Mismatch Fourcc");
+#endif  // V4L2_PIX_FMT_QC08C
+#ifdef V4L2_PIX_FMT_P010
+// V4L2_PIX_FMT_P010 is defined since v6.0
+static_assert(Fourcc::P010 == V4L2_PIX_FMT_P010, "Mismatch Fourcc");
+#endif  // V4L2_PIX_FMT_P010
+#ifdef V4L2_PIX_FMT_QC10C
+// V4L2_PIX_FMT_QC10C is defined since v5.18
+static_assert(Fourcc::QC10 == V4L2_PIX_FMT_QC10C, "Mismatch Fourcc");
+#endif  // V4L2_PIX_FMT_QC10C
 
 }  // namespace android
@@ -0,0 +1,782 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "H264Parser"
+
+#include <v4l2_codec2/common/H264Parser.h>
+
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <media/stagefright/foundation/ABitReader.h>
+#include <utils/Log.h>
+
+namespace android {
+namespace {
+
+// The profiles whose SPS carries the chroma format, bit depths and scaling matrix.
+constexpr uint8_t kHighProfileIdcs[] = {100, 110, 122, 244, 44,  83, 86,
+                                         118, 128, 138, 139, 134, 135};
+
+// Default scaling lists (Table 7-3 and 7-4), in zigzag scan order.
+constexpr uint8_t kDefault4x4Intra[16] = {6,  13, 13, 20, 20, 20, 28, 28,
+                                          28, 28, 32, 32, 32, 37, 37, 42};
+constexpr uint8_t kDefault4x4Inter[16] = {10, 14, 14, 20, 20, 20, 24, 24,
+                                          24, 24, 27, 27, 27, 30, 30, 34};
+constexpr uint8_t kDefault8x8Intra[64] = {
+        6,  10, 10, 13, 11, 13, 16, 16, 16, 16, 18, 18, 18, 18, 18, 23, 23, 23, 23, 23, 23, 25,
+        25, 25, 25, 25, 25, 25, 27, 27, 27, 27, 27, 27, 27, 27, 29, 29, 29, 29, 29, 29, 29, 31,
+        31, 31, 31, 31, 31, 33, 33, 33, 33, 33, 36, 36, 36, 36, 38, 38, 38, 40, 40, 42};
+constexpr uint8_t kDefault8x8Inter[64] = {
+        9,  13, 13, 15, 13, 15, 17, 17, 17, 17, 19, 19, 19, 19, 19, 21, 21, 21, 21, 21, 21, 22,
+        22, 22, 22, 22, 22, 22, 24, 24, 24, 24, 24, 24, 24, 24, 25, 25, 25, 25, 25, 25, 25, 27,
+        27, 27, 27, 27, 27, 28, 28, 28, 28, 28, 30, 30, 30, 30, 32, 32, 32, 33, 33, 35};
+
+// Get the raster scan position of each zigzag scan index of a |size|x|size| block.
+template <size_t size>
+std::array<uint8_t, size * size> makeZigzagScan() {
+    std::array<uint8_t, size * size> scan;
+    size_t index = 0;
+    for (size_t diagonal = 0; diagonal < 2 * size - 1; ++diagonal) {
+        const size_t minRow = diagonal < size ? 0 : diagonal - size + 1;
+        const size_t maxRow = std::min(diagonal, size - 1);
+        // Even diagonals are scanned upwards, odd diagonals downwards.
+        for (size_t i = 0; i <= maxRow - minRow; ++i) {
+            const size_t row = (diagonal % 2 == 0) ? maxRow - i : minRow + i;
+            scan[index++] = static_cast<uint8_t>(row * size + diagonal - row);
+        }
+    }
+    return scan;
+}
+
+const std::array<uint8_t, 16>& zigzag4x4() {
+    static const std::array<uint8_t, 16> kScan = makeZigzagScan<4>();
+    return kScan;
+}
+
+const std::array<uint8_t, 64>& zigzag8x8() {
+    static const std::array<uint8_t, 64> kScan = makeZigzagScan<8>();
+    return kScan;
+}
+
+// Store the zigzag ordered |list| of |size| entries into |raster| in raster scan order.
+void toRasterScan(const uint8_t* list, size_t size, uint8_t* raster) {
+    const uint8_t* scan = size == 16 ? zigzag4x4().data() : zigzag8x8().data();
+    for (size_t i = 0; i < size; ++i) raster[scan[i]] = list[i];
+}
+
+// Reader of the raw byte sequence payload of a NAL unit, with the emulation prevention bytes
+// removed.
+class RbspReader {
+public:
+    // |nal| starts with the NAL unit header, which is skipped.
+    RbspReader(const uint8_t* nal, size_t size)
+          : mRbsp(toRbsp(nal, size, 1)), mReader(mRbsp.data(), mRbsp.size()) {}
+
+    bool readBits(size_t numBits, uint32_t* value) {
+        return mReader.getBitsGraceful(numBits, value);
+    }
+
+    bool readUE(uint32_t* value) {
+        uint32_t numZeroes = 0;
+        uint32_t bit;
+        if (!readBits(1, &bit)) return false;
+        while (bit == 0) {
+            if (++numZeroes > 31) return false;
+            if (!readBits(1, &bit)) return false;
+        }
+        uint32_t suffix = 0;
+        if (numZeroes > 0 && !readBits(numZeroes, &suffix)) return false;
+        *value = static_cast<uint32_t>((1ull << numZeroes) - 1 + suffix);
+        return true;
+    }
+
+    bool readSE(int32_t* value) {
+        uint32_t codeNum;
+        if (!readUE(&codeNum)) return false;
+        *value = (codeNum & 1) ? static_cast<int32_t>((codeNum >> 1) + 1)
+                               : -static_cast<int32_t>(codeNum >> 1);
+        return true;
+    }
+
+    // Get the number of bits read so far.
+    size_t bitsRead() const { return mRbsp.size() * 8 - mReader.numBitsLeft(); }
+
+    // Whether there is more data before the RBSP trailing bits.
+    bool moreRbspData() const {
+        auto last = std::find_if(mRbsp.rbegin(), mRbsp.rend(), [](uint8_t b) { return b != 0; });
+        if (last == mRbsp.rend()) return false;
+        // The last set bit is the rbsp_stop_one_bit.
+        const size_t lastByte = mRbsp.rend() - last - 1;
+        const size_t stopBit = lastByte * 8 + 7 - __builtin_ctz(*last);
+        return bitsRead() < stopBit;
+    }
+
+private:
+    const std::vector<uint8_t> mRbsp;
+    ABitReader mReader;
+};
+
+#define READ_BITS_OR_RETURN(numBits, out)                                 \
+    do {                                                                  \
+        uint32_t _value;                                                  \
+        if (!reader.readBits((numBits), &_value)) {                       \
+            ALOGE("Failed to read %s", #out);                             \
+            return H264Parser::Result::kInvalidStream;                    \
+        }                                                                 \
+        *(out) = _value;                                                  \
+    } while (0)
+
+#define READ_FLAG_OR_RETURN(out)                                          \
+    do {                                                                  \
+        uint32_t _flag;                                                   \
+        if (!reader.readBits(1, &_flag)) {                                \
+            ALOGE("Failed to read %s", #out);                             \
+            return H264Parser::Result::kInvalidStream;                    \
+        }                                                                 \
+        *(out) = _flag != 0;                                              \
+    } while (0)
+
+#define READ_UE_OR_RETURN(out)                                            \
+    do {                                                                  \
+        uint32_t _value;                                                  \
+        if (!reader.readUE(&_value)) {                                    \
+            ALOGE("Failed to read %s", #out);                             \
+            return H264Parser::Result::kInvalidStream;                    \
+        }                                                                 \
+        *(out) = _value;                                                  \
+    } while (0)
+
+#define READ_UE_MAX_OR_RETURN(out, max)                                   \
+    do {                                                                  \
+        uint32_t _value;                                                  \
+        if (!reader.readUE(&_value)) {                                    \
+            ALOGE("Failed to read %s", #out);                             \
+            return H264Parser::Result::kInvalidStream;                    \
+        }                                                                 \
+        if (_value > (max)) {                                             \
+            ALOGE("%s is out of range: %u", #out, _value);                \
+            return H264Parser::Result::kInvalidStream;                    \
+        }                                                                 \
+        *(out) = _value;                                                  \
+    } while (0)
+
+#define READ_SE_OR_RETURN(out)                                            \
+    do {                                                                  \
+        int32_t _value;                                                   \
+        if (!reader.readSE(&_value)) {                                    \
+            ALOGE("Failed to read %s", #out);                             \
+            return H264Parser::Result::kInvalidStream;                    \
+        }                                                                 \
+        *(out) = _value;                                                  \
+    } while (0)
+
+#define IN_RANGE_OR_RETURN(value, min, max)                               \
+    do {                                                                  \
+        if ((value) < (min) || (value) > (max)) {                         \
+            ALOGE("%s is out of range: %d", #value, static_cast<int>(value)); \
+            return H264Parser::Result::kInvalidStream;                    \
+        }                                                                 \
+    } while (0)
+
+// Parse a scaling_list() of |size| entries into |list| in zigzag order. |useDefault| is set if
+// the list signals the default one.
+H264Parser::Result parseScalingList(RbspReader& reader, size_t size, uint8_t* list,
+                                    bool* useDefault) {
+    int32_t lastScale = 8;
+    int32_t nextScale = 8;
+    *useDefault = false;
+    for (size_t j = 0; j < size; ++j) {
+        if (nextScale != 0) {
+            int32_t deltaScale;
+            READ_SE_OR_RETURN(&deltaScale);  // delta_scale
+            IN_RANGE_OR_RETURN(deltaScale, -128, 127);
+            nextScale = (lastScale + deltaScale + 256) % 256;
+            *useDefault = (j == 0 && nextScale == 0);
+            if (*useDefault) return H264Parser::Result::kOk;
+        }
+        list[j] = static_cast<uint8_t>(nextScale == 0 ? lastScale : nextScale);
+        lastScale = list[j];
+    }
+    return H264Parser::Result::kOk;
+}
+
+// Parse the |numLists| scaling lists of a SPS or PPS into |lists4x4| and |lists8x8|, in raster
+// scan order. The lists which are not present are inferred from |fallback4x4| and |fallback8x8|
+// for the first list of each type, and from the previous list of the same type otherwise.
+H264Parser::Result parseScalingMatrix(RbspReader& reader, size_t numLists,
+                                      const uint8_t fallback4x4[2][16],
+                                      const uint8_t fallback8x8[2][64], uint8_t lists4x4[6][16],
+                                      uint8_t lists8x8[6][64]) {
+    for (size_t i = 0; i < 12; ++i) {
+        const bool is4x4 = i < 6;
+        const size_t size = is4x4 ? 16 : 64;
+        // Intra lists come first for 4x4 lists, intra and inter lists alternate for 8x8 lists.
+        const size_t index = is4x4 ? i : i - 6;
+        const bool isIntra = is4x4 ? index < 3 : index % 2 == 0;
+        uint8_t* raster = is4x4 ? lists4x4[index] : lists8x8[index];
+
+        bool present = false;
+        if (i < numLists) READ_FLAG_OR_RETURN(&present);  // scaling_list_present_flag
+
+        bool useDefault = false;
+        if (present) {
+            uint8_t list[64];
+            const H264Parser::Result result = parseScalingList(reader, size, list, &useDefault);
+            if (result != H264Parser::Result::kOk) return result;
+            if (!useDefault) {
+                toRasterScan(list, size, raster);
+                continue;
+            }
+        }
+
+        if (useDefault) {
+            const uint8_t* defaultList = is4x4 ? (isIntra ? kDefault4x4Intra : kDefault4x4Inter)
+                                               : (isIntra ? kDefault8x8Intra : kDefault8x8Inter);
+            toRasterScan(defaultList, size, raster);
+        } else if (is4x4 && (index == 0 || index == 3)) {
+            memcpy(raster, fallback4x4[index / 3], size);
+        } else if (!is4x4 && index < 2) {
+            memcpy(raster, fallback8x8[index], size);
+        } else {
+            // Fall back to the previous list of the same type.
+            memcpy(raster, is4x4 ? lists4x4[index - 1] : lists8x8[index - 2], size);
+        }
+    }
+    return H264Parser::Result::kOk;
+}
+
+// Parse the hrd_parameters() of the VUI, which are skipped.
+H264Parser::Result skipHrdParameters(RbspReader& reader) {
+    uint32_t cpbCntMinus1;
+    READ_UE_MAX_OR_RETURN(&cpbCntMinus1, 31u);  // cpb_cnt_minus1
+    uint32_t unused;
+    READ_BITS_OR_RETURN(8, &unused);  // bit_rate_scale, cpb_size_scale
+    for (uint32_t i = 0; i <= cpbCntMinus1; ++i) {
+        READ_UE_OR_RETURN(&unused);       // bit_rate_value_minus1
+        READ_UE_OR_RETURN(&unused);       // cpb_size_value_minus1
+        READ_BITS_OR_RETURN(1, &unused);  // cbr_flag
+    }
+    // initial_cpb_removal_delay_length_minus1, cpb_removal_delay_length_minus1,
+    // dpb_output_delay_length_minus1, time_offset_length
+    READ_BITS_OR_RETURN(20, &unused);
+    return H264Parser::Result::kOk;
+}
+
+// Parse the vui_parameters() of |sps|, only the bitstream restrictions are kept.
+H264Parser::Result parseVuiParameters(RbspReader& reader, H264SPS* sps) {
+    uint32_t unused;
+    bool flag;
+    READ_FLAG_OR_RETURN(&flag);  // aspect_ratio_info_present_flag
+    if (flag) {
+        uint32_t aspectRatioIdc;
+        READ_BITS_OR_RETURN(8, &aspectRatioIdc);  // aspect_ratio_idc
+        if (aspectRatioIdc == 255) {
+            READ_BITS_OR_RETURN(32, &unused);  // sar_width, sar_height
+        }
+    }
+    READ_FLAG_OR_RETURN(&flag);  // overscan_info_present_flag
+    if (flag) READ_BITS_OR_RETURN(1, &unused);  // overscan_appropriate_flag
+    READ_FLAG_OR_RETURN(&flag);                 // video_signal_type_present_flag
+    if (flag) {
+        READ_BITS_OR_RETURN(4, &unused);  // video_format, video_full_range_flag
+        READ_FLAG_OR_RETURN(&flag);       // colour_description_present_flag
+        if (flag) READ_BITS_OR_RETURN(24, &unused);  // colour_primaries, transfer, matrix
+    }
+    READ_FLAG_OR_RETURN(&flag);  // chroma_loc_info_present_flag
+    if (flag) {
+        READ_UE_OR_RETURN(&unused);  // chroma_sample_loc_type_top_field
+        READ_UE_OR_RETURN(&unused);  // chroma_sample_loc_type_bottom_field
+    }
+    READ_FLAG_OR_RETURN(&flag);  // timing_info_present_flag
+    if (flag) {
+        READ_BITS_OR_RETURN(32, &unused);  // num_units_in_tick
+        READ_BITS_OR_RETURN(32, &unused);  // time_scale
+        READ_BITS_OR_RETURN(1, &unused);   // fixed_frame_rate_flag
+    }
+    bool nalHrdParametersPresent, vclHrdParametersPresent;
+    READ_FLAG_OR_RETURN(&nalHrdParametersPresent);  // nal_hrd_parameters_present_flag
+    if (nalHrdParametersPresent) {
+        const H264Parser::Result result = skipHrdParameters(reader);
+        if (result != H264Parser::Result::kOk) return result;
+    }
+    READ_FLAG_OR_RETURN(&vclHrdParametersPresent);  // vcl_hrd_parameters_present_flag
+    if (vclHrdParametersPresent) {
+        const H264Parser::Result result = skipHrdParameters(reader);
+        if (result != H264Parser::Result::kOk) return result;
+    }
+    if (nalHrdParametersPresent || vclHrdParametersPresent) {
+        READ_BITS_OR_RETURN(1, &unused);  // low_delay_hrd_flag
+    }
+    READ_BITS_OR_RETURN(1, &unused);  // pic_struct_present_flag
+
+    bool bitstreamRestriction;
+    READ_FLAG_OR_RETURN(&bitstreamRestriction);  // bitstream_restriction_flag
+    if (bitstreamRestriction) {
+        READ_BITS_OR_RETURN(1, &unused);  // motion_vectors_over_pic_boundaries_flag
+        READ_UE_OR_RETURN(&unused);       // max_bytes_per_pic_denom
+        READ_UE_OR_RETURN(&unused);       // max_bits_per_mb_denom
+        READ_UE_OR_RETURN(&unused);       // log2_max_mv_length_horizontal
+        READ_UE_OR_RETURN(&unused);       // log2_max_mv_length_vertical
+        READ_UE_OR_RETURN(&sps->max_num_reorder_frames);
+        READ_UE_OR_RETURN(&sps->max_dec_frame_buffering);
+        sps->bitstream_restriction_flag = true;
+    }
+    return H264Parser::Result::kOk;
+}
+
+// Get the MaxDpbMbs limit of the level of |sps| (Table A-1).
+uint32_t getMaxDpbMbs(const H264SPS& sps) {
+    // Level 1b is signaled as level 1.1 with constraint_set3_flag outside of the High profiles.
+    const bool isLevel1b =
+            sps.level_idc == 9 ||
+            (sps.level_idc == 11 && (sps.constraint_set_flags & 0x08) &&
+             std::find(std::begin(kHighProfileIdcs), std::end(kHighProfileIdcs),
+                       sps.profile_idc) == std::end(kHighProfileIdcs));
+    if (isLevel1b) return 396;
+
+    switch (sps.level_idc) {
+    case 10:
+        return 396;
+    case 11:
+        return 900;
+    case 12:
+    case 13:
+    case 20:
+        return 2376;
+    case 21:
+        return 4752;
+    case 22:
+    case 30:
+        return 8100;
+    case 31:
+        return 18000;
+    case 32:
+        return 20480;
+    case 40:
+    case 41:
+        return 32768;
+    case 42:
+        return 34816;
+    case 50:
+        return 110400;
+    case 51:
+    case 52:
+        return 184320;
+    default:
+        // Levels 6 to 6.2, and unknown levels.
+        return 696320;
+    }
+}
+
+}  // namespace
+
+std::vector<uint8_t> toRbsp(const uint8_t* nal, size_t size, size_t headerSize) {
+    std::vector<uint8_t> rbsp;
+    if (size <= headerSize) return rbsp;
+    rbsp.reserve(size - headerSize);
+    size_t numZeroes = 0;
+    for (size_t i = headerSize; i < size; ++i) {
+        // An emulation prevention byte follows each pair of zero bytes escaping a start code.
+        if (numZeroes >= 2 && nal[i] == 0x03) {
+            numZeroes = 0;
+            continue;
+        }
+        numZeroes = nal[i] == 0x00 ? numZeroes + 1 : 0;
+        rbsp.push_back(nal[i]);
+    }
+    return rbsp;
+}
+
+ui::Size H264SPS::getCodedSize() const {
+    return ui::Size((pic_width_in_mbs_minus1 + 1) * 16,
+                    (2 - frame_mbs_only_flag) * (pic_height_in_map_units_minus1 + 1) * 16);
+}
+
+Rect H264SPS::getVisibleRect() const {
+    const ui::Size codedSize = getCodedSize();
+    if (!frame_cropping_flag) return Rect(codedSize.width, codedSize.height);
+
+    // The crop offsets are expressed in chroma sample units (7.4.2.1.1).
+    const uint32_t chromaArrayType = separate_colour_plane_flag ? 0 : chroma_format_idc;
+    const uint32_t subWidthC = (chromaArrayType == 1 || chromaArrayType == 2) ? 2 : 1;
+    const uint32_t subHeightC = chromaArrayType == 1 ? 2 : 1;
+    const uint32_t cropUnitX = chromaArrayType == 0 ? 1 : subWidthC;
+    const uint32_t cropUnitY = (chromaArrayType == 0 ? 1 : subHeightC) * (2 - frame_mbs_only_flag);
+
+    const uint64_t left = static_cast<uint64_t>(frame_crop_left_offset) * cropUnitX;
+    const uint64_t right = static_cast<uint64_t>(frame_crop_right_offset) * cropUnitX;
+    const uint64_t top = static_cast<uint64_t>(frame_crop_top_offset) * cropUnitY;
+    const uint64_t bottom = static_cast<uint64_t>(frame_crop_bottom_offset) * cropUnitY;
+    if (left + right >= static_cast<uint64_t>(codedSize.width) ||
+        top + bottom >= static_cast<uint64_t>(codedSize.height)) {
+        ALOGW("Invalid frame cropping, ignoring it");
+        return Rect(codedSize.width, codedSize.height);
+    }
+    return Rect(left, top, codedSize.width - right, codedSize.height - bottom);
+}
+
+size_t H264SPS::getMaxDpbFrames() const {
+    constexpr size_t kMaxDpbFrames = 16;
+
+    size_t maxDpbFrames;
+    if (bitstream_restriction_flag) {
+        maxDpbFrames = max_dec_frame_buffering;
+    } else {
+        const ui::Size codedSize = getCodedSize();
+        const size_t frameSizeInMbs = (codedSize.width / 16) * (codedSize.height / 16);
+        maxDpbFrames = getMaxDpbMbs(*this) / std::max<size_t>(frameSizeInMbs, 1);
+    }
+    maxDpbFrames = std::max<size_t>(maxDpbFrames, max_num_ref_frames);
+    return std::clamp<size_t>(maxDpbFrames, 1, kMaxDpbFrames);
+}
+
+size_t H264SPS::getMaxReorderFrames() const {
+    if (bitstream_restriction_flag) {
+        return std::min<size_t>(max_num_reorder_frames, getMaxDpbFrames());
+    }
+    // The intra profiles signaled with constraint_set3_flag don't reorder frames.
+    if ((constraint_set_flags & 0x08) &&
+        (profile_idc == 44 || profile_idc == 86 || profile_idc == 100 || profile_idc == 110 ||
+         profile_idc == 122 || profile_idc == 244)) {
+        return 0;
+    }
+    return getMaxDpbFrames();
+}
+
+H264Parser::H264Parser() = default;
+
+H264Parser::~H264Parser() = default;
+
+H264Parser::Result H264Parser::parseSPS(const uint8_t* nal, size_t size) {
+    RbspReader reader(nal, size);
+    auto sps = std::make_unique<H264SPS>();
+
+    READ_BITS_OR_RETURN(8, &sps->profile_idc);
+    uint32_t constraintFlags;
+    READ_BITS_OR_RETURN(8, &constraintFlags);  // constraint_set0..5_flag, reserved_zero_2bits
+    // The V4L2 flags store constraint_set0_flag in the least significant bit.
+    for (size_t i = 0; i < 6; ++i) {
+        if (constraintFlags & (0x80 >> i)) sps->constraint_set_flags |= 1 << i;
+    }
+    READ_BITS_OR_RETURN(8, &sps->level_idc);
+    READ_UE_MAX_OR_RETURN(&sps->seq_parameter_set_id, 31u);
+
+    // Without a scaling matrix, the flat lists apply.
+    memset(sps->scaling_list_4x4, 16, sizeof(sps->scaling_list_4x4));
+    memset(sps->scaling_list_8x8, 16, sizeof(sps->scaling_list_8x8));
+    if (std::find(std::begin(kHighProfileIdcs), std::end(kHighProfileIdcs), sps->profile_idc) !=
+        std::end(kHighProfileIdcs)) {
+        READ_UE_MAX_OR_RETURN(&sps->chroma_format_idc, 3u);
+        if (sps->chroma_format_idc == 3) READ_FLAG_OR_RETURN(&sps->separate_colour_plane_flag);
+        READ_UE_MAX_OR_RETURN(&sps->bit_depth_luma_minus8, 6u);
+        READ_UE_MAX_OR_RETURN(&sps->bit_depth_chroma_minus8, 6u);
+        READ_FLAG_OR_RETURN(&sps->qpprime_y_zero_transform_bypass_flag);
+        READ_FLAG_OR_RETURN(&sps->seq_scaling_matrix_present_flag);
+        if (sps->seq_scaling_matrix_present_flag) {
+            // Fall-back rule A: the first lists of each type fall back to the default lists.
+            uint8_t fallback4x4[2][16];
+            uint8_t fallback8x8[2][64];
+            toRasterScan(kDefault4x4Intra, 16, fallback4x4[0]);
+            toRasterScan(kDefault4x4Inter, 16, fallback4x4[1]);
+            toRasterScan(kDefault8x8Intra, 64, fallback8x8[0]);
+            toRasterScan(kDefault8x8Inter, 64, fallback8x8[1]);
+            const size_t numLists = sps->chroma_format_idc != 3 ? 8 : 12;
+            const Result result =
+                    parseScalingMatrix(reader, numLists, fallback4x4, fallback8x8,
+                                       sps->scaling_list_4x4, sps->scaling_list_8x8);
+            if (result != Result::kOk) return result;
+        }
+    }
+
+    READ_UE_MAX_OR_RETURN(&sps->log2_max_frame_num_minus4, 12u);
+    READ_UE_MAX_OR_RETURN(&sps->pic_order_cnt_type, 2u);
+    if (sps->pic_order_cnt_type == 0) {
+        READ_UE_MAX_OR_RETURN(&sps->log2_max_pic_order_cnt_lsb_minus4, 12u);
+    } else if (sps->pic_order_cnt_type == 1) {
+        READ_FLAG_OR_RETURN(&sps->delta_pic_order_always_zero_flag);
+        READ_SE_OR_RETURN(&sps->offset_for_non_ref_pic);
+        READ_SE_OR_RETURN(&sps->offset_for_top_to_bottom_field);
+        uint32_t numRefFramesInPicOrderCntCycle;
+        READ_UE_MAX_OR_RETURN(&numRefFramesInPicOrderCntCycle, 254u);
+        sps->num_ref_frames_in_pic_order_cnt_cycle = numRefFramesInPicOrderCntCycle;
+        for (uint32_t i = 0; i < numRefFramesInPicOrderCntCycle; ++i) {
+            READ_SE_OR_RETURN(&sps->offset_for_ref_frame[i]);
+        }
+    }
+
+    READ_UE_MAX_OR_RETURN(&sps->max_num_ref_frames, 16u);
+    READ_FLAG_OR_RETURN(&sps->gaps_in_frame_num_value_allowed_flag);
+    uint32_t picWidthInMbsMinus1, picHeightInMapUnitsMinus1;
+    READ_UE_MAX_OR_RETURN(&picWidthInMbsMinus1, 1023u);
+    READ_UE_MAX_OR_RETURN(&picHeightInMapUnitsMinus1, 1023u);
+    sps->pic_width_in_mbs_minus1 = picWidthInMbsMinus1;
+    sps->pic_height_in_map_units_minus1 = picHeightInMapUnitsMinus1;
+    READ_FLAG_OR_RETURN(&sps->frame_mbs_only_flag);
+    if (!sps->frame_mbs_only_flag) READ_FLAG_OR_RETURN(&sps->mb_adaptive_frame_field_flag);
+    READ_FLAG_OR_RETURN(&sps->direct_8x8_inference_flag);
+    READ_FLAG_OR_RETURN(&sps->frame_cropping_flag);
+    if (sps->frame_cropping_flag) {
+        READ_UE_OR_RETURN(&sps->frame_crop_left_offset);
+        READ_UE_OR_RETURN(&sps->frame_crop_right_offset);
+        READ_UE_OR_RETURN(&sps->frame_crop_top_offset);
+        READ_UE_OR_RETURN(&sps->frame_crop_bottom_offset);
+    }
+
+    bool vuiParametersPresent;
+    READ_FLAG_OR_RETURN(&vuiParametersPresent);  // vui_parameters_present_flag
+    // The VUI parameters are only used to limit the frames held for reordering, a stream with
+    // malformed VUI parameters can still be decoded.
+    if (vuiParametersPresent && parseVuiParameters(reader, sps.get()) != Result::kOk) {
+        ALOGW("Failed to parse the VUI parameters, ignoring them");
+        sps->bitstream_restriction_flag = false;
+    }
+
+    ALOGV("Parsed SPS %u: profile_idc=%u, level_idc=%u, coded size %dx%d",
+          sps->seq_parameter_set_id, sps->profile_idc, sps->level_idc,
+          sps->getCodedSize().width, sps->getCodedSize().height);
+    mSPSs[sps->seq_parameter_set_id] = std::move(sps);
+    return Result::kOk;
+}
+
+H264Parser::Result H264Parser::parsePPS(const uint8_t* nal, size_t size) {
+    RbspReader reader(nal, size);
+    auto pps = std::make_unique<H264PPS>();
+
+    READ_UE_MAX_OR_RETURN(&pps->pic_parameter_set_id, 255u);
+    READ_UE_MAX_OR_RETURN(&pps->seq_parameter_set_id, 31u);
+    const H264SPS* sps = getSPS(pps->seq_parameter_set_id);
+    if (!sps) {
+        ALOGE("PPS %u refers to missing SPS %u", pps->pic_parameter_set_id,
+              pps->seq_parameter_set_id);
+        return Result::kMissingParameterSet;
+    }
+
+    READ_FLAG_OR_RETURN(&pps->entropy_coding_mode_flag);
+    READ_FLAG_OR_RETURN(&pps->bottom_field_pic_order_in_frame_present_flag);
+    READ_UE_MAX_OR_RETURN(&pps->num_slice_groups_minus1, 7u);
+    if (pps->num_slice_groups_minus1 > 0) {
+        ALOGE("Slice groups are not supported");
+        return Result::kUnsupportedStream;
+    }
+    READ_UE_MAX_OR_RETURN(&pps->num_ref_idx_l0_default_active_minus1, 31u);
+    READ_UE_MAX_OR_RETURN(&pps->num_ref_idx_l1_default_active_minus1, 31u);
+    READ_FLAG_OR_RETURN(&pps->weighted_pred_flag);
+    READ_BITS_OR_RETURN(2, &pps->weighted_bipred_idc);
+    IN_RANGE_OR_RETURN(pps->weighted_bipred_idc, 0, 2);
+    int32_t value;
+    READ_SE_OR_RETURN(&value);  // pic_init_qp_minus26
+    IN_RANGE_OR_RETURN(value, -26, 25);
+    pps->pic_init_qp_minus26 = value;
+    READ_SE_OR_RETURN(&value);  // pic_init_qs_minus26
+    IN_RANGE_OR_RETURN(value, -26, 25);
+    pps->pic_init_qs_minus26 = value;
+    READ_SE_OR_RETURN(&value);  // chroma_qp_index_offset
+    IN_RANGE_OR_RETURN(value, -12, 12);
+    pps->chroma_qp_index_offset = value;
+    pps->second_chroma_qp_index_offset = value;
+    READ_FLAG_OR_RETURN(&pps->deblocking_filter_control_present_flag);
+    READ_FLAG_OR_RETURN(&pps->constrained_intra_pred_flag);
+    READ_FLAG_OR_RETURN(&pps->redundant_pic_cnt_present_flag);
+
+    // Without a picture scaling matrix, the sequence scaling matrix applies.
+    memcpy(pps->scaling_list_4x4, sps->scaling_list_4x4, sizeof(pps->scaling_list_4x4));
+    memcpy(pps->scaling_list_8x8, sps->scaling_list_8x8, sizeof(pps->scaling_list_8x8));
+    if (reader.moreRbspData()) {
+        READ_FLAG_OR_RETURN(&pps->transform_8x8_mode_flag);
+        READ_FLAG_OR_RETURN(&pps->pic_scaling_matrix_present_flag);
+        if (pps->pic_scaling_matrix_present_flag) {
+            // Fall-back rule B: the first lists of each type fall back to the sequence lists.
+            uint8_t fallback4x4[2][16];
+            uint8_t fallback8x8[2][64];
+            memcpy(fallback4x4[0], sps->scaling_list_4x4[0], 16);
+            memcpy(fallback4x4[1], sps->scaling_list_4x4[3], 16);
+            memcpy(fallback8x8[0], sps->scaling_list_8x8[0], 64);
+            memcpy(fallback8x8[1], sps->scaling_list_8x8[1], 64);
+            const size_t numLists =
+                    6 + (sps->chroma_format_idc != 3 ? 2 : 6) * pps->transform_8x8_mode_flag;
+            const Result result =
+                    parseScalingMatrix(reader, numLists, fallback4x4, fallback8x8,
+                                       pps->scaling_list_4x4, pps->scaling_list_8x8);
+            if (result != Result::kOk) return result;
+        }
+        READ_SE_OR_RETURN(&value);  // second_chroma_qp_index_offset
+        IN_RANGE_OR_RETURN(value, -12, 12);
+        pps->second_chroma_qp_index_offset = value;
+    }
+
+    ALOGV("Parsed PPS %u referring to SPS %u", pps->pic_parameter_set_id,
+          pps->seq_parameter_set_id);
+    mPPSs[pps->pic_parameter_set_id] = std::move(pps);
+    return Result::kOk;
+}
+
+H264Parser::Result H264Parser::parseSliceHeader(const uint8_t* nal, size_t size,
+                                                H264SliceHeader* header) const {
+    if (size < 2) return Result::kInvalidStream;
+    RbspReader reader(nal, size);
+    *header = H264SliceHeader();
+
+    // First byte is forbidden_zero_bit (1) + nal_ref_idc (2) + nal_unit_type (5).
+    header->nal_ref_idc = (nal[0] >> 5) & 0x3;
+    header->idr_pic_flag = (nal[0] & 0x1f) == kIDRSliceType;
+
+    READ_UE_OR_RETURN(&header->first_mb_in_slice);
+    uint32_t sliceType;
+    READ_UE_MAX_OR_RETURN(&sliceType, 9u);
+    header->slice_type = sliceType % 5;
+    READ_UE_MAX_OR_RETURN(&header->pic_parameter_set_id, 255u);
+
+    const H264PPS* pps = getPPS(header->pic_parameter_set_id);
+    const H264SPS* sps = pps ? getSPS(pps->seq_parameter_set_id) : nullptr;
+    if (!sps) {
+        ALOGE("Slice refers to missing PPS %u", header->pic_parameter_set_id);
+        return Result::kMissingParameterSet;
+    }
+
+    if (sps->separate_colour_plane_flag) READ_BITS_OR_RETURN(2, &header->colour_plane_id);
+    READ_BITS_OR_RETURN(sps->log2_max_frame_num_minus4 + 4, &header->frame_num);
+    if (!sps->frame_mbs_only_flag) {
+        READ_FLAG_OR_RETURN(&header->field_pic_flag);
+        if (header->field_pic_flag) READ_FLAG_OR_RETURN(&header->bottom_field_flag);
+    }
+    if (header->idr_pic_flag) {
+        READ_UE_MAX_OR_RETURN(&header->idr_pic_id, 65535u);
+    }
+
+    const size_t picOrderCntStart = reader.bitsRead();
+    if (sps->pic_order_cnt_type == 0) {
+        READ_BITS_OR_RETURN(sps->log2_max_pic_order_cnt_lsb_minus4 + 4,
+                            &header->pic_order_cnt_lsb);
+        if (pps->bottom_field_pic_order_in_frame_present_flag && !header->field_pic_flag) {
+            READ_SE_OR_RETURN(&header->delta_pic_order_cnt_bottom);
+        }
+    }
+    if (sps->pic_order_cnt_type == 1 && !sps->delta_pic_order_always_zero_flag) {
+        READ_SE_OR_RETURN(&header->delta_pic_order_cnt[0]);
+        if (pps->bottom_field_pic_order_in_frame_present_flag && !header->field_pic_flag) {
+            READ_SE_OR_RETURN(&header->delta_pic_order_cnt[1]);
+        }
+    }
+    header->pic_order_cnt_bit_size = reader.bitsRead() - picOrderCntStart;
+
+    if (pps->redundant_pic_cnt_present_flag) {
+        READ_UE_MAX_OR_RETURN(&header->redundant_pic_cnt, 127u);
+    }
+
+    uint32_t unused;
+    if (header->isBSlice()) READ_BITS_OR_RETURN(1, &unused);  // direct_spatial_mv_pred_flag
+
+    uint32_t numRefIdxL0ActiveMinus1 = pps->num_ref_idx_l0_default_active_minus1;
+    uint32_t numRefIdxL1ActiveMinus1 = pps->num_ref_idx_l1_default_active_minus1;
+    if (header->isPSlice() || header->isBSlice()) {
+        bool numRefIdxActiveOverride;
+        READ_FLAG_OR_RETURN(&numRefIdxActiveOverride);  // num_ref_idx_active_override_flag
+        if (numRefIdxActiveOverride) {
+            READ_UE_MAX_OR_RETURN(&numRefIdxL0ActiveMinus1, 31u);
+            if (header->isBSlice()) {
+                READ_UE_MAX_OR_RETURN(&numRefIdxL1ActiveMinus1, 31u);
+            }
+        }
+    }
+
+    // ref_pic_list_modification(), the lists are built by the hardware in frame-based mode.
+    const size_t numLists = header->isBSlice() ? 2 : (header->isPSlice() ? 1 : 0);
+    for (size_t list = 0; list < numLists; ++list) {
+        bool refPicListModification;
+        READ_FLAG_OR_RETURN(&refPicListModification);  // ref_pic_list_modification_flag_lX
+        if (!refPicListModification) continue;
+        // Each modification takes at least one bit, which bounds the loop.
+        for (size_t i = 0; i < 2 * 32 + 1; ++i) {
+            uint32_t modificationOfPicNumsIdc;
+            READ_UE_MAX_OR_RETURN(&modificationOfPicNumsIdc, 3u);
+            if (modificationOfPicNumsIdc == 3) break;
+            READ_UE_OR_RETURN(&unused);  // abs_diff_pic_num_minus1 or long_term_pic_num
+        }
+    }
+
+    // pred_weight_table(), skipped as the weights are parsed by the hardware.
+    if ((pps->weighted_pred_flag && header->isPSlice()) ||
+        (pps->weighted_bipred_idc == 1 && header->isBSlice())) {
+        const uint32_t chromaArrayType =
+                sps->separate_colour_plane_flag ? 0 : sps->chroma_format_idc;
+        int32_t unusedSigned;
+        READ_UE_OR_RETURN(&unused);  // luma_log2_weight_denom
+        if (chromaArrayType != 0) READ_UE_OR_RETURN(&unused);  // chroma_log2_weight_denom
+        for (size_t list = 0; list < numLists; ++list) {
+            const uint32_t numRefIdx =
+                    (list == 0 ? numRefIdxL0ActiveMinus1 : numRefIdxL1ActiveMinus1) + 1;
+            for (uint32_t i = 0; i < numRefIdx; ++i) {
+                bool lumaWeightFlag;
+                READ_FLAG_OR_RETURN(&lumaWeightFlag);  // luma_weight_lX_flag
+                if (lumaWeightFlag) {
+                    READ_SE_OR_RETURN(&unusedSigned);  // luma_weight_lX
+                    READ_SE_OR_RETURN(&unusedSigned);  // luma_offset_lX
+                }
+                if (chromaArrayType == 0) continue;
+                bool chromaWeightFlag;
+                READ_FLAG_OR_RETURN(&chromaWeightFlag);  // chroma_weight_lX_flag
+                if (!chromaWeightFlag) continue;
+                for (size_t j = 0; j < 2; ++j) {
+                    READ_SE_OR_RETURN(&unusedSigned);  // chroma_weight_lX
+                    READ_SE_OR_RETURN(&unusedSigned);  // chroma_offset_lX
+                }
+            }
+        }
+    }
+
+    if (header->nal_ref_idc != 0) {
+        // dec_ref_pic_marking()
+        const size_t decRefPicMarkingStart = reader.bitsRead();
+        if (header->idr_pic_flag) {
+            READ_FLAG_OR_RETURN(&header->no_output_of_prior_pics_flag);
+            READ_FLAG_OR_RETURN(&header->long_term_reference_flag);
+        } else {
+            READ_FLAG_OR_RETURN(&header->adaptive_ref_pic_marking_mode_flag);
+            if (header->adaptive_ref_pic_marking_mode_flag) {
+                for (;;) {
+                    if (header->num_mmcos == H264SliceHeader::kMaxNumMMCOs) {
+                        ALOGE("Too many memory management control operations");
+                        return Result::kInvalidStream;
+                    }
+                    H264DecRefPicMarking& mmco = header->mmcos[header->num_mmcos];
+                    READ_UE_MAX_OR_RETURN(&mmco.memory_management_control_operation, 6u);
+                    if (mmco.memory_management_control_operation == 0) break;
+                    header->num_mmcos++;
+
+                    const uint32_t operation = mmco.memory_management_control_operation;
+                    if (operation == 1 || operation == 3) {
+                        READ_UE_OR_RETURN(&mmco.difference_of_pic_nums_minus1);
+                    }
+                    if (operation == 2) READ_UE_OR_RETURN(&mmco.long_term_pic_num);
+                    if (operation == 3 || operation == 6) {
+                        READ_UE_OR_RETURN(&mmco.long_term_frame_idx);
+                    }
+                    if (operation == 4) READ_UE_OR_RETURN(&mmco.max_long_term_frame_idx_plus1);
+                }
+            }
+        }
+        header->dec_ref_pic_marking_bit_size = reader.bitsRead() - decRefPicMarkingStart;
+    }
+
+    return Result::kOk;
+}
+
+const H264SPS* H264Parser::getSPS(uint8_t id) const {
+    return id < mSPSs.size() ? mSPSs[id].get() : nullptr;
+}
+
+const H264PPS* H264Parser::getPPS(uint8_t id) const {
+    return mPPSs[id].get();
+}
+
+void H264Parser::reset() {
+    for (auto& sps : mSPSs) sps.reset();
+    for (auto& pps : mPPSs) pps.reset();
+}
+
+}  // namespace android
@@ -7,11 +7,20 @@
 
 #include <v4l2_codec2/common/NalParser.h>
 
-#include <algorithm>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <utility>
+#include <vector>
 
 #include <media/stagefright/foundation/ABitReader.h>
 #include <utils/Log.h>
 
+#include <v4l2_codec2/common/H264Parser.h>
+
 namespace android {
 
 namespace {
@@ -91,17 +100,36 @@ bool skipScalingMatrix(ABitReader* br, size_t numScalingLists) {
     return true;
 }
 
+// Skip the HEVC profile_tier_level() syntax structure with profilePresentFlag set.
+bool skipHEVCProfileTierLevel(ABitReader* br, uint32_t maxNumSubLayersMinus1) {
+    // general_profile_space to general_level_idc.
+    br->skipBits(96);
+    std::vector<std::pair<uint32_t, uint32_t>> subLayerPresentFlags(maxNumSubLayersMinus1);
+    for (auto& [profilePresent, levelPresent] : subLayerPresentFlags) {
+        if (!br->getBitsGraceful(1, &profilePresent) || !br->getBitsGraceful(1, &levelPresent)) {
+            return false;
+        }
+    }
+    if (maxNumSubLayersMinus1 > 0) {
+        br->skipBits(2 * (8 - maxNumSubLayersMinus1));  // reserved_zero_2bits
+    }
+    for (const auto& [profilePresent, levelPresent] : subLayerPresentFlags) {
+        if (profilePresent) br->skipBits(88);  // sub_layer_profile_space to sub_layer_inbld_flag
+        if (levelPresent) br->skipBits(8);     // sub_layer_level_idc
+    }
+    return br->numBitsLeft() > 0;
+}
+
 }  // namespace
 
 NalParser::NalParser(const uint8_t* data, size_t length)
-      : mCurrNalDataPos(data), mDataEnd(data + length) {
-    mNextNalStartCodePos = findNextStartCodePos();
-}
+      : mCurrNalDataPos(data), mDataEnd(data + length) {}
 
 bool NalParser::locateNextNal() {
-    if (mNextNalStartCodePos == mDataEnd) return false;
-    mCurrNalDataPos = mNextNalStartCodePos + kNalStartCodeLength;  // skip start code.
-    mNextNalStartCodePos = findNextStartCodePos();
+    const uint8_t* nextNalStartCodePos = this->nextNalStartCodePos();
+    if (nextNalStartCodePos == mDataEnd) return false;
+    mCurrNalDataPos = nextNalStartCodePos + kNalStartCodeLength;  // skip start code.
+    mNextNalStartCodePos = nullptr;
     return true;
 }
 
@@ -120,10 +148,11 @@ const uint8_t* NalParser::data() const {
 }
 
 size_t NalParser::length() const {
-    if (mNextNalStartCodePos == mDataEnd) return mDataEnd - mCurrNalDataPos;
-    size_t length = mNextNalStartCodePos - mCurrNalDataPos;
+    const uint8_t* nextNalStartCodePos = this->nextNalStartCodePos();
+    if (nextNalStartCodePos == mDataEnd) return mDataEnd - mCurrNalDataPos;
+    size_t length = nextNalStartCodePos - mCurrNalDataPos;
     // The start code could be 3 or 4 bytes, i.e., 0x000001 or 0x00000001.
-    return *(mNextNalStartCodePos - 1) == 0x00 ? length - 1 : length;
+    return *(nextNalStartCodePos - 1) == 0x00 ? length - 1 : length;
 }
 
 uint8_t NalParser::type() const {
@@ -132,9 +161,65 @@ uint8_t NalParser::type() const {
     return *mCurrNalDataPos & kNALTypeMask;
 }
 
+uint8_t NalParser::refIdc() const {
+    constexpr uint8_t kNALRefIdcShift = 5;
+    constexpr uint8_t kNALRefIdcMask = 0x3;
+    return (*mCurrNalDataPos >> kNALRefIdcShift) & kNALRefIdcMask;
+}
+
+bool NalParser::isSlice() const {
+    return type() >= kNonIDRType && type() <= kIDRType;
+}
+
+const uint8_t* NalParser::nextNalStartCodePos() const {
+    if (!mNextNalStartCodePos) mNextNalStartCodePos = findNextStartCodePos();
+    return mNextNalStartCodePos;
+}
+
 const uint8_t* NalParser::findNextStartCodePos() const {
-    return std::search(mCurrNalDataPos, mDataEnd, kNalStartCode,
-                       kNalStartCode + kNalStartCodeLength);
+    const uint8_t* pos = mCurrNalDataPos;
+
+    // Compare the 16 candidate positions of each step against the three bytes of the start code
+    // at once, using overlapping unaligned loads. The last bytes are handled by the scalar loop.
+#if defined(__SSE2__) || defined(__ARM_NEON)
+    constexpr size_t kVectorSize = 16;
+    while (static_cast<size_t>(mDataEnd - pos) >= kVectorSize + kNalStartCodeLength - 1) {
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i matches = _mm_and_si128(
+                _mm_and_si128(
+                        _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pos)),
+                                       zero),
+                        _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pos + 1)),
+                                       zero)),
+                _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pos + 2)),
+                               _mm_set1_epi8(1)));
+        const uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(matches));
+        if (mask != 0) return pos + __builtin_ctz(mask);
+#else
+        const uint8x16_t matches =
+                vandq_u8(vandq_u8(vceqq_u8(vld1q_u8(pos), vdupq_n_u8(0)),
+                                  vceqq_u8(vld1q_u8(pos + 1), vdupq_n_u8(0))),
+                         vceqq_u8(vld1q_u8(pos + 2), vdupq_n_u8(1)));
+        // Narrow each byte of the comparison result to 4 bits, as NEON has no movemask.
+        const uint64_t mask = vget_lane_u64(
+                vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(matches), 4)), 0);
+        if (mask != 0) return pos + __builtin_ctzll(mask) / 4;
+#endif
+        pos += kVectorSize;
+    }
+#endif
+
+    for (; static_cast<size_t>(mDataEnd - pos) >= kNalStartCodeLength; ++pos) {
+        // If the third byte is neither 0x00 nor 0x01, no start code can begin at any of the three
+        // positions up to it.
+        if (pos[2] > 0x01) {
+            pos += 2;
+            continue;
+        }
+        if (pos[0] == 0x00 && pos[1] == 0x00 && pos[2] == 0x01) return pos;
+    }
+    return mDataEnd;
 }
 
 bool NalParser::findCodedColorAspects(ColorAspects* colorAspects) {
@@ -264,4 +349,95 @@ bool NalParser::findCodedColorAspects(ColorAspects* colorAspects) {
     return false;  // The NAL unit doesn't contain color aspects info.
 }
 
+bool NalParser::findCodedStreamInfo(CodedStreamInfo* info) const {
+    ALOG_ASSERT(info);
+    ALOG_ASSERT(type() == kSPSType);
+
+    // The SPS of the stateless decoder has all the fields needed, from the VUI too.
+    H264Parser parser;
+    if (parser.parseSPS(data(), length()) != H264Parser::Result::kOk) return false;
+    const H264SPS* sps = nullptr;
+    for (uint8_t id = 0; id < 32 && !sps; id++) sps = parser.getSPS(id);
+    if (!sps) return false;
+
+    info->codedSize = sps->getCodedSize();
+    info->maxDpbFrames = sps->getMaxDpbFrames();
+    return true;
+}
+
+uint8_t HEVCNalParser::type() const {
+    // First two bytes are forbidden_zero_bit (1) + nal_unit_type (6) + nuh_layer_id (6) +
+    // nuh_temporal_id_plus1 (3).
+    constexpr uint8_t kNALTypeMask = 0x3f;
+    return (*data() >> 1) & kNALTypeMask;
+}
+
+bool HEVCNalParser::isSlice() const {
+    // NAL unit types 0 to 31 are VCL NAL units.
+    return type() < 32;
+}
+
+bool HEVCNalParser::isIRAP() const {
+    // BLA_W_LP (16) to RSV_IRAP_VCL23 (23).
+    return type() >= 16 && type() <= 23;
+}
+
+bool HEVCNalParser::findCodedStreamInfo(CodedStreamInfo* info) const {
+    ALOG_ASSERT(info);
+    ALOG_ASSERT(type() == kSPSType);
+
+    // The two bytes of the NAL unit header are skipped, see section 7.3.2.2 of the HEVC
+    // specification for the SPS syntax.
+    constexpr size_t kNalHeaderSize = 2;
+    const std::vector<uint8_t> rbsp = toRbsp(data(), length(), kNalHeaderSize);
+    ABitReader br(rbsp.data(), rbsp.size());
+
+    uint32_t maxSubLayersMinus1;
+    br.skipBits(4);  // sps_video_parameter_set_id
+    if (!br.getBitsGraceful(3, &maxSubLayersMinus1)) return false;  // sps_max_sub_layers_minus1
+    br.skipBits(1);  // sps_temporal_id_nesting_flag
+    if (!skipHEVCProfileTierLevel(&br, maxSubLayersMinus1)) return false;
+
+    uint32_t unused;
+    uint32_t chromaFormatIdc;
+    parseUE(&br, &unused);  // sps_seq_parameter_set_id
+    if (!parseUE(&br, &chromaFormatIdc)) return false;  // chroma_format_idc
+    if (chromaFormatIdc == kYUV444Idc) br.skipBits(1);  // separate_colour_plane_flag
+    uint32_t width, height;
+    if (!parseUE(&br, &width) || !parseUE(&br, &height)) return false;  // pic_{width,height}_...
+
+    uint32_t conformanceWindowFlag;
+    if (!br.getBitsGraceful(1, &conformanceWindowFlag)) return false;
+    if (conformanceWindowFlag) {
+        for (int i = 0; i < 4; i++) parseUE(&br, &unused);  // conf_win_*_offset
+    }
+    parseUE(&br, &unused);  // bit_depth_luma_minus8
+    parseUE(&br, &unused);  // bit_depth_chroma_minus8
+    parseUE(&br, &unused);  // log2_max_pic_order_cnt_lsb_minus4
+
+    // Only the values of the highest sub-layer are kept, which bound those of the lower ones.
+    uint32_t subLayerOrderingInfoPresentFlag;
+    if (!br.getBitsGraceful(1, &subLayerOrderingInfoPresentFlag)) return false;
+    uint32_t maxDecPicBufferingMinus1 = 0;
+    for (uint32_t i = subLayerOrderingInfoPresentFlag ? 0 : maxSubLayersMinus1;
+         i <= maxSubLayersMinus1; i++) {
+        // sps_max_num_reorder_pics and sps_max_latency_increase_plus1 are skipped.
+        if (!parseUE(&br, &maxDecPicBufferingMinus1) || !parseUE(&br, &unused) ||
+            !parseUE(&br, &unused)) {
+            return false;
+        }
+    }
+
+    // The HEVC DPB holds at most 16 frames, see section A.4.2.
+    constexpr uint32_t kMaxDpbFrames = 16;
+    constexpr uint32_t kMaxDimension = 16888;  // The largest picture width of level 6.2.
+    if (width == 0 || height == 0 || width > kMaxDimension || height > kMaxDimension ||
+        maxDecPicBufferingMinus1 >= kMaxDpbFrames) {
+        return false;
+    }
+    info->codedSize = ui::Size(width, height);
+    info->maxDpbFrames = maxDecPicBufferingMinus1 + 1;
+    return true;
+}
+
 }  // namespace android
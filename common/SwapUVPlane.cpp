@@ -0,0 +1,97 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <v4l2_codec2/common/SwapUVPlane.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SWAP_UV_NEON 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SWAP_UV_X86 1
+#endif
+
+namespace android {
+namespace {
+
+// Swap the bytes of the trailing |width| pairs which don't fill a whole vector.
+void swapUVRowScalar(const uint8_t* src, uint8_t* dst, int width) {
+    for (int i = 0; i < width; i++) {
+        const uint8_t u = src[2 * i];
+        dst[2 * i] = src[2 * i + 1];
+        dst[2 * i + 1] = u;
+    }
+}
+
+#if defined(SWAP_UV_NEON)
+void swapUVRow(const uint8_t* src, uint8_t* dst, int width) {
+    int i = 0;
+    // 16 pairs (32 bytes) per iteration.
+    for (; i + 16 <= width; i += 16) {
+        const uint8x16_t a = vld1q_u8(src + 2 * i);
+        const uint8x16_t b = vld1q_u8(src + 2 * i + 16);
+        vst1q_u8(dst + 2 * i, vrev16q_u8(a));
+        vst1q_u8(dst + 2 * i + 16, vrev16q_u8(b));
+    }
+    swapUVRowScalar(src + 2 * i, dst + 2 * i, width - i);
+}
+#elif defined(SWAP_UV_X86)
+__attribute__((target("ssse3"))) void swapUVRowSSSE3(const uint8_t* src, uint8_t* dst,
+                                                      int width) {
+    const __m128i shuffle = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    int i = 0;
+    // 8 pairs (16 bytes) per iteration.
+    for (; i + 8 <= width; i += 8) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 2 * i), _mm_shuffle_epi8(v, shuffle));
+    }
+    swapUVRowScalar(src + 2 * i, dst + 2 * i, width - i);
+}
+
+__attribute__((target("avx2"))) void swapUVRowAVX2(const uint8_t* src, uint8_t* dst, int width) {
+    // _mm256_shuffle_epi8 shuffles within each 128-bit lane, so the same pattern is used twice.
+    const __m256i shuffle =
+            _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14, 1, 0, 3, 2, 5,
+                             4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    int i = 0;
+    // 16 pairs (32 bytes) per iteration.
+    for (; i + 16 <= width; i += 16) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 2 * i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + 2 * i),
+                            _mm256_shuffle_epi8(v, shuffle));
+    }
+    swapUVRowScalar(src + 2 * i, dst + 2 * i, width - i);
+}
+
+using SwapUVRowFunc = void (*)(const uint8_t*, uint8_t*, int);
+
+SwapUVRowFunc selectSwapUVRow() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return swapUVRowAVX2;
+    if (__builtin_cpu_supports("ssse3")) return swapUVRowSSSE3;
+    return swapUVRowScalar;
+}
+
+void swapUVRow(const uint8_t* src, uint8_t* dst, int width) {
+    static const SwapUVRowFunc kSwapUVRow = selectSwapUVRow();
+    kSwapUVRow(src, dst, width);
+}
+#else
+void swapUVRow(const uint8_t* src, uint8_t* dst, int width) {
+    swapUVRowScalar(src, dst, width);
+}
+#endif
+
+}  // namespace
+
+void swapUVPlane(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width,
+                 int height) {
+    for (int row = 0; row < height; row++) {
+        swapUVRow(src, dst, width);
+        src += srcStride;
+        dst += dstStride;
+    }
+}
+
+}  // namespace android
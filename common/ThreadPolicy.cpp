@@ -0,0 +1,174 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "ThreadPolicy"
+
+#include <v4l2_codec2/common/ThreadPolicy.h>
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_util.h>
+#include <base/strings/stringprintf.h>
+#include <cutils/properties.h>
+#include <log/log.h>
+#include <system/thread_defs.h>
+
+namespace android {
+namespace {
+
+// The SCHED_FIFO priority of the real-time codec threads, the lowest one so the audio threads
+// still preempt them.
+constexpr int kRealtimePriority = 1;
+
+// The policy last applied to each thread.
+thread_local ThreadPolicy tCurrentPolicy;
+
+ThreadPolicy::Priority parsePriority(const char* value) {
+    if (!strcmp(value, "display")) return ThreadPolicy::Priority::kDisplay;
+    if (!strcmp(value, "urgent_display")) return ThreadPolicy::Priority::kUrgentDisplay;
+    if (!strcmp(value, "realtime")) return ThreadPolicy::Priority::kRealtime;
+    if (value[0] != '\0' && strcmp(value, "normal")) {
+        ALOGW("Unknown thread priority \"%s\", using the normal one", value);
+    }
+    return ThreadPolicy::Priority::kNormal;
+}
+
+ThreadPolicy::Cluster parseCluster(const char* value) {
+    if (!strcmp(value, "little")) return ThreadPolicy::Cluster::kLittle;
+    if (!strcmp(value, "big")) return ThreadPolicy::Cluster::kBig;
+    if (value[0] != '\0' && strcmp(value, "any")) {
+        ALOGW("Unknown thread cluster \"%s\", threads are not pinned", value);
+    }
+    return ThreadPolicy::Cluster::kAny;
+}
+
+ThreadPolicy readPolicy(const char* priorityProperty, const char* clusterProperty) {
+    char priority[PROPERTY_VALUE_MAX];
+    char cluster[PROPERTY_VALUE_MAX];
+    property_get(priorityProperty, priority, "");
+    property_get(clusterProperty, cluster, "");
+    return ThreadPolicy{parsePriority(priority), parseCluster(cluster)};
+}
+
+// Get the CPUs of the lowest and of the highest maximum frequency, both empty if all the CPUs have
+// the same maximum frequency or if it can't be read.
+std::pair<cpu_set_t, cpu_set_t> computeClusters() {
+    std::vector<std::pair<int, uint64_t>> frequencies;
+    const long numCpus = sysconf(_SC_NPROCESSORS_CONF);
+    for (int cpu = 0; cpu < std::min<long>(numCpus, CPU_SETSIZE); cpu++) {
+        std::string content;
+        uint64_t frequency = 0;
+        if (!::base::ReadFileToString(
+                    ::base::FilePath(::base::StringPrintf(
+                            "/sys/devices/system/cpu/cpu%d/cpufreq/cpuinfo_max_freq", cpu)),
+                    &content) ||
+            !::base::StringToUint64(::base::TrimWhitespaceASCII(content, ::base::TRIM_ALL),
+                                    &frequency)) {
+            continue;
+        }
+        frequencies.emplace_back(cpu, frequency);
+    }
+
+    cpu_set_t little;
+    cpu_set_t big;
+    CPU_ZERO(&little);
+    CPU_ZERO(&big);
+    const auto [minIt, maxIt] =
+            std::minmax_element(frequencies.begin(), frequencies.end(),
+                                [](const auto& a, const auto& b) { return a.second < b.second; });
+    if (frequencies.empty() || minIt->second == maxIt->second) {
+        ALOGI("The CPUs are not split in clusters, codec threads are not pinned");
+        return {little, big};
+    }
+    for (const auto& [cpu, frequency] : frequencies) {
+        if (frequency == minIt->second) CPU_SET(cpu, &little);
+        if (frequency == maxIt->second) CPU_SET(cpu, &big);
+    }
+    ALOGI("%d little and %d big CPUs", CPU_COUNT(&little), CPU_COUNT(&big));
+    return {little, big};
+}
+
+const cpu_set_t& getClusterCpus(ThreadPolicy::Cluster cluster) {
+    static const std::pair<cpu_set_t, cpu_set_t> kClusters = computeClusters();
+    return (cluster == ThreadPolicy::Cluster::kLittle) ? kClusters.first : kClusters.second;
+}
+
+bool setNiceLevel(int niceLevel) {
+    if (setpriority(PRIO_PROCESS, gettid(), niceLevel) != 0) {
+        ALOGW("Failed to set the nice level of thread %d to %d: %s", gettid(), niceLevel,
+              strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+// static
+ThreadPolicy ThreadPolicy::getDefault(V4L2Device::Type type) {
+    static const ThreadPolicy kDecodePolicy = readPolicy(
+            "ro.vendor.v4l2_codec2.decode_thread_priority",
+            "ro.vendor.v4l2_codec2.decode_thread_cluster");
+    static const ThreadPolicy kEncodePolicy = readPolicy(
+            "ro.vendor.v4l2_codec2.encode_thread_priority",
+            "ro.vendor.v4l2_codec2.encode_thread_cluster");
+    return (type == V4L2Device::Type::kEncoder) ? kEncodePolicy : kDecodePolicy;
+}
+
+// static
+ThreadPolicy ThreadPolicy::getCurrent() {
+    return tCurrentPolicy;
+}
+
+bool ThreadPolicy::applyToCurrentThread() const {
+    ALOGV("%s(priority=%u, cluster=%u) on thread %d", __func__, static_cast<uint32_t>(mPriority),
+          static_cast<uint32_t>(mCluster), gettid());
+
+    bool success = true;
+    switch (mPriority) {
+    case Priority::kNormal:
+        break;
+    case Priority::kDisplay:
+        success = setNiceLevel(ANDROID_PRIORITY_DISPLAY);
+        break;
+    case Priority::kRealtime: {
+        // Don't let the threads started by this one inherit the real-time policy by accident.
+        const struct sched_param param = {.sched_priority = kRealtimePriority};
+        if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param) == 0) break;
+        ALOGW("Failed to set SCHED_FIFO on thread %d (%s), using the urgent display priority",
+              gettid(), strerror(errno));
+        success = false;
+        [[fallthrough]];
+    }
+    case Priority::kUrgentDisplay:
+        success = setNiceLevel(ANDROID_PRIORITY_URGENT_DISPLAY) && success;
+        break;
+    }
+
+    if (mCluster != Cluster::kAny) {
+        const cpu_set_t& cpus = getClusterCpus(mCluster);
+        if (CPU_COUNT(&cpus) > 0 && sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+            ALOGW("Failed to pin thread %d: %s", gettid(), strerror(errno));
+            success = false;
+        }
+    }
+
+    tCurrentPolicy = *this;
+    return success;
+}
+
+}  // namespace android
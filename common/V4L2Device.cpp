@@ -7,6 +7,7 @@
 
 //#define LOG_NDEBUG 0
 #define LOG_TAG "V4L2Device"
+#define ATRACE_TAG ATRACE_TAG_VIDEO
 
 #include <v4l2_codec2/common/V4L2Device.h>
 
@@ -19,20 +20,28 @@
 #include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 
 #include <algorithm>
+#include <atomic>
 #include <mutex>
-#include <set>
+#include <new>
 #include <sstream>
+#include <type_traits>
 
 #include <base/bind.h>
 #include <base/numerics/safe_conversions.h>
 #include <base/posix/eintr_wrapper.h>
 #include <base/strings/stringprintf.h>
 #include <base/thread_annotations.h>
+#include <cutils/properties.h>
 #include <utils/Log.h>
+#include <utils/Trace.h>
 
 #include <v4l2_codec2/common/Fourcc.h>
+#include <v4l2_codec2/common/V4L2IoctlProfiler.h>
+#include <v4l2_codec2/common/V4L2IoctlRecorder.h>
 #include <v4l2_codec2/common/VideoPixelFormat.h>
 
 // VP8 parsed frames
@@ -55,7 +64,30 @@
 #define V4L2_PIX_FMT_HEVC_SLICE v4l2_fourcc('S', '2', '6', '5')
 #endif
 
+// AV1 parsed frames
+#ifndef V4L2_PIX_FMT_AV1_FRAME
+#define V4L2_PIX_FMT_AV1_FRAME v4l2_fourcc('A', 'V', '1', 'F')
+#endif
+
+// AV1 profiles
+#ifndef V4L2_CID_MPEG_VIDEO_AV1_PROFILE
+#define V4L2_CID_MPEG_VIDEO_AV1_PROFILE (V4L2_CID_CODEC_BASE + 655)
+#define V4L2_MPEG_VIDEO_AV1_PROFILE_MAIN 0
+#define V4L2_MPEG_VIDEO_AV1_PROFILE_HIGH 1
+#define V4L2_MPEG_VIDEO_AV1_PROFILE_PROFESSIONAL 2
+#endif
+
 namespace android {
+namespace {
+
+// Whether the sessions are spread across the device nodes supporting the same format, e.g. the
+// nodes of the cores of a multi-core codec. Otherwise the first node is always opened.
+bool isDeviceBalancingEnabled() {
+    static const bool kEnabled = property_get_bool("ro.vendor.v4l2_codec2.balance_devices", false);
+    return kEnabled;
+}
+
+}  // namespace
 
 struct v4l2_format buildV4L2Format(const enum v4l2_buf_type type, uint32_t fourcc,
                                    const ui::Size& size, size_t buffer_size, uint32_t stride) {
@@ -84,6 +116,11 @@ V4L2ExtCtrl::V4L2ExtCtrl(uint32_t id, int32_t val) : V4L2ExtCtrl(id) {
     ctrl.value = val;
 }
 
+V4L2ExtCtrl::V4L2ExtCtrl(uint32_t id, void* ptr, uint32_t size) : V4L2ExtCtrl(id) {
+    ctrl.ptr = ptr;
+    ctrl.size = size;
+}
+
 // Class used to store the state of a buffer that should persist between reference creations. This
 // includes:
 // * Result of initial VIDIOC_QUERYBUF ioctl,
@@ -101,6 +138,9 @@ public:
     V4L2Buffer& operator=(const V4L2Buffer&) = delete;
 
     void* getPlaneMapping(const size_t plane);
+    // Map all the planes of this MMAP buffer, populating the page tables if |prefault| is true.
+    // Returns false on failure.
+    bool mapPlanes(bool prefault);
     size_t getMemoryUsage() const;
     const struct v4l2_buffer& v4l2_buffer() const { return mV4l2Buffer; }
 
@@ -108,6 +148,7 @@ private:
     V4L2Buffer(scoped_refptr<V4L2Device> device, enum v4l2_buf_type type, enum v4l2_memory memory,
                const struct v4l2_format& format, size_t bufferId);
     bool query();
+    void* mapPlane(const size_t plane, int flags);
 
     scoped_refptr<V4L2Device> mDevice;
     std::vector<void*> mPlaneMappings;
@@ -192,8 +233,25 @@ void* V4L2Buffer::getPlaneMapping(const size_t plane) {
         return nullptr;
     }
 
-    p = mDevice->mmap(NULL, mV4l2Buffer.m.planes[plane].length, PROT_READ | PROT_WRITE, MAP_SHARED,
-                      mV4l2Buffer.m.planes[plane].m.mem_offset);
+    return mapPlane(plane, MAP_SHARED);
+}
+
+bool V4L2Buffer::mapPlanes(bool prefault) {
+    if (mV4l2Buffer.memory != V4L2_MEMORY_MMAP) {
+        ALOGE("Cannot create mapping on non-MMAP buffer");
+        return false;
+    }
+
+    const int flags = MAP_SHARED | (prefault ? MAP_POPULATE : 0);
+    for (size_t plane = 0; plane < mPlaneMappings.size(); plane++) {
+        if (!mPlaneMappings[plane] && !mapPlane(plane, flags)) return false;
+    }
+    return true;
+}
+
+void* V4L2Buffer::mapPlane(const size_t plane, int flags) {
+    void* p = mDevice->mmap(NULL, mV4l2Buffer.m.planes[plane].length, PROT_READ | PROT_WRITE, flags,
+                            mV4l2Buffer.m.planes[plane].m.mem_offset);
     if (p == MAP_FAILED) {
         ALOGE("mmap() failed: ");
         return nullptr;
@@ -211,12 +269,68 @@ size_t V4L2Buffer::getMemoryUsage() const {
     return usage;
 }
 
+// Module-private class that let users query/write V4L2 buffer information. It also makes some
+// private V4L2Queue methods available to this module only.
+class V4L2BufferRefBase {
+public:
+    using Ptr = std::unique_ptr<V4L2BufferRefBase, V4L2BufferRefBaseDeleter>;
+
+    // Create a reference to |v4l2Buffer| of |queue|, in the slot preallocated for the buffer by the
+    // free list of |queue|.
+    static Ptr create(const struct v4l2_buffer& v4l2Buffer, base::WeakPtr<V4L2Queue> queue);
+
+    V4L2BufferRefBase(const V4L2BufferRefBase&) = delete;
+    V4L2BufferRefBase& operator=(const V4L2BufferRefBase&) = delete;
+
+    bool queueBuffer();
+    void* getPlaneMapping(const size_t plane);
+
+    // Checks that the number of passed FDs is adequate for the current format and buffer
+    // configuration. Only useful for DMABUF buffers.
+    bool checkNumFDsForFormat(const size_t numFds) const;
+
+    // Data from the buffer, that users can query and/or write.
+    struct v4l2_buffer mV4l2Buffer;
+    // WARNING: do not change this to a vector or something smaller than VIDEO_MAX_PLANES, otherwise
+    // the Tegra libv4l2 will write data beyond the number of allocated planes, resulting in memory
+    // corruption.
+    struct v4l2_plane mV4l2Planes[VIDEO_MAX_PLANES];
+
+private:
+    V4L2BufferRefBase(const struct v4l2_buffer& v4l2Buffer, base::WeakPtr<V4L2Queue> queue);
+    ~V4L2BufferRefBase() = default;
+
+    size_t bufferId() const { return mV4l2Buffer.index; }
+
+    friend class V4L2WritableBufferRef;
+    friend struct V4L2BufferRefBaseDeleter;
+    friend struct V4L2ReadableBufferTraits;
+    // A weak pointer to the queue this buffer belongs to. Will remain valid as long as the
+    // underlying V4L2 buffer is valid too. This can only be accessed from the sequence protected by
+    // sequence_checker_. Thread-safe methods (like ~V4L2BufferRefBase) must *never* access this.
+    base::WeakPtr<V4L2Queue> mQueue;
+    // Where to return this buffer if it goes out of scope without being queued.
+    scoped_refptr<V4L2BuffersList> mReturnTo;
+    bool queued = false;
+    // Whether the buffer is returned to |mReturnTo| when this reference is destroyed. Cleared by
+    // V4L2ReadableBufferTraits, which returns the buffer itself.
+    bool mReturnOnDestruction = true;
+
+    SEQUENCE_CHECKER(mSequenceChecker);
+};
+
 // A thread-safe pool of buffer indexes, allowing buffers to be obtained and returned from different
-// threads. All the methods of this class are thread-safe. Users should keep a scoped_refptr to
-// instances of this class in order to ensure the list remains alive as long as they need it.
+// threads. All the methods of this class are thread-safe and lock-free. Users should keep a
+// scoped_refptr to instances of this class in order to ensure the list remains alive as long as
+// they need it.
+//
+// The list also holds, for each buffer, the storage of the V4L2BufferRefBase and of the
+// V4L2ReadableBuffer referencing it, so that no memory is allocated when buffers are obtained and
+// dequeued. A slot is only used while its buffer is out of the list, and the references keep the
+// list alive, so they can outlive the queue.
 class V4L2BuffersList : public base::RefCountedThreadSafe<V4L2BuffersList> {
 public:
-    V4L2BuffersList() = default;
+    explicit V4L2BuffersList(size_t numBuffers);
 
     V4L2BuffersList(const V4L2BuffersList&) = delete;
     V4L2BuffersList& operator=(const V4L2BuffersList&) = delete;
@@ -224,97 +338,83 @@ public:
     // Return a buffer to this list. Also can be called to set the initial pool of buffers.
     // Note that it is illegal to return the same buffer twice.
     void returnBuffer(size_t bufferId);
-    // Get any of the buffers in the list. There is no order guarantee whatsoever.
+    // Get any of the buffers in the list. The buffer with the lowest index is returned, although
+    // callers should not rely on it.
     std::optional<size_t> getFreeBuffer();
     // Get the buffer with specified index.
     std::optional<size_t> getFreeBuffer(size_t requestedBufferId);
     // Number of buffers currently in this list.
     size_t size() const;
 
+    // The storage of the V4L2BufferRefBase and of the V4L2ReadableBuffer of |bufferId|.
+    void* bufferRefSlot(size_t bufferId) { return &mSlots[bufferId].mBufferRef; }
+    void* readableBufferSlot(size_t bufferId) { return &mSlots[bufferId].mReadableBuffer; }
+
 private:
     friend class base::RefCountedThreadSafe<V4L2BuffersList>;
     ~V4L2BuffersList() = default;
 
-    mutable std::mutex mLock;
-    std::set<size_t> mFreeBuffers GUARDED_BY(mLock);
+    // V4L2 queues never hold more than VIDEO_MAX_FRAME buffers, so a single word holds the set.
+    static constexpr size_t kMaxBuffers = 64;
+    static_assert(VIDEO_MAX_FRAME <= kMaxBuffers, "Too many V4L2 buffers for the free bitmap");
+
+    static uint64_t bufferBit(size_t bufferId) {
+        ALOG_ASSERT(bufferId < kMaxBuffers);
+        return static_cast<uint64_t>(1) << bufferId;
+    }
+
+    struct Slot {
+        std::aligned_storage_t<sizeof(V4L2BufferRefBase), alignof(V4L2BufferRefBase)> mBufferRef;
+        std::aligned_storage_t<sizeof(V4L2ReadableBuffer), alignof(V4L2ReadableBuffer)>
+                mReadableBuffer;
+    };
+
+    // Bit i is set if the buffer of index i is free.
+    std::atomic<uint64_t> mFreeBuffers{0};
+    // Never resized, so the slots are not moved while in use.
+    std::vector<Slot> mSlots;
 };
 
-void V4L2BuffersList::returnBuffer(size_t bufferId) {
-    std::lock_guard<std::mutex> lock(mLock);
+V4L2BuffersList::V4L2BuffersList(size_t numBuffers) : mSlots(numBuffers) {
+    ALOG_ASSERT(numBuffers <= kMaxBuffers);
+}
 
-    auto inserted = mFreeBuffers.emplace(bufferId);
-    if (!inserted.second) {
+void V4L2BuffersList::returnBuffer(size_t bufferId) {
+    const uint64_t previous = mFreeBuffers.fetch_or(bufferBit(bufferId), std::memory_order_release);
+    if (previous & bufferBit(bufferId)) {
         ALOGE("Returning buffer failed");
     }
 }
 
 std::optional<size_t> V4L2BuffersList::getFreeBuffer() {
-    std::lock_guard<std::mutex> lock(mLock);
-
-    auto iter = mFreeBuffers.begin();
-    if (iter == mFreeBuffers.end()) {
-        ALOGV("No free buffer available!");
-        return std::nullopt;
-    }
-
-    size_t bufferId = *iter;
-    mFreeBuffers.erase(iter);
+    uint64_t freeBuffers = mFreeBuffers.load(std::memory_order_relaxed);
+    size_t bufferId;
+    do {
+        if (freeBuffers == 0) {
+            ALOGV("No free buffer available!");
+            return std::nullopt;
+        }
+        bufferId = static_cast<size_t>(__builtin_ctzll(freeBuffers));
+    } while (!mFreeBuffers.compare_exchange_weak(freeBuffers, freeBuffers & ~bufferBit(bufferId),
+                                                 std::memory_order_acquire,
+                                                 std::memory_order_relaxed));
 
     return bufferId;
 }
 
 std::optional<size_t> V4L2BuffersList::getFreeBuffer(size_t requestedBufferId) {
-    std::lock_guard<std::mutex> lock(mLock);
+    if (requestedBufferId >= kMaxBuffers) return std::nullopt;
 
-    return (mFreeBuffers.erase(requestedBufferId) > 0) ? std::make_optional(requestedBufferId)
-                                                       : std::nullopt;
+    const uint64_t bit = bufferBit(requestedBufferId);
+    return (mFreeBuffers.fetch_and(~bit, std::memory_order_acquire) & bit)
+                   ? std::make_optional(requestedBufferId)
+                   : std::nullopt;
 }
 
 size_t V4L2BuffersList::size() const {
-    std::lock_guard<std::mutex> lock(mLock);
-
-    return mFreeBuffers.size();
+    return static_cast<size_t>(__builtin_popcountll(mFreeBuffers.load(std::memory_order_relaxed)));
 }
 
-// Module-private class that let users query/write V4L2 buffer information. It also makes some
-// private V4L2Queue methods available to this module only.
-class V4L2BufferRefBase {
-public:
-    V4L2BufferRefBase(const struct v4l2_buffer& v4l2Buffer, base::WeakPtr<V4L2Queue> queue);
-    ~V4L2BufferRefBase();
-
-    V4L2BufferRefBase(const V4L2BufferRefBase&) = delete;
-    V4L2BufferRefBase& operator=(const V4L2BufferRefBase&) = delete;
-
-    bool queueBuffer();
-    void* getPlaneMapping(const size_t plane);
-
-    // Checks that the number of passed FDs is adequate for the current format and buffer
-    // configuration. Only useful for DMABUF buffers.
-    bool checkNumFDsForFormat(const size_t numFds) const;
-
-    // Data from the buffer, that users can query and/or write.
-    struct v4l2_buffer mV4l2Buffer;
-    // WARNING: do not change this to a vector or something smaller than VIDEO_MAX_PLANES, otherwise
-    // the Tegra libv4l2 will write data beyond the number of allocated planes, resulting in memory
-    // corruption.
-    struct v4l2_plane mV4l2Planes[VIDEO_MAX_PLANES];
-
-private:
-    size_t bufferId() const { return mV4l2Buffer.index; }
-
-    friend class V4L2WritableBufferRef;
-    // A weak pointer to the queue this buffer belongs to. Will remain valid as long as the
-    // underlying V4L2 buffer is valid too. This can only be accessed from the sequence protected by
-    // sequence_checker_. Thread-safe methods (like ~V4L2BufferRefBase) must *never* access this.
-    base::WeakPtr<V4L2Queue> mQueue;
-    // Where to return this buffer if it goes out of scope without being queued.
-    scoped_refptr<V4L2BuffersList> mReturnTo;
-    bool queued = false;
-
-    SEQUENCE_CHECKER(mSequenceChecker);
-};
-
 V4L2BufferRefBase::V4L2BufferRefBase(const struct v4l2_buffer& v4l2Buffer,
                                      base::WeakPtr<V4L2Queue> queue)
       : mQueue(std::move(queue)), mReturnTo(mQueue->mFreeBuffers) {
@@ -328,11 +428,23 @@ V4L2BufferRefBase::V4L2BufferRefBase(const struct v4l2_buffer& v4l2Buffer,
     mV4l2Buffer.m.planes = mV4l2Planes;
 }
 
-V4L2BufferRefBase::~V4L2BufferRefBase() {
+// static
+V4L2BufferRefBase::Ptr V4L2BufferRefBase::create(const struct v4l2_buffer& v4l2Buffer,
+                                                 base::WeakPtr<V4L2Queue> queue) {
+    void* slot = queue->mFreeBuffers->bufferRefSlot(v4l2Buffer.index);
+    return Ptr(new (slot) V4L2BufferRefBase(v4l2Buffer, std::move(queue)));
+}
+
+void V4L2BufferRefBaseDeleter::operator()(V4L2BufferRefBase* bufferRef) const {
     // We are the last reference and are only accessing the thread-safe mReturnTo, so we are safe
     // to call from any sequence. If we have been queued, then the queue is our owner so we don't
-    // need to return to the free buffers list.
-    if (!queued) mReturnTo->returnBuffer(bufferId());
+    // need to return to the free buffers list. The slot can be reused as soon as the buffer is
+    // returned, so the buffer is only returned once the reference is destroyed.
+    scoped_refptr<V4L2BuffersList> returnTo = std::move(bufferRef->mReturnTo);
+    const size_t bufferId = bufferRef->bufferId();
+    const bool returnBuffer = !bufferRef->queued && bufferRef->mReturnOnDestruction;
+    bufferRef->~V4L2BufferRefBase();
+    if (returnBuffer) returnTo->returnBuffer(bufferId);
 }
 
 bool V4L2BufferRefBase::queueBuffer() {
@@ -387,7 +499,7 @@ bool V4L2BufferRefBase::checkNumFDsForFormat(const size_t numFds) const {
 
 V4L2WritableBufferRef::V4L2WritableBufferRef(const struct v4l2_buffer& v4l2Buffer,
                                              base::WeakPtr<V4L2Queue> queue)
-      : mBufferData(std::make_unique<V4L2BufferRefBase>(v4l2Buffer, std::move(queue))) {
+      : mBufferData(V4L2BufferRefBase::create(v4l2Buffer, std::move(queue))) {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
 }
 
@@ -449,7 +561,8 @@ bool V4L2WritableBufferRef::queueMMap() && {
     return std::move(self).doQueue();
 }
 
-bool V4L2WritableBufferRef::queueUserPtr(const std::vector<void*>& ptrs) && {
+bool V4L2WritableBufferRef::queueUserPtr(
+        const FixedVector<void*, kMaxVideoFramePlanes>& ptrs) && {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
     ALOG_ASSERT(mBufferData);
 
@@ -475,7 +588,7 @@ bool V4L2WritableBufferRef::queueUserPtr(const std::vector<void*>& ptrs) && {
     return std::move(self).doQueue();
 }
 
-bool V4L2WritableBufferRef::queueDMABuf(const std::vector<int>& fds) && {
+bool V4L2WritableBufferRef::queueDMABuf(const VideoFrameFds& fds) && {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
     ALOG_ASSERT(mBufferData);
 
@@ -595,6 +708,14 @@ void V4L2WritableBufferRef::setPlaneDataOffset(const size_t plane, const size_t
     mBufferData->mV4l2Buffer.m.planes[plane].data_offset = dataOffset;
 }
 
+void V4L2WritableBufferRef::setRequestFd(int requestFd) {
+    DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
+    ALOG_ASSERT(mBufferData);
+
+    mBufferData->mV4l2Buffer.flags |= V4L2_BUF_FLAG_REQUEST_FD;
+    mBufferData->mV4l2Buffer.request_fd = requestFd;
+}
+
 size_t V4L2WritableBufferRef::bufferId() const {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
     ALOG_ASSERT(mBufferData);
@@ -604,7 +725,7 @@ size_t V4L2WritableBufferRef::bufferId() const {
 
 V4L2ReadableBuffer::V4L2ReadableBuffer(const struct v4l2_buffer& v4l2Buffer,
                                        base::WeakPtr<V4L2Queue> queue)
-      : mBufferData(std::make_unique<V4L2BufferRefBase>(v4l2Buffer, std::move(queue))) {
+      : mBufferData(V4L2BufferRefBase::create(v4l2Buffer, std::move(queue))) {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
 }
 
@@ -615,6 +736,18 @@ V4L2ReadableBuffer::~V4L2ReadableBuffer() {
     ALOG_ASSERT(mBufferData);
 }
 
+// static
+void V4L2ReadableBufferTraits::Destruct(const V4L2ReadableBuffer* buffer) {
+    // The buffer is returned by hand once |buffer| is entirely destroyed, as its slot can be reused
+    // by the queue as soon as the buffer is back in the free list.
+    V4L2BufferRefBase* bufferRef = buffer->mBufferData.get();
+    scoped_refptr<V4L2BuffersList> returnTo = bufferRef->mReturnTo;
+    const size_t bufferId = bufferRef->bufferId();
+    bufferRef->mReturnOnDestruction = false;
+    buffer->~V4L2ReadableBuffer();
+    returnTo->returnBuffer(bufferId);
+}
+
 bool V4L2ReadableBuffer::isLast() const {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
     ALOG_ASSERT(mBufferData);
@@ -629,6 +762,13 @@ bool V4L2ReadableBuffer::isKeyframe() const {
     return mBufferData->mV4l2Buffer.flags & V4L2_BUF_FLAG_KEYFRAME;
 }
 
+bool V4L2ReadableBuffer::isError() const {
+    DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
+    ALOG_ASSERT(mBufferData);
+
+    return mBufferData->mV4l2Buffer.flags & V4L2_BUF_FLAG_ERROR;
+}
+
 struct timeval V4L2ReadableBuffer::getTimeStamp() const {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
     ALOG_ASSERT(mBufferData);
@@ -690,9 +830,13 @@ public:
         return V4L2WritableBufferRef(v4l2Buffer, std::move(queue));
     }
 
+    // The buffer is constructed in the slot preallocated for it by |buffers|, and destroyed by
+    // V4L2ReadableBufferTraits.
     static V4L2ReadableBufferRef CreateReadableRef(const struct v4l2_buffer& v4l2Buffer,
-                                                   base::WeakPtr<V4L2Queue> queue) {
-        return new V4L2ReadableBuffer(v4l2Buffer, std::move(queue));
+                                                   base::WeakPtr<V4L2Queue> queue,
+                                                   V4L2BuffersList* buffers) {
+        return new (buffers->readableBufferSlot(v4l2Buffer.index))
+                V4L2ReadableBuffer(v4l2Buffer, std::move(queue));
     }
 };
 
@@ -702,7 +846,13 @@ public:
 
 V4L2Queue::V4L2Queue(scoped_refptr<V4L2Device> dev, enum v4l2_buf_type type,
                      base::OnceClosure destroyCb)
-      : mType(type), mDevice(dev), mDestroyCb(std::move(destroyCb)) {
+      : mType(type),
+        mTraceName(::base::StringPrintf("V4L2Queue(%s)#%p",
+                                        V4L2Device::v4L2BufferTypeToString(type), this)),
+        mQueuedCounterName(mTraceName + " queued"),
+        mFreeCounterName(mTraceName + " free"),
+        mDevice(dev),
+        mDestroyCb(std::move(destroyCb)) {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
 }
 
@@ -714,7 +864,7 @@ V4L2Queue::~V4L2Queue() {
         streamoff();
     }
 
-    ALOG_ASSERT(mQueuedBuffers.empty());
+    ALOG_ASSERT(mQueuedBuffers.none());
     ALOG_ASSERT(!mFreeBuffers);
 
     if (!mBuffers.empty()) {
@@ -760,10 +910,10 @@ std::pair<std::optional<struct v4l2_format>, int> V4L2Queue::getFormat() {
     return std::make_pair(format, 0);
 }
 
-size_t V4L2Queue::allocateBuffers(size_t count, enum v4l2_memory memory) {
+size_t V4L2Queue::allocateBuffers(size_t count, enum v4l2_memory memory, MapMode mapMode) {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
     ALOG_ASSERT(!mFreeBuffers);
-    ALOG_ASSERT(mQueuedBuffers.size() == 0u);
+    ALOG_ASSERT(mQueuedBuffers.none());
 
     if (isStreaming()) {
         ALOGEQ("Cannot allocate buffers while streaming.");
@@ -808,13 +958,14 @@ size_t V4L2Queue::allocateBuffers(size_t count, enum v4l2_memory memory) {
 
     mMemory = memory;
 
-    mFreeBuffers = new V4L2BuffersList();
+    mFreeBuffers = new V4L2BuffersList(reqbufs.count);
 
     // Now query all buffer information.
     for (size_t i = 0; i < reqbufs.count; i++) {
         auto buffer = V4L2Buffer::create(mDevice, mType, mMemory, format, i);
 
-        if (!buffer) {
+        if (!buffer || (mMemory == V4L2_MEMORY_MMAP && mapMode != MapMode::kLazy &&
+                        !buffer->mapPlanes(mapMode == MapMode::kPrefault))) {
             deallocateBuffers();
 
             return 0;
@@ -826,7 +977,11 @@ size_t V4L2Queue::allocateBuffers(size_t count, enum v4l2_memory memory) {
 
     ALOG_ASSERT(mFreeBuffers);
     ALOG_ASSERT(mFreeBuffers->size() == mBuffers.size());
-    ALOG_ASSERT(mQueuedBuffers.size() == 0u);
+    ALOG_ASSERT(mQueuedBuffers.none());
+
+    if (mMemory == V4L2_MEMORY_MMAP && mapMode != MapMode::kLazy) {
+        ALOGVQ("Mapped %zu bytes.", getMemoryUsage());
+    }
 
     return mBuffers.size();
 }
@@ -859,7 +1014,7 @@ bool V4L2Queue::deallocateBuffers() {
     }
 
     ALOG_ASSERT(!mFreeBuffers);
-    ALOG_ASSERT(mQueuedBuffers.size() == 0u);
+    ALOG_ASSERT(mQueuedBuffers.none());
 
     return true;
 }
@@ -906,17 +1061,23 @@ std::optional<V4L2WritableBufferRef> V4L2Queue::getFreeBuffer(size_t requestedBu
 bool V4L2Queue::queueBuffer(struct v4l2_buffer* v4l2Buffer) {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
 
-    int ret = mDevice->ioctl(VIDIOC_QBUF, v4l2Buffer);
+    int ret;
+    {
+        ATRACE_NAME("VIDIOC_QBUF");
+        ret = mDevice->ioctl(VIDIOC_QBUF, v4l2Buffer);
+    }
     if (ret) {
         ALOGEQ("VIDIOC_QBUF failed");
         return false;
     }
 
-    auto inserted = mQueuedBuffers.emplace(v4l2Buffer->index);
-    if (!inserted.second) {
+    if (mQueuedBuffers.test(v4l2Buffer->index)) {
         ALOGE("Queuing buffer failed");
         return false;
     }
+    mQueuedBuffers.set(v4l2Buffer->index);
+    ATRACE_ASYNC_BEGIN(mTraceName.c_str(), static_cast<int32_t>(v4l2Buffer->index));
+    traceBufferCounts();
 
     mDevice->schedulePoll();
 
@@ -945,7 +1106,11 @@ std::pair<bool, V4L2ReadableBufferRef> V4L2Queue::dequeueBuffer() {
     v4l2Buffer.memory = mMemory;
     v4l2Buffer.m.planes = planes;
     v4l2Buffer.length = mPlanesCount;
-    int ret = mDevice->ioctl(VIDIOC_DQBUF, &v4l2Buffer);
+    int ret;
+    {
+        ATRACE_NAME("VIDIOC_DQBUF");
+        ret = mDevice->ioctl(VIDIOC_DQBUF, &v4l2Buffer);
+    }
     if (ret) {
         // TODO(acourbot): we should not have to check for EPIPE as codec clients should not call
         // this method after the last buffer is dequeued.
@@ -961,15 +1126,17 @@ std::pair<bool, V4L2ReadableBufferRef> V4L2Queue::dequeueBuffer() {
         }
     }
 
-    auto it = mQueuedBuffers.find(v4l2Buffer.index);
-    ALOG_ASSERT(it != mQueuedBuffers.end());
-    mQueuedBuffers.erase(*it);
+    ALOG_ASSERT(mQueuedBuffers.test(v4l2Buffer.index));
+    mQueuedBuffers.reset(v4l2Buffer.index);
+    ATRACE_ASYNC_END(mTraceName.c_str(), static_cast<int32_t>(v4l2Buffer.index));
+    traceBufferCounts();
 
     if (queuedBuffersCount() > 0) mDevice->schedulePoll();
 
     ALOG_ASSERT(mFreeBuffers);
     return std::make_pair(true, V4L2BufferRefFactory::CreateReadableRef(
-                                        v4l2Buffer, mWeakThisFactory.GetWeakPtr()));
+                                        v4l2Buffer, mWeakThisFactory.GetWeakPtr(),
+                                        mFreeBuffers.get()));
 }
 
 bool V4L2Queue::isStreaming() const {
@@ -1009,12 +1176,15 @@ bool V4L2Queue::streamoff() {
         return false;
     }
 
-    for (const auto& bufferId : mQueuedBuffers) {
+    for (size_t bufferId = 0; bufferId < mQueuedBuffers.size(); bufferId++) {
+        if (!mQueuedBuffers.test(bufferId)) continue;
         ALOG_ASSERT(mFreeBuffers);
         mFreeBuffers->returnBuffer(bufferId);
+        ATRACE_ASYNC_END(mTraceName.c_str(), static_cast<int32_t>(bufferId));
     }
 
-    mQueuedBuffers.clear();
+    mQueuedBuffers.reset();
+    traceBufferCounts();
 
     mIsStreaming = false;
 
@@ -1036,7 +1206,14 @@ size_t V4L2Queue::freeBuffersCount() const {
 size_t V4L2Queue::queuedBuffersCount() const {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
 
-    return mQueuedBuffers.size();
+    return mQueuedBuffers.count();
+}
+
+void V4L2Queue::traceBufferCounts() const {
+    if (!ATRACE_ENABLED()) return;
+
+    ATRACE_INT(mQueuedCounterName.c_str(), static_cast<int32_t>(queuedBuffersCount()));
+    ATRACE_INT(mFreeCounterName.c_str(), static_cast<int32_t>(freeBuffersCount()));
 }
 
 #undef ALOGEQ
@@ -1094,6 +1271,42 @@ void V4L2Device::onQueueDestroyed(v4l2_buf_type bufType) {
     mQueues.erase(it);
 }
 
+// static
+std::mutex V4L2Device::sDeviceCacheLock;
+// static
+std::map<V4L2Device::Type, V4L2Device::Devices> V4L2Device::sDevicesByType;
+// static
+std::optional<V4L2Device::SupportedEncodeProfiles> V4L2Device::sEncodeProfiles;
+// static
+std::map<std::vector<uint32_t>, V4L2Device::SupportedDecodeProfiles> V4L2Device::sDecodeProfiles;
+// static
+std::mutex V4L2Device::sSessionLock;
+// static
+std::map<std::string, size_t> V4L2Device::sSessionsByPath;
+// static
+size_t V4L2Device::sNextSessionDevice = 0;
+
+// static
+void V4L2Device::preloadDeviceCache() {
+    ALOGV("%s()", __func__);
+
+    scoped_refptr<V4L2Device> device = create();
+    for (Type type : {Type::kDecoder, Type::kEncoder, Type::kImageProcessor}) {
+        device->getDevicesForType(type);
+    }
+    device->getSupportedEncodeProfiles();
+}
+
+// static
+void V4L2Device::invalidateDeviceCache() {
+    ALOGV("%s()", __func__);
+
+    std::lock_guard<std::mutex> lock(sDeviceCacheLock);
+    sDevicesByType.clear();
+    sEncodeProfiles.reset();
+    sDecodeProfiles.clear();
+}
+
 // static
 scoped_refptr<V4L2Device> V4L2Device::create() {
     ALOGV("%s()", __func__);
@@ -1103,18 +1316,30 @@ scoped_refptr<V4L2Device> V4L2Device::create() {
 bool V4L2Device::open(Type type, uint32_t v4l2PixFmt) {
     ALOGV("%s()", __func__);
 
-    std::string path = getDevicePathFor(type, v4l2PixFmt);
+    if (!preopen(type, v4l2PixFmt)) return false;
+    startSession();
+    return true;
+}
 
-    if (path.empty()) {
+bool V4L2Device::preopen(Type type, uint32_t v4l2PixFmt) {
+    ALOGV("%s()", __func__);
+
+    const std::vector<std::string> paths = getDevicePathsFor(type, v4l2PixFmt);
+
+    if (paths.empty()) {
         ALOGE("No devices supporting %s for type: %u", fourccToString(v4l2PixFmt).c_str(),
               static_cast<uint32_t>(type));
         return false;
     }
 
+    const std::string path = pickSessionDevice(paths);
     if (!openDevicePath(path, type)) {
         ALOGE("Failed opening %s", path.c_str());
         return false;
     }
+    mDevicePath = path;
+    mDeviceType = type;
+    mDevicePixFmt = v4l2PixFmt;
 
     mDevicePollInterruptFd.reset(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
     if (!mDevicePollInterruptFd.is_valid()) {
@@ -1125,12 +1350,38 @@ bool V4L2Device::open(Type type, uint32_t v4l2PixFmt) {
     return true;
 }
 
+void V4L2Device::startSession() {
+    ALOG_ASSERT(mDeviceFd.is_valid());
+    if (mSessionStarted) return;
+
+    mSessionStarted = true;
+    acquireSessionDevice(mDevicePath);
+    // The trace covers the session only, the pooled devices waiting to be handed out aren't traced.
+    mIoctlRecorder = V4L2IoctlRecorder::create(static_cast<uint32_t>(mDeviceType), mDevicePixFmt);
+}
+
 int V4L2Device::ioctl(int request, void* arg) {
     ALOG_ASSERT(mDeviceFd.is_valid());
-    return HANDLE_EINTR(::ioctl(mDeviceFd.get(), request, arg));
+    if (!V4L2IoctlProfiler::isEnabled() && !mIoctlRecorder) {
+        return HANDLE_EINTR(::ioctl(mDeviceFd.get(), request, arg));
+    }
+
+    // The argument is recorded as passed to the driver, which overwrites it.
+    std::vector<uint8_t> payload;
+    if (mIoctlRecorder) payload = mIoctlRecorder->serializeArgument(request, arg);
+
+    const ::base::TimeTicks start = ::base::TimeTicks::Now();
+    const int ret = HANDLE_EINTR(::ioctl(mDeviceFd.get(), request, arg));
+    const int error = errno;
+    const ::base::TimeDelta latency = ::base::TimeTicks::Now() - start;
+    if (V4L2IoctlProfiler::isEnabled()) V4L2IoctlProfiler::record(request, latency);
+    if (mIoctlRecorder) mIoctlRecorder->recordIoctl(request, payload, start, latency, ret, error);
+    errno = error;
+    return ret;
 }
 
-bool V4L2Device::poll(bool pollDevice, bool* eventPending) {
+bool V4L2Device::poll(bool pollDevice, bool* eventPending, int timeoutMs,
+                      uint32_t* deviceEvents) {
     struct pollfd pollfds[2];
     nfds_t nfds;
     int pollfd = -1;
@@ -1147,20 +1398,39 @@ bool V4L2Device::poll(bool pollDevice, bool* eventPending) {
         nfds++;
     }
 
-    if (HANDLE_EINTR(::poll(pollfds, nfds, -1)) == -1) {
+    const ::base::TimeTicks start = ::base::TimeTicks::Now();
+    const int ret = HANDLE_EINTR(::poll(pollfds, nfds, timeoutMs));
+    if (mIoctlRecorder) {
+        const int error = errno;
+        mIoctlRecorder->recordPoll(
+                (ret > 0 && pollfd != -1) ? static_cast<uint16_t>(pollfds[pollfd].revents) : 0u,
+                start, ::base::TimeTicks::Now() - start, ret, error);
+        errno = error;
+    }
+    if (ret == -1) {
         ALOGE("poll() failed");
         return false;
     }
+    if (ret == 0) {
+        ALOGE("poll() timed out after %d ms", timeoutMs);
+        return false;
+    }
     *eventPending = (pollfd != -1 && pollfds[pollfd].revents & POLLPRI);
+    if (deviceEvents) {
+        *deviceEvents = (pollfd != -1) ? static_cast<uint16_t>(pollfds[pollfd].revents) : 0u;
+    }
     return true;
 }
 
 void* V4L2Device::mmap(void* addr, unsigned int len, int prot, int flags, unsigned int offset) {
     DCHECK(mDeviceFd.is_valid());
-    return ::mmap(addr, len, prot, flags, mDeviceFd.get(), offset);
+    void* mapping = ::mmap(addr, len, prot, flags, mDeviceFd.get(), offset);
+    if (mIoctlRecorder && mapping != MAP_FAILED) mIoctlRecorder->onMmap(mapping, len, offset);
+    return mapping;
 }
 
 void V4L2Device::munmap(void* addr, unsigned int len) {
+    if (mIoctlRecorder) mIoctlRecorder->onMunmap(addr);
     ::munmap(addr, len);
 }
 
@@ -1249,6 +1519,12 @@ uint32_t V4L2Device::C2ProfileToV4L2PixFmt(C2Config::profile_t profile, bool sli
         } else {
             return V4L2_PIX_FMT_HEVC;
         }
+    } else if (profile >= C2Config::PROFILE_AV1_0 && profile <= C2Config::PROFILE_AV1_2) {
+        if (sliceBased) {
+            return V4L2_PIX_FMT_AV1_FRAME;
+        } else {
+            return V4L2_PIX_FMT_AV1;
+        }
     } else {
         ALOGE("Unknown profile: %s", profileToString(profile));
         return 0;
@@ -1269,6 +1545,8 @@ C2Config::profile_t V4L2Device::v4L2ProfileToC2Profile(VideoCodec codec, uint32_
             return C2Config::PROFILE_AVC_EXTENDED;
         case V4L2_MPEG_VIDEO_H264_PROFILE_HIGH:
             return C2Config::PROFILE_AVC_HIGH;
+        case V4L2_MPEG_VIDEO_H264_PROFILE_HIGH_10:
+            return C2Config::PROFILE_AVC_HIGH_10;
         }
         break;
     case VideoCodec::VP8:
@@ -1305,6 +1583,16 @@ C2Config::profile_t V4L2Device::v4L2ProfileToC2Profile(VideoCodec codec, uint32_
             return C2Config::PROFILE_HEVC_MAIN_10;
         }
         break;
+    case VideoCodec::AV1:
+        switch (profile) {
+        case V4L2_MPEG_VIDEO_AV1_PROFILE_MAIN:
+            return C2Config::PROFILE_AV1_0;
+        case V4L2_MPEG_VIDEO_AV1_PROFILE_HIGH:
+            return C2Config::PROFILE_AV1_1;
+        case V4L2_MPEG_VIDEO_AV1_PROFILE_PROFESSIONAL:
+            return C2Config::PROFILE_AV1_2;
+        }
+        break;
     default:
         ALOGE("Unknown codec: %u", codec);
     }
@@ -1330,6 +1618,9 @@ std::vector<C2Config::profile_t> V4L2Device::v4L2PixFmtToC2Profiles(uint32_t pix
         case VideoCodec::HEVC:
             queryId = V4L2_CID_MPEG_VIDEO_HEVC_PROFILE;
             break;
+        case VideoCodec::AV1:
+            queryId = V4L2_CID_MPEG_VIDEO_AV1_PROFILE;
+            break;
         default:
             return false;
         }
@@ -1390,6 +1681,13 @@ std::vector<C2Config::profile_t> V4L2Device::v4L2PixFmtToC2Profiles(uint32_t pix
             };
         }
         break;
+    case V4L2_PIX_FMT_AV1:
+    case V4L2_PIX_FMT_AV1_FRAME:
+        if (!getSupportedProfiles(VideoCodec::AV1, &profiles)) {
+            ALOGW("Driver doesn't support QUERY AV1 profiles, use default values, Main");
+            profiles = {C2Config::PROFILE_AV1_0};
+        }
+        break;
     default:
         ALOGE("Unhandled pixelformat %s", fourccToString(pixFmt).c_str());
         return {};
@@ -1432,6 +1730,46 @@ int32_t V4L2Device::c2ProfileToV4L2H264Profile(C2Config::profile_t profile) {
     }
 }
 
+// static
+int32_t V4L2Device::c2ProfileToV4L2HEVCProfile(C2Config::profile_t profile) {
+    switch (profile) {
+    case C2Config::PROFILE_HEVC_MAIN:
+        return V4L2_MPEG_VIDEO_HEVC_PROFILE_MAIN;
+    case C2Config::PROFILE_HEVC_MAIN_STILL:
+        return V4L2_MPEG_VIDEO_HEVC_PROFILE_MAIN_STILL_PICTURE;
+    case C2Config::PROFILE_HEVC_MAIN_10:
+        return V4L2_MPEG_VIDEO_HEVC_PROFILE_MAIN_10;
+    default:
+        ALOGE("Add more cases as needed");
+        return -1;
+    }
+}
+
+// static
+int32_t V4L2Device::c2ProfileToV4L2VPxProfile(C2Config::profile_t profile) {
+    switch (profile) {
+    case C2Config::PROFILE_VP8_0:
+        return V4L2_MPEG_VIDEO_VP8_PROFILE_0;
+    case C2Config::PROFILE_VP8_1:
+        return V4L2_MPEG_VIDEO_VP8_PROFILE_1;
+    case C2Config::PROFILE_VP8_2:
+        return V4L2_MPEG_VIDEO_VP8_PROFILE_2;
+    case C2Config::PROFILE_VP8_3:
+        return V4L2_MPEG_VIDEO_VP8_PROFILE_3;
+    case C2Config::PROFILE_VP9_0:
+        return V4L2_MPEG_VIDEO_VP9_PROFILE_0;
+    case C2Config::PROFILE_VP9_1:
+        return V4L2_MPEG_VIDEO_VP9_PROFILE_1;
+    case C2Config::PROFILE_VP9_2:
+        return V4L2_MPEG_VIDEO_VP9_PROFILE_2;
+    case C2Config::PROFILE_VP9_3:
+        return V4L2_MPEG_VIDEO_VP9_PROFILE_3;
+    default:
+        ALOGE("Add more cases as needed");
+        return -1;
+    }
+}
+
 // static
 int32_t V4L2Device::h264LevelIdcToV4L2H264Level(uint8_t levelIdc) {
     switch (levelIdc) {
@@ -1810,6 +2148,13 @@ std::vector<uint32_t> V4L2Device::enumerateSupportedPixelformats(v4l2_buf_type b
 
 V4L2Device::SupportedDecodeProfiles V4L2Device::getSupportedDecodeProfiles(
         const size_t numFormats, const uint32_t pixelFormats[]) {
+    const std::vector<uint32_t> cacheKey(pixelFormats, pixelFormats + numFormats);
+    {
+        std::lock_guard<std::mutex> lock(sDeviceCacheLock);
+        auto it = sDecodeProfiles.find(cacheKey);
+        if (it != sDecodeProfiles.end()) return it->second;
+    }
+
     SupportedDecodeProfiles supportedProfiles;
 
     Type type = Type::kDecoder;
@@ -1825,10 +2170,17 @@ V4L2Device::SupportedDecodeProfiles V4L2Device::getSupportedDecodeProfiles(
         closeDevice();
     }
 
+    std::lock_guard<std::mutex> lock(sDeviceCacheLock);
+    sDecodeProfiles[cacheKey] = supportedProfiles;
     return supportedProfiles;
 }
 
 V4L2Device::SupportedEncodeProfiles V4L2Device::getSupportedEncodeProfiles() {
+    {
+        std::lock_guard<std::mutex> lock(sDeviceCacheLock);
+        if (sEncodeProfiles) return *sEncodeProfiles;
+    }
+
     SupportedEncodeProfiles supportedProfiles;
 
     Type type = Type::kEncoder;
@@ -1844,6 +2196,8 @@ V4L2Device::SupportedEncodeProfiles V4L2Device::getSupportedEncodeProfiles() {
         closeDevice();
     }
 
+    std::lock_guard<std::mutex> lock(sDeviceCacheLock);
+    sEncodeProfiles = supportedProfiles;
     return supportedProfiles;
 }
 
@@ -1909,7 +2263,7 @@ bool V4L2Device::startPolling(android::V4L2DevicePoller::EventCallback eventCall
     DCHECK_CALLED_ON_VALID_SEQUENCE(mClientSequenceChecker);
 
     if (!mDevicePoller) {
-        mDevicePoller = std::make_unique<android::V4L2DevicePoller>(this, "V4L2DeviceThreadPoller");
+        mDevicePoller = std::make_unique<android::V4L2DevicePoller>(this, "V4L2DevicePoll");
     }
 
     bool ret = mDevicePoller->startPolling(std::move(eventCallback), std::move(errorCallback));
@@ -1919,6 +2273,22 @@ bool V4L2Device::startPolling(android::V4L2DevicePoller::EventCallback eventCall
     return ret;
 }
 
+bool V4L2Device::startPolling(android::V4L2DevicePoller::ReadinessCallback readinessCallback,
+                              base::RepeatingClosure errorCallback) {
+    DCHECK_CALLED_ON_VALID_SEQUENCE(mClientSequenceChecker);
+
+    if (!mDevicePoller) {
+        mDevicePoller = std::make_unique<android::V4L2DevicePoller>(this, "V4L2DevicePoll");
+    }
+
+    bool ret =
+            mDevicePoller->startPolling(std::move(readinessCallback), std::move(errorCallback));
+
+    if (!ret) mDevicePoller = nullptr;
+
+    return ret;
+}
+
 bool V4L2Device::stopPolling() {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mClientSequenceChecker);
 
@@ -1956,6 +2326,20 @@ bool V4L2Device::setExtCtrls(uint32_t ctrlClass, std::vector<V4L2ExtCtrl> ctrls)
     return ioctl(VIDIOC_S_EXT_CTRLS, &extCtrls) == 0;
 }
 
+bool V4L2Device::setExtCtrlsInRequest(std::vector<V4L2ExtCtrl> ctrls, int requestFd) {
+    DCHECK_CALLED_ON_VALID_SEQUENCE(mClientSequenceChecker);
+
+    if (ctrls.empty()) return true;
+
+    struct v4l2_ext_controls extCtrls;
+    memset(&extCtrls, 0, sizeof(extCtrls));
+    extCtrls.which = V4L2_CTRL_WHICH_REQUEST_VAL;
+    extCtrls.request_fd = requestFd;
+    extCtrls.count = ctrls.size();
+    extCtrls.controls = &ctrls[0].ctrl;
+    return ioctl(VIDIOC_S_EXT_CTRLS, &extCtrls) == 0;
+}
+
 bool V4L2Device::isCommandSupported(uint32_t commandId) {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mClientSequenceChecker);
 
@@ -1966,6 +2350,16 @@ bool V4L2Device::isCommandSupported(uint32_t commandId) {
     return ioctl(VIDIOC_TRY_ENCODER_CMD, &cmd) == 0;
 }
 
+bool V4L2Device::isDecoderCommandSupported(uint32_t commandId) {
+    DCHECK_CALLED_ON_VALID_SEQUENCE(mClientSequenceChecker);
+
+    struct v4l2_decoder_cmd cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.cmd = commandId;
+
+    return ioctl(VIDIOC_TRY_DECODER_CMD, &cmd) == 0;
+}
+
 bool V4L2Device::hasCapabilities(uint32_t capabilities) {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mClientSequenceChecker);
 
@@ -1979,6 +2373,21 @@ bool V4L2Device::hasCapabilities(uint32_t capabilities) {
     return (caps.capabilities & capabilities) == capabilities;
 }
 
+bool V4L2Device::getDeviceNumber(uint32_t* major, uint32_t* minor) {
+    DCHECK_CALLED_ON_VALID_SEQUENCE(mClientSequenceChecker);
+    ALOG_ASSERT(mDeviceFd.is_valid());
+
+    struct stat deviceStat;
+    if (fstat(mDeviceFd.get(), &deviceStat) != 0 || !S_ISCHR(deviceStat.st_mode)) {
+        ALOGE("Failed to get the device number");
+        return false;
+    }
+
+    *major = ::major(deviceStat.st_rdev);
+    *minor = ::minor(deviceStat.st_rdev);
+    return true;
+}
+
 bool V4L2Device::openDevicePath(const std::string& path, Type /*type*/) {
     ALOG_ASSERT(!mDeviceFd.is_valid());
 
@@ -1991,10 +2400,65 @@ bool V4L2Device::openDevicePath(const std::string& path, Type /*type*/) {
 void V4L2Device::closeDevice() {
     ALOGV("%s()", __func__);
 
+    mIoctlRecorder.reset();
     mDeviceFd.reset();
+    if (mSessionStarted) {
+        releaseSessionDevice(mDevicePath);
+        mSessionStarted = false;
+    }
+    mDevicePath.clear();
+}
+
+// static
+std::string V4L2Device::pickSessionDevice(const std::vector<std::string>& paths) {
+    ALOG_ASSERT(!paths.empty());
+
+    std::lock_guard<std::mutex> lock(sSessionLock);
+    size_t picked = 0;
+    if (isDeviceBalancingEnabled() && paths.size() > 1) {
+        // Start the search at a rotating index, so the first device with the fewest sessions
+        // changes from one session to the next.
+        const size_t start = sNextSessionDevice++ % paths.size();
+        picked = start;
+        for (size_t i = 1; i < paths.size(); i++) {
+            const size_t index = (start + i) % paths.size();
+            if (sSessionsByPath[paths[index]] < sSessionsByPath[paths[picked]]) picked = index;
+        }
+        ALOGV("Picked %s out of %zu devices (%zu sessions)", paths[picked].c_str(), paths.size(),
+              sSessionsByPath[paths[picked]]);
+    }
+    return paths[picked];
+}
+
+// static
+void V4L2Device::acquireSessionDevice(const std::string& path) {
+    std::lock_guard<std::mutex> lock(sSessionLock);
+    sSessionsByPath[path]++;
 }
 
-void V4L2Device::enumerateDevicesForType(Type type) {
+// static
+void V4L2Device::releaseSessionDevice(const std::string& path) {
+    std::lock_guard<std::mutex> lock(sSessionLock);
+    auto it = sSessionsByPath.find(path);
+    ALOG_ASSERT(it != sSessionsByPath.end() && it->second > 0);
+    if (--it->second == 0) sSessionsByPath.erase(it);
+}
+
+bool V4L2Device::isImageProcessor() {
+    // Unlike decoders and encoders, both queues of an image processor take raw pixel formats.
+    for (v4l2_buf_type bufType :
+         {V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE}) {
+        const std::vector<uint32_t> pixelFormats = enumerateSupportedPixelformats(bufType);
+        if (std::none_of(pixelFormats.begin(), pixelFormats.end(), [](uint32_t pixelFormat) {
+                return Fourcc::fromV4L2PixFmt(pixelFormat).has_value();
+            })) {
+            return false;
+        }
+    }
+    return true;
+}
+
+V4L2Device::Devices V4L2Device::enumerateDevicesForType(Type type) {
     // video input/output devices are registered as /dev/videoX in V4L2.
     static const std::string kVideoDevicePattern = "/dev/video";
 
@@ -2009,9 +2473,15 @@ void V4L2Device::enumerateDevicesForType(Type type) {
         devicePattern = kVideoDevicePattern;
         bufType = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
         break;
+    case Type::kImageProcessor:
+        // Image processors are memory-to-memory devices exposed as video devices too, which are
+        // looked up by the pixel formats they produce.
+        devicePattern = kVideoDevicePattern;
+        bufType = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        break;
     default:
-        ALOGE("Only decoder and encoder types are supported!!");
-        return;
+        ALOGE("Only decoder, encoder and image processor types are supported!!");
+        return {};
     }
 
     std::vector<std::string> candidatePaths;
@@ -2032,6 +2502,11 @@ void V4L2Device::enumerateDevicesForType(Type type) {
             continue;
         }
 
+        if (type == Type::kImageProcessor && !isImageProcessor()) {
+            closeDevice();
+            continue;
+        }
+
         const auto& supportedPixelformats = enumerateSupportedPixelformats(bufType);
         if (!supportedPixelformats.empty()) {
             ALOGV("Found device: %s", path.c_str());
@@ -2041,26 +2516,30 @@ void V4L2Device::enumerateDevicesForType(Type type) {
         closeDevice();
     }
 
-    ALOG_ASSERT(mDevicesByType.count(type) == 0u);
-    mDevicesByType[type] = devices;
+    return devices;
 }
 
 const V4L2Device::Devices& V4L2Device::getDevicesForType(Type type) {
-    if (mDevicesByType.count(type) == 0) enumerateDevicesForType(type);
+    if (mDevicesByType.count(type) == 0) {
+        std::lock_guard<std::mutex> lock(sDeviceCacheLock);
+        if (sDevicesByType.count(type) == 0) sDevicesByType[type] = enumerateDevicesForType(type);
+        mDevicesByType[type] = sDevicesByType[type];
+    }
 
     ALOG_ASSERT(mDevicesByType.count(type) != 0u);
     return mDevicesByType[type];
 }
 
-std::string V4L2Device::getDevicePathFor(Type type, uint32_t pixFmt) {
+std::vector<std::string> V4L2Device::getDevicePathsFor(Type type, uint32_t pixFmt) {
     const Devices& devices = getDevicesForType(type);
 
+    std::vector<std::string> paths;
     for (const auto& device : devices) {
         if (std::find(device.second.begin(), device.second.end(), pixFmt) != device.second.end())
-            return device.first;
+            paths.push_back(device.first);
     }
 
-    return std::string();
+    return paths;
 }
 
 }  // namespace android
@@ -5,23 +5,58 @@
 
 #include <v4l2_codec2/common/V4L2DevicePoller.h>
 
+#include <poll.h>
+
 #include <string>
 
 #include <base/bind.h>
 #include <base/threading/sequenced_task_runner_handle.h>
 #include <base/threading/thread_checker.h>
+#include <cutils/properties.h>
 #include <log/log.h>
 
+#include <v4l2_codec2/common/ThreadPolicy.h>
 #include <v4l2_codec2/common/V4L2Device.h>
 
 namespace android {
+namespace {
+
+// Whether devices are polled on the shared V4L2PollReactor instead of one thread per device.
+bool useSharedReactor() {
+    static const bool kUseSharedReactor =
+            property_get_bool("ro.vendor.v4l2_codec2.shared_device_poller", false);
+    return kUseSharedReactor;
+}
+
+// Convert the |events| returned by poll() or epoll_wait() for a V4L2 device, which share the same
+// values, to a readiness mask.
+uint32_t toReadiness(uint32_t events) {
+    uint32_t readiness = 0;
+    if (events & POLLOUT) readiness |= V4L2DevicePoller::kInputReady;
+    if (events & POLLIN) readiness |= V4L2DevicePoller::kOutputReady;
+    if (events & POLLPRI) readiness |= V4L2DevicePoller::kEventPending;
+    return readiness;
+}
+
+}  // namespace
+
+// static
+bool V4L2DevicePoller::isBatchedPollingEnabled() {
+    static const bool kBatchedPolling =
+            property_get_bool("ro.vendor.v4l2_codec2.batched_device_poll", false);
+    return kBatchedPolling;
+}
 
 V4L2DevicePoller::V4L2DevicePoller(V4L2Device* const device, const std::string& threadName)
       : mDevice(device),
         mPollThread(std::move(threadName)),
         mTriggerPoll(base::WaitableEvent::ResetPolicy::AUTOMATIC,
                      base::WaitableEvent::InitialState::NOT_SIGNALED),
-        mStopPolling(false) {}
+        mReadinessDispatched(base::WaitableEvent::ResetPolicy::AUTOMATIC,
+                             base::WaitableEvent::InitialState::NOT_SIGNALED),
+        mStopPolling(false) {
+    mWeakThis = mWeakThisFactory.GetWeakPtr();
+}
 
 V4L2DevicePoller::~V4L2DevicePoller() {
     ALOG_ASSERT(mClientTaskTunner->RunsTasksInCurrentSequence());
@@ -33,21 +68,48 @@ bool V4L2DevicePoller::startPolling(EventCallback eventCallback,
                                     base::RepeatingClosure errorCallback) {
     if (isPolling()) return true;
 
-    ALOGV("Starting polling");
+    mEventCallback = std::move(eventCallback);
+    mReadinessCallback.Reset();
+    mErrorCallback = errorCallback;
+    return startPollingInternal();
+}
 
-    mClientTaskTunner = base::SequencedTaskRunnerHandle::Get();
+bool V4L2DevicePoller::startPolling(ReadinessCallback readinessCallback,
+                                    base::RepeatingClosure errorCallback) {
+    if (isPolling()) return true;
+
+    mEventCallback.Reset();
+    mReadinessCallback = std::move(readinessCallback);
     mErrorCallback = errorCallback;
+    return startPollingInternal();
+}
+
+bool V4L2DevicePoller::startPollingInternal() {
+    ALOGV("Starting polling%s", mReadinessCallback ? " in batched mode" : "");
+
+    mClientTaskTunner = base::SequencedTaskRunnerHandle::Get();
+
+    if (useSharedReactor()) {
+        return startReactorPolling();
+    }
 
     if (!mPollThread.Start()) {
         ALOGE("Failed to start device poll thread");
         return false;
     }
 
-    mEventCallback = std::move(eventCallback);
-
     mStopPolling.store(false);
+    mTriggerPoll.Reset();
+    mReadinessDispatched.Reset();
+    // Poll with the scheduling policy of the client's thread, e.g. the decoder thread.
     mPollThread.task_runner()->PostTask(
-            FROM_HERE, base::BindOnce(&V4L2DevicePoller::devicePollTask, base::Unretained(this)));
+            FROM_HERE, base::BindOnce([](ThreadPolicy policy) { policy.applyToCurrentThread(); },
+                                      ThreadPolicy::getCurrent()));
+    mPollThread.task_runner()->PostTask(
+            FROM_HERE, mReadinessCallback ? base::BindOnce(&V4L2DevicePoller::batchedDevicePollTask,
+                                                           base::Unretained(this))
+                                          : base::BindOnce(&V4L2DevicePoller::devicePollTask,
+                                                           base::Unretained(this)));
 
     ALOGV("Polling thread started");
 
@@ -63,9 +125,15 @@ bool V4L2DevicePoller::stopPolling() {
 
     ALOGV("Stopping polling");
 
+    if (mReactorToken) {
+        stopReactorPolling();
+        return true;
+    }
+
     mStopPolling.store(true);
 
     mTriggerPoll.Signal();
+    mReadinessDispatched.Signal();
 
     if (!mDevice->setDevicePollInterrupt()) {
         ALOGE("Failed to interrupt device poll.");
@@ -88,7 +156,7 @@ bool V4L2DevicePoller::stopPolling() {
 bool V4L2DevicePoller::isPolling() const {
     ALOG_ASSERT(mClientTaskTunner->RunsTasksInCurrentSequence());
 
-    return mPollThread.IsRunning();
+    return mReactorToken.has_value() || mPollThread.IsRunning();
 }
 
 void V4L2DevicePoller::schedulePoll() {
@@ -99,6 +167,13 @@ void V4L2DevicePoller::schedulePoll() {
 
     ALOGV("Scheduling poll");
 
+    if (mReactorToken) {
+        if (!V4L2PollReactor::get()->arm(*mReactorToken)) {
+            mClientTaskTunner->PostTask(FROM_HERE, mErrorCallback);
+        }
+        return;
+    }
+
     mTriggerPoll.Signal();
 }
 
@@ -127,4 +202,102 @@ void V4L2DevicePoller::devicePollTask() {
     }
 }
 
+void V4L2DevicePoller::batchedDevicePollTask() {
+    ALOG_ASSERT(mPollThread.task_runner()->RunsTasksInCurrentSequence());
+
+    while (true) {
+        ALOGV("Waiting for poll to be scheduled.");
+        mTriggerPoll.Wait();
+
+        // Keep polling as long as the device reports some readiness and the client makes
+        // progress servicing it. poll() only reports POLLERR when no buffer is queued, and a
+        // readiness the client cannot service would be reported again right away, so in both
+        // cases wait for the next buffer to be queued.
+        while (!mStopPolling) {
+            bool event_pending = false;
+            uint32_t events = 0;
+            if (!mDevice->poll(true, &event_pending, -1, &events)) {
+                ALOGE("An error occurred while polling, calling error callback");
+                mClientTaskTunner->PostTask(FROM_HERE, mErrorCallback);
+                return;
+            }
+
+            const uint32_t readiness = toReadiness(events);
+            if (readiness == 0 || mStopPolling) break;
+
+            ALOGV("Poll returned readiness 0x%x, calling readiness callback.", readiness);
+            mClientTaskTunner->PostTask(FROM_HERE,
+                                        base::BindOnce(&V4L2DevicePoller::dispatchReadiness,
+                                                       mWeakThis, readiness));
+            mReadinessDispatched.Wait();
+            if (!mReadinessProgressed) {
+                ALOGV("Readiness callback made no progress, waiting for poll to be scheduled.");
+                break;
+            }
+        }
+
+        if (mStopPolling) {
+            ALOGV("Poll stopped, exiting.");
+            break;
+        }
+    }
+}
+
+void V4L2DevicePoller::dispatchReadiness(uint32_t readiness) {
+    ALOG_ASSERT(mClientTaskTunner->RunsTasksInCurrentSequence());
+
+    if (!isPolling()) return;
+
+    mReadinessProgressed.store(mReadinessCallback.Run(readiness));
+    mReadinessDispatched.Signal();
+}
+
+bool V4L2DevicePoller::startReactorPolling() {
+    V4L2PollReactor* reactor = V4L2PollReactor::get();
+    if (!reactor) {
+        ALOGE("Failed to get the shared poll reactor");
+        return false;
+    }
+
+    mReactorToken = reactor->add(
+            mDevice->mDeviceFd.get(), mClientTaskTunner,
+            base::BindRepeating(&V4L2DevicePoller::onReactorEvents, mWeakThis), mErrorCallback);
+    if (!mReactorToken) {
+        ALOGE("Failed to register device to the shared poll reactor");
+        return false;
+    }
+
+    ALOGV("Polling on the shared poll reactor");
+
+    schedulePoll();
+
+    return true;
+}
+
+void V4L2DevicePoller::stopReactorPolling() {
+    V4L2PollReactor::get()->remove(*mReactorToken);
+    mReactorToken.reset();
+
+    ALOGV("Polling on the shared poll reactor stopped");
+}
+
+void V4L2DevicePoller::onReactorEvents(uint32_t events) {
+    ALOG_ASSERT(mClientTaskTunner->RunsTasksInCurrentSequence());
+
+    if (!isPolling()) return;
+
+    if (!mReadinessCallback) {
+        mEventCallback.Run(events & POLLPRI);
+        return;
+    }
+
+    const uint32_t readiness = toReadiness(events);
+    if (readiness == 0) return;
+
+    const bool progressed = mReadinessCallback.Run(readiness);
+    // The callback might have stopped polling. Without progress, the client re-arms the device
+    // through schedulePoll() when it queues the next buffer.
+    if (progressed && isPolling()) schedulePoll();
+}
+
 }  // namespace android
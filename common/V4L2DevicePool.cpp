@@ -0,0 +1,109 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "V4L2DevicePool"
+
+#include <v4l2_codec2/common/V4L2DevicePool.h>
+
+#include <base/bind.h>
+#include <log/log.h>
+
+#include <v4l2_codec2/common/VideoPixelFormat.h>
+
+namespace android {
+
+// static
+V4L2DevicePool* V4L2DevicePool::get() {
+    // The pool is never destroyed, as the refill thread might still be opening devices on exit.
+    static V4L2DevicePool* const sPool = new V4L2DevicePool();
+    return sPool;
+}
+
+void V4L2DevicePool::setPoolSize(V4L2Device::Type type, uint32_t v4l2PixFmt, size_t size) {
+    ALOGV("%s(type=%u, v4l2PixFmt=%s, size=%zu)", __func__, static_cast<uint32_t>(type),
+          fourccToString(v4l2PixFmt).c_str(), size);
+
+    std::lock_guard<std::mutex> lock(mLock);
+    const Key key(type, v4l2PixFmt);
+    Pool& pool = mPools[key];
+    pool.mSize = size;
+    while (pool.mDevices.size() > size) {
+        pool.mDevices.pop_back();
+    }
+    scheduleRefillLocked(key, pool);
+}
+
+scoped_refptr<V4L2Device> V4L2DevicePool::acquire(V4L2Device::Type type, uint32_t v4l2PixFmt) {
+    ALOGV("%s(type=%u, v4l2PixFmt=%s)", __func__, static_cast<uint32_t>(type),
+          fourccToString(v4l2PixFmt).c_str());
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        auto it = mPools.find(Key(type, v4l2PixFmt));
+        if (it != mPools.end() && !it->second.mDevices.empty()) {
+            scoped_refptr<V4L2Device> device = std::move(it->second.mDevices.front());
+            it->second.mDevices.pop_front();
+            scheduleRefillLocked(it->first, it->second);
+            device->startSession();
+            return device;
+        }
+    }
+
+    scoped_refptr<V4L2Device> device = openDevice(type, v4l2PixFmt);
+    if (device) device->startSession();
+    return device;
+}
+
+void V4L2DevicePool::scheduleRefillLocked(const Key& key, Pool& pool) {
+    if (pool.mRefillPending || pool.mDevices.size() >= pool.mSize) return;
+
+    if (!mRefillThread.IsRunning() && !mRefillThread.Start()) {
+        ALOGE("Failed to start refill thread");
+        return;
+    }
+    pool.mRefillPending = true;
+    mRefillThread.task_runner()->PostTask(
+            FROM_HERE,
+            ::base::BindOnce(&V4L2DevicePool::refillTask, ::base::Unretained(this), key));
+}
+
+void V4L2DevicePool::refillTask(Key key) {
+    ALOGV("%s()", __func__);
+
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            Pool& pool = mPools[key];
+            if (pool.mDevices.size() >= pool.mSize) {
+                pool.mRefillPending = false;
+                return;
+            }
+        }
+
+        // Devices are opened without holding the lock, so acquire() is never blocked by a refill.
+        scoped_refptr<V4L2Device> device = openDevice(key.first, key.second);
+
+        std::lock_guard<std::mutex> lock(mLock);
+        Pool& pool = mPools[key];
+        if (!device) {
+            // Don't retry until the next device is acquired, the device is likely unavailable.
+            pool.mRefillPending = false;
+            return;
+        }
+        if (pool.mDevices.size() < pool.mSize) pool.mDevices.push_back(std::move(device));
+    }
+}
+
+// static
+scoped_refptr<V4L2Device> V4L2DevicePool::openDevice(V4L2Device::Type type, uint32_t v4l2PixFmt) {
+    scoped_refptr<V4L2Device> device = V4L2Device::create();
+    if (!device->preopen(type, v4l2PixFmt)) {
+        ALOGE("Failed to open device for %s", fourccToString(v4l2PixFmt).c_str());
+        return nullptr;
+    }
+    return device;
+}
+
+}  // namespace android
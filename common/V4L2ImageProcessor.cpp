@@ -0,0 +1,228 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "V4L2ImageProcessor"
+
+#include <v4l2_codec2/common/V4L2ImageProcessor.h>
+
+#include <linux/videodev2.h>
+#include <string.h>
+
+#include <log/log.h>
+
+#include <v4l2_codec2/common/Fourcc.h>
+#include <v4l2_codec2/common/V4L2Device.h>
+
+namespace android {
+namespace {
+
+// Check whether the planes of |layout1| and |layout2| are laid out identically in memory.
+bool isSameLayout(const VideoFrameLayout& layout1, const VideoFrameLayout& layout2) {
+    if (layout1.mFormat != layout2.mFormat || layout1.mCodedSize != layout2.mCodedSize ||
+        layout1.mPlanes.size() != layout2.mPlanes.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < layout1.mPlanes.size(); ++i) {
+        if (layout1.mPlanes[i].mStride != layout2.mPlanes[i].mStride ||
+            layout1.mPlanes[i].mOffset != layout2.mPlanes[i].mOffset) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Dequeue a buffer from |queue| unless |done| is already set, |done| is set if a buffer was
+// dequeued. Returns false on error.
+bool dequeueIfNotDone(V4L2Queue* queue, bool* done) {
+    if (*done) return true;
+
+    std::pair<bool, V4L2ReadableBufferRef> result = queue->dequeueBuffer();
+    *done = (result.second != nullptr);
+    return result.first;
+}
+
+}  // namespace
+
+// static
+std::unique_ptr<V4L2ImageProcessor> V4L2ImageProcessor::Create(VideoPixelFormat outFormat) {
+    ALOGV("%s(%s)", __func__, videoPixelFormatToString(outFormat).c_str());
+
+    std::optional<Fourcc> fourcc = Fourcc::fromVideoPixelFormat(outFormat, true);
+    if (!fourcc) {
+        return nullptr;
+    }
+
+    scoped_refptr<V4L2Device> device = V4L2Device::create();
+    if (!device->open(V4L2Device::Type::kImageProcessor, fourcc->toV4L2PixFmt())) {
+        ALOGV("No image processor producing %s", fourcc->toString().c_str());
+        return nullptr;
+    }
+
+    if (!device->hasCapabilities(V4L2_CAP_VIDEO_M2M_MPLANE | V4L2_CAP_STREAMING)) {
+        ALOGE("Image processor doesn't support the required capabilities");
+        return nullptr;
+    }
+
+    scoped_refptr<V4L2Queue> inputQueue = device->getQueue(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+    scoped_refptr<V4L2Queue> outputQueue = device->getQueue(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+    if (!inputQueue || !outputQueue) {
+        ALOGE("Failed to get V4L2 device queues");
+        return nullptr;
+    }
+
+    return std::unique_ptr<V4L2ImageProcessor>(new V4L2ImageProcessor(
+            std::move(device), std::move(inputQueue), std::move(outputQueue)));
+}
+
+V4L2ImageProcessor::V4L2ImageProcessor(scoped_refptr<V4L2Device> device,
+                                       scoped_refptr<V4L2Queue> inputQueue,
+                                       scoped_refptr<V4L2Queue> outputQueue)
+      : mDevice(std::move(device)),
+        mInputQueue(std::move(inputQueue)),
+        mOutputQueue(std::move(outputQueue)) {}
+
+V4L2ImageProcessor::~V4L2ImageProcessor() {
+    ALOGV("%s()", __func__);
+
+    reset();
+}
+
+bool V4L2ImageProcessor::convert(int inputFd, const VideoFrameLayout& inputLayout, int outputFd,
+                                 const VideoFrameLayout& outputLayout) {
+    if (!configure(inputLayout, outputLayout)) {
+        return false;
+    }
+
+    std::optional<V4L2WritableBufferRef> inputBuffer = mInputQueue->getFreeBuffer();
+    std::optional<V4L2WritableBufferRef> outputBuffer = mOutputQueue->getFreeBuffer();
+    if (!inputBuffer || !outputBuffer) {
+        ALOGE("Failed to get free buffers from device queues");
+        return false;
+    }
+
+    inputBuffer->setPlaneSize(0, mInputBufferSize);
+    inputBuffer->setPlaneBytesUsed(0, mInputBufferSize);
+    outputBuffer->setPlaneSize(0, mOutputBufferSize);
+    if (!std::move(*inputBuffer).queueDMABuf({inputFd}) ||
+        !std::move(*outputBuffer).queueDMABuf({outputFd})) {
+        ALOGE("Failed to queue buffers using QueueDMABuf");
+        reset();
+        return false;
+    }
+
+    // Both buffers need to be dequeued before the next conversion, the output buffer is usually
+    // the last one to be done.
+    bool inputDone = false;
+    bool outputDone = false;
+    while (!inputDone || !outputDone) {
+        bool eventPending = false;
+        if (!mDevice->poll(true, &eventPending, kConvertTimeoutMs) ||
+            !dequeueIfNotDone(mInputQueue.get(), &inputDone) ||
+            !dequeueIfNotDone(mOutputQueue.get(), &outputDone)) {
+            ALOGE("Failed to wait for the conversion to complete");
+            reset();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool V4L2ImageProcessor::configure(const VideoFrameLayout& inputLayout,
+                                   const VideoFrameLayout& outputLayout) {
+    if (mInputLayout && mOutputLayout && isSameLayout(*mInputLayout, inputLayout) &&
+        isSameLayout(*mOutputLayout, outputLayout)) {
+        return true;
+    }
+
+    ALOGV("%s(): %s %s -> %s %s", __func__, videoPixelFormatToString(inputLayout.mFormat).c_str(),
+          toString(inputLayout.mCodedSize).c_str(),
+          videoPixelFormatToString(outputLayout.mFormat).c_str(),
+          toString(outputLayout.mCodedSize).c_str());
+    reset();
+
+    std::optional<size_t> inputBufferSize = configureQueue(mInputQueue.get(), inputLayout);
+    std::optional<size_t> outputBufferSize = configureQueue(mOutputQueue.get(), outputLayout);
+    if (!inputBufferSize || !outputBufferSize) {
+        return false;
+    }
+
+    // Frames are converted without scaling, into the top-left corner of the output frame.
+    if (inputLayout.mCodedSize != outputLayout.mCodedSize) {
+        struct v4l2_selection selection_arg;
+        memset(&selection_arg, 0, sizeof(selection_arg));
+        selection_arg.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        selection_arg.target = V4L2_SEL_TGT_COMPOSE;
+        selection_arg.r.width = inputLayout.mCodedSize.width;
+        selection_arg.r.height = inputLayout.mCodedSize.height;
+        if (mDevice->ioctl(VIDIOC_S_SELECTION, &selection_arg) != 0 ||
+            selection_arg.r.left != 0 || selection_arg.r.top != 0 ||
+            static_cast<int>(selection_arg.r.width) != inputLayout.mCodedSize.width ||
+            static_cast<int>(selection_arg.r.height) != inputLayout.mCodedSize.height) {
+            ALOGV("Failed to compose %s frames into %s frames",
+                  toString(inputLayout.mCodedSize).c_str(),
+                  toString(outputLayout.mCodedSize).c_str());
+            return false;
+        }
+    }
+
+    if (mInputQueue->allocateBuffers(1, V4L2_MEMORY_DMABUF) == 0 ||
+        mOutputQueue->allocateBuffers(1, V4L2_MEMORY_DMABUF) == 0) {
+        ALOGE("Failed to allocate device buffers");
+        reset();
+        return false;
+    }
+
+    if (!mInputQueue->streamon() || !mOutputQueue->streamon()) {
+        ALOGE("Failed to start streaming");
+        reset();
+        return false;
+    }
+
+    mInputLayout = inputLayout;
+    mOutputLayout = outputLayout;
+    mInputBufferSize = *inputBufferSize;
+    mOutputBufferSize = *outputBufferSize;
+    return true;
+}
+
+std::optional<size_t> V4L2ImageProcessor::configureQueue(V4L2Queue* queue,
+                                                         const VideoFrameLayout& layout) {
+    std::optional<Fourcc> fourcc = Fourcc::fromVideoPixelFormat(layout.mFormat, true);
+    if (!fourcc || layout.mPlanes.empty()) {
+        return std::nullopt;
+    }
+
+    std::optional<struct v4l2_format> format =
+            queue->setFormat(fourcc->toV4L2PixFmt(), layout.mCodedSize, 0, layout.mPlanes[0].mStride);
+    if (!format) {
+        ALOGV("Failed to set format to %s", fourcc->toString().c_str());
+        return std::nullopt;
+    }
+
+    // Frames are imported as is, so the device needs to agree on the layout of the planes.
+    std::optional<VideoFrameLayout> deviceLayout = V4L2Device::v4L2FormatToVideoFrameLayout(*format);
+    if (!deviceLayout || !isSameLayout(*deviceLayout, layout)) {
+        ALOGV("Device doesn't support the layout of %s frames", fourcc->toString().c_str());
+        return std::nullopt;
+    }
+
+    return format->fmt.pix_mp.plane_fmt[0].sizeimage;
+}
+
+void V4L2ImageProcessor::reset() {
+    mInputLayout.reset();
+    mOutputLayout.reset();
+
+    for (V4L2Queue* queue : {mInputQueue.get(), mOutputQueue.get()}) {
+        if (queue->allocatedBuffersCount() == 0) continue;
+        if (!queue->streamoff()) {
+            ALOGE("Failed to stop streaming");
+        }
+        queue->deallocateBuffers();
+    }
+}
+
+}  // namespace android
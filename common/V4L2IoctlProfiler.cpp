@@ -0,0 +1,145 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "V4L2IoctlProfiler"
+
+#include <v4l2_codec2/common/V4L2IoctlProfiler.h>
+
+#include <inttypes.h>
+#include <linux/videodev2.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include <base/strings/stringprintf.h>
+#include <cutils/properties.h>
+
+namespace android {
+namespace {
+
+// The latencies are bucketed by powers of two microseconds: bucket 0 holds the ioctls which took
+// less than 1us, bucket i the ones which took [2^(i-1), 2^i)us, and the last bucket all the ones
+// which took 2^(kNumBuckets-2)us (~0.5s) or more.
+constexpr size_t kNumBuckets = 21;
+
+struct ProfiledIoctl {
+    const int request;
+    const char* const name;
+
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> totalUs{0};
+    std::atomic<uint64_t> maxUs{0};
+    std::atomic<uint64_t> buckets[kNumBuckets] = {};
+};
+
+// The ioctls which aren't listed here are accounted together in the last entry. The request codes
+// are stored as the int passed to V4L2Device::ioctl().
+ProfiledIoctl sIoctls[] = {
+        {static_cast<int>(VIDIOC_QBUF), "QBUF"},
+        {static_cast<int>(VIDIOC_DQBUF), "DQBUF"},
+        {static_cast<int>(VIDIOC_S_EXT_CTRLS), "S_EXT_CTRLS"},
+        {static_cast<int>(VIDIOC_G_FMT), "G_FMT"},
+        {static_cast<int>(VIDIOC_REQBUFS), "REQBUFS"},
+        {static_cast<int>(VIDIOC_STREAMON), "STREAMON"},
+        {0, "other"},
+};
+constexpr size_t kNumIoctls = sizeof(sIoctls) / sizeof(sIoctls[0]);
+
+ProfiledIoctl& getProfiledIoctl(int request) {
+    for (size_t i = 0; i < kNumIoctls - 1; i++) {
+        if (sIoctls[i].request == request) return sIoctls[i];
+    }
+    return sIoctls[kNumIoctls - 1];
+}
+
+size_t getBucket(uint64_t latencyUs) {
+    size_t bucket = 0;
+    while (latencyUs > 0 && bucket < kNumBuckets - 1) {
+        latencyUs >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// The upper bound of |bucket| in microseconds.
+uint64_t getBucketLimitUs(size_t bucket) {
+    return static_cast<uint64_t>(1) << bucket;
+}
+
+// Get the upper bound of the bucket holding the |percentile| of the samples.
+uint64_t getPercentileUs(const uint64_t buckets[kNumBuckets], uint64_t count, size_t percentile) {
+    const uint64_t rank = (count * percentile + 99) / 100;
+    uint64_t accumulated = 0;
+    for (size_t i = 0; i < kNumBuckets; i++) {
+        accumulated += buckets[i];
+        if (accumulated >= rank) return getBucketLimitUs(i);
+    }
+    return getBucketLimitUs(kNumBuckets - 1);
+}
+
+}  // namespace
+
+// static
+bool V4L2IoctlProfiler::isEnabled() {
+    static const bool kEnabled = property_get_bool("ro.vendor.v4l2_codec2.ioctl_profiler", false);
+    return kEnabled;
+}
+
+// static
+void V4L2IoctlProfiler::record(int request, ::base::TimeDelta latency) {
+    const uint64_t latencyUs =
+            static_cast<uint64_t>(std::max<int64_t>(latency.InMicroseconds(), 0));
+    ProfiledIoctl& ioctl = getProfiledIoctl(request);
+
+    ioctl.count.fetch_add(1, std::memory_order_relaxed);
+    ioctl.totalUs.fetch_add(latencyUs, std::memory_order_relaxed);
+    ioctl.buckets[getBucket(latencyUs)].fetch_add(1, std::memory_order_relaxed);
+    uint64_t maxUs = ioctl.maxUs.load(std::memory_order_relaxed);
+    while (latencyUs > maxUs &&
+           !ioctl.maxUs.compare_exchange_weak(maxUs, latencyUs, std::memory_order_relaxed)) {
+    }
+}
+
+// static
+std::string V4L2IoctlProfiler::dump() {
+    if (!isEnabled()) return "";
+
+    std::string dump = "V4L2 ioctls (latencies in us, histogram buckets are powers of two):\n";
+    for (const ProfiledIoctl& ioctl : sIoctls) {
+        // The counters are read one by one while other threads might record samples, so they
+        // might be slightly inconsistent with each other.
+        uint64_t buckets[kNumBuckets];
+        uint64_t count = 0;
+        for (size_t i = 0; i < kNumBuckets; i++) {
+            buckets[i] = ioctl.buckets[i].load(std::memory_order_relaxed);
+            count += buckets[i];
+        }
+        if (count == 0) continue;
+
+        const uint64_t totalUs = ioctl.totalUs.load(std::memory_order_relaxed);
+        ::base::StringAppendF(&dump,
+                              "  %s: count %" PRIu64 ", mean %" PRIu64 ", p50 <%" PRIu64
+                              ", p99 <%" PRIu64 ", max %" PRIu64 "\n    histogram:",
+                              ioctl.name, ioctl.count.load(std::memory_order_relaxed),
+                              totalUs / count, getPercentileUs(buckets, count, 50),
+                              getPercentileUs(buckets, count, 99),
+                              ioctl.maxUs.load(std::memory_order_relaxed));
+        for (size_t i = 0; i < kNumBuckets; i++) {
+            if (buckets[i] == 0) continue;
+            if (i == kNumBuckets - 1) {
+                ::base::StringAppendF(&dump, " >=%" PRIu64 ":%" PRIu64, getBucketLimitUs(i - 1),
+                                      buckets[i]);
+            } else {
+                ::base::StringAppendF(&dump, " <%" PRIu64 ":%" PRIu64, getBucketLimitUs(i),
+                                      buckets[i]);
+            }
+        }
+        dump += "\n";
+    }
+    return dump;
+}
+
+}  // namespace android
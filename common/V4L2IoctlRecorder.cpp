@@ -0,0 +1,197 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "V4L2IoctlRecorder"
+
+#include <v4l2_codec2/common/V4L2IoctlRecorder.h>
+
+#include <errno.h>
+#include <linux/videodev2.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include <base/strings/stringprintf.h>
+#include <cutils/properties.h>
+#include <log/log.h>
+
+namespace android {
+namespace {
+
+// The default maximum size of a trace, which is written for each session of each codec.
+constexpr int32_t kDefaultMaxTraceMb = 256;
+
+void append(std::vector<uint8_t>* payload, const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    payload->insert(payload->end(), bytes, bytes + size);
+}
+
+bool isBufferIoctl(int request) {
+    return request == static_cast<int>(VIDIOC_QBUF) || request == static_cast<int>(VIDIOC_DQBUF) ||
+           request == static_cast<int>(VIDIOC_QUERYBUF) ||
+           request == static_cast<int>(VIDIOC_PREPARE_BUF);
+}
+
+bool isExtCtrlsIoctl(int request) {
+    return request == static_cast<int>(VIDIOC_S_EXT_CTRLS) ||
+           request == static_cast<int>(VIDIOC_G_EXT_CTRLS) ||
+           request == static_cast<int>(VIDIOC_TRY_EXT_CTRLS);
+}
+
+}  // namespace
+
+// static
+std::unique_ptr<V4L2IoctlRecorder> V4L2IoctlRecorder::create(uint32_t deviceType,
+                                                             uint32_t pixFmt) {
+    char dir[PROPERTY_VALUE_MAX];
+    if (property_get("ro.vendor.v4l2_codec2.ioctl_trace_dir", dir, "") <= 0) return nullptr;
+
+    static std::atomic<uint32_t> sNextTrace{0};
+    const std::string path =
+            ::base::StringPrintf("%s/v4l2_%d_%u.trace", dir, getpid(), sNextTrace.fetch_add(1));
+    FILE* file = fopen(path.c_str(), "wbe");
+    if (!file) {
+        ALOGE("Failed to create the ioctl trace %s: %s", path.c_str(), strerror(errno));
+        return nullptr;
+    }
+
+    V4L2TraceHeader header = {};
+    memcpy(header.magic, kV4L2TraceMagic, sizeof(header.magic));
+    header.version = kV4L2TraceVersion;
+    header.deviceType = deviceType;
+    header.pixFmt = pixFmt;
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        ALOGE("Failed to write the ioctl trace %s", path.c_str());
+        fclose(file);
+        return nullptr;
+    }
+
+    static const size_t kMaxBytes = static_cast<size_t>(std::max(
+            property_get_int32("ro.vendor.v4l2_codec2.ioctl_trace_max_mb", kDefaultMaxTraceMb),
+            0)) << 20;
+    ALOGI("Recording the ioctls to %s", path.c_str());
+    return std::unique_ptr<V4L2IoctlRecorder>(new V4L2IoctlRecorder(path, file, kMaxBytes));
+}
+
+V4L2IoctlRecorder::V4L2IoctlRecorder(std::string path, FILE* file, size_t maxBytes)
+      : mPath(std::move(path)),
+        mStartTime(::base::TimeTicks::Now()),
+        mMaxBytes(maxBytes),
+        mFile(file),
+        mBytesWritten(sizeof(V4L2TraceHeader)) {}
+
+V4L2IoctlRecorder::~V4L2IoctlRecorder() {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (mFile) fclose(mFile);
+}
+
+std::vector<uint8_t> V4L2IoctlRecorder::serializeArgument(int request, const void* arg) {
+    std::vector<uint8_t> payload;
+    if (!arg) return payload;
+    append(&payload, arg, _IOC_SIZE(request));
+
+    if (isBufferIoctl(request)) {
+        const auto* buffer = static_cast<const struct v4l2_buffer*>(arg);
+        if (!V4L2_TYPE_IS_MULTIPLANAR(buffer->type) || !buffer->m.planes) return payload;
+        append(&payload, buffer->m.planes, buffer->length * sizeof(struct v4l2_plane));
+
+        if (request != static_cast<int>(VIDIOC_QBUF) ||
+            buffer->type != V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE ||
+            buffer->memory != V4L2_MEMORY_MMAP) {
+            return payload;
+        }
+        std::lock_guard<std::mutex> lock(mLock);
+        for (uint32_t i = 0; i < buffer->length; i++) {
+            const struct v4l2_plane& plane = buffer->m.planes[i];
+            const auto it = mMappings.find(plane.m.mem_offset);
+            const uint32_t size =
+                    it != mMappings.end()
+                            ? static_cast<uint32_t>(std::min<size_t>(plane.bytesused,
+                                                                     it->second.length))
+                            : 0;
+            append(&payload, &size, sizeof(size));
+            if (size > 0) append(&payload, it->second.addr, size);
+        }
+    } else if (isExtCtrlsIoctl(request)) {
+        const auto* ctrls = static_cast<const struct v4l2_ext_controls*>(arg);
+        if (!ctrls->controls) return payload;
+        append(&payload, ctrls->controls, ctrls->count * sizeof(struct v4l2_ext_control));
+        for (uint32_t i = 0; i < ctrls->count; i++) {
+            const struct v4l2_ext_control& ctrl = ctrls->controls[i];
+            if (ctrl.size > 0) append(&payload, ctrl.ptr, ctrl.size);
+        }
+    }
+    return payload;
+}
+
+void V4L2IoctlRecorder::recordIoctl(int request, const std::vector<uint8_t>& payload,
+                                    ::base::TimeTicks start, ::base::TimeDelta duration, int ret,
+                                    int error) {
+    V4L2TraceRecord record = {};
+    record.kind = V4L2TraceRecordKind::kIoctl;
+    record.request = static_cast<uint32_t>(request);
+    record.startNs = (start - mStartTime).InNanoseconds();
+    record.durationNs = duration.InNanoseconds();
+    record.ret = ret;
+    record.error = ret < 0 ? error : 0;
+    record.payloadSize = static_cast<uint32_t>(payload.size());
+    write(record, payload);
+}
+
+void V4L2IoctlRecorder::recordPoll(uint32_t deviceEvents, ::base::TimeTicks start,
+                                   ::base::TimeDelta duration, int ret, int error) {
+    V4L2TraceRecord record = {};
+    record.kind = V4L2TraceRecordKind::kPoll;
+    record.request = deviceEvents;
+    record.startNs = (start - mStartTime).InNanoseconds();
+    record.durationNs = duration.InNanoseconds();
+    record.ret = ret;
+    record.error = ret < 0 ? error : 0;
+    write(record, {});
+}
+
+void V4L2IoctlRecorder::onMmap(void* addr, size_t length, uint32_t offset) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mMappings[offset] = {static_cast<const uint8_t*>(addr), length};
+}
+
+void V4L2IoctlRecorder::onMunmap(void* addr) {
+    std::lock_guard<std::mutex> lock(mLock);
+    for (auto it = mMappings.begin(); it != mMappings.end(); ++it) {
+        if (it->second.addr == addr) {
+            mMappings.erase(it);
+            return;
+        }
+    }
+}
+
+void V4L2IoctlRecorder::write(const V4L2TraceRecord& record, const std::vector<uint8_t>& payload) {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (!mFile) return;
+
+    const size_t recordBytes = sizeof(record) + payload.size();
+    if (mMaxBytes > 0 && mBytesWritten + recordBytes > mMaxBytes) {
+        // The trace ends at the last complete record, which the replay stops at.
+        ALOGW("The ioctl trace %s reached %zu bytes, stopping the recording", mPath.c_str(),
+              mMaxBytes);
+        fclose(mFile);
+        mFile = nullptr;
+        return;
+    }
+    mBytesWritten += recordBytes;
+
+    if (fwrite(&record, sizeof(record), 1, mFile) != 1 ||
+        (!payload.empty() && fwrite(payload.data(), payload.size(), 1, mFile) != 1)) {
+        // The trace is truncated at this record, which the replay stops at.
+        ALOGE("Failed to write the ioctl trace %s, stopping the recording", mPath.c_str());
+        fclose(mFile);
+        mFile = nullptr;
+    }
+}
+
+}  // namespace android
@@ -0,0 +1,115 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "V4L2MediaDevice"
+
+#include <v4l2_codec2/common/V4L2MediaDevice.h>
+
+#include <fcntl.h>
+#include <linux/media.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <base/posix/eintr_wrapper.h>
+#include <base/strings/stringprintf.h>
+#include <log/log.h>
+
+#include <v4l2_codec2/common/V4L2Device.h>
+
+namespace android {
+namespace {
+
+// Media devices are registered as /dev/mediaX.
+constexpr char kMediaDevicePattern[] = "/dev/media";
+// The number of media device nodes probed, like the enumeration of video device nodes.
+constexpr int kMaxNumMediaDevices = 16;
+
+// Returns whether the media device |mediaFd| exposes a V4L2 video interface with the device
+// numbers |major| and |minor|.
+bool hasVideoInterface(int mediaFd, uint32_t major, uint32_t minor) {
+    struct media_v2_topology topology;
+    memset(&topology, 0, sizeof(topology));
+    if (HANDLE_EINTR(ioctl(mediaFd, MEDIA_IOC_G_TOPOLOGY, &topology)) != 0) return false;
+
+    // The interfaces are fetched by a second call, once we know how many there are.
+    std::vector<struct media_v2_interface> interfaces(topology.num_interfaces);
+    if (interfaces.empty()) return false;
+    topology.ptr_interfaces = reinterpret_cast<uintptr_t>(interfaces.data());
+    if (HANDLE_EINTR(ioctl(mediaFd, MEDIA_IOC_G_TOPOLOGY, &topology)) != 0) return false;
+
+    interfaces.resize(std::min<size_t>(interfaces.size(), topology.num_interfaces));
+    for (const struct media_v2_interface& interface : interfaces) {
+        if (interface.intf_type == MEDIA_INTF_T_V4L_VIDEO &&
+            interface.devnode.major == major && interface.devnode.minor == minor) {
+            return true;
+        }
+    }
+    return false;
+}
+
+}  // namespace
+
+// static
+std::unique_ptr<V4L2MediaDevice> V4L2MediaDevice::Open(V4L2Device* device) {
+    ALOGV("%s()", __func__);
+
+    uint32_t major, minor;
+    if (!device->getDeviceNumber(&major, &minor)) return nullptr;
+
+    for (int i = 0; i < kMaxNumMediaDevices; ++i) {
+        const std::string path = ::base::StringPrintf("%s%d", kMediaDevicePattern, i);
+        ::base::ScopedFD mediaFd(HANDLE_EINTR(open(path.c_str(), O_RDWR | O_CLOEXEC)));
+        if (!mediaFd.is_valid()) continue;
+        if (!hasVideoInterface(mediaFd.get(), major, minor)) continue;
+
+        ALOGV("Found media device %s for video device %u:%u", path.c_str(), major, minor);
+        std::unique_ptr<V4L2MediaDevice> mediaDevice(new V4L2MediaDevice(std::move(mediaFd)));
+        // Media devices of drivers without request support fail to allocate requests.
+        if (!mediaDevice->allocateRequest().is_valid()) {
+            ALOGE("Media device %s doesn't support requests", path.c_str());
+            return nullptr;
+        }
+        return mediaDevice;
+    }
+
+    ALOGE("No media device found for video device %u:%u", major, minor);
+    return nullptr;
+}
+
+V4L2MediaDevice::V4L2MediaDevice(::base::ScopedFD mediaFd) : mMediaFd(std::move(mediaFd)) {}
+
+V4L2MediaDevice::~V4L2MediaDevice() = default;
+
+::base::ScopedFD V4L2MediaDevice::allocateRequest() {
+    int requestFd = -1;
+    if (HANDLE_EINTR(ioctl(mMediaFd.get(), MEDIA_IOC_REQUEST_ALLOC, &requestFd)) != 0) {
+        ALOGE("ioctl() failed: MEDIA_IOC_REQUEST_ALLOC");
+        return ::base::ScopedFD();
+    }
+    return ::base::ScopedFD(requestFd);
+}
+
+// static
+bool V4L2MediaDevice::queueRequest(int requestFd) {
+    if (HANDLE_EINTR(ioctl(requestFd, MEDIA_REQUEST_IOC_QUEUE)) != 0) {
+        ALOGE("ioctl() failed: MEDIA_REQUEST_IOC_QUEUE");
+        return false;
+    }
+    return true;
+}
+
+// static
+bool V4L2MediaDevice::reinitRequest(int requestFd) {
+    if (HANDLE_EINTR(ioctl(requestFd, MEDIA_REQUEST_IOC_REINIT)) != 0) {
+        ALOGE("ioctl() failed: MEDIA_REQUEST_IOC_REINIT");
+        return false;
+    }
+    return true;
+}
+
+}  // namespace android
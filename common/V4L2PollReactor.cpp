@@ -0,0 +1,140 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "V4L2PollReactor"
+
+#include <v4l2_codec2/common/V4L2PollReactor.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/epoll.h>
+
+#include <base/bind.h>
+#include <base/posix/eintr_wrapper.h>
+#include <log/log.h>
+
+#include <v4l2_codec2/common/ThreadPolicy.h>
+
+namespace android {
+namespace {
+
+// The events an armed fd is polled for, matching the events polled by V4L2Device::poll().
+constexpr uint32_t kArmedEvents = EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLPRI | EPOLLONESHOT;
+
+}  // namespace
+
+// static
+V4L2PollReactor* V4L2PollReactor::get() {
+    // The reactor is never destroyed, as its clients might still be polling on process exit.
+    static V4L2PollReactor* const sReactor = []() -> V4L2PollReactor* {
+        V4L2PollReactor* reactor = new V4L2PollReactor();
+        if (!reactor->initialize()) {
+            delete reactor;
+            return nullptr;
+        }
+        return reactor;
+    }();
+    return sReactor;
+}
+
+bool V4L2PollReactor::initialize() {
+    ALOGV("%s()", __func__);
+
+    mEpollFd.reset(epoll_create1(EPOLL_CLOEXEC));
+    if (!mEpollFd.is_valid()) {
+        ALOGE("Failed to create epoll instance (errno: %d)", errno);
+        return false;
+    }
+
+    if (!mReactorThread.Start()) {
+        ALOGE("Failed to start reactor thread");
+        return false;
+    }
+    // The reactor serves the devices of all the sessions, so it runs with the default policy of
+    // the decoders, whose sessions are the most sensitive to jank.
+    mReactorThread.task_runner()->PostTask(
+            FROM_HERE, ::base::BindOnce([]() {
+                ThreadPolicy::getDefault(V4L2Device::Type::kDecoder).applyToCurrentThread();
+            }));
+    mReactorThread.task_runner()->PostTask(
+            FROM_HERE, ::base::BindOnce(&V4L2PollReactor::reactorTask, ::base::Unretained(this)));
+    return true;
+}
+
+std::optional<V4L2PollReactor::Token> V4L2PollReactor::add(
+        int fd, scoped_refptr<::base::SequencedTaskRunner> taskRunner, EventCallback eventCallback,
+        ::base::RepeatingClosure errorCallback) {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (mFailed) return std::nullopt;
+
+    const Token token = mNextToken++;
+    // The fd is added disarmed, with no event to be reported until arm() is called.
+    struct epoll_event event = {.events = 0, .data = {.u64 = token}};
+    if (epoll_ctl(mEpollFd.get(), EPOLL_CTL_ADD, fd, &event) != 0) {
+        ALOGE("Failed to add fd %d to epoll instance (errno: %d)", fd, errno);
+        return std::nullopt;
+    }
+
+    ALOGV("%s(): fd %d registered as %" PRIu64, __func__, fd, token);
+    mRegistrations.emplace(token, Registration{fd, std::move(taskRunner), std::move(eventCallback),
+                                               std::move(errorCallback)});
+    return token;
+}
+
+void V4L2PollReactor::remove(Token token) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    auto it = mRegistrations.find(token);
+    if (it == mRegistrations.end()) return;
+
+    ALOGV("%s(): fd %d unregistered", __func__, it->second.mFd);
+    if (epoll_ctl(mEpollFd.get(), EPOLL_CTL_DEL, it->second.mFd, nullptr) != 0) {
+        ALOGW("Failed to remove fd %d from epoll instance (errno: %d)", it->second.mFd, errno);
+    }
+    mRegistrations.erase(it);
+}
+
+bool V4L2PollReactor::arm(Token token) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    auto it = mRegistrations.find(token);
+    if (it == mRegistrations.end()) return false;
+
+    struct epoll_event event = {.events = kArmedEvents, .data = {.u64 = token}};
+    if (epoll_ctl(mEpollFd.get(), EPOLL_CTL_MOD, it->second.mFd, &event) != 0) {
+        ALOGE("Failed to arm fd %d (errno: %d)", it->second.mFd, errno);
+        return false;
+    }
+    return true;
+}
+
+void V4L2PollReactor::reactorTask() {
+    ALOG_ASSERT(mReactorThread.task_runner()->RunsTasksInCurrentSequence());
+
+    struct epoll_event events[kMaxEvents];
+    while (true) {
+        const int numEvents = HANDLE_EINTR(epoll_wait(mEpollFd.get(), events, kMaxEvents, -1));
+        std::lock_guard<std::mutex> lock(mLock);
+        if (numEvents < 0) {
+            ALOGE("epoll_wait() failed (errno: %d), calling error callbacks", errno);
+            for (const auto& entry : mRegistrations) {
+                entry.second.mTaskRunner->PostTask(FROM_HERE, entry.second.mErrorCallback);
+            }
+            mFailed = true;
+            return;
+        }
+
+        for (int i = 0; i < numEvents; ++i) {
+            // The fd might have been removed since epoll_wait() returned.
+            auto it = mRegistrations.find(events[i].data.u64);
+            if (it == mRegistrations.end()) continue;
+
+            it->second.mTaskRunner->PostTask(
+                    FROM_HERE, ::base::BindOnce(it->second.mEventCallback, events[i].events));
+        }
+    }
+}
+
+}  // namespace android
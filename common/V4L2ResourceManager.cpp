@@ -0,0 +1,180 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "V4L2ResourceManager"
+
+#include <v4l2_codec2/common/V4L2ResourceManager.h>
+
+#include <inttypes.h>
+#include <linux/videodev2.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+
+#include <base/strings/stringprintf.h>
+#include <cutils/properties.h>
+#include <log/log.h>
+
+namespace android {
+namespace {
+
+// The frame rate assumed for the profiles which don't report their maximum frame rate, which
+// includes all the decoder profiles.
+constexpr uint32_t kDefaultMaxFrameRate = 30;
+
+// The pixel formats of the decoder profiles the budget of the decoders is derived from.
+constexpr uint32_t kDecodePixelFormats[] = {V4L2_PIX_FMT_H264, V4L2_PIX_FMT_VP8, V4L2_PIX_FMT_VP9,
+                                            V4L2_PIX_FMT_HEVC, V4L2_PIX_FMT_AV1};
+
+uint64_t getNumMacroblocks(const ui::Size& size) {
+    return static_cast<uint64_t>((size.width + 15) / 16) * ((size.height + 15) / 16);
+}
+
+const char* typeToString(V4L2Device::Type type) {
+    switch (type) {
+    case V4L2Device::Type::kDecoder:
+        return "decoder";
+    case V4L2Device::Type::kEncoder:
+        return "encoder";
+    case V4L2Device::Type::kImageProcessor:
+        return "image processor";
+    }
+    return "unknown";
+}
+
+}  // namespace
+
+V4L2ResourceManager::Reservation::Reservation(V4L2ResourceManager* manager, V4L2Device::Type type,
+                                              uint64_t macroblocksPerSecond)
+      : mManager(manager), mType(type), mMacroblocksPerSecond(macroblocksPerSecond) {}
+
+V4L2ResourceManager::Reservation::~Reservation() {
+    mManager->release(mType, mMacroblocksPerSecond);
+}
+
+bool V4L2ResourceManager::Reservation::update(uint64_t macroblocksPerSecond) {
+    if (!mManager->resize(mType, mMacroblocksPerSecond, macroblocksPerSecond)) return false;
+    mMacroblocksPerSecond = macroblocksPerSecond;
+    return true;
+}
+
+// static
+V4L2ResourceManager* V4L2ResourceManager::get() {
+    // The manager is never destroyed, as reservations might still be released on exit.
+    static V4L2ResourceManager* const sManager = new V4L2ResourceManager();
+    return sManager;
+}
+
+// static
+bool V4L2ResourceManager::isEnabled() {
+    static const bool kEnabled =
+            property_get_bool("ro.vendor.v4l2_codec2.admission_control", false);
+    return kEnabled;
+}
+
+// static
+uint64_t V4L2ResourceManager::getMacroblocksPerSecond(const ui::Size& size, float frameRate) {
+    return static_cast<uint64_t>(
+            std::ceil(getNumMacroblocks(size) * std::max(static_cast<double>(frameRate), 1.0)));
+}
+
+std::unique_ptr<V4L2ResourceManager::Reservation> V4L2ResourceManager::reserve(
+        V4L2Device::Type type, uint64_t macroblocksPerSecond) {
+    ALOGV("%s(type=%s, macroblocksPerSecond=%" PRIu64 ")", __func__, typeToString(type),
+          macroblocksPerSecond);
+
+    if (!resize(type, 0, macroblocksPerSecond)) return nullptr;
+
+    std::lock_guard<std::mutex> lock(mLock);
+    getBudgetLocked(type).mNumReservations++;
+    return std::unique_ptr<Reservation>(new Reservation(this, type, macroblocksPerSecond));
+}
+
+std::string V4L2ResourceManager::dump() {
+    if (!isEnabled()) return "";
+
+    std::lock_guard<std::mutex> lock(mLock);
+    std::string dump = "V4L2 admission control (macroblocks per second):\n";
+    for (const auto& [type, budget] : mBudgets) {
+        ::base::StringAppendF(&dump, "  %s: %zu sessions, used %" PRIu64 " of %" PRIu64 "\n",
+                              typeToString(type), budget.mNumReservations, budget.mUsed,
+                              budget.mCapacity);
+    }
+    return dump;
+}
+
+V4L2ResourceManager::Budget& V4L2ResourceManager::getBudgetLocked(V4L2Device::Type type) {
+    auto it = mBudgets.find(type);
+    if (it == mBudgets.end()) {
+        it = mBudgets.emplace(type, Budget()).first;
+        it->second.mCapacity = computeCapacity(type);
+        ALOGI("Budget of the %s sessions: %" PRIu64 " macroblocks per second", typeToString(type),
+              it->second.mCapacity);
+    }
+    return it->second;
+}
+
+bool V4L2ResourceManager::resize(V4L2Device::Type type, uint64_t oldShare, uint64_t newShare) {
+    std::lock_guard<std::mutex> lock(mLock);
+    Budget& budget = getBudgetLocked(type);
+    const uint64_t used = budget.mUsed - oldShare + newShare;
+    // A session is always admitted when the others are idle, so a session larger than the whole
+    // budget can still run on its own.
+    if (newShare > oldShare && budget.mCapacity > 0 && used > budget.mCapacity &&
+        budget.mUsed > oldShare) {
+        ALOGW("Rejecting %" PRIu64 " macroblocks per second of %s work, %" PRIu64 " of %" PRIu64
+              " already in use",
+              newShare - oldShare, typeToString(type), budget.mUsed, budget.mCapacity);
+        return false;
+    }
+    budget.mUsed = used;
+    return true;
+}
+
+void V4L2ResourceManager::release(V4L2Device::Type type, uint64_t share) {
+    std::lock_guard<std::mutex> lock(mLock);
+    Budget& budget = getBudgetLocked(type);
+    budget.mUsed -= share;
+    budget.mNumReservations--;
+}
+
+// static
+uint64_t V4L2ResourceManager::computeCapacity(V4L2Device::Type type) {
+    const char* property = (type == V4L2Device::Type::kDecoder)
+                                   ? "ro.vendor.v4l2_codec2.decode_max_macroblocks_per_second"
+                                   : "ro.vendor.v4l2_codec2.encode_max_macroblocks_per_second";
+    const int64_t configured = property_get_int64(property, 0);
+    if (configured > 0) return static_cast<uint64_t>(configured);
+
+    // Without a SoC configuration, assume the device handles a single session at the largest
+    // resolution and frame rate of its profiles.
+    scoped_refptr<V4L2Device> device = V4L2Device::create();
+    if (!device) {
+        ALOGE("Failed to create V4L2 device, the %s sessions are not limited", typeToString(type));
+        return 0;
+    }
+    uint64_t capacity = 0;
+    if (type == V4L2Device::Type::kDecoder) {
+        for (const auto& profile : device->getSupportedDecodeProfiles(
+                     std::size(kDecodePixelFormats), kDecodePixelFormats)) {
+            capacity = std::max(capacity, getMacroblocksPerSecond(profile.max_resolution,
+                                                                  kDefaultMaxFrameRate));
+        }
+    } else if (type == V4L2Device::Type::kEncoder) {
+        for (const auto& profile : device->getSupportedEncodeProfiles()) {
+            const float frameRate =
+                    (profile.max_framerate_denominator > 0)
+                            ? static_cast<float>(profile.max_framerate_numerator) /
+                                      profile.max_framerate_denominator
+                            : kDefaultMaxFrameRate;
+            capacity = std::max(capacity,
+                                getMacroblocksPerSecond(profile.max_resolution, frameRate));
+        }
+    }
+    return capacity;
+}
+
+}  // namespace android
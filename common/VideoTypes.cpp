@@ -21,6 +21,8 @@ const char* VideoCodecToString(VideoCodec codec) {
         return "VP9";
     case VideoCodec::HEVC:
         return "HEVC";
+    case VideoCodec::AV1:
+        return "AV1";
     }
 }
 
@@ -93,6 +95,8 @@ const char* HalPixelFormatToString(HalPixelFormat format) {
         return "YV12";
     case HalPixelFormat::NV12:
         return "NV12";
+    case HalPixelFormat::YCBCR_P010:
+        return "YCBCR_P010";
     }
 }
 
@@ -0,0 +1,146 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "WorkerPool"
+
+#include <v4l2_codec2/common/WorkerPool.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <cutils/properties.h>
+#include <log/log.h>
+
+namespace android {
+namespace {
+
+// The maximum length of a thread name, including the terminating null byte.
+constexpr size_t kMaxThreadNameLength = 16;
+
+std::mutex sBudgetLock;
+size_t sReservedThreads = 0;
+
+size_t getThreadBudget() {
+    static const size_t kThreadBudget = []() -> size_t {
+        const long numCores = sysconf(_SC_NPROCESSORS_ONLN);
+        const int32_t defaultBudget = std::max(static_cast<int32_t>(numCores) - 1, 0);
+        return static_cast<size_t>(std::max(
+                property_get_int32("ro.vendor.v4l2_codec2.worker_thread_budget", defaultBudget),
+                0));
+    }();
+    return kThreadBudget;
+}
+
+// Reserve up to |wanted| threads from the process-wide budget, returns the number of threads that
+// were actually reserved.
+size_t reserveThreads(size_t wanted) {
+    std::lock_guard<std::mutex> lock(sBudgetLock);
+    const size_t budget = getThreadBudget();
+    const size_t reserved = std::min(wanted, budget - std::min(budget, sReservedThreads));
+    sReservedThreads += reserved;
+    return reserved;
+}
+
+void releaseThreads(size_t count) {
+    std::lock_guard<std::mutex> lock(sBudgetLock);
+    ALOG_ASSERT(sReservedThreads >= count);
+    sReservedThreads -= count;
+}
+
+}  // namespace
+
+// static
+std::unique_ptr<WorkerPool> WorkerPool::Create(size_t maxThreads, const std::string& name) {
+    const size_t numThreads = reserveThreads(maxThreads);
+    ALOGV("%s(maxThreads=%zu, name=%s): reserved %zu threads", __func__, maxThreads, name.c_str(),
+          numThreads);
+    if (numThreads == 0) {
+        return nullptr;
+    }
+
+    std::unique_ptr<WorkerPool> pool(new WorkerPool(numThreads));
+    const std::string threadName = name.substr(0, kMaxThreadNameLength - 1);
+    for (size_t i = 0; i < numThreads; i++) {
+        pool->mThreads.emplace_back(&WorkerPool::workerLoop, pool.get());
+        pthread_setname_np(pool->mThreads.back().native_handle(), threadName.c_str());
+    }
+    return pool;
+}
+
+// static
+size_t WorkerPool::availableThreads() {
+    std::lock_guard<std::mutex> lock(sBudgetLock);
+    const size_t budget = getThreadBudget();
+    return budget - std::min(budget, sReservedThreads);
+}
+
+WorkerPool::WorkerPool(size_t numThreads) {
+    mThreads.reserve(numThreads);
+}
+
+WorkerPool::~WorkerPool() {
+    ALOGV("%s()", __func__);
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mQuit = true;
+    }
+    mJobsAvailable.notify_all();
+    for (auto& thread : mThreads) {
+        thread.join();
+    }
+    releaseThreads(mThreads.size());
+}
+
+void WorkerPool::parallelFor(size_t count, const std::function<void(size_t)>& job) {
+    if (count == 0) return;
+    if (count == 1) {
+        job(0);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mLock);
+    ALOG_ASSERT(mJob == nullptr, "parallelFor() is not re-entrant");
+    mJob = &job;
+    mNextJob = 0;
+    mJobCount = count;
+    mJobsAvailable.notify_all();
+
+    // The calling thread takes part in the work, then waits for the jobs picked by the workers.
+    runJobsLocked(lock);
+    mJobsDone.wait(lock, [this]() { return mNextJob == mJobCount && mRunningJobs == 0; });
+    mJob = nullptr;
+    mJobCount = 0;
+    mNextJob = 0;
+}
+
+void WorkerPool::workerLoop() {
+    std::unique_lock<std::mutex> lock(mLock);
+    while (true) {
+        mJobsAvailable.wait(lock, [this]() { return mQuit || mNextJob < mJobCount; });
+        if (mQuit) return;
+        runJobsLocked(lock);
+    }
+}
+
+void WorkerPool::runJobsLocked(std::unique_lock<std::mutex>& lock) {
+    while (mNextJob < mJobCount) {
+        const size_t index = mNextJob++;
+        const std::function<void(size_t)>* job = mJob;
+        mRunningJobs++;
+
+        lock.unlock();
+        (*job)(index);
+        lock.lock();
+
+        if (--mRunningJobs == 0 && mNextJob == mJobCount) {
+            mJobsDone.notify_all();
+        }
+    }
+}
+
+}  // namespace android
@@ -0,0 +1,52 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_CODED_STREAM_INFO_H
+#define ANDROID_V4L2_CODEC2_COMMON_CODED_STREAM_INFO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <initializer_list>
+
+#include <ui/Size.h>
+
+#include <v4l2_codec2/common/VideoTypes.h>
+
+namespace android {
+
+// The properties of a compressed stream sizing the output buffers of its decoder, parsed from the
+// stream headers before the decoder reports them.
+struct CodedStreamInfo {
+    // The size of the decoded frames, before the alignment of the decoder.
+    ui::Size codedSize;
+    // The number of frames in the decoded picture buffer (or of reference frames for VP8, VP9 and
+    // AV1).
+    size_t maxDpbFrames = 0;
+    // Whether the frames of the AV1 stream may carry film grain parameters, in which case the
+    // device outputs the frames with the grain applied, apart from their grain-free reference.
+    bool hasFilmGrain = false;
+    // The bit depth of the decoded frames, only parsed from the VP9 and AV1 headers.
+    uint32_t bitDepth = 8;
+};
+
+// Find the info of the stream of |codec| in |data|, from the H.264 or HEVC SPS, from the header
+// of the VP8 or VP9 key frame, or from the AV1 sequence header. Returns false if |data| doesn't
+// carry them.
+bool findCodedStreamInfo(VideoCodec codec, const uint8_t* data, size_t size,
+                         CodedStreamInfo* info);
+
+// The AV1 OBU types, see section 6.2.2 of the AV1 bitstream specification.
+constexpr uint32_t kAv1ObuSequenceHeader = 1;
+constexpr uint32_t kAv1ObuFrameHeader = 3;
+constexpr uint32_t kAv1ObuFrame = 6;
+
+// Find the first OBU whose type is one of |obuTypes| in the AV1 temporal unit |data|, and set
+// |*obu| and |*obuSize| to its payload. Returns false if there is none, or if |data| is malformed.
+bool findAv1Obu(const uint8_t* data, size_t size, std::initializer_list<uint32_t> obuTypes,
+                uint32_t* obuType, const uint8_t** obu, size_t* obuSize);
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_CODED_STREAM_INFO_H
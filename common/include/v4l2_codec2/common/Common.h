@@ -14,6 +14,7 @@
 #include <ui/Rect.h>
 #include <ui/Size.h>
 
+#include <v4l2_codec2/common/FixedVector.h>
 #include <v4l2_codec2/common/VideoPixelFormat.h>
 
 namespace android {
@@ -25,6 +26,13 @@ struct VideoFramePlane {
     size_t mSize = 0;
 };
 
+// The maximum number of planes of a video frame, which is VIDEO_MAX_PLANES for V4L2 buffers.
+constexpr size_t kMaxVideoFramePlanes = 8;
+
+// The planes and the file descriptors of a single video frame.
+using VideoFramePlanes = FixedVector<VideoFramePlane, kMaxVideoFramePlanes>;
+using VideoFrameFds = FixedVector<int, kMaxVideoFramePlanes>;
+
 // A video frame's layout, containing pixel format, size and layout of individual planes.
 struct VideoFrameLayout {
     VideoPixelFormat mFormat = VideoPixelFormat::UNKNOWN;
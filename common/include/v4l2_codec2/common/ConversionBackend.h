@@ -0,0 +1,36 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_CONVERSION_BACKEND_H
+#define ANDROID_V4L2_CODEC2_COMMON_CONVERSION_BACKEND_H
+
+#include <memory>
+
+#include <v4l2_codec2/common/Common.h>
+#include <v4l2_codec2/common/VideoPixelFormat.h>
+
+namespace android {
+
+// Interface of a hardware unit converting video frames between pixel formats on behalf of
+// FormatConverter, e.g. a 2D blitter or a V4L2 memory-to-memory image processor. Frames are passed
+// as dmabufs together with the layout of their planes, so no CPU access to the pixels is needed.
+class ConversionBackend {
+public:
+    virtual ~ConversionBackend() = default;
+
+    // Convert the |inputLayout.mCodedSize| area of the frame stored in |inputFd| into the top-left
+    // corner of the frame stored in |outputFd|, blocking until the conversion is done. The planes
+    // of both layouts are sorted by offset. Returns false if the conversion failed or isn't
+    // supported for the given layouts, the caller should convert the frame in software then.
+    virtual bool convert(int inputFd, const VideoFrameLayout& inputLayout, int outputFd,
+                         const VideoFrameLayout& outputLayout) = 0;
+};
+
+// Create the preferred conversion backend available on the system for producing frames in
+// |outFormat|, or return nullptr if frames have to be converted in software.
+std::unique_ptr<ConversionBackend> createConversionBackend(VideoPixelFormat outFormat);
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_CONVERSION_BACKEND_H
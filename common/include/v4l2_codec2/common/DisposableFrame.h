@@ -0,0 +1,40 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_DISPOSABLE_FRAME_H
+#define ANDROID_V4L2_CODEC2_COMMON_DISPOSABLE_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <v4l2_codec2/common/VideoTypes.h>
+
+namespace android {
+
+// Whether the compressed frame of |codec| in |data| is disposable, i.e. dropping it before it is
+// decoded doesn't change the decoding of the following frames. Only the frame headers are parsed:
+// - H.264: all the slices have a nal_ref_idc of 0, and the access unit carries no parameter set.
+// - VP8: the frame updates no reference buffer, and none of the probabilities, segmentation and
+//   loop filter deltas carried over to the next frames.
+// - VP9: the frame refreshes no reference buffer and is error resilient. The other frames predict
+//   their motion vectors from the previous frame, so the frame can only be dropped if the next
+//   frame is independent of it, see isIndependentOfPreviousFrame().
+// Returns false for the other codecs, and if the headers can't be parsed.
+bool isDisposableFrame(VideoCodec codec, const uint8_t* data, size_t size);
+
+// Whether the compressed frame of |codec| in |data| is decoded without the state left by the frame
+// decoded before it, other than through the reference buffers. Only the VP9 frames depend on that
+// state, predicting their motion vectors from the previous frame unless they are key frames or
+// error resilient. Returns false if the headers can't be parsed.
+bool isIndependentOfPreviousFrame(VideoCodec codec, const uint8_t* data, size_t size);
+
+// Whether the compressed frame of |codec| in |data| is a key frame, from which the stream can be
+// decoded without the previous frames: the H.264 and HEVC IDR pictures, the VP8 and VP9 key
+// frames, and the AV1 key frames of the temporal units carrying the sequence header. Returns false
+// for the other codecs, and if the headers can't be parsed.
+bool isKeyFrame(VideoCodec codec, const uint8_t* data, size_t size);
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_DISPOSABLE_FRAME_H
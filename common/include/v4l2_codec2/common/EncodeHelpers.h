@@ -5,10 +5,14 @@
 #ifndef ANDROID_V4L2_CODEC2_COMMON_HELPERS_H
 #define ANDROID_V4L2_CODEC2_COMMON_HELPERS_H
 
+#include <optional>
+#include <vector>
+
 #include <C2Config.h>
 #include <system/graphics.h>
 #include <ui/Size.h>
 
+#include <v4l2_codec2/common/Common.h>
 #include <v4l2_codec2/common/VideoPixelFormat.h>
 
 namespace android {
@@ -36,17 +40,32 @@ struct VideoEncoderAcceleratorConfig {
     VideoFrameStorageType mStorageType;
 };
 
-// Convert the specified C2Config level to a V4L2 level.
+// The maximal number of temporal layers of an encoded stream. The V4L2 hierarchical coding controls
+// support up to 7 layers, but real-time communication doesn't use more than 4.
+constexpr uint32_t kMaxTemporalLayers = 4;
+
+// Convert the specified C2Config H.264 or HEVC level to a V4L2 level.
 uint8_t c2LevelToV4L2Level(C2Config::level_t level);
 
 // Get the specified graphics block in YCbCr format.
 android_ycbcr getGraphicBlockInfo(const C2ConstGraphicBlock& block);
 
+// Get the video frame layout from the specified |block|, and its pixel format in |format|. YV12 is
+// reported as I420 with the planes sorted by offset, and all RGB layouts as ARGB.
+std::optional<VideoFramePlanes> getVideoFrameLayout(const C2ConstGraphicBlock& block,
+                                                    VideoPixelFormat* format);
+
 // Try to extract SPS and PPS NAL units from the specified H.264 |data| stream. If found the data
-// will be copied (after resizing) into the provided |sps| and |pps| buffers. Returns whether
-// extraction was successful.
+// will be copied (after resizing) into the provided |sps| and |pps| buffers. If |stopAtFirstSlice|
+// is set, scanning stops at the first slice NAL unit, as encoders send the parameter sets of a
+// frame in front of its slices. Returns whether extraction was successful.
 bool extractSPSPPS(const uint8_t* data, size_t length, std::vector<uint8_t>* sps,
-                   std::vector<uint8_t>* pps);
+                   std::vector<uint8_t>* pps, bool stopAtFirstSlice = false);
+
+// Same as extractSPSPPS(), for the VPS, SPS and PPS NAL units of a HEVC |data| stream.
+bool extractHEVCParamSets(const uint8_t* data, size_t length, std::vector<uint8_t>* vps,
+                          std::vector<uint8_t>* sps, std::vector<uint8_t>* pps,
+                          bool stopAtFirstSlice = false);
 
 // When encoding a video the codec-specific data (CSD; e.g. SPS and PPS for H264 encoding) will be
 // concatenated to the first encoded slice. This function extracts the CSD out of the bitstream and
@@ -54,11 +73,25 @@ bool extractSPSPPS(const uint8_t* data, size_t length, std::vector<uint8_t>* sps
 bool extractCSDInfo(std::unique_ptr<C2StreamInitDataInfo::output>* const csd, const uint8_t* data,
                     size_t length);
 
-// Prepend the specified |sps| and |pps| NAL units (without start codes) to the H.264 |data| stream.
-// The result is copied into |dst|. The provided |sps| and |pps| data will be updated if an SPS or
-// PPS NAL unit is encountered. Returns the size of the new data, will be 0 if an error occurred.
-size_t prependSPSPPSToIDR(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize,
-                          std::vector<uint8_t>* sps, std::vector<uint8_t>* pps);
+// Same as extractCSDInfo(), for a HEVC stream. The CSD consists of the VPS, SPS and PPS.
+bool extractHEVCCSDInfo(std::unique_ptr<C2StreamInitDataInfo::output>* const csd,
+                        const uint8_t* data, size_t length);
+
+// Insert the specified |sps| and |pps| NAL units (without start codes) in front of the IDR in the
+// H.264 stream of |size| bytes at |*offset| in |buffer|, without copying the stream to a new
+// buffer. The |*offset| bytes of headroom in front of the stream are used if large enough,
+// otherwise the stream is moved forward within the |bufferSize| bytes of |buffer|. The provided
+// |sps| and |pps| data will be updated if an SPS or PPS NAL unit is encountered, in which case
+// nothing is inserted. |*offset| is updated to the new start of the stream. Returns the new size
+// of the stream, will be 0 if an error occurred in which case the stream is left untouched.
+size_t insertSPSPPSBeforeIDR(uint8_t* buffer, size_t bufferSize, size_t* offset, size_t size,
+                             std::vector<uint8_t>* sps, std::vector<uint8_t>* pps);
+
+// Same as insertSPSPPSBeforeIDR(), inserting the VPS, SPS and PPS in front of the intra random
+// access point (IRAP) picture in a HEVC stream.
+size_t insertHEVCParamSetsBeforeIRAP(uint8_t* buffer, size_t bufferSize, size_t* offset,
+                                     size_t size, std::vector<uint8_t>* vps,
+                                     std::vector<uint8_t>* sps, std::vector<uint8_t>* pps);
 
 }  // namespace android
 
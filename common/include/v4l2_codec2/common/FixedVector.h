@@ -0,0 +1,81 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_FIXED_VECTOR_H
+#define ANDROID_V4L2_CODEC2_COMMON_FIXED_VECTOR_H
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <array>
+#include <initializer_list>
+#include <utility>
+
+#include <log/log.h>
+
+namespace android {
+
+// Vector of at most |Capacity| elements of |T|, stored inline. Used for the per-frame lists of
+// planes and file descriptors, which are bounded by the number of planes of a frame, so that
+// building and copying them never allocates.
+template <typename T, size_t Capacity>
+class FixedVector {
+public:
+    using value_type = T;
+    using iterator = T*;
+    using const_iterator = const T*;
+
+    FixedVector() = default;
+    FixedVector(std::initializer_list<T> values) {
+        for (const T& value : values) push_back(value);
+    }
+
+    static constexpr size_t capacity() { return Capacity; }
+    size_t size() const { return mSize; }
+    bool empty() const { return mSize == 0; }
+    bool full() const { return mSize == Capacity; }
+
+    // Append |value|. Appending to a full vector is illegal.
+    void push_back(T value) {
+        LOG_ALWAYS_FATAL_IF(full(), "FixedVector holds at most %zu elements", Capacity);
+        mElements[mSize++] = std::move(value);
+    }
+    template <typename... Args>
+    T& emplace_back(Args&&... args) {
+        push_back(T(std::forward<Args>(args)...));
+        return back();
+    }
+    void clear() { mSize = 0; }
+
+    T& operator[](size_t index) {
+        ALOG_ASSERT(index < mSize);
+        return mElements[index];
+    }
+    const T& operator[](size_t index) const {
+        ALOG_ASSERT(index < mSize);
+        return mElements[index];
+    }
+    T& back() { return (*this)[mSize - 1]; }
+    const T& back() const { return (*this)[mSize - 1]; }
+
+    T* data() { return mElements.data(); }
+    const T* data() const { return mElements.data(); }
+    iterator begin() { return data(); }
+    iterator end() { return data() + mSize; }
+    const_iterator begin() const { return data(); }
+    const_iterator end() const { return data() + mSize; }
+
+    bool operator==(const FixedVector& other) const {
+        return mSize == other.mSize && std::equal(begin(), end(), other.begin());
+    }
+    bool operator!=(const FixedVector& other) const { return !(*this == other); }
+
+private:
+    std::array<T, Capacity> mElements{};
+    size_t mSize = 0;
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_FIXED_VECTOR_H
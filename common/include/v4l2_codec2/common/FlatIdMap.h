@@ -0,0 +1,154 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_FLAT_ID_MAP_H
+#define ANDROID_V4L2_CODEC2_COMMON_FLAT_ID_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+#include <log/log.h>
+
+namespace android {
+
+// Map from 32-bit IDs to |Value|, stored in a flat open-addressed table with linear probing. The
+// table is preallocated and only grows when it gets more than half full, so a map whose size
+// stays bounded (e.g. by a number of V4L2 buffers) never allocates in steady state. Iteration
+// order is unspecified.
+template <typename Value>
+class FlatIdMap {
+public:
+    explicit FlatIdMap(size_t capacity = 0) { reserve(capacity); }
+
+    // Make room for |count| entries without growing the table.
+    void reserve(size_t count) {
+        size_t numSlots = kMinSlots;
+        while (numSlots < count * 2) numSlots *= 2;
+        if (numSlots > mSlots.size()) rehash(numSlots);
+    }
+
+    // Insert |value| under |id|. Returns false and leaves the map unchanged if |id| is present.
+    bool insert(uint32_t id, Value value) {
+        if ((mSize + 1) * 2 > mSlots.size()) rehash(mSlots.size() * 2);
+
+        size_t index = homeIndex(id);
+        while (mSlots[index].mUsed) {
+            if (mSlots[index].mId == id) return false;
+            index = (index + 1) & (mSlots.size() - 1);
+        }
+        mSlots[index].mUsed = true;
+        mSlots[index].mId = id;
+        mSlots[index].mValue = std::move(value);
+        mSize++;
+        return true;
+    }
+
+    // Get the value stored under |id|, or nullptr if |id| is not present.
+    Value* find(uint32_t id) {
+        const size_t index = findIndex(id);
+        return index != kNotFound ? &mSlots[index].mValue : nullptr;
+    }
+    const Value* find(uint32_t id) const {
+        const size_t index = findIndex(id);
+        return index != kNotFound ? &mSlots[index].mValue : nullptr;
+    }
+
+    // Remove |id| from the map. Returns false if |id| is not present.
+    bool erase(uint32_t id) {
+        size_t hole = findIndex(id);
+        if (hole == kNotFound) return false;
+
+        // Shift the following entries of the probe sequence back, so lookups never need
+        // tombstones.
+        const size_t mask = mSlots.size() - 1;
+        for (size_t index = (hole + 1) & mask; mSlots[index].mUsed; index = (index + 1) & mask) {
+            const size_t home = homeIndex(mSlots[index].mId);
+            // Move the entry into the hole if its home slot is not within (hole, index].
+            if (((index - home) & mask) >= ((index - hole) & mask)) {
+                mSlots[hole] = std::move(mSlots[index]);
+                hole = index;
+            }
+        }
+        mSlots[hole].mUsed = false;
+        mSlots[hole].mValue = Value();
+        mSize--;
+        return true;
+    }
+
+    // Remove all the entries, keeping the allocated table.
+    void clear() {
+        for (Slot& slot : mSlots) {
+            slot.mUsed = false;
+            slot.mValue = Value();
+        }
+        mSize = 0;
+    }
+
+    size_t size() const { return mSize; }
+    bool empty() const { return mSize == 0; }
+
+    // Call |func(id, value)| for each entry. |func| must not insert or erase entries.
+    template <typename Func>
+    void forEach(Func&& func) {
+        for (Slot& slot : mSlots) {
+            if (slot.mUsed) func(slot.mId, slot.mValue);
+        }
+    }
+    template <typename Func>
+    void forEach(Func&& func) const {
+        for (const Slot& slot : mSlots) {
+            if (slot.mUsed) func(slot.mId, slot.mValue);
+        }
+    }
+
+private:
+    struct Slot {
+        bool mUsed = false;
+        uint32_t mId = 0;
+        Value mValue = Value();
+    };
+
+    static constexpr size_t kMinSlots = 16;
+    static constexpr size_t kNotFound = ~static_cast<size_t>(0);
+
+    size_t homeIndex(uint32_t id) const {
+        // Fibonacci hashing spreads the sequential IDs used by most clients over the table.
+        return (static_cast<uint32_t>(id * 2654435769u) >> mShift) & (mSlots.size() - 1);
+    }
+
+    size_t findIndex(uint32_t id) const {
+        size_t index = homeIndex(id);
+        while (mSlots[index].mUsed) {
+            if (mSlots[index].mId == id) return index;
+            index = (index + 1) & (mSlots.size() - 1);
+        }
+        return kNotFound;
+    }
+
+    void rehash(size_t numSlots) {
+        ALOG_ASSERT((numSlots & (numSlots - 1)) == 0, "The table size must be a power of 2");
+
+        std::vector<Slot> slots(numSlots);
+        std::swap(mSlots, slots);
+        mShift = 32;
+        for (size_t n = numSlots; n > 1; n /= 2) mShift--;
+
+        mSize = 0;
+        for (Slot& slot : slots) {
+            if (slot.mUsed) insert(slot.mId, std::move(slot.mValue));
+        }
+    }
+
+    std::vector<Slot> mSlots;
+    size_t mSize = 0;
+    // The number of bits the hashed ID is shifted by to get a slot index.
+    uint32_t mShift = 32;
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_FLAT_ID_MAP_H
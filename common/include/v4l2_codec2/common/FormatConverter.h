@@ -5,7 +5,10 @@
 #ifndef ANDROID_V4L2_CODEC2_COMMON_FORMAT_CONVERTER_H
 #define ANDROID_V4L2_CODEC2_COMMON_FORMAT_CONVERTER_H
 
+#include <functional>
 #include <limits>
+#include <list>
+#include <memory>
 #include <queue>
 #include <vector>
 
@@ -13,7 +16,10 @@
 #include <ui/Size.h>
 #include <utils/StrongPointer.h>
 
+#include <v4l2_codec2/common/ConversionBackend.h>
 #include <v4l2_codec2/common/VideoPixelFormat.h>
+#include <v4l2_codec2/common/WorkerPool.h>
+#include <v4l2_codec2/plugin_store/DmabufHelpers.h>
 
 namespace android {
 
@@ -50,10 +56,18 @@ public:
     FormatConverter& operator=(const FormatConverter&) = delete;
 
     // Create FormatConverter instance and initialize it, nullptr will be returned on
-    // initialization error.
+    // initialization error. Frames are converted by the ConversionBackend returned by
+    // createConversionBackend() if there is one, or in software with libyuv otherwise. If
+    // |maxConversionThreads| is not zero, the visible area is split into horizontal stripes which
+    // are converted in software in parallel by up to |maxConversionThreads| worker threads taken
+    // from the process-wide WorkerPool budget. If |scaleInput| is set, input frames whose crop
+    // doesn't match |visibleSize| are scaled to |visibleSize| while converted, e.g. to encode a
+    // lower resolution stream from the frames of a single capture.
     static std::unique_ptr<FormatConverter> Create(VideoPixelFormat outFormat,
                                                    const ui::Size& visibleSize, uint32_t inputCount,
-                                                   const ui::Size& codedSize);
+                                                   const ui::Size& codedSize,
+                                                   size_t maxConversionThreads = 0,
+                                                   bool scaleInput = false);
 
     // Convert the input block into the alternative block with required pixel format and return it,
     // or return the original block if zero-copy is applied.
@@ -63,6 +77,9 @@ public:
     c2_status_t returnBlock(uint64_t frameIndex);
     // Check if there is available block for conversion.
     bool isReady() const { return !mAvailableQueue.empty(); }
+    // Allocate more blocks for conversion if required to convert |inputCount| frames
+    // simultaneously, e.g. after the queue depth of an adaptive encoder grew.
+    c2_status_t growBlockPool(uint32_t inputCount);
 
 private:
     // The minimal number requirement of allocated buffers for conversion. This value is the same as
@@ -70,6 +87,12 @@ private:
     static constexpr uint32_t kMinInputBufferCount = 8;
     // The constant used by BlockEntry to indicate no frame is associated with the BlockEntry.
     static constexpr uint64_t kNoFrameAssociated = ~static_cast<uint64_t>(0);
+    // The minimal number of pixels converted by each stripe when conversion is sliced. Smaller
+    // stripes don't amortize the cost of waking up the worker threads.
+    static constexpr int kMinPixelsPerStripe = 1280 * 720;
+    // The maximal number of input block mappings kept alive. Clients usually cycle through a
+    // small set of input buffers, so this covers the whole set in the common case.
+    static constexpr size_t kMaxInputMappings = 16;
 
     // There are 2 types of BlockEntry:
     // 1. If |mBlock| is an allocated graphic block (not nullptr). This BlockEntry is for
@@ -81,33 +104,89 @@ private:
     //    and released on returnBlock() in associated with returned frame index.
     struct BlockEntry {
         // Constructor of convertible entry.
-        BlockEntry(std::shared_ptr<C2GraphicBlock> block) : mBlock(std::move(block)) {}
+        BlockEntry(std::shared_ptr<C2GraphicBlock> block, std::unique_ptr<C2GraphicView> view)
+              : mBlock(std::move(block)), mView(std::move(view)) {}
         // Constructir of zero-copy entry.
         BlockEntry(uint64_t frameIndex) : mAssociatedFrameIndex(frameIndex) {}
 
         std::shared_ptr<C2GraphicBlock> mBlock;
+        // The mapping of |mBlock|, kept alive as long as the entry to avoid mapping |mBlock| on
+        // every conversion. nullptr for zero-copy entries.
+        std::unique_ptr<C2GraphicView> mView;
         uint64_t mAssociatedFrameIndex = kNoFrameAssociated;
     };
 
+    // The mapping of an input block, cached by the unique ID of the block's dmabuf.
+    struct InputMapping {
+        unique_id_t mId;
+        C2Rect mCrop;
+        std::shared_ptr<const C2GraphicView> mView;
+    };
+
     FormatConverter() = default;
 
     // Initialize foramt converter. It will pre-allocate a set of graphic blocks as |codedSize| and
     // |outFormat|. This function should be called prior to other functions.
     c2_status_t initialize(VideoPixelFormat outFormat, const ui::Size& visibleSize,
-                           uint32_t inputCount, const ui::Size& codedSize);
+                           uint32_t inputCount, const ui::Size& codedSize,
+                           size_t maxConversionThreads, bool scaleInput);
+
+    // Run |convertRows| over the whole visible area, either inline or split into |mNumStripes|
+    // stripes on |mWorkerPool|. |convertRows(top, height)| converts the visible rows
+    // [top, top + height), |top| is always even.
+    void convertStripes(const std::function<void(int top, int height)>& convertRows);
+    // The height of the stripes convertStripes() splits the visible area into.
+    int stripeHeight() const;
+
+    // Allocate |count| more blocks for conversion and make them available.
+    c2_status_t allocateBlocks(uint32_t count);
+
+    // Convert |inputBlock| mapped as |inputView| into |entry| with |mBackend|. Returns false if the
+    // frame needs to be converted in software instead. |idMap| is only set for RGB-backed
+    // IMPLEMENTATION_DEFINED blocks.
+    bool convertWithBackend(const C2ConstGraphicBlock& inputBlock, const C2GraphicView& inputView,
+                            const C2PlanarLayout& inputLayout, const ImplDefinedToRGBXMap* idMap,
+                            const BlockEntry& entry);
+
+    // Map |block| for reading. The mapping of a recently converted buffer is reused from
+    // |mInputMappings| instead of being mapped again, so the caller waits for the fence of |block|
+    // and brackets its reads with dmabuf syncs.
+    std::shared_ptr<const C2GraphicView> mapInputBlock(const C2ConstGraphicBlock& block);
 
     // The array of block entries.
     std::vector<std::unique_ptr<BlockEntry>> mGraphicBlocks;
     // The queue of recording the raw pointers of available graphic blocks. The consumed block will
     // be popped on convertBlock(), and returned block will be pushed on returnBlock().
     std::queue<BlockEntry*> mAvailableQueue;
-    // The temporary U/V plane memory allocation for ABGR to NV12 conversion. They should be
-    // allocated on initialize().
-    std::unique_ptr<uint8_t[]> mTempPlaneU;
-    std::unique_ptr<uint8_t[]> mTempPlaneV;
+    // The cached input block mappings, ordered from the most to the least recently used. A cached
+    // mapping keeps the underlying allocation alive, so a dmabuf ID can't be reused while cached.
+    std::list<InputMapping> mInputMappings;
+
+    // The pool the blocks for conversion are fetched from, and their HAL format and size.
+    std::shared_ptr<C2BlockPool> mPool;
+    uint32_t mHalFormat = 0;
+    ui::Size mCodedSize;
+    // The number of allocated blocks for conversion, not counting the zero-copy entries.
+    uint32_t mNumBlocks = 0;
 
     VideoPixelFormat mOutFormat = VideoPixelFormat::UNKNOWN;
     ui::Size mVisibleSize;
+
+    // The hardware conversion backend, nullptr if frames are converted in software.
+    std::unique_ptr<ConversionBackend> mBackend;
+    // The worker pool used for sliced conversion, nullptr if conversion runs inline.
+    std::unique_ptr<WorkerPool> mWorkerPool;
+    // The number of horizontal stripes the visible area is split into on conversion.
+    size_t mNumStripes = 1;
+
+    // Whether input frames of another size than |mVisibleSize| are scaled.
+    bool mScaleInput = false;
+    // The frame of |mVisibleSize| input frames are scaled into, still in their own pixel format,
+    // when they can't be scaled straight into the output block. Only allocated if |mScaleInput|.
+    std::vector<uint8_t> mScaleBuffer;
+    // The scratch rows ABGR frames are converted to NV12 through, one chunk per stripe. Empty if
+    // libyuv converts ABGR to NV12 directly.
+    std::vector<uint8_t> mABGRToNV12Scratch;
 };
 
 }  // namespace android
@@ -109,6 +109,19 @@ public:
         // Maps to V4L2_PIX_FMT_MM21.
         // It is used for MT8183 hardware video decoder.
         MM21 = composeFourcc('M', 'M', '2', '1'),
+        // Maps to V4L2_PIX_FMT_QC08C.
+        // It is the UBWC compressed NV12 format of the Qualcomm hardware video decoders, which can
+        // only be read by the GPU and the display.
+        QC08 = composeFourcc('Q', '0', '8', 'C'),
+
+        // 10-bit YUV420 formats.
+        // https://linuxtv.org/downloads/v4l-dvb-apis/uapi/v4l/pixfmt-yuv-planar.html
+        // Maps to PIXEL_FORMAT_P016LE, V4L2_PIX_FMT_P010.
+        // 24bpp NV12, the 10 bits of each sample are stored in the MSBs of 16 bits.
+        P010 = composeFourcc('P', '0', '1', '0'),
+        // Maps to V4L2_PIX_FMT_QC10C.
+        // It is the UBWC compressed 10-bit format of the Qualcomm hardware video decoders.
+        QC10 = composeFourcc('Q', '1', '0', 'C'),
     };
 
     explicit Fourcc(Fourcc::Value fourcc);
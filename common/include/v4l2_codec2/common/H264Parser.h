@@ -0,0 +1,188 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_H264_PARSER_H
+#define ANDROID_V4L2_CODEC2_COMMON_H264_PARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <memory>
+#include <vector>
+
+#include <ui/Rect.h>
+#include <ui/Size.h>
+
+namespace android {
+
+// The members of the parameter sets and slice headers are named after the syntax elements of the
+// H.264 specification. The scaling lists are stored in raster scan order, after the fall-back
+// rules have been applied.
+
+// H.264 sequence parameter set.
+struct H264SPS {
+    uint8_t profile_idc = 0;
+    uint8_t constraint_set_flags = 0;
+    uint8_t level_idc = 0;
+    uint8_t seq_parameter_set_id = 0;
+    uint8_t chroma_format_idc = 1;
+    bool separate_colour_plane_flag = false;
+    uint8_t bit_depth_luma_minus8 = 0;
+    uint8_t bit_depth_chroma_minus8 = 0;
+    bool qpprime_y_zero_transform_bypass_flag = false;
+    bool seq_scaling_matrix_present_flag = false;
+    uint8_t scaling_list_4x4[6][16];
+    uint8_t scaling_list_8x8[6][64];
+    uint8_t log2_max_frame_num_minus4 = 0;
+    uint8_t pic_order_cnt_type = 0;
+    uint8_t log2_max_pic_order_cnt_lsb_minus4 = 0;
+    bool delta_pic_order_always_zero_flag = false;
+    int32_t offset_for_non_ref_pic = 0;
+    int32_t offset_for_top_to_bottom_field = 0;
+    uint8_t num_ref_frames_in_pic_order_cnt_cycle = 0;
+    int32_t offset_for_ref_frame[255];
+    uint8_t max_num_ref_frames = 0;
+    bool gaps_in_frame_num_value_allowed_flag = false;
+    uint16_t pic_width_in_mbs_minus1 = 0;
+    uint16_t pic_height_in_map_units_minus1 = 0;
+    bool frame_mbs_only_flag = false;
+    bool mb_adaptive_frame_field_flag = false;
+    bool direct_8x8_inference_flag = false;
+    bool frame_cropping_flag = false;
+    uint32_t frame_crop_left_offset = 0;
+    uint32_t frame_crop_right_offset = 0;
+    uint32_t frame_crop_top_offset = 0;
+    uint32_t frame_crop_bottom_offset = 0;
+    // From the VUI parameters, only valid if |bitstream_restriction_flag| is set.
+    bool bitstream_restriction_flag = false;
+    uint32_t max_num_reorder_frames = 0;
+    uint32_t max_dec_frame_buffering = 0;
+
+    // Get the size of the decoded frames, in pixels.
+    ui::Size getCodedSize() const;
+    // Get the visible rectangle of the decoded frames, inside the coded size.
+    Rect getVisibleRect() const;
+    // Get the number of frames stored in the decoded picture buffer of this sequence.
+    size_t getMaxDpbFrames() const;
+    // Get the maximum number of frames preceding any frame in decoding order and following it in
+    // output order.
+    size_t getMaxReorderFrames() const;
+};
+
+// H.264 picture parameter set.
+struct H264PPS {
+    uint8_t pic_parameter_set_id = 0;
+    uint8_t seq_parameter_set_id = 0;
+    bool entropy_coding_mode_flag = false;
+    bool bottom_field_pic_order_in_frame_present_flag = false;
+    uint8_t num_slice_groups_minus1 = 0;
+    uint8_t num_ref_idx_l0_default_active_minus1 = 0;
+    uint8_t num_ref_idx_l1_default_active_minus1 = 0;
+    bool weighted_pred_flag = false;
+    uint8_t weighted_bipred_idc = 0;
+    int8_t pic_init_qp_minus26 = 0;
+    int8_t pic_init_qs_minus26 = 0;
+    int8_t chroma_qp_index_offset = 0;
+    bool deblocking_filter_control_present_flag = false;
+    bool constrained_intra_pred_flag = false;
+    bool redundant_pic_cnt_present_flag = false;
+    bool transform_8x8_mode_flag = false;
+    bool pic_scaling_matrix_present_flag = false;
+    uint8_t scaling_list_4x4[6][16];
+    uint8_t scaling_list_8x8[6][64];
+    int8_t second_chroma_qp_index_offset = 0;
+};
+
+// One memory management control operation of a slice header's dec_ref_pic_marking().
+struct H264DecRefPicMarking {
+    uint32_t memory_management_control_operation = 0;
+    uint32_t difference_of_pic_nums_minus1 = 0;
+    uint32_t long_term_pic_num = 0;
+    uint32_t long_term_frame_idx = 0;
+    uint32_t max_long_term_frame_idx_plus1 = 0;
+};
+
+// H.264 slice header, parsed up to dec_ref_pic_marking().
+struct H264SliceHeader {
+    enum SliceType : uint8_t { kP = 0, kB = 1, kI = 2, kSP = 3, kSI = 4 };
+    // The maximum number of memory management control operations kept, which bounds the number
+    // of short-term pictures that can be marked in a single slice.
+    static constexpr size_t kMaxNumMMCOs = 32;
+
+    uint8_t nal_ref_idc = 0;
+    bool idr_pic_flag = false;
+    uint32_t first_mb_in_slice = 0;
+    // The slice_type syntax element, modulo 5.
+    uint8_t slice_type = 0;
+    uint8_t pic_parameter_set_id = 0;
+    uint8_t colour_plane_id = 0;
+    uint16_t frame_num = 0;
+    bool field_pic_flag = false;
+    bool bottom_field_flag = false;
+    uint16_t idr_pic_id = 0;
+    uint16_t pic_order_cnt_lsb = 0;
+    int32_t delta_pic_order_cnt_bottom = 0;
+    int32_t delta_pic_order_cnt[2] = {0, 0};
+    uint32_t redundant_pic_cnt = 0;
+    bool no_output_of_prior_pics_flag = false;
+    bool long_term_reference_flag = false;
+    bool adaptive_ref_pic_marking_mode_flag = false;
+    size_t num_mmcos = 0;
+    H264DecRefPicMarking mmcos[kMaxNumMMCOs];
+    // The sizes in bits of the dec_ref_pic_marking() syntax structure, and of the picture order
+    // count syntax elements, needed by some hardware to skip them.
+    size_t dec_ref_pic_marking_bit_size = 0;
+    size_t pic_order_cnt_bit_size = 0;
+
+    bool isPSlice() const { return slice_type == kP || slice_type == kSP; }
+    bool isBSlice() const { return slice_type == kB; }
+};
+
+// Parser of the H.264 parameter sets and slice headers, keeping the parameter sets of the stream
+// it parsed so far. The NAL units are passed without start code, starting with their header.
+class H264Parser {
+public:
+    // Types of the NAL units handled by the parser.
+    static constexpr uint8_t kNonIDRSliceType = 1;
+    static constexpr uint8_t kIDRSliceType = 5;
+    static constexpr uint8_t kSPSType = 7;
+    static constexpr uint8_t kPPSType = 8;
+
+    enum class Result {
+        kOk,
+        kInvalidStream,      // The NAL unit is malformed.
+        kUnsupportedStream,  // The NAL unit uses features the parser doesn't handle.
+        kMissingParameterSet,
+    };
+
+    H264Parser();
+    ~H264Parser();
+
+    // Parse the SPS |nal| of |size| bytes and store it, replacing any SPS with the same ID.
+    Result parseSPS(const uint8_t* nal, size_t size);
+    // Parse the PPS |nal| of |size| bytes and store it, replacing any PPS with the same ID.
+    Result parsePPS(const uint8_t* nal, size_t size);
+    // Parse the header of the slice |nal| of |size| bytes into |header|.
+    Result parseSliceHeader(const uint8_t* nal, size_t size, H264SliceHeader* header) const;
+
+    // Get the stored parameter set with the specified |id|, nullptr if there is none.
+    const H264SPS* getSPS(uint8_t id) const;
+    const H264PPS* getPPS(uint8_t id) const;
+
+    // Remove all the stored parameter sets.
+    void reset();
+
+private:
+    std::array<std::unique_ptr<H264SPS>, 32> mSPSs;
+    std::array<std::unique_ptr<H264PPS>, 256> mPPSs;
+};
+
+// Copy the payload of the NAL unit |nal| of |size| bytes, without its header of |headerSize| bytes
+// and without the emulation prevention bytes. Shared by the H.264 and HEVC parsers.
+std::vector<uint8_t> toRbsp(const uint8_t* nal, size_t size, size_t headerSize);
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_H264_PARSER_H
@@ -7,11 +7,15 @@
 
 #include <stdint.h>
 
+#include <v4l2_codec2/common/CodedStreamInfo.h>
+
 namespace android {
 
 // Helper class to parse H264 NAL units from data.
 class NalParser {
 public:
+    // Type of a non-IDR Slice NAL unit.
+    static constexpr uint8_t kNonIDRType = 1;
     // Type of a IDR Slice NAL unit.
     static constexpr uint8_t kIDRType = 5;
     // Type of a SPS NAL unit.
@@ -30,9 +34,10 @@ public:
     NalParser(const uint8_t* data, size_t length);
 
     // Locates the next NAL after |mNextNalStartCodePos|. If there is one, updates |mCurrNalDataPos|
-    // to the first byte of the NAL data (start code is not included), and |mNextNalStartCodePos| to
-    // the position of the next start code, and returns true.
+    // to the first byte of the NAL data (start code is not included), and returns true.
     // If there is no more NAL, returns false.
+    // The end of the NAL is only searched for when needed by length() or the next call, so a
+    // caller which stops at a NAL after checking its type() doesn't scan its data.
     //
     // Note: This method must be called prior to data() and length().
     bool locateNextNal();
@@ -49,20 +54,64 @@ public:
     // Get the type of the current NAL unit.
     uint8_t type() const;
 
+    // Get the nal_ref_idc of the current NAL unit, 0 if the slices of the NAL unit aren't used as
+    // reference by the following pictures.
+    uint8_t refIdc() const;
+
+    // Whether the current NAL unit contains slice data (i.e. is a VCL NAL unit). Parameter sets
+    // are sent before the first slice of a frame, so parsers looking for them can stop here.
+    bool isSlice() const;
+
     // Find the H.264 video's color aspects in the current SPS NAL.
     bool findCodedColorAspects(ColorAspects* colorAspects);
 
+    // Find the coded size and the DPB size of the H.264 video in the current SPS NAL.
+    bool findCodedStreamInfo(CodedStreamInfo* info) const;
+
 private:
+    // Find the next 0x000001 start code pattern from |mCurrNalDataPos|, scanning 16 bytes at a
+    // time on CPUs with SIMD support. Returns |mDataEnd| if there is none.
     const uint8_t* findNextStartCodePos() const;
+    // Get the position of the start code following the current NAL, searching for it if needed.
+    const uint8_t* nextNalStartCodePos() const;
 
-    // The byte pattern for the start of a H264 NAL unit.
-    const uint8_t kNalStartCode[3] = {0x00, 0x00, 0x01};
     // The length in bytes of the NAL-unit start pattern.
     const size_t kNalStartCodeLength = 3;
 
     const uint8_t* mCurrNalDataPos;
     const uint8_t* mDataEnd;
-    const uint8_t* mNextNalStartCodePos;
+    // The position of the start code following the current NAL, nullptr if not searched yet.
+    mutable const uint8_t* mNextNalStartCodePos = nullptr;
+};
+
+// Helper class to parse HEVC NAL units from data. The start codes are the same as for H.264, but
+// the NAL unit header is two bytes long and carries different NAL unit types.
+class HEVCNalParser : private NalParser {
+public:
+    // Types of the parameter set NAL units.
+    static constexpr uint8_t kVPSType = 32;
+    static constexpr uint8_t kSPSType = 33;
+    static constexpr uint8_t kPPSType = 34;
+
+    using NalParser::NalParser;
+
+    using NalParser::data;
+    using NalParser::length;
+    using NalParser::locateNextNal;
+
+    // Get the type of the current NAL unit.
+    uint8_t type() const;
+
+    // Whether the current NAL unit contains slice data (i.e. is a VCL NAL unit).
+    bool isSlice() const;
+
+    // Whether the current NAL unit is a slice of an intra random access point picture (BLA, IDR
+    // or CRA), in front of which the parameter sets need to be sent.
+    bool isIRAP() const;
+
+    // Find the coded size and the DPB size of the HEVC video in the current SPS NAL, those of its
+    // highest sub-layer.
+    bool findCodedStreamInfo(CodedStreamInfo* info) const;
 };
 
 }  // namespace android
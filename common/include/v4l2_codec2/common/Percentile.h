@@ -0,0 +1,24 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_PERCENTILE_H
+#define ANDROID_V4L2_CODEC2_COMMON_PERCENTILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace android {
+
+// Get the |percentile|th of the |sortedValues|, the 100th being the maximum. Returns 0 if there are
+// no values. This header has no dependencies, so the NDK based e2e tests can use it too.
+inline int64_t getPercentile(const std::vector<int64_t>& sortedValues, size_t percentile) {
+    if (sortedValues.empty()) return 0;
+    return sortedValues[(sortedValues.size() - 1) * percentile / 100];
+}
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_PERCENTILE_H
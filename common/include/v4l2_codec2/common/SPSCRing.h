@@ -0,0 +1,66 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_SPSC_RING_H
+#define ANDROID_V4L2_CODEC2_COMMON_SPSC_RING_H
+
+#include <stddef.h>
+
+#include <atomic>
+#include <utility>
+#include <vector>
+
+#include <log/log.h>
+
+namespace android {
+
+// Bounded lock-free ring buffer to pass |Value|s from a single producer thread to a single
+// consumer thread. push() may only be called by the producer and pop() by the consumer, the
+// producer and consumer can however change over time if calls are externally serialized.
+template <typename Value>
+class SPSCRing {
+public:
+    // Create a ring holding up to |capacity| values, which must be a power of 2.
+    explicit SPSCRing(size_t capacity) : mSlots(capacity) {
+        ALOG_ASSERT(capacity > 0 && (capacity & (capacity - 1)) == 0,
+                    "The ring capacity must be a power of 2");
+    }
+    SPSCRing(const SPSCRing&) = delete;
+    SPSCRing& operator=(const SPSCRing&) = delete;
+
+    // Append |value| to the ring. Returns false and leaves |value| untouched if the ring is full.
+    bool push(Value&& value) {
+        const size_t tail = mTail.load(std::memory_order_relaxed);
+        if (tail - mHead.load(std::memory_order_acquire) == mSlots.size()) return false;
+
+        mSlots[tail & (mSlots.size() - 1)] = std::move(value);
+        mTail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Take the oldest value of the ring into |value|. Returns false if the ring is empty.
+    bool pop(Value* value) {
+        const size_t head = mHead.load(std::memory_order_relaxed);
+        if (head == mTail.load(std::memory_order_acquire)) return false;
+
+        Value& slot = mSlots[head & (mSlots.size() - 1)];
+        *value = std::move(slot);
+        slot = Value();
+        mHead.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t capacity() const { return mSlots.size(); }
+
+private:
+    std::vector<Value> mSlots;
+    // Free-running counters of the values popped and pushed. The indexes are kept on separate
+    // cache lines so the producer and consumer don't keep invalidating each other's line.
+    alignas(64) std::atomic<size_t> mHead{0};
+    alignas(64) std::atomic<size_t> mTail{0};
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_SPSC_RING_H
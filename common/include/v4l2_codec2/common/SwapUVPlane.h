@@ -0,0 +1,21 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_SWAP_UV_PLANE_H
+#define ANDROID_V4L2_CODEC2_COMMON_SWAP_UV_PLANE_H
+
+#include <stdint.h>
+
+namespace android {
+
+// Copy the interleaved chroma plane |src| to |dst| while swapping the two bytes of every pair, i.e.
+// convert a VU (NV21) plane to a UV (NV12) plane or vice versa. |width| is the number of chroma
+// pairs per row. The kernel is vectorized with NEON on ARM and SSSE3/AVX2 on x86, and falls back
+// to a scalar loop otherwise.
+void swapUVPlane(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width,
+                 int height);
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_SWAP_UV_PLANE_H
@@ -0,0 +1,54 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_THREAD_POLICY_H
+#define ANDROID_V4L2_CODEC2_COMMON_THREAD_POLICY_H
+
+#include <stdint.h>
+
+#include <v4l2_codec2/common/V4L2Device.h>
+
+namespace android {
+
+// Scheduling policy of the threads doing the work of a codec session, i.e. its decoder or encoder
+// thread and the threads polling its V4L2 devices. At the default priority these threads get
+// preempted under heavy UI load, and the playback janks.
+//
+// The codec threads are named "V4L2<Something>", within the 15 characters the kernel keeps, so
+// they can be picked out by the profiling tools.
+struct ThreadPolicy {
+    // The values are exposed to the clients by the vendor.v4l2-codec2.thread-policy parameter.
+    enum class Priority : uint32_t {
+        // The nice level the thread was started with.
+        kNormal = 0,
+        // The ANDROID_PRIORITY_DISPLAY and ANDROID_PRIORITY_URGENT_DISPLAY nice levels.
+        kDisplay = 1,
+        kUrgentDisplay = 2,
+        // SCHED_FIFO, falling back to kUrgentDisplay if the process isn't allowed to use it.
+        kRealtime = 3,
+    };
+    enum class Cluster : uint32_t {
+        kAny = 0,
+        // The CPUs of the lowest and of the highest maximum frequency. Threads are left unpinned
+        // if all the CPUs have the same maximum frequency.
+        kLittle = 1,
+        kBig = 2,
+    };
+
+    Priority mPriority = Priority::kNormal;
+    Cluster mCluster = Cluster::kAny;
+
+    // Get the policy of the |type| threads configured by the properties, used when the client
+    // doesn't configure one.
+    static ThreadPolicy getDefault(V4L2Device::Type type);
+    // Get the policy last applied to the calling thread, which the threads it starts should follow.
+    static ThreadPolicy getCurrent();
+
+    // Apply the policy to the calling thread. Returns false if any part of it couldn't be applied.
+    bool applyToCurrentThread() const;
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_THREAD_POLICY_H
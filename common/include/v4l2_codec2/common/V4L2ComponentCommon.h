@@ -14,15 +14,18 @@ struct V4L2ComponentName {
     static const std::string kH264Encoder;
     static const std::string kVP8Encoder;
     static const std::string kVP9Encoder;
+    static const std::string kHEVCEncoder;
 
     static const std::string kH264Decoder;
     static const std::string kVP8Decoder;
     static const std::string kVP9Decoder;
     static const std::string kHEVCDecoder;
+    static const std::string kAV1Decoder;
     static const std::string kH264SecureDecoder;
     static const std::string kVP8SecureDecoder;
     static const std::string kVP9SecureDecoder;
     static const std::string kHEVCSecureDecoder;
+    static const std::string kAV1SecureDecoder;
 
     // Return true if |name| is a valid component name.
     static bool isValid(const char* name);
@@ -13,30 +13,59 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <bitset>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <string>
 #include <vector>
 
 #include <C2Config.h>
 #include <base/containers/flat_map.h>
 #include <base/files/scoped_file.h>
 #include <base/memory/ref_counted.h>
+#include <base/thread_annotations.h>
 
 #include <ui/Size.h>
 #include <v4l2_codec2/common/Common.h>
 #include <v4l2_codec2/common/V4L2DevicePoller.h>
 #include <v4l2_codec2/common/VideoTypes.h>
 
+// AV1 OBU streams, missing from the older kernel headers.
+#ifndef V4L2_PIX_FMT_AV1
+#define V4L2_PIX_FMT_AV1 v4l2_fourcc('A', 'V', '0', '1')
+#endif
+
 namespace android {
 
 class V4L2Queue;
 class V4L2BufferRefBase;
 class V4L2BuffersList;
 class V4L2DecodeSurface;
+class V4L2IoctlRecorder;
+class V4L2ReadableBuffer;
+
+static_assert(VIDEO_MAX_PLANES <= kMaxVideoFramePlanes, "Too many planes for VideoFramePlanes");
+
+// Destroys a V4L2BufferRefBase in the slot preallocated for it by its queue, and returns the buffer
+// to the free list of the queue if needed.
+struct V4L2BufferRefBaseDeleter {
+    void operator()(V4L2BufferRefBase* bufferRef) const;
+};
+
+// Destroys a V4L2ReadableBuffer in the slot preallocated for it by its queue once its last
+// reference is dropped, and only then returns the buffer to the free list of the queue.
+struct V4L2ReadableBufferTraits {
+    static void Destruct(const V4L2ReadableBuffer* buffer);
+};
 
 // Wrapper for the 'v4l2_ext_control' structure.
 struct V4L2ExtCtrl {
     V4L2ExtCtrl(uint32_t id);
     V4L2ExtCtrl(uint32_t id, int32_t val);
+    // Compound control, whose |size| bytes payload is pointed to by |ptr|.
+    V4L2ExtCtrl(uint32_t id, void* ptr, uint32_t size);
     struct v4l2_ext_control ctrl;
 };
 
@@ -62,14 +91,14 @@ public:
     // be equal to the number of planes of this buffer. If successful, true is returned and the
     // reference to the buffer is dropped so this reference becomes invalid. In case of error, false
     // is returned and the buffer is returned to the free list.
-    bool queueUserPtr(const std::vector<void*>& ptrs) &&;
+    bool queueUserPtr(const FixedVector<void*, kMaxVideoFramePlanes>& ptrs) &&;
     // Queue a DMABUF buffer, assigning |fds| as file descriptors for each plane. It is allowed the
     // number of |fds| might be greater than the number of planes of this buffer. It happens when
     // the v4l2 pixel format is single planar. The fd of the first plane is only used in that case.
     // If successful, true is returned and the reference to the buffer is dropped so this reference
     // becomes invalid. In case of error, false is returned and the buffer is returned to the free
     // list.
-    bool queueDMABuf(const std::vector<int>& fds) &&;
+    bool queueDMABuf(const VideoFrameFds& fds) &&;
 
     // Returns the number of planes in this buffer.
     size_t planesCount() const;
@@ -93,6 +122,9 @@ public:
     size_t getPlaneBytesUsed(const size_t plane) const;
     // Set the data offset for |plane|, in bytes.
     void setPlaneDataOffset(const size_t plane, const size_t dataOffset);
+    // Queue this buffer to the media request |requestFd| instead of directly to the device. The
+    // buffer is then only processed once the request is queued.
+    void setRequestFd(int requestFd);
 
     // Return the V4L2 buffer ID of the underlying buffer.
     size_t bufferId() const;
@@ -110,7 +142,7 @@ private:
     V4L2WritableBufferRef(const V4L2WritableBufferRef&) = delete;
     V4L2WritableBufferRef& operator=(const V4L2WritableBufferRef&) = delete;
 
-    std::unique_ptr<V4L2BufferRefBase> mBufferData;
+    std::unique_ptr<V4L2BufferRefBase, V4L2BufferRefBaseDeleter> mBufferData;
 
     SEQUENCE_CHECKER(mSequenceChecker);
 };
@@ -124,12 +156,15 @@ private:
 // buffers they originate from. This flexibility is required because V4L2ReadableBufferRefs can be
 // embedded into VideoFrames, which are then passed to other threads and not necessarily destroyed
 // before the V4L2Queue buffers are freed.
-class V4L2ReadableBuffer : public ::base::RefCountedThreadSafe<V4L2ReadableBuffer> {
+class V4L2ReadableBuffer
+      : public ::base::RefCountedThreadSafe<V4L2ReadableBuffer, V4L2ReadableBufferTraits> {
 public:
     // Returns whether the V4L2_BUF_FLAG_LAST flag is set for this buffer.
     bool isLast() const;
     // Returns whether the V4L2_BUF_FLAG_KEYFRAME flag is set for this buffer.
     bool isKeyframe() const;
+    // Returns whether the V4L2_BUF_FLAG_ERROR flag is set for this buffer.
+    bool isError() const;
     // Return the timestamp set by the driver on this buffer.
     struct timeval getTimeStamp() const;
     // Returns the number of planes in this buffer.
@@ -148,7 +183,8 @@ public:
 
 private:
     friend class V4L2BufferRefFactory;
-    friend class ::base::RefCountedThreadSafe<V4L2ReadableBuffer>;
+    friend class ::base::RefCountedThreadSafe<V4L2ReadableBuffer, V4L2ReadableBufferTraits>;
+    friend struct V4L2ReadableBufferTraits;
 
     ~V4L2ReadableBuffer();
 
@@ -157,7 +193,7 @@ private:
     V4L2ReadableBuffer(const V4L2ReadableBuffer&) = delete;
     V4L2ReadableBuffer& operator=(const V4L2ReadableBuffer&) = delete;
 
-    std::unique_ptr<V4L2BufferRefBase> mBufferData;
+    std::unique_ptr<V4L2BufferRefBase, V4L2BufferRefBaseDeleter> mBufferData;
 
     SEQUENCE_CHECKER(mSequenceChecker);
 };
@@ -185,6 +221,17 @@ class V4L2Buffer;
 //    in 1).
 class V4L2Queue : public ::base::RefCountedThreadSafe<V4L2Queue> {
 public:
+    // When the planes of MMAP buffers are mapped in user space.
+    enum class MapMode {
+        // On first access to each plane.
+        kLazy,
+        // When the buffers are allocated.
+        kEager,
+        // When the buffers are allocated, also populating the page tables so that the first access
+        // to the planes doesn't fault.
+        kPrefault,
+    };
+
     // Set |fourcc| as the current format on this queue. |size| corresponds to the desired buffer's
     // dimensions (i.e. width and height members of v4l2_pix_format_mplane (if not applicable, pass
     // Size()).
@@ -227,7 +274,11 @@ public:
     // always check the return value.
     //
     // Calling this method while buffers are still allocated results in an error.
-    size_t allocateBuffers(size_t count, enum v4l2_memory memory) WARN_UNUSED_RESULT;
+    //
+    // |mapMode| is only used with MMAP buffers. Mapping the planes when the buffers are allocated
+    // moves the cost of the mappings out of the processing of the first frames.
+    size_t allocateBuffers(size_t count, enum v4l2_memory memory,
+                           MapMode mapMode = MapMode::kLazy) WARN_UNUSED_RESULT;
 
     // Deallocate all buffers previously allocated by |allocateBuffers|. Any references to buffers
     // previously allocated held by the client must be released, or this call will fail.
@@ -286,8 +337,15 @@ private:
 
     // Called when clients request a buffer to be queued.
     bool queueBuffer(struct v4l2_buffer* v4l2Buffer);
+    // Export the number of queued and free buffers as trace counters.
+    void traceBufferCounts() const;
 
     const enum v4l2_buf_type mType;
+    // The name of the async trace slices of the buffers queued to the device, keyed by buffer id,
+    // and of the counters exported by traceBufferCounts().
+    const std::string mTraceName;
+    const std::string mQueuedCounterName;
+    const std::string mFreeCounterName;
     enum v4l2_memory mMemory = V4L2_MEMORY_MMAP;
     bool mIsStreaming = false;
     size_t mPlanesCount = 0;
@@ -297,10 +355,11 @@ private:
     std::vector<std::unique_ptr<V4L2Buffer>> mBuffers;
 
     // Buffers that are available for client to get and submit. Buffers in this list are not
-    // referenced by anyone else than ourselves.
+    // referenced by anyone else than ourselves. The list also holds the storage of the references
+    // to the buffers, so that getting and dequeuing buffers doesn't allocate memory.
     scoped_refptr<V4L2BuffersList> mFreeBuffers;
-    // Buffers that have been queued by the client, and not dequeued yet.
-    std::set<size_t> mQueuedBuffers;
+    // Buffers that have been queued by the client, and not dequeued yet, indexed by buffer id.
+    std::bitset<VIDEO_MAX_FRAME> mQueuedBuffers;
 
     scoped_refptr<V4L2Device> mDevice;
     // Callback to call in this queue's destructor.
@@ -350,6 +409,10 @@ public:
     // Convert required H264 profile and level to V4L2 enums.
     static int32_t c2ProfileToV4L2H264Profile(C2Config::profile_t profile);
     static int32_t h264LevelIdcToV4L2H264Level(uint8_t levelIdc);
+    // Convert required HEVC profile to V4L2 enum.
+    static int32_t c2ProfileToV4L2HEVCProfile(C2Config::profile_t profile);
+    // Convert required VP8 or VP9 profile to V4L2 enum.
+    static int32_t c2ProfileToV4L2VPxProfile(C2Config::profile_t profile);
     static v4l2_mpeg_video_bitrate_mode C2BitrateModeToV4L2BitrateMode(
             C2Config::bitrate_mode_t bitrateMode);
 
@@ -372,7 +435,7 @@ public:
     // Returns number of planes of |pixFmt|.
     static size_t getNumPlanesOfV4L2PixFmt(uint32_t pixFmt);
 
-    enum class Type { kDecoder, kEncoder };
+    enum class Type { kDecoder, kEncoder, kImageProcessor };
 
     // Create and initialize an appropriate V4L2Device instance for the current platform, or return
     // nullptr if not available.
@@ -381,6 +444,12 @@ public:
     // Open a V4L2 device of |type| for use with |v4l2PixFmt|. Return true on success. The device
     // will be closed in the destructor.
     bool open(Type type, uint32_t v4l2PixFmt);
+    // Same as open(), but the device is opened ahead of its session, e.g. to be kept in the
+    // V4L2DevicePool. It isn't counted as a session on its node until startSession() is called.
+    bool preopen(Type type, uint32_t v4l2PixFmt);
+    // Start the session of a device opened by preopen(), when it's handed out to a component.
+    // Does nothing if the session was already started.
+    void startSession();
 
     // Returns the V4L2Queue corresponding to the requested |type|, or nullptr if the requested
     // queue type is not supported.
@@ -393,9 +462,13 @@ public:
     // - SetDevicePollInterrupt() is called (on another thread),
     // - |pollDevice| is true, and there is new data to be read from the device,
     //   or an event from the device has arrived; in the latter case
-    //   |*eventPending| will be set to true.
-    // Returns false on error, true otherwise. This method should be called from a separate thread.
-    bool poll(bool pollDevice, bool* eventPending);
+    //   |*eventPending| will be set to true,
+    // - |timeoutMs| milliseconds have elapsed, if |timeoutMs| is not negative.
+    // If |deviceEvents| is not null, it is set to the poll() events returned for the device.
+    // Returns false on error or timeout, true otherwise. This method should be called from a
+    // separate thread, unless a timeout is specified.
+    bool poll(bool pollDevice, bool* eventPending, int timeoutMs = -1,
+              uint32_t* deviceEvents = nullptr);
 
     // These methods are used to interrupt the thread sleeping on poll() and force it to return
     // regardless of device state, which is usually when the client is no longer interested in what
@@ -442,6 +515,10 @@ public:
     // sequence if a polling error has occurred.
     bool startPolling(android::V4L2DevicePoller::EventCallback eventCallback,
                       ::base::RepeatingClosure errorCallback);
+    // Start polling this V4L2Device in batched mode, see V4L2DevicePoller. |readinessCallback|
+    // will be posted to the caller's sequence with the readiness mask of the device.
+    bool startPolling(android::V4L2DevicePoller::ReadinessCallback readinessCallback,
+                      ::base::RepeatingClosure errorCallback);
     // Stop polling this V4L2Device if polling was active. No new events will be posted after this
     // method has returned.
     bool stopPolling();
@@ -454,17 +531,35 @@ public:
     // Set the specified list of |ctrls| for the specified |ctrlClass|, returns whether the
     // operation succeeded.
     bool setExtCtrls(uint32_t ctrlClass, std::vector<V4L2ExtCtrl> ctrls);
+    // Set the specified list of |ctrls| in the media request |requestFd|, they are applied when
+    // the request is processed. Returns whether the operation succeeded.
+    bool setExtCtrlsInRequest(std::vector<V4L2ExtCtrl> ctrls, int requestFd);
 
-    // Check whether the V4L2 command with specified |commandId| is supported.
+    // Check whether the V4L2 encoder command with specified |commandId| is supported.
     bool isCommandSupported(uint32_t commandId);
+    // Check whether the V4L2 decoder command with specified |commandId| is supported.
+    bool isDecoderCommandSupported(uint32_t commandId);
     // Check whether the V4L2 device has the specified |capabilities|.
     bool hasCapabilities(uint32_t capabilities);
+    // Get the |major| and |minor| device numbers of the open device node, which identify it in
+    // the topology of its media device. Returns false on failure.
+    bool getDeviceNumber(uint32_t* major, uint32_t* minor);
+
+    // Populate the process-wide cache of the devices available on the system and of the profiles
+    // they support, which is shared by all V4L2Device instances. The cache is otherwise populated
+    // lazily on first use.
+    static void preloadDeviceCache();
+    // Drop the process-wide device cache, e.g. when devices were added or removed. Instances
+    // created afterwards enumerate the devices again.
+    static void invalidateDeviceCache();
 
 private:
     // Vector of video device node paths and corresponding pixelformats supported by each device node.
     using Devices = std::vector<std::pair<std::string, std::vector<uint32_t>>>;
 
     friend class ::base::RefCountedThreadSafe<V4L2Device>;
+    // The poller needs the device fd to register it to the shared V4L2PollReactor.
+    friend class V4L2DevicePoller;
     V4L2Device();
     ~V4L2Device();
 
@@ -482,26 +577,62 @@ private:
     // Close the currently open device.
     void closeDevice();
 
-    // Enumerate all V4L2 devices on the system for |type| and store the results under
-    // mDevicesByType[type].
-    void enumerateDevicesForType(V4L2Device::Type type);
+    // Check whether the currently open device is an image processor, converting between raw pixel
+    // formats.
+    bool isImageProcessor();
+
+    // Enumerate all V4L2 devices on the system for |type|.
+    Devices enumerateDevicesForType(V4L2Device::Type type);
 
     // Return device information for all devices of |type| available in the system. Enumerates and
-    // queries devices on first run and caches the results for subsequent calls.
+    // queries devices on first run in the process and caches the results for subsequent calls.
     const Devices& getDevicesForType(V4L2Device::Type type);
 
-    // Return device node path for device of |type| supporting |pixFmt|, or an empty string if the
-    // given combination is not supported by the system.
-    std::string getDevicePathFor(V4L2Device::Type type, uint32_t pixFmt);
+    // Return the node paths of the devices of |type| supporting |pixFmt| in enumeration order, or
+    // an empty vector if the given combination is not supported by the system.
+    std::vector<std::string> getDevicePathsFor(V4L2Device::Type type, uint32_t pixFmt);
+
+    // Pick the device of |paths| to open. Returns the first path, unless device balancing is
+    // enabled in which case the device with the fewest sessions is picked, ties being broken in a
+    // round-robin fashion.
+    static std::string pickSessionDevice(const std::vector<std::string>& paths);
+    // Count a session on |path| in |sSessionsByPath|.
+    static void acquireSessionDevice(const std::string& path);
+    // Uncount the session started on |path| by acquireSessionDevice().
+    static void releaseSessionDevice(const std::string& path);
 
     // Callback that is called upon a queue's destruction, to cleanup its pointer in mQueues.
     void onQueueDestroyed(v4l2_buf_type buf_type);
 
-    // Stores information for all devices available on the system for each device Type.
+    // Stores information for all devices available on the system for each device Type, copied
+    // from |sDevicesByType| on first use so it stays valid if the cache is invalidated.
     std::map<V4L2Device::Type, Devices> mDevicesByType;
 
+    // The process-wide device cache, see preloadDeviceCache().
+    static std::mutex sDeviceCacheLock;
+    static std::map<V4L2Device::Type, Devices> sDevicesByType GUARDED_BY(sDeviceCacheLock);
+    static std::optional<SupportedEncodeProfiles> sEncodeProfiles GUARDED_BY(sDeviceCacheLock);
+    static std::map<std::vector<uint32_t>, SupportedDecodeProfiles> sDecodeProfiles
+            GUARDED_BY(sDeviceCacheLock);
+
+    // The process-wide number of sessions started on each node path, used to balance the sessions
+    // across the nodes supporting the same format. The devices kept open by V4L2DevicePool aren't
+    // counted until they're handed out.
+    static std::mutex sSessionLock;
+    static std::map<std::string, size_t> sSessionsByPath GUARDED_BY(sSessionLock);
+    static size_t sNextSessionDevice GUARDED_BY(sSessionLock);
+    // The node path the device was opened on by preopen(), empty if not opened by preopen().
+    std::string mDevicePath;
+    // The type and the pixel format the device was opened for by preopen().
+    Type mDeviceType = Type::kDecoder;
+    uint32_t mDevicePixFmt = 0;
+    // Whether a session was started on |mDevicePath| by startSession().
+    bool mSessionStarted = false;
+
     // The actual device fd.
     ::base::ScopedFD mDeviceFd;
+    // Records the ioctls and polls of the session started by startSession(), if enabled.
+    std::unique_ptr<V4L2IoctlRecorder> mIoctlRecorder;
 
     // eventfd fd to signal device poll thread when its poll() should be interrupted.
     ::base::ScopedFD mDevicePollInterruptFd;
@@ -7,20 +7,25 @@
 #define ANDROID_V4L2_CODEC2_COMMON_V4L2_DEVICE_POLLER_H
 
 #include <atomic>
+#include <optional>
 
 #include <base/callback_forward.h>
+#include <base/memory/weak_ptr.h>
 #include <base/sequence_checker.h>
 #include <base/sequenced_task_runner.h>
 #include <base/synchronization/waitable_event.h>
 #include <base/threading/thread.h>
 
+#include <v4l2_codec2/common/V4L2PollReactor.h>
+
 namespace android {
 
 class V4L2Device;
 
 // Allows a client to poll() on a given V4L2Device and be signaled when a buffer is ready to be
-// dequeued or a V4L2 event has been received. Polling is done on a dedicated thread, and
-// notifications are delivered in the form of a callback to the listener's sequence.
+// dequeued or a V4L2 event has been received. Polling is done on a dedicated thread, or on the
+// process-wide V4L2PollReactor if enabled by the ro.vendor.v4l2_codec2.shared_device_poller
+// property, and notifications are delivered in the form of a callback to the listener's sequence.
 //
 // All the methods of this class (with the exception of the constructor) must be called from the
 // same sequence.
@@ -34,6 +39,23 @@ public:
     // set if a V4L2 event has been detected.
     using EventCallback = ::base::RepeatingCallback<void(bool event)>;
 
+    // The readiness bits reported to a ReadinessCallback.
+    enum Readiness : uint32_t {
+        // A buffer can be dequeued from the V4L2 OUTPUT queue (POLLOUT).
+        kInputReady = 1u << 0,
+        // A buffer can be dequeued from the V4L2 CAPTURE queue (POLLIN).
+        kOutputReady = 1u << 1,
+        // A V4L2 event is pending (POLLPRI).
+        kEventPending = 1u << 2,
+    };
+    // Callback to be called in batched mode with the |readiness| mask of the device. Returns
+    // whether the client made progress, i.e. dequeued a buffer or a V4L2 event.
+    using ReadinessCallback = ::base::RepeatingCallback<bool(uint32_t readiness)>;
+
+    // Returns whether clients should poll in batched mode, which is enabled by the
+    // ro.vendor.v4l2_codec2.batched_device_poll property.
+    static bool isBatchedPollingEnabled();
+
     // Create a poller for |device|, using a thread named |threadName|. Notification won't start
     // until |startPolling()| is called.
     V4L2DevicePoller(V4L2Device* const device, const std::string& threadName);
@@ -46,6 +68,12 @@ public:
     //
     // If an error occurs during polling, |mErrorCallback| will be posted on the caller's sequence.
     bool startPolling(EventCallback eventCallback, ::base::RepeatingClosure errorCallback);
+    // Starts polling in batched mode. The readiness of both queues and the event readiness are
+    // reported together to |readinessCallback|, so the client can service the device in one pass.
+    // Once the callback has run the poller keeps polling by itself as long as the callback made
+    // progress, without waiting for |schedulePoll()|. Otherwise the poller waits for the next
+    // |schedulePoll()|, as the readiness which could not be serviced would be reported again.
+    bool startPolling(ReadinessCallback readinessCallback, ::base::RepeatingClosure errorCallback);
     // Stop polling and stop the thread. The poller won't post any new event to the caller's
     // sequence after this method has returned.
     bool stopPolling();
@@ -59,9 +87,23 @@ public:
     void schedulePoll();
 
 private:
+    // Start polling with the callbacks set by the public startPolling() methods.
+    bool startPollingInternal();
+
     // Perform a poll() on |mDevice| and post either |mEventCallback| or |mErrorCallback| on the
     // client's sequence when poll() returns.
     void devicePollTask();
+    // Batched mode version of devicePollTask(), which posts dispatchReadiness() and polls again
+    // once it has run.
+    void batchedDevicePollTask();
+    // Run |mReadinessCallback| with |readiness| on the client's sequence.
+    void dispatchReadiness(uint32_t readiness);
+
+    // Start and stop polling on the shared V4L2PollReactor instead of |mPollThread|.
+    bool startReactorPolling();
+    void stopReactorPolling();
+    // Called on the client's sequence when the reactor polled the |events| of the device.
+    void onReactorEvents(uint32_t events);
 
     // V4L2 device we are polling.
     V4L2Device* const mDevice;
@@ -69,6 +111,8 @@ private:
     ::base::Thread mPollThread;
     // Callback to post to the client's sequence when an event occurs.
     EventCallback mEventCallback;
+    // Callback to post to the client's sequence in batched mode, set instead of |mEventCallback|.
+    ReadinessCallback mReadinessCallback;
     // Closure to post to the client's sequence when an error occurs.
     ::base::RepeatingClosure mErrorCallback;
     // Client sequence's task runner, where closures are posted.
@@ -79,8 +123,20 @@ private:
     // the polling thread will wait on this WaitableEvent (signaled by |schedulePoll| before calling
     // poll(), so we only call it when we are actually waiting for an event.
     ::base::WaitableEvent mTriggerPoll;
+    // Signaled in batched mode once the readiness callback has run, as the readiness reported by
+    // poll() doesn't change until the client has serviced the device.
+    ::base::WaitableEvent mReadinessDispatched;
+    // Whether the last readiness callback made progress, set before |mReadinessDispatched| is
+    // signaled.
+    std::atomic_bool mReadinessProgressed{false};
     // Set to true when we wish to stop polling, instructing the poller thread to break its loop.
     std::atomic_bool mStopPolling;
+
+    // The token of |mDevice| on the shared V4L2PollReactor, set while polling on the reactor.
+    std::optional<V4L2PollReactor::Token> mReactorToken;
+
+    ::base::WeakPtr<V4L2DevicePoller> mWeakThis;
+    ::base::WeakPtrFactory<V4L2DevicePoller> mWeakThisFactory{this};
 };
 
 }  // namespace android
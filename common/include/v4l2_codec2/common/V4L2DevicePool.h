@@ -0,0 +1,75 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_V4L2_DEVICE_POOL_H
+#define ANDROID_V4L2_CODEC2_COMMON_V4L2_DEVICE_POOL_H
+
+#include <stdint.h>
+
+#include <deque>
+#include <map>
+#include <mutex>
+#include <utility>
+
+#include <base/memory/scoped_refptr.h>
+#include <base/threading/thread.h>
+
+#include <v4l2_codec2/common/V4L2Device.h>
+
+namespace android {
+
+// Process-wide pool of V4L2 devices which are opened ahead of time, so opening the device node
+// and creating its poll interrupt eventfd is not on the critical path of starting a codec. After a
+// device is handed out, the pool is refilled in the background up to its configured size.
+//
+// Pooled devices are never recycled: a device released by a codec is closed, as drivers keep
+// per-fd state (formats, controls) which can't be reset reliably. A handed-out device is thus
+// always in the same clean state as a device which was just opened.
+//
+// All the methods of this class are thread-safe.
+class V4L2DevicePool {
+public:
+    // Get the device pool of the process.
+    static V4L2DevicePool* get();
+
+    // Keep |size| opened devices of |type| supporting |v4l2PixFmt| in the pool. A size of 0
+    // disables pooling for these devices, which is the default.
+    void setPoolSize(V4L2Device::Type type, uint32_t v4l2PixFmt, size_t size);
+
+    // Take an opened device of |type| supporting |v4l2PixFmt| from the pool, or open a new device
+    // if the pool is empty. Returns nullptr if no device could be opened.
+    scoped_refptr<V4L2Device> acquire(V4L2Device::Type type, uint32_t v4l2PixFmt);
+
+private:
+    using Key = std::pair<V4L2Device::Type, uint32_t>;
+
+    struct Pool {
+        size_t mSize = 0;
+        std::deque<scoped_refptr<V4L2Device>> mDevices;
+        // Whether a refill task is already scheduled for this pool.
+        bool mRefillPending = false;
+    };
+
+    V4L2DevicePool() = default;
+    ~V4L2DevicePool() = default;
+
+    // Schedule a refill of the pool identified by |key| if needed. |mLock| must be held.
+    void scheduleRefillLocked(const Key& key, Pool& pool);
+    // Open devices on |mRefillThread| until the pool identified by |key| is full.
+    void refillTask(Key key);
+
+    // Open a new device of |type| supporting |v4l2PixFmt| without starting its session, returns
+    // nullptr on failure.
+    static scoped_refptr<V4L2Device> openDevice(V4L2Device::Type type, uint32_t v4l2PixFmt);
+
+    // Thread on which the pools are refilled, started on first use.
+    ::base::Thread mRefillThread{"V4L2DevicePool"};
+
+    std::mutex mLock;
+    std::map<Key, Pool> mPools;
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_V4L2_DEVICE_POOL_H
@@ -0,0 +1,64 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_V4L2_IMAGE_PROCESSOR_H
+#define ANDROID_V4L2_CODEC2_COMMON_V4L2_IMAGE_PROCESSOR_H
+
+#include <memory>
+#include <optional>
+
+#include <base/memory/scoped_refptr.h>
+
+#include <v4l2_codec2/common/ConversionBackend.h>
+
+namespace android {
+
+class V4L2Device;
+class V4L2Queue;
+
+// ConversionBackend implemented on a V4L2 memory-to-memory image processor. Frames are imported
+// into the device as DMABUF buffers on both queues, and converted one at a time.
+class V4L2ImageProcessor : public ConversionBackend {
+public:
+    // Create an image processor producing frames in |outFormat|, or return nullptr if there is no
+    // such device on the system.
+    static std::unique_ptr<V4L2ImageProcessor> Create(VideoPixelFormat outFormat);
+    ~V4L2ImageProcessor() override;
+
+    V4L2ImageProcessor(const V4L2ImageProcessor&) = delete;
+    V4L2ImageProcessor& operator=(const V4L2ImageProcessor&) = delete;
+
+    bool convert(int inputFd, const VideoFrameLayout& inputLayout, int outputFd,
+                 const VideoFrameLayout& outputLayout) override;
+
+private:
+    // The time after which a conversion is considered stuck.
+    static constexpr int kConvertTimeoutMs = 500;
+
+    V4L2ImageProcessor(scoped_refptr<V4L2Device> device, scoped_refptr<V4L2Queue> inputQueue,
+                       scoped_refptr<V4L2Queue> outputQueue);
+
+    // Configure the device for |inputLayout| and |outputLayout| unless it is already, returns
+    // false if the device can't handle the layouts as is.
+    bool configure(const VideoFrameLayout& inputLayout, const VideoFrameLayout& outputLayout);
+    // Set the format of |queue| to match |layout|, returns the buffer size required by the device.
+    std::optional<size_t> configureQueue(V4L2Queue* queue, const VideoFrameLayout& layout);
+    // Stop streaming and release the device buffers, so the device can be configured again.
+    void reset();
+
+    // The V4L2 device and associated queues, the frames to convert are queued on the input queue.
+    scoped_refptr<V4L2Device> mDevice;
+    scoped_refptr<V4L2Queue> mInputQueue;
+    scoped_refptr<V4L2Queue> mOutputQueue;
+
+    // The layouts currently configured on the device, and the matching buffer sizes.
+    std::optional<VideoFrameLayout> mInputLayout;
+    std::optional<VideoFrameLayout> mOutputLayout;
+    size_t mInputBufferSize = 0;
+    size_t mOutputBufferSize = 0;
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_V4L2_IMAGE_PROCESSOR_H
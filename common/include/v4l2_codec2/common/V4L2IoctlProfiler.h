@@ -0,0 +1,31 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_V4L2_IOCTL_PROFILER_H
+#define ANDROID_V4L2_CODEC2_COMMON_V4L2_IOCTL_PROFILER_H
+
+#include <string>
+
+#include <base/time/time.h>
+
+namespace android {
+
+// Process-wide counters and latency histograms of the ioctls sent to the V4L2 devices, by request
+// code. Enabled by the "ro.vendor.v4l2_codec2.ioctl_profiler" property. The samples are recorded
+// from any thread without locking, and can be dumped at any time.
+class V4L2IoctlProfiler {
+public:
+    static bool isEnabled();
+
+    // Record an ioctl of |request| which took |latency|.
+    static void record(int request, ::base::TimeDelta latency);
+
+    // Dump the number of calls, the mean, max and approximate p50/p99 latencies and the latency
+    // histogram of each profiled ioctl. Returns an empty string if the profiler is disabled.
+    static std::string dump();
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_V4L2_IOCTL_PROFILER_H
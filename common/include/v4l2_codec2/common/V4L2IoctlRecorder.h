@@ -0,0 +1,115 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_V4L2_IOCTL_RECORDER_H
+#define ANDROID_V4L2_CODEC2_COMMON_V4L2_IOCTL_RECORDER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <base/thread_annotations.h>
+#include <base/time/time.h>
+
+namespace android {
+
+// The binary trace written by V4L2IoctlRecorder, in the native byte order: a V4L2TraceHeader
+// followed by V4L2TraceRecords, each followed by |payloadSize| bytes.
+//
+// The payload of an ioctl record is its argument as passed to the driver (_IOC_SIZE(request)
+// bytes), followed by:
+// - For the QBUF, DQBUF, QUERYBUF and PREPARE_BUF ioctls of the multi-planar queues, the
+//   |length| planes of the buffer. For the QBUF of the MMAP buffers of the OUTPUT queue, the
+//   planes are followed by the data of each plane: its size in a uint32_t and its |bytesused|
+//   bytes, so the bitstream fed to a decoder can be replayed.
+// - For the S_EXT_CTRLS, G_EXT_CTRLS and TRY_EXT_CTRLS ioctls, the |count| controls, followed by
+//   the payloads of the controls having a |size|.
+// The poll records have no payload.
+constexpr char kV4L2TraceMagic[8] = {'V', '4', 'L', '2', 'T', 'R', 'C', '\0'};
+constexpr uint32_t kV4L2TraceVersion = 1;
+
+struct V4L2TraceHeader {
+    char magic[8];
+    uint32_t version;
+    // The V4L2Device::Type and the pixel format the device was opened for.
+    uint32_t deviceType;
+    uint32_t pixFmt;
+    uint32_t reserved;
+};
+
+enum class V4L2TraceRecordKind : uint32_t { kIoctl = 1, kPoll = 2 };
+
+struct V4L2TraceRecord {
+    V4L2TraceRecordKind kind;
+    // The request code of the ioctls. The device events returned by poll() for the polls, 0 if
+    // the device wasn't polled.
+    uint32_t request;
+    // The start of the call, relative to the opening of the device, and its duration.
+    int64_t startNs;
+    int64_t durationNs;
+    // The return value of the call, and errno if it failed.
+    int32_t ret;
+    int32_t error;
+    uint32_t payloadSize;
+    uint32_t reserved;
+};
+
+// Records the ioctls and polls of a V4L2Device to a trace file, to replay the exact sequence and
+// timing of the driver calls of a session with the v4l2_codec2_ioctl_replay tool. Enabled by the
+// "ro.vendor.v4l2_codec2.ioctl_trace_dir" property, the directory in which a trace file is
+// written for each device session. The recording stops once the trace reaches the size set by the
+// "ro.vendor.v4l2_codec2.ioctl_trace_max_mb" property, 0 meaning no limit. The calls are recorded
+// from any thread, under a lock.
+class V4L2IoctlRecorder {
+public:
+    // Create a recorder for a device of |deviceType| opened for |pixFmt|. Returns nullptr if the
+    // recording is disabled or the trace file can't be created.
+    static std::unique_ptr<V4L2IoctlRecorder> create(uint32_t deviceType, uint32_t pixFmt);
+    ~V4L2IoctlRecorder();
+
+    // Serialize the argument |arg| of the ioctl of |request| into a trace payload. This must be
+    // called before the ioctl, as the driver overwrites the argument.
+    std::vector<uint8_t> serializeArgument(int request, const void* arg);
+    // Record an ioctl of |request| with the serialized argument |payload|.
+    void recordIoctl(int request, const std::vector<uint8_t>& payload, ::base::TimeTicks start,
+                     ::base::TimeDelta duration, int ret, int error);
+    // Record a poll() which returned |ret| and |deviceEvents| for the device.
+    void recordPoll(uint32_t deviceEvents, ::base::TimeTicks start, ::base::TimeDelta duration,
+                    int ret, int error);
+
+    // Track the mappings of the MMAP buffers, to record the data queued into them.
+    void onMmap(void* addr, size_t length, uint32_t offset);
+    void onMunmap(void* addr);
+
+    const std::string& path() const { return mPath; }
+
+private:
+    struct Mapping {
+        const uint8_t* addr;
+        size_t length;
+    };
+
+    V4L2IoctlRecorder(std::string path, FILE* file, size_t maxBytes);
+    void write(const V4L2TraceRecord& record, const std::vector<uint8_t>& payload);
+
+    const std::string mPath;
+    const ::base::TimeTicks mStartTime;
+    // The maximum size of the trace file, 0 if unlimited.
+    const size_t mMaxBytes;
+
+    std::mutex mLock;
+    FILE* mFile GUARDED_BY(mLock);
+    size_t mBytesWritten GUARDED_BY(mLock);
+    // The mappings of the MMAP buffers of the device, by offset.
+    std::map<uint32_t, Mapping> mMappings GUARDED_BY(mLock);
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_V4L2_IOCTL_RECORDER_H
@@ -0,0 +1,47 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_V4L2_MEDIA_DEVICE_H
+#define ANDROID_V4L2_CODEC2_COMMON_V4L2_MEDIA_DEVICE_H
+
+#include <stdint.h>
+
+#include <memory>
+
+#include <base/files/scoped_file.h>
+
+namespace android {
+
+class V4L2Device;
+
+// The media controller device a V4L2 video device belongs to. Stateless codecs use it to allocate
+// the media requests which bind the buffers of a frame to the controls describing it, see the V4L2
+// Request API.
+class V4L2MediaDevice {
+public:
+    // Open the media device exposing the currently open video device of |device|. Returns nullptr
+    // if there is none, or the media device doesn't support requests.
+    static std::unique_ptr<V4L2MediaDevice> Open(V4L2Device* device);
+    ~V4L2MediaDevice();
+
+    V4L2MediaDevice(const V4L2MediaDevice&) = delete;
+    V4L2MediaDevice& operator=(const V4L2MediaDevice&) = delete;
+
+    // Allocate a new media request. Returns an invalid fd on failure.
+    ::base::ScopedFD allocateRequest();
+
+    // Queue the media request |requestFd| to the device, once its buffers and controls are set.
+    static bool queueRequest(int requestFd);
+    // Reinitialize the completed media request |requestFd|, so it can be reused.
+    static bool reinitRequest(int requestFd);
+
+private:
+    explicit V4L2MediaDevice(::base::ScopedFD mediaFd);
+
+    ::base::ScopedFD mMediaFd;
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_V4L2_MEDIA_DEVICE_H
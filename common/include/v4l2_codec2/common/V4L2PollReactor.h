@@ -0,0 +1,83 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_V4L2_POLL_REACTOR_H
+#define ANDROID_V4L2_CODEC2_COMMON_V4L2_POLL_REACTOR_H
+
+#include <stdint.h>
+
+#include <map>
+#include <mutex>
+#include <optional>
+
+#include <base/callback.h>
+#include <base/files/scoped_file.h>
+#include <base/sequenced_task_runner.h>
+#include <base/threading/thread.h>
+
+namespace android {
+
+// Process-wide reactor multiplexing the fds of all the polled V4L2 devices on a single epoll
+// thread, instead of using one poll thread per device. Each registered fd is polled once per call
+// to arm(), and the client's event callback is posted to the client's sequence when the fd becomes
+// ready.
+//
+// All the methods of this class are thread-safe.
+class V4L2PollReactor {
+public:
+    // Callback to be called when the fd is ready, with the epoll events of the fd.
+    using EventCallback = ::base::RepeatingCallback<void(uint32_t events)>;
+    // The token identifying a registered fd.
+    using Token = uint64_t;
+
+    // Get the reactor of the process, starting it on first use. Returns nullptr if the reactor
+    // failed to start.
+    static V4L2PollReactor* get();
+
+    // Register |fd|, |eventCallback| and |errorCallback| will be posted to |taskRunner|. The fd is
+    // not polled until arm() is called. Returns nullopt on failure.
+    std::optional<Token> add(int fd, scoped_refptr<::base::SequencedTaskRunner> taskRunner,
+                             EventCallback eventCallback, ::base::RepeatingClosure errorCallback);
+    // Unregister the fd identified by |token|. No callback will be posted after this method has
+    // returned.
+    void remove(Token token);
+    // Poll the fd identified by |token| until it becomes ready, then post its event callback once.
+    bool arm(Token token);
+
+private:
+    struct Registration {
+        int mFd;
+        scoped_refptr<::base::SequencedTaskRunner> mTaskRunner;
+        EventCallback mEventCallback;
+        ::base::RepeatingClosure mErrorCallback;
+    };
+
+    // The maximal number of events handled per epoll_wait() call.
+    static constexpr int kMaxEvents = 16;
+
+    V4L2PollReactor() = default;
+    ~V4L2PollReactor() = default;
+
+    // Create the epoll instance and start the reactor thread.
+    bool initialize();
+    // Wait for ready fds and post their callbacks, until an error occurs.
+    void reactorTask();
+
+    // The epoll instance all the registered fds are added to.
+    ::base::ScopedFD mEpollFd;
+    // Thread on which epoll_wait() is called.
+    ::base::Thread mReactorThread{"V4L2PollReactor"};
+
+    // Lock protecting the members below. Callbacks are posted while holding the lock, so remove()
+    // can guarantee no callback gets posted after it returned.
+    std::mutex mLock;
+    std::map<Token, Registration> mRegistrations;
+    Token mNextToken = 0;
+    // Set when epoll_wait() failed, no fd can be registered anymore.
+    bool mFailed = false;
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_V4L2_POLL_REACTOR_H
@@ -0,0 +1,98 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_V4L2_RESOURCE_MANAGER_H
+#define ANDROID_V4L2_CODEC2_COMMON_V4L2_RESOURCE_MANAGER_H
+
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <ui/Size.h>
+
+#include <v4l2_codec2/common/V4L2Device.h>
+
+namespace android {
+
+// Process-wide admission control of the codec sessions, against a budget of macroblocks per
+// second (MB/s) for each type of V4L2 device. Unlike a plain instance count, a 4K60 session then
+// takes a much larger share of the hardware than a QCIF one. Enabled by the
+// "ro.vendor.v4l2_codec2.admission_control" property.
+//
+// The budget of the decoders and of the encoders is read from the
+// "ro.vendor.v4l2_codec2.{decode,encode}_max_macroblocks_per_second" properties, or derived from
+// the largest resolution and frame rate of the profiles reported by the devices otherwise.
+//
+// All the methods of this class are thread-safe.
+class V4L2ResourceManager {
+public:
+    // A share of the budget of a device type held by a codec session, returned to the budget on
+    // destruction.
+    class Reservation {
+    public:
+        ~Reservation();
+        Reservation(const Reservation&) = delete;
+        Reservation& operator=(const Reservation&) = delete;
+
+        // Resize the share to |macroblocksPerSecond|, e.g. once the resolution and frame rate of
+        // the session are known. Returns false, keeping the current share, if the budget can't
+        // cover the new share.
+        bool update(uint64_t macroblocksPerSecond);
+
+    private:
+        friend class V4L2ResourceManager;
+        Reservation(V4L2ResourceManager* manager, V4L2Device::Type type,
+                    uint64_t macroblocksPerSecond);
+
+        V4L2ResourceManager* const mManager;
+        const V4L2Device::Type mType;
+        uint64_t mMacroblocksPerSecond;
+    };
+
+    // Get the resource manager of the process.
+    static V4L2ResourceManager* get();
+    // Whether the codec sessions are admitted against the budgets.
+    static bool isEnabled();
+    // Get the load of encoding or decoding frames of |size| at |frameRate|.
+    static uint64_t getMacroblocksPerSecond(const ui::Size& size, float frameRate);
+
+    // Reserve a share of |macroblocksPerSecond| of the budget of |type|. Returns nullptr if the
+    // budget can't cover it.
+    std::unique_ptr<Reservation> reserve(V4L2Device::Type type, uint64_t macroblocksPerSecond);
+
+    // Dump the used and total budget of each device type. Returns an empty string if admission
+    // control is disabled.
+    std::string dump();
+
+private:
+    struct Budget {
+        // The total budget, 0 if unlimited.
+        uint64_t mCapacity = 0;
+        uint64_t mUsed = 0;
+        size_t mNumReservations = 0;
+    };
+
+    V4L2ResourceManager() = default;
+    ~V4L2ResourceManager() = default;
+
+    // Get the budget of |type|, which is computed on first use. |mLock| must be held.
+    Budget& getBudgetLocked(V4L2Device::Type type);
+    // Change the share of a reservation of |type| from |oldShare| to |newShare|. Returns false if
+    // the budget can't cover the change.
+    bool resize(V4L2Device::Type type, uint64_t oldShare, uint64_t newShare);
+    void release(V4L2Device::Type type, uint64_t share);
+
+    // Compute the total budget of |type| from the properties or the device profiles.
+    static uint64_t computeCapacity(V4L2Device::Type type);
+
+    std::mutex mLock;
+    std::map<V4L2Device::Type, Budget> mBudgets;
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_V4L2_RESOURCE_MANAGER_H
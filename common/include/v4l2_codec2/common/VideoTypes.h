@@ -19,10 +19,12 @@ enum class VideoCodec {
     VP8,
     VP9,
     HEVC,
+    AV1,
 };
 
 constexpr std::initializer_list<VideoCodec> kAllCodecs = {VideoCodec::H264, VideoCodec::VP8,
-                                                          VideoCodec::VP9, VideoCodec::HEVC};
+                                                          VideoCodec::VP9, VideoCodec::HEVC,
+                                                          VideoCodec::AV1};
 
 const char* VideoCodecToString(VideoCodec codec);
 const char* profileToString(C2Config::profile_t profile);
@@ -36,6 +38,8 @@ enum class HalPixelFormat : int32_t {
     YV12 = static_cast<int32_t>(HPixelFormat::YV12),
     // NV12 is not defined at PixelFormat, follow the convention to use fourcc value.
     NV12 = 0x3231564e,
+    // YCBCR_P010 is only defined at PixelFormat since graphics.common@1.1.
+    YCBCR_P010 = 0x36,
 };
 const char* HalPixelFormatToString(HalPixelFormat format);
 
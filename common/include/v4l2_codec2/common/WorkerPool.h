@@ -0,0 +1,77 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_WORKER_POOL_H
+#define ANDROID_V4L2_CODEC2_COMMON_WORKER_POOL_H
+
+#include <stddef.h>
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace android {
+
+// A small, bounded pool of worker threads used to run data-parallel jobs, e.g. converting the
+// horizontal stripes of a frame concurrently. The worker threads of all the pools in the process
+// are taken from a single budget, so several codec instances cannot oversubscribe the CPU cores.
+//
+// The budget defaults to the number of online CPU cores minus one (the calling thread always takes
+// part in the work), and can be overridden by "ro.vendor.v4l2_codec2.worker_thread_budget".
+//
+// All the methods must be called from the same sequence.
+class WorkerPool {
+public:
+    // Create a pool of up to |maxThreads| workers named |name|. The number of workers is reduced to
+    // what is left in the process-wide budget. nullptr is returned if no worker could be reserved,
+    // in which case the caller should run its jobs inline.
+    static std::unique_ptr<WorkerPool> Create(size_t maxThreads, const std::string& name);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    // Returns the number of threads that are still available in the process-wide budget.
+    static size_t availableThreads();
+
+    // Returns the number of worker threads owned by this pool.
+    size_t numThreads() const { return mThreads.size(); }
+
+    // Run |job(i)| for every i in [0, count) on the worker threads and the calling thread. This
+    // method blocks until all the jobs have completed.
+    void parallelFor(size_t count, const std::function<void(size_t)>& job);
+
+private:
+    explicit WorkerPool(size_t numThreads);
+
+    // The main loop of each worker thread.
+    void workerLoop();
+    // Run the jobs of the current batch until none is left. |mLock| must be held.
+    void runJobsLocked(std::unique_lock<std::mutex>& lock);
+
+    std::vector<std::thread> mThreads;
+
+    std::mutex mLock;
+    // Signaled when a new batch of jobs is posted, or when the pool is destroyed.
+    std::condition_variable mJobsAvailable;
+    // Signaled when the last job of the current batch has completed.
+    std::condition_variable mJobsDone;
+
+    // The job of the current batch, the index of the next job to run, the total number of jobs,
+    // and the number of jobs that are currently running.
+    const std::function<void(size_t)>* mJob = nullptr;
+    size_t mNextJob = 0;
+    size_t mJobCount = 0;
+    size_t mRunningJobs = 0;
+    // Set to true when the pool is destroyed, instructing the worker threads to exit.
+    bool mQuit = false;
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_WORKER_POOL_H
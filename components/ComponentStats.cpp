@@ -0,0 +1,123 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "ComponentStats"
+
+#include <v4l2_codec2/components/ComponentStats.h>
+
+#include <inttypes.h>
+#include <algorithm>
+#include <set>
+
+#include <base/strings/stringprintf.h>
+#include <log/log.h>
+
+#include <v4l2_codec2/common/Percentile.h>
+
+namespace android {
+namespace {
+
+// The number of latest latencies the percentiles are computed from.
+constexpr size_t kMaxLatencySamples = 1024;
+
+// The live statistics of the process, the entries are removed when destroyed.
+std::mutex sRegistryLock;
+std::set<const ComponentStats*>& getRegistry() {
+    static std::set<const ComponentStats*>* const sRegistry = new std::set<const ComponentStats*>();
+    return *sRegistry;
+}
+
+}  // namespace
+
+// static
+std::shared_ptr<ComponentStats> ComponentStats::Create(const std::string& name) {
+    std::shared_ptr<ComponentStats> stats(new ComponentStats(name));
+
+    std::lock_guard<std::mutex> lock(sRegistryLock);
+    getRegistry().insert(stats.get());
+    return stats;
+}
+
+ComponentStats::ComponentStats(const std::string& name) : mName(name) {
+    ALOGV("%s(%s)", __func__, name.c_str());
+}
+
+ComponentStats::~ComponentStats() {
+    ALOGV("%s()", __func__);
+
+    std::lock_guard<std::mutex> lock(sRegistryLock);
+    getRegistry().erase(this);
+}
+
+void ComponentStats::addLatency(::base::TimeDelta latency) {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (mLatenciesUs.size() < kMaxLatencySamples) {
+        mLatenciesUs.push_back(latency.InMicroseconds());
+        return;
+    }
+    mLatenciesUs[mNextLatency] = latency.InMicroseconds();
+    mNextLatency = (mNextLatency + 1) % kMaxLatencySamples;
+}
+
+void ComponentStats::addConversionTime(::base::TimeDelta time) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mConversionTime += time;
+    mNumConversions++;
+}
+
+void ComponentStats::setBufferWaitTime(::base::TimeDelta time) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mBufferWaitTime = time;
+}
+
+std::string ComponentStats::dump() const {
+    std::vector<int64_t> latenciesUs;
+    int64_t averageConversionUs = 0;
+    int64_t bufferWaitMs = 0;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        latenciesUs = mLatenciesUs;
+        if (mNumConversions > 0) {
+            averageConversionUs =
+                    mConversionTime.InMicroseconds() / static_cast<int64_t>(mNumConversions);
+        }
+        bufferWaitMs = mBufferWaitTime.InMilliseconds();
+    }
+    std::sort(latenciesUs.begin(), latenciesUs.end());
+
+    std::string dump = ::base::StringPrintf("  %s:\n", mName.c_str());
+    ::base::StringAppendF(&dump,
+                          "    frames in: %" PRIu64 ", out: %" PRIu64 ", dropped: %" PRIu64 "\n",
+                          mFramesIn.load(std::memory_order_relaxed),
+                          mFramesOut.load(std::memory_order_relaxed),
+                          mFramesDropped.load(std::memory_order_relaxed));
+    ::base::StringAppendF(&dump,
+                          "    latency of the last %zu frames: p50 %" PRId64 " us, p99 %" PRId64
+                          " us\n",
+                          latenciesUs.size(), getPercentile(latenciesUs, 50),
+                          getPercentile(latenciesUs, 99));
+    ::base::StringAppendF(&dump, "    waiting for V4L2 buffers: %" PRId64 " ms\n", bufferWaitMs);
+    ::base::StringAppendF(&dump, "    pool starvations: %" PRIu64 "\n",
+                          mPoolStarvations.load(std::memory_order_relaxed));
+    ::base::StringAppendF(&dump,
+                          "    output blocks recycled: %" PRIu64 ", allocated: %" PRIu64 "\n",
+                          mRecycledOutputBlocks.load(std::memory_order_relaxed),
+                          mAllocatedOutputBlocks.load(std::memory_order_relaxed));
+    ::base::StringAppendF(&dump, "    average conversion time: %" PRId64 " us\n",
+                          averageConversionUs);
+    ::base::StringAppendF(&dump, "    V4L2 memory: %zu KB\n",
+                          mMemoryUsage.load(std::memory_order_relaxed) / 1024);
+    return dump;
+}
+
+// static
+std::string ComponentStats::DumpAll() {
+    std::lock_guard<std::mutex> lock(sRegistryLock);
+    std::string dump = ::base::StringPrintf("V4L2 components (%zu):\n", getRegistry().size());
+    for (const ComponentStats* stats : getRegistry()) dump += stats->dump();
+    return dump;
+}
+
+}  // namespace android
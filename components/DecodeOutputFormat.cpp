@@ -0,0 +1,145 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "DecodeOutputFormat"
+
+#include <v4l2_codec2/components/DecodeOutputFormat.h>
+
+#include <algorithm>
+
+#include <cutils/properties.h>
+#include <log/log.h>
+
+#include <v4l2_codec2/common/Fourcc.h>
+#include <v4l2_codec2/common/VideoPixelFormat.h>
+
+namespace android {
+namespace {
+
+// The gralloc usage of the Qualcomm gralloc implementations requesting UBWC compressed buffers
+// (GRALLOC_USAGE_PRIVATE_ALLOC_UBWC).
+constexpr uint64_t kDefaultUbwcUsage = 0x10000000;
+
+// Currently we only support flexible pixel 420 format YCBCR_420_888 in Android.
+// Here is the list of flexible 420 format.
+constexpr uint32_t kLinearOutputFourccs[] = {
+        Fourcc::YU12, Fourcc::YV12, Fourcc::YM12, Fourcc::YM21,
+        Fourcc::NV12, Fourcc::NV21, Fourcc::NM12, Fourcc::NM21,
+};
+
+// The rank of |format| in the order of preference of the output formats: the compressed and tiled
+// formats come first, and 8-bit formats before 10-bit formats, which are only picked when the
+// device can't write 8-bit frames of the stream.
+int getPreferenceRank(const DecodeOutputFormat& format) {
+    return (format.isLinear() ? 2 : 0) + (format.is10Bit() ? 1 : 0);
+}
+constexpr int kNumPreferenceRanks = 4;
+
+// Whether the decoders prefer the compressed and tiled formats of the device.
+bool isCompressedOutputEnabled() {
+    static const bool kEnabled =
+            property_get_bool("ro.vendor.v4l2_codec2.decode_compressed_output", false);
+    return kEnabled;
+}
+
+// The gralloc usage bits requesting the UBWC layout, which differ between gralloc versions.
+uint64_t getUbwcUsage() {
+    static const uint64_t kUsage = static_cast<uint64_t>(property_get_int64(
+            "ro.vendor.v4l2_codec2.decode_ubwc_usage", static_cast<int64_t>(kDefaultUbwcUsage)));
+    return kUsage;
+}
+
+}  // namespace
+
+bool isDecode10BitOutputEnabled() {
+    static const bool kEnabled =
+            property_get_bool("ro.vendor.v4l2_codec2.decode_10bit_output", false);
+    return kEnabled;
+}
+
+std::vector<DecodeOutputFormat> getDecodeOutputFormats(bool allowCompressed) {
+    std::vector<DecodeOutputFormat> formats;
+    if (allowCompressed && isCompressedOutputEnabled()) {
+        // AFBC has no V4L2 pixel format, the devices writing AFBC frames would be listed here with
+        // their vendor pixel format and the AFBC usage of their gralloc.
+        const uint64_t ubwcUsage = getUbwcUsage();
+        if (ubwcUsage != 0) {
+            formats.push_back({Fourcc::QC08, HalPixelFormat::YCBCR_420_888, ubwcUsage});
+            if (isDecode10BitOutputEnabled()) {
+                formats.push_back({Fourcc::QC10, HalPixelFormat::YCBCR_P010, ubwcUsage});
+            }
+        }
+    }
+    for (const uint32_t fourcc : kLinearOutputFourccs) {
+        formats.push_back({fourcc, HalPixelFormat::YCBCR_420_888, 0});
+    }
+    if (isDecode10BitOutputEnabled()) {
+        formats.push_back({Fourcc::P010, HalPixelFormat::YCBCR_P010, 0});
+    }
+    return formats;
+}
+
+namespace {
+
+// Find the preferred output format supported by |device| for which |accept| returns true.
+template <typename AcceptFormat>
+std::optional<DecodeOutputFormat> findDecodeOutputFormat(V4L2Device* device, bool allowCompressed,
+                                                         AcceptFormat accept) {
+    const std::vector<uint32_t> pixfmts =
+            device->enumerateSupportedPixelformats(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+    const std::vector<DecodeOutputFormat> formats = getDecodeOutputFormats(allowCompressed);
+
+    // The output formats supported by the device, in the order the device enumerates them.
+    std::vector<DecodeOutputFormat> candidates;
+    for (const uint32_t pixfmt : pixfmts) {
+        auto format = std::find_if(
+                formats.begin(), formats.end(),
+                [pixfmt](const DecodeOutputFormat& f) { return f.v4l2PixFmt == pixfmt; });
+        if (format == formats.end()) {
+            ALOGD("Pixel format %s is not supported, skipping...", fourccToString(pixfmt).c_str());
+            continue;
+        }
+        candidates.push_back(*format);
+    }
+
+    for (int rank = 0; rank < kNumPreferenceRanks; rank++) {
+        for (const DecodeOutputFormat& format : candidates) {
+            if (getPreferenceRank(format) != rank) continue;
+
+            if (accept(format)) {
+                ALOGV("Output pixel format: %s", fourccToString(format.v4l2PixFmt).c_str());
+                return format;
+            }
+        }
+    }
+    return std::nullopt;
+}
+
+}  // namespace
+
+std::optional<DecodeOutputFormat> setupDecodeOutputFormat(V4L2Device* device, V4L2Queue* queue,
+                                                          const ui::Size& size,
+                                                          bool allowCompressed) {
+    return findDecodeOutputFormat(device, allowCompressed, [&](const DecodeOutputFormat& format) {
+        return queue->setFormat(format.v4l2PixFmt, size, 0) != std::nullopt;
+    });
+}
+
+std::optional<std::pair<DecodeOutputFormat, ui::Size>> tryDecodeOutputFormat(
+        V4L2Device* device, V4L2Queue* queue, const ui::Size& size, bool allowCompressed) {
+    ui::Size adjustedSize;
+    const std::optional<DecodeOutputFormat> format =
+            findDecodeOutputFormat(device, allowCompressed, [&](const DecodeOutputFormat& format) {
+                const std::optional<struct v4l2_format> v4l2Format =
+                        queue->tryFormat(format.v4l2PixFmt, size, 0);
+                if (!v4l2Format) return false;
+                adjustedSize.set(v4l2Format->fmt.pix_mp.width, v4l2Format->fmt.pix_mp.height);
+                return true;
+            });
+    if (!format) return std::nullopt;
+    return std::make_pair(*format, adjustedSize);
+}
+
+}  // namespace android
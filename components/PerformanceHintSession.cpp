@@ -0,0 +1,134 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "PerformanceHintSession"
+
+#include <v4l2_codec2/components/PerformanceHintSession.h>
+
+#include <inttypes.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <aidl/android/hardware/power/IPower.h>
+#include <android/binder_manager.h>
+#include <cutils/properties.h>
+#include <log/log.h>
+
+using aidl::android::hardware::power::IPower;
+using aidl::android::hardware::power::IPowerHintSession;
+using aidl::android::hardware::power::WorkDuration;
+
+namespace android {
+namespace {
+
+// The frame rate assumed when the client doesn't configure one.
+constexpr float kDefaultFrameRate = 30.0f;
+
+// The session of each thread.
+thread_local PerformanceHintSession* tSession = nullptr;
+
+bool isEnabled() {
+    static const bool kEnabled =
+            property_get_bool("ro.vendor.v4l2_codec2.performance_hints", false);
+    return kEnabled;
+}
+
+int64_t getFramePeriodNs(float frameRate) {
+    return static_cast<int64_t>(1e9 / (frameRate > 0.0f ? frameRate : kDefaultFrameRate));
+}
+
+// Get the Power HAL, nullptr if the device doesn't have one.
+std::shared_ptr<IPower> getPowerHal() {
+    static const std::shared_ptr<IPower> sPowerHal = []() -> std::shared_ptr<IPower> {
+        const std::string instance = std::string(IPower::descriptor) + "/default";
+        if (!AServiceManager_isDeclared(instance.c_str())) {
+            ALOGI("%s is not declared, performance hints are disabled", instance.c_str());
+            return nullptr;
+        }
+        return IPower::fromBinder(
+                ::ndk::SpAIBinder(AServiceManager_waitForService(instance.c_str())));
+    }();
+    return sPowerHal;
+}
+
+}  // namespace
+
+PerformanceHintSession::ScopedWork::ScopedWork()
+      : mSession((tSession && !tSession->mInWork) ? tSession : nullptr) {
+    if (!mSession) return;
+    mSession->mInWork = true;
+    mSession->mWorkStart = ::base::TimeTicks::Now();
+}
+
+PerformanceHintSession::ScopedWork::~ScopedWork() {
+    if (!mSession) return;
+    mSession->mWorkDuration += ::base::TimeTicks::Now() - mSession->mWorkStart;
+    mSession->mInWork = false;
+}
+
+// static
+std::unique_ptr<PerformanceHintSession> PerformanceHintSession::Create(float frameRate) {
+    if (!isEnabled()) return nullptr;
+    ALOG_ASSERT(tSession == nullptr, "The thread already has a performance hint session");
+
+    std::shared_ptr<IPower> powerHal = getPowerHal();
+    if (!powerHal) return nullptr;
+
+    const int64_t targetDurationNs = getFramePeriodNs(frameRate);
+    std::shared_ptr<IPowerHintSession> session;
+    const ::ndk::ScopedAStatus status = powerHal->createHintSession(
+            getpid(), static_cast<int32_t>(getuid()), {gettid()}, targetDurationNs, &session);
+    if (!status.isOk() || !session) {
+        ALOGW("Failed to create performance hint session: %s", status.getDescription().c_str());
+        return nullptr;
+    }
+    ALOGV("Created performance hint session for thread %d, target %" PRId64 " ns", gettid(),
+          targetDurationNs);
+    return std::unique_ptr<PerformanceHintSession>(
+            new PerformanceHintSession(std::move(session), targetDurationNs));
+}
+
+PerformanceHintSession::PerformanceHintSession(std::shared_ptr<IPowerHintSession> session,
+                                               int64_t targetDurationNs)
+      : mSession(std::move(session)), mTargetDurationNs(targetDurationNs) {
+    tSession = this;
+}
+
+PerformanceHintSession::~PerformanceHintSession() {
+    ALOG_ASSERT(tSession == this);
+    tSession = nullptr;
+    mSession->close();
+}
+
+void PerformanceHintSession::setFrameRate(float frameRate) {
+    const int64_t targetDurationNs = getFramePeriodNs(frameRate);
+    if (targetDurationNs == mTargetDurationNs) return;
+
+    ALOGV("%s(): target %" PRId64 " ns", __func__, targetDurationNs);
+    mTargetDurationNs = targetDurationNs;
+    mSession->updateTargetWorkDuration(targetDurationNs);
+}
+
+void PerformanceHintSession::onFrameDone() {
+    // Count the work of the current task up to now, the rest goes to the next frame.
+    const ::base::TimeTicks now = ::base::TimeTicks::Now();
+    if (mInWork) {
+        mWorkDuration += now - mWorkStart;
+        mWorkStart = now;
+    }
+    // The frames completed together are all reported with the first one.
+    if (mWorkDuration.is_zero()) return;
+
+    WorkDuration duration;
+    duration.timeStampNanos = (now - ::base::TimeTicks()).InNanoseconds();
+    duration.durationNanos = mWorkDuration.InNanoseconds();
+    mWorkDuration = ::base::TimeDelta();
+    // The session calls are oneway, so reporting each frame doesn't wait for the Power HAL.
+    mSession->reportActualWorkDuration({duration});
+}
+
+}  // namespace android
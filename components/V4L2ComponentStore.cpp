@@ -7,6 +7,7 @@
 
 #include <v4l2_codec2/components/V4L2ComponentStore.h>
 
+#include <linux/videodev2.h>
 #include <stdint.h>
 
 #include <memory>
@@ -14,10 +15,12 @@
 
 #include <C2.h>
 #include <C2Config.h>
+#include <cutils/properties.h>
 #include <log/log.h>
 #include <media/stagefright/foundation/MediaDefs.h>
 
 #include <v4l2_codec2/common/V4L2ComponentCommon.h>
+#include <v4l2_codec2/common/V4L2DevicePool.h>
 #include <v4l2_codec2/components/V4L2ComponentFactory.h>
 
 namespace android {
@@ -37,12 +40,53 @@ std::string getMediaTypeFromComponentName(const std::string& name) {
         name == V4L2ComponentName::kVP9Encoder) {
         return MEDIA_MIMETYPE_VIDEO_VP9;
     }
-    if (name == V4L2ComponentName::kHEVCDecoder || name == V4L2ComponentName::kHEVCSecureDecoder) {
+    if (name == V4L2ComponentName::kHEVCDecoder || name == V4L2ComponentName::kHEVCSecureDecoder ||
+        name == V4L2ComponentName::kHEVCEncoder) {
         return MEDIA_MIMETYPE_VIDEO_HEVC;
     }
+    if (name == V4L2ComponentName::kAV1Decoder || name == V4L2ComponentName::kAV1SecureDecoder) {
+        return MEDIA_MIMETYPE_VIDEO_AV1;
+    }
     return "";
 }
 
+// Configure the pools of pre-opened devices from the per-codec pool size properties.
+void configureDevicePools() {
+    struct PoolConfig {
+        const char* mProperty;
+        V4L2Device::Type mType;
+        uint32_t mPixFmt;
+    };
+    static constexpr PoolConfig kPoolConfigs[] = {
+            {"ro.vendor.v4l2_codec2.h264_decode_device_pool_size", V4L2Device::Type::kDecoder,
+             V4L2_PIX_FMT_H264},
+            {"ro.vendor.v4l2_codec2.vp8_decode_device_pool_size", V4L2Device::Type::kDecoder,
+             V4L2_PIX_FMT_VP8},
+            {"ro.vendor.v4l2_codec2.vp9_decode_device_pool_size", V4L2Device::Type::kDecoder,
+             V4L2_PIX_FMT_VP9},
+            {"ro.vendor.v4l2_codec2.hevc_decode_device_pool_size", V4L2Device::Type::kDecoder,
+             V4L2_PIX_FMT_HEVC},
+            {"ro.vendor.v4l2_codec2.av1_decode_device_pool_size", V4L2Device::Type::kDecoder,
+             V4L2_PIX_FMT_AV1},
+            {"ro.vendor.v4l2_codec2.h264_encode_device_pool_size", V4L2Device::Type::kEncoder,
+             V4L2_PIX_FMT_H264},
+            {"ro.vendor.v4l2_codec2.vp8_encode_device_pool_size", V4L2Device::Type::kEncoder,
+             V4L2_PIX_FMT_VP8},
+            {"ro.vendor.v4l2_codec2.vp9_encode_device_pool_size", V4L2Device::Type::kEncoder,
+             V4L2_PIX_FMT_VP9},
+            {"ro.vendor.v4l2_codec2.hevc_encode_device_pool_size", V4L2Device::Type::kEncoder,
+             V4L2_PIX_FMT_HEVC},
+    };
+
+    for (const PoolConfig& config : kPoolConfigs) {
+        const int32_t size = property_get_int32(config.mProperty, 0);
+        if (size > 0) {
+            V4L2DevicePool::get()->setPoolSize(config.mType, config.mPixFmt,
+                                               static_cast<size_t>(size));
+        }
+    }
+}
+
 }  // namespace
 
 // static
@@ -63,6 +107,8 @@ std::shared_ptr<C2ComponentStore> V4L2ComponentStore::Create() {
 
 V4L2ComponentStore::V4L2ComponentStore() : mReflector(std::make_shared<C2ReflectorHelper>()) {
     ALOGV("%s()", __func__);
+
+    configureDevicePools();
 }
 
 V4L2ComponentStore::~V4L2ComponentStore() {
@@ -121,8 +167,11 @@ std::vector<std::shared_ptr<const C2Component::Traits>> V4L2ComponentStore::list
     ret.push_back(GetTraits(V4L2ComponentName::kVP9Encoder));
     ret.push_back(GetTraits(V4L2ComponentName::kVP9Decoder));
     ret.push_back(GetTraits(V4L2ComponentName::kVP9SecureDecoder));
+    ret.push_back(GetTraits(V4L2ComponentName::kHEVCEncoder));
     ret.push_back(GetTraits(V4L2ComponentName::kHEVCDecoder));
     ret.push_back(GetTraits(V4L2ComponentName::kHEVCSecureDecoder));
+    ret.push_back(GetTraits(V4L2ComponentName::kAV1Decoder));
+    ret.push_back(GetTraits(V4L2ComponentName::kAV1SecureDecoder));
     return ret;
 }
 
@@ -4,6 +4,7 @@
 
 //#define LOG_NDEBUG 0
 #define LOG_TAG "V4L2DecodeComponent"
+#define ATRACE_TAG ATRACE_TAG_VIDEO
 
 #include <v4l2_codec2/components/V4L2DecodeComponent.h>
 
@@ -11,56 +12,86 @@
 #include <linux/videodev2.h>
 #include <stdint.h>
 
+#include <algorithm>
 #include <memory>
+#include <optional>
+#include <vector>
 
 #include <C2.h>
 #include <C2PlatformSupport.h>
 #include <Codec2Mapper.h>
 #include <SimpleC2Interface.h>
 #include <base/bind.h>
-#include <base/callback_helpers.h>
 #include <base/time/time.h>
 #include <cutils/properties.h>
 #include <log/log.h>
 #include <media/stagefright/foundation/ColorUtils.h>
+#include <utils/Timers.h>
+#include <utils/Trace.h>
 
+#include <v4l2_codec2/common/CodedStreamInfo.h>
 #include <v4l2_codec2/common/Common.h>
+#include <v4l2_codec2/common/DisposableFrame.h>
 #include <v4l2_codec2/common/NalParser.h>
+#include <v4l2_codec2/common/V4L2ResourceManager.h>
 #include <v4l2_codec2/common/VideoTypes.h>
 #include <v4l2_codec2/components/BitstreamBuffer.h>
+#include <v4l2_codec2/components/DecodeOutputFormat.h>
 #include <v4l2_codec2/components/V4L2Decoder.h>
+#include <v4l2_codec2/components/V4L2StatelessDecoder.h>
 #include <v4l2_codec2/components/VideoFramePool.h>
 
 namespace android {
 namespace {
 
+// (b/157113946): Prevent malicious dynamic resolution change exhausts system memory.
+constexpr int kMaximumSupportedArea = 4096 * 4096;
+
 // CCBC pauses sending input buffers to the component when all the output slots are filled by
 // pending decoded buffers. If the available output buffers are exhausted before CCBC pauses sending
 // input buffers, CCodec may timeout due to waiting for a available output buffer.
 // This function returns the minimum number of output buffers to prevent the buffers from being
 // exhausted before CCBC pauses sending input buffers.
-size_t getMinNumOutputBuffers(VideoCodec codec) {
-    // The constant values copied from CCodecBufferChannel.cpp.
-    // (b/184020290): Check the value still sync when seeing error message from CCodec:
-    // "previous call to queue exceeded timeout".
-    constexpr size_t kSmoothnessFactor = 4;
-    constexpr size_t kRenderingDepth = 3;
+size_t getMinNumOutputBuffers(const V4L2DecodeInterface& intf) {
     // Extra number of needed output buffers for V4L2Decoder.
     constexpr size_t kExtraNumOutputBuffersForDecoder = 2;
 
     // The total needed number of output buffers at pipeline are:
-    // - MediaCodec output slots: output delay + kSmoothnessFactor
-    // - Surface: kRenderingDepth
+    // - MediaCodec output slots and Surface: output delay + output pipeline depth
     // - Component: kExtraNumOutputBuffersForDecoder
-    return V4L2DecodeInterface::getOutputDelay(codec) + kSmoothnessFactor + kRenderingDepth +
+    return intf.getOutputDelay() + intf.getOutputPipelineDepth() +
            kExtraNumOutputBuffersForDecoder;
 }
 
+// Whether start() returns without waiting for the device to be set up, in which case the works
+// queued meanwhile are decoded once it is, and setup failures are reported as errors.
+bool isAsyncStartEnabled() {
+    static const bool kEnabled =
+            property_get_bool("ro.vendor.v4l2_codec2.decode_async_start", false);
+    return kEnabled;
+}
+
+// The time without queued works after which the decoder releases its buffers, 0 to only release
+// them on the memory pressure hints of the client, and negative (default) to never release them.
+int32_t getIdleTrimTimeoutMs() {
+    static const int32_t kTimeoutMs =
+            property_get_int32("ro.vendor.v4l2_codec2.decode_idle_trim_timeout_ms", -1);
+    return kTimeoutMs;
+}
+
+// The largest size of the bitstream kept to restore the decoder after trimming it. The streams
+// of longer key frame intervals can't be trimmed.
+constexpr size_t kMaxReplayInputsSize = 16 * 1024 * 1024;
+
 // Mask against 30 bits to avoid (undefined) wraparound on signed integer.
 int32_t frameIndexToBitstreamId(c2_cntr64_t frameIndex) {
     return static_cast<int32_t>(frameIndex.peeku() & 0x3FFFFFFF);
 }
 
+// The flag of the bitstream IDs of the inputs replayed to restore the decoder, which are above the
+// ones of the works.
+constexpr int32_t kReplayBitstreamIdFlag = 0x40000000;
+
 bool parseCodedColorAspects(const C2ConstLinearBlock& input,
                             C2StreamColorAspectsInfo::input* codedAspects) {
     C2ReadView view = input.map().get();
@@ -101,6 +132,44 @@ bool parseCodedColorAspects(const C2ConstLinearBlock& input,
     return true;
 }
 
+// Whether the bitstream of |codec| in |input| can be dropped without corrupting the next frames.
+bool isDisposableInput(VideoCodec codec, const C2ConstLinearBlock& input) {
+    C2ReadView view = input.map().get();
+    if (view.error() != C2_OK) return false;
+    return isDisposableFrame(codec, view.data(), view.capacity());
+}
+
+// Whether the bitstream of |codec| in the input of |work| is decoded without the state left by the
+// previous frame, so that frame can be dropped. Only the VP9 frames depend on that state, see
+// isIndependentOfPreviousFrame(), for which false is returned if |work| is missing or has no input.
+bool isIndependentInput(VideoCodec codec, const C2Work* work) {
+    if (codec != VideoCodec::VP9) return true;
+    if (!work || work->input.buffers.empty() || !work->input.buffers.front()) return false;
+    C2ReadView view = work->input.buffers.front()->data().linearBlocks().front().map().get();
+    if (view.error() != C2_OK) return false;
+    return isIndependentOfPreviousFrame(codec, view.data(), view.capacity());
+}
+
+// Parse the coded size and the reference frames of the stream of |codec| from the headers in
+// |input|.
+bool parseCodedStreamInfo(VideoCodec codec, const C2ConstLinearBlock& input,
+                          CodedStreamInfo* info) {
+    C2ReadView view = input.map().get();
+    if (view.error() != C2_OK) return false;
+    return findCodedStreamInfo(codec, view.data(), view.capacity(), info);
+}
+
+// Whether the codec config |input| of |codec| carries no bitstream for the device. The AV1 codec
+// config is the AV1CodecConfigurationRecord of the container, starting with its marker and
+// version, whose sequence header comes again with the key frames.
+bool isContainerCodecConfig(VideoCodec codec, const C2ConstLinearBlock& input) {
+    if (codec != VideoCodec::AV1) return false;
+    C2ReadView view = input.map().get();
+    if (view.error() != C2_OK || view.capacity() == 0) return false;
+    constexpr uint8_t kAv1CodecConfigMarkerAndVersion = 0x81;
+    return view.data()[0] == kAv1CodecConfigMarkerAndVersion;
+}
+
 bool isWorkDone(const C2Work& work) {
     const int32_t bitstreamId = frameIndexToBitstreamId(work.input.ordinal.frameIndex);
 
@@ -161,24 +230,45 @@ std::shared_ptr<C2Component> V4L2DecodeComponent::create(
         return nullptr;
     }
 
-    return std::shared_ptr<C2Component>(new V4L2DecodeComponent(name, id, helper, intfImpl),
-                                        deleter);
+    // The load of the stream is updated on start(), once the client configured its resolution and
+    // frame rate.
+    std::unique_ptr<V4L2ResourceManager::Reservation> reservation;
+    if (V4L2ResourceManager::isEnabled()) {
+        reservation = V4L2ResourceManager::get()->reserve(
+                V4L2Device::Type::kDecoder,
+                V4L2ResourceManager::getMacroblocksPerSecond(intfImpl->getPictureSize(),
+                                                             intfImpl->getFrameRate()));
+        if (!reservation) {
+            ALOGW("Reject to Initialize() due to the decoders being fully loaded");
+            return nullptr;
+        }
+    }
+
+    auto* component = new V4L2DecodeComponent(name, id, helper, intfImpl);
+    component->mReservation = std::move(reservation);
+    return std::shared_ptr<C2Component>(component, deleter);
 }
 
 V4L2DecodeComponent::V4L2DecodeComponent(const std::string& name, c2_node_id_t id,
                                          const std::shared_ptr<C2ReflectorHelper>& helper,
                                          const std::shared_ptr<V4L2DecodeInterface>& intfImpl)
       : mIntfImpl(intfImpl),
-        mIntf(std::make_shared<SimpleInterface<V4L2DecodeInterface>>(name.c_str(), id, mIntfImpl)) {
+        mIntf(std::make_shared<SimpleInterface<V4L2DecodeInterface>>(name.c_str(), id, mIntfImpl)),
+        mWorkTraceName(name + "#" + std::to_string(id) + " work"),
+        mDecodeTraceName(name + "#" + std::to_string(id) + " decode"),
+        mStats(ComponentStats::Create(name + "#" + std::to_string(id))) {
     ALOGV("%s(%s)", __func__, name.c_str());
 
     sConcurrentInstances.fetch_add(1, std::memory_order_relaxed);
     mIsSecure = name.find(".secure") != std::string::npos;
+    // The callback is unset before |*this| is destroyed.
+    mIntfImpl->setTrimMemoryCallback([this]() { onTrimMemoryRequested(); });
 }
 
 V4L2DecodeComponent::~V4L2DecodeComponent() {
     ALOGV("%s()", __func__);
 
+    mIntfImpl->setTrimMemoryCallback(nullptr);
     release();
 
     sConcurrentInstances.fetch_sub(1, std::memory_order_relaxed);
@@ -195,18 +285,39 @@ c2_status_t V4L2DecodeComponent::start() {
         return C2_BAD_STATE;
     }
 
+    if (mReservation &&
+        !mReservation->update(V4L2ResourceManager::getMacroblocksPerSecond(
+                mIntfImpl->getPictureSize(), mIntfImpl->getFrameRate()))) {
+        ALOGE("Not enough decoder capacity left to start the decoder");
+        return C2_NO_MEMORY;
+    }
+
     if (!mDecoderThread.Start()) {
         ALOGE("Decoder thread failed to start.");
         return C2_CORRUPTED;
     }
     mDecoderTaskRunner = mDecoderThread.task_runner();
     mWeakThis = mWeakThisFactory.GetWeakPtr();
+    // A wakeup might have been dropped when the previous decoder thread was stopped.
+    mQueueWakeupPending.store(false);
+
+    if (isAsyncStartEnabled()) {
+        // The works queued from now on are decoded once startTask() is done, as they're handled
+        // on the same sequence.
+        mComponentState.store(ComponentState::RUNNING);
+        mDecoderTaskRunner->PostTask(FROM_HERE,
+                                     ::base::BindOnce(&V4L2DecodeComponent::startTask, mWeakThis,
+                                                      nullptr, nullptr));
+        prefetchBlockPool();
+        return C2_OK;
+    }
 
     c2_status_t status = C2_CORRUPTED;
     ::base::WaitableEvent done;
     mDecoderTaskRunner->PostTask(
             FROM_HERE, ::base::BindOnce(&V4L2DecodeComponent::startTask, mWeakThis,
                                         ::base::Unretained(&status), ::base::Unretained(&done)));
+    prefetchBlockPool();
     done.Wait();
 
     if (status == C2_OK) mComponentState.store(ComponentState::RUNNING);
@@ -217,44 +328,111 @@ void V4L2DecodeComponent::startTask(c2_status_t* status, ::base::WaitableEvent*
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
 
-    ::base::ScopedClosureRunner done_caller(
-            ::base::BindOnce(&::base::WaitableEvent::Signal, ::base::Unretained(done)));
-    *status = C2_CORRUPTED;
+    const c2_status_t result = startDecoder();
+    if (done) {
+        *status = result;
+        done->Signal();
+    } else if (result != C2_OK) {
+        reportError(result);
+    }
+}
+
+c2_status_t V4L2DecodeComponent::startDecoder() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    // The decoder thread is started again on each start(), so the policy configured before is
+    // picked up. The device poll threads follow the policy of this thread.
+    mIntfImpl->getThreadPolicy().applyToCurrentThread();
+    mHintSession = PerformanceHintSession::Create(mIntfImpl->getFrameRate());
+
+    mWorkReporter = std::make_unique<WorkReporter>("V4L2DecReporter");
+    // ::base::Unretained(this) is safe here because |mWorkDoneBatcher| is destroyed on
+    // releaseTask(), before |mDecoderThread| is stopped.
+    mWorkDoneBatcher = std::make_unique<WorkDoneBatcher>(
+            mDecoderTaskRunner, ::base::BindRepeating(&V4L2DecodeComponent::reportWorks,
+                                                      ::base::Unretained(this)));
 
     const auto codec = mIntfImpl->getVideoCodec();
     if (!codec) {
         ALOGE("Failed to get video codec.");
-        return;
+        return C2_CORRUPTED;
+    }
+    mLowLatency = mIntfImpl->isLowLatencyMode();
+    mTunnel = mIntfImpl->getTunnel();
+    // The protected bitstream can't be parsed for its key frames, and the tunnel holds on to the
+    // frames queued to it.
+    mIsTrimEnabled = getIdleTrimTimeoutMs() >= 0 && !mIsSecure && !mTunnel;
+
+    const c2_status_t status = createDecoder();
+    if (status != C2_OK) return status;
+    // The protected bitstream can't be parsed for its headers.
+    mIsOutputPrepared = mIsSecure;
+
+    // Get default color aspects on start.
+    if (!mIsSecure && *codec == VideoCodec::H264) {
+        if (mIntfImpl->queryColorAspects(&mCurrentColorAspects) != C2_OK) return C2_CORRUPTED;
+        mPendingColorAspectsChange = false;
     }
+
+    return C2_OK;
+}
+
+c2_status_t V4L2DecodeComponent::createDecoder() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    const VideoCodec codec = *mIntfImpl->getVideoCodec();
     const size_t inputBufferSize = mIntfImpl->getInputBufferSize();
-    const size_t minNumOutputBuffers = getMinNumOutputBuffers(*codec);
+    const size_t numInputBuffers = mIntfImpl->getInputPipelineDepth();
+    const size_t minNumOutputBuffers = getMinNumOutputBuffers(*mIntfImpl);
 
     // ::base::Unretained(this) is safe here because |mDecoder| is always destroyed before
     // |mDecoderThread| is stopped, so |*this| is always valid during |mDecoder|'s lifetime.
-    mDecoder = V4L2Decoder::Create(*codec, inputBufferSize, minNumOutputBuffers,
-                                   ::base::BindRepeating(&V4L2DecodeComponent::getVideoFramePool,
-                                                         ::base::Unretained(this)),
-                                   ::base::BindRepeating(&V4L2DecodeComponent::onOutputFrameReady,
-                                                         ::base::Unretained(this)),
-                                   ::base::BindRepeating(&V4L2DecodeComponent::reportError,
-                                                         ::base::Unretained(this), C2_CORRUPTED),
-                                   mDecoderTaskRunner);
+    const auto getPoolCb = ::base::BindRepeating(&V4L2DecodeComponent::getVideoFramePool,
+                                                 ::base::Unretained(this));
+    const auto outputCb = ::base::BindRepeating(&V4L2DecodeComponent::onOutputFrameReady,
+                                                ::base::Unretained(this));
+    const auto errorCb = ::base::BindRepeating(&V4L2DecodeComponent::reportError,
+                                               ::base::Unretained(this), C2_CORRUPTED);
+    mDecoder = V4L2Decoder::Create(codec, inputBufferSize, numInputBuffers, minNumOutputBuffers,
+                                   mIntfImpl->getMaxPictureSize(),
+                                   mIntfImpl->getDownscaledOutputSize(), mLowLatency, getPoolCb,
+                                   outputCb, errorCb, mDecoderTaskRunner);
+    // Devices without a stateful decoder might have a stateless one, which can't decode the
+    // protected bitstream it needs to parse. It has no scaler, so it outputs the coded size.
+    if (!mDecoder && !mIsSecure) {
+        ALOGI("No stateful decoder for %s, trying the stateless one", VideoCodecToString(codec));
+        mDecoder = V4L2StatelessDecoder::Create(codec, inputBufferSize, minNumOutputBuffers,
+                                                mLowLatency, getPoolCb, outputCb, errorCb,
+                                                mDecoderTaskRunner);
+    }
     if (!mDecoder) {
-        ALOGE("Failed to create V4L2Decoder for %s", VideoCodecToString(*codec));
-        return;
+        ALOGE("Failed to create V4L2Decoder for %s", VideoCodecToString(codec));
+        return C2_CORRUPTED;
     }
+    return C2_OK;
+}
 
-    // Get default color aspects on start.
-    if (!mIsSecure && *codec == VideoCodec::H264) {
-        if (mIntfImpl->queryColorAspects(&mCurrentColorAspects) != C2_OK) return;
-        mPendingColorAspectsChange = false;
-    }
+void V4L2DecodeComponent::prefetchBlockPool() {
+    ALOGV("%s()", __func__);
+
+    auto sharedThis = weak_from_this().lock();
+    if (sharedThis == nullptr) return;
+
+    // Failures are reported when the pool is actually needed.
+    const C2BlockPool::local_id_t poolId = mIntfImpl->getBlockPoolId();
+    std::shared_ptr<C2BlockPool> blockPool;
+    if (GetCodec2BlockPool(poolId, std::move(sharedThis), &blockPool) != C2_OK) return;
 
-    *status = C2_OK;
+    std::lock_guard<std::mutex> lock(mPrefetchedBlockPoolLock);
+    mPrefetchedBlockPool = std::move(blockPool);
+    mPrefetchedBlockPoolId = poolId;
 }
 
 std::unique_ptr<VideoFramePool> V4L2DecodeComponent::getVideoFramePool(const ui::Size& size,
                                                                        HalPixelFormat pixelFormat,
+                                                                       uint64_t usage,
                                                                        size_t numBuffers) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
@@ -265,8 +443,6 @@ std::unique_ptr<VideoFramePool> V4L2DecodeComponent::getVideoFramePool(const ui:
         return nullptr;
     }
 
-    // (b/157113946): Prevent malicious dynamic resolution change exhausts system memory.
-    constexpr int kMaximumSupportedArea = 4096 * 4096;
     if (getArea(size).value_or(INT_MAX) > kMaximumSupportedArea) {
         ALOGE("The output size (%dx%d) is larger than supported size (4096x4096)", size.width,
               size.height);
@@ -278,15 +454,43 @@ std::unique_ptr<VideoFramePool> V4L2DecodeComponent::getVideoFramePool(const ui:
     auto poolId = mIntfImpl->getBlockPoolId();
     ALOGI("Using C2BlockPool ID = %" PRIu64 " for allocating output buffers", poolId);
     std::shared_ptr<C2BlockPool> blockPool;
-    auto status = GetCodec2BlockPool(poolId, std::move(sharedThis), &blockPool);
+    {
+        std::lock_guard<std::mutex> lock(mPrefetchedBlockPoolLock);
+        if (mPrefetchedBlockPool && mPrefetchedBlockPoolId == poolId) {
+            blockPool = std::move(mPrefetchedBlockPool);
+        }
+        mPrefetchedBlockPool.reset();
+    }
+    auto status = blockPool ? C2_OK : GetCodec2BlockPool(poolId, std::move(sharedThis), &blockPool);
     if (status != C2_OK) {
         ALOGE("Graphic block allocator is invalid: %d", status);
         reportError(status);
         return nullptr;
     }
 
-    return VideoFramePool::Create(std::move(blockPool), numBuffers, size, pixelFormat, mIsSecure,
-                                  mDecoderTaskRunner);
+    auto pool = VideoFramePool::Create(std::move(blockPool), numBuffers, size, pixelFormat, usage,
+                                       mIsSecure, mDecoderTaskRunner);
+    if (!pool) return nullptr;
+    pool->setStats(mStats);
+
+    // Let the client know when the frames switch between 8-bit and P010 buffers, the other 8-bit
+    // formats are all reported as the flexible YUV 4:2:0 format.
+    C2StreamPixelFormatInfo::output outputPixelFormat(
+            0u, static_cast<uint32_t>(pixelFormat == HalPixelFormat::YCBCR_P010
+                                              ? HalPixelFormat::YCBCR_P010
+                                              : HalPixelFormat::YCBCR_420_888));
+    if (outputPixelFormat.value != mIntfImpl->getPixelFormat()) {
+        std::vector<std::unique_ptr<C2SettingResult>> failures;
+        c2_status_t status = mIntfImpl->config({&outputPixelFormat}, C2_MAY_BLOCK, &failures);
+        if (status != C2_OK) {
+            ALOGE("Failed to config pixel format to interface: %d", status);
+            reportError(status);
+            return nullptr;
+        }
+        // The format is sent to the client along with the first frame in the new buffers.
+        mPendingPixelFormat = C2Param::Copy(outputPixelFormat);
+    }
+    return pool;
 }
 
 c2_status_t V4L2DecodeComponent::stop() {
@@ -314,6 +518,12 @@ void V4L2DecodeComponent::stopTask() {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
 
+    // Works still waiting in the queue when stopping are abandoned along with the pending ones.
+    std::vector<std::unique_ptr<C2Work>> queuedWorks;
+    takeQueuedWorks(&queuedWorks);
+    for (auto& work : queuedWorks) {
+        mPendingWorks.push(std::move(work));
+    }
     reportAbandonedWorks();
     mIsDraining = false;
 
@@ -347,6 +557,36 @@ void V4L2DecodeComponent::releaseTask() {
 
     mWeakThisFactory.InvalidateWeakPtrs();
     mDecoder = nullptr;
+    mWorkDoneBatcher = nullptr;
+    // The works reported so far are delivered before the component is stopped.
+    mWorkReporter = nullptr;
+    mHintSession = nullptr;
+    mCodecConfigInputs.clear();
+    mReplayInputs.clear();
+    mReplayInputsSize = 0;
+    mCanReplay = false;
+    mLastInputIsCodecConfig = false;
+    mIsTrimmed = false;
+    mIsIdleCheckPending = false;
+    {
+        std::lock_guard<std::mutex> lock(mPrefetchedBlockPoolLock);
+        mPrefetchedBlockPool.reset();
+    }
+    if (mTunnel) {
+        mTunnel->flush();
+        mTunnel = nullptr;
+    }
+
+    if (mNumLatencySamples > 0) {
+        const int64_t averageUs =
+                mTotalDecodeLatency.InMicroseconds() / static_cast<int64_t>(mNumLatencySamples);
+        ALOGI("Decode latency of %zu works: average %" PRId64 " us, max %" PRId64 " us",
+              mNumLatencySamples, averageUs, mMaxDecodeLatency.InMicroseconds());
+    }
+    mDecodeStartTimes.clear();
+    mNumLatencySamples = 0;
+    mTotalDecodeLatency = ::base::TimeDelta();
+    mMaxDecodeLatency = ::base::TimeDelta();
 }
 
 c2_status_t V4L2DecodeComponent::setListener_vb(
@@ -383,12 +623,15 @@ void V4L2DecodeComponent::setListenerTask(const std::shared_ptr<Listener>& liste
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
 
+    // Works finished so far are still reported to the previous listener.
+    if (mWorkDoneBatcher) mWorkDoneBatcher->flush();
     mListener = listener;
     done->Signal();
 }
 
 c2_status_t V4L2DecodeComponent::queue_nb(std::list<std::unique_ptr<C2Work>>* const items) {
     ALOGV("%s()", __func__);
+    ATRACE_CALL();
 
     auto currentState = mComponentState.load();
     if (currentState != ComponentState::RUNNING) {
@@ -396,16 +639,82 @@ c2_status_t V4L2DecodeComponent::queue_nb(std::list<std::unique_ptr<C2Work>>* co
         return C2_BAD_STATE;
     }
 
-    while (!items->empty()) {
-        mDecoderTaskRunner->PostTask(FROM_HERE,
-                                     ::base::BindOnce(&V4L2DecodeComponent::queueTask, mWeakThis,
-                                                      std::move(items->front())));
-        items->pop_front();
+    {
+        std::lock_guard<std::mutex> lock(mQueueLock);
+        while (!items->empty()) {
+            ATRACE_ASYNC_BEGIN(mWorkTraceName.c_str(),
+                               frameIndexToBitstreamId(items->front()->input.ordinal.frameIndex));
+            // Once a work overflowed, the following works must overflow too to keep them ordered.
+            if (!mHasOverflowWorks.load(std::memory_order_relaxed) &&
+                mQueuedWorks.push(std::move(items->front()))) {
+                items->pop_front();
+                continue;
+            }
+            mOverflowWorks.push_back(std::move(items->front()));
+            mHasOverflowWorks.store(true, std::memory_order_release);
+            items->pop_front();
+        }
+    }
+
+    // Only wake up the decoder thread if it's not going to drain the queued works already.
+    if (!mQueueWakeupPending.exchange(true, std::memory_order_acq_rel)) {
+        mDecoderTaskRunner->PostTask(
+                FROM_HERE, ::base::BindOnce(&V4L2DecodeComponent::queueTask, mWeakThis));
     }
     return C2_OK;
 }
 
-void V4L2DecodeComponent::queueTask(std::unique_ptr<C2Work> work) {
+void V4L2DecodeComponent::queueTask() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    // Clear the wakeup flag before draining, so works queued from now on post a new wakeup.
+    mQueueWakeupPending.store(false, std::memory_order_release);
+
+    const int32_t idleTrimTimeoutMs = getIdleTrimTimeoutMs();
+    if (mIsTrimEnabled && idleTrimTimeoutMs > 0) {
+        mLastQueueTime = ::base::TimeTicks::Now();
+        if (!mIsIdleCheckPending) {
+            mIsIdleCheckPending = true;
+            mDecoderTaskRunner->PostDelayedTask(
+                    FROM_HERE, ::base::BindOnce(&V4L2DecodeComponent::checkIdleTask, mWeakThis),
+                    ::base::TimeDelta::FromMilliseconds(idleTrimTimeoutMs));
+        }
+    }
+
+    std::vector<std::unique_ptr<C2Work>> works;
+    takeQueuedWorks(&works);
+    // Keep queueing the rest of the batch when a work fails, so the following works are abandoned
+    // along with the pending ones instead of being dropped.
+    bool allQueued = true;
+    for (auto& work : works) {
+        allQueued &= queueWork(std::move(work));
+    }
+    if (allQueued) pumpPendingWorks();
+}
+
+void V4L2DecodeComponent::takeQueuedWorks(std::vector<std::unique_ptr<C2Work>>* works) {
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    std::unique_ptr<C2Work> work;
+    while (mQueuedWorks.pop(&work)) {
+        works->emplace_back(std::move(work));
+    }
+    // Overflowed works were all queued after the works in the ring.
+    if (mHasOverflowWorks.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lock(mQueueLock);
+        while (mQueuedWorks.pop(&work)) {
+            works->emplace_back(std::move(work));
+        }
+        for (auto& overflowWork : mOverflowWorks) {
+            works->emplace_back(std::move(overflowWork));
+        }
+        mOverflowWorks.clear();
+        mHasOverflowWorks.store(false, std::memory_order_relaxed);
+    }
+}
+
+bool V4L2DecodeComponent::queueWork(std::unique_ptr<C2Work> work) {
     ALOGV("%s(): flags=0x%x, index=%llu, timestamp=%llu", __func__, work->input.flags,
           work->input.ordinal.frameIndex.peekull(), work->input.ordinal.timestamp.peekull());
     ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
@@ -415,7 +724,7 @@ void V4L2DecodeComponent::queueTask(std::unique_ptr<C2Work> work) {
               work->input.buffers.size());
         work->result = C2_CORRUPTED;
         reportWork(std::move(work));
-        return;
+        return true;
     }
 
     work->worklets.front()->output.flags = static_cast<C2FrameData::flags_t>(0);
@@ -428,7 +737,7 @@ void V4L2DecodeComponent::queueTask(std::unique_ptr<C2Work> work) {
             (work->input.flags & C2FrameData::FLAG_CODEC_CONFIG) == 0) {
             ALOGE("Invalid work: work with no input buffer should be EOS or CSD.");
             reportError(C2_BAD_VALUE);
-            return;
+            return false;
         }
 
         // Emplace a nullptr to unify the check for work done.
@@ -437,11 +746,13 @@ void V4L2DecodeComponent::queueTask(std::unique_ptr<C2Work> work) {
     }
 
     mPendingWorks.push(std::move(work));
-    pumpPendingWorks();
+    return true;
 }
 
 void V4L2DecodeComponent::pumpPendingWorks() {
     ALOGV("%s()", __func__);
+    ATRACE_CALL();
+    PerformanceHintSession::ScopedWork hintWork;
     ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
 
     auto currentState = mComponentState.load();
@@ -449,7 +760,9 @@ void V4L2DecodeComponent::pumpPendingWorks() {
         ALOGW("Could not pump C2Work at state: %s", ComponentStateToString(currentState));
         return;
     }
+    if (mIsTrimmed && !mPendingWorks.empty() && !mIsDraining && !restoreDecoder()) return;
 
+    const std::optional<int64_t> lateTimestampUs = getLateTimestampUs();
     while (!mPendingWorks.empty() && !mIsDraining) {
         std::unique_ptr<C2Work> pendingWork(std::move(mPendingWorks.front()));
         mPendingWorks.pop();
@@ -462,8 +775,8 @@ void V4L2DecodeComponent::pumpPendingWorks() {
         ALOGV("Process C2Work bitstreamId=%d isCSDWork=%d, isEmptyWork=%d", bitstreamId, isCSDWork,
               isEmptyWork);
 
-        auto res = mWorksAtDecoder.insert(std::make_pair(bitstreamId, std::move(pendingWork)));
-        ALOGW_IF(!res.second, "We already inserted bitstreamId %d to decoder?", bitstreamId);
+        const bool inserted = mWorksAtDecoder.insert(bitstreamId, std::move(pendingWork));
+        ALOGW_IF(!inserted, "We already inserted bitstreamId %d to decoder?", bitstreamId);
 
         if (!isEmptyWork) {
             // If input.buffers is not empty, the buffer should have meaningful content inside.
@@ -471,6 +784,17 @@ void V4L2DecodeComponent::pumpPendingWorks() {
                     work->input.buffers.front()->data().linearBlocks().front();
             ALOG_ASSERT(linearBlock.size() > 0u, "Input buffer of work(%d) is empty.", bitstreamId);
 
+            // The device would fail to parse the codec config of the container, which only
+            // duplicates the stream headers.
+            if (isCSDWork && !isEOSWork &&
+                isContainerCodecConfig(*mIntfImpl->getVideoCodec(), linearBlock)) {
+                ALOGV("Skipping the container codec config bitstreamId=%d", bitstreamId);
+                std::unique_ptr<C2Work>* workAtDecoder = mWorksAtDecoder.find(bitstreamId);
+                if (workAtDecoder) (*workAtDecoder)->input.buffers.front().reset();
+                reportWorkIfFinished(bitstreamId);
+                continue;
+            }
+
             // Try to parse color aspects from bitstream for CSD work of non-secure H264 codec.
             if (isCSDWork && !mIsSecure && (mIntfImpl->getVideoCodec() == VideoCodec::H264)) {
                 C2StreamColorAspectsInfo::input codedAspects = {0u};
@@ -491,14 +815,45 @@ void V4L2DecodeComponent::pumpPendingWorks() {
                 }
             }
 
+            // Catch up with the render clock by dropping the late frames no other frame depends on.
+            // The next frame might depend on the state left by the dropped one, so it has to be
+            // queued already to tell.
+            if (lateTimestampUs && !isCSDWork && !isEOSWork &&
+                work->input.ordinal.timestamp.peekll() < *lateTimestampUs &&
+                isDisposableInput(*mIntfImpl->getVideoCodec(), linearBlock) &&
+                isIndependentInput(*mIntfImpl->getVideoCodec(),
+                                   mPendingWorks.empty() ? nullptr : mPendingWorks.front().get())) {
+                ALOGV("Dropping late work bitstreamId=%d, timestamp=%lld us", bitstreamId,
+                      work->input.ordinal.timestamp.peekll());
+                dropWork(bitstreamId);
+                continue;
+            }
+            // The headers come with the codec config or the first frame, the device announces the
+            // later changes itself.
+            if (!mIsOutputPrepared) {
+                mIsOutputPrepared = prepareOutputBuffers(linearBlock) || !isCSDWork;
+                if (mComponentState.load() == ComponentState::ERROR) return;
+            }
+            if (mIsTrimEnabled) keepReplayInput(bitstreamId, isCSDWork, linearBlock);
+
             std::unique_ptr<ConstBitstreamBuffer> buffer = std::make_unique<ConstBitstreamBuffer>(
                     bitstreamId, linearBlock, linearBlock.offset(), linearBlock.size());
             if (!buffer) {
                 reportError(C2_CORRUPTED);
                 return;
             }
+            mDecodeStartTimes.erase(bitstreamId);
+            mDecodeStartTimes.insert(bitstreamId, ::base::TimeTicks::Now());
+            ATRACE_ASYNC_BEGIN(mDecodeTraceName.c_str(), bitstreamId);
+            mStats->onFrameIn();
             mDecoder->decode(std::move(buffer), ::base::BindOnce(&V4L2DecodeComponent::onDecodeDone,
                                                                  mWeakThis, bitstreamId));
+            // |mDecoder| holds the bitstream until it's decoded, so the client can reuse the
+            // input buffer right away.
+            if (mLowLatency) {
+                std::unique_ptr<C2Work>* workAtDecoder = mWorksAtDecoder.find(bitstreamId);
+                if (workAtDecoder) (*workAtDecoder)->input.buffers.front().reset();
+            }
         }
 
         if (isEOSWork) {
@@ -511,14 +866,219 @@ void V4L2DecodeComponent::pumpPendingWorks() {
     }
 }
 
+std::optional<int64_t> V4L2DecodeComponent::getLateTimestampUs() {
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    // The secure bitstreams can't be parsed, and the tunnel renders on its own clock.
+    if (mIsSecure || mTunnel) return std::nullopt;
+
+    C2V4L2RenderClockTuning renderClock;
+    if (mIntfImpl->query({&renderClock}, {}, C2_DONT_BLOCK, nullptr) != C2_OK ||
+        renderClock.mediaTimeUs < 0) {
+        return std::nullopt;
+    }
+
+    // The works queued now are output after the average decode latency.
+    const int64_t numSamples = static_cast<int64_t>(mNumLatencySamples);
+    const int64_t latencyUs =
+            (numSamples > 0) ? mTotalDecodeLatency.InMicroseconds() / numSamples : 0;
+    const int64_t elapsedUs = (systemTime(SYSTEM_TIME_MONOTONIC) - renderClock.systemTimeNs) / 1000;
+    return renderClock.mediaTimeUs + elapsedUs + latencyUs;
+}
+
+void V4L2DecodeComponent::dropWork(int32_t bitstreamId) {
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    std::unique_ptr<C2Work>* workAtDecoder = mWorksAtDecoder.find(bitstreamId);
+    ALOG_ASSERT(workAtDecoder != nullptr);
+    C2Work* work = workAtDecoder->get();
+    work->input.buffers.front().reset();
+    work->worklets.front()->output.flags = C2FrameData::FLAG_DROP_FRAME;
+    mStats->onFrameDropped();
+    reportWorkIfFinished(bitstreamId);
+}
+
+bool V4L2DecodeComponent::prepareOutputBuffers(const C2ConstLinearBlock& input) {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    CodedStreamInfo info;
+    if (!parseCodedStreamInfo(*mIntfImpl->getVideoCodec(), input, &info)) return false;
+    ALOGV("Parsed stream headers: coded size %s, %zu DPB frames, film grain %d",
+          toString(info.codedSize).c_str(), info.maxDpbFrames, info.hasFilmGrain);
+    // The AV1 Main profile covers both the 8-bit and the 10-bit streams, which can only be told
+    // apart from their sequence header.
+    if (info.bitDepth > 8 && !isDecode10BitOutputEnabled()) {
+        ALOGE("%u-bit streams are not supported without 10-bit output", info.bitDepth);
+        reportError(C2_BAD_VALUE);
+        return false;
+    }
+    // The pool would be rejected, the device reports the error once it parsed the stream.
+    if (getArea(info.codedSize).value_or(INT_MAX) > kMaximumSupportedArea) return true;
+
+    // The frames shown with film grain are written to another buffer than their grain-free
+    // reference, so the reference of the displayed frame takes one more buffer.
+    const size_t numFrames = info.maxDpbFrames + (info.hasFilmGrain ? 1 : 0);
+    mDecoder->prepareOutputBuffers(info.codedSize, numFrames);
+    return true;
+}
+
+void V4L2DecodeComponent::keepReplayInput(int32_t bitstreamId, bool isCSDWork,
+                                          const C2ConstLinearBlock& input) {
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    if (isCSDWork) {
+        if (!mLastInputIsCodecConfig) mCodecConfigInputs.clear();
+        mCodecConfigInputs.push_back(input);
+        mLastInputIsCodecConfig = true;
+        return;
+    }
+    mLastInputIsCodecConfig = false;
+
+    C2ReadView view = input.map().get();
+    if (view.error() == C2_OK &&
+        isKeyFrame(*mIntfImpl->getVideoCodec(), view.data(), view.capacity())) {
+        mReplayInputs.clear();
+        mReplayInputsSize = 0;
+        mCanReplay = true;
+    }
+    if (!mCanReplay) return;
+
+    if (mReplayInputsSize + input.size() > kMaxReplayInputsSize) {
+        ALOGV("The bitstream since the last key frame is too large to be kept");
+        mReplayInputs.clear();
+        mReplayInputsSize = 0;
+        mCanReplay = false;
+        return;
+    }
+    mReplayInputs.emplace_back(bitstreamId, input);
+    mReplayInputsSize += input.size();
+}
+
+void V4L2DecodeComponent::onTrimMemoryRequested() {
+    ALOGV("%s()", __func__);
+    std::lock_guard<std::mutex> lock(mStartStopLock);
+
+    if (mComponentState.load() != ComponentState::RUNNING) return;
+    mDecoderTaskRunner->PostTask(FROM_HERE,
+                                 ::base::BindOnce(&V4L2DecodeComponent::trimTask, mWeakThis));
+}
+
+void V4L2DecodeComponent::checkIdleTask() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    mIsIdleCheckPending = false;
+    const ::base::TimeDelta timeout = ::base::TimeDelta::FromMilliseconds(getIdleTrimTimeoutMs());
+    const ::base::TimeDelta idleTime = ::base::TimeTicks::Now() - mLastQueueTime;
+    if (idleTime < timeout) {
+        mIsIdleCheckPending = true;
+        mDecoderTaskRunner->PostDelayedTask(
+                FROM_HERE, ::base::BindOnce(&V4L2DecodeComponent::checkIdleTask, mWeakThis),
+                timeout - idleTime);
+        return;
+    }
+    trimTask();
+}
+
+void V4L2DecodeComponent::trimTask() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    if (!mIsTrimEnabled || !mDecoder || mComponentState.load() != ComponentState::RUNNING) return;
+    if (mIsDraining || !mPendingWorks.empty() || !mCanReplay) {
+        ALOGV("The decoder can't be restored to its current state, not trimming it");
+        return;
+    }
+    ALOGI("Trimming the decoder with %zu works pending", mWorksAtDecoder.size());
+
+    // The decode callbacks of the works are dropped with |mDecoder|, which releases all the
+    // buffers of its V4L2 queues and of its VideoFramePool.
+    mDecoder = nullptr;
+    mIsTrimmed = true;
+    mDecodeStartTimes.clear();
+    mStats->setMemoryUsage(0);
+
+    // The works which got their frame, or don't have one, are done once their input is released.
+    // The other ones wait for their frame to be decoded again from the bitstream kept, or are
+    // dropped if it predates the last key frame.
+    std::vector<int32_t> droppedBitstreamIds;
+    mWorksAtDecoder.forEach([&](uint32_t id, const std::unique_ptr<C2Work>& work) {
+        const int32_t bitstreamId = static_cast<int32_t>(id);
+        C2FrameData& output = work->worklets.front()->output;
+        const bool isCSDWork = work->input.flags & C2FrameData::FLAG_CODEC_CONFIG;
+        const bool isReplayed = std::any_of(
+                mReplayInputs.begin(), mReplayInputs.end(),
+                [bitstreamId](const auto& input) { return input.first == bitstreamId; });
+        if (!isCSDWork && output.buffers.empty() && isReplayed) return;
+
+        work->input.buffers.front().reset();
+        if (isCSDWork) {
+            mOutputBitstreamIds.push(bitstreamId);
+        } else if (output.buffers.empty()) {
+            if (!(output.flags & C2FrameData::FLAG_DROP_FRAME)) mStats->onFrameDropped();
+            output.flags = C2FrameData::FLAG_DROP_FRAME;
+            droppedBitstreamIds.push_back(bitstreamId);
+        }
+    });
+    for (const int32_t bitstreamId : droppedBitstreamIds) reportWorkIfFinished(bitstreamId);
+    pumpReportWork();
+}
+
+bool V4L2DecodeComponent::restoreDecoder() {
+    ALOGI("%s(): replaying %zu inputs", __func__, mCodecConfigInputs.size() + mReplayInputs.size());
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+    ALOG_ASSERT(mIsTrimmed);
+
+    mIsTrimmed = false;
+    if (createDecoder() != C2_OK) {
+        reportError(C2_CORRUPTED);
+        return false;
+    }
+
+    int32_t replayIndex = 0;
+    const auto replay = [&](const C2ConstLinearBlock& input) {
+        mDecoder->decode(std::make_unique<ConstBitstreamBuffer>(
+                                 kReplayBitstreamIdFlag | replayIndex++, input, input.offset(),
+                                 input.size()),
+                         ::base::BindOnce(&V4L2DecodeComponent::onReplayDecodeDone, mWeakThis));
+    };
+    for (const C2ConstLinearBlock& input : mCodecConfigInputs) replay(input);
+    for (const auto& [bitstreamId, input] : mReplayInputs) {
+        // The works still at the decoder are the ones waiting for their frame.
+        if (mWorksAtDecoder.find(bitstreamId) == nullptr) {
+            replay(input);
+            continue;
+        }
+        mDecoder->decode(std::make_unique<ConstBitstreamBuffer>(bitstreamId, input, input.offset(),
+                                                                input.size()),
+                         ::base::BindOnce(&V4L2DecodeComponent::onDecodeDone, mWeakThis,
+                                          bitstreamId));
+    }
+    return true;
+}
+
+void V4L2DecodeComponent::onReplayDecodeDone(VideoDecoder::DecodeStatus status) {
+    ALOGV("%s(status=%s)", __func__, VideoDecoder::DecodeStatusToString(status));
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    if (status == VideoDecoder::DecodeStatus::kError) reportError(C2_CORRUPTED);
+}
+
 void V4L2DecodeComponent::onDecodeDone(int32_t bitstreamId, VideoDecoder::DecodeStatus status) {
     ALOGV("%s(bitstreamId=%d, status=%s)", __func__, bitstreamId,
           VideoDecoder::DecodeStatusToString(status));
     ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+    ATRACE_ASYNC_END(mDecodeTraceName.c_str(), bitstreamId);
 
-    auto it = mWorksAtDecoder.find(bitstreamId);
-    ALOG_ASSERT(it != mWorksAtDecoder.end());
-    C2Work* work = it->second.get();
+    std::unique_ptr<C2Work>* workAtDecoder = mWorksAtDecoder.find(bitstreamId);
+    if (workAtDecoder == nullptr) {
+        // In low latency mode, the works are reported as soon as their frame is output.
+        ALOG_ASSERT(mLowLatency);
+        if (status == VideoDecoder::DecodeStatus::kError) reportError(C2_CORRUPTED);
+        return;
+    }
+    C2Work* work = workAtDecoder->get();
 
     switch (status) {
     case VideoDecoder::DecodeStatus::kAborted:
@@ -553,13 +1113,33 @@ void V4L2DecodeComponent::onOutputFrameReady(std::unique_ptr<VideoFrame> frame)
     ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
 
     const int32_t bitstreamId = frame->getBitstreamId();
-    auto it = mWorksAtDecoder.find(bitstreamId);
-    if (it == mWorksAtDecoder.end()) {
+    // The frames of the works already reported are decoded again when restoring the decoder.
+    if (bitstreamId & kReplayBitstreamIdFlag) return;
+    std::unique_ptr<C2Work>* workAtDecoder = mWorksAtDecoder.find(bitstreamId);
+    if (workAtDecoder == nullptr) {
         ALOGE("Work with bitstreamId=%d not found, already abandoned?", bitstreamId);
         reportError(C2_CORRUPTED);
         return;
     }
-    C2Work* work = it->second.get();
+    C2Work* work = workAtDecoder->get();
+    mStats->onFrameOut();
+    mStats->setMemoryUsage(mDecoder->getMemoryUsage());
+    if (mHintSession) mHintSession->onFrameDone();
+
+    // The tunneled frames are displayed without going through the client, so the work is
+    // reported without output buffer.
+    if (mTunnel) {
+        if (!mTunnel->queueFrame(std::move(frame)->getGraphicBlock(),
+                                 work->input.ordinal.timestamp.peekll())) {
+            ALOGE("Failed to queue the frame of bitstreamId=%d to the tunnel", bitstreamId);
+            reportError(C2_CORRUPTED);
+            return;
+        }
+        work->worklets.front()->output.flags = C2FrameData::FLAG_DROP_FRAME;
+        mOutputBitstreamIds.push(bitstreamId);
+        pumpReportWork();
+        return;
+    }
 
     C2ConstGraphicBlock constBlock = std::move(frame)->getGraphicBlock();
     std::shared_ptr<C2Buffer> buffer = C2Buffer::CreateGraphicBuffer(std::move(constBlock));
@@ -571,11 +1151,15 @@ void V4L2DecodeComponent::onOutputFrameReady(std::unique_ptr<VideoFrame> frame)
     if (mCurrentColorAspects) {
         buffer->setInfo(mCurrentColorAspects);
     }
+    if (mPendingPixelFormat) {
+        work->worklets.front()->output.configUpdate.push_back(std::move(mPendingPixelFormat));
+    }
     work->worklets.front()->output.buffers.emplace_back(std::move(buffer));
 
-    // Check no-show frame by timestamps for VP8/VP9 cases before reporting the current work.
+    // Check no-show frame by timestamps for VP8/VP9/AV1 cases before reporting the current work.
     if (mIntfImpl->getVideoCodec() == VideoCodec::VP8 ||
-        mIntfImpl->getVideoCodec() == VideoCodec::VP9) {
+        mIntfImpl->getVideoCodec() == VideoCodec::VP9 ||
+        mIntfImpl->getVideoCodec() == VideoCodec::AV1) {
         detectNoShowFrameWorksAndReportIfFinished(work->input.ordinal);
     }
 
@@ -588,10 +1172,10 @@ void V4L2DecodeComponent::detectNoShowFrameWorksAndReportIfFinished(
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
 
-    std::vector<int32_t> noShowFrameBitstreamIds;
-    for (auto& kv : mWorksAtDecoder) {
-        const int32_t bitstreamId = kv.first;
-        const C2Work* work = kv.second.get();
+    std::vector<std::pair<uint64_t, int32_t>> noShowFrameBitstreamIds;
+    mWorksAtDecoder.forEach([&](uint32_t id, const std::unique_ptr<C2Work>& workAtDecoder) {
+        const int32_t bitstreamId = static_cast<int32_t>(id);
+        const C2Work* work = workAtDecoder.get();
 
         // A work in mWorksAtDecoder would be considered to have no-show frame if there is no
         // corresponding output buffer returned while the one of the work with latter timestamp is
@@ -602,15 +1186,19 @@ void V4L2DecodeComponent::detectNoShowFrameWorksAndReportIfFinished(
             // We need to call reportWorkIfFinished() for all detected no-show frame works. However,
             // we should do it after the detection loop since reportWorkIfFinished() may erase
             // entries in |mWorksAtDecoder|.
-            noShowFrameBitstreamIds.push_back(bitstreamId);
+            noShowFrameBitstreamIds.emplace_back(work->input.ordinal.frameIndex.peeku(),
+                                                 bitstreamId);
+            mStats->onFrameDropped();
             ALOGV("Detected no-show frame work index=%llu timestamp=%llu",
                   work->input.ordinal.frameIndex.peekull(),
                   work->input.ordinal.timestamp.peekull());
         }
-    }
+    });
 
-    // Try to report works with no-show frame.
-    for (const int32_t bitstreamId : noShowFrameBitstreamIds) reportWorkIfFinished(bitstreamId);
+    // Try to report works with no-show frame, in the order they were queued as the map is not
+    // ordered.
+    std::sort(noShowFrameBitstreamIds.begin(), noShowFrameBitstreamIds.end());
+    for (const auto& entry : noShowFrameBitstreamIds) reportWorkIfFinished(entry.second);
 }
 
 void V4L2DecodeComponent::pumpReportWork() {
@@ -633,19 +1221,20 @@ bool V4L2DecodeComponent::reportWorkIfFinished(int32_t bitstreamId) {
         return false;
     }
 
-    auto it = mWorksAtDecoder.find(bitstreamId);
-    if (it == mWorksAtDecoder.end()) {
+    std::unique_ptr<C2Work>* workAtDecoder = mWorksAtDecoder.find(bitstreamId);
+    if (workAtDecoder == nullptr) {
         ALOGI("work(bitstreamId = %d) is dropped, skip.", bitstreamId);
         return true;
     }
 
-    if (!isWorkDone(*(it->second))) {
+    if (!isWorkDone(**workAtDecoder)) {
         ALOGV("work(bitstreamId = %d) is not done yet.", bitstreamId);
         return false;
     }
 
-    std::unique_ptr<C2Work> work = std::move(it->second);
-    mWorksAtDecoder.erase(it);
+    std::unique_ptr<C2Work> work = std::move(*workAtDecoder);
+    mWorksAtDecoder.erase(bitstreamId);
+    recordDecodeLatency(bitstreamId);
 
     work->result = C2_OK;
     work->workletsProcessed = static_cast<uint32_t>(work->worklets.size());
@@ -661,17 +1250,17 @@ bool V4L2DecodeComponent::reportEOSWork() {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
 
-    const auto it =
-            std::find_if(mWorksAtDecoder.begin(), mWorksAtDecoder.end(), [](const auto& kv) {
-                return kv.second->input.flags & C2FrameData::FLAG_END_OF_STREAM;
-            });
-    if (it == mWorksAtDecoder.end()) {
+    std::optional<uint32_t> eosBitstreamId;
+    mWorksAtDecoder.forEach([&](uint32_t id, const std::unique_ptr<C2Work>& workAtDecoder) {
+        if (workAtDecoder->input.flags & C2FrameData::FLAG_END_OF_STREAM) eosBitstreamId = id;
+    });
+    if (!eosBitstreamId) {
         ALOGE("Failed to find EOS work.");
         return false;
     }
 
-    std::unique_ptr<C2Work> eosWork(std::move(it->second));
-    mWorksAtDecoder.erase(it);
+    std::unique_ptr<C2Work> eosWork(std::move(*mWorksAtDecoder.find(*eosBitstreamId)));
+    mWorksAtDecoder.erase(*eosBitstreamId);
 
     eosWork->result = C2_OK;
     eosWork->workletsProcessed = static_cast<uint32_t>(eosWork->worklets.size());
@@ -680,11 +1269,11 @@ bool V4L2DecodeComponent::reportEOSWork() {
 
     if (!mWorksAtDecoder.empty()) {
         ALOGW("There are remaining works except EOS work. abandon them.");
-        for (const auto& kv : mWorksAtDecoder) {
-            ALOGW("bitstreamId(%d) => Work index=%llu, timestamp=%llu", kv.first,
-                  kv.second->input.ordinal.frameIndex.peekull(),
-                  kv.second->input.ordinal.timestamp.peekull());
-        }
+        mWorksAtDecoder.forEach([](uint32_t id, const std::unique_ptr<C2Work>& workAtDecoder) {
+            ALOGW("bitstreamId(%u) => Work index=%llu, timestamp=%llu", id,
+                  workAtDecoder->input.ordinal.frameIndex.peekull(),
+                  workAtDecoder->input.ordinal.timestamp.peekull());
+        });
         reportAbandonedWorks();
     }
 
@@ -700,12 +1289,44 @@ bool V4L2DecodeComponent::reportWork(std::unique_ptr<C2Work> work) {
         return false;
     }
 
-    std::list<std::unique_ptr<C2Work>> finishedWorks;
-    finishedWorks.emplace_back(std::move(work));
-    mListener->onWorkDone_nb(weak_from_this(), std::move(finishedWorks));
+    // All the works finished during the current task are reported in a single call, unless the
+    // client wants them as soon as possible.
+    mWorkDoneBatcher->add(std::move(work));
+    if (mLowLatency) mWorkDoneBatcher->flush();
     return true;
 }
 
+void V4L2DecodeComponent::recordDecodeLatency(int32_t bitstreamId) {
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    const ::base::TimeTicks* startTime = mDecodeStartTimes.find(bitstreamId);
+    if (startTime == nullptr) return;
+    const ::base::TimeDelta latency = ::base::TimeTicks::Now() - *startTime;
+    mDecodeStartTimes.erase(bitstreamId);
+
+    mNumLatencySamples++;
+    mTotalDecodeLatency += latency;
+    mMaxDecodeLatency = std::max(mMaxDecodeLatency, latency);
+    mStats->addLatency(latency);
+    ALOGV("work(bitstreamId = %d) reported after %" PRId64 " us", bitstreamId,
+          latency.InMicroseconds());
+}
+
+void V4L2DecodeComponent::reportWorks(std::list<std::unique_ptr<C2Work>> works) {
+    ALOGV("%s(): Reporting %zu works", __func__, works.size());
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    if (!mListener) {
+        ALOGE("mListener is nullptr, setListener_vb() not called?");
+        return;
+    }
+    for (const auto& work : works) {
+        ATRACE_ASYNC_END(mWorkTraceName.c_str(),
+                         frameIndexToBitstreamId(work->input.ordinal.frameIndex));
+    }
+    mWorkReporter->reportWorks(mListener, weak_from_this(), std::move(works));
+}
+
 c2_status_t V4L2DecodeComponent::flush_sm(
         flush_mode_t mode, std::list<std::unique_ptr<C2Work>>* const /* flushedWork */) {
     ALOGV("%s()", __func__);
@@ -715,8 +1336,9 @@ c2_status_t V4L2DecodeComponent::flush_sm(
         ALOGE("Could not flush at state: %s", ComponentStateToString(currentState));
         return C2_BAD_STATE;
     }
-    if (mode != FLUSH_COMPONENT) {
-        return C2_OMITTED;  // Tunneling is not supported by now
+    // The frames queued to the tunnel are dropped with the ones of the component.
+    if (mode != FLUSH_COMPONENT && !(mode == FLUSH_CHAIN && mIntfImpl->getTunnel())) {
+        return C2_OMITTED;
     }
 
     mDecoderTaskRunner->PostTask(FROM_HERE,
@@ -728,8 +1350,16 @@ void V4L2DecodeComponent::flushTask() {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
 
-    mDecoder->flush();
+    // The decoder is missing if the asynchronous start failed, or while it is trimmed.
+    if (!mDecoder && !mIsTrimmed) return;
+
+    if (mDecoder) mDecoder->flush();
+    if (mTunnel) mTunnel->flush();
     reportAbandonedWorks();
+    // The decoding resumes from the next input, which might not be a key frame.
+    mReplayInputs.clear();
+    mReplayInputsSize = 0;
+    mCanReplay = false;
 
     // Pending EOS work will be abandoned here due to component flush if any.
     mIsDraining = false;
@@ -744,10 +1374,19 @@ void V4L2DecodeComponent::reportAbandonedWorks() {
         abandonedWorks.emplace_back(std::move(mPendingWorks.front()));
         mPendingWorks.pop();
     }
-    for (auto& kv : mWorksAtDecoder) {
-        abandonedWorks.emplace_back(std::move(kv.second));
-    }
+    // Abandon the works in the order they were queued, as the map is not ordered.
+    std::vector<std::unique_ptr<C2Work>> worksAtDecoder;
+    worksAtDecoder.reserve(mWorksAtDecoder.size());
+    mWorksAtDecoder.forEach([&](uint32_t /* id */, std::unique_ptr<C2Work>& workAtDecoder) {
+        worksAtDecoder.emplace_back(std::move(workAtDecoder));
+    });
     mWorksAtDecoder.clear();
+    std::sort(worksAtDecoder.begin(), worksAtDecoder.end(), [](const auto& a, const auto& b) {
+        return a->input.ordinal.frameIndex < b->input.ordinal.frameIndex;
+    });
+    for (auto& work : worksAtDecoder) {
+        abandonedWorks.emplace_back(std::move(work));
+    }
 
     for (auto& work : abandonedWorks) {
         // TODO: correlate the definition of flushed work result to framework.
@@ -757,12 +1396,10 @@ void V4L2DecodeComponent::reportAbandonedWorks() {
             work->input.buffers.front().reset();
         }
     }
+    // Works which finished before the abandoned ones are reported first.
+    mWorkDoneBatcher->flush();
     if (!abandonedWorks.empty()) {
-        if (!mListener) {
-            ALOGE("mListener is nullptr, setListener_vb() not called?");
-            return;
-        }
-        mListener->onWorkDone_nb(weak_from_this(), std::move(abandonedWorks));
+        reportWorks(std::move(abandonedWorks));
     }
 }
 
@@ -777,15 +1414,17 @@ c2_status_t V4L2DecodeComponent::drain_nb(drain_mode_t mode) {
 
     switch (mode) {
     case DRAIN_CHAIN:
-        return C2_OMITTED;  // Tunneling is not supported.
-
-    case DRAIN_COMPONENT_NO_EOS:
-        return C2_OK;  // Do nothing special.
+        // The tunnel is the end of the chain, so draining it is the same as draining the component.
+        if (!mIntfImpl->getTunnel()) return C2_OMITTED;
+        [[fallthrough]];
 
     case DRAIN_COMPONENT_WITH_EOS:
         mDecoderTaskRunner->PostTask(FROM_HERE,
                                      ::base::BindOnce(&V4L2DecodeComponent::drainTask, mWeakThis));
         return C2_OK;
+
+    case DRAIN_COMPONENT_NO_EOS:
+        return C2_OK;  // Do nothing special.
     }
 }
 
@@ -802,6 +1441,7 @@ void V4L2DecodeComponent::drainTask() {
 
     if (!mWorksAtDecoder.empty()) {
         ALOGV("Drain the pending works at the decoder.");
+        if (mIsTrimmed && !restoreDecoder()) return;
         mDecoder->drain(::base::BindOnce(&V4L2DecodeComponent::onDrainDone, mWeakThis));
         mIsDraining = true;
     }
@@ -839,15 +1479,24 @@ void V4L2DecodeComponent::reportError(c2_status_t error) {
     if (mComponentState.load() == ComponentState::ERROR) return;
     mComponentState.store(ComponentState::ERROR);
 
+    if (mWorkDoneBatcher) mWorkDoneBatcher->flush();
+
     if (!mListener) {
         ALOGE("mListener is nullptr, setListener_vb() not called?");
         return;
     }
-    mListener->onError_nb(weak_from_this(), static_cast<uint32_t>(error));
+    // The error follows the works reported before, unless the decoder failed to start.
+    if (mWorkReporter) {
+        mWorkReporter->reportError(mListener, weak_from_this(), error);
+    } else {
+        mListener->onError_nb(weak_from_this(), static_cast<uint32_t>(error));
+    }
 }
 
 c2_status_t V4L2DecodeComponent::announce_nb(const std::vector<C2WorkOutline>& /* items */) {
-    return C2_OMITTED;  // Tunneling is not supported by now
+    // The announced works are only meant for the tunneled components, which don't need them as
+    // the works are queued to this component as usual.
+    return mIntfImpl->getTunnel() ? C2_OK : C2_OMITTED;
 }
 
 std::shared_ptr<C2ComponentInterface> V4L2DecodeComponent::intf() {
@@ -7,14 +7,20 @@
 
 #include <v4l2_codec2/components/V4L2DecodeInterface.h>
 
+#include <string.h>
+
+#include <algorithm>
+
 #include <C2PlatformSupport.h>
 #include <SimpleC2Interface.h>
 #include <android/hardware/graphics/common/1.0/types.h>
+#include <cutils/properties.h>
 #include <log/log.h>
 #include <media/stagefright/foundation/MediaDefs.h>
 
 #include <v4l2_codec2/common/V4L2ComponentCommon.h>
 #include <v4l2_codec2/common/V4L2Device.h>
+#include <v4l2_codec2/components/DecodeOutputFormat.h>
 #include <v4l2_codec2/plugin_store/V4L2AllocatorId.h>
 
 namespace android {
@@ -27,6 +33,23 @@ constexpr size_t kInputBufferSizeFor1080p = 1024 * 1024;  // 1MB
 // Input bitstream buffer size for up to 4k streams.
 constexpr size_t kInputBufferSizeFor4K = 4 * kInputBufferSizeFor1080p;
 
+// The default number of bitstream buffers queued to the device.
+constexpr uint32_t kDefaultInputPipelineDepth = 16;
+constexpr uint32_t kMaxInputPipelineDepth = 32;
+// The default number of output buffers held by the client and the display. The values are copied
+// from CCodecBufferChannel.cpp: the MediaCodec output slots beyond the output delay
+// (kSmoothnessFactor), and the Surface (kRenderingDepth).
+// (b/184020290): Check the value still sync when seeing error message from CCodec:
+// "previous call to queue exceeded timeout".
+constexpr uint32_t kDefaultOutputPipelineDepth = 4 + 3;
+constexpr uint32_t kMaxOutputPipelineDepth = 32;
+// The depths used by the low latency preset: a few bitstream buffers to absorb the network jitter,
+// and a double-buffered display.
+constexpr uint32_t kLowLatencyInputPipelineDepth = 4;
+constexpr uint32_t kLowLatencyOutputPipelineDepth = 2;
+// The frame rate assumed until the client announces the frame rate of the stream.
+constexpr float kDefaultFrameRate = 30.0;
+
 std::optional<VideoCodec> getCodecFromComponentName(const std::string& name) {
     if (name == V4L2ComponentName::kH264Decoder || name == V4L2ComponentName::kH264SecureDecoder)
         return VideoCodec::H264;
@@ -36,20 +59,83 @@ std::optional<VideoCodec> getCodecFromComponentName(const std::string& name) {
         return VideoCodec::VP9;
     if (name == V4L2ComponentName::kHEVCDecoder || name == V4L2ComponentName::kHEVCSecureDecoder)
         return VideoCodec::HEVC;
+    if (name == V4L2ComponentName::kAV1Decoder || name == V4L2ComponentName::kAV1SecureDecoder)
+        return VideoCodec::AV1;
 
     ALOGE("Unknown name: %s", name.c_str());
     return std::nullopt;
 }
 
-size_t calculateInputBufferSize(size_t area) {
+// The smallest input buffer size picked from the level limits.
+constexpr size_t kMinAdaptiveInputBufferSize = 64 * 1024;  // 64KB
+
+// Get the size of the coded picture buffer of |level| in bytes, which no access unit of a
+// conforming stream exceeds. Returns nullopt for the codecs without known limits.
+std::optional<size_t> getMaxAccessUnitSize(C2Config::level_t level) {
+    // MaxCPB of the H.264 (Table A-1) and HEVC (Table A.8) levels in units of 1000 bits, which are
+    // scaled by the largest cpbBrNalFactor of the supported profiles.
+    constexpr size_t kH264CpbNalFactor = 1500;
+    constexpr size_t kHEVCCpbNalFactor = 1100;
+    size_t maxCpb = 0;
+    size_t cpbNalFactor = kH264CpbNalFactor;
+    switch (level) {
+    // clang-format off
+    case C2Config::LEVEL_AVC_1:   maxCpb = 175; break;
+    case C2Config::LEVEL_AVC_1B:  maxCpb = 350; break;
+    case C2Config::LEVEL_AVC_1_1: maxCpb = 500; break;
+    case C2Config::LEVEL_AVC_1_2: maxCpb = 1000; break;
+    case C2Config::LEVEL_AVC_1_3: maxCpb = 2000; break;
+    case C2Config::LEVEL_AVC_2:   maxCpb = 2000; break;
+    case C2Config::LEVEL_AVC_2_1: maxCpb = 4000; break;
+    case C2Config::LEVEL_AVC_2_2: maxCpb = 4000; break;
+    case C2Config::LEVEL_AVC_3:   maxCpb = 10000; break;
+    case C2Config::LEVEL_AVC_3_1: maxCpb = 14000; break;
+    case C2Config::LEVEL_AVC_3_2: maxCpb = 20000; break;
+    case C2Config::LEVEL_AVC_4:   maxCpb = 25000; break;
+    case C2Config::LEVEL_AVC_4_1: maxCpb = 62500; break;
+    case C2Config::LEVEL_AVC_4_2: maxCpb = 62500; break;
+    case C2Config::LEVEL_AVC_5:   maxCpb = 135000; break;
+    case C2Config::LEVEL_AVC_5_1: maxCpb = 240000; break;
+    case C2Config::LEVEL_AVC_5_2: maxCpb = 240000; break;
+    case C2Config::LEVEL_HEVC_MAIN_1:   maxCpb = 350; break;
+    case C2Config::LEVEL_HEVC_MAIN_2:   maxCpb = 1500; break;
+    case C2Config::LEVEL_HEVC_MAIN_2_1: maxCpb = 3000; break;
+    case C2Config::LEVEL_HEVC_MAIN_3:   maxCpb = 6000; break;
+    case C2Config::LEVEL_HEVC_MAIN_3_1: maxCpb = 10000; break;
+    case C2Config::LEVEL_HEVC_MAIN_4:   maxCpb = 12000; break;
+    case C2Config::LEVEL_HEVC_MAIN_4_1: maxCpb = 20000; break;
+    case C2Config::LEVEL_HEVC_MAIN_5:   maxCpb = 25000; break;
+    case C2Config::LEVEL_HEVC_MAIN_5_1: maxCpb = 40000; break;
+    case C2Config::LEVEL_HEVC_MAIN_5_2: maxCpb = 60000; break;
+    case C2Config::LEVEL_HEVC_HIGH_4:   maxCpb = 30000; break;
+    case C2Config::LEVEL_HEVC_HIGH_4_1: maxCpb = 50000; break;
+    case C2Config::LEVEL_HEVC_HIGH_5:   maxCpb = 100000; break;
+    case C2Config::LEVEL_HEVC_HIGH_5_1: maxCpb = 160000; break;
+    case C2Config::LEVEL_HEVC_HIGH_5_2: maxCpb = 240000; break;
+    // clang-format on
+    default:
+        return std::nullopt;
+    }
+    if (level >= C2Config::LEVEL_HEVC_MAIN_1 && level <= C2Config::LEVEL_HEVC_HIGH_6_2) {
+        cpbNalFactor = kHEVCCpbNalFactor;
+    }
+    return maxCpb * cpbNalFactor / 8;
+}
+
+size_t calculateInputBufferSize(size_t area, C2Config::level_t level) {
     if (area > k4KArea) {
         ALOGW("Input buffer size for video size (%zu) larger than 4K (%zu) might be too small.",
               area, k4KArea);
     }
 
     // Enlarge the input buffer for 4k video
-    if (area > k1080pArea) return kInputBufferSizeFor4K;
-    return kInputBufferSizeFor1080p;
+    const size_t size = (area > k1080pArea) ? kInputBufferSizeFor4K : kInputBufferSizeFor1080p;
+    if (!V4L2DecodeInterface::isInputBufferSizeAdaptive()) return size;
+
+    // Streams of lower levels are bounded by their coded picture buffer instead.
+    const std::optional<size_t> maxAccessUnitSize = getMaxAccessUnitSize(level);
+    if (!maxAccessUnitSize) return size;
+    return std::clamp(*maxAccessUnitSize, kMinAdaptiveInputBufferSize, size);
 }
 }  // namespace
 
@@ -69,6 +155,32 @@ C2R V4L2DecodeInterface::SizeSetter(bool /* mayBlock */,
             .plus(videoSize.F(videoSize.v.height).validatePossible(videoSize.v.height));
 }
 
+// static
+C2R V4L2DecodeInterface::ThreadPolicySetter(bool /* mayBlock */,
+                                            C2P<C2V4L2ThreadPolicyTuning>& me) {
+    return me.F(me.v.priority)
+            .validatePossible(me.v.priority)
+            .plus(me.F(me.v.cluster).validatePossible(me.v.cluster));
+}
+
+// static
+C2R V4L2DecodeInterface::RenderClockSetter(bool /* mayBlock */,
+                                           C2P<C2V4L2RenderClockTuning>& me) {
+    return me.F(me.v.mediaTimeUs)
+            .validatePossible(me.v.mediaTimeUs)
+            .plus(me.F(me.v.systemTimeNs).validatePossible(me.v.systemTimeNs));
+}
+
+// static
+C2R V4L2DecodeInterface::MaxPictureSizeSetter(bool /* mayBlock */,
+                                              C2P<C2StreamMaxPictureSizeTuning::output>& me,
+                                              const C2P<C2StreamPictureSizeInfo::output>& size) {
+    // The max picture size can't be smaller than the current picture size.
+    me.set().width = std::min(std::max(me.v.width, size.v.width), 4096u);
+    me.set().height = std::min(std::max(me.v.height, size.v.height), 4096u);
+    return C2R::Ok();
+}
+
 // static
 template <typename T>
 C2R V4L2DecodeInterface::DefaultColorAspectsSetter(bool /* mayBlock */, C2P<T>& def) {
@@ -105,11 +217,44 @@ C2R V4L2DecodeInterface::MergedColorAspectsSetter(
 // static
 C2R V4L2DecodeInterface::MaxInputBufferSizeCalculator(
         bool /* mayBlock */, C2P<C2StreamMaxBufferSizeInfo::input>& me,
-        const C2P<C2StreamPictureSizeInfo::output>& size) {
-    me.set().value = calculateInputBufferSize(size.v.width * size.v.height);
+        const C2P<C2StreamPictureSizeInfo::output>& size,
+        const C2P<C2StreamProfileLevelInfo::input>& profileLevel) {
+    me.set().value = calculateInputBufferSize(size.v.width * size.v.height, profileLevel.v.level);
     return C2R::Ok();
 }
 
+// static
+C2R V4L2DecodeInterface::OutputDelaySetter(
+        bool /* mayBlock */, C2P<C2PortDelayTuning::output>& me,
+        const C2P<C2GlobalLowLatencyModeTuning>& lowLatencyMode,
+        const C2P<C2V4L2LowLatencyPresetTuning>& preset) {
+    // Low latency streams don't reorder frames, so no extra input is needed to output a frame.
+    if (lowLatencyMode.v.value || preset.v.value) me.set().value = 0;
+    return me.F(me.v.value).validatePossible(me.v.value);
+}
+
+// static
+C2R V4L2DecodeInterface::InputPipelineDepthSetter(
+        bool /* mayBlock */, C2P<C2V4L2InputPipelineDepthTuning>& me,
+        const C2P<C2V4L2LowLatencyPresetTuning>& preset) {
+    if (preset.v.value) me.set().value = std::min(me.v.value, kLowLatencyInputPipelineDepth);
+    return me.F(me.v.value).validatePossible(me.v.value);
+}
+
+// static
+C2R V4L2DecodeInterface::OutputPipelineDepthSetter(
+        bool /* mayBlock */, C2P<C2V4L2OutputPipelineDepthTuning>& me,
+        const C2P<C2V4L2LowLatencyPresetTuning>& preset) {
+    if (preset.v.value) me.set().value = std::min(me.v.value, kLowLatencyOutputPipelineDepth);
+    return me.F(me.v.value).validatePossible(me.v.value);
+}
+
+// static
+C2R V4L2DecodeInterface::TunneledModeSetter(bool /* mayBlock */,
+                                            C2P<C2PortTunneledModeTuning::output>& me) {
+    return me.F(me.v.m.mode).validatePossible(me.v.m.mode);
+}
+
 V4L2DecodeInterface::V4L2DecodeInterface(const std::string& name,
                                          const std::shared_ptr<C2ReflectorHelper>& helper)
       : C2InterfaceHelper(helper), mInitStatus(C2_OK) {
@@ -165,13 +310,15 @@ V4L2DecodeInterface::V4L2DecodeInterface(const std::string& name,
                              .build());
         break;
 
-    case VideoCodec::VP9:
+    case VideoCodec::VP9: {
         inputMime = MEDIA_MIMETYPE_VIDEO_VP9;
+        std::vector<unsigned int> profiles = {C2Config::PROFILE_VP9_0};
+        if (isDecode10BitOutputEnabled()) profiles.push_back(C2Config::PROFILE_VP9_2);
         addParameter(
                 DefineParam(mProfileLevel, C2_PARAMKEY_PROFILE_LEVEL)
                         .withDefault(new C2StreamProfileLevelInfo::input(
                                 0u, C2Config::PROFILE_VP9_0, C2Config::LEVEL_VP9_5))
-                        .withFields({C2F(mProfileLevel, profile).oneOf({C2Config::PROFILE_VP9_0}),
+                        .withFields({C2F(mProfileLevel, profile).oneOf(profiles),
                                      C2F(mProfileLevel, level)
                                              .oneOf({C2Config::LEVEL_VP9_1, C2Config::LEVEL_VP9_1_1,
                                                      C2Config::LEVEL_VP9_2, C2Config::LEVEL_VP9_2_1,
@@ -181,16 +328,18 @@ V4L2DecodeInterface::V4L2DecodeInterface(const std::string& name,
                         .withSetter(ProfileLevelSetter)
                         .build());
         break;
+    }
 
-    case VideoCodec::HEVC:
+    case VideoCodec::HEVC: {
         inputMime = MEDIA_MIMETYPE_VIDEO_HEVC;
+        std::vector<unsigned int> profiles = {C2Config::PROFILE_HEVC_MAIN,
+                                              C2Config::PROFILE_HEVC_MAIN_STILL};
+        if (isDecode10BitOutputEnabled()) profiles.push_back(C2Config::PROFILE_HEVC_MAIN_10);
         addParameter(
                 DefineParam(mProfileLevel, C2_PARAMKEY_PROFILE_LEVEL)
                         .withDefault(new C2StreamProfileLevelInfo::input(
                                 0u, C2Config::PROFILE_HEVC_MAIN, C2Config::LEVEL_HEVC_MAIN_5_1))
-                        .withFields({C2F(mProfileLevel, profile)
-                                             .oneOf({C2Config::PROFILE_HEVC_MAIN,
-                                                     C2Config::PROFILE_HEVC_MAIN_STILL}),
+                        .withFields({C2F(mProfileLevel, profile).oneOf(profiles),
                                      C2F(mProfileLevel, level)
                                              .oneOf({C2Config::LEVEL_HEVC_MAIN_1,
                                                      C2Config::LEVEL_HEVC_MAIN_2,
@@ -212,6 +361,37 @@ V4L2DecodeInterface::V4L2DecodeInterface(const std::string& name,
         break;
     }
 
+    case VideoCodec::AV1:
+        // The Main profile covers both the 8-bit and the 10-bit streams. Without 10-bit output,
+        // the component rejects the 10-bit streams once it parsed their sequence header.
+        inputMime = MEDIA_MIMETYPE_VIDEO_AV1;
+        addParameter(
+                DefineParam(mProfileLevel, C2_PARAMKEY_PROFILE_LEVEL)
+                        .withDefault(new C2StreamProfileLevelInfo::input(
+                                0u, C2Config::PROFILE_AV1_0, C2Config::LEVEL_AV1_5_1))
+                        .withFields({C2F(mProfileLevel, profile).oneOf({C2Config::PROFILE_AV1_0}),
+                                     C2F(mProfileLevel, level)
+                                             .oneOf({C2Config::LEVEL_AV1_2,
+                                                     C2Config::LEVEL_AV1_2_1,
+                                                     C2Config::LEVEL_AV1_2_2,
+                                                     C2Config::LEVEL_AV1_2_3,
+                                                     C2Config::LEVEL_AV1_3,
+                                                     C2Config::LEVEL_AV1_3_1,
+                                                     C2Config::LEVEL_AV1_3_2,
+                                                     C2Config::LEVEL_AV1_3_3,
+                                                     C2Config::LEVEL_AV1_4,
+                                                     C2Config::LEVEL_AV1_4_1,
+                                                     C2Config::LEVEL_AV1_4_2,
+                                                     C2Config::LEVEL_AV1_4_3,
+                                                     C2Config::LEVEL_AV1_5,
+                                                     C2Config::LEVEL_AV1_5_1,
+                                                     C2Config::LEVEL_AV1_5_2,
+                                                     C2Config::LEVEL_AV1_5_3})})
+                        .withSetter(ProfileLevelSetter)
+                        .build());
+        break;
+    }
+
     addParameter(
             DefineParam(mInputFormat, C2_PARAMKEY_INPUT_STREAM_BUFFER_TYPE)
                     .withConstValue(new C2StreamBufferTypeSetting::input(0u, C2BufferData::LINEAR))
@@ -227,9 +407,68 @@ V4L2DecodeInterface::V4L2DecodeInterface(const std::string& name,
                          .withConstValue(
                                  new C2StreamBufferTypeSetting::output(0u, C2BufferData::GRAPHIC))
                          .build());
+    addParameter(DefineParam(mLowLatencyPreset, C2_PARAMKEY_V4L2_LOW_LATENCY_PRESET)
+                         .withDefault(new C2V4L2LowLatencyPresetTuning(C2_FALSE))
+                         .withFields({C2F(mLowLatencyPreset, value).oneOf({C2_FALSE, C2_TRUE})})
+                         .withSetter(Setter<decltype(*mLowLatencyPreset)>::StrictValueWithNoDeps)
+                         .build());
+    addParameter(DefineParam(mLowLatencyMode, C2_PARAMKEY_LOW_LATENCY_MODE)
+                         .withDefault(new C2GlobalLowLatencyModeTuning(C2_FALSE))
+                         .withFields({C2F(mLowLatencyMode, value).oneOf({C2_FALSE, C2_TRUE})})
+                         .withSetter(Setter<decltype(*mLowLatencyMode)>::StrictValueWithNoDeps)
+                         .build());
+    const ThreadPolicy threadPolicy = ThreadPolicy::getDefault(V4L2Device::Type::kDecoder);
+    addParameter(
+            DefineParam(mThreadPolicy, C2_PARAMKEY_V4L2_THREAD_POLICY)
+                    .withDefault(new C2V4L2ThreadPolicyTuning(
+                            static_cast<uint32_t>(threadPolicy.mPriority),
+                            static_cast<uint32_t>(threadPolicy.mCluster)))
+                    .withFields({C2F(mThreadPolicy, priority)
+                                         .inRange(0, static_cast<uint32_t>(
+                                                             ThreadPolicy::Priority::kRealtime)),
+                                 C2F(mThreadPolicy, cluster)
+                                         .inRange(0, static_cast<uint32_t>(
+                                                             ThreadPolicy::Cluster::kBig))})
+                    .withSetter(ThreadPolicySetter)
+                    .build());
+    addParameter(DefineParam(mRenderClock, C2_PARAMKEY_V4L2_RENDER_CLOCK)
+                         .withDefault(new C2V4L2RenderClockTuning())
+                         .withFields({C2F(mRenderClock, mediaTimeUs).any(),
+                                      C2F(mRenderClock, systemTimeNs).any()})
+                         .withSetter(RenderClockSetter)
+                         .build());
+    addParameter(DefineParam(mTrimMemory, C2_PARAMKEY_V4L2_TRIM_MEMORY)
+                         .withDefault(new C2V4L2TrimMemoryTuning(C2_FALSE))
+                         .withFields({C2F(mTrimMemory, value).oneOf({C2_FALSE, C2_TRUE})})
+                         .withSetter(Setter<decltype(*mTrimMemory)>::StrictValueWithNoDeps)
+                         .build());
     addParameter(
-            DefineParam(mOutputDelay, C2_PARAMKEY_OUTPUT_DELAY)
-                    .withConstValue(new C2PortDelayTuning::output(getOutputDelay(*mVideoCodec)))
+            DefineParam(mDownscaledOutputSize, C2_PARAMKEY_V4L2_DOWNSCALED_OUTPUT_SIZE)
+                    .withDefault(new C2V4L2DownscaledOutputSizeTuning(0u, 0u))
+                    .withFields({C2F(mDownscaledOutputSize, width).inRange(0, 4096),
+                                 C2F(mDownscaledOutputSize, height).inRange(0, 4096)})
+                    .withSetter(Setter<decltype(*mDownscaledOutputSize)>::StrictValueWithNoDeps)
+                    .build());
+    // The client can lower the output delay for streams which reorder fewer frames.
+    const uint32_t maxOutputDelay = getOutputDelay(*mVideoCodec);
+    addParameter(DefineParam(mOutputDelay, C2_PARAMKEY_OUTPUT_DELAY)
+                         .withDefault(new C2PortDelayTuning::output(maxOutputDelay))
+                         .withFields({C2F(mOutputDelay, value).inRange(0, maxOutputDelay)})
+                         .withSetter(OutputDelaySetter, mLowLatencyMode, mLowLatencyPreset)
+                         .build());
+    addParameter(
+            DefineParam(mInputPipelineDepth, C2_PARAMKEY_V4L2_INPUT_PIPELINE_DEPTH)
+                    .withDefault(new C2V4L2InputPipelineDepthTuning(kDefaultInputPipelineDepth))
+                    .withFields(
+                            {C2F(mInputPipelineDepth, value).inRange(2, kMaxInputPipelineDepth)})
+                    .withSetter(InputPipelineDepthSetter, mLowLatencyPreset)
+                    .build());
+    addParameter(
+            DefineParam(mOutputPipelineDepth, C2_PARAMKEY_V4L2_OUTPUT_PIPELINE_DEPTH)
+                    .withDefault(new C2V4L2OutputPipelineDepthTuning(kDefaultOutputPipelineDepth))
+                    .withFields(
+                            {C2F(mOutputPipelineDepth, value).inRange(1, kMaxOutputPipelineDepth)})
+                    .withSetter(OutputPipelineDepthSetter, mLowLatencyPreset)
                     .build());
 
     addParameter(DefineParam(mInputMediaType, C2_PARAMKEY_INPUT_MEDIA_TYPE)
@@ -242,6 +481,19 @@ V4L2DecodeInterface::V4L2DecodeInterface(const std::string& name,
                                  MEDIA_MIMETYPE_VIDEO_RAW))
                          .build());
 
+    // The pixel format of the output buffers, the flexible YUV 4:2:0 format unless the frames of a
+    // 10-bit stream are written as P010. Updated by the component when the format changes.
+    std::vector<uint32_t> pixelFormats = {static_cast<uint32_t>(HalPixelFormat::YCBCR_420_888)};
+    if (isDecode10BitOutputEnabled()) {
+        pixelFormats.push_back(static_cast<uint32_t>(HalPixelFormat::YCBCR_P010));
+    }
+    addParameter(DefineParam(mPixelFormat, C2_PARAMKEY_PIXEL_FORMAT)
+                         .withDefault(new C2StreamPixelFormatInfo::output(
+                                 0u, static_cast<uint32_t>(HalPixelFormat::YCBCR_420_888)))
+                         .withFields({C2F(mPixelFormat, value).oneOf(pixelFormats)})
+                         .withSetter(Setter<decltype(*mPixelFormat)>::StrictValueWithNoDeps)
+                         .build());
+
     // Note(b/165826281): The check is not used at Android framework currently.
     // In order to fasten the bootup time, we use the maximum supported size instead of querying the
     // capability from the V4L2 device.
@@ -254,13 +506,32 @@ V4L2DecodeInterface::V4L2DecodeInterface(const std::string& name,
                          .withSetter(SizeSetter)
                          .build());
 
+    // The client can announce the maximum size the stream may switch to (e.g. for adaptive
+    // playback), so output buffers are allocated large enough to avoid reallocating them on
+    // resolution changes.
+    addParameter(DefineParam(mMaxSize, C2_PARAMKEY_MAX_PICTURE_SIZE)
+                         .withDefault(new C2StreamMaxPictureSizeTuning::output(0u, 320, 240))
+                         .withFields({
+                                 C2F(mMaxSize, width).inRange(16, 4096, 16),
+                                 C2F(mMaxSize, height).inRange(16, 4096, 16),
+                         })
+                         .withSetter(MaxPictureSizeSetter, mSize)
+                         .build());
+
+    // Only used to estimate the load of the stream on the device.
+    addParameter(DefineParam(mFrameRate, C2_PARAMKEY_FRAME_RATE)
+                         .withDefault(new C2StreamFrameRateInfo::input(0u, kDefaultFrameRate))
+                         .withFields({C2F(mFrameRate, value).greaterThan(0.)})
+                         .withSetter(Setter<decltype(*mFrameRate)>::StrictValueWithNoDeps)
+                         .build());
+
     addParameter(
             DefineParam(mMaxInputSize, C2_PARAMKEY_INPUT_MAX_BUFFER_SIZE)
                     .withDefault(new C2StreamMaxBufferSizeInfo::input(0u, kInputBufferSizeFor1080p))
                     .withFields({
                             C2F(mMaxInputSize, value).any(),
                     })
-                    .calculatedAs(MaxInputBufferSizeCalculator, mSize)
+                    .calculatedAs(MaxInputBufferSizeCalculator, mSize, mProfileLevel)
                     .build());
 
     bool secureMode = name.find(".secure") != std::string::npos;
@@ -350,10 +621,117 @@ V4L2DecodeInterface::V4L2DecodeInterface(const std::string& name,
                                      .inRange(C2Color::MATRIX_UNSPECIFIED, C2Color::MATRIX_OTHER)})
                     .withSetter(MergedColorAspectsSetter, mDefaultColorAspects, mCodedColorAspects)
                     .build());
+
+    // Tunneled playback needs the vendor library to hand the frames over to the display, and
+    // isn't supported for the secure playback.
+    if (!secureMode) mTunnelLoader = VendorTunnelLoader::Create();
+    std::vector<uint32_t> tunneledModes = {C2PortTunneledModeTuning::Struct::NONE};
+    if (mTunnelLoader) tunneledModes.push_back(C2PortTunneledModeTuning::Struct::SIDEBAND);
+    addParameter(DefineParam(mTunneledMode, C2_PARAMKEY_TUNNELED_RENDER)
+                         .withDefault(C2PortTunneledModeTuning::output::AllocShared(
+                                 1, C2PortTunneledModeTuning::Struct::NONE,
+                                 C2PortTunneledModeTuning::Struct::REALTIME, 0))
+                         .withFields({C2F(mTunneledMode, m.mode).oneOf(tunneledModes),
+                                      C2F(mTunneledMode, m.syncType).any(),
+                                      C2F(mTunneledMode, m.syncId).any()})
+                         .withSetter(TunneledModeSetter)
+                         .build());
+    addParameter(
+            DefineParam(mTunnelHandle, C2_PARAMKEY_OUTPUT_TUNNEL_HANDLE)
+                    .withDefault(C2PortTunnelHandleTuning::output::AllocShared(0))
+                    .withFields({C2F(mTunnelHandle, m.values[0]).any(),
+                                 C2F(mTunnelHandle, m.values).any()})
+                    .withSetter(Setter<C2PortTunnelHandleTuning::output>::NonStrictValuesWithNoDeps)
+                    .build());
+}
+
+c2_status_t V4L2DecodeInterface::config(
+        const std::vector<C2Param*>& params, c2_blocking_t mayBlock,
+        std::vector<std::unique_ptr<C2SettingResult>>* const failures) {
+    c2_status_t status = C2InterfaceHelper::config(params, mayBlock, failures);
+    if (status != C2_OK) return status;
+
+    // The hint is handled each time it is set, rather than when its value changes.
+    const bool trimMemory = std::any_of(params.begin(), params.end(), [](const C2Param* param) {
+        return param->index() == C2V4L2TrimMemoryTuning::PARAM_TYPE &&
+               static_cast<const C2V4L2TrimMemoryTuning*>(param)->value;
+    });
+    if (trimMemory) {
+        std::lock_guard<std::mutex> lock(mTrimMemoryLock);
+        if (mTrimMemoryCb) mTrimMemoryCb();
+    }
+
+    return updateTunnel();
+}
+
+void V4L2DecodeInterface::setTrimMemoryCallback(std::function<void()> trimMemoryCb) {
+    std::lock_guard<std::mutex> lock(mTrimMemoryLock);
+    mTrimMemoryCb = std::move(trimMemoryCb);
+}
+
+std::shared_ptr<VendorTunnel> V4L2DecodeInterface::getTunnel() {
+    std::lock_guard<std::mutex> lock(mTunnelLock);
+    return mTunnel;
+}
+
+c2_status_t V4L2DecodeInterface::updateTunnel() {
+    std::lock_guard<std::mutex> lock(mTunnelLock);
+    if (mTunnel || !mTunnelLoader ||
+        mTunneledMode->m.mode != C2PortTunneledModeTuning::Struct::SIDEBAND) {
+        return C2_OK;
+    }
+
+    const int32_t syncId = mTunneledMode->flexCount() > 0 ? mTunneledMode->m.syncId[0] : 0;
+    std::unique_ptr<VendorTunnel> tunnel =
+            mTunnelLoader->createTunnel(mTunneledMode->m.syncType, syncId);
+    if (!tunnel) {
+        ALOGE("Failed to create the tunnel (syncType=%u, syncId=%d)", mTunneledMode->m.syncType,
+              syncId);
+        return C2_CORRUPTED;
+    }
+
+    // Only the ints of the handle can be passed to the client as a C2Param.
+    const native_handle_t* handle = tunnel->getSidebandHandle();
+    if (!handle || handle->numFds != 0) {
+        ALOGE("Invalid sideband handle of the tunnel");
+        return C2_CORRUPTED;
+    }
+    std::unique_ptr<C2PortTunnelHandleTuning::output> tunnelHandle =
+            C2PortTunnelHandleTuning::output::AllocUnique(handle->numInts);
+    memcpy(tunnelHandle->m.values, &handle->data[0], sizeof(int32_t) * handle->numInts);
+
+    std::vector<std::unique_ptr<C2SettingResult>> failures;
+    c2_status_t status =
+            C2InterfaceHelper::config({tunnelHandle.get()}, C2_MAY_BLOCK, &failures);
+    if (status != C2_OK) {
+        ALOGE("Failed to configure the tunnel handle: %d", status);
+        return status;
+    }
+
+    ALOGI("Created the tunnel (syncType=%u, syncId=%d)", mTunneledMode->m.syncType, syncId);
+    mTunnel = std::move(tunnel);
+    return C2_OK;
+}
+
+ui::Size V4L2DecodeInterface::getPictureSize() const {
+    return ui::Size(mSize->width, mSize->height);
+}
+
+ui::Size V4L2DecodeInterface::getMaxPictureSize() const {
+    return ui::Size(mMaxSize->width, mMaxSize->height);
+}
+
+ui::Size V4L2DecodeInterface::getDownscaledOutputSize() const {
+    return ui::Size(mDownscaledOutputSize->width, mDownscaledOutputSize->height);
+}
+
+ThreadPolicy V4L2DecodeInterface::getThreadPolicy() const {
+    return ThreadPolicy{static_cast<ThreadPolicy::Priority>(mThreadPolicy->priority),
+                        static_cast<ThreadPolicy::Cluster>(mThreadPolicy->cluster)};
 }
 
 size_t V4L2DecodeInterface::getInputBufferSize() const {
-    return calculateInputBufferSize(mSize->width * mSize->height);
+    return calculateInputBufferSize(mSize->width * mSize->height, mProfileLevel->level);
 }
 
 c2_status_t V4L2DecodeInterface::queryColorAspects(
@@ -369,6 +747,13 @@ c2_status_t V4L2DecodeInterface::queryColorAspects(
     return status;
 }
 
+// static
+bool V4L2DecodeInterface::isInputBufferSizeAdaptive() {
+    static const bool kAdaptive =
+            property_get_bool("ro.vendor.v4l2_codec2.decode_adaptive_input_buffer_size", false);
+    return kAdaptive;
+}
+
 uint32_t V4L2DecodeInterface::getOutputDelay(VideoCodec codec) {
     switch (codec) {
     case VideoCodec::H264:
@@ -383,6 +768,10 @@ uint32_t V4L2DecodeInterface::getOutputDelay(VideoCodec codec) {
         return 0;
     case VideoCodec::VP9:
         return 0;
+    case VideoCodec::AV1:
+        // A temporal unit carries a single shown frame, the frames it decodes without showing them
+        // are shown by the later ones with show_existing_frame.
+        return 0;
     }
 }
 
@@ -10,29 +10,34 @@
 #include <stdint.h>
 
 #include <algorithm>
+#include <cmath>
 #include <vector>
 
 #include <base/bind.h>
 #include <base/files/scoped_file.h>
 #include <base/memory/ptr_util.h>
+#include <cutils/properties.h>
 #include <log/log.h>
 
 #include <v4l2_codec2/common/Common.h>
 #include <v4l2_codec2/common/Fourcc.h>
+#include <v4l2_codec2/common/V4L2DevicePool.h>
+#include <v4l2_codec2/components/DecodeOutputFormat.h>
+#include <v4l2_codec2/components/PerformanceHintSession.h>
 
 namespace android {
 namespace {
 
-constexpr size_t kNumInputBuffers = 16;
 // Extra buffers for transmitting in the whole video pipeline.
 constexpr size_t kNumExtraOutputBuffers = 4;
 
-// Currently we only support flexible pixel 420 format YCBCR_420_888 in Android.
-// Here is the list of flexible 420 format.
-constexpr std::initializer_list<uint32_t> kSupportedOutputFourccs = {
-        Fourcc::YU12, Fourcc::YV12, Fourcc::YM12, Fourcc::YM21,
-        Fourcc::NV12, Fourcc::NV21, Fourcc::NM12, Fourcc::NM21,
-};
+// Define the display delay control codes if not present in header files.
+#ifndef V4L2_CID_MPEG_VIDEO_DEC_DISPLAY_DELAY
+#define V4L2_CID_MPEG_VIDEO_DEC_DISPLAY_DELAY (V4L2_CID_MPEG_BASE + 653)
+#endif
+#ifndef V4L2_CID_MPEG_VIDEO_DEC_DISPLAY_DELAY_ENABLE
+#define V4L2_CID_MPEG_VIDEO_DEC_DISPLAY_DELAY_ENABLE (V4L2_CID_MPEG_BASE + 654)
+#endif
 
 uint32_t VideoCodecToV4L2PixFmt(VideoCodec codec) {
     switch (codec) {
@@ -44,19 +49,31 @@ uint32_t VideoCodecToV4L2PixFmt(VideoCodec codec) {
         return V4L2_PIX_FMT_VP9;
     case VideoCodec::HEVC:
         return V4L2_PIX_FMT_HEVC;
+    case VideoCodec::AV1:
+        return V4L2_PIX_FMT_AV1;
     }
 }
 
+// Get the number of output frames fetched from the frame pool ahead of the V4L2 output queue
+// demand, 0 disables prefetching.
+size_t getOutputPrefetchCount() {
+    static const size_t kPrefetchCount = static_cast<size_t>(
+            std::max(property_get_int32("ro.vendor.v4l2_codec2.decode_prefetch_frames", 0), 0));
+    return kPrefetchCount;
+}
+
 }  // namespace
 
 // static
 std::unique_ptr<VideoDecoder> V4L2Decoder::Create(
-        const VideoCodec& codec, const size_t inputBufferSize, const size_t minNumOutputBuffers,
-        GetPoolCB getPoolCb, OutputCB outputCb, ErrorCB errorCb,
-        scoped_refptr<::base::SequencedTaskRunner> taskRunner) {
+        const VideoCodec& codec, const size_t inputBufferSize, const size_t numInputBuffers,
+        const size_t minNumOutputBuffers, const ui::Size& maxPictureSize,
+        const ui::Size& downscaledSize, const bool lowLatency, GetPoolCB getPoolCb,
+        OutputCB outputCb, ErrorCB errorCb, scoped_refptr<::base::SequencedTaskRunner> taskRunner) {
     std::unique_ptr<V4L2Decoder> decoder =
             ::base::WrapUnique<V4L2Decoder>(new V4L2Decoder(taskRunner));
-    if (!decoder->start(codec, inputBufferSize, minNumOutputBuffers, std::move(getPoolCb),
+    if (!decoder->start(codec, inputBufferSize, numInputBuffers, minNumOutputBuffers,
+                        maxPictureSize, downscaledSize, lowLatency, std::move(getPoolCb),
                         std::move(outputCb), std::move(errorCb))) {
         return nullptr;
     }
@@ -94,13 +111,20 @@ V4L2Decoder::~V4L2Decoder() {
 }
 
 bool V4L2Decoder::start(const VideoCodec& codec, const size_t inputBufferSize,
-                        const size_t minNumOutputBuffers, GetPoolCB getPoolCb, OutputCB outputCb,
+                        const size_t numInputBuffers, const size_t minNumOutputBuffers,
+                        const ui::Size& maxPictureSize, const ui::Size& downscaledSize,
+                        const bool lowLatency, GetPoolCB getPoolCb, OutputCB outputCb,
                         ErrorCB errorCb) {
-    ALOGV("%s(codec=%s, inputBufferSize=%zu, minNumOutputBuffers=%zu)", __func__,
-          VideoCodecToString(codec), inputBufferSize, minNumOutputBuffers);
+    ALOGV("%s(codec=%s, inputBufferSize=%zu, numInputBuffers=%zu, minNumOutputBuffers=%zu, "
+          "maxPictureSize=%s, downscaledSize=%s, lowLatency=%d)",
+          __func__, VideoCodecToString(codec), inputBufferSize, numInputBuffers,
+          minNumOutputBuffers, toString(maxPictureSize).c_str(), toString(downscaledSize).c_str(),
+          lowLatency);
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
 
     mMinNumOutputBuffers = minNumOutputBuffers;
+    mMaxPictureSize = maxPictureSize;
+    mDownscaledSize = downscaledSize;
     mGetPoolCb = std::move(getPoolCb);
     mOutputCb = std::move(outputCb);
     mErrorCb = std::move(errorCb);
@@ -110,10 +134,9 @@ bool V4L2Decoder::start(const VideoCodec& codec, const size_t inputBufferSize,
         return false;
     }
 
-    mDevice = V4L2Device::create();
-
     const uint32_t inputPixelFormat = VideoCodecToV4L2PixFmt(codec);
-    if (!mDevice->open(V4L2Device::Type::kDecoder, inputPixelFormat)) {
+    mDevice = V4L2DevicePool::get()->acquire(V4L2Device::Type::kDecoder, inputPixelFormat);
+    if (!mDevice) {
         ALOGE("Failed to open device for %s", VideoCodecToString(codec));
         return false;
     }
@@ -140,6 +163,9 @@ bool V4L2Decoder::start(const VideoCodec& codec, const size_t inputBufferSize,
         return false;
     }
 
+    // The display delay has to be set before the input queue is started.
+    if (lowLatency) setupLowLatencyMode();
+
     // Create Input/Output V4L2Queue, and setup input queue.
     mInputQueue = mDevice->getQueue(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
     mOutputQueue = mDevice->getQueue(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
@@ -147,13 +173,18 @@ bool V4L2Decoder::start(const VideoCodec& codec, const size_t inputBufferSize,
         ALOGE("Failed to create V4L2 queue.");
         return false;
     }
-    if (!setupInputFormat(inputPixelFormat, inputBufferSize)) {
+    if (!setupInputFormat(inputPixelFormat, inputBufferSize, numInputBuffers)) {
         ALOGE("Failed to setup input format.");
         return false;
     }
 
-    if (!mDevice->startPolling(::base::BindRepeating(&V4L2Decoder::serviceDeviceTask, mWeakThis),
-                               ::base::BindRepeating(&V4L2Decoder::onError, mWeakThis))) {
+    // Drivers implementing the stop and start decoder commands follow the stateful decoder
+    // interface closely enough to seek by only restarting the input queue.
+    mLightFlush = mDevice->isDecoderCommandSupported(V4L2_DEC_CMD_STOP) &&
+                  mDevice->isDecoderCommandSupported(V4L2_DEC_CMD_START);
+    ALOGV("Light flush is %s", mLightFlush ? "supported" : "not supported");
+
+    if (!startDevicePolling()) {
         ALOGE("Failed to start polling V4L2 device.");
         return false;
     }
@@ -162,7 +193,27 @@ bool V4L2Decoder::start(const VideoCodec& codec, const size_t inputBufferSize,
     return true;
 }
 
-bool V4L2Decoder::setupInputFormat(const uint32_t inputPixelFormat, const size_t inputBufferSize) {
+void V4L2Decoder::setupLowLatencyMode() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    // A display delay of 0 makes the device return each frame once decoded, without holding it
+    // back for reordering. Older drivers only implement the MFC specific controls.
+    if (mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG,
+                             {V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_DEC_DISPLAY_DELAY_ENABLE, 1),
+                              V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_DEC_DISPLAY_DELAY, 0)}) ||
+        mDevice->setExtCtrls(
+                V4L2_CTRL_CLASS_MPEG,
+                {V4L2ExtCtrl(V4L2_CID_MPEG_MFC51_VIDEO_DECODER_H264_DISPLAY_DELAY_ENABLE, 1),
+                 V4L2ExtCtrl(V4L2_CID_MPEG_MFC51_VIDEO_DECODER_H264_DISPLAY_DELAY, 0)})) {
+        ALOGI("Enabled low latency decoding");
+        return;
+    }
+    ALOGI("Device doesn't support setting the display delay, keep the default one");
+}
+
+bool V4L2Decoder::setupInputFormat(const uint32_t inputPixelFormat, const size_t inputBufferSize,
+                                   const size_t numInputBuffers) {
     ALOGV("%s(inputPixelFormat=%u, inputBufferSize=%zu)", __func__, inputPixelFormat,
           inputBufferSize);
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
@@ -183,10 +234,13 @@ bool V4L2Decoder::setupInputFormat(const uint32_t inputPixelFormat, const size_t
     }
     ALOG_ASSERT(format->fmt.pix_mp.pixelformat == inputPixelFormat);
 
-    if (mInputQueue->allocateBuffers(kNumInputBuffers, V4L2_MEMORY_DMABUF) == 0) {
+    const size_t adjustedNumInputBuffers =
+            mInputQueue->allocateBuffers(numInputBuffers, V4L2_MEMORY_DMABUF);
+    if (adjustedNumInputBuffers == 0) {
         ALOGE("Failed to allocate input buffer.");
         return false;
     }
+    mPendingDecodeCbs.resize(adjustedNumInputBuffers);
     if (!mInputQueue->streamon()) {
         ALOGE("Failed to streamon input queue.");
         return false;
@@ -287,8 +341,12 @@ void V4L2Decoder::pumpDecodeRequest() {
         mDecodeRequests.pop();
 
         const int32_t bitstreamId = request.buffer->id;
+        const size_t inputBufferId = inputBuffer->bufferId();
         ALOGV("QBUF to input queue, bitstreadId=%d", bitstreamId);
-        inputBuffer->setTimeStamp({.tv_sec = bitstreamId});
+        // The flush generation is carried to the output buffer, to detect frames decoded before
+        // a light flush.
+        inputBuffer->setTimeStamp(
+                {.tv_sec = bitstreamId, .tv_usec = static_cast<suseconds_t>(mFlushGeneration)});
         size_t planeSize = inputBuffer->getPlaneSize(0);
         if (request.buffer->size > planeSize) {
             ALOGE("The input size (%zu) is not enough, we need %zu", planeSize,
@@ -301,18 +359,27 @@ void V4L2Decoder::pumpDecodeRequest() {
               request.buffer->offset);
         inputBuffer->setPlaneDataOffset(0, request.buffer->offset);
         inputBuffer->setPlaneBytesUsed(0, request.buffer->offset + request.buffer->size);
-        std::vector<int> fds;
-        fds.push_back(std::move(request.buffer->dmabuf.handle()->data[0]));
-        if (!std::move(*inputBuffer).queueDMABuf(fds)) {
+        if (!std::move(*inputBuffer).queueDMABuf({request.buffer->dmabuf.handle()->data[0]})) {
             ALOGE("%s(): Failed to QBUF to input queue, bitstreamId=%d", __func__, bitstreamId);
             onError();
             return;
         }
 
-        mPendingDecodeCbs.insert(std::make_pair(bitstreamId, std::move(request.decodeCb)));
+        ALOG_ASSERT(inputBufferId < mPendingDecodeCbs.size());
+        mPendingDecodeCbs[inputBufferId] = {bitstreamId, std::move(request.decodeCb),
+                                            std::move(request.buffer)};
     }
 }
 
+size_t V4L2Decoder::getMemoryUsage() const {
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    size_t usage = 0;
+    if (mInputQueue) usage += mInputQueue->getMemoryUsage();
+    if (mOutputQueue) usage += mOutputQueue->getMemoryUsage();
+    return usage;
+}
+
 void V4L2Decoder::flush() {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
@@ -327,19 +394,29 @@ void V4L2Decoder::flush() {
     }
 
     // Call all pending callbacks.
-    for (auto& item : mPendingDecodeCbs) {
-        std::move(item.second).Run(VideoDecoder::DecodeStatus::kAborted);
+    for (PendingDecode& pendingDecode : mPendingDecodeCbs) {
+        if (pendingDecode.mDecodeCb) {
+            std::move(pendingDecode.mDecodeCb).Run(VideoDecoder::DecodeStatus::kAborted);
+        }
+        pendingDecode.mBuffer.reset();
     }
-    mPendingDecodeCbs.clear();
+    // An aborted drain might leave the output queue stopped on its last buffer, which is only
+    // reset by restarting the output queue.
+    const bool lightFlush = mLightFlush && !mDrainCb;
     if (mDrainCb) {
         std::move(mDrainCb).Run(VideoDecoder::DecodeStatus::kAborted);
     }
 
+    if (lightFlush) {
+        flushInputQueue();
+        return;
+    }
+
     // Streamoff both V4L2 queues to drop input and output buffers.
     const bool isOutputStreaming = mOutputQueue->isStreaming();
     mDevice->stopPolling();
     mOutputQueue->streamoff();
-    mFrameAtDevice.clear();
+    for (auto& frame : mFrameAtDevice) frame.reset();
     mInputQueue->streamoff();
 
     // Streamon both V4L2 queues.
@@ -355,8 +432,7 @@ void V4L2Decoder::flush() {
         tryFetchVideoFrame();
     }
 
-    if (!mDevice->startPolling(::base::BindRepeating(&V4L2Decoder::serviceDeviceTask, mWeakThis),
-                               ::base::BindRepeating(&V4L2Decoder::onError, mWeakThis))) {
+    if (!startDevicePolling()) {
         ALOGE("Failed to start polling V4L2 device.");
         onError();
         return;
@@ -365,9 +441,92 @@ void V4L2Decoder::flush() {
     setState(State::Idle);
 }
 
+void V4L2Decoder::prepareOutputBuffers(const ui::Size& codedSize, size_t maxDpbFrames) {
+    ALOGV("%s(codedSize=%s, maxDpbFrames=%zu)", __func__, toString(codedSize).c_str(),
+          maxDpbFrames);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    // Only the first output format is prepared, the later ones are announced by the device.
+    // The scale of the downscaled frames is only known once the device set the output format.
+    if (mState == State::Error || mVideoFramePool || mOutputQueue->allocatedBuffersCount() > 0 ||
+        isEmpty(codedSize) || !isEmpty(mDownscaledSize)) {
+        return;
+    }
+
+    ui::Size allocationSize = codedSize;
+    if (codedSize.width <= mMaxPictureSize.width && codedSize.height <= mMaxPictureSize.height) {
+        allocationSize = mMaxPictureSize;
+    }
+    // The format isn't set, the device might not accept it before parsing the stream.
+    const auto format = tryDecodeOutputFormat(mDevice.get(), mOutputQueue.get(), allocationSize,
+                                              !mCompressedOutputRejected);
+    if (!format || isEmpty(format->second)) {
+        ALOGV("Failed to try the output format, waiting for the device");
+        return;
+    }
+
+    // The DPB frames, plus the one being decoded. Fewer buffers than the device asks for would
+    // have to be reallocated, so the estimate errs towards more buffers.
+    const size_t numBuffers = std::max(maxDpbFrames + 1, mMinNumOutputBuffers);
+    mVideoFramePool = mGetPoolCb.Run(format->second, format->first.halFormat, format->first.usage,
+                                     numBuffers);
+    if (!mVideoFramePool) {
+        ALOGV("Failed to get the frame pool, waiting for the device");
+        return;
+    }
+    ALOGI("Prepared %zu output buffers. coded size: %s", numBuffers,
+          toString(format->second).c_str());
+    mCodedSize = format->second;
+    mOutputPixelFormat = format->first.v4l2PixFmt;
+    mOutputFormat = format->first;
+    mNumPreparedOutputBuffers = numBuffers;
+    mFrameAtDevice.resize(numBuffers);
+    // Allocate all the graphic buffers in the background while the device parses the stream.
+    mVideoFramePool->setPrefetchCount(numBuffers);
+}
+
+void V4L2Decoder::flushInputQueue() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    // Restarting the input queue drops the pending input buffers and makes the device seek to the
+    // next queued buffer. The output queue keeps streaming with its buffers allocated and queued,
+    // and polling is not stopped: callbacks polled before the flush run on this sequence and find
+    // nothing to dequeue on the input queue. Frames decoded from the dropped input buffers might
+    // still be dequeued from the output queue, these are recognized by their flush generation.
+    mFlushGeneration = (mFlushGeneration + 1) % kMaxFlushGeneration;
+    if (!mInputQueue->streamoff() || !mInputQueue->streamon()) {
+        ALOGE("Failed to restart the input queue.");
+        onError();
+        return;
+    }
+
+    setState(State::Idle);
+}
+
+bool V4L2Decoder::startDevicePolling() {
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (V4L2DevicePoller::isBatchedPollingEnabled()) {
+        return mDevice->startPolling(
+                ::base::BindRepeating(&V4L2Decoder::serviceDeviceReadiness, mWeakThis),
+                ::base::BindRepeating(&V4L2Decoder::onError, mWeakThis));
+    }
+    return mDevice->startPolling(::base::BindRepeating(&V4L2Decoder::serviceDeviceTask, mWeakThis),
+                                 ::base::BindRepeating(&V4L2Decoder::onError, mWeakThis));
+}
+
 void V4L2Decoder::serviceDeviceTask(bool event) {
-    ALOGV("%s(event=%d) state=%s InputQueue(%s):%zu+%zu/%zu, OutputQueue(%s):%zu+%zu/%zu", __func__,
-          event, StateToString(mState), (mInputQueue->isStreaming() ? "streamon" : "streamoff"),
+    serviceDeviceReadiness(V4L2DevicePoller::kInputReady | V4L2DevicePoller::kOutputReady |
+                           (event ? V4L2DevicePoller::kEventPending : 0u));
+}
+
+bool V4L2Decoder::serviceDeviceReadiness(uint32_t readiness) {
+    PerformanceHintSession::ScopedWork hintWork;
+    const bool event = readiness & V4L2DevicePoller::kEventPending;
+    ALOGV("%s(readiness=0x%x) state=%s InputQueue(%s):%zu+%zu/%zu, OutputQueue(%s):%zu+%zu/%zu",
+          __func__, readiness, StateToString(mState),
+          (mInputQueue->isStreaming() ? "streamon" : "streamoff"),
           mInputQueue->freeBuffersCount(), mInputQueue->queuedBuffersCount(),
           mInputQueue->allocatedBuffersCount(),
           (mOutputQueue->isStreaming() ? "streamon" : "streamoff"),
@@ -375,18 +534,18 @@ void V4L2Decoder::serviceDeviceTask(bool event) {
           mOutputQueue->allocatedBuffersCount());
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
 
-    if (mState == State::Error) return;
+    if (mState == State::Error) return false;
 
-    // Dequeue output and input queue.
+    // Dequeue output and input queue. Queues which were not reported ready are skipped.
     bool inputDequeued = false;
-    while (mInputQueue->queuedBuffersCount() > 0) {
+    while ((readiness & V4L2DevicePoller::kInputReady) && mInputQueue->queuedBuffersCount() > 0) {
         bool success;
         V4L2ReadableBufferRef dequeuedBuffer;
         std::tie(success, dequeuedBuffer) = mInputQueue->dequeueBuffer();
         if (!success) {
             ALOGE("Failed to dequeue buffer from input queue.");
             onError();
-            return;
+            return false;
         }
         if (!dequeuedBuffer) break;
 
@@ -395,24 +554,25 @@ void V4L2Decoder::serviceDeviceTask(bool event) {
         // Run the corresponding decode callback.
         int32_t id = dequeuedBuffer->getTimeStamp().tv_sec;
         ALOGV("DQBUF from input queue, bitstreamId=%d", id);
-        auto it = mPendingDecodeCbs.find(id);
-        if (it == mPendingDecodeCbs.end()) {
+        ALOG_ASSERT(dequeuedBuffer->bufferId() < mPendingDecodeCbs.size());
+        PendingDecode& pendingDecode = mPendingDecodeCbs[dequeuedBuffer->bufferId()];
+        if (!pendingDecode.mDecodeCb || pendingDecode.mBitstreamId != id) {
             ALOGW("Callback is already abandoned.");
             continue;
         }
-        std::move(it->second).Run(VideoDecoder::DecodeStatus::kOk);
-        mPendingDecodeCbs.erase(it);
+        pendingDecode.mBuffer.reset();
+        std::move(pendingDecode.mDecodeCb).Run(VideoDecoder::DecodeStatus::kOk);
     }
 
     bool outputDequeued = false;
-    while (mOutputQueue->queuedBuffersCount() > 0) {
+    while ((readiness & V4L2DevicePoller::kOutputReady) && mOutputQueue->queuedBuffersCount() > 0) {
         bool success;
         V4L2ReadableBufferRef dequeuedBuffer;
         std::tie(success, dequeuedBuffer) = mOutputQueue->dequeueBuffer();
         if (!success) {
             ALOGE("Failed to dequeue buffer from output queue.");
             onError();
-            return;
+            return false;
         }
         if (!dequeuedBuffer) break;
 
@@ -426,13 +586,15 @@ void V4L2Decoder::serviceDeviceTask(bool event) {
               bufferId, bitstreamId, bytesUsed, isLast);
 
         // Get the corresponding VideoFrame of the dequeued buffer.
-        auto it = mFrameAtDevice.find(bufferId);
-        ALOG_ASSERT(it != mFrameAtDevice.end(), "buffer %zu is not found at mFrameAtDevice",
-                    bufferId);
-        auto frame = std::move(it->second);
-        mFrameAtDevice.erase(it);
-
-        if (bytesUsed > 0) {
+        ALOG_ASSERT(bufferId < mFrameAtDevice.size() && mFrameAtDevice[bufferId],
+                    "buffer %zu is not found at mFrameAtDevice", bufferId);
+        auto frame = std::move(mFrameAtDevice[bufferId]);
+
+        // Frames decoded before a light flush are dropped, the client already abandoned them.
+        const uint32_t flushGeneration =
+                static_cast<uint32_t>(dequeuedBuffer->getTimeStamp().tv_usec);
+        const bool isStale = mLightFlush && flushGeneration != mFlushGeneration;
+        if (bytesUsed > 0 && !isStale) {
             ALOGV("Send output frame(bitstreamId=%d) to client", bitstreamId);
             frame->setBitstreamId(bitstreamId);
             frame->setVisibleRect(mVisibleRect);
@@ -440,7 +602,9 @@ void V4L2Decoder::serviceDeviceTask(bool event) {
         } else {
             // Workaround(b/168750131): If the buffer is not enqueued before the next drain is done,
             // then the driver will fail to notify EOS. So we recycle the buffer immediately.
-            ALOGV("Recycle empty buffer %zu back to V4L2 output queue.", bufferId);
+            // Stale frames are recycled the same way.
+            ALOGV("Recycle %s buffer %zu back to V4L2 output queue.", isStale ? "stale" : "empty",
+                  bufferId);
             dequeuedBuffer.reset();
             auto outputBuffer = mOutputQueue->getFreeBuffer(bufferId);
             ALOG_ASSERT(outputBuffer, "V4L2 output queue slot %zu is not freed.", bufferId);
@@ -448,9 +612,9 @@ void V4L2Decoder::serviceDeviceTask(bool event) {
             if (!std::move(*outputBuffer).queueDMABuf(frame->getFDs())) {
                 ALOGE("%s(): Failed to recycle empty buffer to output queue.", __func__);
                 onError();
-                return;
+                return false;
             }
-            mFrameAtDevice.insert(std::make_pair(bufferId, std::move(frame)));
+            mFrameAtDevice[bufferId] = std::move(frame);
         }
 
         if (mDrainCb && isLast) {
@@ -465,7 +629,7 @@ void V4L2Decoder::serviceDeviceTask(bool event) {
     if (event && dequeueResolutionChangeEvent()) {
         if (!changeResolution()) {
             onError();
-            return;
+            return false;
         }
     }
 
@@ -479,6 +643,8 @@ void V4L2Decoder::serviceDeviceTask(bool event) {
         mTaskRunner->PostTask(FROM_HERE,
                               ::base::BindOnce(&V4L2Decoder::tryFetchVideoFrame, mWeakThis));
     }
+
+    return inputDequeued || outputDequeued || event;
 }
 
 bool V4L2Decoder::dequeueResolutionChangeEvent() {
@@ -506,9 +672,44 @@ bool V4L2Decoder::changeResolution() {
         return false;
     }
     *numOutputBuffers = std::max(*numOutputBuffers, mMinNumOutputBuffers);
-
     const ui::Size codedSize(format->fmt.pix_mp.width, format->fmt.pix_mp.height);
-    if (!setupOutputFormat(codedSize)) {
+
+    // The output buffers must be released before the output format can be changed. The frames at
+    // the device are returned to the frame pool, but the V4L2 buffer of each block is kept. The
+    // frame pool prepared from the stream headers is reused the same way.
+    const size_t numAllocatedBuffers =
+            std::max(mOutputQueue->allocatedBuffersCount(), mNumPreparedOutputBuffers);
+    const bool isPrepared = mNumPreparedOutputBuffers > 0;
+    mNumPreparedOutputBuffers = 0;
+    mOutputQueue->streamoff();
+    mOutputQueue->deallocateBuffers();
+    for (auto& frame : mFrameAtDevice) frame.reset();
+
+    // If the new stream fits in the current buffers, we don't need a new frame pool. This avoids
+    // reallocating all the graphic buffers on each switch of adaptive streaming. The downscaled
+    // buffers are sized for each stream, so they are always reallocated.
+    if (isEmpty(mDownscaledSize) && mVideoFramePool && codedSize.width <= mCodedSize.width &&
+        codedSize.height <= mCodedSize.height && *numOutputBuffers <= numAllocatedBuffers) {
+        if (reuseOutputBuffers(codedSize, numAllocatedBuffers)) {
+            if (isPrepared) {
+                mVideoFramePool->setPrefetchCount(
+                        std::min(getOutputPrefetchCount(), numAllocatedBuffers));
+            }
+            return true;
+        }
+        ALOGV("Failed to reuse the output buffers, reallocating them");
+    }
+    mFrameAtDevice.clear();
+    mBlockIdToV4L2Id.clear();
+
+    // Allocate the buffers at the maximum picture size requested by the client if the stream fits
+    // in it, so later resolution changes within this size can reuse them.
+    ui::Size allocationSize = codedSize;
+    if (codedSize.width <= mMaxPictureSize.width && codedSize.height <= mMaxPictureSize.height) {
+        allocationSize = mMaxPictureSize;
+    }
+    const std::optional<Rect> downscaledRect = setupDownscaledOutputFormat(codedSize);
+    if (!downscaledRect && !setupOutputFormat(allocationSize)) {
         return false;
     }
 
@@ -517,7 +718,13 @@ bool V4L2Decoder::changeResolution() {
         return false;
     }
     mCodedSize.set(adjustedFormat->fmt.pix_mp.width, adjustedFormat->fmt.pix_mp.height);
-    mVisibleRect = getVisibleRect(mCodedSize);
+    mOutputPixelFormat = adjustedFormat->fmt.pix_mp.pixelformat;
+    // The visible rectangle must lie within the stream, not the padding of larger buffers.
+    if (downscaledRect) {
+        mVisibleRect = *downscaledRect;
+    } else {
+        mVisibleRect = getVisibleRect(allocationSize == codedSize ? mCodedSize : codedSize);
+    }
 
     ALOGI("Need %zu output buffers. coded size: %s, visible rect: %s", *numOutputBuffers,
           toString(mCodedSize).c_str(), toString(mVisibleRect).c_str());
@@ -526,11 +733,6 @@ bool V4L2Decoder::changeResolution() {
         return false;
     }
 
-    mOutputQueue->streamoff();
-    mOutputQueue->deallocateBuffers();
-    mFrameAtDevice.clear();
-    mBlockIdToV4L2Id.clear();
-
     const size_t adjustedNumOutputBuffers =
             mOutputQueue->allocateBuffers(*numOutputBuffers, V4L2_MEMORY_DMABUF);
     if (adjustedNumOutputBuffers == 0) {
@@ -538,6 +740,8 @@ bool V4L2Decoder::changeResolution() {
         return false;
     }
     ALOGV("Allocated %zu output buffers.", adjustedNumOutputBuffers);
+    mFrameAtDevice.resize(adjustedNumOutputBuffers);
+    mBlockIdToV4L2Id.reserve(adjustedNumOutputBuffers);
     if (!mOutputQueue->streamon()) {
         ALOGE("Failed to streamon output queue.");
         return false;
@@ -546,34 +750,139 @@ bool V4L2Decoder::changeResolution() {
     // Release the previous VideoFramePool before getting a new one to guarantee only one pool
     // exists at the same time.
     mVideoFramePool.reset();
-    // Always use flexible pixel 420 format YCBCR_420_888 in Android.
-    mVideoFramePool =
-            mGetPoolCb.Run(mCodedSize, HalPixelFormat::YCBCR_420_888, adjustedNumOutputBuffers);
+    mVideoFramePool = mGetPoolCb.Run(mCodedSize, mOutputFormat.halFormat, mOutputFormat.usage,
+                                     adjustedNumOutputBuffers);
+    if (!mVideoFramePool && !mOutputFormat.isLinear()) {
+        // The consumer can't take compressed or tiled buffers, decode to a linear format instead.
+        ALOGW("Failed to get block pool for %s output, falling back to linear output",
+              fourccToString(mOutputFormat.v4l2PixFmt).c_str());
+        mCompressedOutputRejected = true;
+        return changeResolution();
+    }
     if (!mVideoFramePool) {
         ALOGE("Failed to get block pool with size: %s", toString(mCodedSize).c_str());
         return false;
     }
+    mVideoFramePool->setPrefetchCount(
+            std::min(getOutputPrefetchCount(), adjustedNumOutputBuffers));
+
+    tryFetchVideoFrame();
+    return true;
+}
+
+bool V4L2Decoder::reuseOutputBuffers(const ui::Size& codedSize, size_t numBuffers) {
+    ALOGV("%s(codedSize=%s, numBuffers=%zu)", __func__, toString(codedSize).c_str(), numBuffers);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    // The device must write frames with the layout of the existing buffers, so the output format
+    // is set to the allocated size rather than the stream's coded size.
+    if (!setupOutputFormat(mCodedSize)) {
+        return false;
+    }
+    const std::optional<struct v4l2_format> adjustedFormat = getFormatInfo();
+    if (!adjustedFormat ||
+        ui::Size(adjustedFormat->fmt.pix_mp.width, adjustedFormat->fmt.pix_mp.height) !=
+                mCodedSize ||
+        adjustedFormat->fmt.pix_mp.pixelformat != mOutputPixelFormat) {
+        ALOGV("Output format doesn't match the allocated buffers");
+        return false;
+    }
+
+    // Allocating DMABUF V4L2 buffers is cheap, the graphic buffers are kept in the frame pool.
+    // The same number of buffers is allocated so each block keeps its V4L2 buffer id.
+    if (mOutputQueue->allocateBuffers(numBuffers, V4L2_MEMORY_DMABUF) != numBuffers) {
+        ALOGE("Failed to allocate output buffers.");
+        mOutputQueue->deallocateBuffers();
+        return false;
+    }
+    if (!mOutputQueue->streamon()) {
+        ALOGE("Failed to streamon output queue.");
+        return false;
+    }
+
+    mVisibleRect = getVisibleRect(codedSize);
+    ALOGI("Reused %zu output buffers. coded size: %s, stream coded size: %s, visible rect: %s",
+          numBuffers, toString(mCodedSize).c_str(), toString(codedSize).c_str(),
+          toString(mVisibleRect).c_str());
 
     tryFetchVideoFrame();
     return true;
 }
 
 bool V4L2Decoder::setupOutputFormat(const ui::Size& size) {
-    for (const uint32_t& pixfmt :
-         mDevice->enumerateSupportedPixelformats(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)) {
-        if (std::find(kSupportedOutputFourccs.begin(), kSupportedOutputFourccs.end(), pixfmt) ==
-            kSupportedOutputFourccs.end()) {
-            ALOGD("Pixel format %s is not supported, skipping...", fourccToString(pixfmt).c_str());
-            continue;
-        }
+    const std::optional<DecodeOutputFormat> format = setupDecodeOutputFormat(
+            mDevice.get(), mOutputQueue.get(), size, !mCompressedOutputRejected);
+    if (!format) {
+        ALOGE("Failed to find supported pixel format");
+        return false;
+    }
 
-        if (mOutputQueue->setFormat(pixfmt, size, 0) != std::nullopt) {
-            return true;
-        }
+    mOutputFormat = *format;
+    return true;
+}
+
+std::optional<Rect> V4L2Decoder::setupDownscaledOutputFormat(const ui::Size& codedSize) {
+    ALOGV("%s(codedSize=%s)", __func__, toString(codedSize).c_str());
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (isEmpty(mDownscaledSize)) return std::nullopt;
+
+    // Fit the visible rectangle of the stream in the requested size, keeping its aspect ratio.
+    const Rect visibleRect = getVisibleRect(codedSize);
+    const float scale =
+            std::min(static_cast<float>(mDownscaledSize.width) / visibleRect.width(),
+                     static_cast<float>(mDownscaledSize.height) / visibleRect.height());
+    if (scale >= 1.0f) return std::nullopt;
+    // The sizes are kept even for the subsampled chroma planes.
+    const auto scaleLength = [scale](int32_t length) {
+        return std::max(static_cast<int32_t>(std::ceil(length * scale / 2)) * 2, 2);
+    };
+    if (!setupOutputFormat(ui::Size(scaleLength(codedSize.width), scaleLength(codedSize.height)))) {
+        return std::nullopt;
     }
 
-    ALOGE("Failed to find supported pixel format");
-    return false;
+    // The devices without a scaler keep the coded size of the stream.
+    const std::optional<struct v4l2_format> format = getFormatInfo();
+    if (!format) return std::nullopt;
+    const ui::Size scaledSize(format->fmt.pix_mp.width, format->fmt.pix_mp.height);
+    if (isEmpty(scaledSize) || scaledSize.width > codedSize.width ||
+        scaledSize.height > codedSize.height || scaledSize == codedSize) {
+        ALOGI("Device doesn't scale the output down to %s, outputting the coded size",
+              toString(mDownscaledSize).c_str());
+        return std::nullopt;
+    }
+
+    // Compose the visible rectangle into its scaled position. The devices which don't support
+    // setting the compose rectangle scale the whole coded frame to the output format, which puts
+    // it in the same position.
+    const float scaleX = static_cast<float>(scaledSize.width) / codedSize.width;
+    const float scaleY = static_cast<float>(scaledSize.height) / codedSize.height;
+    Rect rect(static_cast<int32_t>(visibleRect.left * scaleX),
+              static_cast<int32_t>(visibleRect.top * scaleY),
+              static_cast<int32_t>(std::ceil(visibleRect.right * scaleX)),
+              static_cast<int32_t>(std::ceil(visibleRect.bottom * scaleY)));
+    struct v4l2_selection selection_arg;
+    memset(&selection_arg, 0, sizeof(selection_arg));
+    selection_arg.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    selection_arg.target = V4L2_SEL_TGT_COMPOSE;
+    selection_arg.r.left = rect.left;
+    selection_arg.r.top = rect.top;
+    selection_arg.r.width = rect.width();
+    selection_arg.r.height = rect.height();
+    if (mDevice->ioctl(VIDIOC_S_SELECTION, &selection_arg) == 0) {
+        rect = Rect(selection_arg.r.left, selection_arg.r.top,
+                    selection_arg.r.left + selection_arg.r.width,
+                    selection_arg.r.top + selection_arg.r.height);
+    } else {
+        ALOGV("VIDIOC_S_SELECTION is not supported, scaling the whole coded frame");
+    }
+    if (rect.isEmpty() || !contains(Rect(scaledSize.width, scaledSize.height), rect)) {
+        rect = Rect(scaledSize.width, scaledSize.height);
+    }
+
+    ALOGI("Scaling the output down from %s to %s, visible rect: %s", toString(codedSize).c_str(),
+          toString(scaledSize).c_str(), toString(rect).c_str());
+    return rect;
 }
 
 void V4L2Decoder::tryFetchVideoFrame() {
@@ -586,6 +895,17 @@ void V4L2Decoder::tryFetchVideoFrame() {
         return;
     }
 
+    // Refill the free V4L2 output buffers in a burst with the frames fetched ahead of time.
+    while (mOutputQueue->freeBuffersCount() > 0) {
+        std::optional<VideoFramePool::FrameWithBlockId> frameWithBlockId =
+                mVideoFramePool->takePrefetchedFrame();
+        if (!frameWithBlockId) break;
+        if (!queueOutputFrame(std::move(frameWithBlockId->first), frameWithBlockId->second)) {
+            onError();
+            return;
+        }
+    }
+
     if (mOutputQueue->freeBuffersCount() == 0) {
         ALOGV("No free V4L2 output buffers, ignore.");
         return;
@@ -613,18 +933,30 @@ void V4L2Decoder::onVideoFrameReady(
     uint32_t blockId;
     std::tie(frame, blockId) = std::move(*frameWithBlockId);
 
+    if (!queueOutputFrame(std::move(frame), blockId)) {
+        onError();
+        return;
+    }
+
+    tryFetchVideoFrame();
+}
+
+bool V4L2Decoder::queueOutputFrame(std::unique_ptr<VideoFrame> frame, uint32_t blockId) {
+    ALOGV("%s(blockId=%u)", __func__, blockId);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
     std::optional<V4L2WritableBufferRef> outputBuffer;
     // Find the V4L2 buffer that is associated with this block.
-    auto iter = mBlockIdToV4L2Id.find(blockId);
-    if (iter != mBlockIdToV4L2Id.end()) {
+    const size_t* v4l2BufferId = mBlockIdToV4L2Id.find(blockId);
+    if (v4l2BufferId) {
         // If we have met this block in the past, reuse the same V4L2 buffer.
-        outputBuffer = mOutputQueue->getFreeBuffer(iter->second);
+        outputBuffer = mOutputQueue->getFreeBuffer(*v4l2BufferId);
     } else if (mBlockIdToV4L2Id.size() < mOutputQueue->allocatedBuffersCount()) {
         // If this is the first time we see this block, give it the next
         // available V4L2 buffer.
-        const size_t v4l2BufferId = mBlockIdToV4L2Id.size();
-        mBlockIdToV4L2Id.emplace(blockId, v4l2BufferId);
-        outputBuffer = mOutputQueue->getFreeBuffer(v4l2BufferId);
+        const size_t newV4L2BufferId = mBlockIdToV4L2Id.size();
+        mBlockIdToV4L2Id.insert(blockId, newV4L2BufferId);
+        outputBuffer = mOutputQueue->getFreeBuffer(newV4L2BufferId);
     } else {
         // If this happens, this is a bug in VideoFramePool. It should never
         // provide more blocks than we have V4L2 buffers.
@@ -633,8 +965,7 @@ void V4L2Decoder::onVideoFrameReady(
 
     if (!outputBuffer) {
         ALOGE("V4L2 buffer not available. blockId=%u", blockId);
-        onError();
-        return;
+        return false;
     }
 
     uint32_t v4l2Id = outputBuffer->bufferId();
@@ -643,17 +974,14 @@ void V4L2Decoder::onVideoFrameReady(
     if (!std::move(*outputBuffer).queueDMABuf(frame->getFDs())) {
         ALOGE("%s(): Failed to QBUF to output queue, blockId=%u, V4L2Id=%u", __func__, blockId,
               v4l2Id);
-        onError();
-        return;
+        return false;
     }
-    if (mFrameAtDevice.find(v4l2Id) != mFrameAtDevice.end()) {
+    if (v4l2Id >= mFrameAtDevice.size() || mFrameAtDevice[v4l2Id]) {
         ALOGE("%s(): V4L2 buffer %d already enqueued.", __func__, v4l2Id);
-        onError();
-        return;
+        return false;
     }
-    mFrameAtDevice.insert(std::make_pair(v4l2Id, std::move(frame)));
-
-    tryFetchVideoFrame();
+    mFrameAtDevice[v4l2Id] = std::move(frame);
+    return true;
 }
 
 std::optional<size_t> V4L2Decoder::getNumOutputBuffers() {
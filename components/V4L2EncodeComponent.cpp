@@ -4,6 +4,7 @@
 
 //#define LOG_NDEBUG 0
 #define LOG_TAG "V4L2EncodeComponent"
+#define ATRACE_TAG ATRACE_TAG_VIDEO
 
 #include <v4l2_codec2/components/V4L2EncodeComponent.h>
 
@@ -23,14 +24,21 @@
 #include <media/stagefright/MediaDefs.h>
 #include <ui/GraphicBuffer.h>
 #include <ui/Size.h>
+#include <utils/Trace.h>
 
 #include <v4l2_codec2/common/Common.h>
 #include <v4l2_codec2/common/EncodeHelpers.h>
 #include <v4l2_codec2/common/FormatConverter.h>
+#include <v4l2_codec2/common/V4L2ResourceManager.h>
 #include <v4l2_codec2/common/VideoPixelFormat.h>
 #include <v4l2_codec2/components/BitstreamBuffer.h>
+#include <v4l2_codec2/components/ComponentStats.h>
+#include <v4l2_codec2/components/PerformanceHintSession.h>
 #include <v4l2_codec2/components/V4L2EncodeInterface.h>
 #include <v4l2_codec2/components/V4L2Encoder.h>
+#include <v4l2_codec2/components/WorkDoneBatcher.h>
+#include <v4l2_codec2/components/WorkReporter.h>
+#include <v4l2_codec2/plugin_store/DmabufHelpers.h>
 
 using android::hardware::graphics::common::V1_0::BufferUsage;
 
@@ -43,95 +51,13 @@ const VideoPixelFormat kInputPixelFormat = VideoPixelFormat::NV12;
 // The peak bitrate in function of the target bitrate, used when the bitrate mode is VBR.
 constexpr uint32_t kPeakBitrateMultiplier = 2u;
 
-// Get the video frame layout from the specified |inputBlock|.
-// TODO(dstaessens): Clean up code extracting layout from a C2GraphicBlock.
-std::optional<std::vector<VideoFramePlane>> getVideoFrameLayout(const C2ConstGraphicBlock& block,
-                                                                VideoPixelFormat* format) {
-    ALOGV("%s()", __func__);
-
-    // Get the C2PlanarLayout from the graphics block. The C2GraphicView returned by block.map()
-    // needs to be released before calling getGraphicBlockInfo(), or the lockYCbCr() call will block
-    // Indefinitely.
-    C2PlanarLayout layout = block.map().get().layout();
-
-    // The above layout() cannot fill layout information and memset 0 instead if the input format is
-    // IMPLEMENTATION_DEFINED and its backed format is RGB. We fill the layout by using
-    // ImplDefinedToRGBXMap in the case.
-    if (layout.type == C2PlanarLayout::TYPE_UNKNOWN) {
-        std::unique_ptr<ImplDefinedToRGBXMap> idMap = ImplDefinedToRGBXMap::Create(block);
-        if (idMap == nullptr) {
-            ALOGE("Unable to parse RGBX_8888 from IMPLEMENTATION_DEFINED");
-            return std::nullopt;
-        }
-        layout.type = C2PlanarLayout::TYPE_RGB;
-        // These parameters would be used in TYPE_GRB case below.
-        layout.numPlanes = 3;   // same value as in C2AllocationGralloc::map()
-        layout.rootPlanes = 1;  // same value as in C2AllocationGralloc::map()
-        layout.planes[C2PlanarLayout::PLANE_R].offset = idMap->offset();
-        layout.planes[C2PlanarLayout::PLANE_R].rowInc = idMap->rowInc();
-    }
-
-    std::vector<uint32_t> offsets(layout.numPlanes, 0u);
-    std::vector<uint32_t> strides(layout.numPlanes, 0u);
-    switch (layout.type) {
-    case C2PlanarLayout::TYPE_YUV: {
-        android_ycbcr ycbcr = getGraphicBlockInfo(block);
-        offsets[C2PlanarLayout::PLANE_Y] =
-                static_cast<uint32_t>(reinterpret_cast<uintptr_t>(ycbcr.y));
-        offsets[C2PlanarLayout::PLANE_U] =
-                static_cast<uint32_t>(reinterpret_cast<uintptr_t>(ycbcr.cb));
-        offsets[C2PlanarLayout::PLANE_V] =
-                static_cast<uint32_t>(reinterpret_cast<uintptr_t>(ycbcr.cr));
-        strides[C2PlanarLayout::PLANE_Y] = static_cast<uint32_t>(ycbcr.ystride);
-        strides[C2PlanarLayout::PLANE_U] = static_cast<uint32_t>(ycbcr.cstride);
-        strides[C2PlanarLayout::PLANE_V] = static_cast<uint32_t>(ycbcr.cstride);
-
-        bool crcb = false;
-        if (offsets[C2PlanarLayout::PLANE_U] > offsets[C2PlanarLayout::PLANE_V]) {
-            // Swap offsets, no need to swap strides as they are identical for both chroma planes.
-            std::swap(offsets[C2PlanarLayout::PLANE_U], offsets[C2PlanarLayout::PLANE_V]);
-            crcb = true;
-        }
-
-        bool semiplanar = false;
-        if (ycbcr.chroma_step >
-            offsets[C2PlanarLayout::PLANE_V] - offsets[C2PlanarLayout::PLANE_U]) {
-            semiplanar = true;
-        }
-
-        if (!crcb && !semiplanar) {
-            *format = VideoPixelFormat::I420;
-        } else if (!crcb && semiplanar) {
-            *format = VideoPixelFormat::NV12;
-        } else if (crcb && !semiplanar) {
-            // HACK: pretend YV12 is I420 now since VEA only accepts I420. (YV12 will be used
-            //       for input byte-buffer mode).
-            // TODO(dstaessens): Is this hack still necessary now we're not using the VEA directly?
-            //format = VideoPixelFormat::YV12;
-            *format = VideoPixelFormat::I420;
-        } else {
-            *format = VideoPixelFormat::NV21;
-        }
-        break;
-    }
-    case C2PlanarLayout::TYPE_RGB: {
-        offsets[C2PlanarLayout::PLANE_R] = layout.planes[C2PlanarLayout::PLANE_R].offset;
-        strides[C2PlanarLayout::PLANE_R] =
-                static_cast<uint32_t>(layout.planes[C2PlanarLayout::PLANE_R].rowInc);
-        *format = VideoPixelFormat::ARGB;
-        break;
-    }
-    default:
-        ALOGW("Unknown layout type: %u", static_cast<uint32_t>(layout.type));
-        return std::nullopt;
-    }
+// The maximum time to wait for the producer of an input frame to signal its fence. The fence of a
+// frame written by the GPU signals well within a frame period, unless the producer hangs.
+constexpr c2_nsecs_t kInputFenceTimeoutNs = 1000000000;  // 1s
 
-    std::vector<VideoFramePlane> planes;
-    for (uint32_t i = 0; i < layout.rootPlanes; ++i) {
-        // The mSize field is not used in our case, so we can safely set it to zero.
-        planes.push_back({strides[i], offsets[i], 0});
-    }
-    return planes;
+// Get the cookie of the async trace slice of |work|.
+int32_t getTraceCookie(const C2Work& work) {
+    return static_cast<int32_t>(work.input.ordinal.frameIndex.peeku() & 0x7FFFFFFF);
 }
 
 // Get the video frame stride for the specified |format| and |size|.
@@ -159,8 +85,7 @@ std::optional<uint32_t> getVideoFrameStride(VideoPixelFormat format, ui::Size si
 
     const C2ConstGraphicBlock constBlock = block->share(C2Rect(size.width, size.height), C2Fence());
     VideoPixelFormat pixelFormat;
-    std::optional<std::vector<VideoFramePlane>> planes =
-            getVideoFrameLayout(constBlock, &pixelFormat);
+    std::optional<VideoFramePlanes> planes = getVideoFrameLayout(constBlock, &pixelFormat);
     if (!planes || planes.value().empty()) {
         ALOGE("Failed to get video frame layout from block");
         return std::nullopt;
@@ -169,24 +94,109 @@ std::optional<uint32_t> getVideoFrameStride(VideoPixelFormat format, ui::Size si
     return planes.value()[0].mStride;
 }
 
-// Create an input frame from the specified graphic block.
-std::unique_ptr<V4L2Encoder::InputFrame> CreateInputFrame(const C2ConstGraphicBlock& block,
-                                                          uint64_t index, int64_t timestamp) {
-    VideoPixelFormat format;
-    std::optional<std::vector<VideoFramePlane>> planes = getVideoFrameLayout(block, &format);
-    if (!planes) {
-        ALOGE("Failed to get input block's layout");
-        return nullptr;
+// Get the pixel format of the specified |block| as it is laid out in memory. Unlike
+// getVideoFrameLayout(), YV12 is not reported as I420 and RGB is reported with its actual byte
+// order. Returns nullopt if the format is not one we can pass to the device without conversion.
+std::optional<VideoPixelFormat> getNativePixelFormat(const C2ConstGraphicBlock& block) {
+    const C2GraphicView view = block.map().get();
+    const C2PlanarLayout layout = view.layout();
+    switch (layout.type) {
+    case C2PlanarLayout::TYPE_YUV: {
+        const uint8_t* u = view.data()[C2PlanarLayout::PLANE_U];
+        const uint8_t* v = view.data()[C2PlanarLayout::PLANE_V];
+        if (layout.rootPlanes == 3) {
+            return (v < u) ? VideoPixelFormat::YV12 : VideoPixelFormat::I420;
+        }
+        if (layout.rootPlanes == 2) {
+            return (v > u) ? VideoPixelFormat::NV12 : VideoPixelFormat::NV21;
+        }
+        return std::nullopt;
+    }
+    case C2PlanarLayout::TYPE_RGB:
+        // Same as FormatConverter, C2AllocationGralloc::map() only maps RGBA_8888.
+        return VideoPixelFormat::ABGR;
+    default:
+        return std::nullopt;
     }
+}
+
+// The maximum number of output block ids remembered to count the recycled blocks. The set is reset
+// once full, the pools don't recycle more buffers than the encoder keeps in flight anyway.
+constexpr size_t kMaxTrackedOutputBlocks = 64;
 
-    std::vector<int> fds;
+// Whether the encoders back the basic linear block pool with a buffer pool, which recycles the
+// output buffers once released by the client instead of allocating a buffer for each frame.
+bool isOutputBlockRecyclingEnabled() {
+    static const bool kEnabled =
+            property_get_bool("ro.vendor.v4l2_codec2.encode_recycle_output_blocks", false);
+    return kEnabled;
+}
+
+// Whether input frames larger or smaller than the configured picture size are scaled by the input
+// format convertor. This allows encoding several resolutions of a single capture, each encoder
+// scaling the full resolution frames to its own size, as done for simulcast.
+bool isInputScalingEnabled() {
+    static const bool kEnabled =
+            property_get_bool("ro.vendor.v4l2_codec2.encode_scale_input", false);
+    return kEnabled;
+}
+
+// Check whether a frame reported as |layoutFormat| by getVideoFrameLayout() can be passed to a
+// device configured for |deviceFormat|, taking the workarounds of getVideoFrameLayout() into
+// account.
+bool isLayoutCompatible(VideoPixelFormat layoutFormat, VideoPixelFormat deviceFormat) {
+    if (layoutFormat == deviceFormat) return true;
+    // getVideoFrameLayout() reports YV12 as I420 with the planes sorted by offset.
+    if (layoutFormat == VideoPixelFormat::I420 && deviceFormat == VideoPixelFormat::YV12) {
+        return true;
+    }
+    // getVideoFrameLayout() reports all RGB layouts as ARGB.
+    return layoutFormat == VideoPixelFormat::ARGB && deviceFormat == VideoPixelFormat::ABGR;
+}
+
+// Create an input frame from the specified graphic block, whose layout is |planes| and |format| as
+// reported by getVideoFrameLayout(). If |deviceFormat| is specified the block is passed to the
+// device as-is, and is tagged with the device's input format.
+std::unique_ptr<V4L2Encoder::InputFrame> CreateInputFrame(
+        const C2ConstGraphicBlock& block, const VideoFramePlanes& planes, VideoPixelFormat format,
+        uint64_t index, int64_t timestamp, std::optional<VideoPixelFormat> deviceFormat) {
+    if (deviceFormat) {
+        if (!isLayoutCompatible(format, *deviceFormat)) {
+            ALOGE("Input block's format %s doesn't match the device's input format %s",
+                  videoPixelFormatToString(format).c_str(),
+                  videoPixelFormatToString(*deviceFormat).c_str());
+            return nullptr;
+        }
+        format = *deviceFormat;
+    }
+
+    VideoFrameFds fds;
     const C2Handle* const handle = block.handle();
+    if (handle->numFds < 0 || static_cast<size_t>(handle->numFds) > fds.capacity()) {
+        ALOGE("Unsupported number of fds in the input block: %d", handle->numFds);
+        return nullptr;
+    }
     for (int i = 0; i < handle->numFds; i++) {
         fds.emplace_back(handle->data[i]);
     }
 
-    return std::make_unique<V4L2Encoder::InputFrame>(std::move(fds), std::move(planes.value()),
-                                                     format, index, timestamp);
+    return std::make_unique<V4L2Encoder::InputFrame>(fds, planes, format, index, timestamp);
+}
+
+// Whether the input frame of |work|, if any, was written by its producer.
+bool isInputFenceSignaled(const C2Work& work) {
+    if (work.input.buffers.empty() || !work.input.buffers.front()) return true;
+    const std::vector<C2ConstGraphicBlock> blocks =
+            work.input.buffers.front()->data().graphicBlocks();
+    return blocks.empty() || blocks.front().fence().ready();
+}
+
+// Wait for |fence|, and run |doneCb| with the result on |taskRunner|. Runs on the fence thread.
+void waitForFence(C2Fence fence, scoped_refptr<::base::SequencedTaskRunner> taskRunner,
+                  ::base::OnceCallback<void(c2_status_t)> doneCb) {
+    ATRACE_CALL();
+    const c2_status_t status = fence.wait(kInputFenceTimeoutNs);
+    taskRunner->PostTask(FROM_HERE, ::base::BindOnce(std::move(doneCb), status));
 }
 
 // Check whether the specified |profile| is an H.264 profile.
@@ -195,6 +205,11 @@ bool IsH264Profile(C2Config::profile_t profile) {
             profile <= C2Config::PROFILE_AVC_ENHANCED_MULTIVIEW_DEPTH_HIGH);
 }
 
+// Check whether the specified |profile| is an HEVC profile.
+bool IsHEVCProfile(C2Config::profile_t profile) {
+    return (profile >= C2Config::PROFILE_HEVC_MAIN && profile <= C2Config::PROFILE_HEVC_3D_MAIN);
+}
+
 }  // namespace
 
 // static
@@ -223,14 +238,31 @@ std::shared_ptr<C2Component> V4L2EncodeComponent::create(
         return nullptr;
     }
 
-    return std::shared_ptr<C2Component>(new V4L2EncodeComponent(name, id, std::move(interface)),
-                                        deleter);
+    // The resolution and frame rate are not configured yet, reserve the load of the default
+    // configuration until the component is started.
+    std::unique_ptr<V4L2ResourceManager::Reservation> reservation;
+    if (V4L2ResourceManager::isEnabled()) {
+        reservation = V4L2ResourceManager::get()->reserve(
+                V4L2Device::Type::kEncoder,
+                V4L2ResourceManager::getMacroblocksPerSecond(interface->getInputVisibleSize(),
+                                                             interface->getFramerate()));
+        if (!reservation) {
+            ALOGW("Cannot create additional encoder, the encoders are fully loaded");
+            return nullptr;
+        }
+    }
+
+    auto* component = new V4L2EncodeComponent(name, id, std::move(interface));
+    component->mReservation = std::move(reservation);
+    return std::shared_ptr<C2Component>(component, deleter);
 }
 
 V4L2EncodeComponent::V4L2EncodeComponent(C2String name, c2_node_id_t id,
                                          std::shared_ptr<V4L2EncodeInterface> interface)
       : mName(name),
         mId(id),
+        mWorkTraceName(name + "#" + std::to_string(id) + " work"),
+        mStats(ComponentStats::Create(name + "#" + std::to_string(id))),
         mInterface(std::move(interface)),
         mComponentState(ComponentState::LOADED) {
     ALOGV("%s(%s)", __func__, name.c_str());
@@ -267,12 +299,25 @@ c2_status_t V4L2EncodeComponent::start() {
         return C2_BAD_STATE;
     }
 
+    // Admit the session against the load of its actual resolution and frame rate.
+    if (mReservation &&
+        !mReservation->update(V4L2ResourceManager::getMacroblocksPerSecond(
+                mInterface->getInputVisibleSize(), mInterface->getFramerate()))) {
+        ALOGE("Not enough encoder capacity left to start the encoder");
+        return C2_NO_MEMORY;
+    }
+
     if (!mEncoderThread.Start()) {
         ALOGE("Failed to start encoder thread");
         return C2_CORRUPTED;
     }
     mEncoderTaskRunner = mEncoderThread.task_runner();
     mWeakThis = mWeakThisFactory.GetWeakPtr();
+    if (!mFenceThread.Start()) {
+        ALOGE("Failed to start fence thread");
+        mEncoderThread.Stop();
+        return C2_CORRUPTED;
+    }
 
     // Initialize the encoder on the encoder thread.
     ::base::WaitableEvent done;
@@ -311,6 +356,8 @@ c2_status_t V4L2EncodeComponent::stop() {
             FROM_HERE, ::base::BindOnce(&V4L2EncodeComponent::stopTask, mWeakThis, &done));
     done.Wait();
     mEncoderThread.Stop();
+    // The results of the fence waits still running are dropped along with the encoder thread.
+    mFenceThread.Stop();
 
     setComponentState(ComponentState::LOADED);
 
@@ -346,6 +393,7 @@ c2_status_t V4L2EncodeComponent::release() {
 
 c2_status_t V4L2EncodeComponent::queue_nb(std::list<std::unique_ptr<C2Work>>* const items) {
     ALOGV("%s()", __func__);
+    ATRACE_CALL();
 
     if (mComponentState != ComponentState::RUNNING) {
         ALOGE("Trying to queue work item while component is not running");
@@ -353,6 +401,7 @@ c2_status_t V4L2EncodeComponent::queue_nb(std::list<std::unique_ptr<C2Work>>* co
     }
 
     while (!items->empty()) {
+        ATRACE_ASYNC_BEGIN(mWorkTraceName.c_str(), getTraceCookie(*items->front()));
         mEncoderTaskRunner->PostTask(FROM_HERE,
                                      ::base::BindOnce(&V4L2EncodeComponent::queueTask, mWeakThis,
                                                       std::move(items->front())));
@@ -440,7 +489,20 @@ void V4L2EncodeComponent::startTask(bool* success, ::base::WaitableEvent* done)
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
 
-    *success = initializeEncoder();
+    // The encoder thread is started again on each start(), so the policy configured before is
+    // picked up. The device poll threads follow the policy of this thread.
+    mInterface->getThreadPolicy().applyToCurrentThread();
+    mHintSession = PerformanceHintSession::Create(mInterface->getFramerate());
+
+    mWorkReporter = std::make_unique<WorkReporter>("V4L2EncReporter");
+    // ::base::Unretained(this) is safe here because |mWorkDoneBatcher| is destroyed on stopTask(),
+    // before |mEncoderThread| is stopped.
+    mWorkDoneBatcher = std::make_unique<WorkDoneBatcher>(
+            mEncoderTaskRunner, ::base::BindRepeating(&V4L2EncodeComponent::reportWorks,
+                                                      ::base::Unretained(this)));
+
+    mInputFormatNegotiated = false;
+    *success = initializeEncoder(kInputPixelFormat, std::nullopt);
     done->Signal();
 }
 
@@ -455,6 +517,10 @@ void V4L2EncodeComponent::stopTask(::base::WaitableEvent* done) {
 
     mEncoder.reset();
     mOutputBlockPool.reset();
+    mWorkDoneBatcher.reset();
+    // The work items reported so far are delivered before the component is stopped.
+    mWorkReporter.reset();
+    mHintSession.reset();
 
     // Invalidate all weak pointers so no more functions will be executed on the encoder thread.
     mWeakThisFactory.InvalidateWeakPtrs();
@@ -465,7 +531,113 @@ void V4L2EncodeComponent::stopTask(::base::WaitableEvent* done) {
 void V4L2EncodeComponent::queueTask(std::unique_ptr<C2Work> work) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
+
+    // Reading a frame before its producer is done with it would block the encoder thread until
+    // the fence signals, so the frame waits on the fence thread instead and the encoder keeps
+    // returning the encoded buffers in between. The work items after it wait as well, to keep
+    // their order.
+    if (mInputWaitQueue.empty() && isInputFenceSignaled(*work)) {
+        processWork(std::move(work));
+        return;
+    }
+
+    if (!isInputFenceSignaled(*work)) {
+        const uint64_t index = work->input.ordinal.frameIndex.peeku();
+        ALOGV("Waiting for the fence of input block (index: %" PRIu64 ")", index);
+        mFenceThread.task_runner()->PostTask(
+                FROM_HERE,
+                ::base::BindOnce(
+                        &waitForFence,
+                        work->input.buffers.front()->data().graphicBlocks().front().fence(),
+                        mEncoderTaskRunner,
+                        ::base::BindOnce(&V4L2EncodeComponent::onInputFenceSignaled, mWeakThis,
+                                         index)));
+    }
+    mInputWaitQueue.push_back(std::move(work));
+}
+
+void V4L2EncodeComponent::onInputFenceSignaled(uint64_t index, c2_status_t status) {
+    ALOGV("%s(index=%" PRIu64 ", status=%d)", __func__, index, status);
+    ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
+
+    // The work item might have been flushed while its fence was waited for. Otherwise the error is
+    // reported right away, even if the work item isn't first in line: its fence won't signal, so
+    // the queue would stall once it got there.
+    if (status != C2_OK &&
+        std::any_of(mInputWaitQueue.begin(), mInputWaitQueue.end(),
+                    [index](const std::unique_ptr<C2Work>& work) {
+                        return work->input.ordinal.frameIndex.peeku() == index;
+                    })) {
+        ALOGE("Failed to wait for the fence of input block (index: %" PRIu64 ", error: %d)",
+              index, status);
+        reportError(status == C2_TIMED_OUT ? C2_TIMED_OUT : C2_CORRUPTED);
+        return;
+    }
+
+    pumpInputWaitQueue();
+}
+
+void V4L2EncodeComponent::pumpInputWaitQueue() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
+
+    while (!mInputWaitQueue.empty() && !mInputLayoutChangePending &&
+           isInputFenceSignaled(*mInputWaitQueue.front())) {
+        std::unique_ptr<C2Work> work = std::move(mInputWaitQueue.front());
+        mInputWaitQueue.pop_front();
+        processWork(std::move(work));
+        // Stop at the first error reported while processing the work items.
+        if (mComponentState == ComponentState::ERROR) return;
+    }
+}
+
+void V4L2EncodeComponent::changeInputLayoutTask() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
+
+    // The device can only be reconfigured once all the frames queued to it are encoded.
+    if (!mInputLayoutChangePending || !mWorkQueue.empty()) return;
+    mInputLayoutChangePending = false;
+    ALOG_ASSERT(!mInputWaitQueue.empty());
+    ALOG_ASSERT(!mInputFormatConverter);
+
+    const C2ConstGraphicBlock block =
+            mInputWaitQueue.front()->input.buffers.front()->data().graphicBlocks().front();
+    VideoPixelFormat layoutFormat;
+    std::optional<VideoFramePlanes> planes = getVideoFrameLayout(block, &layoutFormat);
+    if (!planes || planes->empty()) {
+        ALOGE("Failed to get the layout of the input block");
+        reportError(C2_CORRUPTED);
+        return;
+    }
+
+    const VideoPixelFormat format = mEncoder->inputFormat();
+    ALOGI("Input frame layout changed, reconfiguring encoder for %s input with stride %u",
+          videoPixelFormatToString(format).c_str(), (*planes)[0].mStride);
+    mEncoder.reset();
+    if (!initializeEncoder(format, (*planes)[0].mStride)) {
+        reportError(C2_CORRUPTED);
+        return;
+    }
+    // The device might not take the new layout as-is, e.g. because of its alignment requirements.
+    // The frames are then converted, which fits the device whatever their layout.
+    if (!mInputFormatConverter && !mEncoder->isInputLayoutSupported(*planes)) {
+        ALOGW("Device doesn't support the input frame layout, converting input frames");
+        mEncoder.reset();
+        if (!initializeEncoder(kInputPixelFormat, std::nullopt)) {
+            reportError(C2_CORRUPTED);
+            return;
+        }
+    }
+
+    pumpInputWaitQueue();
+}
+
+void V4L2EncodeComponent::processWork(std::unique_ptr<C2Work> work) {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
     ALOG_ASSERT(mEncoder);
+    PerformanceHintSession::ScopedWork hintWork;
 
     // Currently only a single worklet per work item is supported. An input buffer should always be
     // supplied unless this is a drain or CSD request.
@@ -496,6 +668,23 @@ void V4L2EncodeComponent::queueTask(std::unique_ptr<C2Work> work) {
         return;
     }
 
+    // When receiving the first input frame, check whether the device supports its format natively.
+    if (!mInputFormatNegotiated && !work->input.buffers.empty()) {
+        mInputFormatNegotiated = true;
+        if (!negotiateInputFormat(work->input.buffers.front()->data().graphicBlocks().front())) {
+            reportError(C2_CORRUPTED);
+            return;
+        }
+    }
+
+    // The convertor needs as many blocks as frames in flight on the device.
+    if (mInputFormatConverter &&
+        mInputFormatConverter->growBlockPool(mEncoder->queueDepth()) != C2_OK) {
+        ALOGE("Failed to grow the input format convertor pool");
+        reportError(C2_NO_MEMORY);
+        return;
+    }
+
     // If conversion is required but no free buffers are available we queue the work item.
     if (mInputFormatConverter && !mInputFormatConverter->isReady()) {
         ALOGV("Input format convertor ran out of buffers");
@@ -508,15 +697,36 @@ void V4L2EncodeComponent::queueTask(std::unique_ptr<C2Work> work) {
     if (!work->input.buffers.empty()) {
         C2ConstGraphicBlock inputBlock =
                 work->input.buffers.front()->data().graphicBlocks().front();
+        // The layout of the block passed to the device, read once for both checking it and
+        // creating the input frame.
+        VideoPixelFormat layoutFormat = VideoPixelFormat::UNKNOWN;
+        std::optional<VideoFramePlanes> planes;
+        if (!mInputFormatConverter) planes = getVideoFrameLayout(inputBlock, &layoutFormat);
+        // Without format convertor the frames are passed to the device as-is. A frame laid out
+        // differently than the previous ones, e.g. by another producer, waits until the device
+        // is reconfigured for its layout, instead of being encoded as garbage.
+        if (planes && !mEncoder->isInputLayoutSupported(*planes)) {
+            ALOGV("Input block (index: %" PRIu64 ") has another layout, reconfiguring encoder",
+                  index);
+            mInputLayoutChangePending = true;
+            mInputWaitQueue.push_front(std::move(work));
+            mEncoderTaskRunner->PostTask(
+                    FROM_HERE,
+                    ::base::BindOnce(&V4L2EncodeComponent::changeInputLayoutTask, mWeakThis));
+            return;
+        }
         if (mInputFormatConverter) {
             ALOGV("Converting input block (index: %" PRIu64 ")", index);
             c2_status_t status = C2_CORRUPTED;
+            const ::base::TimeTicks convertStart = ::base::TimeTicks::Now();
             inputBlock = mInputFormatConverter->convertBlock(index, inputBlock, &status);
+            mStats->addConversionTime(::base::TimeTicks::Now() - convertStart);
             if (status != C2_OK) {
                 ALOGE("Failed to convert input block (index: %" PRIu64 ")", index);
                 reportError(status);
                 return;
             }
+            planes = getVideoFrameLayout(inputBlock, &layoutFormat);
         } else {
             // Android encoder framework reuses the same gpu buffers as
             // inputs and doesn't call lock/unlock explicitly between writes.
@@ -544,12 +754,22 @@ void V4L2EncodeComponent::queueTask(std::unique_ptr<C2Work> work) {
                 buffer->unlock();
             } while (0);
         }
-        if (!encode(inputBlock, index, timestamp)) {
+        // Apply the parameters attached to the work item, e.g. the regions of interest of the
+        // frame, so they take effect from this frame on.
+        if (!work->input.configUpdate.empty() && !applyConfigUpdate(work->input.configUpdate)) {
+            return;
+        }
+        if (!planes) {
+            ALOGE("Failed to get the layout of input block (index: %" PRIu64 ")", index);
+            reportError(C2_CORRUPTED);
+            return;
+        }
+        if (!encode(inputBlock, *planes, layoutFormat, index, timestamp)) {
             return;
         }
     }
 
-    mWorkQueue.push_back(std::move(work));
+    pushWork(std::move(work));
     if (endOfStream) {
         mEncoder->drain();
     }
@@ -560,7 +780,13 @@ void V4L2EncodeComponent::drainTask(drain_mode_t /*drainMode*/) {
     ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
 
     // We can only start draining if all work has been queued in the encoder, so we mark the last
-    // item waiting for conversion as EOS if required.
+    // item waiting for its fence or for conversion as EOS if required.
+    if (!mInputWaitQueue.empty()) {
+        C2Work* work = mInputWaitQueue.back().get();
+        work->input.flags = static_cast<C2FrameData::flags_t>(work->input.flags |
+                                                              C2FrameData::FLAG_END_OF_STREAM);
+        return;
+    }
     if (!mInputConverterQueue.empty()) {
         C2Work* work = mInputConverterQueue.back().get();
         work->input.flags = static_cast<C2FrameData::flags_t>(work->input.flags |
@@ -604,7 +830,8 @@ void V4L2EncodeComponent::onDrainDone(bool success) {
 
     // Mark the item in the output work queue as EOS done.
     C2Work* eosWork = it->get();
-    eosWork->worklets.back()->output.flags = C2FrameData::FLAG_END_OF_STREAM;
+    eosWork->worklets.back()->output.flags = static_cast<C2FrameData::flags_t>(
+            eosWork->worklets.back()->output.flags | C2FrameData::FLAG_END_OF_STREAM);
 
     // Draining is done which means all buffers on the device output queue have been returned, but
     // not all buffers on the device input queue might have been returned yet.
@@ -614,8 +841,7 @@ void V4L2EncodeComponent::onDrainDone(bool success) {
     }
 
     ALOGV("Draining done");
-    reportWork(std::move(mWorkQueue.front()));
-    mWorkQueue.pop_front();
+    reportWork(popWork());
 }
 
 void V4L2EncodeComponent::flushTask(::base::WaitableEvent* done,
@@ -631,7 +857,16 @@ void V4L2EncodeComponent::flushTask(::base::WaitableEvent* done,
             flushedWork->push_back(std::move(work));
             mInputConverterQueue.pop();
         }
+        while (!mInputWaitQueue.empty()) {
+            std::unique_ptr<C2Work> work = std::move(mInputWaitQueue.front());
+            work->input.buffers.clear();
+            flushedWork->push_back(std::move(work));
+            mInputWaitQueue.pop_front();
+        }
     }
+    // The work items finished before the flush reach the listener before flush_sm() returns.
+    if (mWorkDoneBatcher) mWorkDoneBatcher->flush();
+    if (mWorkReporter) mWorkReporter->flush();
     done->Signal();
 
     flush();
@@ -642,33 +877,41 @@ void V4L2EncodeComponent::setListenerTask(const std::shared_ptr<Listener>& liste
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
 
+    // Work items finished so far are still reported to the previous listener.
+    if (mWorkDoneBatcher) mWorkDoneBatcher->flush();
     mListener = listener;
     done->Signal();
 }
 
-bool V4L2EncodeComponent::initializeEncoder() {
-    ALOGV("%s()", __func__);
+bool V4L2EncodeComponent::initializeEncoder(VideoPixelFormat inputFormat,
+                                            std::optional<uint32_t> stride) {
+    ALOGV("%s(inputFormat=%s)", __func__, videoPixelFormatToString(inputFormat).c_str());
     ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
     ALOG_ASSERT(!mInputFormatConverter);
     ALOG_ASSERT(!mEncoder);
 
     mLastFrameTime = std::nullopt;
+    mFramerate = 0;
+    mRegionsOfInterest.clear();
 
     // Get the requested profile and level.
     C2Config::profile_t outputProfile = mInterface->getOutputProfile();
 
-    // CSD only needs to be extracted when using an H.264 profile.
-    mExtractCSD = IsH264Profile(outputProfile);
+    // CSD only needs to be extracted when using an H.264 or HEVC profile. VP8 and VP9 frames carry
+    // their own headers and are returned without being parsed.
+    mIsHEVC = IsHEVCProfile(outputProfile);
+    mExtractCSD = IsH264Profile(outputProfile) || mIsHEVC;
 
-    std::optional<uint8_t> h264Level;
-    if (IsH264Profile(outputProfile)) {
-        h264Level = c2LevelToV4L2Level(mInterface->getOutputLevel());
+    std::optional<uint8_t> level;
+    if (mExtractCSD) {
+        level = c2LevelToV4L2Level(mInterface->getOutputLevel());
     }
 
     // Get the stride used by the C2 framework, as this might be different from the stride used by
     // the V4L2 encoder.
-    std::optional<uint32_t> stride =
-            getVideoFrameStride(kInputPixelFormat, mInterface->getInputVisibleSize());
+    if (!stride) {
+        stride = getVideoFrameStride(inputFormat, mInterface->getInputVisibleSize());
+    }
     if (!stride) {
         ALOGE("Failed to get video frame stride");
         reportError(C2_CORRUPTED);
@@ -686,10 +929,14 @@ bool V4L2EncodeComponent::initializeEncoder() {
 
     mBitrate = mInterface->getBitrate();
 
+    const size_t queueDepth = mInterface->getQueueDepth();
+    const bool adaptiveQueueDepth = mInterface->isQueueDepthAdaptive();
     mEncoder = V4L2Encoder::create(
-            outputProfile, h264Level, mInterface->getInputVisibleSize(), *stride,
-            mInterface->getKeyFramePeriod(), mBitrateMode, mBitrate,
-            mBitrate * kPeakBitrateMultiplier,
+            outputProfile, level, mInterface->getInputVisibleSize(), inputFormat, *stride,
+            mInterface->getKeyFramePeriod(), mInterface->getIntraRefreshPeriod(), mBitrateMode,
+            mBitrate, mBitrate * kPeakBitrateMultiplier, queueDepth, adaptiveQueueDepth,
+            mInterface->isOutputBufferRightSized(), mInterface->getTemporalLayerCount(),
+            mInterface->getTemporalLayerBitrateRatios(),
             ::base::BindRepeating(&V4L2EncodeComponent::fetchOutputBlock, mWeakThis),
             ::base::BindRepeating(&V4L2EncodeComponent::onInputBufferDone, mWeakThis),
             ::base::BindRepeating(&V4L2EncodeComponent::onOutputBufferDone, mWeakThis),
@@ -701,12 +948,33 @@ bool V4L2EncodeComponent::initializeEncoder() {
         return false;
     }
 
+    // The client's native format was requested, no input format convertor is required if the
+    // device accepted it. Otherwise fall back to the default configuration.
+    if (inputFormat != kInputPixelFormat) {
+        if (mEncoder->inputFormat() == inputFormat) {
+            ALOGV("Encoding %s input frames without conversion",
+                  videoPixelFormatToString(inputFormat).c_str());
+            return true;
+        }
+        ALOGW("Failed to configure the device for %s input, falling back to %s",
+              videoPixelFormatToString(inputFormat).c_str(),
+              videoPixelFormatToString(kInputPixelFormat).c_str());
+        mEncoder.reset();
+        return initializeEncoder(kInputPixelFormat, std::nullopt);
+    }
+
     // Add an input format convertor if the device doesn't support the requested input format.
     ALOGV("Creating input format convertor (%s)",
           videoPixelFormatToString(mEncoder->inputFormat()).c_str());
-    mInputFormatConverter =
-            FormatConverter::Create(mEncoder->inputFormat(), mEncoder->visibleSize(),
-                                    V4L2Encoder::kInputBufferCount, mEncoder->codedSize());
+    // Large frames can be converted in parallel stripes. The worker threads are taken from the
+    // WorkerPool budget shared by all the encoder instances of the process.
+    static const size_t kMaxConversionThreads = static_cast<size_t>(
+            std::max(property_get_int32("ro.vendor.v4l2_codec2.encode_convert_threads", 0), 0));
+    // The convertor starts with blocks for the initial queue depth, and grows along with the queue
+    // depth of an adaptive encoder in processWork().
+    mInputFormatConverter = FormatConverter::Create(
+            mEncoder->inputFormat(), mEncoder->visibleSize(), mEncoder->queueDepth(),
+            mEncoder->codedSize(), kMaxConversionThreads, isInputScalingEnabled());
     if (!mInputFormatConverter) {
         ALOGE("Failed to created input format convertor");
         return false;
@@ -715,6 +983,57 @@ bool V4L2EncodeComponent::initializeEncoder() {
     return true;
 }
 
+bool V4L2EncodeComponent::negotiateInputFormat(const C2ConstGraphicBlock& block) {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
+    ALOG_ASSERT(mWorkQueue.empty());
+
+    // Nothing to do if the format is not known, already used by the device (in which case the
+    // format convertor applies zero-copy), or not supported by the device.
+    std::optional<VideoPixelFormat> format = getNativePixelFormat(block);
+    if (!format || *format == mEncoder->inputFormat() ||
+        !mEncoder->isInputFormatSupported(*format)) {
+        return true;
+    }
+
+    // Frames of another size than the picture size have to be scaled by the format convertor.
+    if (isInputScalingEnabled() && (block.crop().width != mEncoder->visibleSize().width ||
+                                    block.crop().height != mEncoder->visibleSize().height)) {
+        ALOGV("Input frames are scaled, keep converting input frames");
+        return true;
+    }
+
+    VideoPixelFormat layoutFormat;
+    std::optional<VideoFramePlanes> planes = getVideoFrameLayout(block, &layoutFormat);
+    if (!planes || planes->empty()) {
+        ALOGW("Failed to get the layout of the input block, keep converting input frames");
+        return true;
+    }
+
+    ALOGI("Device supports %s input natively, reconfigure encoder to skip format conversion",
+          videoPixelFormatToString(*format).c_str());
+    mInputFormatConverter.reset();
+    mEncoder.reset();
+    return initializeEncoder(*format, (*planes)[0].mStride);
+}
+
+bool V4L2EncodeComponent::applyConfigUpdate(
+        const std::vector<std::unique_ptr<C2Param>>& configUpdate) {
+    ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
+
+    std::vector<C2Param*> params;
+    for (const std::unique_ptr<C2Param>& param : configUpdate) params.push_back(param.get());
+    std::vector<std::unique_ptr<C2SettingResult>> failures;
+    c2_status_t status = mInterface->config(params, C2_MAY_BLOCK, &failures);
+    // Invalid values are adjusted or ignored by the interface, like configuring the component.
+    if (status != C2_OK && status != C2_BAD_VALUE && status != C2_BAD_INDEX) {
+        ALOGE("Failed to apply the parameters of the work item (error code: %d)", status);
+        reportError(status);
+        return false;
+    }
+    return true;
+}
+
 bool V4L2EncodeComponent::updateEncodingParameters() {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
@@ -751,6 +1070,7 @@ bool V4L2EncodeComponent::updateEncodingParameters() {
             return false;
         }
         mFramerate = framerate;
+        if (mHintSession) mHintSession->setFrameRate(framerate);
     }
 
     // Check whether an explicit key frame was requested, if so reset the key frame counter to
@@ -762,6 +1082,23 @@ bool V4L2EncodeComponent::updateEncodingParameters() {
         reportError(status);
         return false;
     }
+    // Update the regions of interest if they changed, so the encoder only sets its controls when
+    // needed. Encoders without support for regions of interest ignore them.
+    std::vector<VideoEncoder::RegionOfInterest> regions;
+    for (const C2V4L2RegionOfInterestStruct& region : mInterface->getRegionsOfInterest()) {
+        if (region.width == 0 || region.height == 0) continue;
+        regions.push_back({Rect(region.left, region.top, region.left + region.width,
+                                region.top + region.height),
+                           region.qpDelta});
+    }
+    if (regions != mRegionsOfInterest) {
+        ALOGV("Setting %zu regions of interest", regions.size());
+        if (!mEncoder->setRegionsOfInterest(regions) && !regions.empty()) {
+            ALOGW("The encoder doesn't support regions of interest, ignoring them");
+        }
+        mRegionsOfInterest = std::move(regions);
+    }
+
     if (requestKeyFrame.value == C2_TRUE) {
         mEncoder->requestKeyframe();
         requestKeyFrame.value = C2_FALSE;
@@ -777,7 +1114,9 @@ bool V4L2EncodeComponent::updateEncodingParameters() {
     return true;
 }
 
-bool V4L2EncodeComponent::encode(C2ConstGraphicBlock block, uint64_t index, int64_t timestamp) {
+bool V4L2EncodeComponent::encode(C2ConstGraphicBlock block, const VideoFramePlanes& planes,
+                                 VideoPixelFormat layoutFormat, uint64_t index,
+                                 int64_t timestamp) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
     ALOG_ASSERT(mEncoder);
@@ -802,7 +1141,12 @@ bool V4L2EncodeComponent::encode(C2ConstGraphicBlock block, uint64_t index, int6
     if (!updateEncodingParameters()) return false;
 
     // Create an input frame from the graphic block.
-    std::unique_ptr<V4L2Encoder::InputFrame> frame = CreateInputFrame(block, index, timestamp);
+    // Without format convertor the block is in the client's native format, which is the format
+    // configured on the device.
+    std::optional<VideoPixelFormat> deviceFormat;
+    if (!mInputFormatConverter) deviceFormat = mEncoder->inputFormat();
+    std::unique_ptr<V4L2Encoder::InputFrame> frame =
+            CreateInputFrame(block, planes, layoutFormat, index, timestamp, deviceFormat);
     if (!frame) {
         ALOGE("Failed to create video frame from input block (index: %" PRIu64
               ", timestamp: %" PRId64 ")",
@@ -811,6 +1155,8 @@ bool V4L2EncodeComponent::encode(C2ConstGraphicBlock block, uint64_t index, int6
         return false;
     }
 
+    mEncodeStartTimes[index] = ::base::TimeTicks::Now();
+    mStats->onFrameIn();
     if (!mEncoder->encode(std::move(frame))) {
         return false;
     }
@@ -822,7 +1168,8 @@ void V4L2EncodeComponent::flush() {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
 
-    mEncoder->flush();
+    // The encoder might not exist if reconfiguring it failed.
+    if (mEncoder) mEncoder->flush();
 
     // Report all queued work items as aborted.
     std::list<std::unique_ptr<C2Work>> abortedWorkItems;
@@ -833,8 +1180,16 @@ void V4L2EncodeComponent::flush() {
         abortedWorkItems.push_back(std::move(work));
         mInputConverterQueue.pop();
     }
+    while (!mInputWaitQueue.empty()) {
+        std::unique_ptr<C2Work> work = std::move(mInputWaitQueue.front());
+        work->result = C2_NOT_FOUND;
+        work->input.buffers.clear();
+        abortedWorkItems.push_back(std::move(work));
+        mInputWaitQueue.pop_front();
+    }
+    mInputLayoutChangePending = false;
     while (!mWorkQueue.empty()) {
-        std::unique_ptr<C2Work> work = std::move(mWorkQueue.front());
+        std::unique_ptr<C2Work> work = popWork();
         // Return buffer to the input format convertor if required.
         if (mInputFormatConverter && work->input.buffers.empty()) {
             mInputFormatConverter->returnBlock(work->input.ordinal.frameIndex.peeku());
@@ -842,10 +1197,12 @@ void V4L2EncodeComponent::flush() {
         work->result = C2_NOT_FOUND;
         work->input.buffers.clear();
         abortedWorkItems.push_back(std::move(work));
-        mWorkQueue.pop_front();
     }
+    mEncodeStartTimes.clear();
+    // Work items which finished before the aborted ones are reported first.
+    mWorkDoneBatcher->flush();
     if (!abortedWorkItems.empty()) {
-        mListener->onWorkDone_nb(weak_from_this(), std::move(abortedWorkItems));
+        reportWorks(std::move(abortedWorkItems));
     }
 }
 
@@ -861,6 +1218,13 @@ void V4L2EncodeComponent::fetchOutputBlock(uint32_t size,
     if (status != C2_OK) {
         ALOGE("Failed to fetch linear block (error: %d)", status);
         reportError(status);
+        return;
+    }
+
+    const std::optional<unique_id_t> blockId = getDmabufId(block->handle()->data[0]);
+    if (blockId) {
+        if (mOutputBlockIds.size() >= kMaxTrackedOutputBlocks) mOutputBlockIds.clear();
+        mStats->onOutputBlockFetched(!mOutputBlockIds.insert(*blockId).second);
     }
 
     *buffer = std::make_unique<BitstreamBuffer>(std::move(block), 0, size);
@@ -895,7 +1259,7 @@ void V4L2EncodeComponent::onInputBufferDone(uint64_t index) {
         while (!mInputConverterQueue.empty() && mInputFormatConverter->isReady()) {
             std::unique_ptr<C2Work> work = std::move(mInputConverterQueue.front());
             mInputConverterQueue.pop();
-            queueTask(std::move(work));
+            processWork(std::move(work));
         }
     }
 
@@ -903,8 +1267,7 @@ void V4L2EncodeComponent::onInputBufferDone(uint64_t index) {
     // to be returned, in which case we can report it as completed now. As input buffers are not
     // necessarily returned in order we might be able to return multiple ready work items now.
     while (!mWorkQueue.empty() && isWorkDone(*mWorkQueue.front())) {
-        reportWork(std::move(mWorkQueue.front()));
-        mWorkQueue.pop_front();
+        reportWork(popWork());
     }
 }
 
@@ -915,8 +1278,27 @@ void V4L2EncodeComponent::onOutputBufferDone(size_t dataSize, int64_t timestamp,
     ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
     ALOG_ASSERT(buffer->dmabuf);
 
+    mStats->onFrameOut();
+    if (mHintSession) mHintSession->onFrameDone();
+
+    // A dropped frame completes its work without output buffer, the CSD is extracted from the
+    // next key frame.
+    if (dataSize == 0) {
+        C2Work* work = getWorkByTimestamp(timestamp);
+        if (!work) {
+            reportError(C2_CORRUPTED);
+            return;
+        }
+        work->worklets.front()->output.flags = static_cast<C2FrameData::flags_t>(
+                work->worklets.front()->output.flags | C2FrameData::FLAG_DROP_FRAME);
+        while (!mWorkQueue.empty() && isWorkDone(*mWorkQueue.front())) {
+            reportWork(popWork());
+        }
+        return;
+    }
+
     C2ConstLinearBlock constBlock =
-            buffer->dmabuf->share(buffer->dmabuf->offset(), dataSize, C2Fence());
+            buffer->dmabuf->share(buffer->dmabuf->offset() + buffer->offset, dataSize, C2Fence());
 
     // If no CSD (content-specific-data, e.g. SPS for H.264) has been submitted yet, we expect this
     // output block to contain CSD. We only submit the CSD once, even if it's attached to each key
@@ -925,7 +1307,9 @@ void V4L2EncodeComponent::onOutputBufferDone(size_t dataSize, int64_t timestamp,
         ALOGV("No CSD submitted yet, extracting CSD");
         std::unique_ptr<C2StreamInitDataInfo::output> csd;
         C2ReadView view = constBlock.map().get();
-        if (!extractCSDInfo(&csd, view.data(), view.capacity())) {
+        bool extracted = mIsHEVC ? extractHEVCCSDInfo(&csd, view.data(), view.capacity())
+                                 : extractCSDInfo(&csd, view.data(), view.capacity());
+        if (!extracted) {
             ALOGE("Failed to extract CSD");
             reportError(C2_CORRUPTED);
             return;
@@ -960,30 +1344,58 @@ void V4L2EncodeComponent::onOutputBufferDone(size_t dataSize, int64_t timestamp,
         linearBuffer->setInfo(
                 std::make_shared<C2StreamPictureTypeMaskInfo::output>(0u, C2Config::SYNC_FRAME));
     }
+    // Report the temporal layer of each frame, so the frames of the upper layers can be dropped
+    // without decoding the stream.
+    if (mInterface->getTemporalLayerCount() > 1) {
+        linearBuffer->setInfo(
+                std::make_shared<C2StreamLayerIndexInfo::output>(0u, buffer->temporalLayer));
+    }
     work->worklets.front()->output.buffers.emplace_back(std::move(linearBuffer));
 
     // We can report the work item as completed if its associated input buffer has also been
     // released. As output buffers are not necessarily returned in order we might be able to return
     // multiple ready work items now.
     while (!mWorkQueue.empty() && isWorkDone(*mWorkQueue.front())) {
-        reportWork(std::move(mWorkQueue.front()));
-        mWorkQueue.pop_front();
+        reportWork(popWork());
     }
 }
 
+void V4L2EncodeComponent::pushWork(std::unique_ptr<C2Work> work) {
+    ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
+
+    mWorksByIndex.emplace(work->input.ordinal.frameIndex.peeku(), work.get());
+    mWorksByTimestamp.emplace(work->input.ordinal.timestamp.peeku(), work.get());
+    mWorkQueue.push_back(std::move(work));
+}
+
+std::unique_ptr<C2Work> V4L2EncodeComponent::popWork() {
+    ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
+    ALOG_ASSERT(!mWorkQueue.empty());
+
+    std::unique_ptr<C2Work> work = std::move(mWorkQueue.front());
+    mWorkQueue.pop_front();
+
+    auto byIndex = mWorksByIndex.find(work->input.ordinal.frameIndex.peeku());
+    if (byIndex != mWorksByIndex.end() && byIndex->second == work.get()) {
+        mWorksByIndex.erase(byIndex);
+    }
+    auto byTimestamp = mWorksByTimestamp.find(work->input.ordinal.timestamp.peeku());
+    if (byTimestamp != mWorksByTimestamp.end() && byTimestamp->second == work.get()) {
+        mWorksByTimestamp.erase(byTimestamp);
+    }
+    return work;
+}
+
 C2Work* V4L2EncodeComponent::getWorkByIndex(uint64_t index) {
     ALOGV("%s(): getting work item (index: %" PRIu64 ")", __func__, index);
     ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
 
-    auto it = std::find_if(mWorkQueue.begin(), mWorkQueue.end(),
-                           [index](const std::unique_ptr<C2Work>& w) {
-                               return w->input.ordinal.frameIndex.peeku() == index;
-                           });
-    if (it == mWorkQueue.end()) {
+    auto it = mWorksByIndex.find(index);
+    if (it == mWorksByIndex.end()) {
         ALOGE("Failed to find work (index: %" PRIu64 ")", index);
         return nullptr;
     }
-    return it->get();
+    return it->second;
 }
 
 C2Work* V4L2EncodeComponent::getWorkByTimestamp(int64_t timestamp) {
@@ -991,9 +1403,16 @@ C2Work* V4L2EncodeComponent::getWorkByTimestamp(int64_t timestamp) {
     ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
     ALOG_ASSERT(timestamp >= 0);
 
-    // Find the work with specified timestamp by looping over the output work queue. This should be
-    // very fast as the output work queue will never be longer then a few items. Ignore empty work
-    // items that are marked as EOS, as their timestamp might clash with other work items.
+    // Ignore empty work items that are marked as EOS, as their timestamp might clash with other
+    // work items.
+    auto indexed = mWorksByTimestamp.find(static_cast<uint64_t>(timestamp));
+    if (indexed != mWorksByTimestamp.end() &&
+        !(indexed->second->input.flags & C2FrameData::FLAG_END_OF_STREAM)) {
+        return indexed->second;
+    }
+
+    // Only the first work item with a timestamp is indexed, fall back to looping over the output
+    // work queue if it was marked as EOS or if its timestamp clashed with a reported work item.
     auto it = std::find_if(
             mWorkQueue.begin(), mWorkQueue.end(), [timestamp](const std::unique_ptr<C2Work>& w) {
                 return !(w->input.flags & C2FrameData::FLAG_END_OF_STREAM) &&
@@ -1023,8 +1442,10 @@ bool V4L2EncodeComponent::isWorkDone(const C2Work& work) const {
         return false;
     }
 
-    // If the work item had an input buffer to be encoded, it should have an output buffer set.
-    if (!work.input.buffers.empty() && work.worklets.front()->output.buffers.empty()) {
+    // If the work item had an input buffer to be encoded, it should have an output buffer set
+    // unless its frame was dropped.
+    if (!work.input.buffers.empty() && work.worklets.front()->output.buffers.empty() &&
+        !(work.worklets.front()->output.flags & C2FrameData::FLAG_DROP_FRAME)) {
         ALOGV("Output buffer associated with work item %" PRIu64 " not returned yet",
               work.input.ordinal.frameIndex.peeku());
         return false;
@@ -1042,9 +1463,33 @@ void V4L2EncodeComponent::reportWork(std::unique_ptr<C2Work> work) {
     work->result = C2_OK;
     work->workletsProcessed = static_cast<uint32_t>(work->worklets.size());
 
-    std::list<std::unique_ptr<C2Work>> finishedWorkList;
-    finishedWorkList.emplace_back(std::move(work));
-    mListener->onWorkDone_nb(weak_from_this(), std::move(finishedWorkList));
+    auto startTime = mEncodeStartTimes.find(work->input.ordinal.frameIndex.peeku());
+    if (startTime != mEncodeStartTimes.end()) {
+        mStats->addLatency(::base::TimeTicks::Now() - startTime->second);
+        mEncodeStartTimes.erase(startTime);
+    }
+    if (mEncoder) {
+        mStats->setMemoryUsage(mEncoder->getMemoryUsage());
+        mStats->setBufferWaitTime(mEncoder->getBufferWaitTime());
+    }
+
+    // All the work items finished during the current task are reported in a single call.
+    mWorkDoneBatcher->add(std::move(work));
+
+    // The encoder is reconfigured for a new input layout once it encoded all the previous frames.
+    if (mInputLayoutChangePending && mWorkQueue.empty()) {
+        mEncoderTaskRunner->PostTask(
+                FROM_HERE,
+                ::base::BindOnce(&V4L2EncodeComponent::changeInputLayoutTask, mWeakThis));
+    }
+}
+
+void V4L2EncodeComponent::reportWorks(std::list<std::unique_ptr<C2Work>> works) {
+    ALOGV("%s(): Reporting %zu work items", __func__, works.size());
+    ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
+
+    for (const auto& work : works) ATRACE_ASYNC_END(mWorkTraceName.c_str(), getTraceCookie(*work));
+    mWorkReporter->reportWorks(mListener, weak_from_this(), std::move(works));
 }
 
 bool V4L2EncodeComponent::getBlockPool() {
@@ -1056,7 +1501,17 @@ bool V4L2EncodeComponent::getBlockPool() {
         return false;
     }
 
+    mOutputBlockIds.clear();
     C2BlockPool::local_id_t poolId = mInterface->getBlockPoolId();
+    if (poolId == C2BlockPool::BASIC_LINEAR && isOutputBlockRecyclingEnabled()) {
+        // The basic pool allocates and maps a new buffer for each frame. A pooled block pool hands
+        // the released buffers out again, it tracks their release across processes through the
+        // buffer pool so a buffer is never rewritten while the client still reads it.
+        c2_status_t status = CreateCodec2BlockPool(C2PlatformAllocatorStore::ION, sharedThis,
+                                                   &mOutputBlockPool);
+        if (status == C2_OK && mOutputBlockPool) return true;
+        ALOGW("Failed to create a pooled output block pool, error: %d", status);
+    }
     if (poolId == C2BlockPool::BASIC_LINEAR) {
         ALOGW("Using unoptimized linear block pool");
     }
@@ -1075,8 +1530,14 @@ void V4L2EncodeComponent::reportError(c2_status_t error) {
     // TODO(dstaessens): Report all pending work items as finished upon failure.
     std::lock_guard<std::mutex> lock(mComponentLock);
     if (mComponentState != ComponentState::ERROR) {
+        if (mWorkDoneBatcher) mWorkDoneBatcher->flush();
         setComponentState(ComponentState::ERROR);
-        mListener->onError_nb(weak_from_this(), static_cast<uint32_t>(error));
+        // The error follows the work items reported before, unless the encoder isn't started.
+        if (mWorkReporter) {
+            mWorkReporter->reportError(mListener, weak_from_this(), error);
+        } else {
+            mListener->onError_nb(weak_from_this(), static_cast<uint32_t>(error));
+        }
     }
 }
 
@@ -9,10 +9,14 @@
 
 #include <inttypes.h>
 #include <algorithm>
+#include <limits>
+#include <map>
+#include <mutex>
 
 #include <C2PlatformSupport.h>
 #include <SimpleC2Interface.h>
 #include <android/hardware/graphics/common/1.0/types.h>
+#include <cutils/properties.h>
 #include <media/stagefright/MediaDefs.h>
 #include <utils/Log.h>
 
@@ -38,14 +42,25 @@ constexpr float kDefaultFrameRate = 30.0;
 // The default output bitrate in bits per second. Use the max bitrate of AVC Level1.0 as default.
 constexpr uint32_t kDefaultBitrate = 64000;
 
+// The queue depths used for the supported pixel rates, when not overridden by property. Two
+// buffers are enough up to 1080p30, while 4K30 or 1080p120 need a third buffer to hide the
+// latency of returning encoded buffers to the client.
+constexpr uint64_t kQueueDepth3MinPixelRate = 1920ull * 1080 * 30 + 1;
+constexpr uint64_t kQueueDepth4MinPixelRate = 3840ull * 2160 * 30 + 1;
+constexpr uint32_t kMinQueueDepth = 2;
+
 // The maximal output bitrate in bits per second. It's the max bitrate of AVC Level4.1.
 // TODO: increase this in the future for supporting higher level/resolution encoding.
 constexpr uint32_t kMaxBitrate = 50000000;
 
+// The QP offsets of the regions of interest are limited to the H.264 and HEVC QP range.
+constexpr int32_t kMaxRegionOfInterestQpDelta = 51;
+
 std::optional<VideoCodec> getCodecFromComponentName(const std::string& name) {
     if (name == V4L2ComponentName::kH264Encoder) return VideoCodec::H264;
     if (name == V4L2ComponentName::kVP8Encoder) return VideoCodec::VP8;
     if (name == V4L2ComponentName::kVP9Encoder) return VideoCodec::VP9;
+    if (name == V4L2ComponentName::kHEVCEncoder) return VideoCodec::HEVC;
 
     ALOGE("Unknown name: %s", name.c_str());
     return std::nullopt;
@@ -61,11 +76,55 @@ bool IsValidProfileForCodec(VideoCodec codec, C2Config::profile_t profile) {
         return ((profile >= C2Config::PROFILE_VP8_0) && (profile <= C2Config::PROFILE_VP8_3));
     case VideoCodec::VP9:
         return ((profile >= C2Config::PROFILE_VP9_0) && (profile <= C2Config::PROFILE_VP9_3));
+    case VideoCodec::HEVC:
+        return ((profile >= C2Config::PROFILE_HEVC_MAIN) &&
+                (profile <= C2Config::PROFILE_HEVC_3D_MAIN));
     default:
         return false;
     }
 }
 
+// The capabilities of the encoders of a codec, as reported by the V4L2 devices.
+struct EncodeCapabilities {
+    // Note: unsigned int is used here, since std::vector<C2Config::profile_t> cannot convert to
+    // std::vector<unsigned int> required by the c2 framework.
+    std::vector<unsigned int> mProfiles;
+    ui::Size mMaxSize;
+};
+
+// Get the capabilities of the encoders of |codec|. They are only compiled from the device profiles
+// by the first interface of each codec, as the framework creates interfaces very often. Returns
+// nullptr if the V4L2 device can't be created.
+const EncodeCapabilities* getEncodeCapabilities(VideoCodec codec) {
+    static std::mutex sLock;
+    static std::map<VideoCodec, EncodeCapabilities> sCapabilities;
+
+    std::lock_guard<std::mutex> lock(sLock);
+    auto it = sCapabilities.find(codec);
+    if (it != sCapabilities.end()) return &it->second;
+
+    scoped_refptr<V4L2Device> device = V4L2Device::create();
+    if (!device) {
+        ALOGE("Failed to create V4L2 device");
+        return nullptr;
+    }
+
+    EncodeCapabilities capabilities;
+    for (const auto& supportedProfile : device->getSupportedEncodeProfiles()) {
+        if (!IsValidProfileForCodec(codec, supportedProfile.profile)) {
+            continue;  // Ignore unrecognizable or unsupported profiles.
+        }
+        ALOGV("Queried c2_profile = 0x%x : max_size = %d x %d", supportedProfile.profile,
+              supportedProfile.max_resolution.width, supportedProfile.max_resolution.height);
+        capabilities.mProfiles.push_back(static_cast<unsigned int>(supportedProfile.profile));
+        capabilities.mMaxSize.setWidth(
+                std::max(capabilities.mMaxSize.width, supportedProfile.max_resolution.width));
+        capabilities.mMaxSize.setHeight(
+                std::max(capabilities.mMaxSize.height, supportedProfile.max_resolution.height));
+    }
+    return &sCapabilities.emplace(codec, std::move(capabilities)).first->second;
+}
+
 }  // namespace
 
 // static
@@ -208,6 +267,74 @@ C2R V4L2EncodeInterface::VP9ProfileLevelSetter(
     return C2R::Ok();
 }
 
+C2R V4L2EncodeInterface::HEVCProfileLevelSetter(
+        bool /*mayBlock*/, C2P<C2StreamProfileLevelInfo::output>& info,
+        const C2P<C2StreamPictureSizeInfo::input>& videoSize,
+        const C2P<C2StreamFrameRateInfo::output>& frameRate,
+        const C2P<C2StreamBitrateInfo::output>& bitrate) {
+    // Adopt default minimal profile instead if the requested profile is not supported, or lower
+    // than the default minimal one.
+    constexpr C2Config::profile_t minProfile = C2Config::PROFILE_HEVC_MAIN;
+    if (!info.F(info.v.profile).supportsAtAll(info.v.profile) || info.v.profile < minProfile) {
+        if (info.F(info.v.profile).supportsAtAll(minProfile)) {
+            ALOGV("Set profile to default (%u) instead.", minProfile);
+            info.set().profile = minProfile;
+        } else {
+            ALOGE("Unable to set either requested profile (%u) or default profile (%u).",
+                  info.v.profile, minProfile);
+            return C2R(C2SettingResultBuilder::BadValue(info.F(info.v.profile)));
+        }
+    }
+
+    // Tables A.8 and A.9 in spec, main tier.
+    struct LevelLimits {
+        C2Config::level_t level;
+        uint64_t maxLumaSR;  // max luma sample rate in samples per second
+        uint64_t maxLumaPS;  // max luma picture size in samples
+        uint32_t maxBR;      // max video bitrate in bits per second
+    };
+    constexpr LevelLimits kLimits[] = {
+            {C2Config::LEVEL_HEVC_MAIN_1, 552960, 36864, 128000},
+            {C2Config::LEVEL_HEVC_MAIN_2, 3686400, 122880, 1500000},
+            {C2Config::LEVEL_HEVC_MAIN_2_1, 7372800, 245760, 3000000},
+            {C2Config::LEVEL_HEVC_MAIN_3, 16588800, 552960, 6000000},
+            {C2Config::LEVEL_HEVC_MAIN_3_1, 33177600, 983040, 10000000},
+            {C2Config::LEVEL_HEVC_MAIN_4, 66846720, 2228224, 12000000},
+            {C2Config::LEVEL_HEVC_MAIN_4_1, 133693440, 2228224, 20000000},
+            {C2Config::LEVEL_HEVC_MAIN_5, 267386880, 8912896, 25000000},
+            {C2Config::LEVEL_HEVC_MAIN_5_1, 534773760, 8912896, 40000000},
+            {C2Config::LEVEL_HEVC_MAIN_5_2, 1069547520, 8912896, 60000000},
+            {C2Config::LEVEL_HEVC_MAIN_6, 1069547520, 35651584, 60000000},
+            {C2Config::LEVEL_HEVC_MAIN_6_1, 2139095040, 35651584, 120000000},
+            {C2Config::LEVEL_HEVC_MAIN_6_2, 4278190080, 35651584, 240000000},
+    };
+
+    uint64_t targetPS = static_cast<uint64_t>(videoSize.v.width) * videoSize.v.height;
+    uint64_t targetSR = static_cast<uint64_t>(targetPS * frameRate.v.value);
+
+    // Update the level to the lowest level meeting the requirements, if the supplied level is not
+    // supported or doesn't meet them.
+    const bool supported = info.F(info.v.level).supportsAtAll(info.v.level);
+    for (const LevelLimits& limit : kLimits) {
+        if (!info.F(info.v.level).supportsAtAll(limit.level)) {
+            continue;
+        }
+        if (targetPS <= limit.maxLumaPS && targetSR <= limit.maxLumaSR &&
+            bitrate.v.value <= limit.maxBR) {
+            if (!supported || info.v.level < limit.level) {
+                ALOGD("Given level %u does not cover current configuration: adjusting to %u",
+                      info.v.level, limit.level);
+                info.set().level = limit.level;
+            }
+            return C2R::Ok();
+        }
+    }
+
+    ALOGE("Unable to find proper level with current config, requested level (%u).",
+          info.v.level);
+    return C2R(C2SettingResultBuilder::BadValue(info.F(info.v.level)));
+}
+
 // static
 C2R V4L2EncodeInterface::SizeSetter(bool mayBlock, C2P<C2StreamPictureSizeInfo::input>& videoSize) {
     (void)mayBlock;
@@ -217,6 +344,14 @@ C2R V4L2EncodeInterface::SizeSetter(bool mayBlock, C2P<C2StreamPictureSizeInfo::
             .plus(videoSize.F(videoSize.v.height).validatePossible(videoSize.v.height));
 }
 
+// static
+C2R V4L2EncodeInterface::ThreadPolicySetter(bool mayBlock, C2P<C2V4L2ThreadPolicyTuning>& me) {
+    (void)mayBlock;
+    return me.F(me.v.priority)
+            .validatePossible(me.v.priority)
+            .plus(me.F(me.v.cluster).validatePossible(me.v.cluster));
+}
+
 // static
 C2R V4L2EncodeInterface::IntraRefreshPeriodSetter(bool mayBlock,
                                                   C2P<C2StreamIntraRefreshTuning::output>& period) {
@@ -231,6 +366,41 @@ C2R V4L2EncodeInterface::IntraRefreshPeriodSetter(bool mayBlock,
     return C2R::Ok();
 }
 
+// static
+C2R V4L2EncodeInterface::TemporalLayeringSetter(
+        bool mayBlock, C2P<C2StreamTemporalLayeringTuning::output>& layering) {
+    (void)mayBlock;
+    if (layering.v.m.layerCount > kMaxTemporalLayers) {
+        layering.set().m.layerCount = kMaxTemporalLayers;
+    }
+    // Only hierarchical P layers are supported, as the encoder doesn't produce B frames.
+    layering.set().m.bLayerCount = 0;
+    // Keep the cumulative bitrate ratios monotonic and clamped to 1.
+    for (size_t i = 0; i < layering.v.flexCount() && i + 1 < layering.v.m.layerCount; i++) {
+        float ratio = std::clamp(layering.v.m.bitrateRatios[i], 0.f, 1.f);
+        if (i > 0) ratio = std::max(ratio, layering.v.m.bitrateRatios[i - 1]);
+        layering.set().m.bitrateRatios[i] = ratio;
+    }
+    return C2R::Ok();
+}
+
+// static
+C2R V4L2EncodeInterface::RegionsOfInterestSetter(
+        bool mayBlock, C2P<C2V4L2RegionsOfInterestTuning::input>& regions) {
+    (void)mayBlock;
+    for (size_t i = 0; i < regions.v.flexCount(); i++) {
+        C2V4L2RegionOfInterestStruct& region = regions.set().m.values[i];
+        // The regions must not overflow the coordinate range, so their edges can be computed.
+        region.width = std::clamp(region.width, 0,
+                                  std::numeric_limits<int32_t>::max() - std::max(region.left, 0));
+        region.height = std::clamp(region.height, 0,
+                                   std::numeric_limits<int32_t>::max() - std::max(region.top, 0));
+        region.qpDelta = std::clamp(region.qpDelta, -kMaxRegionOfInterestQpDelta,
+                                    kMaxRegionOfInterestQpDelta);
+    }
+    return C2R::Ok();
+}
+
 V4L2EncodeInterface::V4L2EncodeInterface(const C2String& name,
                                          std::shared_ptr<C2ReflectorHelper> helper)
       : C2InterfaceHelper(std::move(helper)) {
@@ -242,13 +412,6 @@ V4L2EncodeInterface::V4L2EncodeInterface(const C2String& name,
 }
 
 void V4L2EncodeInterface::Initialize(const C2String& name) {
-    scoped_refptr<V4L2Device> device = V4L2Device::create();
-    if (!device) {
-        ALOGE("Failed to create V4L2 device");
-        mInitStatus = C2_CORRUPTED;
-        return;
-    }
-
     auto codec = getCodecFromComponentName(name);
     if (!codec) {
         ALOGE("Invalid component name");
@@ -256,23 +419,13 @@ void V4L2EncodeInterface::Initialize(const C2String& name) {
         return;
     }
 
-    V4L2Device::SupportedEncodeProfiles supported_profiles = device->getSupportedEncodeProfiles();
-
-    // Compile the list of supported profiles.
-    // Note: unsigned int is used here, since std::vector<C2Config::profile_t> cannot convert to
-    // std::vector<unsigned int> required by the c2 framework below.
-    std::vector<unsigned int> profiles;
-    ui::Size maxSize;
-    for (const auto& supportedProfile : supported_profiles) {
-        if (!IsValidProfileForCodec(codec.value(), supportedProfile.profile)) {
-            continue;  // Ignore unrecognizable or unsupported profiles.
-        }
-        ALOGV("Queried c2_profile = 0x%x : max_size = %d x %d", supportedProfile.profile,
-              supportedProfile.max_resolution.width, supportedProfile.max_resolution.height);
-        profiles.push_back(static_cast<unsigned int>(supportedProfile.profile));
-        maxSize.setWidth(std::max(maxSize.width, supportedProfile.max_resolution.width));
-        maxSize.setHeight(std::max(maxSize.height, supportedProfile.max_resolution.height));
+    const EncodeCapabilities* capabilities = getEncodeCapabilities(codec.value());
+    if (!capabilities) {
+        mInitStatus = C2_CORRUPTED;
+        return;
     }
+    const std::vector<unsigned int>& profiles = capabilities->mProfiles;
+    const ui::Size& maxSize = capabilities->mMaxSize;
 
     if (profiles.empty()) {
         ALOGE("No supported profiles");
@@ -371,6 +524,33 @@ void V4L2EncodeInterface::Initialize(const C2String& name) {
                                                  C2Config::LEVEL_VP9_6_2})})
                         .withSetter(VP9ProfileLevelSetter, mInputVisibleSize, mFrameRate, mBitrate)
                         .build());
+    } else if (getCodecFromComponentName(name) == VideoCodec::HEVC) {
+        outputMime = MEDIA_MIMETYPE_VIDEO_HEVC;
+        C2Config::profile_t minProfile = static_cast<C2Config::profile_t>(
+                *std::min_element(profiles.begin(), profiles.end()));
+        addParameter(
+                DefineParam(mProfileLevel, C2_PARAMKEY_PROFILE_LEVEL)
+                        .withDefault(new C2StreamProfileLevelInfo::output(
+                                0u, minProfile, C2Config::LEVEL_HEVC_MAIN_4_1))
+                        .withFields(
+                                {C2F(mProfileLevel, profile).oneOf(profiles),
+                                 C2F(mProfileLevel, level)
+                                         .oneOf({C2Config::LEVEL_HEVC_MAIN_1,
+                                                 C2Config::LEVEL_HEVC_MAIN_2,
+                                                 C2Config::LEVEL_HEVC_MAIN_2_1,
+                                                 C2Config::LEVEL_HEVC_MAIN_3,
+                                                 C2Config::LEVEL_HEVC_MAIN_3_1,
+                                                 C2Config::LEVEL_HEVC_MAIN_4,
+                                                 C2Config::LEVEL_HEVC_MAIN_4_1,
+                                                 C2Config::LEVEL_HEVC_MAIN_5,
+                                                 C2Config::LEVEL_HEVC_MAIN_5_1,
+                                                 C2Config::LEVEL_HEVC_MAIN_5_2,
+                                                 C2Config::LEVEL_HEVC_MAIN_6,
+                                                 C2Config::LEVEL_HEVC_MAIN_6_1,
+                                                 C2Config::LEVEL_HEVC_MAIN_6_2})})
+                        .withSetter(HEVCProfileLevelSetter, mInputVisibleSize, mFrameRate,
+                                    mBitrate)
+                        .build());
     } else {
         ALOGE("Unsupported component name: %s", name.c_str());
         mInitStatus = C2_BAD_VALUE;
@@ -431,6 +611,29 @@ void V4L2EncodeInterface::Initialize(const C2String& name) {
                          .withSetter(Setter<decltype(*mKeyFramePeriodUs)>::StrictValueWithNoDeps)
                          .build());
 
+    addParameter(
+            DefineParam(mTemporalLayering, C2_PARAMKEY_TEMPORAL_LAYERING)
+                    .withDefault(C2StreamTemporalLayeringTuning::output::AllocShared(0u, 0u, 0, 0))
+                    .withFields(
+                            {C2F(mTemporalLayering, m.layerCount).inRange(0, kMaxTemporalLayers),
+                             C2F(mTemporalLayering, m.bLayerCount).inRange(0, 0),
+                             C2F(mTemporalLayering, m.bitrateRatios).inRange(0., 1.)})
+                    .withSetter(TemporalLayeringSetter)
+                    .build());
+
+    addParameter(
+            DefineParam(mRegionsOfInterest, C2_PARAMKEY_V4L2_REGIONS_OF_INTEREST)
+                    .withDefault(C2V4L2RegionsOfInterestTuning::input::AllocShared(0u, 0u))
+                    .withFields({C2F(mRegionsOfInterest, m.values[0].left).any(),
+                                 C2F(mRegionsOfInterest, m.values[0].top).any(),
+                                 C2F(mRegionsOfInterest, m.values[0].width).any(),
+                                 C2F(mRegionsOfInterest, m.values[0].height).any(),
+                                 C2F(mRegionsOfInterest, m.values[0].qpDelta)
+                                         .inRange(-kMaxRegionOfInterestQpDelta,
+                                                  kMaxRegionOfInterestQpDelta)})
+                    .withSetter(RegionsOfInterestSetter)
+                    .build());
+
     C2Allocator::id_t inputAllocators[] = {kDefaultInputAllocator};
 
     C2Allocator::id_t outputAllocators[] = {kDefaultOutputAllocator};
@@ -455,6 +658,21 @@ void V4L2EncodeInterface::Initialize(const C2String& name) {
                     .withSetter(Setter<C2PortBlockPoolsTuning::output>::NonStrictValuesWithNoDeps)
                     .build());
 
+    const ThreadPolicy threadPolicy = ThreadPolicy::getDefault(V4L2Device::Type::kEncoder);
+    addParameter(
+            DefineParam(mThreadPolicy, C2_PARAMKEY_V4L2_THREAD_POLICY)
+                    .withDefault(new C2V4L2ThreadPolicyTuning(
+                            static_cast<uint32_t>(threadPolicy.mPriority),
+                            static_cast<uint32_t>(threadPolicy.mCluster)))
+                    .withFields({C2F(mThreadPolicy, priority)
+                                         .inRange(0, static_cast<uint32_t>(
+                                                             ThreadPolicy::Priority::kRealtime)),
+                                 C2F(mThreadPolicy, cluster)
+                                         .inRange(0, static_cast<uint32_t>(
+                                                             ThreadPolicy::Cluster::kBig))})
+                    .withSetter(ThreadPolicySetter)
+                    .build());
+
     mInitStatus = C2_OK;
 }
 
@@ -466,4 +684,62 @@ uint32_t V4L2EncodeInterface::getKeyFramePeriod() const {
     return static_cast<uint32_t>(std::max(std::min(std::round(period), double(UINT32_MAX)), 1.));
 }
 
+uint32_t V4L2EncodeInterface::getIntraRefreshPeriod() const {
+    if (mIntraRefreshPeriod->mode != C2Config::INTRA_REFRESH_ARBITRARY) return 0;
+    return static_cast<uint32_t>(std::max(std::round(mIntraRefreshPeriod->period), 1.f));
+}
+
+std::vector<float> V4L2EncodeInterface::getTemporalLayerBitrateRatios() const {
+    // Layers without a requested ratio get an even share of the bitrate left by the lower layers.
+    const uint32_t layerCount = getTemporalLayerCount();
+    std::vector<float> ratios;
+    for (uint32_t i = 0; i + 1 < layerCount; i++) {
+        if (i < mTemporalLayering->flexCount()) {
+            ratios.push_back(mTemporalLayering->m.bitrateRatios[i]);
+        } else {
+            const float lower = ratios.empty() ? 0.f : ratios.back();
+            ratios.push_back(lower + (1.f - lower) / (layerCount - i));
+        }
+    }
+    return ratios;
+}
+
+std::vector<C2V4L2RegionOfInterestStruct> V4L2EncodeInterface::getRegionsOfInterest() const {
+    return std::vector<C2V4L2RegionOfInterestStruct>(
+            mRegionsOfInterest->m.values,
+            mRegionsOfInterest->m.values + mRegionsOfInterest->flexCount());
+}
+
+uint32_t V4L2EncodeInterface::getQueueDepth() const {
+    static const int32_t kQueueDepthOverride =
+            property_get_int32("ro.vendor.v4l2_codec2.encode_queue_depth", 0);
+    if (kQueueDepthOverride > 0) {
+        return std::max(static_cast<uint32_t>(kQueueDepthOverride), kMinQueueDepth);
+    }
+
+    const uint64_t pixelRate = static_cast<uint64_t>(mInputVisibleSize->width) *
+                               mInputVisibleSize->height *
+                               static_cast<uint64_t>(std::max(std::round(mFrameRate->value), 1.f));
+    if (pixelRate >= kQueueDepth4MinPixelRate) return 4;
+    if (pixelRate >= kQueueDepth3MinPixelRate) return 3;
+    return kMinQueueDepth;
+}
+
+bool V4L2EncodeInterface::isQueueDepthAdaptive() const {
+    static const bool kAdaptive =
+            property_get_bool("ro.vendor.v4l2_codec2.encode_adaptive_queue_depth", false);
+    return kAdaptive;
+}
+
+bool V4L2EncodeInterface::isOutputBufferRightSized() const {
+    static const bool kRightSized =
+            property_get_bool("ro.vendor.v4l2_codec2.encode_right_sized_output_buffers", false);
+    return kRightSized;
+}
+
+ThreadPolicy V4L2EncodeInterface::getThreadPolicy() const {
+    return ThreadPolicy{static_cast<ThreadPolicy::Priority>(mThreadPolicy->priority),
+                        static_cast<ThreadPolicy::Cluster>(mThreadPolicy->cluster)};
+}
+
 }  // namespace android
@@ -8,25 +8,38 @@
 #include <v4l2_codec2/components/V4L2Encoder.h>
 
 #include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <limits>
 #include <optional>
 #include <vector>
 
 #include <base/bind.h>
 #include <base/files/scoped_file.h>
 #include <base/memory/ptr_util.h>
+#include <cutils/properties.h>
 #include <log/log.h>
 #include <ui/Rect.h>
 
 #include <v4l2_codec2/common/EncodeHelpers.h>
 #include <v4l2_codec2/common/Fourcc.h>
 #include <v4l2_codec2/common/V4L2Device.h>
+#include <v4l2_codec2/common/V4L2DevicePool.h>
 #include <v4l2_codec2/components/BitstreamBuffer.h>
+#include <v4l2_codec2/components/PerformanceHintSession.h>
 
 namespace android {
 
-namespace {
+// The element layout of the vendor region of interest array control, see getRoiCtrlId().
+struct V4L2RoiRegion {
+    int32_t left;
+    int32_t top;
+    uint32_t width;
+    uint32_t height;
+    int32_t qpDelta;
+};
 
-const VideoPixelFormat kInputPixelFormat = VideoPixelFormat::NV12;
+namespace {
 
 // The maximum size for output buffer, which is chosen empirically for a 1080p video.
 constexpr size_t kMaxBitstreamBufferSizeInBytes = 2 * 1024 * 1024;  // 2MB
@@ -48,29 +61,90 @@ size_t GetMaxOutputBufferSize(const ui::Size& size) {
 #ifndef V4L2_CID_MPEG_VIDEO_PREPEND_SPSPPS_TO_IDR
 #define V4L2_CID_MPEG_VIDEO_PREPEND_SPSPPS_TO_IDR (V4L2_CID_MPEG_BASE + 644)
 #endif
+// Define V4L2_CID_MPEG_VIDEO_H264_HIER_CODING_L0_BR control code if not present in header files.
+// The bitrate controls of the higher layers follow consecutively.
+#ifndef V4L2_CID_MPEG_VIDEO_H264_HIER_CODING_L0_BR
+#define V4L2_CID_MPEG_VIDEO_H264_HIER_CODING_L0_BR (V4L2_CID_MPEG_BASE + 391)
+#endif
+// Define the V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD controls if not present in header files.
+#ifndef V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD
+#define V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD (V4L2_CID_MPEG_BASE + 236)
+#endif
+#ifndef V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD_TYPE
+#define V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD_TYPE (V4L2_CID_MPEG_BASE + 237)
+#define V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD_TYPE_CYCLIC 1
+#endif
+
+// The right-sized output buffers hold key frames of |kKeyFrameSizeFactor| times the average frame
+// size at the target bitrate, which is typical of constant bitrate encoding, and are never smaller
+// than |kMinRightSizedBufferSize|. The frame rate is assumed to be |kDefaultFramerate| until set.
+constexpr uint64_t kKeyFrameSizeFactor = 8;
+constexpr uint64_t kMinRightSizedBufferSize = 64 * 1024;  // 64KB
+constexpr uint32_t kDefaultFramerate = 30;
+
+// The number of frames over which buffer starvation is measured in adaptive queue depth mode.
+constexpr uint32_t kQueueDepthWindowFrames = 30;
+
+// The headroom requested in front of the encoded data of each output buffer when SPS and PPS need
+// to be injected before IDR frames, so they can be written in place. This is enough for the
+// parameter sets of all the H.264 profiles the encoder produces.
+constexpr size_t kParamsHeadroom = 128;
+
+// The number of consecutive non-key frames without parameter sets after which the device is assumed
+// to only send SPS and PPS with key frames, and non-key frames are not scanned anymore.
+constexpr uint32_t kNonKeyFramesWithoutParamsThreshold = 30;
+
+// Get the id of the vendor array control taking the regions of interest of the next frames, as
+// V4L2RoiRegion elements with a width of 0 for the unused ones. 0 if the device has none.
+uint32_t getRoiCtrlId() {
+    static const uint32_t kCtrlId = static_cast<uint32_t>(
+            property_get_int32("ro.vendor.v4l2_codec2.encode_roi_ctrl", 0));
+    return kCtrlId;
+}
+
+// Get a bitstream buffer referring to the data at |offset| in the block of |buffer|.
+std::unique_ptr<BitstreamBuffer> withDataOffset(std::unique_ptr<BitstreamBuffer> buffer,
+                                                size_t offset) {
+    if (buffer->offset == offset) return buffer;
+    auto newBuffer =
+            std::make_unique<BitstreamBuffer>(std::move(buffer->dmabuf), offset, buffer->size);
+    newBuffer->temporalLayer = buffer->temporalLayer;
+    return newBuffer;
+}
 
 }  // namespace
 
 // static
 std::unique_ptr<VideoEncoder> V4L2Encoder::create(
         C2Config::profile_t outputProfile, std::optional<uint8_t> level,
-        const ui::Size& visibleSize, uint32_t stride, uint32_t keyFramePeriod,
-        C2Config::bitrate_mode_t bitrateMode, uint32_t bitrate, std::optional<uint32_t> peakBitrate,
-        FetchOutputBufferCB fetchOutputBufferCb, InputBufferDoneCB inputBufferDoneCb,
-        OutputBufferDoneCB outputBufferDoneCb, DrainDoneCB drainDoneCb, ErrorCB errorCb,
+        const ui::Size& visibleSize, VideoPixelFormat inputFormat, uint32_t stride,
+        uint32_t keyFramePeriod, uint32_t intraRefreshPeriod, C2Config::bitrate_mode_t bitrateMode,
+        uint32_t bitrate, std::optional<uint32_t> peakBitrate, size_t queueDepth,
+        bool adaptiveQueueDepth, bool rightSizedOutputBuffers, uint32_t numTemporalLayers,
+        std::vector<float> temporalLayerBitrateRatios, FetchOutputBufferCB fetchOutputBufferCb,
+        InputBufferDoneCB inputBufferDoneCb, OutputBufferDoneCB outputBufferDoneCb,
+        DrainDoneCB drainDoneCb, ErrorCB errorCb,
         scoped_refptr<::base::SequencedTaskRunner> taskRunner) {
     ALOGV("%s()", __func__);
 
     std::unique_ptr<V4L2Encoder> encoder = ::base::WrapUnique<V4L2Encoder>(new V4L2Encoder(
             std::move(taskRunner), std::move(fetchOutputBufferCb), std::move(inputBufferDoneCb),
             std::move(outputBufferDoneCb), std::move(drainDoneCb), std::move(errorCb)));
-    if (!encoder->initialize(outputProfile, level, visibleSize, stride, keyFramePeriod, bitrateMode,
-                             bitrate, peakBitrate)) {
+    if (!encoder->initialize(outputProfile, level, visibleSize, inputFormat, stride, keyFramePeriod,
+                             intraRefreshPeriod, bitrateMode, bitrate, peakBitrate, queueDepth,
+                             adaptiveQueueDepth, rightSizedOutputBuffers, numTemporalLayers,
+                             std::move(temporalLayerBitrateRatios))) {
         return nullptr;
     }
     return encoder;
 }
 
+// static
+size_t V4L2Encoder::getMaxQueueDepth(size_t queueDepth, bool adaptiveQueueDepth) {
+    if (adaptiveQueueDepth) return kMaxQueueDepth;
+    return std::clamp(queueDepth, kInputBufferCount, kMaxQueueDepth);
+}
+
 V4L2Encoder::V4L2Encoder(scoped_refptr<::base::SequencedTaskRunner> taskRunner,
                          FetchOutputBufferCB fetchOutputBufferCb,
                          InputBufferDoneCB inputBufferDoneCb, OutputBufferDoneCB outputBufferDoneCb,
@@ -152,15 +226,27 @@ void V4L2Encoder::flush() {
     handleFlushRequest();
 }
 
+size_t V4L2Encoder::getMemoryUsage() const {
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    size_t usage = 0;
+    if (mInputQueue) usage += mInputQueue->getMemoryUsage();
+    if (mOutputQueue) usage += mOutputQueue->getMemoryUsage();
+    return usage;
+}
+
 bool V4L2Encoder::setBitrate(uint32_t bitrate) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
 
-    if (!mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG,
-                              {V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_BITRATE, bitrate)})) {
+    if (!setCtrl(V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_BITRATE, bitrate))) {
         ALOGE("Setting bitrate to %u failed", bitrate);
         return false;
     }
+    mBitrate = bitrate;
+    // The layers are only known to be supported once the device is configured.
+    if (mState != State::UNINITIALIZED) setTemporalLayerBitrates(bitrate);
+    updateOutputBufferSize();
     return true;
 }
 
@@ -168,8 +254,7 @@ bool V4L2Encoder::setPeakBitrate(uint32_t peakBitrate) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
 
-    if (!mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG,
-                              {V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_BITRATE_PEAK, peakBitrate)})) {
+    if (!setCtrl(V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_BITRATE_PEAK, peakBitrate))) {
         // TODO(b/190336806): Our stack doesn't support dynamic peak bitrate changes yet, ignore
         // errors for now.
         ALOGW("Setting peak bitrate to %u failed", peakBitrate);
@@ -190,9 +275,36 @@ bool V4L2Encoder::setFramerate(uint32_t framerate) {
         ALOGE("Setting framerate to %u failed", framerate);
         return false;
     }
+    mFramerate = framerate;
+    updateOutputBufferSize();
     return true;
 }
 
+bool V4L2Encoder::setRegionsOfInterest(std::vector<RegionOfInterest> regions) {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mRoiRegions.empty()) return false;
+
+    if (regions.size() > mRoiRegions.size()) {
+        ALOGW("Only %zu of the %zu regions of interest are supported", mRoiRegions.size(),
+              regions.size());
+        regions.resize(mRoiRegions.size());
+    }
+
+    // The staged control points to |mRoiRegions|, which is only updated in place.
+    const Rect frame(mVisibleSize.width, mVisibleSize.height);
+    std::fill(mRoiRegions.begin(), mRoiRegions.end(), V4L2RoiRegion{});
+    for (size_t i = 0; i < regions.size(); i++) {
+        Rect rect;
+        if (!regions[i].rect.intersect(frame, &rect)) continue;
+        mRoiRegions[i] = {rect.left, rect.top, static_cast<uint32_t>(rect.getWidth()),
+                          static_cast<uint32_t>(rect.getHeight()), regions[i].qpDelta};
+    }
+    return setCtrl(V4L2ExtCtrl(getRoiCtrlId(), mRoiRegions.data(),
+                               mRoiRegions.size() * sizeof(V4L2RoiRegion)));
+}
+
 void V4L2Encoder::requestKeyframe() {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
@@ -200,21 +312,54 @@ void V4L2Encoder::requestKeyframe() {
     mKeyFrameCounter = 0;
 }
 
+bool V4L2Encoder::isInputFormatSupported(VideoPixelFormat format) const {
+    return std::find(mSupportedInputFormats.begin(), mSupportedInputFormats.end(), format) !=
+           mSupportedInputFormats.end();
+}
+
+bool V4L2Encoder::isInputLayoutSupported(const VideoFramePlanes& planes) const {
+    if (!mInputLayout || planes.size() != mInputLayout->mPlanes.size()) return false;
+
+    // The strides are set once with the format, but the offset of each V4L2 plane is set for each
+    // buffer. The color planes without a V4L2 plane of their own lie at a fixed offset from the
+    // first one.
+    for (size_t i = 0; i < planes.size(); ++i) {
+        if (planes[i].mStride != mInputLayout->mPlanes[i].mStride) return false;
+        if (!mInputLayout->mMultiPlanar && i > 0 &&
+            (planes[i].mOffset < planes[0].mOffset ||
+             planes[i].mOffset - planes[0].mOffset != mInputLayout->mPlanes[i].mOffset)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 VideoPixelFormat V4L2Encoder::inputFormat() const {
     return mInputLayout ? mInputLayout.value().mFormat : VideoPixelFormat::UNKNOWN;
 }
 
 bool V4L2Encoder::initialize(C2Config::profile_t outputProfile, std::optional<uint8_t> level,
-                             const ui::Size& visibleSize, uint32_t stride, uint32_t keyFramePeriod,
+                             const ui::Size& visibleSize, VideoPixelFormat inputFormat,
+                             uint32_t stride, uint32_t keyFramePeriod, uint32_t intraRefreshPeriod,
                              C2Config::bitrate_mode_t bitrateMode, uint32_t bitrate,
-                             std::optional<uint32_t> peakBitrate) {
+                             std::optional<uint32_t> peakBitrate, size_t queueDepth,
+                             bool adaptiveQueueDepth, bool rightSizedOutputBuffers,
+                             uint32_t numTemporalLayers,
+                             std::vector<float> temporalLayerBitrateRatios) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
-    ALOG_ASSERT(keyFramePeriod > 0);
 
     mVisibleSize = visibleSize;
     mKeyFramePeriod = keyFramePeriod;
+    mIntraRefreshPeriod = intraRefreshPeriod;
     mKeyFrameCounter = 0;
+    mQueueDepth = std::clamp(queueDepth, kInputBufferCount, kMaxQueueDepth);
+    mMaxQueueDepth = getMaxQueueDepth(queueDepth, adaptiveQueueDepth);
+    ALOGV("Using queue depth %zu (max: %zu)", mQueueDepth, mMaxQueueDepth);
+    mRightSizedOutputBuffers = rightSizedOutputBuffers;
+    mNumTemporalLayers = std::clamp(numTemporalLayers, 1u, kMaxTemporalLayers);
+    mTemporalLayerBitrateRatios = std::move(temporalLayerBitrateRatios);
+    mTemporalLayerBitrateRatios.resize(mNumTemporalLayers - 1, 1.f);
 
     // Open the V4L2 device for encoding to the requested output format.
     // TODO(dstaessens): Avoid conversion to VideoCodecProfile and use C2Config::profile_t directly.
@@ -224,13 +369,8 @@ bool V4L2Encoder::initialize(C2Config::profile_t outputProfile, std::optional<ui
         return false;
     }
 
-    mDevice = V4L2Device::create();
+    mDevice = V4L2DevicePool::get()->acquire(V4L2Device::Type::kEncoder, outputPixelFormat);
     if (!mDevice) {
-        ALOGE("Failed to create V4L2 device");
-        return false;
-    }
-
-    if (!mDevice->open(V4L2Device::Type::kEncoder, outputPixelFormat)) {
         ALOGE("Failed to open device for profile %s (%s)", profileToString(outputProfile),
               fourccToString(outputPixelFormat).c_str());
         return false;
@@ -255,6 +395,23 @@ bool V4L2Encoder::initialize(C2Config::profile_t outputProfile, std::optional<ui
         return false;
     }
 
+    // Query the input formats the device can import directly, so the client can avoid a format
+    // conversion when its native format is supported. Both the multi-planar and single-planar
+    // formats are queried, as configureInputFormat() tries both.
+    for (v4l2_buf_type bufType : {V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, V4L2_BUF_TYPE_VIDEO_OUTPUT}) {
+        for (uint32_t pixfmt : mDevice->enumerateSupportedPixelformats(bufType)) {
+            std::optional<Fourcc> fourcc = Fourcc::fromV4L2PixFmt(pixfmt);
+            // The tiled MT21 and MM21 formats map to NV12, but don't share its memory layout.
+            if (!fourcc || *fourcc == Fourcc(Fourcc::MT21) || *fourcc == Fourcc(Fourcc::MM21)) {
+                continue;
+            }
+            const VideoPixelFormat format = fourcc->toVideoPixelFormat();
+            if (format != VideoPixelFormat::UNKNOWN && !isInputFormatSupported(format)) {
+                mSupportedInputFormats.push_back(format);
+            }
+        }
+    }
+
     // Configure the requested bitrate mode and bitrate on the device.
     if (!configureBitrateMode(bitrateMode) || !setBitrate(bitrate)) return false;
 
@@ -267,13 +424,14 @@ bool V4L2Encoder::initialize(C2Config::profile_t outputProfile, std::optional<ui
 
     // Configure the input format. If the device doesn't support the specified format we'll use one
     // of the device's preferred formats in combination with an input format convertor.
-    if (!configureInputFormat(kInputPixelFormat, stride)) return false;
+    if (!configureInputFormat(inputFormat, stride)) return false;
 
     // Create input and output buffers.
     if (!createInputBuffers() || !createOutputBuffers()) return false;
 
     // Configure the device, setting all required controls.
     if (!configureDevice(outputProfile, level)) return false;
+    configureRegionsOfInterest();
 
     // We're ready to start encoding now.
     setState(State::WAITING_FOR_INPUT_FRAME);
@@ -303,22 +461,25 @@ void V4L2Encoder::handleEncodeRequest() {
     // Note: The input buffers are not copied into the device's input buffers, but rather a memory
     // pointer is imported. We still have to throttle the number of enqueues queued simultaneously
     // on the device however.
-    if (mInputQueue->freeBuffersCount() == 0) {
+    if (mInputQueue->freeBuffersCount() == 0 || mInputQueue->queuedBuffersCount() >= mQueueDepth) {
         ALOGV("Waiting for device to return input buffers");
+        if (!mFrontRequestWaited) {
+            mFrontRequestWaited = true;
+            mNumWindowBufferWaits++;
+        }
         setState(State::WAITING_FOR_V4L2_BUFFER);
         return;
     }
 
-    // Request the next frame to be a key frame each time the counter reaches 0.
-    if (mKeyFrameCounter == 0) {
-        if (!mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG,
-                                  {V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME)})) {
-            ALOGE("Failed requesting key frame");
-            onError();
-            return;
-        }
+    // Request the next frame to be a key frame each time the counter reaches 0. The request is set
+    // on the device together with the parameter changes staged since the previous frame.
+    if (mKeyFrameCounter == 0) setCtrl(V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME));
+    if (!applyStagedCtrls()) {
+        ALOGE("Failed setting the controls of the next frame");
+        onError();
+        return;
     }
-    mKeyFrameCounter = (mKeyFrameCounter + 1) % mKeyFramePeriod;
+    mKeyFrameCounter = mKeyFramePeriod > 0 ? (mKeyFrameCounter + 1) % mKeyFramePeriod : 1;
 
     // Enqueue the input frame in the V4L2 device.
     uint64_t index = encodeRequest.video_frame->index();
@@ -331,6 +492,8 @@ void V4L2Encoder::handleEncodeRequest() {
         return;
     }
     mEncodeRequests.pop();
+    mFrontRequestWaited = false;
+    if (mMaxQueueDepth > mQueueDepth) adaptQueueDepth();
 
     // Start streaming and polling on the input and output queue if required.
     if (!mInputQueue->isStreaming()) {
@@ -344,7 +507,8 @@ void V4L2Encoder::handleEncodeRequest() {
     }
 
     // Queue buffers on output queue. These buffers will be used to store the encoded bitstream.
-    while (mOutputQueue->freeBuffersCount() > 0) {
+    while (mOutputQueue->freeBuffersCount() > 0 &&
+           mOutputQueue->queuedBuffersCount() < mQueueDepth) {
         if (!enqueueOutputBuffer()) return;
     }
 
@@ -364,6 +528,21 @@ void V4L2Encoder::handleEncodeRequest() {
                           ::base::BindOnce(&V4L2Encoder::handleEncodeRequest, mWeakThis));
 }
 
+void V4L2Encoder::adaptQueueDepth() {
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (++mNumWindowFrames < kQueueDepthWindowFrames) return;
+
+    // Waiting for the device on most frames means the client produces frames faster than they
+    // travel through the device queue, one more buffer in flight lets the device catch up.
+    if (mNumWindowBufferWaits * 2 > mNumWindowFrames) {
+        mQueueDepth++;
+        ALOGV("Increased queue depth to %zu", mQueueDepth);
+    }
+    mNumWindowFrames = 0;
+    mNumWindowBufferWaits = 0;
+}
+
 void V4L2Encoder::handleFlushRequest() {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
@@ -384,6 +563,7 @@ void V4L2Encoder::handleFlushRequest() {
     while (!mEncodeRequests.empty()) {
         mEncodeRequests.pop();
     }
+    mFrontRequestWaited = false;
     for (auto& buf : mInputBuffers) {
         buf = nullptr;
     }
@@ -461,11 +641,15 @@ bool V4L2Encoder::configureInputFormat(VideoPixelFormat inputFormat, uint32_t st
     ALOG_ASSERT(!mInputQueue->isStreaming());
     ALOG_ASSERT(!isEmpty(mVisibleSize));
 
-    // First try to use the requested pixel format directly.
+    // First try to use the requested pixel format directly, using either the multi-planar or the
+    // single-planar variant.
     std::optional<struct v4l2_format> format;
-    auto fourcc = Fourcc::fromVideoPixelFormat(inputFormat, false);
-    if (fourcc) {
-        format = mInputQueue->setFormat(fourcc->toV4L2PixFmt(), mVisibleSize, 0, stride);
+    for (bool singlePlanar : {false, true}) {
+        auto fourcc = Fourcc::fromVideoPixelFormat(inputFormat, singlePlanar);
+        if (fourcc) {
+            format = mInputQueue->setFormat(fourcc->toV4L2PixFmt(), mVisibleSize, 0, stride);
+        }
+        if (format) break;
     }
 
     // If the device doesn't support the requested input format we'll try the device's preferred
@@ -513,6 +697,7 @@ bool V4L2Encoder::configureInputFormat(VideoPixelFormat inputFormat, uint32_t st
     uint32_t AdjustedOutputBufferSize = outputFormat.first->fmt.pix_mp.plane_fmt[0].sizeimage;
     if (mOutputBufferSize != AdjustedOutputBufferSize) {
         mOutputBufferSize = AdjustedOutputBufferSize;
+        mMinOutputBufferSize = AdjustedOutputBufferSize;
         ALOGV("Output buffer size adjusted to: %u", mOutputBufferSize);
     }
 
@@ -570,8 +755,15 @@ bool V4L2Encoder::configureOutputFormat(C2Config::profile_t outputProfile) {
     ALOG_ASSERT(!mOutputQueue->isStreaming());
     ALOG_ASSERT(!isEmpty(mVisibleSize));
 
+    // The size set on the device is the minimum size of the buffers, the right-sized buffers can
+    // be grown beyond it without reconfiguring the device.
+    mMaxOutputBufferSize = GetMaxOutputBufferSize(mVisibleSize);
+    uint32_t requestedSize = mMaxOutputBufferSize;
+    if (mRightSizedOutputBuffers) {
+        requestedSize = std::min(getRightSizedOutputBufferSize(), mMaxOutputBufferSize);
+    }
     auto format = mOutputQueue->setFormat(V4L2Device::C2ProfileToV4L2PixFmt(outputProfile, false),
-                                          mVisibleSize, GetMaxOutputBufferSize(mVisibleSize));
+                                          mVisibleSize, requestedSize);
     if (!format) {
         ALOGE("Failed to set output format to %s", profileToString(outputProfile));
         return false;
@@ -579,6 +771,8 @@ bool V4L2Encoder::configureOutputFormat(C2Config::profile_t outputProfile) {
 
     // The device might adjust the requested output buffer size to match hardware requirements.
     mOutputBufferSize = format->fmt.pix_mp.plane_fmt[0].sizeimage;
+    mMinOutputBufferSize = mOutputBufferSize;
+    updateOutputBufferSize();
 
     ALOGV("Output format set to %s (buffer size: %u)", profileToString(outputProfile),
           mOutputBufferSize);
@@ -586,7 +780,7 @@ bool V4L2Encoder::configureOutputFormat(C2Config::profile_t outputProfile) {
 }
 
 bool V4L2Encoder::configureDevice(C2Config::profile_t outputProfile,
-                                  std::optional<const uint8_t> outputH264Level) {
+                                  std::optional<const uint8_t> outputLevel) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
 
@@ -603,21 +797,37 @@ bool V4L2Encoder::configureDevice(C2Config::profile_t outputProfile,
     // - Set GOP length to 0 to disable periodic key frames.
     mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG, {V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_MB_RC_ENABLE, 1),
                                                 V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_GOP_SIZE, 0)});
+    configureIntraRefresh();
 
-    // All controls below are H.264-specific, so we can return here if the profile is not H.264.
+    // All controls below are codec-specific.
     if (outputProfile >= C2Config::PROFILE_AVC_BASELINE &&
         outputProfile <= C2Config::PROFILE_AVC_ENHANCED_MULTIVIEW_DEPTH_HIGH) {
-        return configureH264(outputProfile, outputH264Level);
+        if (!configureH264(outputProfile, outputLevel)) return false;
+        configureTemporalLayers();
+        return true;
+    }
+    if (outputProfile >= C2Config::PROFILE_HEVC_MAIN &&
+        outputProfile <= C2Config::PROFILE_HEVC_3D_MAIN) {
+        if (!configureHEVC(outputProfile, outputLevel)) return false;
+        configureTemporalLayers();
+        return true;
     }
 
+    if (mNumTemporalLayers > 1) {
+        ALOGW("Temporal layers are only supported for H.264 and HEVC, encoding a single layer");
+        mNumTemporalLayers = 1;
+    }
+    if ((outputProfile >= C2Config::PROFILE_VP8_0 && outputProfile <= C2Config::PROFILE_VP8_3) ||
+        (outputProfile >= C2Config::PROFILE_VP9_0 && outputProfile <= C2Config::PROFILE_VP9_3)) {
+        return configureVPx(outputProfile);
+    }
     return true;
 }
 
-bool V4L2Encoder::configureH264(C2Config::profile_t outputProfile,
-                                std::optional<const uint8_t> outputH264Level) {
-    // When encoding H.264 we want to prepend SPS and PPS to each IDR for resilience. Some
-    // devices support this through the V4L2_CID_MPEG_VIDEO_PREPEND_SPSPPS_TO_IDR control.
-    // Otherwise we have to cache the latest SPS and PPS and inject these manually.
+bool V4L2Encoder::configureParamsBeforeIDR() {
+    // When encoding H.264 or HEVC we want to prepend the parameter sets to each IDR for
+    // resilience. Some devices support this through the V4L2_CID_MPEG_VIDEO_PREPEND_SPSPPS_TO_IDR
+    // control. Otherwise we have to cache the latest parameter sets and inject these manually.
     if (mDevice->isCtrlExposed(V4L2_CID_MPEG_VIDEO_PREPEND_SPSPPS_TO_IDR)) {
         if (!mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG,
                                   {V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_PREPEND_SPSPPS_TO_IDR, 1)})) {
@@ -630,6 +840,12 @@ bool V4L2Encoder::configureH264(C2Config::profile_t outputProfile,
         mInjectParamsBeforeIDR = true;
         ALOGV("Device doesn't support prepending SPS and PPS to IDR, injecting manually.");
     }
+    return true;
+}
+
+bool V4L2Encoder::configureH264(C2Config::profile_t outputProfile,
+                                std::optional<const uint8_t> outputH264Level) {
+    if (!configureParamsBeforeIDR()) return false;
 
     std::vector<V4L2ExtCtrl> h264Ctrls;
 
@@ -661,6 +877,72 @@ bool V4L2Encoder::configureH264(C2Config::profile_t outputProfile,
     return true;
 }
 
+bool V4L2Encoder::configureHEVC(C2Config::profile_t outputProfile,
+                                std::optional<const uint8_t> outputHEVCLevel) {
+    mHEVC = true;
+    if (!configureParamsBeforeIDR()) return false;
+
+    std::vector<V4L2ExtCtrl> hevcCtrls;
+
+    // No B-frames, for lowest decoding latency.
+    hevcCtrls.emplace_back(V4L2_CID_MPEG_VIDEO_B_FRAMES, 0);
+    // Quantization parameter maximum value (for variable bitrate control).
+    hevcCtrls.emplace_back(V4L2_CID_MPEG_VIDEO_HEVC_MAX_QP, 51);
+
+    // Set HEVC profile.
+    int32_t profile = V4L2Device::c2ProfileToV4L2HEVCProfile(outputProfile);
+    if (profile < 0) {
+        ALOGE("Trying to set invalid HEVC profile");
+        return false;
+    }
+    hevcCtrls.emplace_back(V4L2_CID_MPEG_VIDEO_HEVC_PROFILE, profile);
+
+    // Set HEVC output level and tier. Use Level 4.1 as fallback default, only the main tier is
+    // supported.
+    int32_t hevcLevel =
+            static_cast<int32_t>(outputHEVCLevel.value_or(V4L2_MPEG_VIDEO_HEVC_LEVEL_4_1));
+    hevcCtrls.emplace_back(V4L2_CID_MPEG_VIDEO_HEVC_LEVEL, hevcLevel);
+    hevcCtrls.emplace_back(V4L2_CID_MPEG_VIDEO_HEVC_TIER, V4L2_MPEG_VIDEO_HEVC_TIER_MAIN);
+
+    // Ask not to put the parameter sets into separate bitstream buffers.
+    hevcCtrls.emplace_back(V4L2_CID_MPEG_VIDEO_HEADER_MODE,
+                           V4L2_MPEG_VIDEO_HEADER_MODE_JOINED_WITH_1ST_FRAME);
+
+    // Ignore return value as these controls are optional.
+    mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG, std::move(hevcCtrls));
+
+    return true;
+}
+
+bool V4L2Encoder::configureVPx(C2Config::profile_t outputProfile) {
+    // VP8 and VP9 frames carry their own headers, so there are no parameter sets to prepend to
+    // key frames and the encoded frames are returned without being parsed.
+    mInjectParamsBeforeIDR = false;
+
+    // Set VP8 or VP9 profile. The controls are set separately, so a control the device doesn't
+    // support can't make the others fail. Ignore return values as these controls are optional.
+    int32_t profile = V4L2Device::c2ProfileToV4L2VPxProfile(outputProfile);
+    if (profile < 0) {
+        ALOGE("Trying to set invalid VP8/VP9 profile");
+        return false;
+    }
+    const bool isVP8 = outputProfile <= C2Config::PROFILE_VP8_3;
+    mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG,
+                         {V4L2ExtCtrl(isVP8 ? V4L2_CID_MPEG_VIDEO_VP8_PROFILE
+                                            : V4L2_CID_MPEG_VIDEO_VP9_PROFILE,
+                                      profile)});
+
+    // Only reference the previous frame, for lowest encoding latency and memory usage. The number
+    // of reference frames is a VP8 control.
+    if (isVP8 && mDevice->isCtrlExposed(V4L2_CID_MPEG_VIDEO_VPX_NUM_REF_FRAMES)) {
+        mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG,
+                             {V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_VPX_NUM_REF_FRAMES,
+                                          V4L2_CID_MPEG_VIDEO_VPX_1_REF_FRAME)});
+    }
+
+    return true;
+}
+
 bool V4L2Encoder::configureBitrateMode(C2Config::bitrate_mode_t bitrateMode) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
@@ -676,12 +958,200 @@ bool V4L2Encoder::configureBitrateMode(C2Config::bitrate_mode_t bitrateMode) {
     return true;
 }
 
+void V4L2Encoder::configureRegionsOfInterest() {
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    const uint32_t ctrlId = getRoiCtrlId();
+    if (ctrlId == 0) return;
+
+    struct v4l2_query_ext_ctrl query;
+    memset(&query, 0, sizeof(query));
+    query.id = ctrlId;
+    if (mDevice->ioctl(VIDIOC_QUERY_EXT_CTRL, &query) != 0 ||
+        query.elem_size != sizeof(V4L2RoiRegion) || query.elems == 0) {
+        ALOGW("Device doesn't support the region of interest control 0x%x", ctrlId);
+        return;
+    }
+    ALOGV("Device supports %u regions of interest", query.elems);
+    mRoiRegions.resize(query.elems);
+}
+
+void V4L2Encoder::configureTemporalLayers() {
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mNumTemporalLayers <= 1) return;
+
+    std::vector<V4L2ExtCtrl> ctrls;
+    uint32_t layerCtrl;
+    if (mHEVC) {
+        layerCtrl = V4L2_CID_MPEG_VIDEO_HEVC_HIER_CODING_LAYER;
+        ctrls.emplace_back(V4L2_CID_MPEG_VIDEO_HEVC_HIER_CODING_TYPE,
+                           V4L2_MPEG_VIDEO_HEVC_HIERARCHICAL_CODING_P);
+    } else {
+        layerCtrl = V4L2_CID_MPEG_VIDEO_H264_HIERARCHICAL_CODING_LAYER;
+        ctrls.emplace_back(V4L2_CID_MPEG_VIDEO_H264_HIERARCHICAL_CODING, 1);
+        ctrls.emplace_back(V4L2_CID_MPEG_VIDEO_H264_HIERARCHICAL_CODING_TYPE,
+                           V4L2_MPEG_VIDEO_H264_HIERARCHICAL_CODING_P);
+    }
+    ctrls.emplace_back(layerCtrl, mNumTemporalLayers);
+    if (!mDevice->isCtrlExposed(layerCtrl) ||
+        !mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG, std::move(ctrls))) {
+        ALOGW("Device doesn't support %u temporal layers, encoding a single layer",
+              mNumTemporalLayers);
+        mNumTemporalLayers = 1;
+        return;
+    }
+    ALOGV("Encoding %u temporal layers", mNumTemporalLayers);
+
+    setTemporalLayerBitrates(mBitrate);
+}
+
+void V4L2Encoder::configureIntraRefresh() {
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mIntraRefreshPeriod == 0) return;
+
+    // Devices exposing the intra refresh period spread the refresh over the frames themselves.
+    if (mDevice->isCtrlExposed(V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD)) {
+        std::vector<V4L2ExtCtrl> ctrls;
+        if (mDevice->isCtrlExposed(V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD_TYPE)) {
+            ctrls.emplace_back(V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD_TYPE,
+                               V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD_TYPE_CYCLIC);
+        }
+        ctrls.emplace_back(V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD, mIntraRefreshPeriod);
+        if (mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG, std::move(ctrls))) {
+            ALOGV("Refreshing intra macroblocks over %u frames", mIntraRefreshPeriod);
+            return;
+        }
+    }
+
+    // Otherwise refresh enough macroblocks each frame to cover the frame over the period.
+    if (mDevice->isCtrlExposed(V4L2_CID_MPEG_VIDEO_CYCLIC_INTRA_REFRESH_MB)) {
+        constexpr uint32_t kMacroblockSize = 16;
+        const uint32_t numMacroblocks =
+                ((mVisibleSize.width + kMacroblockSize - 1) / kMacroblockSize) *
+                ((mVisibleSize.height + kMacroblockSize - 1) / kMacroblockSize);
+        const uint32_t numRefreshedMacroblocks =
+                (numMacroblocks + mIntraRefreshPeriod - 1) / mIntraRefreshPeriod;
+        if (mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG,
+                                 {V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_CYCLIC_INTRA_REFRESH_MB,
+                                              numRefreshedMacroblocks)})) {
+            ALOGV("Refreshing %u intra macroblocks per frame", numRefreshedMacroblocks);
+            return;
+        }
+    }
+
+    ALOGW("Device doesn't support intra refresh, disabling it");
+    mIntraRefreshPeriod = 0;
+}
+
+void V4L2Encoder::setTemporalLayerBitrates(uint32_t bitrate) {
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mNumTemporalLayers <= 1) return;
+
+    // The C2 ratios are cumulative, while V4L2 sets the bitrate of each layer on its own.
+    const uint32_t baseCtrl = mHEVC ? V4L2_CID_MPEG_VIDEO_HEVC_HIER_CODING_L0_BR
+                                    : V4L2_CID_MPEG_VIDEO_H264_HIER_CODING_L0_BR;
+    float lowerRatio = 0.f;
+    for (uint32_t layer = 0; layer < mNumTemporalLayers; layer++) {
+        const float ratio =
+                layer + 1 < mNumTemporalLayers ? mTemporalLayerBitrateRatios[layer] : 1.f;
+        const int32_t layerBitrate = static_cast<int32_t>(bitrate * (ratio - lowerRatio));
+        lowerRatio = ratio;
+        // The per-layer bitrates are optional, the device splits the bitrate itself otherwise.
+        if (!setCtrl(V4L2ExtCtrl(baseCtrl + layer, layerBitrate))) {
+            ALOGV("Setting the bitrate of temporal layer %u failed", layer);
+        }
+    }
+}
+
+uint32_t V4L2Encoder::getNextTemporalLayer(bool keyFrame) {
+    if (mNumTemporalLayers <= 1) return 0;
+
+    // In the hierarchical P pattern of N layers repeating every 2^(N-1) frames, the first frame is
+    // in the base layer and the others in the layer given by their number of trailing zero bits,
+    // e.g. 0, 2, 1, 2 for 3 layers.
+    if (keyFrame) mTemporalLayerFrameIndex = 0;
+    const uint32_t period = 1u << (mNumTemporalLayers - 1);
+    const uint32_t position = mTemporalLayerFrameIndex++ % period;
+    if (position == 0) return 0;
+    return mNumTemporalLayers - 1 - static_cast<uint32_t>(__builtin_ctz(position));
+}
+
+bool V4L2Encoder::setCtrl(V4L2ExtCtrl ctrl) {
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mState == State::UNINITIALIZED) {
+        return mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG, {ctrl});
+    }
+
+    auto it = std::find_if(mStagedCtrls.begin(), mStagedCtrls.end(),
+                           [&ctrl](const V4L2ExtCtrl& staged) {
+                               return staged.ctrl.id == ctrl.ctrl.id;
+                           });
+    if (it != mStagedCtrls.end()) {
+        *it = ctrl;
+    } else {
+        mStagedCtrls.push_back(ctrl);
+    }
+    return true;
+}
+
+bool V4L2Encoder::applyStagedCtrls() {
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mStagedCtrls.empty()) return true;
+
+    std::vector<V4L2ExtCtrl> ctrls;
+    std::swap(ctrls, mStagedCtrls);
+    if (mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG, ctrls)) return true;
+
+    // The device rejects the whole batch if any of the controls is invalid, set them one by one to
+    // find which one failed.
+    ALOGV("Setting %zu controls at once failed, setting them one by one", ctrls.size());
+    for (const V4L2ExtCtrl& ctrl : ctrls) {
+        if (mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG, {ctrl})) continue;
+
+        // TODO(b/190336806): Our stack doesn't support dynamic peak bitrate changes yet, ignore
+        // errors for now.
+        if (ctrl.ctrl.id == V4L2_CID_MPEG_VIDEO_BITRATE_PEAK) {
+            ALOGW("Setting peak bitrate to %d failed", ctrl.ctrl.value);
+            continue;
+        }
+        // The per-layer bitrates and the regions of interest are optional as well.
+        if (ctrl.ctrl.id == getRoiCtrlId()) {
+            ALOGW("Setting the regions of interest failed");
+            continue;
+        }
+        const uint32_t layerBitrateCtrl = mHEVC ? V4L2_CID_MPEG_VIDEO_HEVC_HIER_CODING_L0_BR
+                                                : V4L2_CID_MPEG_VIDEO_H264_HIER_CODING_L0_BR;
+        if (ctrl.ctrl.id >= layerBitrateCtrl &&
+            ctrl.ctrl.id < layerBitrateCtrl + mNumTemporalLayers) {
+            ALOGV("Setting temporal layer bitrate to %d failed", ctrl.ctrl.value);
+            continue;
+        }
+        ALOGE("Setting control 0x%x to %d failed", ctrl.ctrl.id, ctrl.ctrl.value);
+        return false;
+    }
+    return true;
+}
+
 bool V4L2Encoder::startDevicePoll() {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
 
-    if (!mDevice->startPolling(::base::BindRepeating(&V4L2Encoder::serviceDeviceTask, mWeakThis),
-                               ::base::BindRepeating(&V4L2Encoder::onPollError, mWeakThis))) {
+    bool success;
+    if (V4L2DevicePoller::isBatchedPollingEnabled()) {
+        success = mDevice->startPolling(
+                ::base::BindRepeating(&V4L2Encoder::serviceDeviceReadiness, mWeakThis),
+                ::base::BindRepeating(&V4L2Encoder::onPollError, mWeakThis));
+    } else {
+        success = mDevice->startPolling(
+                ::base::BindRepeating(&V4L2Encoder::serviceDeviceTask, mWeakThis),
+                ::base::BindRepeating(&V4L2Encoder::onPollError, mWeakThis));
+    }
+    if (!success) {
         ALOGE("Device poll thread failed to start");
         onError();
         return false;
@@ -711,25 +1181,35 @@ void V4L2Encoder::onPollError() {
 }
 
 void V4L2Encoder::serviceDeviceTask(bool /*event*/) {
-    ALOGV("%s()", __func__);
+    serviceDeviceReadiness(V4L2DevicePoller::kInputReady | V4L2DevicePoller::kOutputReady);
+}
+
+bool V4L2Encoder::serviceDeviceReadiness(uint32_t readiness) {
+    PerformanceHintSession::ScopedWork hintWork;
+    ALOGV("%s(readiness=0x%x)", __func__, readiness);
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
     ALOG_ASSERT(mState != State::UNINITIALIZED);
 
     if (mState == State::ERROR) {
-        return;
+        return false;
     }
 
+    bool dequeued = false;
+
     // Dequeue completed input (VIDEO_OUTPUT) buffers, and recycle to the free list.
-    while (mInputQueue->queuedBuffersCount() > 0) {
+    while ((readiness & V4L2DevicePoller::kInputReady) && mInputQueue->queuedBuffersCount() > 0) {
         if (!dequeueInputBuffer()) break;
+        dequeued = true;
     }
 
     // Dequeue completed output (VIDEO_CAPTURE) buffers, and recycle to the free list.
-    while (mOutputQueue->queuedBuffersCount() > 0) {
+    while ((readiness & V4L2DevicePoller::kOutputReady) && mOutputQueue->queuedBuffersCount() > 0) {
         if (!dequeueOutputBuffer()) break;
+        dequeued = true;
     }
 
     ALOGV("%s() - done", __func__);
+    return dequeued;
 }
 
 bool V4L2Encoder::enqueueInputBuffer(std::unique_ptr<InputFrame> frame) {
@@ -741,7 +1221,7 @@ bool V4L2Encoder::enqueueInputBuffer(std::unique_ptr<InputFrame> frame) {
     ALOG_ASSERT(mInputLayout->mPlanes.size() == frame->planes().size());
 
     auto format = frame->pixelFormat();
-    auto planes = frame->planes();
+    const auto& planes = frame->planes();
     auto index = frame->index();
     auto timestamp = frame->timestamp();
 
@@ -808,8 +1288,11 @@ bool V4L2Encoder::enqueueOutputBuffer() {
         return false;
     }
 
+    // Drivers which support it will keep the requested headroom free in front of the encoded data,
+    // the block is enlarged accordingly.
+    const size_t headroom = mInjectParamsBeforeIDR ? kParamsHeadroom : 0;
     std::unique_ptr<BitstreamBuffer> bitstreamBuffer;
-    mFetchOutputBufferCb.Run(mOutputBufferSize, &bitstreamBuffer);
+    mFetchOutputBufferCb.Run(mOutputBufferSize + headroom, &bitstreamBuffer);
     if (!bitstreamBuffer) {
         ALOGE("Failed to fetch output block");
         onError();
@@ -818,12 +1301,20 @@ bool V4L2Encoder::enqueueOutputBuffer() {
 
     size_t bufferId = buffer->bufferId();
 
-    std::vector<int> fds;
-    fds.push_back(bitstreamBuffer->dmabuf->handle()->data[0]);
-    if (!std::move(*buffer).queueDMABuf(fds)) {
-        ALOGE("Failed to queue output buffer using QueueDMABuf");
-        onError();
-        return false;
+    if (headroom > 0) buffer->setPlaneDataOffset(0, headroom);
+    if (mOutputMemory == V4L2_MEMORY_MMAP) {
+        // The encoded data is copied to the bitstream buffer once the buffer is dequeued.
+        if (!std::move(*buffer).queueMMap()) {
+            ALOGE("Failed to queue output buffer using QueueMMap");
+            onError();
+            return false;
+        }
+    } else {
+        if (!std::move(*buffer).queueDMABuf({bitstreamBuffer->dmabuf->handle()->data[0]})) {
+            ALOGE("Failed to queue output buffer using QueueDMABuf");
+            onError();
+            return false;
+        }
     }
 
     ALOG_ASSERT(!mOutputBuffers[bufferId]);
@@ -899,7 +1390,8 @@ bool V4L2Encoder::dequeueOutputBuffer() {
         return false;
     }
 
-    size_t encodedDataSize = buffer->getPlaneBytesUsed(0) - buffer->getPlaneDataOffset(0);
+    const size_t dataOffset = buffer->getPlaneDataOffset(0);
+    size_t encodedDataSize = buffer->getPlaneBytesUsed(0) - dataOffset;
     ::base::TimeDelta timestamp = ::base::TimeDelta::FromMicroseconds(
             buffer->getTimeStamp().tv_usec +
             buffer->getTimeStamp().tv_sec * ::base::Time::kMicrosecondsPerSecond);
@@ -913,10 +1405,42 @@ bool V4L2Encoder::dequeueOutputBuffer() {
         onError();
         return false;
     }
+    if (mOutputMemory == V4L2_MEMORY_MMAP && encodedDataSize > 0 &&
+        !copyMMapOutputBuffer(*buffer, dataOffset, encodedDataSize,
+                              mOutputBuffers[buffer->bufferId()].get())) {
+        onError();
+        return false;
+    }
+
+    // A frame filling its whole buffer was most likely truncated. The device only writes the
+    // bitstream into the DMABUF buffers the encoder sized itself.
+    const uint32_t capacity = mOutputBuffers[buffer->bufferId()]->dmabuf->capacity();
+    const bool truncated = mRightSizedOutputBuffers && mOutputMemory == V4L2_MEMORY_DMABUF &&
+                           buffer->getPlaneBytesUsed(0) >= capacity;
+    if (truncated && mMinOutputBufferSize < mMaxOutputBufferSize) {
+        mMinOutputBufferSize = std::min(capacity * 2, mMaxOutputBufferSize);
+        ALOGW("Encoded frame overflowed its output buffer, growing the buffers to %u bytes",
+              mMinOutputBufferSize);
+        updateOutputBufferSize();
+    }
+    if (!mFirstFrameDequeued && encodedDataSize > 0) {
+        // The buffers fetched from now on are sized from the bitrate.
+        mFirstFrameDequeued = true;
+        updateOutputBufferSize();
+    }
 
     std::unique_ptr<BitstreamBuffer> bitstreamBuffer =
-            std::move(mOutputBuffers[buffer->bufferId()]);
-    if (encodedDataSize > 0) {
+            withDataOffset(std::move(mOutputBuffers[buffer->bufferId()]), dataOffset);
+    if (encodedDataSize > 0 && (truncated || buffer->isError())) {
+        // Truncated and corrupted frames are dropped. They can't be used as a reference by the
+        // decoder, so the next frame is encoded as a key frame.
+        ALOGW("Dropping %s frame (timestamp: %" PRId64 ")", truncated ? "truncated" : "corrupted",
+              timestamp.InMicroseconds());
+        mKeyFrameCounter = 0;
+        mOutputBufferDoneCb.Run(0, timestamp.InMicroseconds(), false, std::move(bitstreamBuffer));
+    } else if (encodedDataSize > 0) {
+        // The frames come out in encoding order, as the encoder doesn't produce B frames.
+        bitstreamBuffer->temporalLayer = getNextTemporalLayer(buffer->isKeyframe());
         if (!mInjectParamsBeforeIDR) {
             // No need to inject SPS or PPS before IDR frames, we can just return the buffer as-is.
             mOutputBufferDoneCb.Run(encodedDataSize, timestamp.InMicroseconds(),
@@ -924,36 +1448,38 @@ bool V4L2Encoder::dequeueOutputBuffer() {
         } else if (!buffer->isKeyframe()) {
             // We need to inject SPS and PPS before IDR frames, but this frame is not a key frame.
             // We can return the buffer as-is, but need to update our SPS and PPS cache if required.
-            C2ConstLinearBlock constBlock = bitstreamBuffer->dmabuf->share(
-                    bitstreamBuffer->dmabuf->offset(), encodedDataSize, C2Fence());
-            C2ReadView readView = constBlock.map().get();
-            extractSPSPPS(readView.data(), encodedDataSize, &mCachedSPS, &mCachedPPS);
+            // Devices practically never send parameter sets with non-key frames, once that is
+            // established the cache is only refreshed from key frames.
+            if (mParamsOnNonKeyFrames ||
+                mNumNonKeyFramesWithoutParams < kNonKeyFramesWithoutParamsThreshold) {
+                C2ConstLinearBlock constBlock = bitstreamBuffer->dmabuf->share(
+                        bitstreamBuffer->dmabuf->offset() + dataOffset, encodedDataSize,
+                        C2Fence());
+                C2ReadView readView = constBlock.map().get();
+                if (extractCachedParams(readView.data(), encodedDataSize)) {
+                    if (!mParamsOnNonKeyFrames) ALOGV("SPS and PPS found in non-key frame");
+                    mParamsOnNonKeyFrames = true;
+                } else if (++mNumNonKeyFramesWithoutParams ==
+                           kNonKeyFramesWithoutParamsThreshold) {
+                    ALOGV("No SPS and PPS sent with non-key frames, not scanning them anymore");
+                }
+            }
             mOutputBufferDoneCb.Run(encodedDataSize, timestamp.InMicroseconds(),
                                     buffer->isKeyframe(), std::move(bitstreamBuffer));
         } else {
             // We need to inject our cached SPS and PPS NAL units to the IDR frame. It's possible
             // this frame already has SPS and PPS NAL units attached, in which case we only need to
-            // update our cached SPS and PPS.
-            C2ConstLinearBlock constBlock = bitstreamBuffer->dmabuf->share(
-                    bitstreamBuffer->dmabuf->offset(), encodedDataSize, C2Fence());
-            C2ReadView readView = constBlock.map().get();
-
-            // Allocate a new buffer to copy the data with prepended SPS and PPS into.
-            std::unique_ptr<BitstreamBuffer> prependedBitstreamBuffer;
-            mFetchOutputBufferCb.Run(mOutputBufferSize, &prependedBitstreamBuffer);
-            if (!prependedBitstreamBuffer) {
-                ALOGE("Failed to fetch output block");
-                onError();
-                return false;
-            }
-            C2WriteView writeView = prependedBitstreamBuffer->dmabuf->map().get();
+            // update our cached SPS and PPS. The parameter sets are written in place, into the
+            // headroom in front of the encoded data if the driver reserved it.
+            C2WriteView writeView = bitstreamBuffer->dmabuf->map().get();
+            size_t offset = dataOffset;
+            size_t newSize = insertCachedParams(writeView.data(), writeView.size(), &offset,
+                                                encodedDataSize);
 
             // If there is not enough space in the output buffer just return the original buffer.
-            size_t newSize = prependSPSPPSToIDR(readView.data(), encodedDataSize, writeView.data(),
-                                                writeView.size(), &mCachedSPS, &mCachedPPS);
             if (newSize > 0) {
                 mOutputBufferDoneCb.Run(newSize, timestamp.InMicroseconds(), buffer->isKeyframe(),
-                                        std::move(prependedBitstreamBuffer));
+                                        withDataOffset(std::move(bitstreamBuffer), offset));
             } else {
                 mOutputBufferDoneCb.Run(encodedDataSize, timestamp.InMicroseconds(),
                                         buffer->isKeyframe(), std::move(bitstreamBuffer));
@@ -977,11 +1503,93 @@ bool V4L2Encoder::dequeueOutputBuffer() {
 
     // Queue a new output buffer to replace the one we dequeued.
     buffer = nullptr;
-    enqueueOutputBuffer();
+    if (mOutputQueue->queuedBuffersCount() < mQueueDepth) enqueueOutputBuffer();
+
+    return true;
+}
 
+bool V4L2Encoder::copyMMapOutputBuffer(const V4L2ReadableBuffer& buffer, size_t dataOffset,
+                                       size_t size, BitstreamBuffer* bitstreamBuffer) {
+    const uint8_t* data = static_cast<const uint8_t*>(buffer.getPlaneMapping(0));
+    if (!data) {
+        ALOGE("Failed to map the output buffer");
+        return false;
+    }
+    C2WriteView writeView = bitstreamBuffer->dmabuf->map().get();
+    if (writeView.error() != C2_OK || dataOffset + size > writeView.size()) {
+        ALOGE("Failed to map the output block, or it is too small (%zu bytes) for %zu bytes",
+              static_cast<size_t>(writeView.size()), dataOffset + size);
+        return false;
+    }
+    memcpy(writeView.data() + dataOffset, data + dataOffset, size);
     return true;
 }
 
+uint32_t V4L2Encoder::getRightSizedOutputBufferSize() const {
+    const uint32_t framerate = mFramerate > 0 ? mFramerate : kDefaultFramerate;
+    const uint64_t averageFrameSize = mBitrate / 8 / framerate;
+    return static_cast<uint32_t>(std::min<uint64_t>(
+            std::max<uint64_t>(averageFrameSize * kKeyFrameSizeFactor, kMinRightSizedBufferSize),
+            std::numeric_limits<uint32_t>::max()));
+}
+
+bool V4L2Encoder::resetOutputBufferSizeToMax() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mOutputQueue->allocatedBuffersCount() == 0);
+
+    auto currentFormat = mOutputQueue->getFormat();
+    if (!currentFormat.first) {
+        ALOGE("Failed to get output format (errno: %i)", currentFormat.second);
+        return false;
+    }
+    auto format = mOutputQueue->setFormat(currentFormat.first->fmt.pix_mp.pixelformat,
+                                          mVisibleSize, mMaxOutputBufferSize);
+    if (!format) {
+        ALOGE("Failed to set the output buffer size to %u", mMaxOutputBufferSize);
+        return false;
+    }
+
+    mRightSizedOutputBuffers = false;
+    mOutputBufferSize = format->fmt.pix_mp.plane_fmt[0].sizeimage;
+    mMinOutputBufferSize = mOutputBufferSize;
+    ALOGV("Output buffer size reset to %u bytes", mOutputBufferSize);
+    return true;
+}
+
+void V4L2Encoder::updateOutputBufferSize() {
+    // The buffer sizes are only known once the output format is configured.
+    if (!mRightSizedOutputBuffers || mMaxOutputBufferSize == 0) return;
+
+    // The first frame is a key frame encoded before the rate control settled, so its buffers are
+    // sized for the worst case.
+    const uint32_t size =
+            mFirstFrameDequeued
+                    ? std::clamp(getRightSizedOutputBufferSize(), mMinOutputBufferSize,
+                                 std::max(mMinOutputBufferSize, mMaxOutputBufferSize))
+                    : std::max(mMinOutputBufferSize, mMaxOutputBufferSize);
+    if (size != mOutputBufferSize) {
+        ALOGV("Output buffer size set to %u bytes", size);
+        mOutputBufferSize = size;
+    }
+}
+
+bool V4L2Encoder::extractCachedParams(const uint8_t* data, size_t size) {
+    if (mHEVC) {
+        return extractHEVCParamSets(data, size, &mCachedVPS, &mCachedSPS, &mCachedPPS,
+                                    /*stopAtFirstSlice=*/true);
+    }
+    return extractSPSPPS(data, size, &mCachedSPS, &mCachedPPS, /*stopAtFirstSlice=*/true);
+}
+
+size_t V4L2Encoder::insertCachedParams(uint8_t* buffer, size_t bufferSize, size_t* offset,
+                                       size_t size) {
+    if (mHEVC) {
+        return insertHEVCParamSetsBeforeIRAP(buffer, bufferSize, offset, size, &mCachedVPS,
+                                             &mCachedSPS, &mCachedPPS);
+    }
+    return insertSPSPPSBeforeIDR(buffer, bufferSize, offset, size, &mCachedSPS, &mCachedPPS);
+}
+
 bool V4L2Encoder::createInputBuffers() {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
@@ -990,7 +1598,7 @@ bool V4L2Encoder::createInputBuffers() {
 
     // No memory is allocated here, we just generate a list of buffers on the input queue, which
     // will hold memory handles to the real buffers.
-    if (mInputQueue->allocateBuffers(kInputBufferCount, V4L2_MEMORY_DMABUF) < kInputBufferCount) {
+    if (mInputQueue->allocateBuffers(mMaxQueueDepth, V4L2_MEMORY_DMABUF) < kInputBufferCount) {
         ALOGE("Failed to create V4L2 input buffers.");
         return false;
     }
@@ -1007,10 +1615,22 @@ bool V4L2Encoder::createOutputBuffers() {
 
     // No memory is allocated here, we just generate a list of buffers on the output queue, which
     // will hold memory handles to the real buffers.
-    if (mOutputQueue->allocateBuffers(kOutputBufferCount, V4L2_MEMORY_DMABUF) <
-        kOutputBufferCount) {
-        ALOGE("Failed to create V4L2 output buffers.");
-        return false;
+    if (mOutputQueue->allocateBuffers(mMaxQueueDepth, V4L2_MEMORY_DMABUF) >= kOutputBufferCount) {
+        mOutputMemory = V4L2_MEMORY_DMABUF;
+    } else {
+        // The driver can't import the bitstream buffers, let it allocate the output buffers.
+        ALOGW("Failed to create DMABUF V4L2 output buffers, falling back to MMAP");
+        mOutputQueue->deallocateBuffers();
+        // The size of the MMAP buffers is fixed by the driver, and the frames overflowing them
+        // can't be detected. So the buffers are sized for the worst case instead.
+        if (mRightSizedOutputBuffers && !resetOutputBufferSizeToMax()) return false;
+        // The bitstream is copied out of every buffer, so map them upfront.
+        if (mOutputQueue->allocateBuffers(mMaxQueueDepth, V4L2_MEMORY_MMAP,
+                                          V4L2Queue::MapMode::kPrefault) < kOutputBufferCount) {
+            ALOGE("Failed to create V4L2 output buffers.");
+            return false;
+        }
+        mOutputMemory = V4L2_MEMORY_MMAP;
     }
 
     mOutputBuffers.resize(mOutputQueue->allocatedBuffersCount());
@@ -1071,6 +1691,12 @@ void V4L2Encoder::setState(State state) {
         break;
     }
 
+    if (state == State::WAITING_FOR_V4L2_BUFFER && mState != State::WAITING_FOR_V4L2_BUFFER) {
+        mBufferWaitStart = ::base::TimeTicks::Now();
+    } else if (mState == State::WAITING_FOR_V4L2_BUFFER && state != mState) {
+        mBufferWaitTime += ::base::TimeTicks::Now() - mBufferWaitStart;
+    }
+
     ALOGV("Changed encoder state from %s to %s", stateToString(mState), stateToString(state));
     mState = state;
 }
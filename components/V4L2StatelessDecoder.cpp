@@ -0,0 +1,1460 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "V4L2StatelessDecoder"
+
+#include <v4l2_codec2/components/V4L2StatelessDecoder.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <base/bind.h>
+#include <base/memory/ptr_util.h>
+#include <cutils/properties.h>
+#include <log/log.h>
+
+#include <v4l2_codec2/common/Common.h>
+#include <v4l2_codec2/common/Fourcc.h>
+#include <v4l2_codec2/common/NalParser.h>
+#include <v4l2_codec2/common/V4L2DevicePool.h>
+#include <v4l2_codec2/common/VideoPixelFormat.h>
+#include <v4l2_codec2/components/DecodeOutputFormat.h>
+#include <v4l2_codec2/components/PerformanceHintSession.h>
+#include <v4l2_codec2/components/V4L2DecodeInterface.h>
+
+namespace android {
+namespace {
+
+// Extra buffers for transmitting in the whole video pipeline.
+constexpr size_t kNumExtraOutputBuffers = 4;
+// The number of frames submitted to the device ahead of the one being decoded by default, each
+// with its own input buffer and media request.
+constexpr int32_t kDefaultPipelineDepth = 4;
+constexpr int32_t kMaxPipelineDepth = 16;
+
+constexpr uint8_t kNalStartCode[] = {0x00, 0x00, 0x01};
+
+// The input buffers are sized to twice the largest access unit seen so far when adaptive, aligned
+// to avoid reallocating them for slightly larger units.
+constexpr size_t kAdaptiveInputBufferSizeFactor = 2;
+constexpr size_t kInputBufferSizeAlignment = 64 * 1024;  // 64KB
+
+// Get the number of frames submitted to the device at once.
+size_t getPipelineDepth() {
+    static const size_t kPipelineDepth = static_cast<size_t>(
+            std::clamp(property_get_int32("ro.vendor.v4l2_codec2.stateless_decode_pipeline_depth",
+                                          kDefaultPipelineDepth),
+                       1, kMaxPipelineDepth));
+    return kPipelineDepth;
+}
+
+size_t getInputBufferSizeFor(size_t accessUnitSize) {
+    const size_t size = accessUnitSize * kAdaptiveInputBufferSizeFactor;
+    return (size + kInputBufferSizeAlignment - 1) / kInputBufferSizeAlignment *
+           kInputBufferSizeAlignment;
+}
+
+void fillSPSControl(const H264SPS& sps, struct v4l2_ctrl_h264_sps* ctrl) {
+    memset(ctrl, 0, sizeof(*ctrl));
+    ctrl->profile_idc = sps.profile_idc;
+    ctrl->constraint_set_flags = sps.constraint_set_flags;
+    ctrl->level_idc = sps.level_idc;
+    ctrl->seq_parameter_set_id = sps.seq_parameter_set_id;
+    ctrl->chroma_format_idc = sps.chroma_format_idc;
+    ctrl->bit_depth_luma_minus8 = sps.bit_depth_luma_minus8;
+    ctrl->bit_depth_chroma_minus8 = sps.bit_depth_chroma_minus8;
+    ctrl->log2_max_frame_num_minus4 = sps.log2_max_frame_num_minus4;
+    ctrl->pic_order_cnt_type = sps.pic_order_cnt_type;
+    ctrl->log2_max_pic_order_cnt_lsb_minus4 = sps.log2_max_pic_order_cnt_lsb_minus4;
+    ctrl->max_num_ref_frames = sps.max_num_ref_frames;
+    ctrl->num_ref_frames_in_pic_order_cnt_cycle = sps.num_ref_frames_in_pic_order_cnt_cycle;
+    memcpy(ctrl->offset_for_ref_frame, sps.offset_for_ref_frame,
+           sps.num_ref_frames_in_pic_order_cnt_cycle * sizeof(sps.offset_for_ref_frame[0]));
+    ctrl->offset_for_non_ref_pic = sps.offset_for_non_ref_pic;
+    ctrl->offset_for_top_to_bottom_field = sps.offset_for_top_to_bottom_field;
+    ctrl->pic_width_in_mbs_minus1 = sps.pic_width_in_mbs_minus1;
+    ctrl->pic_height_in_map_units_minus1 = sps.pic_height_in_map_units_minus1;
+
+    if (sps.separate_colour_plane_flag) ctrl->flags |= V4L2_H264_SPS_FLAG_SEPARATE_COLOUR_PLANE;
+    if (sps.qpprime_y_zero_transform_bypass_flag) {
+        ctrl->flags |= V4L2_H264_SPS_FLAG_QPPRIME_Y_ZERO_TRANSFORM_BYPASS;
+    }
+    if (sps.delta_pic_order_always_zero_flag) {
+        ctrl->flags |= V4L2_H264_SPS_FLAG_DELTA_PIC_ORDER_ALWAYS_ZERO;
+    }
+    if (sps.gaps_in_frame_num_value_allowed_flag) {
+        ctrl->flags |= V4L2_H264_SPS_FLAG_GAPS_IN_FRAME_NUM_VALUE_ALLOWED;
+    }
+    if (sps.frame_mbs_only_flag) ctrl->flags |= V4L2_H264_SPS_FLAG_FRAME_MBS_ONLY;
+    if (sps.mb_adaptive_frame_field_flag) ctrl->flags |= V4L2_H264_SPS_FLAG_MB_ADAPTIVE_FRAME_FIELD;
+    if (sps.direct_8x8_inference_flag) ctrl->flags |= V4L2_H264_SPS_FLAG_DIRECT_8X8_INFERENCE;
+}
+
+void fillPPSControl(const H264SPS& sps, const H264PPS& pps, struct v4l2_ctrl_h264_pps* ctrl) {
+    memset(ctrl, 0, sizeof(*ctrl));
+    ctrl->pic_parameter_set_id = pps.pic_parameter_set_id;
+    ctrl->seq_parameter_set_id = pps.seq_parameter_set_id;
+    ctrl->num_slice_groups_minus1 = pps.num_slice_groups_minus1;
+    ctrl->num_ref_idx_l0_default_active_minus1 = pps.num_ref_idx_l0_default_active_minus1;
+    ctrl->num_ref_idx_l1_default_active_minus1 = pps.num_ref_idx_l1_default_active_minus1;
+    ctrl->weighted_bipred_idc = pps.weighted_bipred_idc;
+    ctrl->pic_init_qp_minus26 = pps.pic_init_qp_minus26;
+    ctrl->pic_init_qs_minus26 = pps.pic_init_qs_minus26;
+    ctrl->chroma_qp_index_offset = pps.chroma_qp_index_offset;
+    ctrl->second_chroma_qp_index_offset = pps.second_chroma_qp_index_offset;
+
+    if (pps.entropy_coding_mode_flag) ctrl->flags |= V4L2_H264_PPS_FLAG_ENTROPY_CODING_MODE;
+    if (pps.bottom_field_pic_order_in_frame_present_flag) {
+        ctrl->flags |= V4L2_H264_PPS_FLAG_BOTTOM_FIELD_PIC_ORDER_IN_FRAME_PRESENT;
+    }
+    if (pps.weighted_pred_flag) ctrl->flags |= V4L2_H264_PPS_FLAG_WEIGHTED_PRED;
+    if (pps.deblocking_filter_control_present_flag) {
+        ctrl->flags |= V4L2_H264_PPS_FLAG_DEBLOCKING_FILTER_CONTROL_PRESENT;
+    }
+    if (pps.constrained_intra_pred_flag) ctrl->flags |= V4L2_H264_PPS_FLAG_CONSTRAINED_INTRA_PRED;
+    if (pps.redundant_pic_cnt_present_flag) {
+        ctrl->flags |= V4L2_H264_PPS_FLAG_REDUNDANT_PIC_CNT_PRESENT;
+    }
+    if (pps.transform_8x8_mode_flag) ctrl->flags |= V4L2_H264_PPS_FLAG_TRANSFORM_8X8_MODE;
+    // The scaling matrix control always holds the lists to use, including the inferred ones.
+    if (sps.seq_scaling_matrix_present_flag || pps.pic_scaling_matrix_present_flag) {
+        ctrl->flags |= V4L2_H264_PPS_FLAG_SCALING_MATRIX_PRESENT;
+    }
+}
+
+// Get the timestamp the device identifies the frames decoded from |bitstreamId| with, in
+// nanoseconds as the reference_ts of the DPB entries.
+uint64_t getReferenceTimestamp(int32_t bitstreamId) {
+    return static_cast<uint64_t>(bitstreamId) * 1000000000ull;
+}
+
+}  // namespace
+
+// static
+std::unique_ptr<VideoDecoder> V4L2StatelessDecoder::Create(
+        const VideoCodec& codec, const size_t inputBufferSize, const size_t minNumOutputBuffers,
+        const bool lowLatency, GetPoolCB getPoolCb, OutputCB outputCb, ErrorCB errorCb,
+        scoped_refptr<::base::SequencedTaskRunner> taskRunner) {
+    if (codec != VideoCodec::H264) {
+        ALOGV("Stateless decoding of %s is not supported", VideoCodecToString(codec));
+        return nullptr;
+    }
+
+    std::unique_ptr<V4L2StatelessDecoder> decoder =
+            ::base::WrapUnique<V4L2StatelessDecoder>(new V4L2StatelessDecoder(taskRunner));
+    if (!decoder->start(inputBufferSize, minNumOutputBuffers, lowLatency, std::move(getPoolCb),
+                        std::move(outputCb), std::move(errorCb))) {
+        return nullptr;
+    }
+    return decoder;
+}
+
+V4L2StatelessDecoder::V4L2StatelessDecoder(scoped_refptr<::base::SequencedTaskRunner> taskRunner)
+      : mTaskRunner(std::move(taskRunner)) {
+    ALOGV("%s()", __func__);
+
+    mWeakThis = mWeakThisFactory.GetWeakPtr();
+}
+
+V4L2StatelessDecoder::~V4L2StatelessDecoder() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    mWeakThisFactory.InvalidateWeakPtrs();
+
+    // Streamoff input and output queue.
+    if (mOutputQueue) {
+        mOutputQueue->streamoff();
+        mOutputQueue->deallocateBuffers();
+        mOutputQueue = nullptr;
+    }
+    if (mInputQueue) {
+        mInputQueue->streamoff();
+        mInputQueue->deallocateBuffers();
+        mInputQueue = nullptr;
+    }
+    if (mDevice) {
+        mDevice->stopPolling();
+        mDevice = nullptr;
+    }
+}
+
+bool V4L2StatelessDecoder::start(const size_t inputBufferSize, const size_t minNumOutputBuffers,
+                                 const bool lowLatency, GetPoolCB getPoolCb, OutputCB outputCb,
+                                 ErrorCB errorCb) {
+    ALOGV("%s(inputBufferSize=%zu, minNumOutputBuffers=%zu, lowLatency=%d)", __func__,
+          inputBufferSize, minNumOutputBuffers, lowLatency);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    mInputBufferSize = inputBufferSize;
+    mMinNumOutputBuffers = minNumOutputBuffers;
+    mLowLatency = lowLatency;
+    mGetPoolCb = std::move(getPoolCb);
+    mOutputCb = std::move(outputCb);
+    mErrorCb = std::move(errorCb);
+
+    mDevice = V4L2DevicePool::get()->acquire(V4L2Device::Type::kDecoder, V4L2_PIX_FMT_H264_SLICE);
+    if (!mDevice) {
+        ALOGE("Failed to open stateless device for H264");
+        return false;
+    }
+
+    if (!mDevice->hasCapabilities(V4L2_CAP_VIDEO_M2M_MPLANE | V4L2_CAP_STREAMING)) {
+        ALOGE("Device does not have VIDEO_M2M_MPLANE and STREAMING capabilities.");
+        return false;
+    }
+
+    mMediaDevice = V4L2MediaDevice::Open(mDevice.get());
+    if (!mMediaDevice) {
+        ALOGE("Failed to open the media device of the stateless device");
+        return false;
+    }
+
+    // Whole frames are submitted with their start codes, so no slice parameters are needed.
+    std::vector<V4L2ExtCtrl> ctrls;
+    ctrls.emplace_back(V4L2_CID_STATELESS_H264_DECODE_MODE,
+                       V4L2_STATELESS_H264_DECODE_MODE_FRAME_BASED);
+    ctrls.emplace_back(V4L2_CID_STATELESS_H264_START_CODE, V4L2_STATELESS_H264_START_CODE_ANNEX_B);
+    if (!mDevice->setExtCtrls(V4L2_CTRL_CLASS_CODEC_STATELESS, std::move(ctrls))) {
+        ALOGE("Device does not support frame-based decoding with Annex B start codes");
+        return false;
+    }
+
+    mInputQueue = mDevice->getQueue(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+    mOutputQueue = mDevice->getQueue(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+    if (!mInputQueue || !mOutputQueue) {
+        ALOGE("Failed to create V4L2 queue.");
+        return false;
+    }
+
+    // The queues are configured once the first SPS is known, like the device expects.
+    if (!startDevicePolling()) {
+        ALOGE("Failed to start polling V4L2 device.");
+        return false;
+    }
+
+    setState(State::Idle);
+    return true;
+}
+
+void V4L2StatelessDecoder::decode(std::unique_ptr<ConstBitstreamBuffer> buffer,
+                                  DecodeCB decodeCb) {
+    ALOGV("%s(id=%d)", __func__, buffer->id);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mState == State::Error) {
+        ALOGE("Ignore due to error state.");
+        mTaskRunner->PostTask(FROM_HERE, ::base::BindOnce(std::move(decodeCb),
+                                                          VideoDecoder::DecodeStatus::kError));
+        return;
+    }
+
+    if (mState == State::Idle) {
+        setState(State::Decoding);
+    }
+
+    mDecodeRequests.push(DecodeRequest(std::move(buffer), std::move(decodeCb)));
+    pumpDecodeRequest();
+}
+
+void V4L2StatelessDecoder::drain(DecodeCB drainCb) {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    switch (mState) {
+    case State::Idle:
+        ALOGV("Nothing need to drain, ignore.");
+        mTaskRunner->PostTask(
+                FROM_HERE, ::base::BindOnce(std::move(drainCb), VideoDecoder::DecodeStatus::kOk));
+        return;
+
+    case State::Decoding:
+        mDecodeRequests.push(DecodeRequest(nullptr, std::move(drainCb)));
+        pumpDecodeRequest();
+        return;
+
+    case State::Draining:
+    case State::Error:
+        ALOGE("Ignore due to wrong state: %s", StateToString(mState));
+        mTaskRunner->PostTask(FROM_HERE, ::base::BindOnce(std::move(drainCb),
+                                                          VideoDecoder::DecodeStatus::kError));
+        return;
+    }
+}
+
+void V4L2StatelessDecoder::pumpDecodeRequest() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mState != State::Decoding) return;
+
+    while (!mDecodeRequests.empty()) {
+        // Drain the decoder once all the submitted frames are decoded.
+        if (mDecodeRequests.front().buffer == nullptr) {
+            ALOGV("Get drain request.");
+            mDrainCb = std::move(mDecodeRequests.front().decodeCb);
+            mDecodeRequests.pop();
+            setState(State::Draining);
+            tryFinishDrain();
+            return;
+        }
+
+        switch (decodeBuffer(mDecodeRequests.front())) {
+        case DecodeResult::kDone:
+            mDecodeRequests.pop();
+            break;
+
+        case DecodeResult::kRetry:
+            ALOGV("Wait for the device to make progress.");
+            return;
+
+        case DecodeResult::kError: {
+            auto request = std::move(mDecodeRequests.front());
+            mDecodeRequests.pop();
+            if (request.decodeCb) {
+                std::move(request.decodeCb).Run(VideoDecoder::DecodeStatus::kError);
+            }
+            onError();
+            return;
+        }
+        }
+    }
+}
+
+V4L2StatelessDecoder::DecodeResult V4L2StatelessDecoder::decodeBuffer(DecodeRequest& request) {
+    const int32_t bitstreamId = request.buffer->id;
+    ALOGV("%s(bitstreamId=%d)", __func__, bitstreamId);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    // The parameters of the frame are parsed on the CPU, so the bitstream is mapped. Buffers that
+    // need to be processed again are parsed again, storing the same parameter sets.
+    C2ReadView view = request.buffer->dmabuf.map().get();
+    if (view.error() != C2_OK) {
+        ALOGE("Failed to map the bitstream buffer, bitstreamId=%d", bitstreamId);
+        return DecodeResult::kError;
+    }
+
+    NalParser parser(view.data(), std::min<size_t>(view.capacity(), request.buffer->size));
+    std::optional<H264SliceHeader> header;
+    std::vector<std::pair<const uint8_t*, size_t>> slices;
+    uint32_t decodeFlags = 0;
+    while (parser.locateNextNal()) {
+        const uint8_t* nal = parser.data();
+        const size_t nalSize = parser.length();
+        if (nalSize == 0) continue;
+
+        const uint8_t type = parser.type();
+        // The units following the slices of the first picture belong to the next picture, which
+        // is not decoded.
+        if (header && !parser.isSlice()) break;
+
+        H264Parser::Result result = H264Parser::Result::kOk;
+        if (type == H264Parser::kSPSType) {
+            result = mParser.parseSPS(nal, nalSize);
+        } else if (type == H264Parser::kPPSType) {
+            result = mParser.parsePPS(nal, nalSize);
+        } else if (type == H264Parser::kNonIDRSliceType || type == H264Parser::kIDRSliceType) {
+            H264SliceHeader sliceHeader;
+            result = mParser.parseSliceHeader(nal, nalSize, &sliceHeader);
+            if (result != H264Parser::Result::kOk) {
+                ALOGE("Failed to parse slice header, bitstreamId=%d", bitstreamId);
+                return DecodeResult::kError;
+            }
+            if (header && sliceHeader.first_mb_in_slice == 0) {
+                ALOGW("Only the first picture of bitstreamId=%d is decoded", bitstreamId);
+                break;
+            }
+            if (!header) header = sliceHeader;
+            if (sliceHeader.isPSlice()) decodeFlags |= V4L2_H264_DECODE_PARAM_FLAG_PFRAME;
+            if (sliceHeader.isBSlice()) decodeFlags |= V4L2_H264_DECODE_PARAM_FLAG_BFRAME;
+            slices.emplace_back(nal, nalSize);
+        }
+        if (result != H264Parser::Result::kOk) {
+            ALOGE("Failed to parse parameter set, bitstreamId=%d", bitstreamId);
+            return DecodeResult::kError;
+        }
+    }
+
+    // Buffers without picture, like the codec-specific data, are done once parsed.
+    if (!header) {
+        ALOGV("No picture in bitstreamId=%d", bitstreamId);
+        mTaskRunner->PostTask(FROM_HERE, ::base::BindOnce(std::move(request.decodeCb),
+                                                          VideoDecoder::DecodeStatus::kOk));
+        return DecodeResult::kDone;
+    }
+
+    const H264PPS* pps = mParser.getPPS(header->pic_parameter_set_id);
+    const H264SPS* sps = pps ? mParser.getSPS(pps->seq_parameter_set_id) : nullptr;
+    ALOG_ASSERT(sps, "Slice header parsed without parameter sets");
+    if (header->field_pic_flag) {
+        ALOGE("Field pictures are not supported");
+        return DecodeResult::kError;
+    }
+    if (sps->chroma_format_idc != 1 || sps->bit_depth_luma_minus8 != 0 ||
+        sps->bit_depth_chroma_minus8 != 0) {
+        ALOGE("Only 8-bit 4:2:0 streams are supported");
+        return DecodeResult::kError;
+    }
+
+    // A new sequence which doesn't fit the current configuration is decoded after the pictures of
+    // the previous one.
+    if (!mConfigured || sps->getCodedSize() != mStreamCodedSize ||
+        sps->getMaxDpbFrames() > mMaxDpbFrames || sps->getVisibleRect() != mVisibleRect) {
+        const DecodeResult result = configure(*sps);
+        if (result != DecodeResult::kDone) return result;
+    }
+
+    // The input buffers are only reallocated when the picture doesn't fit them.
+    size_t accessUnitSize = 0;
+    for (const auto& slice : slices) accessUnitSize += sizeof(kNalStartCode) + slice.second;
+    mMaxAccessUnitSize = std::max(mMaxAccessUnitSize, accessUnitSize);
+    if (accessUnitSize > mInputBufferSize) {
+        const DecodeResult result = resizeInputBuffers(getInputBufferSizeFor(accessUnitSize));
+        if (result != DecodeResult::kDone) return result;
+    }
+
+    if (mInputQueue->freeBuffersCount() == 0) {
+        ALOGV("There is no free input buffer.");
+        return DecodeResult::kRetry;
+    }
+
+    auto picture = std::make_shared<Picture>();
+    picture->mBitstreamId = bitstreamId;
+    picture->mIdr = header->idr_pic_flag;
+    picture->mNalRefIdc = header->nal_ref_idc;
+    picture->mFrameNum = header->frame_num;
+
+    const int32_t maxFrameNum = 1 << (sps->log2_max_frame_num_minus4 + 4);
+    if (header->idr_pic_flag) {
+        // The pictures preceding an IDR picture are all output, even if no_output_of_prior_pics
+        // is set, so that the works of all the bitstreams are finished.
+        flushDpb();
+        decodeFlags |= V4L2_H264_DECODE_PARAM_FLAG_IDR_PIC;
+    } else if (header->frame_num != mPrevRefFrameNum &&
+               header->frame_num != (mPrevRefFrameNum + 1) % maxFrameNum) {
+        handleFrameNumGap(*sps, header->frame_num);
+    }
+
+    computePicOrderCnt(*sps, *header, picture.get());
+    updatePicNums(*sps, header->frame_num);
+
+    if (!submitPicture(*header, *picture, slices, decodeFlags, &request.decodeCb)) {
+        return DecodeResult::kError;
+    }
+    mPicturesAtDevice[bitstreamId] = picture;
+
+    if (header->nal_ref_idc != 0) markReferencePictures(*sps, *header, picture.get());
+
+    // Keep the state of this picture for the picture order count of the next ones. A picture
+    // with memory_management_control_operation 5 is considered to have frame_num 0 (8.2.1).
+    mPrevHasMmco5 = picture->mHasMmco5;
+    mPrevFrameNum = picture->mFrameNum;
+    mPrevFrameNumOffset = picture->mHasMmco5 ? 0 : picture->mFrameNumOffset;
+    if (picture->isRef()) {
+        mPrevRefFrameNum = picture->mFrameNum;
+        mPrevRefPicOrderCntMsb = picture->mHasMmco5 ? 0 : picture->mPicOrderCntMsb;
+        mPrevRefPicOrderCntLsb =
+                picture->mHasMmco5 ? picture->mTopFieldOrderCnt : header->pic_order_cnt_lsb;
+    }
+
+    // All the prior pictures precede the pictures following memory_management_control_operation
+    // 5 in output order (C.4.4).
+    if (picture->mHasMmco5) flushDpb();
+    picture->mOutputNeeded = true;
+    storePicture(std::move(picture));
+
+    if (!releaseParkedFrames()) return DecodeResult::kError;
+    outputPictures();
+    return DecodeResult::kDone;
+}
+
+V4L2StatelessDecoder::DecodeResult V4L2StatelessDecoder::configure(const H264SPS& sps) {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    // The queues can only be reconfigured once all the pictures of the previous sequence are
+    // decoded.
+    flushDpb();
+    if (mInputQueue->queuedBuffersCount() > 0 || !mPicturesAtDevice.empty()) {
+        ALOGV("Wait for the pictures of the previous sequence to be decoded.");
+        return DecodeResult::kRetry;
+    }
+    outputPictures();
+
+    mOutputQueue->streamoff();
+    mOutputQueue->deallocateBuffers();
+    mFrameAtDevice.clear();
+    mParkedFrames.clear();
+    mBlockIdToV4L2Id.clear();
+    mInputQueue->streamoff();
+    mInputQueue->deallocateBuffers();
+
+    // Shrink the input buffers to the access units seen so far, the next larger ones reallocate
+    // them anyway.
+    if (V4L2DecodeInterface::isInputBufferSizeAdaptive() && mMaxAccessUnitSize > 0) {
+        mInputBufferSize = std::min(mInputBufferSize, getInputBufferSizeFor(mMaxAccessUnitSize));
+    }
+
+    // The input format must be set before the SPS, which determines the decoded formats.
+    const ui::Size codedSize = sps.getCodedSize();
+    auto format = mInputQueue->setFormat(V4L2_PIX_FMT_H264_SLICE, codedSize, mInputBufferSize);
+    if (!format) {
+        ALOGE("Failed to set the input format for %s", toString(codedSize).c_str());
+        return DecodeResult::kError;
+    }
+    // The bitstream is copied into every buffer, so map them upfront.
+    const size_t numInputBuffers = mInputQueue->allocateBuffers(
+            getPipelineDepth(), V4L2_MEMORY_MMAP, V4L2Queue::MapMode::kPrefault);
+    if (numInputBuffers == 0) {
+        ALOGE("Failed to allocate input buffer.");
+        return DecodeResult::kError;
+    }
+    mPendingDecodeCbs.resize(numInputBuffers);
+    while (mRequests.size() < numInputBuffers) {
+        ::base::ScopedFD request = mMediaDevice->allocateRequest();
+        if (!request.is_valid()) return DecodeResult::kError;
+        mRequests.push_back(std::move(request));
+    }
+
+    struct v4l2_ctrl_h264_sps spsCtrl;
+    fillSPSControl(sps, &spsCtrl);
+    std::vector<V4L2ExtCtrl> ctrls;
+    ctrls.emplace_back(V4L2_CID_STATELESS_H264_SPS, &spsCtrl, sizeof(spsCtrl));
+    if (!mDevice->setExtCtrls(V4L2_CTRL_CLASS_CODEC_STATELESS, std::move(ctrls))) {
+        ALOGE("Failed to set the SPS control");
+        return DecodeResult::kError;
+    }
+
+    if (!setupOutputFormat(codedSize)) return DecodeResult::kError;
+    const std::optional<struct v4l2_format> outputFormat = mOutputQueue->getFormat().first;
+    if (!outputFormat) {
+        ALOGE("Failed to get the output format");
+        return DecodeResult::kError;
+    }
+    mCodedSize.set(outputFormat->fmt.pix_mp.width, outputFormat->fmt.pix_mp.height);
+    mStreamCodedSize = codedSize;
+    mVisibleRect = sps.getVisibleRect();
+    mMaxDpbFrames = sps.getMaxDpbFrames();
+    mMaxReorderFrames = mLowLatency ? 0 : sps.getMaxReorderFrames();
+
+    // The output buffers hold the reference pictures, the pictures being decoded, and the
+    // pictures in the rest of the video pipeline.
+    const size_t numOutputBuffers = std::max(
+            mMaxDpbFrames + numInputBuffers + kNumExtraOutputBuffers + 1, mMinNumOutputBuffers);
+    ALOGI("Need %zu output buffers. coded size: %s, visible rect: %s, DPB size: %zu",
+          numOutputBuffers, toString(mCodedSize).c_str(), toString(mVisibleRect).c_str(),
+          mMaxDpbFrames);
+    const size_t adjustedNumOutputBuffers =
+            mOutputQueue->allocateBuffers(numOutputBuffers, V4L2_MEMORY_DMABUF);
+    if (adjustedNumOutputBuffers == 0) {
+        ALOGE("Failed to allocate output buffer.");
+        return DecodeResult::kError;
+    }
+    mFrameAtDevice.resize(adjustedNumOutputBuffers);
+    mParkedFrames.resize(adjustedNumOutputBuffers);
+    mBlockIdToV4L2Id.reserve(adjustedNumOutputBuffers);
+
+    if (!mInputQueue->streamon() || !mOutputQueue->streamon()) {
+        ALOGE("Failed to streamon the queues.");
+        return DecodeResult::kError;
+    }
+
+    // Release the previous VideoFramePool before getting a new one to guarantee only one pool
+    // exists at the same time.
+    mVideoFramePool.reset();
+    mVideoFramePool = mGetPoolCb.Run(mCodedSize, mOutputFormat.halFormat, mOutputFormat.usage,
+                                     adjustedNumOutputBuffers);
+    if (!mVideoFramePool && !mOutputFormat.isLinear()) {
+        // The consumer can't take compressed or tiled buffers, decode to a linear format instead.
+        ALOGW("Failed to get block pool for %s output, falling back to linear output",
+              fourccToString(mOutputFormat.v4l2PixFmt).c_str());
+        mCompressedOutputRejected = true;
+        return configure(sps);
+    }
+    if (!mVideoFramePool) {
+        ALOGE("Failed to get block pool with size: %s", toString(mCodedSize).c_str());
+        return DecodeResult::kError;
+    }
+
+    mConfigured = true;
+    tryFetchVideoFrame();
+    return DecodeResult::kDone;
+}
+
+V4L2StatelessDecoder::DecodeResult V4L2StatelessDecoder::resizeInputBuffers(size_t size) {
+    ALOGV("%s(size=%zu)", __func__, size);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mInputQueue->queuedBuffersCount() > 0) {
+        ALOGV("Wait for the input buffers to be dequeued.");
+        return DecodeResult::kRetry;
+    }
+
+    ALOGI("Reallocate the input buffers from %zu to %zu bytes", mInputBufferSize, size);
+    mInputQueue->streamoff();
+    mInputQueue->deallocateBuffers();
+
+    // The pixel format and the coded size are kept, so the decoded formats don't change.
+    auto format = mInputQueue->setFormat(V4L2_PIX_FMT_H264_SLICE, mStreamCodedSize, size);
+    if (!format) {
+        ALOGE("Failed to set the input format with %zu bytes", size);
+        return DecodeResult::kError;
+    }
+    // The bitstream is copied into every buffer, so map them upfront.
+    const size_t numInputBuffers = mInputQueue->allocateBuffers(
+            getPipelineDepth(), V4L2_MEMORY_MMAP, V4L2Queue::MapMode::kPrefault);
+    if (numInputBuffers == 0) {
+        ALOGE("Failed to allocate input buffer.");
+        return DecodeResult::kError;
+    }
+    mPendingDecodeCbs.resize(numInputBuffers);
+    while (mRequests.size() < numInputBuffers) {
+        ::base::ScopedFD request = mMediaDevice->allocateRequest();
+        if (!request.is_valid()) return DecodeResult::kError;
+        mRequests.push_back(std::move(request));
+    }
+    if (!mInputQueue->streamon()) {
+        ALOGE("Failed to streamon the input queue.");
+        return DecodeResult::kError;
+    }
+
+    mInputBufferSize = size;
+    return DecodeResult::kDone;
+}
+
+bool V4L2StatelessDecoder::submitPicture(
+        const H264SliceHeader& header, const Picture& picture,
+        const std::vector<std::pair<const uint8_t*, size_t>>& slices, uint32_t decodeFlags,
+        DecodeCB* decodeCb) {
+    ALOGV("%s(bitstreamId=%d)", __func__, picture.mBitstreamId);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    const H264PPS* pps = mParser.getPPS(header.pic_parameter_set_id);
+    const H264SPS* sps = mParser.getSPS(pps->seq_parameter_set_id);
+
+    auto inputBuffer = mInputQueue->getFreeBuffer();
+    if (!inputBuffer) {
+        ALOGE("There is no free input buffer.");
+        return false;
+    }
+    const size_t inputBufferId = inputBuffer->bufferId();
+
+    // Copy the slices of the picture with their start codes.
+    uint8_t* mapping = static_cast<uint8_t*>(inputBuffer->getPlaneMapping(0));
+    if (!mapping) {
+        ALOGE("Failed to map input buffer %zu", inputBufferId);
+        return false;
+    }
+    const size_t planeSize = inputBuffer->getPlaneSize(0);
+    size_t bytesUsed = 0;
+    for (const auto& [nal, nalSize] : slices) {
+        if (bytesUsed + sizeof(kNalStartCode) + nalSize > planeSize) {
+            ALOGE("The input size (%zu) is not enough for bitstreamId=%d", planeSize,
+                  picture.mBitstreamId);
+            return false;
+        }
+        memcpy(mapping + bytesUsed, kNalStartCode, sizeof(kNalStartCode));
+        bytesUsed += sizeof(kNalStartCode);
+        memcpy(mapping + bytesUsed, nal, nalSize);
+        bytesUsed += nalSize;
+    }
+    inputBuffer->setPlaneBytesUsed(0, bytesUsed);
+    // The timestamp is copied to the decoded frame, and identifies it as a reference picture.
+    inputBuffer->setTimeStamp({.tv_sec = picture.mBitstreamId, .tv_usec = 0});
+
+    struct v4l2_ctrl_h264_sps spsCtrl;
+    fillSPSControl(*sps, &spsCtrl);
+    struct v4l2_ctrl_h264_pps ppsCtrl;
+    fillPPSControl(*sps, *pps, &ppsCtrl);
+    struct v4l2_ctrl_h264_scaling_matrix scalingMatrix;
+    memcpy(scalingMatrix.scaling_list_4x4, pps->scaling_list_4x4,
+           sizeof(scalingMatrix.scaling_list_4x4));
+    memcpy(scalingMatrix.scaling_list_8x8, pps->scaling_list_8x8,
+           sizeof(scalingMatrix.scaling_list_8x8));
+
+    struct v4l2_ctrl_h264_decode_params decodeParams;
+    memset(&decodeParams, 0, sizeof(decodeParams));
+    size_t numEntries = 0;
+    for (const auto& dpbPicture : mDpb) {
+        // Frames inferred from gaps in frame_num are not known to the device.
+        if (dpbPicture->mBitstreamId < 0 || numEntries == V4L2_H264_NUM_DPB_ENTRIES) continue;
+        struct v4l2_h264_dpb_entry& entry = decodeParams.dpb[numEntries++];
+        entry.reference_ts = getReferenceTimestamp(dpbPicture->mBitstreamId);
+        entry.pic_num =
+                dpbPicture->mLongTermRef ? dpbPicture->mLongTermPicNum : dpbPicture->mPicNum;
+        entry.frame_num =
+                dpbPicture->mLongTermRef ? dpbPicture->mLongTermFrameIdx : dpbPicture->mFrameNum;
+        entry.fields = V4L2_H264_FRAME_REF;
+        entry.top_field_order_cnt = dpbPicture->mTopFieldOrderCnt;
+        entry.bottom_field_order_cnt = dpbPicture->mBottomFieldOrderCnt;
+        entry.flags = V4L2_H264_DPB_ENTRY_FLAG_VALID;
+        if (dpbPicture->isRef()) entry.flags |= V4L2_H264_DPB_ENTRY_FLAG_ACTIVE;
+        if (dpbPicture->mLongTermRef) entry.flags |= V4L2_H264_DPB_ENTRY_FLAG_LONG_TERM;
+    }
+    decodeParams.nal_ref_idc = header.nal_ref_idc;
+    decodeParams.frame_num = header.frame_num;
+    decodeParams.top_field_order_cnt = picture.mTopFieldOrderCnt;
+    decodeParams.bottom_field_order_cnt = picture.mBottomFieldOrderCnt;
+    decodeParams.idr_pic_id = header.idr_pic_id;
+    decodeParams.pic_order_cnt_lsb = header.pic_order_cnt_lsb;
+    decodeParams.delta_pic_order_cnt_bottom = header.delta_pic_order_cnt_bottom;
+    decodeParams.delta_pic_order_cnt0 = header.delta_pic_order_cnt[0];
+    decodeParams.delta_pic_order_cnt1 = header.delta_pic_order_cnt[1];
+    decodeParams.dec_ref_pic_marking_bit_size = header.dec_ref_pic_marking_bit_size;
+    decodeParams.pic_order_cnt_bit_size = header.pic_order_cnt_bit_size;
+    decodeParams.flags = decodeFlags;
+
+    // Each input buffer is submitted with its own request, which was completed when the buffer
+    // was dequeued.
+    const int requestFd = mRequests[inputBufferId].get();
+    if (!V4L2MediaDevice::reinitRequest(requestFd)) return false;
+
+    std::vector<V4L2ExtCtrl> ctrls;
+    ctrls.emplace_back(V4L2_CID_STATELESS_H264_SPS, &spsCtrl, sizeof(spsCtrl));
+    ctrls.emplace_back(V4L2_CID_STATELESS_H264_PPS, &ppsCtrl, sizeof(ppsCtrl));
+    ctrls.emplace_back(V4L2_CID_STATELESS_H264_SCALING_MATRIX, &scalingMatrix,
+                       sizeof(scalingMatrix));
+    ctrls.emplace_back(V4L2_CID_STATELESS_H264_DECODE_PARAMS, &decodeParams,
+                       sizeof(decodeParams));
+    if (!mDevice->setExtCtrlsInRequest(std::move(ctrls), requestFd)) {
+        ALOGE("Failed to set the controls of bitstreamId=%d", picture.mBitstreamId);
+        return false;
+    }
+
+    ALOGV("QBUF to input queue, bitstreamId=%d", picture.mBitstreamId);
+    inputBuffer->setRequestFd(requestFd);
+    if (!std::move(*inputBuffer).queueMMap()) {
+        ALOGE("%s(): Failed to QBUF to input queue, bitstreamId=%d", __func__,
+              picture.mBitstreamId);
+        return false;
+    }
+    if (!V4L2MediaDevice::queueRequest(requestFd)) return false;
+
+    ALOG_ASSERT(inputBufferId < mPendingDecodeCbs.size());
+    mPendingDecodeCbs[inputBufferId] = std::move(*decodeCb);
+    return true;
+}
+
+void V4L2StatelessDecoder::tryFinishDrain() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mState != State::Draining) return;
+    if (mInputQueue->queuedBuffersCount() > 0 || !mPicturesAtDevice.empty()) {
+        ALOGV("Wait for all submitted pictures to be decoded.");
+        return;
+    }
+
+    flushDpb();
+    outputPictures();
+    ALOGV("All buffers are drained.");
+    std::move(mDrainCb).Run(VideoDecoder::DecodeStatus::kOk);
+    setState(State::Idle);
+
+    // Resume the buffers queued after the drain request.
+    if (!mDecodeRequests.empty()) {
+        setState(State::Decoding);
+        mTaskRunner->PostTask(FROM_HERE, ::base::BindOnce(&V4L2StatelessDecoder::pumpDecodeRequest,
+                                                          mWeakThis));
+    }
+}
+
+size_t V4L2StatelessDecoder::getMemoryUsage() const {
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    size_t usage = 0;
+    if (mInputQueue) usage += mInputQueue->getMemoryUsage();
+    if (mOutputQueue) usage += mOutputQueue->getMemoryUsage();
+    return usage;
+}
+
+void V4L2StatelessDecoder::flush() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mState == State::Idle) {
+        ALOGV("Nothing need to flush, ignore.");
+        return;
+    }
+    if (mState == State::Error) {
+        ALOGE("Ignore due to error state.");
+        return;
+    }
+
+    // Call all pending callbacks.
+    for (DecodeCB& decodeCb : mPendingDecodeCbs) {
+        if (decodeCb) std::move(decodeCb).Run(VideoDecoder::DecodeStatus::kAborted);
+    }
+    while (!mDecodeRequests.empty()) {
+        auto request = std::move(mDecodeRequests.front());
+        mDecodeRequests.pop();
+        if (request.decodeCb) {
+            std::move(request.decodeCb).Run(VideoDecoder::DecodeStatus::kAborted);
+        }
+    }
+    if (mDrainCb) {
+        std::move(mDrainCb).Run(VideoDecoder::DecodeStatus::kAborted);
+    }
+
+    // Streamoff both V4L2 queues to drop the submitted pictures and the decoded frames.
+    mDevice->stopPolling();
+    mOutputQueue->streamoff();
+    for (auto& frame : mFrameAtDevice) frame.reset();
+    for (auto& frame : mParkedFrames) frame.reset();
+    mInputQueue->streamoff();
+
+    // The stream resumes at an IDR picture.
+    mDpb.clear();
+    mOutputPictures.clear();
+    mPicturesAtDevice.clear();
+    mPrevRefPicOrderCntMsb = 0;
+    mPrevRefPicOrderCntLsb = 0;
+    mPrevFrameNumOffset = 0;
+    mPrevFrameNum = 0;
+    mPrevRefFrameNum = 0;
+    mPrevHasMmco5 = false;
+    mMaxLongTermFrameIdx = -1;
+
+    if (mConfigured) {
+        mInputQueue->streamon();
+        mOutputQueue->streamon();
+        // All the buffers are dropped at mOutputQueue, so we have to trigger
+        // tryFetchVideoFrame() here.
+        tryFetchVideoFrame();
+    }
+
+    if (!startDevicePolling()) {
+        ALOGE("Failed to start polling V4L2 device.");
+        onError();
+        return;
+    }
+
+    setState(State::Idle);
+}
+
+bool V4L2StatelessDecoder::startDevicePolling() {
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (V4L2DevicePoller::isBatchedPollingEnabled()) {
+        return mDevice->startPolling(
+                ::base::BindRepeating(&V4L2StatelessDecoder::serviceDeviceReadiness, mWeakThis),
+                ::base::BindRepeating(&V4L2StatelessDecoder::onError, mWeakThis));
+    }
+    return mDevice->startPolling(
+            ::base::BindRepeating(&V4L2StatelessDecoder::serviceDeviceTask, mWeakThis),
+            ::base::BindRepeating(&V4L2StatelessDecoder::onError, mWeakThis));
+}
+
+void V4L2StatelessDecoder::serviceDeviceTask(bool event) {
+    serviceDeviceReadiness(V4L2DevicePoller::kInputReady | V4L2DevicePoller::kOutputReady |
+                           (event ? V4L2DevicePoller::kEventPending : 0u));
+}
+
+bool V4L2StatelessDecoder::serviceDeviceReadiness(uint32_t readiness) {
+    PerformanceHintSession::ScopedWork hintWork;
+    ALOGV("%s(readiness=0x%x) state=%s InputQueue:%zu+%zu/%zu, OutputQueue:%zu+%zu/%zu", __func__,
+          readiness, StateToString(mState), mInputQueue->freeBuffersCount(),
+          mInputQueue->queuedBuffersCount(), mInputQueue->allocatedBuffersCount(),
+          mOutputQueue->freeBuffersCount(), mOutputQueue->queuedBuffersCount(),
+          mOutputQueue->allocatedBuffersCount());
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mState == State::Error) return false;
+
+    // Dequeue output and input queue. Queues which were not reported ready are skipped.
+    bool inputDequeued = false;
+    while ((readiness & V4L2DevicePoller::kInputReady) && mInputQueue->queuedBuffersCount() > 0) {
+        bool success;
+        V4L2ReadableBufferRef dequeuedBuffer;
+        std::tie(success, dequeuedBuffer) = mInputQueue->dequeueBuffer();
+        if (!success) {
+            ALOGE("Failed to dequeue buffer from input queue.");
+            onError();
+            return false;
+        }
+        if (!dequeuedBuffer) break;
+
+        inputDequeued = true;
+
+        // Run the corresponding decode callback.
+        ALOGV("DQBUF from input queue, bitstreamId=%d",
+              static_cast<int32_t>(dequeuedBuffer->getTimeStamp().tv_sec));
+        ALOG_ASSERT(dequeuedBuffer->bufferId() < mPendingDecodeCbs.size());
+        DecodeCB& decodeCb = mPendingDecodeCbs[dequeuedBuffer->bufferId()];
+        if (!decodeCb) {
+            ALOGW("Callback is already abandoned.");
+            continue;
+        }
+        std::move(decodeCb).Run(VideoDecoder::DecodeStatus::kOk);
+    }
+
+    bool outputDequeued = false;
+    while ((readiness & V4L2DevicePoller::kOutputReady) && mOutputQueue->queuedBuffersCount() > 0) {
+        bool success;
+        V4L2ReadableBufferRef dequeuedBuffer;
+        std::tie(success, dequeuedBuffer) = mOutputQueue->dequeueBuffer();
+        if (!success) {
+            ALOGE("Failed to dequeue buffer from output queue.");
+            onError();
+            return false;
+        }
+        if (!dequeuedBuffer) break;
+
+        outputDequeued = true;
+
+        const size_t bufferId = dequeuedBuffer->bufferId();
+        const int32_t bitstreamId = static_cast<int32_t>(dequeuedBuffer->getTimeStamp().tv_sec);
+        const bool isError = dequeuedBuffer->isError();
+        ALOGV("DQBUF from output queue, bufferId=%zu, bitstreamId=%d, isError=%d", bufferId,
+              bitstreamId, isError);
+
+        // Get the corresponding VideoFrame of the dequeued buffer.
+        ALOG_ASSERT(bufferId < mFrameAtDevice.size() && mFrameAtDevice[bufferId],
+                    "buffer %zu is not found at mFrameAtDevice", bufferId);
+        auto frame = std::move(mFrameAtDevice[bufferId]);
+
+        auto it = mPicturesAtDevice.find(bitstreamId);
+        if (it == mPicturesAtDevice.end()) {
+            ALOGV("Recycle buffer %zu of unknown bitstreamId=%d", bufferId, bitstreamId);
+            dequeuedBuffer.reset();
+            if (!queueFrameToDevice(std::move(frame), bufferId)) {
+                onError();
+                return false;
+            }
+            continue;
+        }
+
+        // A picture which failed to decode is still output, so its work can be finished.
+        if (isError) ALOGW("Failed to decode bitstreamId=%d", bitstreamId);
+        std::shared_ptr<Picture> picture = std::move(it->second);
+        mPicturesAtDevice.erase(it);
+        picture->mFrame = std::move(frame);
+        picture->mV4L2Id = bufferId;
+        picture->mDecoded = true;
+    }
+
+    if (outputDequeued) outputPictures();
+    tryFinishDrain();
+
+    // We freed some input buffers, or the device might be idle, continue handling decode
+    // requests.
+    if (inputDequeued || outputDequeued) {
+        mTaskRunner->PostTask(FROM_HERE, ::base::BindOnce(&V4L2StatelessDecoder::pumpDecodeRequest,
+                                                          mWeakThis));
+    }
+    // We free some output buffers, try to get VideoFrame.
+    if (outputDequeued) {
+        mTaskRunner->PostTask(
+                FROM_HERE, ::base::BindOnce(&V4L2StatelessDecoder::tryFetchVideoFrame, mWeakThis));
+    }
+
+    return inputDequeued || outputDequeued;
+}
+
+bool V4L2StatelessDecoder::setupOutputFormat(const ui::Size& size) {
+    const std::optional<DecodeOutputFormat> format = setupDecodeOutputFormat(
+            mDevice.get(), mOutputQueue.get(), size, !mCompressedOutputRejected);
+    if (!format) {
+        ALOGE("Failed to find supported pixel format");
+        return false;
+    }
+
+    mOutputFormat = *format;
+    return true;
+}
+
+void V4L2StatelessDecoder::computePicOrderCnt(const H264SPS& sps, const H264SliceHeader& header,
+                                              Picture* picture) {
+    const int32_t maxFrameNum = 1 << (sps.log2_max_frame_num_minus4 + 4);
+
+    if (sps.pic_order_cnt_type == 0) {
+        // 8.2.1.1
+        int32_t prevPicOrderCntMsb = header.idr_pic_flag ? 0 : mPrevRefPicOrderCntMsb;
+        int32_t prevPicOrderCntLsb = header.idr_pic_flag ? 0 : mPrevRefPicOrderCntLsb;
+        const int32_t maxPicOrderCntLsb = 1 << (sps.log2_max_pic_order_cnt_lsb_minus4 + 4);
+        const int32_t lsb = header.pic_order_cnt_lsb;
+        if (lsb < prevPicOrderCntLsb && (prevPicOrderCntLsb - lsb) >= maxPicOrderCntLsb / 2) {
+            picture->mPicOrderCntMsb = prevPicOrderCntMsb + maxPicOrderCntLsb;
+        } else if (lsb > prevPicOrderCntLsb &&
+                   (lsb - prevPicOrderCntLsb) > maxPicOrderCntLsb / 2) {
+            picture->mPicOrderCntMsb = prevPicOrderCntMsb - maxPicOrderCntLsb;
+        } else {
+            picture->mPicOrderCntMsb = prevPicOrderCntMsb;
+        }
+        picture->mTopFieldOrderCnt = picture->mPicOrderCntMsb + lsb;
+        picture->mBottomFieldOrderCnt =
+                picture->mTopFieldOrderCnt + header.delta_pic_order_cnt_bottom;
+        return;
+    }
+
+    // 8.2.1.2 and 8.2.1.3
+    if (header.idr_pic_flag) {
+        picture->mFrameNumOffset = 0;
+    } else if (mPrevFrameNum > header.frame_num) {
+        picture->mFrameNumOffset = mPrevFrameNumOffset + maxFrameNum;
+    } else {
+        picture->mFrameNumOffset = mPrevFrameNumOffset;
+    }
+
+    if (sps.pic_order_cnt_type == 2) {
+        int32_t tempPicOrderCnt = 0;
+        if (!header.idr_pic_flag) {
+            tempPicOrderCnt = 2 * (picture->mFrameNumOffset + header.frame_num);
+            if (header.nal_ref_idc == 0) tempPicOrderCnt -= 1;
+        }
+        picture->mTopFieldOrderCnt = tempPicOrderCnt;
+        picture->mBottomFieldOrderCnt = tempPicOrderCnt;
+        return;
+    }
+
+    const int32_t numRefFrames = sps.num_ref_frames_in_pic_order_cnt_cycle;
+    int32_t absFrameNum = numRefFrames != 0 ? picture->mFrameNumOffset + header.frame_num : 0;
+    if (header.nal_ref_idc == 0 && absFrameNum > 0) absFrameNum -= 1;
+
+    int32_t expectedPicOrderCnt = 0;
+    if (absFrameNum > 0) {
+        int32_t expectedDeltaPerPicOrderCntCycle = 0;
+        for (int32_t i = 0; i < numRefFrames; ++i) {
+            expectedDeltaPerPicOrderCntCycle += sps.offset_for_ref_frame[i];
+        }
+        const int32_t picOrderCntCycleCnt = (absFrameNum - 1) / numRefFrames;
+        const int32_t frameNumInPicOrderCntCycle = (absFrameNum - 1) % numRefFrames;
+        expectedPicOrderCnt = picOrderCntCycleCnt * expectedDeltaPerPicOrderCntCycle;
+        for (int32_t i = 0; i <= frameNumInPicOrderCntCycle; ++i) {
+            expectedPicOrderCnt += sps.offset_for_ref_frame[i];
+        }
+    }
+    if (header.nal_ref_idc == 0) expectedPicOrderCnt += sps.offset_for_non_ref_pic;
+
+    picture->mTopFieldOrderCnt = expectedPicOrderCnt + header.delta_pic_order_cnt[0];
+    picture->mBottomFieldOrderCnt = picture->mTopFieldOrderCnt +
+                                    sps.offset_for_top_to_bottom_field +
+                                    header.delta_pic_order_cnt[1];
+}
+
+void V4L2StatelessDecoder::updatePicNums(const H264SPS& sps, int32_t currFrameNum) {
+    // 8.2.4.1, only frames are decoded.
+    const int32_t maxFrameNum = 1 << (sps.log2_max_frame_num_minus4 + 4);
+    for (const auto& picture : mDpb) {
+        if (picture->mShortTermRef) {
+            picture->mFrameNumWrap = picture->mFrameNum > currFrameNum
+                                             ? picture->mFrameNum - maxFrameNum
+                                             : picture->mFrameNum;
+            picture->mPicNum = picture->mFrameNumWrap;
+        }
+        if (picture->mLongTermRef) picture->mLongTermPicNum = picture->mLongTermFrameIdx;
+    }
+}
+
+void V4L2StatelessDecoder::handleFrameNumGap(const H264SPS& sps, int32_t frameNum) {
+    ALOGV("%s(frameNum=%d) prevRefFrameNum=%d", __func__, frameNum, mPrevRefFrameNum);
+
+    if (!sps.gaps_in_frame_num_value_allowed_flag) {
+        ALOGW("Unexpected gap in frame_num, inferring the missing frames");
+    }
+
+    // 8.2.5.2, the missing frames are short-term references which are never output.
+    const int32_t maxFrameNum = 1 << (sps.log2_max_frame_num_minus4 + 4);
+    for (int32_t unusedFrameNum = (mPrevRefFrameNum + 1) % maxFrameNum; unusedFrameNum != frameNum;
+         unusedFrameNum = (unusedFrameNum + 1) % maxFrameNum) {
+        auto picture = std::make_shared<Picture>();
+        picture->mFrameNum = unusedFrameNum;
+        picture->mFrameNumOffset = mPrevFrameNum > unusedFrameNum
+                                           ? mPrevFrameNumOffset + maxFrameNum
+                                           : mPrevFrameNumOffset;
+
+        updatePicNums(sps, unusedFrameNum);
+        slidingWindowMarking(sps);
+        picture->mShortTermRef = true;
+        storePicture(picture);
+
+        mPrevFrameNum = unusedFrameNum;
+        mPrevRefFrameNum = unusedFrameNum;
+        mPrevFrameNumOffset = picture->mFrameNumOffset;
+        mPrevHasMmco5 = false;
+    }
+}
+
+void V4L2StatelessDecoder::markReferencePictures(const H264SPS& sps,
+                                                 const H264SliceHeader& header,
+                                                 Picture* picture) {
+    // 8.2.5.1
+    if (header.idr_pic_flag) {
+        // The previous pictures were all removed when the IDR picture was parsed.
+        if (header.long_term_reference_flag) {
+            picture->mLongTermRef = true;
+            picture->mLongTermFrameIdx = 0;
+            mMaxLongTermFrameIdx = 0;
+        } else {
+            picture->mShortTermRef = true;
+            mMaxLongTermFrameIdx = -1;
+        }
+        return;
+    }
+
+    if (!header.adaptive_ref_pic_marking_mode_flag) {
+        slidingWindowMarking(sps);
+        picture->mShortTermRef = true;
+        return;
+    }
+
+    // 8.2.5.4
+    auto findShortTerm = [this](int32_t picNum) -> Picture* {
+        for (const auto& dpbPicture : mDpb) {
+            if (dpbPicture->mShortTermRef && dpbPicture->mPicNum == picNum) {
+                return dpbPicture.get();
+            }
+        }
+        return nullptr;
+    };
+    auto unmarkLongTerm = [this](auto predicate) {
+        for (const auto& dpbPicture : mDpb) {
+            if (dpbPicture->mLongTermRef && predicate(*dpbPicture)) {
+                dpbPicture->mLongTermRef = false;
+            }
+        }
+    };
+
+    for (size_t i = 0; i < header.num_mmcos; ++i) {
+        const H264DecRefPicMarking& mmco = header.mmcos[i];
+        const int32_t picNumX =
+                header.frame_num - static_cast<int32_t>(mmco.difference_of_pic_nums_minus1 + 1);
+        const int32_t longTermFrameIdx = static_cast<int32_t>(mmco.long_term_frame_idx);
+
+        switch (mmco.memory_management_control_operation) {
+        case 1: {
+            Picture* shortTerm = findShortTerm(picNumX);
+            if (shortTerm) shortTerm->mShortTermRef = false;
+            break;
+        }
+        case 2:
+            unmarkLongTerm([&](const Picture& p) {
+                return p.mLongTermPicNum == static_cast<int32_t>(mmco.long_term_pic_num);
+            });
+            break;
+        case 3: {
+            Picture* shortTerm = findShortTerm(picNumX);
+            unmarkLongTerm([&](const Picture& p) {
+                return &p != shortTerm && p.mLongTermFrameIdx == longTermFrameIdx;
+            });
+            if (shortTerm) {
+                shortTerm->mShortTermRef = false;
+                shortTerm->mLongTermRef = true;
+                shortTerm->mLongTermFrameIdx = longTermFrameIdx;
+                shortTerm->mLongTermPicNum = longTermFrameIdx;
+            }
+            break;
+        }
+        case 4:
+            mMaxLongTermFrameIdx = static_cast<int32_t>(mmco.max_long_term_frame_idx_plus1) - 1;
+            unmarkLongTerm(
+                    [&](const Picture& p) { return p.mLongTermFrameIdx > mMaxLongTermFrameIdx; });
+            break;
+        case 5:
+            for (const auto& dpbPicture : mDpb) {
+                dpbPicture->mShortTermRef = false;
+                dpbPicture->mLongTermRef = false;
+            }
+            mMaxLongTermFrameIdx = -1;
+            picture->mHasMmco5 = true;
+            break;
+        case 6:
+            unmarkLongTerm(
+                    [&](const Picture& p) { return p.mLongTermFrameIdx == longTermFrameIdx; });
+            picture->mLongTermRef = true;
+            picture->mLongTermFrameIdx = longTermFrameIdx;
+            picture->mLongTermPicNum = longTermFrameIdx;
+            break;
+        }
+    }
+
+    if (!picture->mLongTermRef) picture->mShortTermRef = true;
+
+    if (picture->mHasMmco5) {
+        // The picture is then considered to have frame_num and picture order counts relative to
+        // 0 (8.2.1).
+        const int32_t tempPicOrderCnt = picture->picOrderCnt();
+        picture->mTopFieldOrderCnt -= tempPicOrderCnt;
+        picture->mBottomFieldOrderCnt -= tempPicOrderCnt;
+        picture->mFrameNum = 0;
+    }
+}
+
+void V4L2StatelessDecoder::slidingWindowMarking(const H264SPS& sps) {
+    // 8.2.5.3
+    const size_t maxNumRefFrames = std::max<size_t>(sps.max_num_ref_frames, 1);
+    for (;;) {
+        size_t numRefFrames = 0;
+        Picture* oldestShortTerm = nullptr;
+        for (const auto& picture : mDpb) {
+            if (!picture->isRef()) continue;
+            numRefFrames++;
+            if (picture->mShortTermRef &&
+                (!oldestShortTerm || picture->mFrameNumWrap < oldestShortTerm->mFrameNumWrap)) {
+                oldestShortTerm = picture.get();
+            }
+        }
+        if (numRefFrames < maxNumRefFrames || !oldestShortTerm) return;
+        oldestShortTerm->mShortTermRef = false;
+    }
+}
+
+void V4L2StatelessDecoder::storePicture(std::shared_ptr<Picture> picture) {
+    // C.4.5
+    removeUnusedPictures();
+
+    // A non-reference picture preceding all the pictures waiting for output is output directly
+    // when the DPB is full.
+    if (!picture->isRef()) {
+        while (mDpb.size() >= mMaxDpbFrames) {
+            const auto lowest = std::min_element(
+                    mDpb.begin(), mDpb.end(), [](const auto& a, const auto& b) {
+                        if (a->mOutputNeeded != b->mOutputNeeded) return a->mOutputNeeded;
+                        return a->picOrderCnt() < b->picOrderCnt();
+                    });
+            if (lowest == mDpb.end() || !(*lowest)->mOutputNeeded ||
+                picture->picOrderCnt() < (*lowest)->picOrderCnt()) {
+                picture->mOutputNeeded = false;
+                mOutputPictures.push_back(std::move(picture));
+                return;
+            }
+            bumpPicture();
+        }
+    }
+
+    while (mDpb.size() >= mMaxDpbFrames && bumpPicture()) {
+    }
+    if (mDpb.size() >= mMaxDpbFrames) {
+        // Only happens with streams holding more references than their DPB size.
+        ALOGW("The DPB is full of reference pictures, dropping the oldest one");
+        auto oldest = std::min_element(mDpb.begin(), mDpb.end(), [](const auto& a, const auto& b) {
+            return a->mFrameNumWrap < b->mFrameNumWrap;
+        });
+        mDpb.erase(oldest);
+    }
+    mDpb.push_back(std::move(picture));
+
+    // Don't hold more pictures than the stream can reorder, to output them as soon as possible.
+    while (static_cast<size_t>(std::count_if(mDpb.begin(), mDpb.end(), [](const auto& p) {
+               return p->mOutputNeeded;
+           })) > mMaxReorderFrames &&
+           bumpPicture()) {
+    }
+}
+
+bool V4L2StatelessDecoder::bumpPicture() {
+    // C.4.5.3
+    auto lowest = mDpb.end();
+    for (auto it = mDpb.begin(); it != mDpb.end(); ++it) {
+        if ((*it)->mOutputNeeded &&
+            (lowest == mDpb.end() || (*it)->picOrderCnt() < (*lowest)->picOrderCnt())) {
+            lowest = it;
+        }
+    }
+    if (lowest == mDpb.end()) return false;
+
+    std::shared_ptr<Picture> picture = *lowest;
+    picture->mOutputNeeded = false;
+    if (!picture->isRef()) mDpb.erase(lowest);
+    ALOGV("Bump bitstreamId=%d, picOrderCnt=%d", picture->mBitstreamId, picture->picOrderCnt());
+    mOutputPictures.push_back(std::move(picture));
+    return true;
+}
+
+void V4L2StatelessDecoder::flushDpb() {
+    while (bumpPicture()) {
+    }
+    mDpb.clear();
+}
+
+void V4L2StatelessDecoder::removeUnusedPictures() {
+    mDpb.erase(std::remove_if(mDpb.begin(), mDpb.end(),
+                              [](const auto& p) { return !p->mOutputNeeded && !p->isRef(); }),
+               mDpb.end());
+}
+
+void V4L2StatelessDecoder::outputPictures() {
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    while (!mOutputPictures.empty() && mOutputPictures.front()->mDecoded) {
+        std::shared_ptr<Picture> picture = std::move(mOutputPictures.front());
+        mOutputPictures.pop_front();
+
+        ALOGV("Send output frame(bitstreamId=%d) to client", picture->mBitstreamId);
+        picture->mFrame->setBitstreamId(picture->mBitstreamId);
+        picture->mFrame->setVisibleRect(mVisibleRect);
+        mOutputCb.Run(std::move(picture->mFrame));
+    }
+}
+
+void V4L2StatelessDecoder::tryFetchVideoFrame() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (!mVideoFramePool) {
+        ALOGE("mVideoFramePool is null, failed to get the instance after resolution change?");
+        onError();
+        return;
+    }
+
+    // The buffers of the frames kept aside are free, but can't be filled with other frames.
+    const size_t numParkedFrames =
+            std::count_if(mParkedFrames.begin(), mParkedFrames.end(),
+                          [](const auto& frame) { return frame != nullptr; });
+    if (mOutputQueue->freeBuffersCount() <= numParkedFrames) {
+        ALOGV("No free V4L2 output buffers, ignore.");
+        return;
+    }
+
+    if (!mVideoFramePool->getVideoFrame(
+                ::base::BindOnce(&V4L2StatelessDecoder::onVideoFrameReady, mWeakThis))) {
+        ALOGV("%s(): Previous callback is running, ignore.", __func__);
+    }
+}
+
+void V4L2StatelessDecoder::onVideoFrameReady(
+        std::optional<VideoFramePool::FrameWithBlockId> frameWithBlockId) {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (!frameWithBlockId) {
+        ALOGE("Got nullptr VideoFrame.");
+        onError();
+        return;
+    }
+
+    // Unwrap our arguments.
+    std::unique_ptr<VideoFrame> frame;
+    uint32_t blockId;
+    std::tie(frame, blockId) = std::move(*frameWithBlockId);
+
+    if (!queueOutputFrame(std::move(frame), blockId)) {
+        onError();
+        return;
+    }
+
+    tryFetchVideoFrame();
+}
+
+bool V4L2StatelessDecoder::queueOutputFrame(std::unique_ptr<VideoFrame> frame, uint32_t blockId) {
+    ALOGV("%s(blockId=%u)", __func__, blockId);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    // Find the V4L2 buffer that is associated with this block.
+    const size_t* v4l2BufferId = mBlockIdToV4L2Id.find(blockId);
+    if (v4l2BufferId) {
+        // If we have met this block in the past, reuse the same V4L2 buffer.
+        return queueFrameToDevice(std::move(frame), *v4l2BufferId);
+    }
+    if (mBlockIdToV4L2Id.size() < mOutputQueue->allocatedBuffersCount()) {
+        // If this is the first time we see this block, give it the next
+        // available V4L2 buffer.
+        const size_t newV4L2BufferId = mBlockIdToV4L2Id.size();
+        mBlockIdToV4L2Id.insert(blockId, newV4L2BufferId);
+        return queueFrameToDevice(std::move(frame), newV4L2BufferId);
+    }
+
+    // If this happens, this is a bug in VideoFramePool. It should never
+    // provide more blocks than we have V4L2 buffers.
+    ALOGE("Got more different blocks than we have V4L2 buffers for.");
+    return false;
+}
+
+bool V4L2StatelessDecoder::queueFrameToDevice(std::unique_ptr<VideoFrame> frame, size_t v4l2Id) {
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    // The client might release the frame of a picture that is still used as a reference, the
+    // buffer must not be written until the reference is dropped.
+    if (isReferenced(v4l2Id)) {
+        ALOGV("V4L2 buffer %zu holds a reference picture, keeping its frame aside", v4l2Id);
+        mParkedFrames[v4l2Id] = std::move(frame);
+        return true;
+    }
+
+    std::optional<V4L2WritableBufferRef> outputBuffer = mOutputQueue->getFreeBuffer(v4l2Id);
+    if (!outputBuffer) {
+        ALOGE("V4L2 buffer %zu not available.", v4l2Id);
+        return false;
+    }
+
+    ALOGV("QBUF to output queue, V4L2Id=%zu", v4l2Id);
+    if (!std::move(*outputBuffer).queueDMABuf(frame->getFDs())) {
+        ALOGE("%s(): Failed to QBUF to output queue, V4L2Id=%zu", __func__, v4l2Id);
+        return false;
+    }
+    if (v4l2Id >= mFrameAtDevice.size() || mFrameAtDevice[v4l2Id]) {
+        ALOGE("%s(): V4L2 buffer %zu already enqueued.", __func__, v4l2Id);
+        return false;
+    }
+    mFrameAtDevice[v4l2Id] = std::move(frame);
+    return true;
+}
+
+bool V4L2StatelessDecoder::isReferenced(size_t v4l2Id) const {
+    return std::any_of(mDpb.begin(), mDpb.end(), [v4l2Id](const auto& picture) {
+        return picture->isRef() && picture->mV4L2Id == v4l2Id;
+    });
+}
+
+bool V4L2StatelessDecoder::releaseParkedFrames() {
+    for (size_t v4l2Id = 0; v4l2Id < mParkedFrames.size(); ++v4l2Id) {
+        if (!mParkedFrames[v4l2Id] || isReferenced(v4l2Id)) continue;
+        if (!queueFrameToDevice(std::move(mParkedFrames[v4l2Id]), v4l2Id)) return false;
+    }
+    return true;
+}
+
+void V4L2StatelessDecoder::onError() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    setState(State::Error);
+    mErrorCb.Run();
+}
+
+void V4L2StatelessDecoder::setState(State newState) {
+    ALOGV("%s(%s)", __func__, StateToString(newState));
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mState == newState) return;
+    if (mState == State::Error) {
+        ALOGV("Already in Error state.");
+        return;
+    }
+
+    switch (newState) {
+    case State::Idle:
+        break;
+    case State::Decoding:
+        break;
+    case State::Draining:
+        if (mState != State::Decoding) newState = State::Error;
+        break;
+    case State::Error:
+        break;
+    }
+
+    ALOGI("Set state %s => %s", StateToString(mState), StateToString(newState));
+    mState = newState;
+}
+
+// static
+const char* V4L2StatelessDecoder::StateToString(State state) {
+    switch (state) {
+    case State::Idle:
+        return "Idle";
+    case State::Decoding:
+        return "Decoding";
+    case State::Draining:
+        return "Draining";
+    case State::Error:
+        return "Error";
+    }
+}
+
+}  // namespace android
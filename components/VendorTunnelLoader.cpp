@@ -0,0 +1,59 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "VendorTunnelLoader"
+
+#include <v4l2_codec2/components/VendorTunnelLoader.h>
+
+#include <dlfcn.h>
+
+#include <log/log.h>
+
+namespace android {
+namespace {
+const char* kLibPath = "libv4l2_codec2_vendor_tunnel.so";
+const char* kCreateTunnelFuncName = "CreateTunnel";
+}  // namespace
+
+// static
+std::unique_ptr<VendorTunnelLoader> VendorTunnelLoader::Create() {
+    ALOGV("%s()", __func__);
+
+    void* libHandle = dlopen(kLibPath, RTLD_NOW | RTLD_NODELETE);
+    if (!libHandle) {
+        ALOGI("%s(): Failed to load library: %s", __func__, kLibPath);
+        return nullptr;
+    }
+
+    auto createTunnelFunc = (CreateTunnelFunc)dlsym(libHandle, kCreateTunnelFuncName);
+    if (!createTunnelFunc) {
+        ALOGE("%s(): Failed to load functions: %s", __func__, kCreateTunnelFuncName);
+        dlclose(libHandle);
+        return nullptr;
+    }
+
+    return std::unique_ptr<VendorTunnelLoader>(
+            new VendorTunnelLoader(libHandle, createTunnelFunc));
+}
+
+VendorTunnelLoader::VendorTunnelLoader(void* libHandle, CreateTunnelFunc createTunnelFunc)
+      : mLibHandle(libHandle), mCreateTunnelFunc(createTunnelFunc) {
+    ALOGV("%s()", __func__);
+}
+
+VendorTunnelLoader::~VendorTunnelLoader() {
+    ALOGV("%s()", __func__);
+
+    dlclose(mLibHandle);
+}
+
+std::unique_ptr<VendorTunnel> VendorTunnelLoader::createTunnel(uint32_t syncType,
+                                                                int32_t syncId) {
+    ALOGV("%s(syncType=%u, syncId=%d)", __func__, syncType, syncId);
+
+    return std::unique_ptr<VendorTunnel>(mCreateTunnelFunc(syncType, syncId));
+}
+
+}  // namespace android
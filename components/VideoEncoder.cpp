@@ -6,11 +6,11 @@
 
 namespace android {
 
-VideoEncoder::InputFrame::InputFrame(std::vector<int>&& fds, std::vector<VideoFramePlane>&& planes,
+VideoEncoder::InputFrame::InputFrame(const VideoFrameFds& fds, const VideoFramePlanes& planes,
                                      VideoPixelFormat pixelFormat, uint64_t index,
                                      int64_t timestamp)
-      : mFds(std::move(fds)),
-        mPlanes(std::move(planes)),
+      : mFds(fds),
+        mPlanes(planes),
         mPixelFormat(pixelFormat),
         mIndex(index),
         mTimestamp(timestamp) {}
@@ -16,21 +16,25 @@ namespace android {
 std::unique_ptr<VideoFrame> VideoFrame::Create(std::shared_ptr<C2GraphicBlock> block) {
     if (!block) return nullptr;
 
-    std::vector<int> fds;
+    VideoFrameFds fds;
     const C2Handle* const handle = block->handle();
+    if (handle->numFds < 0 || static_cast<size_t>(handle->numFds) > fds.capacity()) {
+        ALOGE("Unsupported number of fds: %d", handle->numFds);
+        return nullptr;
+    }
     for (int i = 0; i < handle->numFds; i++) {
         fds.emplace_back(handle->data[i]);
     }
 
-    return std::unique_ptr<VideoFrame>(new VideoFrame(std::move(block), std::move(fds)));
+    return std::unique_ptr<VideoFrame>(new VideoFrame(std::move(block), fds));
 }
 
-VideoFrame::VideoFrame(std::shared_ptr<C2GraphicBlock> block, std::vector<int> fds)
+VideoFrame::VideoFrame(std::shared_ptr<C2GraphicBlock> block, const VideoFrameFds& fds)
       : mGraphicBlock(std::move(block)), mFds(fds) {}
 
 VideoFrame::~VideoFrame() = default;
 
-const std::vector<int>& VideoFrame::getFDs() const {
+const VideoFrameFds& VideoFrame::getFDs() const {
     return mFds;
 }
 
@@ -4,11 +4,17 @@
 
 //#define LOG_NDEBUG 0
 #define LOG_TAG "VideoFramePool"
+#define ATRACE_TAG ATRACE_TAG_VIDEO
 
 #include <v4l2_codec2/components/VideoFramePool.h>
 
 #include <stdint.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <memory>
+#include <mutex>
+#include <vector>
 
 #include <C2BlockInternal.h>
 #include <bufferpool/BufferPoolTypes.h>
@@ -16,9 +22,13 @@
 #include <android/hardware/graphics/common/1.0/types.h>
 #include <base/bind.h>
 #include <base/memory/ptr_util.h>
+#include <base/synchronization/waitable_event.h>
+#include <base/threading/thread.h>
 #include <base/time/time.h>
 #include <log/log.h>
+#include <utils/Trace.h>
 
+#include <v4l2_codec2/common/ThreadPolicy.h>
 #include <v4l2_codec2/common/VideoTypes.h>
 #include <v4l2_codec2/plugin_store/DmabufHelpers.h>
 #include <v4l2_codec2/plugin_store/V4L2AllocatorId.h>
@@ -27,6 +37,76 @@ using android::hardware::graphics::common::V1_0::BufferUsage;
 using android::hardware::media::bufferpool::BufferPoolData;
 
 namespace android {
+namespace {
+
+// Variables used to exponential backoff retry when buffer fetching times out.
+constexpr size_t kFetchRetryDelayInit = 64;       // Initial delay: 64us
+constexpr size_t kFetchRetryDelayMax = 16384;     // Max delay: 16ms (1 frame at 60fps)
+constexpr size_t kFenceWaitTimeoutNs = 16000000;  // 16ms (1 frame at 60fps)
+
+// A fixed set of fetch threads, sized to the number of CPU cores, shared by all the VideoFramePool
+// instances of the process. Each pool is bound to a single thread, so the fetch tasks of a pool
+// stay ordered, and new pools are bound to the thread serving the fewest pools.
+class FetchExecutor {
+public:
+    static FetchExecutor* get() {
+        // The executor is never destroyed, as pools might still be fetching on process exit.
+        static FetchExecutor* const sExecutor = new FetchExecutor();
+        return sExecutor;
+    }
+
+    // Bind a pool to a fetch thread, whose index is returned in |threadIndex|. Returns the task
+    // runner of the fetch thread, or nullptr if the thread failed to start.
+    scoped_refptr<::base::SequencedTaskRunner> acquire(size_t* threadIndex) {
+        std::lock_guard<std::mutex> lock(mLock);
+        const size_t index = static_cast<size_t>(
+                std::min_element(mNumPools.begin(), mNumPools.end()) - mNumPools.begin());
+        ::base::Thread& thread = *mThreads[index];
+        if (!thread.IsRunning()) {
+            if (!thread.Start()) {
+                ALOGE("Fetch thread failed to start.");
+                return nullptr;
+            }
+            // The fetch threads are shared by all the decoders, so they run with the default
+            // policy of the decoders.
+            thread.task_runner()->PostTask(FROM_HERE, ::base::BindOnce([]() {
+                ThreadPolicy::getDefault(V4L2Device::Type::kDecoder).applyToCurrentThread();
+            }));
+        }
+        mNumPools[index]++;
+        *threadIndex = index;
+        return thread.task_runner();
+    }
+
+    // Unbind a pool from the fetch thread |threadIndex|.
+    void release(size_t threadIndex) {
+        std::lock_guard<std::mutex> lock(mLock);
+        ALOG_ASSERT(mNumPools[threadIndex] > 0);
+        mNumPools[threadIndex]--;
+    }
+
+    // Get the number of pools bound to the fetch thread |threadIndex|.
+    size_t getNumPools(size_t threadIndex) {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mNumPools[threadIndex];
+    }
+
+private:
+    FetchExecutor() {
+        const size_t numThreads =
+                static_cast<size_t>(std::max(sysconf(_SC_NPROCESSORS_ONLN), 1L));
+        for (size_t i = 0; i < numThreads; i++) {
+            mThreads.push_back(std::make_unique<::base::Thread>("V4L2FetchThread"));
+        }
+        mNumPools.resize(numThreads, 0);
+    }
+
+    std::mutex mLock;
+    std::vector<std::unique_ptr<::base::Thread>> mThreads;
+    std::vector<size_t> mNumPools;
+};
+
+}  // namespace
 
 // static
 std::optional<uint32_t> VideoFramePool::getBufferIdFromGraphicBlock(C2BlockPool& blockPool,
@@ -65,10 +145,52 @@ std::optional<uint32_t> VideoFramePool::getBufferIdFromGraphicBlock(C2BlockPool&
     return std::nullopt;
 }
 
+std::optional<uint32_t> VideoFramePool::getCachedBufferIdFromGraphicBlock(const C2Block2D& block) {
+    ALOG_ASSERT(mFetchTaskRunner->RunsTasksInCurrentSequence());
+
+    const C2Allocator::id_t allocatorId = mBlockPool->getAllocatorId();
+    if (allocatorId != C2PlatformAllocatorStore::BUFFERQUEUE &&
+        allocatorId != V4L2AllocatorId::SECURE_GRAPHIC) {
+        // The id of the bufferpool-backed blocks is read without any syscall.
+        return getBufferIdFromGraphicBlock(*mBlockPool, block);
+    }
+
+    uint32_t generation;
+    uint64_t bqId;
+    int32_t bqSlot;
+    if (!_C2BlockFactory::GetBufferQueueData(_C2BlockFactory::GetGraphicBlockPoolData(block),
+                                             &generation, &bqId, &bqSlot)) {
+        // The block isn't backed by a slot, e.g. no surface is attached to the pool yet.
+        return getBufferIdFromGraphicBlock(*mBlockPool, block);
+    }
+
+    // The slot can be reallocated, e.g. when the consumer discards its free buffers. The ints of
+    // the handle describe the allocation (e.g. its gralloc buffer id), unlike its fds they are
+    // the same for each fetch of the same buffer, so they tell a reallocated slot apart.
+    const C2Handle* const handle = block.handle();
+    std::vector<int> allocationInts(handle->data + handle->numFds,
+                                    handle->data + handle->numFds + handle->numInts);
+    const BufferQueueSlot slot(generation, bqId, bqSlot);
+    auto it = mBufferIdCache.find(slot);
+    if (it != mBufferIdCache.end() && it->second.allocationInts == allocationInts) {
+        mNumBufferIdCacheHits++;
+        return it->second.bufferId;
+    }
+
+    mNumBufferIdCacheMisses++;
+    std::optional<uint32_t> bufferId = getBufferIdFromGraphicBlock(*mBlockPool, block);
+    if (bufferId) {
+        mBufferIdCache[slot] = {*bufferId, std::move(allocationInts)};
+    } else {
+        mBufferIdCache.erase(slot);
+    }
+    return bufferId;
+}
+
 // static
 std::unique_ptr<VideoFramePool> VideoFramePool::Create(
         std::shared_ptr<C2BlockPool> blockPool, const size_t numBuffers, const ui::Size& size,
-        HalPixelFormat pixelFormat, bool isSecure,
+        HalPixelFormat pixelFormat, uint64_t extraUsage, bool isSecure,
         scoped_refptr<::base::SequencedTaskRunner> taskRunner) {
     ALOG_ASSERT(blockPool != nullptr);
 
@@ -77,9 +199,13 @@ std::unique_ptr<VideoFramePool> VideoFramePool::Create(
         usage |= C2MemoryUsage::READ_PROTECTED;
     } else if (blockPool->getAllocatorId() == C2PlatformAllocatorStore::GRALLOC) {
         // CPU access to buffers is only required in byte buffer mode.
+        if (extraUsage != 0) {
+            ALOGI("Compressed or tiled buffers can't be read by the CPU in byte buffer mode");
+            return nullptr;
+        }
         usage |= C2MemoryUsage::CPU_READ;
     }
-    const C2MemoryUsage memoryUsage(usage);
+    const C2MemoryUsage memoryUsage(usage | extraUsage);
 
     std::unique_ptr<VideoFramePool> pool =
             ::base::WrapUnique(new VideoFramePool(std::move(blockPool), numBuffers, size,
@@ -97,6 +223,7 @@ VideoFramePool::VideoFramePool(std::shared_ptr<C2BlockPool> blockPool, const siz
         mSize(size),
         mPixelFormat(pixelFormat),
         mMemoryUsage(memoryUsage),
+        mFetchRetryDelay(kFetchRetryDelayInit),
         mClientTaskRunner(std::move(taskRunner)) {
     ALOGV("%s(size=%dx%d)", __func__, size.width, size.height);
     ALOG_ASSERT(mClientTaskRunner->RunsTasksInCurrentSequence());
@@ -105,11 +232,8 @@ VideoFramePool::VideoFramePool(std::shared_ptr<C2BlockPool> blockPool, const siz
 }
 
 bool VideoFramePool::initialize() {
-    if (!mFetchThread.Start()) {
-        ALOGE("Fetch thread failed to start.");
-        return false;
-    }
-    mFetchTaskRunner = mFetchThread.task_runner();
+    mFetchTaskRunner = FetchExecutor::get()->acquire(&mFetchThreadIndex);
+    if (!mFetchTaskRunner) return false;
 
     mClientWeakThis = mClientWeakThisFactory.GetWeakPtr();
     mFetchWeakThis = mFetchWeakThisFactory.GetWeakPtr();
@@ -123,18 +247,26 @@ VideoFramePool::~VideoFramePool() {
 
     mClientWeakThisFactory.InvalidateWeakPtrs();
 
-    if (mFetchThread.IsRunning()) {
-        mFetchTaskRunner->PostTask(FROM_HERE,
-                                   ::base::BindOnce(&VideoFramePool::destroyTask, mFetchWeakThis));
-        mFetchThread.Stop();
+    if (mFetchTaskRunner) {
+        // The fetch thread is shared with other pools, so wait for the pending fetch of this pool
+        // to be done instead of stopping the thread.
+        ::base::WaitableEvent done;
+        mFetchTaskRunner->PostTask(FROM_HERE, ::base::BindOnce(&VideoFramePool::destroyTask,
+                                                               mFetchWeakThis, &done));
+        done.Wait();
+        FetchExecutor::get()->release(mFetchThreadIndex);
     }
 }
 
-void VideoFramePool::destroyTask() {
+void VideoFramePool::destroyTask(::base::WaitableEvent* done) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mFetchTaskRunner->RunsTasksInCurrentSequence());
 
     mFetchWeakThisFactory.InvalidateWeakPtrs();
+    ALOGV("%s(): buffer id cache hits: %zu, misses: %zu", __func__, mNumBufferIdCacheHits,
+          mNumBufferIdCacheMisses);
+    mBufferIdCache.clear();
+    done->Signal();
 }
 
 bool VideoFramePool::shouldDropBuffer(uint32_t bufferId) {
@@ -158,11 +290,68 @@ bool VideoFramePool::getVideoFrame(GetVideoFrameCB cb) {
     }
 
     mOutputCb = std::move(cb);
-    mFetchTaskRunner->PostTask(
-            FROM_HERE, ::base::BindOnce(&VideoFramePool::getVideoFrameTask, mFetchWeakThis));
+    if (!mReadyFrames.empty() || mFetchFailed) {
+        // The callback is always called asynchronously, even if a frame is already available.
+        mClientTaskRunner->PostTask(
+                FROM_HERE, ::base::BindOnce(&VideoFramePool::deliverFrame, mClientWeakThis));
+    }
+    scheduleFetches();
     return true;
 }
 
+void VideoFramePool::setPrefetchCount(size_t count) {
+    ALOGV("%s(count=%zu)", __func__, count);
+    ALOG_ASSERT(mClientTaskRunner->RunsTasksInCurrentSequence());
+
+    mPrefetchCount = count;
+    scheduleFetches();
+}
+
+std::optional<VideoFramePool::FrameWithBlockId> VideoFramePool::takePrefetchedFrame() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mClientTaskRunner->RunsTasksInCurrentSequence());
+
+    // Frames are passed to the pending callback first to keep them in order.
+    if (mOutputCb || mReadyFrames.empty()) {
+        return std::nullopt;
+    }
+
+    FrameWithBlockId frameWithBlockId = std::move(mReadyFrames.front());
+    mReadyFrames.pop();
+    scheduleFetches();
+    return frameWithBlockId;
+}
+
+void VideoFramePool::scheduleFetches() {
+    ALOG_ASSERT(mClientTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mFetchFailed) return;
+
+    const size_t numWanted = std::max(mPrefetchCount, static_cast<size_t>(mOutputCb ? 1 : 0));
+    while (mNumPendingFetches + mReadyFrames.size() < numWanted) {
+        mFetchTaskRunner->PostTask(
+                FROM_HERE, ::base::BindOnce(&VideoFramePool::getVideoFrameTask, mFetchWeakThis));
+        mNumPendingFetches++;
+    }
+}
+
+void VideoFramePool::deliverFrame() {
+    ALOG_ASSERT(mClientTaskRunner->RunsTasksInCurrentSequence());
+
+    if (!mOutputCb) return;
+
+    std::optional<FrameWithBlockId> frameWithBlockId;
+    if (!mReadyFrames.empty()) {
+        frameWithBlockId = std::move(mReadyFrames.front());
+        mReadyFrames.pop();
+    } else if (!mFetchFailed) {
+        return;
+    }
+
+    scheduleFetches();
+    std::move(mOutputCb).Run(std::move(frameWithBlockId));
+}
+
 // static
 void VideoFramePool::getVideoFrameTaskThunk(
         scoped_refptr<::base::SequencedTaskRunner> taskRunner,
@@ -176,24 +365,27 @@ void VideoFramePool::getVideoFrameTaskThunk(
 
 void VideoFramePool::getVideoFrameTask() {
     ALOGV("%s()", __func__);
+    ATRACE_CALL();
     ALOG_ASSERT(mFetchTaskRunner->RunsTasksInCurrentSequence());
 
-    // Variables used to exponential backoff retry when buffer fetching times out.
-    constexpr size_t kFetchRetryDelayInit = 64;    // Initial delay: 64us
-    constexpr size_t kFetchRetryDelayMax = 16384;  // Max delay: 16ms (1 frame at 60fps)
-    constexpr size_t kFenceWaitTimeoutNs = 16000000;  // 16ms (1 frame at 60fps)
-    static size_t sNumRetries = 0;
-    static size_t sDelay = kFetchRetryDelayInit;
-
     C2Fence fence;
     std::shared_ptr<C2GraphicBlock> block;
     c2_status_t err = mBlockPool->fetchGraphicBlock(mSize.width, mSize.height,
                                                     static_cast<uint32_t>(mPixelFormat),
                                                     mMemoryUsage, &block, &fence);
-    if (err == C2_BLOCKING) {
-        err = fence.wait(kFenceWaitTimeoutNs);
-        if (err == C2_OK) {
-            ALOGV("%s(): fence wait succeded, retrying now", __func__);
+    if (err == C2_BLOCKING && fence.valid()) {
+        // The fence is signaled as soon as a block is released to the pool, so the fetch is
+        // retried right away instead of backing off. A timed out wait is retried right away too,
+        // the wait itself already throttles the retries. The wait is shortened when the fetch
+        // thread is shared, so the other pools bound to the thread get their turn in time.
+        const size_t numPools = std::max(FetchExecutor::get()->getNumPools(mFetchThreadIndex),
+                                         static_cast<size_t>(1));
+        err = fence.wait(kFenceWaitTimeoutNs / numPools);
+        if (err == C2_OK || err == C2_TIMED_OUT) {
+            ALOGV("%s(): fence wait returned %d, retrying now", __func__, err);
+            if (mStats) mStats->onPoolStarved();
+            mFetchRetries = 0;
+            mFetchRetryDelay = kFetchRetryDelayInit;
             mFetchTaskRunner->PostTask(
                     FROM_HERE,
                     ::base::BindOnce(&VideoFramePool::getVideoFrameTask, mFetchWeakThis));
@@ -209,7 +401,7 @@ void VideoFramePool::getVideoFrameTask() {
 
     std::optional<uint32_t> bufferId;
     if (err == C2_OK) {
-        bufferId = getBufferIdFromGraphicBlock(*mBlockPool, *block);
+        bufferId = getCachedBufferIdFromGraphicBlock(*block);
 
         if (bufferId) {
             ALOGV("%s(): Got buffer with id = %u", __func__, *bufferId);
@@ -224,21 +416,24 @@ void VideoFramePool::getVideoFrameTask() {
         }
     }
 
+    // Fall back to polling the block pool if it provides no fence to wait for.
     if (err == C2_TIMED_OUT || err == C2_BLOCKING) {
-        ALOGV("%s(): fetchGraphicBlock() timeout, waiting %zuus (%zu retry)", __func__, sDelay,
-              sNumRetries + 1);
+        ALOGV("%s(): fetchGraphicBlock() timeout, waiting %zuus (%zu retry)", __func__,
+              mFetchRetryDelay, mFetchRetries + 1);
+        if (mStats) mStats->onPoolStarved();
         mFetchTaskRunner->PostDelayedTask(
                 FROM_HERE, ::base::BindOnce(&VideoFramePool::getVideoFrameTask, mFetchWeakThis),
-                ::base::TimeDelta::FromMicroseconds(sDelay));
+                ::base::TimeDelta::FromMicroseconds(mFetchRetryDelay));
 
-        sDelay = std::min(sDelay * 2, kFetchRetryDelayMax);  // Exponential backoff
-        sNumRetries++;
+        // Exponential backoff
+        mFetchRetryDelay = std::min(mFetchRetryDelay * 2, kFetchRetryDelayMax);
+        mFetchRetries++;
         return;
     }
 
     // Reset to the default value.
-    sNumRetries = 0;
-    sDelay = kFetchRetryDelayInit;
+    mFetchRetries = 0;
+    mFetchRetryDelay = kFetchRetryDelayInit;
 
     if (err != C2_OK) {
         ALOGE("%s(): Failed to fetch block, err=%d", __func__, err);
@@ -267,14 +462,20 @@ void VideoFramePool::onVideoFrameReady(std::optional<FrameWithBlockId> frameWith
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mClientTaskRunner->RunsTasksInCurrentSequence());
 
+    ALOG_ASSERT(mNumPendingFetches > 0);
+    mNumPendingFetches--;
+
     if (!frameWithBlockId) {
         ALOGE("Failed to get GraphicBlock, abandoning all pending requests.");
         mClientWeakThisFactory.InvalidateWeakPtrs();
         mClientWeakThis = mClientWeakThisFactory.GetWeakPtr();
+        mNumPendingFetches = 0;
+        mFetchFailed = true;
+    } else {
+        mReadyFrames.push(std::move(*frameWithBlockId));
     }
 
-    ALOG_ASSERT(mOutputCb);
-    std::move(mOutputCb).Run(std::move(frameWithBlockId));
+    deliverFrame();
 }
 
 }  // namespace android
@@ -0,0 +1,69 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "WorkDoneBatcher"
+
+#include <v4l2_codec2/components/WorkDoneBatcher.h>
+
+#include <algorithm>
+
+#include <base/bind.h>
+#include <cutils/properties.h>
+#include <log/log.h>
+
+namespace android {
+
+WorkDoneBatcher::WorkDoneBatcher(scoped_refptr<::base::SequencedTaskRunner> taskRunner,
+                                 ReportWorksCB reportWorksCb)
+      : mTaskRunner(std::move(taskRunner)),
+        mReportWorksCb(std::move(reportWorksCb)),
+        mMaxLatencyUs(std::max(
+                property_get_int32("ro.vendor.v4l2_codec2.work_done_max_latency_us", 0), 0)) {}
+
+WorkDoneBatcher::~WorkDoneBatcher() {
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    flush();
+}
+
+void WorkDoneBatcher::add(std::unique_ptr<C2Work> work) {
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    const ::base::TimeTicks now = ::base::TimeTicks::Now();
+    if (mWorks.empty()) mBatchStart = now;
+    mWorks.emplace_back(std::move(work));
+
+    if (mMaxLatencyUs > 0 && (now - mBatchStart).InMicroseconds() >= mMaxLatencyUs) {
+        ALOGV("%s(): Latency cap reached, reporting %zu works", __func__, mWorks.size());
+        flush();
+        return;
+    }
+
+    if (!mFlushPending) {
+        mFlushPending = true;
+        mTaskRunner->PostTask(FROM_HERE, ::base::BindOnce(&WorkDoneBatcher::flushTask,
+                                                          mWeakThisFactory.GetWeakPtr()));
+    }
+}
+
+void WorkDoneBatcher::flush() {
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mWorks.empty()) return;
+
+    ALOGV("%s(): Reporting %zu works", __func__, mWorks.size());
+    std::list<std::unique_ptr<C2Work>> works;
+    works.swap(mWorks);
+    mReportWorksCb.Run(std::move(works));
+}
+
+void WorkDoneBatcher::flushTask() {
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    mFlushPending = false;
+    flush();
+}
+
+}  // namespace android
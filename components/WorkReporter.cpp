@@ -0,0 +1,141 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "WorkReporter"
+#define ATRACE_TAG ATRACE_TAG_VIDEO
+
+#include <v4l2_codec2/components/WorkReporter.h>
+
+#include <utility>
+
+#include <base/bind.h>
+#include <log/log.h>
+#include <utils/Trace.h>
+
+namespace android {
+
+WorkReporter::WorkReporter(const char* threadName) : mThread(threadName) {
+    if (!mThread.Start()) {
+        ALOGW("Failed to start the %s thread, reporting on the codec thread", threadName);
+    }
+}
+
+WorkReporter::~WorkReporter() {
+    // Stopping the thread runs its pending tasks first. The reports are then delivered here, as
+    // they were pushed after the last task or the thread never ran.
+    if (mThread.IsRunning()) mThread.Stop();
+    deliverReports();
+}
+
+void WorkReporter::reportWorks(std::shared_ptr<C2Component::Listener> listener,
+                               std::weak_ptr<C2Component> component,
+                               std::list<std::unique_ptr<C2Work>> works) {
+    ALOGV("%s(): Reporting %zu works", __func__, works.size());
+
+    Report report;
+    report.mListener = std::move(listener);
+    report.mComponent = std::move(component);
+    report.mWorks = std::move(works);
+    push(std::move(report));
+}
+
+void WorkReporter::reportError(std::shared_ptr<C2Component::Listener> listener,
+                               std::weak_ptr<C2Component> component, c2_status_t error) {
+    ALOGV("%s(error=%d)", __func__, error);
+
+    Report report;
+    report.mListener = std::move(listener);
+    report.mComponent = std::move(component);
+    report.mError = error;
+    push(std::move(report));
+}
+
+void WorkReporter::flush() {
+    // The reports are delivered as they are made without the reporting thread.
+    if (!mThread.IsRunning()) return;
+
+    ALOGV("%s()", __func__);
+    ::base::WaitableEvent done;
+    mThread.task_runner()->PostTask(
+            FROM_HERE, ::base::BindOnce(&WorkReporter::flushTask, ::base::Unretained(this), &done));
+    done.Wait();
+}
+
+void WorkReporter::push(Report report) {
+    if (!mThread.IsRunning()) {
+        deliver(std::move(report));
+        return;
+    }
+
+    // Once a report overflowed, the following reports must overflow too to keep them ordered.
+    if (mHasOverflowReports.load(std::memory_order_acquire) || !mReports.push(std::move(report))) {
+        std::lock_guard<std::mutex> lock(mOverflowLock);
+        ALOGV("%s(): The ring is full, %zu reports overflowed", __func__, mOverflowReports.size());
+        mOverflowReports.push_back(std::move(report));
+        mHasOverflowReports.store(true, std::memory_order_release);
+    }
+
+    // Only wake up the reporting thread if it's not going to deliver the pushed reports already.
+    // ::base::Unretained(this) is safe because the thread is stopped before |this| is destroyed.
+    if (!mWakeupPending.exchange(true, std::memory_order_acq_rel)) {
+        mThread.task_runner()->PostTask(
+                FROM_HERE, ::base::BindOnce(&WorkReporter::deliverTask, ::base::Unretained(this)));
+    }
+}
+
+void WorkReporter::deliverTask() {
+    ALOG_ASSERT(mThread.task_runner()->RunsTasksInCurrentSequence());
+
+    // Clear the wakeup flag before delivering, so the reports pushed from now on post a new
+    // wakeup.
+    mWakeupPending.store(false, std::memory_order_release);
+    deliverReports();
+}
+
+void WorkReporter::flushTask(::base::WaitableEvent* done) {
+    ALOG_ASSERT(mThread.task_runner()->RunsTasksInCurrentSequence());
+
+    deliverReports();
+    done->Signal();
+}
+
+void WorkReporter::deliverReports() {
+    Report report;
+    while (mReports.pop(&report)) {
+        deliver(std::move(report));
+    }
+    // Overflowed reports were all pushed after the reports in the ring.
+    if (mHasOverflowReports.load(std::memory_order_acquire)) {
+        std::deque<Report> overflowReports;
+        {
+            std::lock_guard<std::mutex> lock(mOverflowLock);
+            while (mReports.pop(&report)) {
+                overflowReports.emplace_back(std::move(report));
+            }
+            for (auto& overflowReport : mOverflowReports) {
+                overflowReports.emplace_back(std::move(overflowReport));
+            }
+            mOverflowReports.clear();
+            mHasOverflowReports.store(false, std::memory_order_release);
+        }
+        // The listener is called without the lock, so the reporting sequence isn't blocked on
+        // the client.
+        for (auto& overflowReport : overflowReports) {
+            deliver(std::move(overflowReport));
+        }
+    }
+}
+
+// static
+void WorkReporter::deliver(Report report) {
+    if (report.mError != C2_OK) {
+        report.mListener->onError_nb(report.mComponent, static_cast<uint32_t>(report.mError));
+        return;
+    }
+    ATRACE_NAME("onWorkDone_nb");
+    report.mListener->onWorkDone_nb(report.mComponent, std::move(report.mWorks));
+}
+
+}  // namespace android
@@ -33,6 +33,8 @@ struct BitstreamBuffer {
     std::shared_ptr<C2LinearBlock> dmabuf;
     const size_t offset;
     const size_t size;
+    // The temporal layer of the encoded frame, 0 if the stream has no temporal layers.
+    uint32_t temporalLayer = 0;
 };
 
 }  // namespace android
@@ -0,0 +1,79 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMPONENTS_COMPONENT_STATS_H
+#define ANDROID_V4L2_CODEC2_COMPONENTS_COMPONENT_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <base/thread_annotations.h>
+#include <base/time/time.h>
+
+namespace android {
+
+// The runtime statistics of a component, listed in the debug dump of the service. The statistics
+// are recorded on the component threads and can be dumped from any thread.
+class ComponentStats {
+public:
+    // Create the statistics of the component |name|, which are part of DumpAll() as long as the
+    // returned instance is alive.
+    static std::shared_ptr<ComponentStats> Create(const std::string& name);
+    ~ComponentStats();
+
+    void onFrameIn() { mFramesIn.fetch_add(1, std::memory_order_relaxed); }
+    void onFrameOut() { mFramesOut.fetch_add(1, std::memory_order_relaxed); }
+    // A frame was dropped, or not shown by the stream.
+    void onFrameDropped() { mFramesDropped.fetch_add(1, std::memory_order_relaxed); }
+    // The output buffer pool had no free buffer when a frame was fetched.
+    void onPoolStarved() { mPoolStarvations.fetch_add(1, std::memory_order_relaxed); }
+    // An output block was fetched from the block pool, |recycled| if its buffer was fetched
+    // before.
+    void onOutputBlockFetched(bool recycled) {
+        (recycled ? mRecycledOutputBlocks : mAllocatedOutputBlocks)
+                .fetch_add(1, std::memory_order_relaxed);
+    }
+    // The time between queuing a work to the codec and reporting it.
+    void addLatency(::base::TimeDelta latency);
+    void addConversionTime(::base::TimeDelta time);
+    // The total time the codec waited for the device to return input buffers so far.
+    void setBufferWaitTime(::base::TimeDelta time);
+    // The memory allocated by the V4L2 queues of the codec, in bytes.
+    void setMemoryUsage(size_t bytes) { mMemoryUsage.store(bytes, std::memory_order_relaxed); }
+
+    std::string dump() const;
+    // Dump the statistics of all the live components of the process.
+    static std::string DumpAll();
+
+private:
+    explicit ComponentStats(const std::string& name);
+
+    const std::string mName;
+
+    std::atomic<uint64_t> mFramesIn{0};
+    std::atomic<uint64_t> mFramesOut{0};
+    std::atomic<uint64_t> mFramesDropped{0};
+    std::atomic<uint64_t> mPoolStarvations{0};
+    std::atomic<uint64_t> mRecycledOutputBlocks{0};
+    std::atomic<uint64_t> mAllocatedOutputBlocks{0};
+    std::atomic<size_t> mMemoryUsage{0};
+
+    mutable std::mutex mLock;
+    // The latest latencies in microseconds, used as a ring buffer once full.
+    std::vector<int64_t> mLatenciesUs GUARDED_BY(mLock);
+    size_t mNextLatency GUARDED_BY(mLock) = 0;
+    ::base::TimeDelta mConversionTime GUARDED_BY(mLock);
+    uint64_t mNumConversions GUARDED_BY(mLock) = 0;
+    ::base::TimeDelta mBufferWaitTime GUARDED_BY(mLock);
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMPONENTS_COMPONENT_STATS_H
@@ -0,0 +1,61 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMPONENTS_DECODE_OUTPUT_FORMAT_H
+#define ANDROID_V4L2_CODEC2_COMPONENTS_DECODE_OUTPUT_FORMAT_H
+
+#include <stdint.h>
+
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <ui/Size.h>
+#include <v4l2_codec2/common/V4L2Device.h>
+#include <v4l2_codec2/common/VideoTypes.h>
+
+namespace android {
+
+// A pixel format the decoders can write their frames in, and how the graphic buffers holding the
+// frames are allocated.
+struct DecodeOutputFormat {
+    // The V4L2 pixel format of the capture queue.
+    uint32_t v4l2PixFmt;
+    // The HAL pixel format the graphic buffers are allocated with.
+    HalPixelFormat halFormat;
+    // The vendor gralloc usage bits selecting the compressed or tiled layout of the buffers, 0 for
+    // the linear formats.
+    uint64_t usage;
+
+    // The frames in compressed or tiled formats can't be read by the CPU.
+    bool isLinear() const { return usage == 0; }
+    bool is10Bit() const { return halFormat == HalPixelFormat::YCBCR_P010; }
+};
+
+// Whether the decoders write the frames of 10-bit streams in 10-bit formats, and advertise the
+// 10-bit profiles.
+bool isDecode10BitOutputEnabled();
+
+// Get the output formats of the decoders by order of preference. The compressed and tiled formats
+// come first if |allowCompressed| and they are enabled on the device, followed by the linear
+// formats, which are the fallback for the consumers reading the frames with the CPU.
+std::vector<DecodeOutputFormat> getDecodeOutputFormats(bool allowCompressed);
+
+// Set the format of the capture |queue| of |device| to the preferred output format supported by
+// the device, at |size|. The compressed and tiled formats are tried first, the 8-bit formats before
+// the 10-bit ones, and the formats of each kind by the order the device enumerates them. Returns
+// the chosen format.
+std::optional<DecodeOutputFormat> setupDecodeOutputFormat(V4L2Device* device, V4L2Queue* queue,
+                                                          const ui::Size& size,
+                                                          bool allowCompressed);
+
+// Identical to setupDecodeOutputFormat(), but only tries the formats without setting them, so it
+// can be called before the device parsed the stream. Returns the chosen format, and the coded size
+// of the buffers the device would write at |size|.
+std::optional<std::pair<DecodeOutputFormat, ui::Size>> tryDecodeOutputFormat(
+        V4L2Device* device, V4L2Queue* queue, const ui::Size& size, bool allowCompressed);
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMPONENTS_DECODE_OUTPUT_FORMAT_H
@@ -0,0 +1,71 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMPONENTS_PERFORMANCE_HINT_SESSION_H
+#define ANDROID_V4L2_CODEC2_COMPONENTS_PERFORMANCE_HINT_SESSION_H
+
+#include <stdint.h>
+
+#include <memory>
+
+#include <base/time/time.h>
+
+namespace aidl::android::hardware::power {
+class IPowerHintSession;
+}  // namespace aidl::android::hardware::power
+
+namespace android {
+
+// A performance hint session of the Power HAL (ADPF) for the thread of a codec session. The time
+// spent on each frame is reported against the frame period, so the CPU ramps up ahead of the large
+// frames instead of after missing their deadline, and down during steady streams. Enabled by the
+// "ro.vendor.v4l2_codec2.performance_hints" property.
+//
+// The work of a frame is spread over several tasks of the codec thread, e.g. queueing its
+// bitstream and dequeuing its output, which are timed by ScopedWork and reported together once the
+// frame is done. All the methods must be called on the thread the session was created on.
+class PerformanceHintSession {
+public:
+    // Times the enclosing scope as work of the session of the calling thread, if it has one. Nested
+    // scopes are only timed once.
+    class ScopedWork {
+    public:
+        ScopedWork();
+        ~ScopedWork();
+        ScopedWork(const ScopedWork&) = delete;
+        ScopedWork& operator=(const ScopedWork&) = delete;
+
+    private:
+        PerformanceHintSession* const mSession;
+    };
+
+    // Create a session for the calling thread, targeting the period of |frameRate|. Returns
+    // nullptr if the sessions are disabled or the Power HAL doesn't support them.
+    static std::unique_ptr<PerformanceHintSession> Create(float frameRate);
+    ~PerformanceHintSession();
+    PerformanceHintSession(const PerformanceHintSession&) = delete;
+    PerformanceHintSession& operator=(const PerformanceHintSession&) = delete;
+
+    // Update the target duration of the frames to the period of |frameRate|.
+    void setFrameRate(float frameRate);
+    // Report the work timed since the previous frame as the work of a frame.
+    void onFrameDone();
+
+private:
+    PerformanceHintSession(
+            std::shared_ptr<aidl::android::hardware::power::IPowerHintSession> session,
+            int64_t targetDurationNs);
+
+    std::shared_ptr<aidl::android::hardware::power::IPowerHintSession> mSession;
+    int64_t mTargetDurationNs;
+    // The work timed since the previous frame.
+    ::base::TimeDelta mWorkDuration;
+    // Whether a ScopedWork is timing the current task, and since when its work isn't counted.
+    bool mInWork = false;
+    ::base::TimeTicks mWorkStart;
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMPONENTS_PERFORMANCE_HINT_SESSION_H
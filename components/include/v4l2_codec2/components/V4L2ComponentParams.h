@@ -0,0 +1,133 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMPONENTS_V4L2_COMPONENT_PARAMS_H
+#define ANDROID_V4L2_CODEC2_COMPONENTS_V4L2_COMPONENT_PARAMS_H
+
+#include <C2Config.h>
+#include <C2Param.h>
+
+namespace android {
+
+// Vendor parameters of the V4L2 components. The keys start with "vendor." so the framework exposes
+// them to MediaCodec clients, e.g. as "vendor.v4l2-codec2.input-pipeline-depth.value".
+enum V4L2ParamIndexKind : C2Param::type_index_t {
+    kParamIndexV4L2InputPipelineDepth = C2Param::TYPE_INDEX_VENDOR_START,
+    kParamIndexV4L2OutputPipelineDepth,
+    kParamIndexV4L2LowLatencyPreset,
+    kParamIndexV4L2ThreadPolicy,
+    kParamIndexV4L2RenderClock,
+    kParamIndexV4L2TrimMemory,
+    kParamIndexV4L2DownscaledOutputSize,
+    kParamIndexV4L2RegionOfInterest,
+    kParamIndexV4L2RegionsOfInterest,
+};
+
+// The number of bitstream buffers the decoder can queue to the V4L2 device at once.
+typedef C2GlobalParam<C2Tuning, C2Uint32Value, kParamIndexV4L2InputPipelineDepth>
+        C2V4L2InputPipelineDepthTuning;
+constexpr char C2_PARAMKEY_V4L2_INPUT_PIPELINE_DEPTH[] = "vendor.v4l2-codec2.input-pipeline-depth";
+
+// The number of decoded frames the client and the display hold on to, on top of the output delay
+// and of the frames the decoder needs.
+typedef C2GlobalParam<C2Tuning, C2Uint32Value, kParamIndexV4L2OutputPipelineDepth>
+        C2V4L2OutputPipelineDepthTuning;
+constexpr char C2_PARAMKEY_V4L2_OUTPUT_PIPELINE_DEPTH[] =
+        "vendor.v4l2-codec2.output-pipeline-depth";
+
+// Shrink the pipeline depths and the output delay for streams without frame reordering, e.g.
+// cloud gaming. Meant to be set when configuring the component, before it is started.
+typedef C2GlobalParam<C2Tuning, C2EasyBoolValue, kParamIndexV4L2LowLatencyPreset>
+        C2V4L2LowLatencyPresetTuning;
+constexpr char C2_PARAMKEY_V4L2_LOW_LATENCY_PRESET[] = "vendor.v4l2-codec2.low-latency-preset";
+
+// The scheduling priority and the CPU cluster of the codec threads, as the values of
+// ThreadPolicy::Priority and ThreadPolicy::Cluster.
+struct C2V4L2ThreadPolicyStruct {
+    C2V4L2ThreadPolicyStruct() : priority(0), cluster(0) {}
+    C2V4L2ThreadPolicyStruct(uint32_t priority_, uint32_t cluster_)
+          : priority(priority_), cluster(cluster_) {}
+
+    uint32_t priority;
+    uint32_t cluster;
+
+    DEFINE_AND_DESCRIBE_C2STRUCT(V4L2ThreadPolicy)
+    C2FIELD(priority, "priority")
+    C2FIELD(cluster, "cluster")
+};
+
+// The policy of the threads of the session, which defaults to the one configured by the
+// properties for its codec type. Meant to be set when configuring the component, before it is
+// started.
+typedef C2GlobalParam<C2Tuning, C2V4L2ThreadPolicyStruct, kParamIndexV4L2ThreadPolicy>
+        C2V4L2ThreadPolicyTuning;
+constexpr char C2_PARAMKEY_V4L2_THREAD_POLICY[] = "vendor.v4l2-codec2.thread-policy";
+
+// The playback position of the client: the frame of timestamp |mediaTimeUs| is rendered at
+// |systemTimeNs|, in the CLOCK_MONOTONIC time base (e.g. System.nanoTime()), and the playback
+// goes on at normal speed from there.
+struct C2V4L2RenderClockStruct {
+    C2V4L2RenderClockStruct() : mediaTimeUs(-1), systemTimeNs(0) {}
+    C2V4L2RenderClockStruct(int64_t mediaTimeUs_, int64_t systemTimeNs_)
+          : mediaTimeUs(mediaTimeUs_), systemTimeNs(systemTimeNs_) {}
+
+    int64_t mediaTimeUs;
+    int64_t systemTimeNs;
+
+    DEFINE_AND_DESCRIBE_C2STRUCT(V4L2RenderClock)
+    C2FIELD(mediaTimeUs, "media-time-us")
+    C2FIELD(systemTimeNs, "system-time-ns")
+};
+
+// The render clock of the decoder, updated by the client as the playback goes on. The decoder
+// drops the disposable frames it can't output before their render time, so it catches up when
+// falling behind. A negative |mediaTimeUs| (default) never drops frames.
+typedef C2GlobalParam<C2Tuning, C2V4L2RenderClockStruct, kParamIndexV4L2RenderClock>
+        C2V4L2RenderClockTuning;
+constexpr char C2_PARAMKEY_V4L2_RENDER_CLOCK[] = "vendor.v4l2-codec2.render-clock";
+
+// A memory pressure hint of the client, e.g. when the playback is paused or moved to the
+// background. Each time it is set to true, the decoder releases its buffers until the next input,
+// if idle trimming is enabled.
+typedef C2GlobalParam<C2Tuning, C2EasyBoolValue, kParamIndexV4L2TrimMemory>
+        C2V4L2TrimMemoryTuning;
+constexpr char C2_PARAMKEY_V4L2_TRIM_MEMORY[] = "vendor.v4l2-codec2.trim-memory";
+
+// The size the decoded frames are scaled down to fit in, keeping their aspect ratio, e.g. for
+// thumbnails and previews. The device scales the frames while writing them, so the output buffers
+// are allocated at the scaled size. Frames which already fit, and devices without a scaler, are
+// output at their coded size. A 0x0 size (default) disables it. Meant to be set when configuring
+// the component, before it is started.
+typedef C2GlobalParam<C2Tuning, C2PictureSizeStruct, kParamIndexV4L2DownscaledOutputSize>
+        C2V4L2DownscaledOutputSizeTuning;
+constexpr char C2_PARAMKEY_V4L2_DOWNSCALED_OUTPUT_SIZE[] =
+        "vendor.v4l2-codec2.downscaled-output-size";
+
+// A rectangular region of the input frames, whose QP is offset by |qpDelta| from the one picked
+// by the rate control. Negative offsets spend more bits on the region, e.g. on faces or text.
+struct C2V4L2RegionOfInterestStruct {
+    int32_t left;
+    int32_t top;
+    int32_t width;
+    int32_t height;
+    int32_t qpDelta;
+
+    DEFINE_AND_DESCRIBE_C2STRUCT(V4L2RegionOfInterest)
+    C2FIELD(left, "left")
+    C2FIELD(top, "top")
+    C2FIELD(width, "width")
+    C2FIELD(height, "height")
+    C2FIELD(qpDelta, "qp-delta")
+};
+
+// The regions of interest of the encoder input frames. The regions can be attached to the C2Work
+// of a frame, and apply to the following frames as well until replaced, an empty list clears them.
+typedef C2StreamParam<C2Tuning, C2SimpleArrayStruct<C2V4L2RegionOfInterestStruct>,
+                      kParamIndexV4L2RegionsOfInterest>
+        C2V4L2RegionsOfInterestTuning;
+constexpr char C2_PARAMKEY_V4L2_REGIONS_OF_INTEREST[] = "vendor.v4l2-codec2.regions-of-interest";
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMPONENTS_V4L2_COMPONENT_PARAMS_H
@@ -6,7 +6,13 @@
 #define ANDROID_V4L2_CODEC2_COMPONENTS_V4L2_DECODE_COMPONENT_H
 
 #include <atomic>
+#include <deque>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include <C2Component.h>
 #include <C2ComponentFactory.h>
@@ -16,10 +22,18 @@
 #include <base/sequenced_task_runner.h>
 #include <base/synchronization/waitable_event.h>
 #include <base/threading/thread.h>
+#include <base/time/time.h>
 
+#include <v4l2_codec2/common/FlatIdMap.h>
+#include <v4l2_codec2/common/SPSCRing.h>
+#include <v4l2_codec2/common/V4L2ResourceManager.h>
+#include <v4l2_codec2/components/ComponentStats.h>
+#include <v4l2_codec2/components/PerformanceHintSession.h>
 #include <v4l2_codec2/components/V4L2DecodeInterface.h>
 #include <v4l2_codec2/components/VideoDecoder.h>
 #include <v4l2_codec2/components/VideoFramePool.h>
+#include <v4l2_codec2/components/WorkDoneBatcher.h>
+#include <v4l2_codec2/components/WorkReporter.h>
 
 namespace android {
 
@@ -58,22 +72,60 @@ private:
     };
     static const char* ComponentStateToString(ComponentState state);
 
-    // Handle C2Component's public methods on |mDecoderTaskRunner|.
+    // Handle C2Component's public methods on |mDecoderTaskRunner|. |status| and |done| are null
+    // when the component is started asynchronously, in which case failures are reported as errors.
     void startTask(c2_status_t* status, ::base::WaitableEvent* done);
+    // Set up the component for decoding, and create |mDecoder|.
+    c2_status_t startDecoder();
+    // Create |mDecoder|, opening and setting up the device.
+    c2_status_t createDecoder();
     void stopTask();
     void releaseTask();
-    void queueTask(std::unique_ptr<C2Work> work);
+    // Move all the works from |mQueuedWorks| to |mPendingWorks| and process them.
+    void queueTask();
     void flushTask();
     void drainTask();
     void setListenerTask(const std::shared_ptr<Listener>& listener, ::base::WaitableEvent* done);
 
+    // Handle the memory pressure hints of the client, called on its thread.
+    void onTrimMemoryRequested();
+    // Trim the decoder if no work was queued during the idle trim timeout.
+    void checkIdleTask();
+    // Release the memory of |mDecoder|, i.e. its V4L2 queues and output buffers, by destroying it
+    // until the next input. Skipped if the decoder can't be restored to its current state.
+    void trimTask();
+    // Create |mDecoder| again after trimming it, replaying the bitstream kept since the last key
+    // frame. The works waiting for their frame get it from the replay, the other frames are
+    // dropped. Returns false if an error was reported.
+    bool restoreDecoder();
+    // Hint |mDecoder| to allocate its output buffers from the stream headers in |input|, before
+    // the device parsed them. Returns whether the headers were found.
+    bool prepareOutputBuffers(const C2ConstLinearBlock& input);
+    // Keep the bitstream |input| of the work |bitstreamId|, sent to |mDecoder|, for restoring it.
+    void keepReplayInput(int32_t bitstreamId, bool isCSDWork, const C2ConstLinearBlock& input);
+    void onReplayDecodeDone(VideoDecoder::DecodeStatus status);
+
+    // Take all the works queued by queue_nb() so far, in queuing order.
+    void takeQueuedWorks(std::vector<std::unique_ptr<C2Work>>* works);
+    // Validate a queued |work| and append it to |mPendingWorks|. Returns false if an error was
+    // reported, in which case the remaining queued works should be dropped.
+    bool queueWork(std::unique_ptr<C2Work> work);
     // Try to process pending works at |mPendingWorks|. Paused when |mIsDraining| is set.
     void pumpPendingWorks();
+    // Get the timestamp below which the works queued now can't be output before their render
+    // time, or std::nullopt if the client doesn't supply a render clock.
+    std::optional<int64_t> getLateTimestampUs();
+    // Drop the work |bitstreamId|, which is reported without being decoded.
+    void dropWork(int32_t bitstreamId);
+    // Look up the output block pool configured by the client, so that the first
+    // getVideoFramePool() call doesn't need to. Called by start() while the decoder thread sets up
+    // the device.
+    void prefetchBlockPool();
     // Get the buffer pool.
     std::unique_ptr<VideoFramePool> getVideoFramePool(const ui::Size& size,
-                                                      HalPixelFormat pixelFormat,
+                                                      HalPixelFormat pixelFormat, uint64_t usage,
                                                       size_t numBuffers);
-    // Detect and report works with no-show frame, only used at VP8 and VP9.
+    // Detect and report works with no-show frame, only used at VP8, VP9 and AV1.
     void detectNoShowFrameWorksAndReportIfFinished(const C2WorkOrdinalStruct& currOrdinal);
 
     // Finish callbacks of each method.
@@ -89,10 +141,17 @@ private:
     bool reportEOSWork();
     void reportAbandonedWorks();
     bool reportWork(std::unique_ptr<C2Work> work);
+    // Report the finished |works| to the listener in a single call.
+    void reportWorks(std::list<std::unique_ptr<C2Work>> works);
     // Report error when any error occurs.
     void reportError(c2_status_t error);
+    // Record the time between sending the work |bitstreamId| to |mDecoder| and reporting it.
+    void recordDecodeLatency(int32_t bitstreamId);
 
     static std::atomic<int32_t> sConcurrentInstances;
+    // The share of the decoders' macroblock budget held by the component, nullptr if admission
+    // control is disabled.
+    std::unique_ptr<V4L2ResourceManager::Reservation> mReservation;
 
     // The pointer of component interface implementation.
     std::shared_ptr<V4L2DecodeInterface> mIntfImpl;
@@ -100,19 +159,76 @@ private:
     const std::shared_ptr<C2ComponentInterface> mIntf;
     // The pointer of component listener.
     std::shared_ptr<Listener> mListener;
+    // The names of the async trace slices of the works, from queue_nb() to onWorkDone_nb(), and of
+    // their bitstream at |mDecoder|, keyed by bitstream id. They're unique to this component.
+    const std::string mWorkTraceName;
+    const std::string mDecodeTraceName;
+    // The runtime statistics of the component, listed in the debug dump of the service.
+    const std::shared_ptr<ComponentStats> mStats;
 
     std::unique_ptr<VideoDecoder> mDecoder;
+    // Batches the works finished during a decoder task, so they're reported in a single call.
+    std::unique_ptr<WorkDoneBatcher> mWorkDoneBatcher;
+    // Delivers the batches of works and the errors to |mListener| off the decoder thread.
+    std::unique_ptr<WorkReporter> mWorkReporter;
+    // The performance hint session of the decoder thread, nullptr if unsupported.
+    std::unique_ptr<PerformanceHintSession> mHintSession;
+    // The works queued by queue_nb() which haven't been picked up by the decoder thread yet. The
+    // IPC thread pushes works into the ring and only posts queueTask() when no wakeup is pending
+    // (|mQueueWakeupPending|), so a burst of works is drained in a single decoder task. Producers
+    // are serialized by |mQueueLock|, which the decoder thread only takes when the ring has
+    // overflowed into |mOverflowWorks|.
+    static constexpr size_t kQueuedWorksCapacity = 64;
+    SPSCRing<std::unique_ptr<C2Work>> mQueuedWorks{kQueuedWorksCapacity};
+    std::mutex mQueueLock;
+    std::deque<std::unique_ptr<C2Work>> mOverflowWorks;
+    std::atomic<bool> mHasOverflowWorks{false};
+    std::atomic<bool> mQueueWakeupPending{false};
     // The queue of works that haven't processed and sent to |mDecoder|.
     std::queue<std::unique_ptr<C2Work>> mPendingWorks;
     // The works whose input buffers are sent to |mDecoder|. The key is the
     // bitstream ID of work's input buffer.
-    std::map<int32_t, std::unique_ptr<C2Work>> mWorksAtDecoder;
+    FlatIdMap<std::unique_ptr<C2Work>> mWorksAtDecoder;
     // The bitstream ID of the works that output frames have been returned from |mDecoder|.
     // The order is display order.
     std::queue<int32_t> mOutputBitstreamIds;
 
     // Set to true when decoding the protected playback.
     bool mIsSecure = false;
+    // Set to true when the frames are output as soon as decoded. The works are then reported once
+    // their frame is output, and their input buffer is returned to the client once queued to
+    // |mDecoder|, which keeps the bitstream until decoded.
+    bool mLowLatency = false;
+    // The tunnel the frames are queued to when the tunneled playback is configured, in which case
+    // the works are reported without output buffer.
+    std::shared_ptr<VendorTunnel> mTunnel;
+
+    // Set to true once the output buffers of the first stream headers were hinted to |mDecoder|.
+    bool mIsOutputPrepared = false;
+
+    // Set to true when |mDecoder| can be trimmed while idle, in which case the bitstream needed to
+    // restore it is kept: the codec config, and the inputs since the last key frame with the
+    // bitstream ID of their work, |mReplayInputsSize| bytes in total. |mCanReplay| is unset when
+    // the inputs don't start at a key frame, e.g. after a flush or once they grew too large.
+    bool mIsTrimEnabled = false;
+    std::vector<C2ConstLinearBlock> mCodecConfigInputs;
+    std::vector<std::pair<int32_t, C2ConstLinearBlock>> mReplayInputs;
+    size_t mReplayInputsSize = 0;
+    bool mCanReplay = false;
+    // Set to true when the last input kept is codec config, so a new one replaces the previous.
+    bool mLastInputIsCodecConfig = false;
+    // Set to true while |mDecoder| is trimmed, until the next input restores it.
+    bool mIsTrimmed = false;
+    // The time of the last queueTask(), and whether checkIdleTask() is posted.
+    ::base::TimeTicks mLastQueueTime;
+    bool mIsIdleCheckPending = false;
+
+    // The time each work was sent to |mDecoder|, and the statistics of the time until the works
+    // are reported.
+    FlatIdMap<::base::TimeTicks> mDecodeStartTimes;
+    size_t mNumLatencySamples = 0;
+    ::base::TimeDelta mTotalDecodeLatency;
+    ::base::TimeDelta mMaxDecodeLatency;
     // The component state.
     std::atomic<ComponentState> mComponentState{ComponentState::STOPPED};
     // Whether we are currently draining the component. This is set when the component is processing
@@ -123,8 +239,17 @@ private:
     // The mutex lock to synchronize start/stop/reset/release calls.
     std::mutex mStartStopLock;
 
+    // The output block pool looked up by prefetchBlockPool(), and its ID. Taken by the first
+    // getVideoFramePool() call if the client didn't configure another pool since.
+    std::mutex mPrefetchedBlockPoolLock;
+    std::shared_ptr<C2BlockPool> mPrefetchedBlockPool;
+    C2BlockPool::local_id_t mPrefetchedBlockPoolId = 0;
+
     // The color aspects parameter for current decoded output buffers.
     std::shared_ptr<C2StreamColorAspectsInfo::output> mCurrentColorAspects;
+    // The pixel format of the output buffers to report along with the next output frame, set when
+    // the decoder switched to buffers of another format.
+    std::unique_ptr<C2Param> mPendingPixelFormat;
     // The flag of pending color aspects change. This should be set once we have parsed color
     // aspects from bitstream by parseCodedColorAspects(), at the same time recorded input frame
     // index into |mPendingColorAspectsChangeFrameIndex|.
@@ -137,7 +262,7 @@ private:
 
     // The device task runner and its sequence checker. We should interact with
     // |mDevice| on this.
-    ::base::Thread mDecoderThread{"V4L2DecodeComponentDecoderThread"};
+    ::base::Thread mDecoderThread{"V4L2Decoder"};
     scoped_refptr<::base::SequencedTaskRunner> mDecoderTaskRunner;
 
     ::base::WeakPtrFactory<V4L2DecodeComponent> mWeakThisFactory{this};
@@ -5,14 +5,20 @@
 #ifndef ANDROID_V4L2_CODEC2_COMPONENTS_V4L2_DECODE_INTERFACE_H
 #define ANDROID_V4L2_CODEC2_COMPONENTS_V4L2_DECODE_INTERFACE_H
 
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 #include <C2Config.h>
 #include <ui/Size.h>
 #include <util/C2InterfaceHelper.h>
 
+#include <v4l2_codec2/common/ThreadPolicy.h>
 #include <v4l2_codec2/common/VideoTypes.h>
+#include <v4l2_codec2/components/V4L2ComponentParams.h>
+#include <v4l2_codec2/components/VendorTunnelLoader.h>
 
 namespace android {
 
@@ -27,20 +33,70 @@ public:
     c2_status_t status() const { return mInitStatus; }
     C2BlockPool::local_id_t getBlockPoolId() const { return mOutputBlockPoolIds->m.values[0]; }
     std::optional<VideoCodec> getVideoCodec() const { return mVideoCodec; }
+    uint32_t getPixelFormat() const { return mPixelFormat->value; }
 
+    // Whether the input buffers are sized from the level of the stream, which bounds the size of
+    // its access units, instead of only from the picture size. The stateless decoder also shrinks
+    // them to the access units of the stream on each new sequence.
+    static bool isInputBufferSizeAdaptive();
+    // Get the default output delay of |codec|, which is also the largest one.
     static uint32_t getOutputDelay(VideoCodec codec);
+    // Get the output delay configured for this component.
+    uint32_t getOutputDelay() const { return mOutputDelay->value; }
 
     size_t getInputBufferSize() const;
+    size_t getInputPipelineDepth() const { return mInputPipelineDepth->value; }
+    size_t getOutputPipelineDepth() const { return mOutputPipelineDepth->value; }
+    // Whether the frames should be output as soon as they are decoded, either requested by the
+    // client through the low latency mode or as part of the low latency preset.
+    bool isLowLatencyMode() const { return mLowLatencyMode->value || mLowLatencyPreset->value; }
+    // Get the scheduling policy of the decoder threads.
+    ThreadPolicy getThreadPolicy() const;
+    ui::Size getPictureSize() const;
+    // Get the maximum picture size the stream is expected to switch to, which is never smaller
+    // than the current picture size.
+    ui::Size getMaxPictureSize() const;
+    // Get the size the output frames are scaled down to fit in, empty if they aren't scaled.
+    ui::Size getDownscaledOutputSize() const;
+    // Get the frame rate announced by the client, used to estimate the load of the stream.
+    float getFrameRate() const { return mFrameRate->value; }
     c2_status_t queryColorAspects(
             std::shared_ptr<C2StreamColorAspectsInfo::output>* targetColorAspects);
+    // Get the tunnel to the display, created once the client configures the sideband tunneled
+    // mode. Returns nullptr if the component isn't tunneled.
+    std::shared_ptr<VendorTunnel> getTunnel();
+    // Set the callback run when the client configures |mTrimMemory| to true, nullptr to unset it.
+    // The callback is run on the thread of the client, and never after unsetting returns.
+    void setTrimMemoryCallback(std::function<void()> trimMemoryCb);
+
+    // Hide C2InterfaceHelper::config() to create the tunnel when the tunneled mode is configured,
+    // and expose its sideband handle as |mTunnelHandle|. Also runs the trim memory callback.
+    c2_status_t config(const std::vector<C2Param*>& params, c2_blocking_t mayBlock,
+                       std::vector<std::unique_ptr<C2SettingResult>>* const failures);
 
 private:
     // Configurable parameter setters.
     static C2R ProfileLevelSetter(bool mayBlock, C2P<C2StreamProfileLevelInfo::input>& info);
     static C2R SizeSetter(bool mayBlock, C2P<C2StreamPictureSizeInfo::output>& videoSize);
-    static C2R MaxInputBufferSizeCalculator(bool mayBlock,
-                                            C2P<C2StreamMaxBufferSizeInfo::input>& me,
-                                            const C2P<C2StreamPictureSizeInfo::output>& size);
+    static C2R MaxPictureSizeSetter(bool mayBlock, C2P<C2StreamMaxPictureSizeTuning::output>& me,
+                                    const C2P<C2StreamPictureSizeInfo::output>& size);
+    static C2R MaxInputBufferSizeCalculator(
+            bool mayBlock, C2P<C2StreamMaxBufferSizeInfo::input>& me,
+            const C2P<C2StreamPictureSizeInfo::output>& size,
+            const C2P<C2StreamProfileLevelInfo::input>& profileLevel);
+    static C2R OutputDelaySetter(bool mayBlock, C2P<C2PortDelayTuning::output>& me,
+                                 const C2P<C2GlobalLowLatencyModeTuning>& lowLatencyMode,
+                                 const C2P<C2V4L2LowLatencyPresetTuning>& preset);
+    static C2R InputPipelineDepthSetter(bool mayBlock, C2P<C2V4L2InputPipelineDepthTuning>& me,
+                                        const C2P<C2V4L2LowLatencyPresetTuning>& preset);
+    static C2R OutputPipelineDepthSetter(bool mayBlock, C2P<C2V4L2OutputPipelineDepthTuning>& me,
+                                         const C2P<C2V4L2LowLatencyPresetTuning>& preset);
+    static C2R TunneledModeSetter(bool mayBlock, C2P<C2PortTunneledModeTuning::output>& me);
+    static C2R ThreadPolicySetter(bool mayBlock, C2P<C2V4L2ThreadPolicyTuning>& me);
+    static C2R RenderClockSetter(bool mayBlock, C2P<C2V4L2RenderClockTuning>& me);
+
+    // Create |mTunnel| for the configured |mTunneledMode| if needed, and configure |mTunnelHandle|.
+    c2_status_t updateTunnel();
 
     template <typename T>
     static C2R DefaultColorAspectsSetter(bool mayBlock, C2P<T>& def);
@@ -63,9 +119,25 @@ private:
     // The MIME type of output port; should be MEDIA_MIMETYPE_VIDEO_RAW.
     std::shared_ptr<C2PortMediaTypeSetting::output> mOutputMediaType;
     // The number of additional output frames that might need to be generated before an output
-    // buffer can be released by the component; only used for H264 because H264 may reorder the
-    // output frames.
+    // buffer can be released by the component; only used for H264 and HEVC because they may
+    // reorder the output frames.
     std::shared_ptr<C2PortDelayTuning::output> mOutputDelay;
+    // The depths of the input and output pipelines, and the preset shrinking them together with
+    // the output delay.
+    std::shared_ptr<C2V4L2InputPipelineDepthTuning> mInputPipelineDepth;
+    std::shared_ptr<C2V4L2OutputPipelineDepthTuning> mOutputPipelineDepth;
+    std::shared_ptr<C2V4L2LowLatencyPresetTuning> mLowLatencyPreset;
+    // The low latency mode requested by the client, which outputs the frames in decoding order
+    // without output delay.
+    std::shared_ptr<C2GlobalLowLatencyModeTuning> mLowLatencyMode;
+    // The scheduling policy of the decoder threads.
+    std::shared_ptr<C2V4L2ThreadPolicyTuning> mThreadPolicy;
+    // The render clock the late disposable frames are dropped against.
+    std::shared_ptr<C2V4L2RenderClockTuning> mRenderClock;
+    // The memory pressure hint of the client, handled by |mTrimMemoryCb|.
+    std::shared_ptr<C2V4L2TrimMemoryTuning> mTrimMemory;
+    // The size the output frames are scaled down to fit in by the device.
+    std::shared_ptr<C2V4L2DownscaledOutputSizeTuning> mDownscaledOutputSize;
     // The input codec profile and level. For now configuring this parameter is useless since
     // the component always uses fixed codec profile to initialize accelerator. It is only used
     // for the client to query supported profile and level values.
@@ -73,6 +145,12 @@ private:
     std::shared_ptr<C2StreamProfileLevelInfo::input> mProfileLevel;
     // Decoded video size for output.
     std::shared_ptr<C2StreamPictureSizeInfo::output> mSize;
+    // The HAL pixel format of the output buffers.
+    std::shared_ptr<C2StreamPixelFormatInfo::output> mPixelFormat;
+    // Maximum video size the stream may switch to, used to size the output buffers.
+    std::shared_ptr<C2StreamMaxPictureSizeTuning::output> mMaxSize;
+    // The frame rate of the stream announced by the client.
+    std::shared_ptr<C2StreamFrameRateInfo::input> mFrameRate;
     // Maximum size of one input buffer.
     std::shared_ptr<C2StreamMaxBufferSizeInfo::input> mMaxInputSize;
     // The suggested usage of input buffer allocator ID.
@@ -93,9 +171,24 @@ private:
     // former has higher priority. This parameter is used for component to provide color aspects
     // as C2Info in decoded output buffers.
     std::shared_ptr<C2StreamColorAspectsInfo::output> mColorAspects;
+    // The tunneled mode requested by the client, only the sideband mode is supported when the
+    // vendor tunnel library is available.
+    std::shared_ptr<C2PortTunneledModeTuning::output> mTunneledMode;
+    // The sideband handle of |mTunnel|, for the client to set on its surface.
+    std::shared_ptr<C2PortTunnelHandleTuning::output> mTunnelHandle;
 
     c2_status_t mInitStatus;
     std::optional<VideoCodec> mVideoCodec;
+
+    // The loader of the vendor tunnel library, nullptr if the library isn't available.
+    std::unique_ptr<VendorTunnelLoader> mTunnelLoader;
+    // The tunnel created for the tunneled mode, guarded by |mTunnelLock| since the interface is
+    // configured by the client threads.
+    std::mutex mTunnelLock;
+    std::shared_ptr<VendorTunnel> mTunnel;
+    // The callback of the memory pressure hints, guarded by |mTrimMemoryLock|.
+    std::mutex mTrimMemoryLock;
+    std::function<void()> mTrimMemoryCb;
 };
 
 }  // namespace android
@@ -9,14 +9,17 @@
 
 #include <memory>
 #include <optional>
+#include <vector>
 
 #include <base/callback.h>
 #include <base/memory/weak_ptr.h>
 
 #include <ui/Rect.h>
 #include <ui/Size.h>
+#include <v4l2_codec2/common/FlatIdMap.h>
 #include <v4l2_codec2/common/V4L2Device.h>
 #include <v4l2_codec2/common/VideoTypes.h>
+#include <v4l2_codec2/components/DecodeOutputFormat.h>
 #include <v4l2_codec2/components/VideoDecoder.h>
 #include <v4l2_codec2/components/VideoFrame.h>
 #include <v4l2_codec2/components/VideoFramePool.h>
@@ -26,14 +29,18 @@ namespace android {
 class V4L2Decoder : public VideoDecoder {
 public:
     static std::unique_ptr<VideoDecoder> Create(
-            const VideoCodec& codec, const size_t inputBufferSize, const size_t minNumOutputBuffers,
-            GetPoolCB getPoolCB, OutputCB outputCb, ErrorCB errorCb,
+            const VideoCodec& codec, const size_t inputBufferSize, const size_t numInputBuffers,
+            const size_t minNumOutputBuffers, const ui::Size& maxPictureSize,
+            const ui::Size& downscaledSize, const bool lowLatency, GetPoolCB getPoolCB,
+            OutputCB outputCb, ErrorCB errorCb,
             scoped_refptr<::base::SequencedTaskRunner> taskRunner);
     ~V4L2Decoder() override;
 
     void decode(std::unique_ptr<ConstBitstreamBuffer> buffer, DecodeCB decodeCb) override;
     void drain(DecodeCB drainCb) override;
     void flush() override;
+    void prepareOutputBuffers(const ui::Size& codedSize, size_t maxDpbFrames) override;
+    size_t getMemoryUsage() const override;
 
 private:
     enum class State {
@@ -54,20 +61,46 @@ private:
         DecodeCB decodeCb;
     };
 
+    // The decode callback of a buffer queued to the V4L2 input queue. The bitstream id is kept to
+    // detect callbacks abandoned by a flush. The bitstream buffer is kept until the device is done
+    // with it, so the client can release its own reference as soon as the buffer is queued.
+    struct PendingDecode {
+        int32_t mBitstreamId = 0;
+        DecodeCB mDecodeCb;
+        std::unique_ptr<ConstBitstreamBuffer> mBuffer;
+    };
+
     V4L2Decoder(scoped_refptr<::base::SequencedTaskRunner> taskRunner);
-    bool start(const VideoCodec& codec, const size_t inputBufferSize,
-               const size_t minNumOutputBuffers, GetPoolCB getPoolCb, OutputCB outputCb,
-               ErrorCB errorCb);
-    bool setupInputFormat(const uint32_t inputPixelFormat, const size_t inputBufferSize);
+    bool start(const VideoCodec& codec, const size_t inputBufferSize, const size_t numInputBuffers,
+               const size_t minNumOutputBuffers, const ui::Size& maxPictureSize,
+               const ui::Size& downscaledSize, const bool lowLatency, GetPoolCB getPoolCb,
+               OutputCB outputCb, ErrorCB errorCb);
+    // Ask the device to output the frames as soon as they are decoded, in decoding order.
+    void setupLowLatencyMode();
+    bool setupInputFormat(const uint32_t inputPixelFormat, const size_t inputBufferSize,
+                          const size_t numInputBuffers);
     void pumpDecodeRequest();
 
+    // Flush by only restarting the input queue, see |mLightFlush|.
+    void flushInputQueue();
+    bool startDevicePolling();
     void serviceDeviceTask(bool event);
+    bool serviceDeviceReadiness(uint32_t readiness);
     bool dequeueResolutionChangeEvent();
     bool changeResolution();
+    // Reconfigure the output queue for a stream of |codedSize| with the buffers of the current
+    // frame pool, without reallocating them. Returns false if the buffers can't be reused.
+    bool reuseOutputBuffers(const ui::Size& codedSize, size_t numBuffers);
     bool setupOutputFormat(const ui::Size& size);
+    // Set up the output format for the frames of a stream of |codedSize| scaled down to fit in
+    // |mDownscaledSize|. Returns the visible rectangle of the scaled frames, or std::nullopt if
+    // they aren't scaled.
+    std::optional<Rect> setupDownscaledOutputFormat(const ui::Size& codedSize);
 
     void tryFetchVideoFrame();
     void onVideoFrameReady(std::optional<VideoFramePool::FrameWithBlockId> frameWithBlockId);
+    // Queue |frame| with |blockId| to the V4L2 output queue. Returns whether it was successful.
+    bool queueOutputFrame(std::unique_ptr<VideoFrame> frame, uint32_t blockId);
 
     std::optional<size_t> getNumOutputBuffers();
     std::optional<struct v4l2_format> getFormatInfo();
@@ -84,23 +117,52 @@ private:
     scoped_refptr<V4L2Queue> mOutputQueue;
 
     std::queue<DecodeRequest> mDecodeRequests;
-    std::map<int32_t, DecodeCB> mPendingDecodeCbs;
+    // The decode callbacks of the buffers queued to the V4L2 input queue, indexed by V4L2 buffer
+    // id.
+    std::vector<PendingDecode> mPendingDecodeCbs;
 
     size_t mMinNumOutputBuffers = 0;
+    // The maximum picture size announced by the client, output buffers are allocated at this size
+    // when the stream fits within it.
+    ui::Size mMaxPictureSize;
+    // The size the output frames are scaled down to fit in, empty if they aren't scaled.
+    ui::Size mDownscaledSize;
     GetPoolCB mGetPoolCb;
     OutputCB mOutputCb;
     DecodeCB mDrainCb;
     ErrorCB mErrorCb;
 
+    // The size and pixel format the output buffers are allocated at. The coded size can be larger
+    // than the stream's coded size, when the buffers are reused after a resolution change.
     ui::Size mCodedSize;
+    uint32_t mOutputPixelFormat = 0;
+    // The output format chosen by setupOutputFormat().
+    DecodeOutputFormat mOutputFormat = {};
+    // Set once the consumer rejected the compressed and tiled output formats, the decoder then
+    // only writes linear frames.
+    bool mCompressedOutputRejected = false;
     Rect mVisibleRect;
+    // The number of output buffers of the frame pool allocated by prepareOutputBuffers(), before
+    // the device announced the output format. 0 once the first resolution change is done.
+    size_t mNumPreparedOutputBuffers = 0;
 
-    std::map<size_t, std::unique_ptr<VideoFrame>> mFrameAtDevice;
+    // The frames queued to the V4L2 output queue, indexed by V4L2 buffer id.
+    std::vector<std::unique_ptr<VideoFrame>> mFrameAtDevice;
 
     // Block IDs can be arbitrarily large, but we only have a limited number of
     // buffers. This maintains an association between a block ID and a specific
     // V4L2 buffer index.
-    std::map<size_t, size_t> mBlockIdToV4L2Id;
+    FlatIdMap<size_t> mBlockIdToV4L2Id;
+
+    // Whether flush() only restarts the input queue, keeping the output queue streaming, instead
+    // of stopping polling and restarting both queues. Used when the device supports the stop and
+    // start decoder commands.
+    bool mLightFlush = false;
+    // Incremented on each light flush, and stored in the timestamp of each input buffer so the
+    // output frames decoded before the last flush can be recognized. It's stored in the
+    // microseconds field, so it wraps below one million.
+    static constexpr uint32_t kMaxFlushGeneration = 1000000;
+    uint32_t mFlushGeneration = 0;
 
     State mState = State::Idle;
 
@@ -6,9 +6,13 @@
 #define ANDROID_V4L2_CODEC2_COMPONENTS_V4L2_ENCODE_COMPONENT_H
 
 #include <atomic>
+#include <list>
 #include <memory>
 #include <optional>
+#include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include <C2Component.h>
 #include <C2ComponentFactory.h>
@@ -21,14 +25,22 @@
 #include <base/single_thread_task_runner.h>
 #include <base/synchronization/waitable_event.h>
 #include <base/threading/thread.h>
+#include <base/time/time.h>
 #include <util/C2InterfaceHelper.h>
 
+#include <v4l2_codec2/common/V4L2ResourceManager.h>
+#include <v4l2_codec2/common/VideoPixelFormat.h>
+#include <v4l2_codec2/components/VideoEncoder.h>
+
 namespace android {
 
 struct BitstreamBuffer;
+class ComponentStats;
 class FormatConverter;
-class VideoEncoder;
+class PerformanceHintSession;
 class V4L2EncodeInterface;
+class WorkDoneBatcher;
+class WorkReporter;
 
 class V4L2EncodeComponent : public C2Component,
                             public std::enable_shared_from_this<V4L2EncodeComponent> {
@@ -73,8 +85,18 @@ private:
     void startTask(bool* success, ::base::WaitableEvent* done);
     // Destroy the encoder on the encoder thread.
     void stopTask(::base::WaitableEvent* done);
-    // Queue a new encode work item on the encoder thread.
+    // Queue a new encode work item on the encoder thread. The work item waits in
+    // |mInputWaitQueue| until the fence of its input block signaled.
     void queueTask(std::unique_ptr<C2Work> work);
+    // Called on the encoder thread when the wait for the fence of the input block |index| is done.
+    void onInputFenceSignaled(uint64_t index, c2_status_t status);
+    // Process the work items of |mInputWaitQueue| which are ready, in order.
+    void pumpInputWaitQueue();
+    // Reconfigure the encoder for the layout of the first work item of |mInputWaitQueue|, once all
+    // the previous work items are done.
+    void changeInputLayoutTask();
+    // Convert the input block of |work| if required and encode it, its fence must be signaled.
+    void processWork(std::unique_ptr<C2Work> work);
     // Drain all currently scheduled work on the encoder thread. The encoder will process all
     // scheduled work and mark the last item as EOS, before processing any new work.
     void drainTask(drain_mode_t drainMode);
@@ -87,16 +109,25 @@ private:
     // Set the component listener on the encoder thread.
     void setListenerTask(const std::shared_ptr<Listener>& listener, ::base::WaitableEvent* done);
 
-    // Initialize the V4L2 device for encoding with the requested configuration.
-    bool initializeEncoder();
+    // Initialize the V4L2 device for encoding with the requested configuration. The device is
+    // configured to accept |inputFormat| frames with the specified |stride|, or the stride of a
+    // graphic block allocated in |inputFormat| if not specified.
+    bool initializeEncoder(VideoPixelFormat inputFormat, std::optional<uint32_t> stride);
+    // Check whether the V4L2 device can directly encode the client's native pixel format of
+    // |block|. If so the encoder is reconfigured so no input format conversion is required.
+    bool negotiateInputFormat(const C2ConstGraphicBlock& block);
+    // Apply the parameters of the |configUpdate| attached to a work item to the interface.
+    bool applyConfigUpdate(const std::vector<std::unique_ptr<C2Param>>& configUpdate);
     // Update the |mBitrate| and |mFramerate| currently configured on the V4L2 device, to match the
-    // values requested by the codec 2.0 framework.
+    // values requested by the codec 2.0 framework, as well as the regions of interest.
     bool updateEncodingParameters();
 
     // Schedule the next encode operation on the V4L2 device.
     void scheduleNextEncodeTask();
-    // Encode the specified |block| with corresponding |index| and |timestamp|.
-    bool encode(C2ConstGraphicBlock block, uint64_t index, int64_t timestamp);
+    // Encode the specified |block| laid out as |planes| and |layoutFormat|, as reported by
+    // getVideoFrameLayout(), with corresponding |index| and |timestamp|.
+    bool encode(C2ConstGraphicBlock block, const VideoFramePlanes& planes,
+                VideoPixelFormat layoutFormat, uint64_t index, int64_t timestamp);
     // Flush the encoder.
     void flush();
 
@@ -109,6 +140,10 @@ private:
     void onOutputBufferDone(size_t dataSize, int64_t timestamp, bool keyFrame,
                             std::unique_ptr<BitstreamBuffer> buffer);
 
+    // Append |work| to the output work queue and index it.
+    void pushWork(std::unique_ptr<C2Work> work);
+    // Remove the first work item from the output work queue and its indexes.
+    std::unique_ptr<C2Work> popWork();
     // Helper function to find a work item in the output work queue by index.
     C2Work* getWorkByIndex(uint64_t index);
     // Helper function to find a work item in the output work queue by timestamp.
@@ -117,6 +152,8 @@ private:
     bool isWorkDone(const C2Work& work) const;
     // Notify the listener the specified |work| item is finished.
     void reportWork(std::unique_ptr<C2Work> work);
+    // Notify the listener the specified |works| are finished in a single call.
+    void reportWorks(std::list<std::unique_ptr<C2Work>> works);
 
     // Configure the c2 block pool that will be used to create output buffers.
     bool getBlockPool();
@@ -134,10 +171,18 @@ private:
 
     // The number of concurrent encoder instances currently created.
     static std::atomic<int32_t> sConcurrentInstances;
+    // The share of the encoders' macroblock budget held by the component, nullptr if admission
+    // control is disabled.
+    std::unique_ptr<V4L2ResourceManager::Reservation> mReservation;
     // The component's registered name.
     const C2String mName;
     // The component's id, provided by the C2 framework upon initialization.
     const c2_node_id_t mId = 0;
+    // The name of the async trace slices of the work items, from queue_nb() to onWorkDone_nb(),
+    // keyed by frame index.
+    const std::string mWorkTraceName;
+    // The runtime statistics of the component, listed in the debug dump of the service.
+    const std::shared_ptr<ComponentStats> mStats;
     // The component's interface implementation.
     const std::shared_ptr<V4L2EncodeInterface> mInterface;
 
@@ -148,10 +193,19 @@ private:
     // The component's listener to be notified when events occur, only accessed on encoder thread.
     std::shared_ptr<Listener> mListener;
 
+    // The queue of encode work items waiting for the fence of their input block to signal, for the
+    // encoder to be reconfigured for their layout, or for the work items before them, in queuing
+    // order.
+    std::deque<std::unique_ptr<C2Work>> mInputWaitQueue;
+    // Whether the first work item of |mInputWaitQueue| waits for the encoder to be reconfigured.
+    bool mInputLayoutChangePending = false;
     // The queue of encode work items waiting for free buffers in the input convertor.
     std::queue<std::unique_ptr<C2Work>> mInputConverterQueue;
     // An input format convertor will be used if the device doesn't support the video's format.
     std::unique_ptr<FormatConverter> mInputFormatConverter;
+    // Whether the client's native input format has been negotiated with the device, which is done
+    // when receiving the first input frame.
+    bool mInputFormatNegotiated = false;
 
     // The bitrate currently configured on the v4l2 device.
     uint32_t mBitrate = 0;
@@ -161,23 +215,44 @@ private:
     uint32_t mFramerate = 0;
     // The timestamp of the last frame encoded, used to dynamically adjust the framerate.
     std::optional<int64_t> mLastFrameTime;
+    // The regions of interest currently set on the encoder.
+    std::vector<VideoEncoder::RegionOfInterest> mRegionsOfInterest;
 
     // Whether we need to extract and submit CSD (codec-specific data, e.g. H.264 SPS).
     bool mExtractCSD = false;
+    // Whether the output is HEVC, whose CSD also contains the VPS.
+    bool mIsHEVC = false;
 
     // The queue of encode work items currently being processed.
     std::deque<std::unique_ptr<C2Work>> mWorkQueue;
+    // Indexes of the items in |mWorkQueue| by frame index and by timestamp, kept in sync by
+    // pushWork() and popWork(). Only the first item with a timestamp is indexed by timestamp.
+    std::unordered_map<uint64_t, C2Work*> mWorksByIndex;
+    std::unordered_map<uint64_t, C2Work*> mWorksByTimestamp;
+    // The time each frame was sent to the encoder, by frame index, to record the encode latency.
+    std::unordered_map<uint64_t, ::base::TimeTicks> mEncodeStartTimes;
 
     // The output block pool.
     std::shared_ptr<C2BlockPool> mOutputBlockPool;
+    // The dmabuf ids of the output blocks fetched so far, to count the recycled blocks.
+    std::unordered_set<uint32_t> mOutputBlockIds;
+    // Batches the work items finished during an encoder task, so they're reported in a single
+    // call.
+    std::unique_ptr<WorkDoneBatcher> mWorkDoneBatcher;
+    // Delivers the batches of work items and the errors to |mListener| off the encoder thread.
+    std::unique_ptr<WorkReporter> mWorkReporter;
+    // The performance hint session of the encoder thread, nullptr if unsupported.
+    std::unique_ptr<PerformanceHintSession> mHintSession;
 
     // The component state, accessible from any thread as C2Component interface is not thread-safe.
     std::atomic<ComponentState> mComponentState;
 
     // The encoder thread on which all interaction with the V4L2 device is performed.
-    ::base::Thread mEncoderThread{"V4L2EncodeComponentThread"};
+    ::base::Thread mEncoderThread{"V4L2Encoder"};
     // The task runner on the encoder thread.
     scoped_refptr<::base::SequencedTaskRunner> mEncoderTaskRunner;
+    // The thread waiting for the fences of the input blocks, one at a time in queuing order.
+    ::base::Thread mFenceThread{"V4L2EncoderFence"};
 
     // The WeakPtrFactory used to get weak pointers of this.
     ::base::WeakPtr<V4L2EncodeComponent> mWeakThis;
@@ -5,6 +5,7 @@
 #ifndef ANDROID_V4L2_CODEC2_COMPONENTS_V4L2_ENCODE_INTERFACE_H
 #define ANDROID_V4L2_CODEC2_COMPONENTS_V4L2_ENCODE_INTERFACE_H
 
+#include <algorithm>
 #include <optional>
 #include <vector>
 
@@ -15,6 +16,8 @@
 #include <util/C2InterfaceHelper.h>
 
 #include <v4l2_codec2/common/EncodeHelpers.h>
+#include <v4l2_codec2/common/ThreadPolicy.h>
+#include <v4l2_codec2/components/V4L2ComponentParams.h>
 
 namespace media {
 class V4L2Device;
@@ -42,12 +45,32 @@ public:
 
     // Get sync key-frame period in frames.
     uint32_t getKeyFramePeriod() const;
+    // Get the number of frames over which the intra macroblocks are cyclically refreshed, 0 if
+    // intra refresh is disabled.
+    uint32_t getIntraRefreshPeriod() const;
     // Get the requested bitrate mode.
     C2Config::bitrate_mode_t getBitrateMode() const { return mBitrateMode->value; }
     // Get the requested bitrate.
     uint32_t getBitrate() const { return mBitrate->value; }
     // Get the requested framerate.
     float getFramerate() const { return mFrameRate->value; }
+    // Get the requested number of temporal layers, 1 if temporal layering is disabled.
+    uint32_t getTemporalLayerCount() const { return std::max(mTemporalLayering->m.layerCount, 1u); }
+    // Get the cumulative bitrate ratios of all the temporal layers but the top one.
+    std::vector<float> getTemporalLayerBitrateRatios() const;
+    // Get the requested regions of interest, empty if none.
+    std::vector<C2V4L2RegionOfInterestStruct> getRegionsOfInterest() const;
+    // Get the number of buffers to keep queued on each of the V4L2 device queues. Unless
+    // overridden by property, deeper queues are used for higher pixel rates to keep the encoder
+    // busy while the client is producing the next frame.
+    uint32_t getQueueDepth() const;
+    // Whether the encoder may grow the queue depth at runtime when it starves for buffers.
+    bool isQueueDepthAdaptive() const;
+    // Whether the output buffers are sized from the bitrate and frame rate rather than the
+    // worst case of the resolution, and grown when overflowing.
+    bool isOutputBufferRightSized() const;
+    // Get the scheduling policy of the encoder threads.
+    ThreadPolicy getThreadPolicy() const;
 
     // Request changing the framerate to the specified value.
     void setFramerate(uint32_t framerate) { mFrameRate->value = framerate; }
@@ -60,6 +83,10 @@ protected:
                                       const C2P<C2StreamPictureSizeInfo::input>& videosize,
                                       const C2P<C2StreamFrameRateInfo::output>& frameRate,
                                       const C2P<C2StreamBitrateInfo::output>& bitrate);
+    static C2R HEVCProfileLevelSetter(bool mayBlock, C2P<C2StreamProfileLevelInfo::output>& info,
+                                      const C2P<C2StreamPictureSizeInfo::input>& videosize,
+                                      const C2P<C2StreamFrameRateInfo::output>& frameRate,
+                                      const C2P<C2StreamBitrateInfo::output>& bitrate);
     static C2R VP9ProfileLevelSetter(bool mayBlock, C2P<C2StreamProfileLevelInfo::output>& info,
                                      const C2P<C2StreamPictureSizeInfo::input>& videosize,
                                      const C2P<C2StreamFrameRateInfo::output>& frameRate,
@@ -70,6 +97,14 @@ protected:
     static C2R IntraRefreshPeriodSetter(bool mayBlock,
                                         C2P<C2StreamIntraRefreshTuning::output>& period);
 
+    static C2R TemporalLayeringSetter(bool mayBlock,
+                                      C2P<C2StreamTemporalLayeringTuning::output>& layering);
+
+    static C2R RegionsOfInterestSetter(bool mayBlock,
+                                       C2P<C2V4L2RegionsOfInterestTuning::input>& regions);
+
+    static C2R ThreadPolicySetter(bool mayBlock, C2P<C2V4L2ThreadPolicyTuning>& me);
+
     // Constant parameters
 
     // The kind of the component; should be C2Component::KIND_ENCODER.
@@ -100,6 +135,10 @@ protected:
     std::shared_ptr<C2StreamSyncFrameIntervalTuning::output> mKeyFramePeriodUs;
     // Component uses this ID to fetch corresponding output block pool from platform.
     std::shared_ptr<C2PortBlockPoolsTuning::output> mOutputBlockPoolIds;
+    // The scheduling policy of the encoder threads.
+    std::shared_ptr<C2V4L2ThreadPolicyTuning> mThreadPolicy;
+    // The temporal layering of the encoded stream, only hierarchical P layers are supported.
+    std::shared_ptr<C2StreamTemporalLayeringTuning::output> mTemporalLayering;
 
     // Dynamic parameters
 
@@ -112,6 +151,8 @@ protected:
     // The switch-type parameter that will be set to true while client requests keyframe. It
     // will be reset once encoder gets the request.
     std::shared_ptr<C2StreamRequestSyncFrameTuning::output> mRequestKeyFrame;
+    // The regions of interest of the input frames.
+    std::shared_ptr<C2V4L2RegionsOfInterestTuning::input> mRegionsOfInterest;
     // The intra-frame refresh period. This is unused for the component now.
     // TODO: adapt intra refresh period to encoder.
     std::shared_ptr<C2StreamIntraRefreshTuning::output> mIntraRefreshPeriod;
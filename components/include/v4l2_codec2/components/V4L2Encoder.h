@@ -13,6 +13,7 @@
 
 #include <base/memory/weak_ptr.h>
 #include <base/sequenced_task_runner.h>
+#include <base/time/time.h>
 #include <ui/Size.h>
 
 #include <v4l2_codec2/common/Common.h>
@@ -23,21 +24,32 @@ namespace android {
 struct BitstreamBuffer;
 struct VideoFramePlane;
 class V4L2Device;
+struct V4L2ExtCtrl;
+struct V4L2RoiRegion;
 class V4L2Queue;
 
 class V4L2Encoder : public VideoEncoder {
 public:
-    // Number of buffers on V4L2 device queues.
+    // Minimum number of buffers on V4L2 device queues.
     static constexpr size_t kInputBufferCount = 2;
     static constexpr size_t kOutputBufferCount = 2;
+    // Maximum number of buffers queued simultaneously on each V4L2 device queue.
+    static constexpr size_t kMaxQueueDepth = 8;
 
     static std::unique_ptr<VideoEncoder> create(
             C2Config::profile_t profile, std::optional<uint8_t> level, const ui::Size& visibleSize,
-            uint32_t stride, uint32_t keyFramePeriod, C2Config::bitrate_mode_t bitrateMode,
-            uint32_t bitrate, std::optional<uint32_t> peakBitrate,
-            FetchOutputBufferCB fetchOutputBufferCb, InputBufferDoneCB inputBufferDoneCb,
-            OutputBufferDoneCB outputBufferDoneCb, DrainDoneCB drainDoneCb, ErrorCB errorCb,
+            VideoPixelFormat inputFormat, uint32_t stride, uint32_t keyFramePeriod,
+            uint32_t intraRefreshPeriod, C2Config::bitrate_mode_t bitrateMode, uint32_t bitrate,
+            std::optional<uint32_t> peakBitrate, size_t queueDepth, bool adaptiveQueueDepth,
+            bool rightSizedOutputBuffers, uint32_t numTemporalLayers,
+            std::vector<float> temporalLayerBitrateRatios, FetchOutputBufferCB fetchOutputBufferCb,
+            InputBufferDoneCB inputBufferDoneCb, OutputBufferDoneCB outputBufferDoneCb,
+            DrainDoneCB drainDoneCb, ErrorCB errorCb,
             scoped_refptr<::base::SequencedTaskRunner> taskRunner);
+
+    // Get the maximum number of input frames queued simultaneously on the device, at which the
+    // encode() caller should size its input buffer pool.
+    static size_t getMaxQueueDepth(size_t queueDepth, bool adaptiveQueueDepth);
     ~V4L2Encoder() override;
 
     bool encode(std::unique_ptr<InputFrame> frame) override;
@@ -48,10 +60,18 @@ public:
     bool setPeakBitrate(uint32_t peakBitrate) override;
     bool setFramerate(uint32_t framerate) override;
     void requestKeyframe() override;
+    bool setRegionsOfInterest(std::vector<RegionOfInterest> regions) override;
+
+    bool isInputFormatSupported(VideoPixelFormat format) const override;
+    bool isInputLayoutSupported(const VideoFramePlanes& planes) const override;
 
     VideoPixelFormat inputFormat() const override;
     const ui::Size& visibleSize() const override { return mVisibleSize; }
     const ui::Size& codedSize() const override { return mInputCodedSize; }
+    size_t queueDepth() const override { return mQueueDepth; }
+
+    size_t getMemoryUsage() const override;
+    ::base::TimeDelta getBufferWaitTime() const override { return mBufferWaitTime; }
 
 private:
     // Possible encoder states.
@@ -82,12 +102,18 @@ private:
 
     // Initialize the V4L2 encoder for specified parameters.
     bool initialize(C2Config::profile_t outputProfile, std::optional<uint8_t> level,
-                    const ui::Size& visibleSize, uint32_t stride, uint32_t keyFramePeriod,
+                    const ui::Size& visibleSize, VideoPixelFormat inputFormat, uint32_t stride,
+                    uint32_t keyFramePeriod, uint32_t intraRefreshPeriod,
                     C2Config::bitrate_mode_t bitrateMode, uint32_t bitrate,
-                    std::optional<uint32_t> peakBitrate);
+                    std::optional<uint32_t> peakBitrate, size_t queueDepth, bool adaptiveQueueDepth,
+                    bool rightSizedOutputBuffers, uint32_t numTemporalLayers,
+                    std::vector<float> temporalLayerBitrateRatios);
 
     // Handle the next encode request on the queue.
     void handleEncodeRequest();
+    // Grow the queue depth if the encoder was starved for input buffers for most of the frames
+    // in the last measurement window, called each time a frame is queued in adaptive mode.
+    void adaptQueueDepth();
     // Handle a request to flush the encoder.
     void handleFlushRequest();
     // Handle a request to drain the encoder.
@@ -101,12 +127,39 @@ private:
     bool configureOutputFormat(C2Config::profile_t outputProfile);
     // Configure required and optional controls on the V4L2 device.
     bool configureDevice(C2Config::profile_t outputProfile,
-                         std::optional<const uint8_t> outputH264Level);
+                         std::optional<const uint8_t> outputLevel);
+    // Configure the device to prepend the parameter sets to each IDR, or enable manual injection
+    // if the device doesn't support it.
+    bool configureParamsBeforeIDR();
     // Configure required and optional H.264 controls on the V4L2 device.
     bool configureH264(C2Config::profile_t outputProfile,
                        std::optional<const uint8_t> outputH264Level);
+    // Configure required and optional HEVC controls on the V4L2 device.
+    bool configureHEVC(C2Config::profile_t outputProfile,
+                       std::optional<const uint8_t> outputHEVCLevel);
+    // Configure required and optional VP8 and VP9 controls on the V4L2 device.
+    bool configureVPx(C2Config::profile_t outputProfile);
     // Configure the specified bitrate mode on the V4L2 device.
     bool configureBitrateMode(C2Config::bitrate_mode_t bitrateMode);
+    // Check whether the device supports the vendor region of interest control, see
+    // setRegionsOfInterest().
+    void configureRegionsOfInterest();
+    // Configure hierarchical P coding with the requested number of temporal layers, falls back to
+    // a single layer if the device doesn't support it.
+    void configureTemporalLayers();
+    // Configure cyclic intra refresh over the requested number of frames, disabled if the device
+    // doesn't support it.
+    void configureIntraRefresh();
+    // Set the bitrate of each temporal layer from the target |bitrate|.
+    void setTemporalLayerBitrates(uint32_t bitrate);
+    // Get the temporal layer of the next encoded frame, |keyFrame| restarts the layer pattern.
+    uint32_t getNextTemporalLayer(bool keyFrame);
+    // Set |ctrl| on the device right away while initializing, or stage it to be set together with
+    // the other controls of the next frame otherwise. A staged control replaces the previously
+    // staged value of the same control.
+    bool setCtrl(V4L2ExtCtrl ctrl);
+    // Set all the staged controls on the device with a single ioctl, returns whether successful.
+    bool applyStagedCtrls();
 
     // Attempt to start the V4L2 device poller.
     bool startDevicePoll();
@@ -116,6 +169,9 @@ private:
     void onPollError();
     // Service I/O on the V4L2 device, called by the V4L2 device poller.
     void serviceDeviceTask(bool event);
+    // Service I/O on the queues set in the |readiness| mask, called by the V4L2 device poller in
+    // batched mode. Returns whether a buffer was dequeued.
+    bool serviceDeviceReadiness(uint32_t readiness);
 
     // Enqueue an input buffer to be encoded on the device input queue. Returns whether the
     // operation was successful.
@@ -130,6 +186,23 @@ private:
     // Returns whether the operation was successful.
     bool dequeueOutputBuffer();
 
+    // Copy the |size| bytes of encoded data at |dataOffset| of the MMAP output |buffer| to the same
+    // offset of |bitstreamBuffer|.
+    bool copyMMapOutputBuffer(const V4L2ReadableBuffer& buffer, size_t dataOffset, size_t size,
+                              BitstreamBuffer* bitstreamBuffer);
+    // Get the output buffer size fitting the key frames at the current bitrate and frame rate.
+    uint32_t getRightSizedOutputBufferSize() const;
+    // Update the size of the output buffers fetched from now on, if they are right-sized.
+    void updateOutputBufferSize();
+    // Stop right-sizing the output buffers, and configure the device for the worst-case size.
+    // Called before allocating MMAP output buffers, whose size can't change afterwards.
+    bool resetOutputBufferSizeToMax();
+    // Update the cached parameter sets from the encoded |data|, returns whether all were found.
+    bool extractCachedParams(const uint8_t* data, size_t size);
+    // Insert the cached parameter sets before the key frame stored at |*offset| in |buffer|, see
+    // insertSPSPPSBeforeIDR(). Returns the new size of the encoded data, or 0 on failure.
+    size_t insertCachedParams(uint8_t* buffer, size_t bufferSize, size_t* offset, size_t size);
+
     // Create input buffers on the V4L2 device input queue.
     bool createInputBuffers();
     // Create output buffers on the V4L2 device output queue.
@@ -156,29 +229,86 @@ private:
     ui::Size mInputCodedSize;
     // The input layout configured on the V4L2 device.
     std::optional<VideoFrameLayout> mInputLayout;
+    // The input pixel formats supported by the V4L2 device.
+    std::vector<VideoPixelFormat> mSupportedInputFormats;
     // Required output buffer byte size.
     uint32_t mOutputBufferSize = 0;
-
-    // How often we want to request the V4L2 device to create a key frame.
+    // Whether the output buffers are sized from the bitrate and frame rate, between the minimum
+    // size required by the device and the worst case size of the resolution. The minimum is
+    // raised each time an encoded frame overflows its buffer. Disabled with MMAP output buffers.
+    bool mRightSizedOutputBuffers = false;
+    uint32_t mMinOutputBufferSize = 0;
+    uint32_t mMaxOutputBufferSize = 0;
+    // Whether the first encoded frame was dequeued, until then the right-sized output buffers are
+    // sized for the worst case.
+    bool mFirstFrameDequeued = false;
+    uint32_t mBitrate = 0;
+    uint32_t mFramerate = 0;
+
+    // How often we want to request the V4L2 device to create a key frame, only the first frame is a
+    // key frame if 0.
     uint32_t mKeyFramePeriod = 0;
+    // The number of frames over which the device refreshes all the macroblocks through intra
+    // coding, 0 if intra refresh is disabled.
+    uint32_t mIntraRefreshPeriod = 0;
     // Key frame counter, a key frame will be requested each time it reaches zero.
     uint32_t mKeyFrameCounter = 0;
-
-    // Whether we need to manually cache and prepend SPS and PPS to IDR frames.
+    // The regions of interest passed to the vendor control, sized to the number of regions it
+    // supports. Empty if the device doesn't support regions of interest.
+    std::vector<V4L2RoiRegion> mRoiRegions;
+    // The controls staged by the dynamic parameter changes, set right before the next frame is
+    // queued so each frame costs at most one VIDIOC_S_EXT_CTRLS.
+    std::vector<V4L2ExtCtrl> mStagedCtrls;
+
+    // The number of temporal layers, and the cumulative bitrate ratios of all the layers but the
+    // top one. The frames are assigned to the layers in the hierarchical P pattern, which restarts
+    // at each key frame, |mTemporalLayerFrameIndex| is the position of the next encoded frame.
+    uint32_t mNumTemporalLayers = 1;
+    std::vector<float> mTemporalLayerBitrateRatios;
+    uint32_t mTemporalLayerFrameIndex = 0;
+
+    // Whether we're encoding HEVC, whose parameter sets include a VPS.
+    bool mHEVC = false;
+    // Whether we need to manually cache and prepend the parameter sets to IDR frames.
     bool mInjectParamsBeforeIDR = false;
-    // The latest cached SPS and PPS (without H.264 start code).
+    // The latest cached VPS (HEVC only), SPS and PPS (without start code).
+    std::vector<uint8_t> mCachedVPS;
     std::vector<uint8_t> mCachedSPS;
     std::vector<uint8_t> mCachedPPS;
+    // Whether the device was seen sending SPS and PPS with non-key frames, and the number of
+    // consecutive non-key frames without SPS and PPS otherwise. Non-key frames are only scanned
+    // for parameter sets until we know where the device puts them.
+    bool mParamsOnNonKeyFrames = false;
+    uint32_t mNumNonKeyFramesWithoutParams = 0;
 
     // The V4L2 device and associated queues used to interact with the device.
     scoped_refptr<V4L2Device> mDevice;
     scoped_refptr<V4L2Queue> mInputQueue;
     scoped_refptr<V4L2Queue> mOutputQueue;
 
+    // The number of buffers currently allowed in flight on each device queue. More buffers are
+    // allocated on the queues when adaptive, so the depth can grow up to |mMaxQueueDepth|
+    // without reallocation.
+    size_t mQueueDepth = kInputBufferCount;
+    size_t mMaxQueueDepth = kInputBufferCount;
+    // Counters of the current adaptive queue depth measurement window.
+    uint32_t mNumWindowFrames = 0;
+    uint32_t mNumWindowBufferWaits = 0;
+    // Whether the frame at the front of |mEncodeRequests| already waited for an input buffer, so
+    // each frame is only counted once in |mNumWindowBufferWaits|.
+    bool mFrontRequestWaited = false;
+    // The total time spent in the WAITING_FOR_V4L2_BUFFER state, and when the current wait
+    // started.
+    ::base::TimeDelta mBufferWaitTime;
+    ::base::TimeTicks mBufferWaitStart;
+
     // List of frames associated with each buffer in the V4L2 device input queue.
     std::vector<std::unique_ptr<InputFrame>> mInputBuffers;
     // List of bitstream buffers associated with each buffer in the V4L2 device output queue.
     std::vector<std::unique_ptr<BitstreamBuffer>> mOutputBuffers;
+    // The memory type of the output queue. The bitstream buffers are imported as DMABUF so the
+    // device writes straight into them, drivers only supporting MMAP buffers get theirs copied.
+    enum v4l2_memory mOutputMemory = V4L2_MEMORY_DMABUF;
 
     // Callbacks to be triggered on various events.
     FetchOutputBufferCB mFetchOutputBufferCb;
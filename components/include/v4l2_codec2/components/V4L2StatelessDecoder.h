@@ -0,0 +1,250 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMPONENTS_V4L2_STATELESS_DECODER_H
+#define ANDROID_V4L2_CODEC2_COMPONENTS_V4L2_STATELESS_DECODER_H
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <memory>
+#include <optional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include <base/callback.h>
+#include <base/files/scoped_file.h>
+#include <base/memory/weak_ptr.h>
+
+#include <ui/Rect.h>
+#include <ui/Size.h>
+#include <v4l2_codec2/common/FlatIdMap.h>
+#include <v4l2_codec2/common/H264Parser.h>
+#include <v4l2_codec2/common/V4L2Device.h>
+#include <v4l2_codec2/common/V4L2MediaDevice.h>
+#include <v4l2_codec2/common/VideoTypes.h>
+#include <v4l2_codec2/components/DecodeOutputFormat.h>
+#include <v4l2_codec2/components/VideoDecoder.h>
+#include <v4l2_codec2/components/VideoFrame.h>
+#include <v4l2_codec2/components/VideoFramePool.h>
+
+namespace android {
+
+// Decoder for the stateless V4L2 decoders, which only decode a single frame from the parameters
+// parsed by their client, see the V4L2 stateless codec interface. Each frame is submitted as a
+// media request binding its bitstream buffer to the controls describing it, and the decoded
+// picture buffer is managed here.
+//
+// Only H.264 streams of frames are supported, in the frame-based decoding mode with Annex B start
+// codes. Each bitstream buffer is expected to hold at most one picture.
+class V4L2StatelessDecoder : public VideoDecoder {
+public:
+    static std::unique_ptr<VideoDecoder> Create(
+            const VideoCodec& codec, const size_t inputBufferSize, const size_t minNumOutputBuffers,
+            const bool lowLatency, GetPoolCB getPoolCb, OutputCB outputCb, ErrorCB errorCb,
+            scoped_refptr<::base::SequencedTaskRunner> taskRunner);
+    ~V4L2StatelessDecoder() override;
+
+    void decode(std::unique_ptr<ConstBitstreamBuffer> buffer, DecodeCB decodeCb) override;
+    void drain(DecodeCB drainCb) override;
+    void flush() override;
+    size_t getMemoryUsage() const override;
+
+private:
+    enum class State {
+        Idle,  // Not received any decode buffer after initialized, flushed, or drained.
+        Decoding,
+        Draining,
+        Error,
+    };
+    static const char* StateToString(State state);
+
+    struct DecodeRequest {
+        DecodeRequest(std::unique_ptr<ConstBitstreamBuffer> buffer, DecodeCB decodeCb)
+              : buffer(std::move(buffer)), decodeCb(std::move(decodeCb)) {}
+        DecodeRequest(DecodeRequest&&) = default;
+        ~DecodeRequest() = default;
+
+        std::unique_ptr<ConstBitstreamBuffer> buffer;  // nullptr means Drain
+        DecodeCB decodeCb;
+    };
+
+    // The result of processing the decode request at the front of |mDecodeRequests|.
+    enum class DecodeResult {
+        kDone,   // The request is finished or submitted to the device.
+        kRetry,  // The request must be processed again, once the device made progress.
+        kError,
+    };
+
+    // A frame of the decoded picture buffer, named after the variables of the H.264
+    // specification.
+    struct Picture {
+        // The bitstream the picture is decoded from, -1 for frames inferred from a gap in
+        // frame_num, which are neither decoded nor output.
+        int32_t mBitstreamId = -1;
+        bool mIdr = false;
+        uint8_t mNalRefIdc = 0;
+        bool mHasMmco5 = false;
+
+        int32_t mFrameNum = 0;
+        int32_t mFrameNumWrap = 0;
+        int32_t mPicNum = 0;
+        int32_t mLongTermPicNum = 0;
+        int32_t mLongTermFrameIdx = 0;
+        bool mShortTermRef = false;
+        bool mLongTermRef = false;
+
+        int32_t mPicOrderCntMsb = 0;
+        int32_t mTopFieldOrderCnt = 0;
+        int32_t mBottomFieldOrderCnt = 0;
+        int32_t mFrameNumOffset = 0;
+
+        // Whether the picture is still waiting to be bumped out of the decoded picture buffer.
+        bool mOutputNeeded = false;
+        // The decoded frame, set once dequeued from the V4L2 output queue, and the V4L2 buffer it
+        // was decoded into.
+        std::unique_ptr<VideoFrame> mFrame;
+        std::optional<size_t> mV4L2Id;
+        bool mDecoded = false;
+
+        bool isRef() const { return mShortTermRef || mLongTermRef; }
+        int32_t picOrderCnt() const { return std::min(mTopFieldOrderCnt, mBottomFieldOrderCnt); }
+    };
+
+    V4L2StatelessDecoder(scoped_refptr<::base::SequencedTaskRunner> taskRunner);
+    bool start(const size_t inputBufferSize, const size_t minNumOutputBuffers,
+               const bool lowLatency, GetPoolCB getPoolCb, OutputCB outputCb, ErrorCB errorCb);
+    void pumpDecodeRequest();
+    DecodeResult decodeBuffer(DecodeRequest& request);
+    // Flush the decoded picture buffer and wait for the device to be idle, then configure the
+    // queues for the stream of |sps|. Returns kRetry while the device is still busy.
+    DecodeResult configure(const H264SPS& sps);
+    // Reallocate the input buffers with |size| bytes once they are all dequeued. Returns kRetry
+    // while the device still holds some of them.
+    DecodeResult resizeInputBuffers(size_t size);
+    // Submit |picture| with the slice |header| to the device as a media request, with the
+    // |slices| NAL units copied to the input buffer of the request. |decodeCb| is only taken once
+    // the picture is submitted, so the caller can still report the failures with it.
+    bool submitPicture(const H264SliceHeader& header, const Picture& picture,
+                       const std::vector<std::pair<const uint8_t*, size_t>>& slices,
+                       uint32_t decodeFlags, DecodeCB* decodeCb);
+    void tryFinishDrain();
+
+    bool startDevicePolling();
+    void serviceDeviceTask(bool event);
+    bool serviceDeviceReadiness(uint32_t readiness);
+    bool setupOutputFormat(const ui::Size& size);
+
+    // Decoded picture buffer management, following the H.264 specification (8.2 and C.4).
+    void computePicOrderCnt(const H264SPS& sps, const H264SliceHeader& header, Picture* picture);
+    void updatePicNums(const H264SPS& sps, int32_t currFrameNum);
+    void handleFrameNumGap(const H264SPS& sps, int32_t frameNum);
+    void markReferencePictures(const H264SPS& sps, const H264SliceHeader& header,
+                               Picture* picture);
+    void slidingWindowMarking(const H264SPS& sps);
+    void storePicture(std::shared_ptr<Picture> picture);
+    // Bump the picture with the lowest picture order count out of the decoded picture buffer.
+    // Returns false if no picture is waiting for output.
+    bool bumpPicture();
+    // Bump all the pictures waiting for output, and empty the decoded picture buffer.
+    void flushDpb();
+    void removeUnusedPictures();
+    // Output the bumped pictures in order, as long as they are decoded.
+    void outputPictures();
+
+    void tryFetchVideoFrame();
+    void onVideoFrameReady(std::optional<VideoFramePool::FrameWithBlockId> frameWithBlockId);
+    // Queue |frame| with |blockId| to the V4L2 output queue. Returns whether it was successful.
+    bool queueOutputFrame(std::unique_ptr<VideoFrame> frame, uint32_t blockId);
+    // Queue |frame| to the V4L2 output buffer |v4l2Id|, or keep it aside while the picture
+    // decoded in the buffer is still used as a reference.
+    bool queueFrameToDevice(std::unique_ptr<VideoFrame> frame, size_t v4l2Id);
+    bool isReferenced(size_t v4l2Id) const;
+    // Queue the frames kept aside whose buffer isn't used as a reference anymore.
+    bool releaseParkedFrames();
+
+    void setState(State newState);
+    void onError();
+
+    std::unique_ptr<VideoFramePool> mVideoFramePool;
+
+    scoped_refptr<V4L2Device> mDevice;
+    std::unique_ptr<V4L2MediaDevice> mMediaDevice;
+    scoped_refptr<V4L2Queue> mInputQueue;
+    scoped_refptr<V4L2Queue> mOutputQueue;
+
+    std::queue<DecodeRequest> mDecodeRequests;
+    // The decode callbacks of the buffers queued to the V4L2 input queue, and the media request
+    // each input buffer is submitted with, indexed by V4L2 buffer id.
+    std::vector<DecodeCB> mPendingDecodeCbs;
+    std::vector<::base::ScopedFD> mRequests;
+
+    size_t mInputBufferSize = 0;
+    // The largest access unit seen so far, which the input buffers are sized to when adaptive.
+    size_t mMaxAccessUnitSize = 0;
+    size_t mMinNumOutputBuffers = 0;
+    // Output the pictures in decoding order, without waiting for the pictures reordered before
+    // them.
+    bool mLowLatency = false;
+    GetPoolCB mGetPoolCb;
+    OutputCB mOutputCb;
+    DecodeCB mDrainCb;
+    ErrorCB mErrorCb;
+
+    H264Parser mParser;
+
+    // The configuration of the current stream, set once the first SPS is activated.
+    bool mConfigured = false;
+    ui::Size mStreamCodedSize;
+    size_t mMaxDpbFrames = 0;
+    size_t mMaxReorderFrames = 0;
+    ui::Size mCodedSize;
+    Rect mVisibleRect;
+    // The output format chosen by setupOutputFormat().
+    DecodeOutputFormat mOutputFormat = {};
+    // Set once the consumer rejected the compressed and tiled output formats, the decoder then
+    // only writes linear frames.
+    bool mCompressedOutputRejected = false;
+
+    // The decoded picture buffer, the pictures bumped out of it waiting to be decoded before
+    // being output, and the pictures being decoded by the device, indexed by bitstream id.
+    std::vector<std::shared_ptr<Picture>> mDpb;
+    std::deque<std::shared_ptr<Picture>> mOutputPictures;
+    std::map<int32_t, std::shared_ptr<Picture>> mPicturesAtDevice;
+
+    // The state of the previous pictures, used to compute the picture order count and to detect
+    // gaps in frame_num.
+    int32_t mPrevRefPicOrderCntMsb = 0;
+    int32_t mPrevRefPicOrderCntLsb = 0;
+    int32_t mPrevFrameNumOffset = 0;
+    int32_t mPrevFrameNum = 0;
+    int32_t mPrevRefFrameNum = 0;
+    bool mPrevHasMmco5 = false;
+    // The maximum long-term frame index, -1 if there is none.
+    int32_t mMaxLongTermFrameIdx = -1;
+
+    // The frames queued to the V4L2 output queue, and the frames returned by the frame pool while
+    // their buffer still holds a reference picture, indexed by V4L2 buffer id.
+    std::vector<std::unique_ptr<VideoFrame>> mFrameAtDevice;
+    std::vector<std::unique_ptr<VideoFrame>> mParkedFrames;
+
+    // Block IDs can be arbitrarily large, but we only have a limited number of
+    // buffers. This maintains an association between a block ID and a specific
+    // V4L2 buffer index.
+    FlatIdMap<size_t> mBlockIdToV4L2Id;
+
+    State mState = State::Idle;
+
+    scoped_refptr<::base::SequencedTaskRunner> mTaskRunner;
+
+    ::base::WeakPtr<V4L2StatelessDecoder> mWeakThis;
+    ::base::WeakPtrFactory<V4L2StatelessDecoder> mWeakThisFactory{this};
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMPONENTS_V4L2_STATELESS_DECODER_H
@@ -0,0 +1,56 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMPONENTS_VENDOR_TUNNEL_LOADER_H
+#define ANDROID_V4L2_CODEC2_COMPONENTS_VENDOR_TUNNEL_LOADER_H
+
+#include <stdint.h>
+
+#include <memory>
+
+#include <C2Buffer.h>
+#include <cutils/native_handle.h>
+
+namespace android {
+
+// A sideband stream to the display hardware, used for tunneled playback. The decoded frames are
+// handed over to the display without going through the client.
+class VendorTunnel {
+public:
+    virtual ~VendorTunnel() = default;
+
+    // Get the sideband handle the client sets on its surface. The handle must only contain ints,
+    // as it's passed to the client as the C2PortTunnelHandleTuning parameter.
+    virtual const native_handle_t* getSidebandHandle() const = 0;
+    // Display |block| at |timestampUs|, following the A/V sync configured at creation. The block
+    // is kept until the display doesn't read it anymore, and then destroyed from any thread.
+    virtual bool queueFrame(C2ConstGraphicBlock block, int64_t timestampUs) = 0;
+    // Drop all the queued frames which are not displayed yet.
+    virtual void flush() = 0;
+};
+
+// This class is for loading the vendor-specific VendorTunnel implementations.
+// The vendor should implement the shared library "libv4l2_codec2_vendor_tunnel.so"
+// and expose the function "VendorTunnel* CreateTunnel(uint32_t syncType, int32_t syncId);",
+// where |syncType| and |syncId| are the ones of C2PortTunneledModeTuning.
+class VendorTunnelLoader {
+public:
+    using CreateTunnelFunc = VendorTunnel* (*)(uint32_t /* syncType */, int32_t /* syncId */);
+
+    static std::unique_ptr<VendorTunnelLoader> Create();
+    ~VendorTunnelLoader();
+
+    // Delegate to the vendor's shared library. Returns nullptr if the tunnel can't be created.
+    std::unique_ptr<VendorTunnel> createTunnel(uint32_t syncType, int32_t syncId);
+
+private:
+    VendorTunnelLoader(void* libHandle, CreateTunnelFunc createTunnelFunc);
+
+    void* mLibHandle;
+    CreateTunnelFunc mCreateTunnelFunc;
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMPONENTS_VENDOR_TUNNEL_LOADER_H
@@ -5,6 +5,7 @@
 #ifndef ANDROID_V4L2_CODEC2_COMPONENTS_VIDEO_DECODER_H
 #define ANDROID_V4L2_CODEC2_COMPONENTS_VIDEO_DECODER_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <memory>
 
@@ -26,8 +27,11 @@ public:
     };
     static const char* DecodeStatusToString(DecodeStatus status);
 
+    // |usage| is the vendor gralloc usage of the compressed and tiled output formats, 0 for linear
+    // output. The callback returns nullptr if the output buffers can't be allocated with |usage|.
     using GetPoolCB = ::base::RepeatingCallback<std::unique_ptr<VideoFramePool>(
-            const ui::Size& size, HalPixelFormat pixelFormat, size_t numOutputBuffers)>;
+            const ui::Size& size, HalPixelFormat pixelFormat, uint64_t usage,
+            size_t numOutputBuffers)>;
     using DecodeCB = ::base::OnceCallback<void(DecodeStatus)>;
     using OutputCB = ::base::RepeatingCallback<void(std::unique_ptr<VideoFrame>)>;
     using ErrorCB = ::base::RepeatingCallback<void()>;
@@ -37,6 +41,14 @@ public:
     virtual void decode(std::unique_ptr<ConstBitstreamBuffer> buffer, DecodeCB decodeCb) = 0;
     virtual void drain(DecodeCB drainCb) = 0;
     virtual void flush() = 0;
+
+    // Hint that the stream headers announce frames of |codedSize| with up to |maxDpbFrames|
+    // reference frames, so the decoder can allocate its output buffers before it parses the stream
+    // itself. The decoder still follows the stream if it turns out differently.
+    virtual void prepareOutputBuffers(const ui::Size& /*codedSize*/, size_t /*maxDpbFrames*/) {}
+
+    // Get the memory allocated by the decoder's V4L2 queues, in bytes.
+    virtual size_t getMemoryUsage() const { return 0; }
 };
 
 }  // namespace android
@@ -5,11 +5,13 @@
 #ifndef ANDROID_V4L2_CODEC2_COMPONENTS_VIDEO_ENCODER_H
 #define ANDROID_V4L2_CODEC2_COMPONENTS_VIDEO_ENCODER_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <memory>
 #include <vector>
 
 #include <base/callback.h>
+#include <base/time/time.h>
 #include <ui/Size.h>
 
 #include <v4l2_codec2/common/Common.h>
@@ -28,28 +30,41 @@ public:
     //       is returned by an InputBufferDoneCB() call.
     class InputFrame {
     public:
-        InputFrame(std::vector<int>&& fds, std::vector<VideoFramePlane>&& planes,
+        InputFrame(const VideoFrameFds& fds, const VideoFramePlanes& planes,
                    VideoPixelFormat pixelFormat, uint64_t index, int64_t timestamp);
         ~InputFrame() = default;
 
-        const std::vector<int>& fds() const { return mFds; }
-        const std::vector<VideoFramePlane>& planes() const { return mPlanes; }
+        const VideoFrameFds& fds() const { return mFds; }
+        const VideoFramePlanes& planes() const { return mPlanes; }
         VideoPixelFormat pixelFormat() const { return mPixelFormat; }
         uint64_t index() const { return mIndex; }
         int64_t timestamp() const { return mTimestamp; }
 
     private:
-        const std::vector<int> mFds;
-        std::vector<VideoFramePlane> mPlanes;
+        const VideoFrameFds mFds;
+        VideoFramePlanes mPlanes;
         VideoPixelFormat mPixelFormat;
         uint64_t mIndex = 0;
         int64_t mTimestamp = 0;
     };
 
+    // A region of the input frames, whose QP is offset by |qpDelta| from the one picked by the rate
+    // control.
+    struct RegionOfInterest {
+        Rect rect;
+        int32_t qpDelta = 0;
+
+        bool operator==(const RegionOfInterest& other) const {
+            return rect == other.rect && qpDelta == other.qpDelta;
+        }
+    };
+
     using FetchOutputBufferCB =
             ::base::RepeatingCallback<void(uint32_t, std::unique_ptr<BitstreamBuffer>* buffer)>;
     // TODO(dstaessens): Change callbacks to OnceCallback provided when requesting encode/drain.
     using InputBufferDoneCB = ::base::RepeatingCallback<void(uint64_t)>;
+    // Called with the size, timestamp and key frame flag of each encoded frame. A frame dropped by
+    // the encoder, e.g. because it was truncated, is reported with a size of 0.
     using OutputBufferDoneCB = ::base::RepeatingCallback<void(
             size_t, int64_t, bool, std::unique_ptr<BitstreamBuffer> buffer)>;
     using DrainDoneCB = ::base::RepeatingCallback<void(bool)>;
@@ -74,10 +89,27 @@ public:
     virtual bool setFramerate(uint32_t framerate) = 0;
     // Request the next frame encoded to be a key frame, will affect the next non-processed frame.
     virtual void requestKeyframe() = 0;
+    // Set the regions of interest, replacing the previous ones. Will affect all non-processed
+    // frames. Returns false if the encoder doesn't support regions of interest.
+    virtual bool setRegionsOfInterest(std::vector<RegionOfInterest> /*regions*/) { return false; }
+
+    // Check whether the encoder can directly import input frames in the specified |format|.
+    virtual bool isInputFormatSupported(VideoPixelFormat format) const = 0;
+    // Check whether input frames with the plane layout |planes| can be passed to the device as-is,
+    // i.e. the device reads them with the strides and plane offsets it is configured for.
+    virtual bool isInputLayoutSupported(const VideoFramePlanes& planes) const = 0;
 
     virtual VideoPixelFormat inputFormat() const = 0;
     virtual const ui::Size& visibleSize() const = 0;
     virtual const ui::Size& codedSize() const = 0;
+    // Get the number of input frames currently allowed in flight on the device, which might grow
+    // while encoding if the queue depth is adaptive.
+    virtual size_t queueDepth() const = 0;
+
+    // Get the memory allocated by the encoder's V4L2 queues, in bytes.
+    virtual size_t getMemoryUsage() const { return 0; }
+    // Get the total time the encoder waited for the device to return input buffers so far.
+    virtual ::base::TimeDelta getBufferWaitTime() const { return ::base::TimeDelta(); }
 };
 
 }  // namespace android
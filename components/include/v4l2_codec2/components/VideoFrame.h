@@ -12,6 +12,8 @@
 
 #include <ui/Rect.h>
 
+#include <v4l2_codec2/common/Common.h>
+
 namespace android {
 
 // Wrap C2GraphicBlock and provide essential information from C2GraphicBlock.
@@ -22,7 +24,7 @@ public:
     ~VideoFrame();
 
     // Return the file descriptors of the corresponding buffer.
-    const std::vector<int>& getFDs() const;
+    const VideoFrameFds& getFDs() const;
 
     // Getter and setter of the visible rectangle.
     void setVisibleRect(const Rect& visibleRect);
@@ -36,10 +38,10 @@ public:
     C2ConstGraphicBlock getGraphicBlock();
 
 private:
-    VideoFrame(std::shared_ptr<C2GraphicBlock> block, std::vector<int> fds);
+    VideoFrame(std::shared_ptr<C2GraphicBlock> block, const VideoFrameFds& fds);
 
     std::shared_ptr<C2GraphicBlock> mGraphicBlock;
-    std::vector<int> mFds;
+    VideoFrameFds mFds;
     Rect mVisibleRect;
     int32_t mBitstreamId = -1;
 };
@@ -6,18 +6,22 @@
 #define ANDROID_V4L2_CODEC2_COMPONENTS_VIDEO_FRAME_POOL_H
 
 #include <atomic>
+#include <map>
 #include <memory>
 #include <optional>
 #include <queue>
+#include <tuple>
+#include <vector>
 
 #include <C2Buffer.h>
 #include <base/callback.h>
 #include <base/memory/weak_ptr.h>
 #include <base/sequenced_task_runner.h>
-#include <base/threading/thread.h>
+#include <base/synchronization/waitable_event.h>
 #include <ui/Size.h>
 
 #include <v4l2_codec2/common/VideoTypes.h>
+#include <v4l2_codec2/components/ComponentStats.h>
 #include <v4l2_codec2/components/VideoFrame.h>
 
 namespace android {
@@ -30,9 +34,11 @@ public:
     using FrameWithBlockId = std::pair<std::unique_ptr<VideoFrame>, uint32_t>;
     using GetVideoFrameCB = ::base::OnceCallback<void(std::optional<FrameWithBlockId>)>;
 
+    // |extraUsage| holds the vendor usage bits of the compressed and tiled formats. Returns nullptr
+    // if they are requested while the consumer reads the buffers with the CPU.
     static std::unique_ptr<VideoFramePool> Create(
             std::shared_ptr<C2BlockPool> blockPool, const size_t numBuffers, const ui::Size& size,
-            HalPixelFormat pixelFormat, bool isSecure,
+            HalPixelFormat pixelFormat, uint64_t extraUsage, bool isSecure,
             scoped_refptr<::base::SequencedTaskRunner> taskRunner);
     ~VideoFramePool();
 
@@ -42,6 +48,16 @@ public:
     // be dropped directly.
     bool getVideoFrame(GetVideoFrameCB cb);
 
+    // Keep up to |count| frames fetched ahead of time, which can be taken without waiting with
+    // takePrefetchedFrame() or are passed to the next getVideoFrame() callback. 0 (default)
+    // disables prefetching, frames are then only fetched on getVideoFrame().
+    void setPrefetchCount(size_t count);
+    // Take a frame fetched ahead of time, returns nullopt if no frame is ready yet.
+    std::optional<FrameWithBlockId> takePrefetchedFrame();
+    // Record the fetches retried because the block pool had no free block into |stats|. Must be
+    // called before the first getVideoFrame().
+    void setStats(std::shared_ptr<ComponentStats> stats) { mStats = std::move(stats); }
+
 private:
     // |blockPool| is the C2BlockPool that we fetch graphic blocks from.
     // |maxBufferCount| maximum number of buffer that should should provide to client
@@ -53,18 +69,27 @@ private:
                    const ui::Size& size, HalPixelFormat pixelFormat, C2MemoryUsage memoryUsage,
                    scoped_refptr<::base::SequencedTaskRunner> taskRunner);
     bool initialize();
-    void destroyTask();
+    void destroyTask(::base::WaitableEvent* done);
 
     static void getVideoFrameTaskThunk(scoped_refptr<::base::SequencedTaskRunner> taskRunner,
                                        std::optional<::base::WeakPtr<VideoFramePool>> weakPool);
     void getVideoFrameTask();
     void onVideoFrameReady(std::optional<FrameWithBlockId> frameWithBlockId);
 
+    // Post fetch tasks until the pending fetches and the ready frames cover the pending
+    // getVideoFrame() callback and the prefetch count.
+    void scheduleFetches();
+    // Pass the next ready frame, or the fetch failure, to the pending getVideoFrame() callback.
+    void deliverFrame();
+
     // Returns true if a buffer shall not be handed to client.
     bool shouldDropBuffer(uint32_t bufferId);
 
     static std::optional<uint32_t> getBufferIdFromGraphicBlock(C2BlockPool& blockPool,
                                                                const C2Block2D& block);
+    // Same as above, but the ids of the BufferQueue-backed blocks are looked up in
+    // |mBufferIdCache| first, which avoids an fstat() on the dma-buf of each fetched block.
+    std::optional<uint32_t> getCachedBufferIdFromGraphicBlock(const C2Block2D& block);
 
     std::shared_ptr<C2BlockPool> mBlockPool;
 
@@ -80,9 +105,40 @@ private:
 
     GetVideoFrameCB mOutputCb;
 
+    // The number of frames to fetch ahead of time.
+    size_t mPrefetchCount = 0;
+    // The number of fetch tasks posted to the fetch thread whose frame hasn't been received yet.
+    size_t mNumPendingFetches = 0;
+    // The fetched frames not passed to the client yet.
+    std::queue<FrameWithBlockId> mReadyFrames;
+    // Set when fetching a frame failed, the failure is passed to the next getVideoFrame() callback
+    // once all the ready frames are taken.
+    bool mFetchFailed = false;
+
+    // The state of the exponential backoff used when the block pool doesn't provide a fence to
+    // wait for a block to be released, only accessed on the fetch thread.
+    size_t mFetchRetries = 0;
+    size_t mFetchRetryDelay;
+
+    // The buffer ids of the BufferQueue-backed blocks, indexed by the (generation, BufferQueue id,
+    // slot) the blocks are fetched from. Each fetch returns a new handle with newly duplicated
+    // fds, so an entry is only used while the ints of the fetched handle match the ones of the
+    // cached allocation. Only accessed on the fetch thread.
+    using BufferQueueSlot = std::tuple<uint32_t, uint64_t, int32_t>;
+    struct CachedBufferId {
+        uint32_t bufferId;
+        std::vector<int> allocationInts;
+    };
+    std::map<BufferQueueSlot, CachedBufferId> mBufferIdCache;
+    size_t mNumBufferIdCacheHits = 0;
+    size_t mNumBufferIdCacheMisses = 0;
+
+    std::shared_ptr<ComponentStats> mStats;
+
     scoped_refptr<::base::SequencedTaskRunner> mClientTaskRunner;
-    ::base::Thread mFetchThread{"VideoFramePoolFetchThread"};
+    // The task runner of the fetch thread, which is shared with other pools of the process.
     scoped_refptr<::base::SequencedTaskRunner> mFetchTaskRunner;
+    size_t mFetchThreadIndex = 0;
 
     ::base::WeakPtr<VideoFramePool> mClientWeakThis;
     ::base::WeakPtr<VideoFramePool> mFetchWeakThis;
@@ -0,0 +1,64 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMPONENTS_WORK_DONE_BATCHER_H
+#define ANDROID_V4L2_CODEC2_COMPONENTS_WORK_DONE_BATCHER_H
+
+#include <stdint.h>
+
+#include <list>
+#include <memory>
+
+#include <C2Work.h>
+#include <base/callback.h>
+#include <base/memory/weak_ptr.h>
+#include <base/sequenced_task_runner.h>
+#include <base/time/time.h>
+
+namespace android {
+
+// Coalesces the works finished by a component into a single onWorkDone_nb() call, as each call
+// is a separate IPC transaction to the client. Finished works are collected until the end of the
+// current task on |taskRunner|, after which they are all reported at once. An optional latency
+// cap reports the batch early when the oldest work has been held back for too long.
+//
+// All methods must be called on |taskRunner|.
+class WorkDoneBatcher {
+public:
+    using ReportWorksCB = ::base::RepeatingCallback<void(std::list<std::unique_ptr<C2Work>>)>;
+
+    // Create a batcher reporting the batched works through |reportWorksCb|. The latency cap is
+    // read from the ro.vendor.v4l2_codec2.work_done_max_latency_us property, 0 disables it.
+    WorkDoneBatcher(scoped_refptr<::base::SequencedTaskRunner> taskRunner,
+                    ReportWorksCB reportWorksCb);
+    // Pending works are reported when the batcher is destroyed.
+    ~WorkDoneBatcher();
+
+    // Add a finished |work| to the current batch.
+    void add(std::unique_ptr<C2Work> work);
+    // Report the current batch immediately. Must be called before reporting works or errors
+    // directly to the client, so the client observes them in order.
+    void flush();
+
+private:
+    // Report the current batch, posted once at the end of the task the batch was started in.
+    void flushTask();
+
+    scoped_refptr<::base::SequencedTaskRunner> mTaskRunner;
+    ReportWorksCB mReportWorksCb;
+    // The maximum time a work is held back in a batch, 0 if unbounded.
+    const int64_t mMaxLatencyUs;
+
+    // The works of the current batch, and the time the first one was added.
+    std::list<std::unique_ptr<C2Work>> mWorks;
+    ::base::TimeTicks mBatchStart;
+    // Whether flushTask() is already scheduled.
+    bool mFlushPending = false;
+
+    ::base::WeakPtrFactory<WorkDoneBatcher> mWeakThisFactory{this};
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMPONENTS_WORK_DONE_BATCHER_H
@@ -0,0 +1,86 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMPONENTS_WORK_REPORTER_H
+#define ANDROID_V4L2_CODEC2_COMPONENTS_WORK_REPORTER_H
+
+#include <atomic>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+
+#include <C2Component.h>
+#include <C2Work.h>
+#include <base/synchronization/waitable_event.h>
+#include <base/threading/thread.h>
+
+#include <v4l2_codec2/common/SPSCRing.h>
+
+namespace android {
+
+// Delivers the finished works and the errors of a component to its listener on a dedicated
+// thread, so a client slow to handle the callbacks doesn't hold up the codec thread, which keeps
+// feeding the device in the meantime. The reports are handed over through a lock-free ring and
+// delivered in the order they were made, each to the listener it was made for.
+//
+// The reports must all be made from the same sequence, usually the codec thread of the component.
+class WorkReporter {
+public:
+    // Create a reporter delivering the reports on a thread named |threadName|. The reports are
+    // delivered on the reporting sequence directly if the thread can't be started.
+    explicit WorkReporter(const char* threadName);
+    // Delivers the pending reports before returning, so none is delivered after the component
+    // is stopped.
+    ~WorkReporter();
+    WorkReporter(const WorkReporter&) = delete;
+    WorkReporter& operator=(const WorkReporter&) = delete;
+
+    // Report the finished |works| of |component| to |listener|.
+    void reportWorks(std::shared_ptr<C2Component::Listener> listener,
+                     std::weak_ptr<C2Component> component,
+                     std::list<std::unique_ptr<C2Work>> works);
+    // Report the |error| of |component| to |listener|, after the works reported before.
+    void reportError(std::shared_ptr<C2Component::Listener> listener,
+                     std::weak_ptr<C2Component> component, c2_status_t error);
+    // Deliver the reports made so far before returning, e.g. so the works finished before a flush
+    // reach the listener before the flush returns.
+    void flush();
+
+private:
+    // A call to the listener, reporting |works| or |error| if it isn't C2_OK.
+    struct Report {
+        std::shared_ptr<C2Component::Listener> mListener;
+        std::weak_ptr<C2Component> mComponent;
+        std::list<std::unique_ptr<C2Work>> mWorks;
+        c2_status_t mError = C2_OK;
+    };
+
+    // Hand |report| over to the reporting thread.
+    void push(Report report);
+    // Deliver the reports handed over so far, on the reporting thread.
+    void deliverTask();
+    // Deliver the reports handed over so far on the reporting thread, then signal |done|.
+    void flushTask(::base::WaitableEvent* done);
+    // Deliver the reports handed over so far, on the calling thread.
+    void deliverReports();
+    static void deliver(Report report);
+
+    // The reports not delivered yet. The reporting sequence pushes the reports into the ring and
+    // only posts deliverTask() when no wakeup is pending (|mWakeupPending|), so a burst of reports
+    // is delivered by a single task. The reports overflow into |mOverflowReports|, guarded by
+    // |mOverflowLock|, while the ring is full, e.g. when the client is stalled.
+    static constexpr size_t kReportsCapacity = 64;
+    SPSCRing<Report> mReports{kReportsCapacity};
+    std::mutex mOverflowLock;
+    std::deque<Report> mOverflowReports;
+    std::atomic<bool> mHasOverflowReports{false};
+    std::atomic<bool> mWakeupPending{false};
+
+    ::base::Thread mThread;
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMPONENTS_WORK_REPORTER_H
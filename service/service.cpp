@@ -5,6 +5,8 @@
 //#define LOG_NDEBUG 0
 #define LOG_TAG "android.hardware.media.c2@1.0-service-v4l2"
 
+#include <stdio.h>
+
 #include <C2Component.h>
 #include <base/logging.h>
 #include <codec2/hidl/1.2/ComponentStore.h>
@@ -12,6 +14,17 @@
 #include <log/log.h>
 #include <minijail.h>
 
+#ifdef V4L2_CODEC2_AIDL_SERVICE
+#include <android/binder_manager.h>
+#include <android/binder_process.h>
+#include <codec2/aidl/ComponentStore.h>
+#include <codec2/common/HalSelection.h>
+#endif
+
+#include <v4l2_codec2/common/V4L2Device.h>
+#include <v4l2_codec2/common/V4L2IoctlProfiler.h>
+#include <v4l2_codec2/common/V4L2ResourceManager.h>
+#include <v4l2_codec2/components/ComponentStats.h>
 #include <v4l2_codec2/components/V4L2ComponentStore.h>
 
 // This is the absolute on-device path of the prebuild_etc module
@@ -26,28 +39,109 @@ static constexpr char kExtSeccompPolicyPath[] =
         "/vendor/etc/seccomp_policy/"
         "android.hardware.media.c2-extended-seccomp_policy";
 
+namespace {
+
+using namespace ::android::hardware::media::c2::V1_2;
+using ::android::hardware::hidl_handle;
+using ::android::hardware::hidl_string;
+using ::android::hardware::hidl_vec;
+using ::android::hardware::Return;
+
+// The runtime statistics of the live components, appended to the debug dump of the store.
+std::string dumpV4L2State() {
+    return android::ComponentStats::DumpAll() + android::V4L2IoctlProfiler::dump() +
+           android::V4L2ResourceManager::get()->dump();
+}
+
+// Append the runtime statistics of the live components to the debug dump of the store, e.g.
+// "lshal debug android.hardware.media.c2@1.2::IComponentStore/default".
+class V4L2ComponentStoreService : public utils::ComponentStore {
+public:
+    explicit V4L2ComponentStoreService(const std::shared_ptr<C2ComponentStore>& store)
+          : utils::ComponentStore(store) {}
+
+    Return<void> debug(const hidl_handle& handle, const hidl_vec<hidl_string>& args) override {
+        Return<void> ret = utils::ComponentStore::debug(handle, args);
+        if (handle == nullptr || handle->numFds < 1) return ret;
+
+        dprintf(handle->data[0], "%s", dumpV4L2State().c_str());
+        return ret;
+    }
+};
+
+#ifdef V4L2_CODEC2_AIDL_SERVICE
+namespace aidl_c2 = ::aidl::android::hardware::media::c2;
+
+// The number of threads of the binder thread pool of the AIDL service.
+constexpr uint32_t kNumAidlThreads = 8;
+
+// Same as V4L2ComponentStoreService for the AIDL store, e.g.
+// "dumpsys android.hardware.media.c2.IComponentStore/default".
+class V4L2AidlComponentStoreService : public aidl_c2::utils::ComponentStore {
+public:
+    explicit V4L2AidlComponentStoreService(const std::shared_ptr<C2ComponentStore>& store)
+          : aidl_c2::utils::ComponentStore(store) {}
+
+    binder_status_t dump(int fd, const char** args, uint32_t numArgs) override {
+        binder_status_t status = aidl_c2::utils::ComponentStore::dump(fd, args, numArgs);
+        dprintf(fd, "%s", dumpV4L2State().c_str());
+        return status;
+    }
+};
+
+// Register the AIDL IComponentStore service and serve it. Only returns on failure.
+void runAidlService() {
+    ALOGD("Instantiating Codec2's V4L2 AIDL IComponentStore service...");
+    ABinderProcess_setThreadPoolMaxThreadCount(kNumAidlThreads);
+    ABinderProcess_startThreadPool();
+
+    std::shared_ptr<aidl_c2::IComponentStore> store =
+            ::ndk::SharedRefBase::make<V4L2AidlComponentStoreService>(
+                    android::V4L2ComponentStore::Create());
+    const std::string instance = std::string(aidl_c2::IComponentStore::descriptor) + "/default";
+    if (AServiceManager_addService(store->asBinder().get(), instance.c_str()) != STATUS_OK) {
+        ALOGE("Cannot register Codec2's AIDL IComponentStore service.");
+        return;
+    }
+    ALOGI("Codec2's AIDL IComponentStore service created.");
+    ABinderProcess_joinThreadPool();
+}
+#endif
+
+}  // namespace
+
 int main(int /* argc */, char** /* argv */) {
     ALOGD("Service starting...");
 
     signal(SIGPIPE, SIG_IGN);
     android::SetUpMinijail(kBaseSeccompPolicyPath, kExtSeccompPolicyPath);
 
-    // Extra threads may be needed to handle a stacked IPC sequence that
-    // contains alternating binder and hwbinder calls. (See b/35283480.)
-    android::hardware::configureRpcThreadpool(8, true /* callerWillJoin */);
-
 #if LOG_NDEBUG == 0
     ALOGD("Enable all verbose logging of libchrome");
     logging::SetMinLogLevel(-5);
 #endif
 
+    // Enumerate the V4L2 devices once, so components created later don't need to probe them.
+    android::V4L2Device::preloadDeviceCache();
+
+#ifdef V4L2_CODEC2_AIDL_SERVICE
+    // Serve the AIDL HAL when the platform selects it, the HIDL HAL otherwise.
+    if (android::IsCodec2AidlHalSelected()) {
+        runAidlService();
+        ALOGD("Service shutdown.");
+        return 1;
+    }
+#endif
+
+    // Extra threads may be needed to handle a stacked IPC sequence that
+    // contains alternating binder and hwbinder calls. (See b/35283480.)
+    android::hardware::configureRpcThreadpool(8, true /* callerWillJoin */);
+
     // Create IComponentStore service.
     {
-        using namespace ::android::hardware::media::c2::V1_2;
-
         ALOGD("Instantiating Codec2's V4L2 IComponentStore service...");
         android::sp<IComponentStore> store(
-                new utils::ComponentStore(android::V4L2ComponentStore::Create()));
+                new V4L2ComponentStoreService(android::V4L2ComponentStore::Create()));
         if (store == nullptr) {
             ALOGE("Cannot create Codec2's V4L2 IComponentStore service.");
         } else if (store->registerAsService("default") != android::OK) {
@@ -0,0 +1,92 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "BenchmarkHelpers.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+
+#include <base/bind.h>
+
+#include <v4l2_codec2/common/Percentile.h>
+
+namespace android {
+
+bool fillGradient(C2GraphicBlock* block) {
+    C2GraphicView view = block->map().get();
+    if (view.error() != C2_OK) return false;
+
+    const C2PlanarLayout& layout = view.layout();
+    for (uint32_t p = 0; p < layout.numPlanes; p++) {
+        const C2PlaneInfo& plane = layout.planes[p];
+        uint8_t* const data = view.data()[p];
+        for (uint32_t y = 0; y < view.height() / plane.rowSampling; y++) {
+            for (uint32_t x = 0; x < view.width() / plane.colSampling; x++) {
+                data[y * plane.rowInc + x * plane.colInc] = static_cast<uint8_t>(x + y + p * 64);
+            }
+        }
+    }
+    return true;
+}
+
+::base::TimeDelta getProcessCpuTime() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    const int64_t cpuTimeUs = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+                              usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+    return ::base::TimeDelta::FromMicroseconds(cpuTimeUs);
+}
+
+BenchmarkSession::BenchmarkSession(const std::string& threadName) : mThread(threadName) {}
+
+BenchmarkSession::~BenchmarkSession() = default;
+
+bool BenchmarkSession::start() {
+    if (!mThread.Start()) return false;
+    mTaskRunner = mThread.task_runner();
+    mTaskRunner->PostTask(FROM_HERE, ::base::BindOnce(&BenchmarkSession::startTask,
+                                                      ::base::Unretained(this)));
+    return true;
+}
+
+bool BenchmarkSession::wait() {
+    mDone.Wait();
+    mThread.Stop();
+    return mSucceeded;
+}
+
+void BenchmarkSession::finish(bool succeeded) {
+    if (mFinishing) return;
+    mFinishing = true;
+    if (mEndTime.is_null()) mEndTime = ::base::TimeTicks::Now();
+    mSucceeded = succeeded;
+    mTaskRunner->PostTask(FROM_HERE, ::base::BindOnce(&BenchmarkSession::doneTask,
+                                                      ::base::Unretained(this)));
+}
+
+void BenchmarkSession::doneTask() {
+    releaseTask();
+    mDone.Signal();
+}
+
+void printTotals(size_t numSessions, std::vector<int64_t> allLatenciesUs,
+                 const BenchmarkTimes& times) {
+    std::sort(allLatenciesUs.begin(), allLatenciesUs.end());
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("total: %zu sessions, %zu frames, %.2f fps, latency p50 %" PRId64 " us, p90 %" PRId64
+           " us, p99 %" PRId64 " us\n",
+           numSessions, allLatenciesUs.size(), allLatenciesUs.size() / times.duration.InSecondsF(),
+           getPercentile(allLatenciesUs, 50), getPercentile(allLatenciesUs, 90),
+           getPercentile(allLatenciesUs, 99));
+    printf("CPU time: %" PRId64 " ms (%.1f%% of one core), peak RSS: %ld KB\n",
+           times.cpuTime.InMilliseconds(),
+           100.0 * times.cpuTime.InSecondsF() / times.duration.InSecondsF(), usage.ru_maxrss);
+}
+
+}  // namespace android
@@ -0,0 +1,94 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_TESTS_BENCHMARKS_BENCHMARK_HELPERS_H
+#define ANDROID_V4L2_CODEC2_TESTS_BENCHMARKS_BENCHMARK_HELPERS_H
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <C2Buffer.h>
+#include <base/sequenced_task_runner.h>
+#include <base/synchronization/waitable_event.h>
+#include <base/threading/thread.h>
+#include <base/time/time.h>
+
+namespace android {
+
+// Fill all the planes of |block| with a gradient, so the codecs have some content to process.
+bool fillGradient(C2GraphicBlock* block);
+
+// Get the CPU time consumed by the whole process so far.
+::base::TimeDelta getProcessCpuTime();
+
+// A benchmark session, e.g. a decoder or an encoder processing a stream, running on its own thread.
+class BenchmarkSession {
+public:
+    explicit BenchmarkSession(const std::string& threadName);
+    virtual ~BenchmarkSession();
+
+    bool start();
+    // Wait until the session is done, returns false if it failed.
+    bool wait();
+
+    size_t numFrames() const { return mLatenciesUs.size(); }
+    ::base::TimeDelta duration() const { return mEndTime - mStartTime; }
+    // The time between the submission of each frame and its output, in microseconds.
+    const std::vector<int64_t>& latenciesUs() const { return mLatenciesUs; }
+
+protected:
+    // Start processing the stream, called on the session thread.
+    virtual void startTask() = 0;
+    // Destroy the codec once the session finished, called on the session thread.
+    virtual void releaseTask() = 0;
+
+    // Finish the session. The codec might still be running the callback which finished the
+    // session, so it's destroyed in a separate task.
+    void finish(bool succeeded);
+
+    scoped_refptr<::base::SequencedTaskRunner> mTaskRunner;
+    bool mFinishing = false;
+
+    std::vector<int64_t> mLatenciesUs;
+    ::base::TimeTicks mStartTime;
+    ::base::TimeTicks mEndTime;
+
+private:
+    void doneTask();
+
+    ::base::Thread mThread;
+    ::base::WaitableEvent mDone;
+    bool mSucceeded = false;
+};
+
+// The wall-clock and CPU time all the sessions of a benchmark ran for.
+struct BenchmarkTimes {
+    ::base::TimeDelta duration;
+    ::base::TimeDelta cpuTime;
+};
+
+// Run all the |sessions| in parallel until they're done. Returns false if any of them failed.
+template <typename Session>
+bool runSessions(const std::vector<std::unique_ptr<Session>>& sessions, BenchmarkTimes* times) {
+    const ::base::TimeDelta startCpuTime = getProcessCpuTime();
+    const ::base::TimeTicks startTime = ::base::TimeTicks::Now();
+    bool succeeded = true;
+    for (auto& session : sessions) succeeded &= session->start();
+    for (auto& session : sessions) succeeded &= session->wait();
+    times->duration = ::base::TimeTicks::Now() - startTime;
+    times->cpuTime = getProcessCpuTime() - startCpuTime;
+    return succeeded;
+}
+
+// Print the throughput and latency distribution of all the |numSessions| sessions together, whose
+// frame latencies are |allLatenciesUs|, and the CPU time and peak memory usage of the process.
+void printTotals(size_t numSessions, std::vector<int64_t> allLatenciesUs,
+                 const BenchmarkTimes& times);
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_TESTS_BENCHMARKS_BENCHMARK_HELPERS_H
@@ -0,0 +1,223 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <v4l2_codec2/common/EncodeHelpers.h>
+#include <v4l2_codec2/common/NalParser.h>
+
+namespace android {
+namespace {
+
+constexpr uint8_t kStartCode[] = {0x00, 0x00, 0x00, 0x01};
+// The number of frames in the group of pictures of the benchmarked streams.
+constexpr size_t kGopSize = 30;
+
+// Minimal big-endian bit writer, used to generate a valid SPS.
+class BitWriter {
+public:
+    void putBits(uint32_t value, size_t numBits) {
+        while (numBits-- > 0) {
+            if (mNumBits % 8 == 0) mData.push_back(0);
+            mData.back() |= ((value >> numBits) & 1) << (7 - mNumBits % 8);
+            mNumBits++;
+        }
+    }
+
+    // Write |value| as an unsigned Exp-Golomb code.
+    void putUE(uint32_t value) {
+        const uint64_t codeNum = static_cast<uint64_t>(value) + 1;
+        size_t numBits = 0;
+        while ((codeNum >> numBits) > 1) numBits++;
+        putBits(0, numBits);
+        putBits(static_cast<uint32_t>(codeNum), numBits + 1);
+    }
+
+    // Write the RBSP stop bit and the alignment bits.
+    std::vector<uint8_t> finish() {
+        putBits(1, 1);
+        return mData;
+    }
+
+private:
+    std::vector<uint8_t> mData;
+    size_t mNumBits = 0;
+};
+
+// A High profile, level 4.0 SPS of a 1920x1080 stream, signaling BT.709 color aspects.
+std::vector<uint8_t> createSPS() {
+    BitWriter bw;
+    bw.putBits(NalParser::kSPSType | 0x60, 8);  // forbidden_zero_bit, nal_ref_idc, nal_unit_type
+    bw.putBits(100, 8);                         // profile_idc
+    bw.putBits(0, 8);                           // constraint flags + reserved bits
+    bw.putBits(40, 8);                          // level_idc
+    bw.putUE(0);                                // seq_parameter_set_id
+    bw.putUE(1);                                // chroma_format_idc
+    bw.putUE(0);                                // bit_depth_luma_minus8
+    bw.putUE(0);                                // bit_depth_chroma_minus8
+    bw.putBits(0, 1);                           // qpprime_y_zero_transform_bypass_flag
+    bw.putBits(0, 1);                           // seq_scaling_matrix_present_flag
+    bw.putUE(0);                                // log2_max_frame_num_minus4
+    bw.putUE(0);                                // pic_order_cnt_type
+    bw.putUE(2);                                // log2_max_pic_order_cnt_lsb_minus4
+    bw.putUE(1);                                // max_num_ref_frames
+    bw.putBits(0, 1);                           // gaps_in_frame_num_value_allowed_flag
+    bw.putUE(119);                              // pic_width_in_mbs_minus1
+    bw.putUE(67);                               // pic_height_in_map_units_minus1
+    bw.putBits(1, 1);                           // frame_mbs_only_flag
+    bw.putBits(1, 1);                           // direct_8x8_inference_flag
+    bw.putBits(1, 1);                           // frame_cropping_flag
+    bw.putUE(0);                                // frame_crop_left_offset
+    bw.putUE(0);                                // frame_crop_right_offset
+    bw.putUE(0);                                // frame_crop_top_offset
+    bw.putUE(4);                                // frame_crop_bottom_offset
+    bw.putBits(1, 1);                           // vui_parameters_present_flag
+    bw.putBits(0, 1);                           // aspect_ratio_info_present_flag
+    bw.putBits(0, 1);                           // overscan_info_present_flag
+    bw.putBits(1, 1);                           // video_signal_type_present_flag
+    bw.putBits(5, 3);                           // video_format
+    bw.putBits(0, 1);                           // video_full_range_flag
+    bw.putBits(1, 1);                           // colour_description_present_flag
+    bw.putBits(1, 8);                           // colour_primaries
+    bw.putBits(1, 8);                           // transfer_characteristics
+    bw.putBits(1, 8);                           // matrix_coefficients
+    return bw.finish();
+}
+
+std::vector<uint8_t> createPPS() {
+    return {NalParser::kPPSType | 0x60, 0xeb, 0xe3, 0xcb, 0x22, 0xc0};
+}
+
+// A slice NAL unit of |size| bytes. The payload is random data without zero bytes, so it doesn't
+// contain any start code like a real stream once the emulation prevention bytes are inserted.
+std::vector<uint8_t> createSlice(uint8_t type, size_t size) {
+    std::vector<uint8_t> slice(size);
+    slice[0] = type | 0x60;
+    uint32_t seed = size;
+    for (size_t i = 1; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        slice[i] = static_cast<uint8_t>((seed >> 16) % 255 + 1);
+    }
+    return slice;
+}
+
+void appendNal(const std::vector<uint8_t>& nal, std::vector<uint8_t>* stream) {
+    stream->insert(stream->end(), std::begin(kStartCode), std::end(kStartCode));
+    stream->insert(stream->end(), nal.begin(), nal.end());
+}
+
+// The average inter frame size is |state.range(0)| bytes, the IDR frames are 8 times larger which
+// is typical of constant bitrate encoding.
+size_t getFrameSize(const benchmark::State& state) {
+    return static_cast<size_t>(state.range(0));
+}
+
+std::vector<uint8_t> createIDRFrame(size_t frameSize, bool withParameterSets) {
+    std::vector<uint8_t> frame;
+    if (withParameterSets) {
+        appendNal(createSPS(), &frame);
+        appendNal(createPPS(), &frame);
+    }
+    appendNal(createSlice(NalParser::kIDRType, frameSize * 8), &frame);
+    return frame;
+}
+
+// A group of pictures made of an IDR frame with its parameter sets followed by inter frames.
+std::vector<uint8_t> createGop(size_t frameSize) {
+    std::vector<uint8_t> stream = createIDRFrame(frameSize, true);
+    for (size_t i = 1; i < kGopSize; i++) {
+        appendNal(createSlice(NalParser::kNonIDRType, frameSize), &stream);
+    }
+    return stream;
+}
+
+void BM_LocateNextNal(benchmark::State& state) {
+    const std::vector<uint8_t> stream = createGop(getFrameSize(state));
+    for (auto _ : state) {
+        NalParser parser(stream.data(), stream.size());
+        size_t numBytes = 0;
+        while (parser.locateNextNal()) numBytes += parser.length();
+        benchmark::DoNotOptimize(numBytes);
+    }
+    state.SetBytesProcessed(state.iterations() * stream.size());
+}
+
+void BM_FindCodedColorAspects(benchmark::State& state) {
+    std::vector<uint8_t> sps;
+    appendNal(createSPS(), &sps);
+    for (auto _ : state) {
+        NalParser parser(sps.data(), sps.size());
+        NalParser::ColorAspects colorAspects;
+        if (!parser.locateSPS() || !parser.findCodedColorAspects(&colorAspects)) {
+            state.SkipWithError("Failed to parse the color aspects");
+            break;
+        }
+        benchmark::DoNotOptimize(colorAspects);
+    }
+}
+
+// |state.range(1)| selects whether scanning stops at the first slice.
+void BM_ExtractSPSPPS(benchmark::State& state) {
+    const std::vector<uint8_t> frame = createIDRFrame(getFrameSize(state), true);
+    const bool stopAtFirstSlice = state.range(1) != 0;
+    std::vector<uint8_t> sps;
+    std::vector<uint8_t> pps;
+    for (auto _ : state) {
+        if (!extractSPSPPS(frame.data(), frame.size(), &sps, &pps, stopAtFirstSlice)) {
+            state.SkipWithError("Failed to extract the SPS and PPS");
+            break;
+        }
+        benchmark::DoNotOptimize(sps.data());
+        benchmark::DoNotOptimize(pps.data());
+    }
+    state.SetBytesProcessed(state.iterations() * frame.size());
+}
+
+// The parameter sets are written into headroom in front of the frame, which leaves the frame itself
+// untouched so the same buffer can be reused on every iteration.
+void BM_InsertSPSPPSBeforeIDR(benchmark::State& state) {
+    const std::vector<uint8_t> frame = createIDRFrame(getFrameSize(state), false);
+    std::vector<uint8_t> sps = createSPS();
+    std::vector<uint8_t> pps = createPPS();
+    const size_t headroom = sps.size() + pps.size() + 2 * sizeof(kStartCode);
+    std::vector<uint8_t> buffer(headroom + frame.size());
+    std::copy(frame.begin(), frame.end(), buffer.begin() + headroom);
+    for (auto _ : state) {
+        size_t offset = headroom;
+        if (insertSPSPPSBeforeIDR(buffer.data(), buffer.size(), &offset, frame.size(), &sps,
+                                  &pps) == 0) {
+            state.SkipWithError("Failed to insert the SPS and PPS");
+            break;
+        }
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * frame.size());
+}
+
+// The average inter frame sizes of 720p at 4Mbps, 1080p at 8Mbps and 2160p at 25Mbps, at 30fps.
+void FrameSizes(benchmark::internal::Benchmark* b) {
+    b->Arg(16 * 1024);
+    b->Arg(32 * 1024);
+    b->Arg(100 * 1024);
+}
+
+void ExtractArgs(benchmark::internal::Benchmark* b) {
+    for (int frameSize : {16 * 1024, 32 * 1024, 100 * 1024}) {
+        b->Args({frameSize, 0});
+        b->Args({frameSize, 1});
+    }
+}
+
+BENCHMARK(BM_LocateNextNal)->Apply(FrameSizes);
+BENCHMARK(BM_FindCodedColorAspects);
+BENCHMARK(BM_ExtractSPSPPS)->Apply(ExtractArgs);
+BENCHMARK(BM_InsertSPSPPSBeforeIDR)->Apply(FrameSizes);
+
+}  // namespace
+}  // namespace android
@@ -0,0 +1,309 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Headless decoder throughput benchmark. Decodes an elementary stream with V4L2Decoder directly,
+// without MediaCodec nor Surface, in one or several parallel sessions, e.g.
+//   v4l2_codec2_decode_benchmark --codec=h264 --sessions=4 /data/local/tmp/bear.h264
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "DecodeBenchmark"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <C2PlatformSupport.h>
+#include <base/bind.h>
+#include <base/time/time.h>
+#include <log/log.h>
+
+#include <v4l2_codec2/common/Percentile.h>
+#include <v4l2_codec2/common/VideoTypes.h>
+#include <v4l2_codec2/components/BitstreamBuffer.h>
+#include <v4l2_codec2/components/V4L2Decoder.h>
+#include <v4l2_codec2/components/V4L2StatelessDecoder.h>
+#include <v4l2_codec2/components/VideoFramePool.h>
+
+#include "BenchmarkHelpers.h"
+#include "encoded_data_helper.h"
+
+namespace android {
+namespace {
+
+// The number of decode() calls kept pending on the decoder, enough to keep the device busy.
+constexpr size_t kMaxPendingDecodes = 8;
+// The number of input and (minimum) output buffers, the defaults of the decode components.
+constexpr size_t kNumInputBuffers = 16;
+constexpr size_t kMinNumOutputBuffers = 12;
+constexpr size_t kMinInputBufferSize = 1024 * 1024;
+const ui::Size kMaxPictureSize(4096, 4096);
+
+struct Options {
+    std::string streamPath;
+    VideoCodec codec = VideoCodec::H264;
+    size_t numSessions = 1;
+    size_t numLoops = 1;
+    bool stateless = false;
+};
+
+VideoCodecType toVideoCodecType(VideoCodec codec) {
+    switch (codec) {
+    case VideoCodec::H264:
+        return VideoCodecType::H264;
+    case VideoCodec::VP8:
+        return VideoCodecType::VP8;
+    case VideoCodec::VP9:
+        return VideoCodecType::VP9;
+    case VideoCodec::HEVC:
+        return VideoCodecType::HEVC;
+    case VideoCodec::AV1:
+        return VideoCodecType::AV1;
+    }
+}
+
+// A decoder decoding the stream |numLoops| times on its own thread.
+class DecodeSession : public BenchmarkSession {
+public:
+    DecodeSession(size_t index, const Options& options)
+          : BenchmarkSession("DecodeSession" + std::to_string(index)),
+            mOptions(options),
+            mStream(options.streamPath, toVideoCodecType(options.codec)) {}
+
+    bool start() {
+        if (!mStream.IsValid()) {
+            ALOGE("Failed to read the stream %s", mOptions.streamPath.c_str());
+            return false;
+        }
+        return BenchmarkSession::start();
+    }
+
+    size_t peakMemoryUsage() const { return mPeakMemoryUsage; }
+
+private:
+    void startTask() override {
+        if (GetCodec2BlockPool(C2BlockPool::BASIC_LINEAR, nullptr, &mInputPool) != C2_OK) {
+            ALOGE("Failed to get the input block pool");
+            finish(false);
+            return;
+        }
+
+        size_t inputBufferSize = kMinInputBufferSize;
+        while (const EncodedDataHelper::Fragment* fragment = mStream.GetNextFragment()) {
+            inputBufferSize = std::max(inputBufferSize, fragment->data.size() * 2);
+        }
+        mStream.Rewind();
+
+        auto getPoolCb = ::base::BindRepeating(&DecodeSession::getVideoFramePool,
+                                               ::base::Unretained(this));
+        auto outputCb =
+                ::base::BindRepeating(&DecodeSession::onOutputFrame, ::base::Unretained(this));
+        auto errorCb = ::base::BindRepeating(&DecodeSession::onError, ::base::Unretained(this));
+        if (mOptions.stateless) {
+            mDecoder = V4L2StatelessDecoder::Create(mOptions.codec, inputBufferSize,
+                                                    kMinNumOutputBuffers, false, getPoolCb,
+                                                    outputCb, errorCb, mTaskRunner);
+        } else {
+            mDecoder = V4L2Decoder::Create(mOptions.codec, inputBufferSize, kNumInputBuffers,
+                                           kMinNumOutputBuffers, kMaxPictureSize, ui::Size(),
+                                           false, getPoolCb, outputCb, errorCb, mTaskRunner);
+        }
+        if (!mDecoder) {
+            ALOGE("Failed to create the decoder for %s", VideoCodecToString(mOptions.codec));
+            finish(false);
+            return;
+        }
+
+        mStartTime = ::base::TimeTicks::Now();
+        pumpDecodes();
+    }
+
+    std::unique_ptr<VideoFramePool> getVideoFramePool(const ui::Size& size,
+                                                      HalPixelFormat pixelFormat, uint64_t usage,
+                                                      size_t numBuffers) {
+        std::shared_ptr<C2BlockPool> blockPool;
+        if (CreateCodec2BlockPool(C2PlatformAllocatorStore::GRALLOC, nullptr, &blockPool) !=
+            C2_OK) {
+            ALOGE("Failed to create the output block pool");
+            return nullptr;
+        }
+        return VideoFramePool::Create(std::move(blockPool), numBuffers, size, pixelFormat, usage,
+                                      false, mTaskRunner);
+    }
+
+    void pumpDecodes() {
+        if (mFinishing) return;
+
+        while (!mDraining && mNumPendingDecodes < kMaxPendingDecodes) {
+            if (mStream.ReachEndOfStream()) {
+                if (++mNumLoopsDone < mOptions.numLoops) {
+                    mStream.Rewind();
+                    continue;
+                }
+                mDraining = true;
+                mDecoder->drain(
+                        ::base::BindOnce(&DecodeSession::onDrainDone, ::base::Unretained(this)));
+                return;
+            }
+
+            const EncodedDataHelper::Fragment* fragment = mStream.GetNextFragment();
+            std::unique_ptr<ConstBitstreamBuffer> buffer = createBuffer(fragment->data);
+            if (!buffer) {
+                finish(false);
+                return;
+            }
+            const int32_t bitstreamId = buffer->id;
+            mDecodeStartTimes[bitstreamId] = ::base::TimeTicks::Now();
+            mNumPendingDecodes++;
+            mDecoder->decode(std::move(buffer), ::base::BindOnce(&DecodeSession::onDecodeDone,
+                                                                 ::base::Unretained(this)));
+        }
+    }
+
+    std::unique_ptr<ConstBitstreamBuffer> createBuffer(const std::string& data) {
+        std::shared_ptr<C2LinearBlock> block;
+        const C2MemoryUsage usage = {C2MemoryUsage::CPU_READ, C2MemoryUsage::CPU_WRITE};
+        if (mInputPool->fetchLinearBlock(data.size(), usage, &block) != C2_OK) {
+            ALOGE("Failed to fetch an input block of %zu bytes", data.size());
+            return nullptr;
+        }
+        C2WriteView view = block->map().get();
+        if (view.error() != C2_OK) {
+            ALOGE("Failed to map the input block");
+            return nullptr;
+        }
+        memcpy(view.data(), data.data(), data.size());
+
+        const int32_t bitstreamId = mNextBitstreamId;
+        mNextBitstreamId = (mNextBitstreamId + 1) & 0x3FFFFFFF;
+        return std::make_unique<ConstBitstreamBuffer>(
+                bitstreamId, block->share(0, data.size(), C2Fence()), 0, data.size());
+    }
+
+    void onDecodeDone(VideoDecoder::DecodeStatus status) {
+        mNumPendingDecodes--;
+        if (status != VideoDecoder::DecodeStatus::kOk) {
+            ALOGE("Failed to decode: %s", VideoDecoder::DecodeStatusToString(status));
+            finish(false);
+            return;
+        }
+        pumpDecodes();
+    }
+
+    void onOutputFrame(std::unique_ptr<VideoFrame> frame) {
+        auto startTime = mDecodeStartTimes.find(frame->getBitstreamId());
+        if (startTime != mDecodeStartTimes.end()) {
+            mLatenciesUs.push_back((::base::TimeTicks::Now() - startTime->second).InMicroseconds());
+            mDecodeStartTimes.erase(startTime);
+        }
+        mPeakMemoryUsage = std::max(mPeakMemoryUsage, mDecoder->getMemoryUsage());
+        // |frame| is destroyed here, which returns its block to the pool right away.
+    }
+
+    void onDrainDone(VideoDecoder::DecodeStatus status) {
+        mEndTime = ::base::TimeTicks::Now();
+        finish(status == VideoDecoder::DecodeStatus::kOk);
+    }
+
+    void onError() {
+        ALOGE("The decoder reported an error");
+        finish(false);
+    }
+
+    void releaseTask() override { mDecoder.reset(); }
+
+    const Options mOptions;
+
+    EncodedDataHelper mStream;
+    size_t mNumLoopsDone = 0;
+    std::shared_ptr<C2BlockPool> mInputPool;
+    std::unique_ptr<VideoDecoder> mDecoder;
+    int32_t mNextBitstreamId = 0;
+    size_t mNumPendingDecodes = 0;
+    bool mDraining = false;
+
+    std::map<int32_t, ::base::TimeTicks> mDecodeStartTimes;
+    size_t mPeakMemoryUsage = 0;
+};
+
+bool parseOptions(int argc, char** argv, Options* options) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (strncmp(arg, "--codec=", 8) == 0) {
+            const std::string codec(arg + 8);
+            if (codec == "h264") {
+                options->codec = VideoCodec::H264;
+            } else if (codec == "vp8") {
+                options->codec = VideoCodec::VP8;
+            } else if (codec == "vp9") {
+                options->codec = VideoCodec::VP9;
+            } else if (codec == "hevc") {
+                options->codec = VideoCodec::HEVC;
+            } else if (codec == "av1") {
+                options->codec = VideoCodec::AV1;
+            } else {
+                return false;
+            }
+        } else if (strncmp(arg, "--sessions=", 11) == 0) {
+            options->numSessions = static_cast<size_t>(std::max(atoi(arg + 11), 1));
+        } else if (strncmp(arg, "--loops=", 8) == 0) {
+            options->numLoops = static_cast<size_t>(std::max(atoi(arg + 8), 1));
+        } else if (strcmp(arg, "--stateless") == 0) {
+            options->stateless = true;
+        } else if (arg[0] != '-' && options->streamPath.empty()) {
+            options->streamPath = arg;
+        } else {
+            return false;
+        }
+    }
+    return !options->streamPath.empty();
+}
+
+}  // namespace
+}  // namespace android
+
+int main(int argc, char** argv) {
+    using namespace android;
+
+    Options options;
+    if (!parseOptions(argc, argv, &options)) {
+        fprintf(stderr,
+                "Usage: %s [--codec=h264|vp8|vp9|hevc|av1] [--sessions=N] [--loops=N] "
+                "[--stateless] <stream.h264|.hevc|.ivf>\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<std::unique_ptr<DecodeSession>> sessions;
+    for (size_t i = 0; i < options.numSessions; i++) {
+        sessions.push_back(std::make_unique<DecodeSession>(i, options));
+    }
+
+    BenchmarkTimes times;
+    if (!runSessions(sessions, &times)) {
+        fprintf(stderr, "Decoding failed, see logcat for details\n");
+        return EXIT_FAILURE;
+    }
+
+    std::vector<int64_t> allLatenciesUs;
+    for (size_t i = 0; i < sessions.size(); i++) {
+        const DecodeSession& session = *sessions[i];
+        std::vector<int64_t> latenciesUs = session.latenciesUs();
+        std::sort(latenciesUs.begin(), latenciesUs.end());
+        printf("session %zu: %zu frames, %.2f fps, latency p50 %" PRId64 " us, p99 %" PRId64
+               " us, peak V4L2 memory %zu KB\n",
+               i, session.numFrames(), session.numFrames() / session.duration().InSecondsF(),
+               getPercentile(latenciesUs, 50), getPercentile(latenciesUs, 99),
+               session.peakMemoryUsage() / 1024);
+        allLatenciesUs.insert(allLatenciesUs.end(), latenciesUs.begin(), latenciesUs.end());
+    }
+    printTotals(sessions.size(), std::move(allLatenciesUs), times);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,421 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Headless encoder throughput benchmark. Encodes synthetic frames from memory with V4L2Encoder
+// directly at unlimited rate, in one or several parallel sessions, e.g.
+//   v4l2_codec2_encode_benchmark --codec=h264 --size=1920x1080 --format=yv12 --queue_depth=4
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "EncodeBenchmark"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <optional>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include <C2PlatformSupport.h>
+#include <android/hardware/graphics/common/1.0/types.h>
+#include <base/bind.h>
+#include <base/time/time.h>
+#include <log/log.h>
+#include <system/graphics.h>
+
+#include <v4l2_codec2/common/Common.h>
+#include <v4l2_codec2/common/EncodeHelpers.h>
+#include <v4l2_codec2/common/FormatConverter.h>
+#include <v4l2_codec2/common/Percentile.h>
+#include <v4l2_codec2/common/VideoPixelFormat.h>
+#include <v4l2_codec2/components/BitstreamBuffer.h>
+#include <v4l2_codec2/components/V4L2Encoder.h>
+
+#include "BenchmarkHelpers.h"
+
+using android::hardware::graphics::common::V1_0::BufferUsage;
+
+namespace android {
+namespace {
+
+struct Options {
+    C2Config::profile_t profile = C2Config::PROFILE_AVC_MAIN;
+    ui::Size size = ui::Size(1280, 720);
+    // The HAL format the input frames are allocated in.
+    uint32_t halFormat = HAL_PIXEL_FORMAT_YCBCR_420_888;
+    size_t queueDepth = V4L2Encoder::kInputBufferCount;
+    bool adaptiveQueueDepth = false;
+    bool rightSizedOutputBuffers = false;
+    // Whether all the input frames go through FormatConverter, instead of being passed to the
+    // device as-is when it supports their format.
+    bool forceConversion = false;
+    size_t conversionThreads = 0;
+    size_t numFrames = 300;
+    size_t numSessions = 1;
+    uint32_t bitrate = 4000000;
+    uint32_t framerate = 30;
+};
+
+// An encoder encoding |numFrames| frames on its own thread.
+class EncodeSession : public BenchmarkSession {
+public:
+    EncodeSession(size_t index, const Options& options)
+          : BenchmarkSession("EncodeSession" + std::to_string(index)), mOptions(options) {}
+
+    uint64_t numBytes() const { return mNumBytes; }
+    bool isConverting() const { return mConverter != nullptr; }
+    ::base::TimeDelta conversionTime() const { return mConversionTime; }
+    ::base::TimeDelta bufferWaitTime() const { return mBufferWaitTime; }
+
+private:
+    void startTask() override {
+        if (!allocateInputBlocks() || !createEncoder()) {
+            finish(false);
+            return;
+        }
+        if (GetCodec2BlockPool(C2BlockPool::BASIC_LINEAR, nullptr, &mOutputPool) != C2_OK) {
+            ALOGE("Failed to get the output block pool");
+            finish(false);
+            return;
+        }
+
+        mStartTime = ::base::TimeTicks::Now();
+        pumpEncodes();
+    }
+
+    bool allocateInputBlocks() {
+        std::shared_ptr<C2BlockPool> pool;
+        if (GetCodec2BlockPool(C2BlockPool::BASIC_GRAPHIC, nullptr, &pool) != C2_OK) {
+            ALOGE("Failed to get the input block pool");
+            return false;
+        }
+
+        const C2MemoryUsage usage(C2MemoryUsage::CPU_READ | C2MemoryUsage::CPU_WRITE |
+                                  static_cast<uint64_t>(BufferUsage::VIDEO_ENCODER));
+        const size_t numBlocks =
+                V4L2Encoder::getMaxQueueDepth(mOptions.queueDepth, mOptions.adaptiveQueueDepth) + 1;
+        for (size_t i = 0; i < numBlocks; i++) {
+            std::shared_ptr<C2GraphicBlock> block;
+            if (pool->fetchGraphicBlock(mOptions.size.width, mOptions.size.height,
+                                        mOptions.halFormat, usage, &block) != C2_OK ||
+                !fillGradient(block.get())) {
+                ALOGE("Failed to allocate the input frames");
+                return false;
+            }
+            mInputBlocks.push_back(
+                    block->share(C2Rect(mOptions.size.width, mOptions.size.height), C2Fence()));
+            mFreeInputBlocks.push(i);
+        }
+        return true;
+    }
+
+    bool createEncoder() {
+        VideoPixelFormat layoutFormat;
+        std::optional<VideoFramePlanes> planes =
+                getVideoFrameLayout(mInputBlocks.front(), &layoutFormat);
+        if (!planes || planes->empty()) {
+            ALOGE("Failed to get the layout of the input frames");
+            return false;
+        }
+        // getVideoFrameLayout() reports all RGB layouts as ARGB, while gralloc allocates RGBA.
+        if (layoutFormat == VideoPixelFormat::ARGB) layoutFormat = VideoPixelFormat::ABGR;
+
+        if (!mOptions.forceConversion) {
+            mEncoder = createEncoder(layoutFormat, (*planes)[0].mStride);
+            if (mEncoder && mEncoder->inputFormat() == layoutFormat) return true;
+            ALOGI("The device doesn't accept %s input, converting the frames",
+                  videoPixelFormatToString(layoutFormat).c_str());
+        }
+
+        // Same as V4L2EncodeComponent, the converted frames are NV12.
+        std::optional<uint32_t> stride = getVideoFrameStride(VideoPixelFormat::NV12);
+        if (!stride) return false;
+        mEncoder = createEncoder(VideoPixelFormat::NV12, *stride);
+        if (!mEncoder) return false;
+        mConverter = FormatConverter::Create(
+                mEncoder->inputFormat(), mEncoder->visibleSize(),
+                V4L2Encoder::getMaxQueueDepth(mOptions.queueDepth, mOptions.adaptiveQueueDepth),
+                mEncoder->codedSize(), mOptions.conversionThreads);
+        if (!mConverter) {
+            ALOGE("Failed to create the format converter");
+            return false;
+        }
+        return true;
+    }
+
+    std::unique_ptr<VideoEncoder> createEncoder(VideoPixelFormat inputFormat, uint32_t stride) {
+        auto encoder = V4L2Encoder::create(
+                mOptions.profile, std::nullopt, mOptions.size, inputFormat, stride,
+                mOptions.framerate, 0, C2Config::BITRATE_CONST, mOptions.bitrate, std::nullopt,
+                mOptions.queueDepth, mOptions.adaptiveQueueDepth, mOptions.rightSizedOutputBuffers,
+                1, {},
+                ::base::BindRepeating(&EncodeSession::fetchOutputBuffer, ::base::Unretained(this)),
+                ::base::BindRepeating(&EncodeSession::onInputBufferDone, ::base::Unretained(this)),
+                ::base::BindRepeating(&EncodeSession::onOutputBufferDone, ::base::Unretained(this)),
+                ::base::BindRepeating(&EncodeSession::onDrainDone, ::base::Unretained(this)),
+                ::base::BindRepeating(&EncodeSession::onError, ::base::Unretained(this)),
+                mTaskRunner);
+        if (!encoder) {
+            ALOGE("Failed to create the encoder (profile: %s)", profileToString(mOptions.profile));
+            return nullptr;
+        }
+        if (!encoder->setFramerate(mOptions.framerate)) return nullptr;
+        return encoder;
+    }
+
+    // Get the stride of the frames of |format| allocated by gralloc.
+    std::optional<uint32_t> getVideoFrameStride(VideoPixelFormat format) {
+        const uint32_t halFormat = format == VideoPixelFormat::I420
+                                           ? HAL_PIXEL_FORMAT_YV12
+                                           : HAL_PIXEL_FORMAT_YCBCR_420_888;
+        std::shared_ptr<C2BlockPool> pool;
+        std::shared_ptr<C2GraphicBlock> block;
+        if (GetCodec2BlockPool(C2BlockPool::BASIC_GRAPHIC, nullptr, &pool) != C2_OK ||
+            pool->fetchGraphicBlock(mOptions.size.width, mOptions.size.height, halFormat,
+                                    C2MemoryUsage(C2MemoryUsage::CPU_READ), &block) != C2_OK) {
+            ALOGE("Failed to allocate a frame to get its stride");
+            return std::nullopt;
+        }
+        VideoPixelFormat layoutFormat;
+        std::optional<VideoFramePlanes> planes = getVideoFrameLayout(
+                block->share(C2Rect(mOptions.size.width, mOptions.size.height), C2Fence()),
+                &layoutFormat);
+        if (!planes || planes->empty()) return std::nullopt;
+        return (*planes)[0].mStride;
+    }
+
+    void pumpEncodes() {
+        while (!mFinishing && !mFreeInputBlocks.empty() && mNumQueuedFrames < mOptions.numFrames) {
+            if (mConverter && !mConverter->isReady()) return;
+
+            const uint64_t index = mNumQueuedFrames++;
+            const size_t blockIndex = mFreeInputBlocks.front();
+            mFreeInputBlocks.pop();
+            mBlocksInUse[index] = blockIndex;
+
+            C2ConstGraphicBlock block = mInputBlocks[blockIndex];
+            if (mConverter) {
+                c2_status_t status = C2_CORRUPTED;
+                const ::base::TimeTicks convertStart = ::base::TimeTicks::Now();
+                block = mConverter->convertBlock(index, block, &status);
+                mConversionTime += ::base::TimeTicks::Now() - convertStart;
+                if (status != C2_OK) {
+                    ALOGE("Failed to convert the frame %" PRIu64, index);
+                    finish(false);
+                    return;
+                }
+            }
+
+            if (!encode(block, index)) {
+                finish(false);
+                return;
+            }
+        }
+
+        if (mNumQueuedFrames == mOptions.numFrames && !mDraining) {
+            mDraining = true;
+            mEncoder->drain();
+        }
+    }
+
+    bool encode(const C2ConstGraphicBlock& block, uint64_t index) {
+        VideoPixelFormat layoutFormat;
+        std::optional<VideoFramePlanes> planes = getVideoFrameLayout(block, &layoutFormat);
+        if (!planes) {
+            ALOGE("Failed to get the layout of the frame %" PRIu64, index);
+            return false;
+        }
+        VideoFrameFds fds;
+        const C2Handle* const handle = block.handle();
+        if (handle->numFds < 0 || static_cast<size_t>(handle->numFds) > fds.capacity()) {
+            ALOGE("Unsupported number of fds in the frame %" PRIu64 ": %d", index, handle->numFds);
+            return false;
+        }
+        for (int i = 0; i < handle->numFds; i++) fds.emplace_back(handle->data[i]);
+
+        const int64_t timestamp = static_cast<int64_t>(index) * 1000000 / mOptions.framerate;
+        mEncodeStartTimes[timestamp] = ::base::TimeTicks::Now();
+        return mEncoder->encode(std::make_unique<VideoEncoder::InputFrame>(
+                fds, *planes, mEncoder->inputFormat(), index, timestamp));
+    }
+
+    void fetchOutputBuffer(uint32_t size, std::unique_ptr<BitstreamBuffer>* buffer) {
+        std::shared_ptr<C2LinearBlock> block;
+        const C2MemoryUsage usage(C2MemoryUsage::CPU_READ |
+                                  static_cast<uint64_t>(BufferUsage::VIDEO_ENCODER));
+        if (mOutputPool->fetchLinearBlock(size, usage, &block) != C2_OK) {
+            ALOGE("Failed to fetch an output block of %u bytes", size);
+            onError();
+            return;
+        }
+        *buffer = std::make_unique<BitstreamBuffer>(std::move(block), 0, size);
+    }
+
+    void onInputBufferDone(uint64_t index) {
+        auto blockIndex = mBlocksInUse.find(index);
+        if (blockIndex == mBlocksInUse.end()) return;
+        mFreeInputBlocks.push(blockIndex->second);
+        mBlocksInUse.erase(blockIndex);
+        if (mConverter) mConverter->returnBlock(index);
+
+        pumpEncodes();
+    }
+
+    void onOutputBufferDone(size_t dataSize, int64_t timestamp, bool /* keyFrame */,
+                            std::unique_ptr<BitstreamBuffer> /* buffer */) {
+        auto startTime = mEncodeStartTimes.find(timestamp);
+        if (startTime != mEncodeStartTimes.end()) {
+            mLatenciesUs.push_back((::base::TimeTicks::Now() - startTime->second).InMicroseconds());
+            mEncodeStartTimes.erase(startTime);
+        }
+        mNumBytes += dataSize;
+    }
+
+    void onDrainDone(bool success) {
+        mEndTime = ::base::TimeTicks::Now();
+        finish(success);
+    }
+
+    void onError() {
+        ALOGE("The encoder reported an error");
+        finish(false);
+    }
+
+    void releaseTask() override {
+        if (mEncoder) mBufferWaitTime = mEncoder->getBufferWaitTime();
+        mEncoder.reset();
+    }
+
+    const Options mOptions;
+
+    std::vector<C2ConstGraphicBlock> mInputBlocks;
+    std::queue<size_t> mFreeInputBlocks;
+    // The input block of each frame sent to the encoder, by frame index.
+    std::map<uint64_t, size_t> mBlocksInUse;
+    std::shared_ptr<C2BlockPool> mOutputPool;
+    std::unique_ptr<FormatConverter> mConverter;
+    std::unique_ptr<VideoEncoder> mEncoder;
+    size_t mNumQueuedFrames = 0;
+    bool mDraining = false;
+
+    std::map<int64_t, ::base::TimeTicks> mEncodeStartTimes;
+    uint64_t mNumBytes = 0;
+    ::base::TimeDelta mConversionTime;
+    ::base::TimeDelta mBufferWaitTime;
+};
+
+bool parseOptions(int argc, char** argv, Options* options) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        int width = 0;
+        int height = 0;
+        if (strncmp(arg, "--codec=", 8) == 0) {
+            const std::string codec(arg + 8);
+            if (codec == "h264") {
+                options->profile = C2Config::PROFILE_AVC_MAIN;
+            } else if (codec == "vp8") {
+                options->profile = C2Config::PROFILE_VP8_0;
+            } else if (codec == "vp9") {
+                options->profile = C2Config::PROFILE_VP9_0;
+            } else if (codec == "hevc") {
+                options->profile = C2Config::PROFILE_HEVC_MAIN;
+            } else {
+                return false;
+            }
+        } else if (sscanf(arg, "--size=%dx%d", &width, &height) == 2) {
+            if (width <= 0 || height <= 0) return false;
+            options->size = ui::Size(width, height);
+        } else if (strncmp(arg, "--format=", 9) == 0) {
+            const std::string format(arg + 9);
+            if (format == "nv12") {
+                options->halFormat = HAL_PIXEL_FORMAT_YCBCR_420_888;
+            } else if (format == "yv12") {
+                options->halFormat = HAL_PIXEL_FORMAT_YV12;
+            } else if (format == "rgba") {
+                options->halFormat = HAL_PIXEL_FORMAT_RGBA_8888;
+            } else {
+                return false;
+            }
+        } else if (strncmp(arg, "--queue_depth=", 14) == 0) {
+            options->queueDepth = static_cast<size_t>(std::max(atoi(arg + 14), 0));
+        } else if (strcmp(arg, "--adaptive_queue_depth") == 0) {
+            options->adaptiveQueueDepth = true;
+        } else if (strcmp(arg, "--right_sized_output") == 0) {
+            options->rightSizedOutputBuffers = true;
+        } else if (strcmp(arg, "--convert") == 0) {
+            options->forceConversion = true;
+        } else if (strncmp(arg, "--convert_threads=", 18) == 0) {
+            options->conversionThreads = static_cast<size_t>(std::max(atoi(arg + 18), 0));
+        } else if (strncmp(arg, "--frames=", 9) == 0) {
+            options->numFrames = static_cast<size_t>(std::max(atoi(arg + 9), 1));
+        } else if (strncmp(arg, "--sessions=", 11) == 0) {
+            options->numSessions = static_cast<size_t>(std::max(atoi(arg + 11), 1));
+        } else if (strncmp(arg, "--bitrate=", 10) == 0) {
+            options->bitrate = static_cast<uint32_t>(std::max(atoi(arg + 10), 1));
+        } else if (strncmp(arg, "--framerate=", 12) == 0) {
+            options->framerate = static_cast<uint32_t>(std::max(atoi(arg + 12), 1));
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+}  // namespace
+}  // namespace android
+
+int main(int argc, char** argv) {
+    using namespace android;
+
+    Options options;
+    if (!parseOptions(argc, argv, &options)) {
+        fprintf(stderr,
+                "Usage: %s [--codec=h264|vp8|vp9|hevc] [--size=WxH] [--format=nv12|yv12|rgba] "
+                "[--queue_depth=N] [--adaptive_queue_depth] [--right_sized_output] [--convert] "
+                "[--convert_threads=N] [--frames=N] [--sessions=N] [--bitrate=bps] "
+                "[--framerate=fps]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<std::unique_ptr<EncodeSession>> sessions;
+    for (size_t i = 0; i < options.numSessions; i++) {
+        sessions.push_back(std::make_unique<EncodeSession>(i, options));
+    }
+
+    BenchmarkTimes times;
+    if (!runSessions(sessions, &times)) {
+        fprintf(stderr, "Encoding failed, see logcat for details\n");
+        return EXIT_FAILURE;
+    }
+
+    std::vector<int64_t> allLatenciesUs;
+    for (size_t i = 0; i < sessions.size(); i++) {
+        const EncodeSession& session = *sessions[i];
+        std::vector<int64_t> latenciesUs = session.latenciesUs();
+        std::sort(latenciesUs.begin(), latenciesUs.end());
+        const double streamDuration = static_cast<double>(session.numFrames()) / options.framerate;
+        printf("session %zu: %zu frames, %.2f fps, latency p50 %" PRId64 " us, p99 %" PRId64
+               " us, %.0f kbps at %u fps, %s",
+               i, session.numFrames(), session.numFrames() / session.duration().InSecondsF(),
+               getPercentile(latenciesUs, 50), getPercentile(latenciesUs, 99),
+               session.numBytes() * 8 / streamDuration / 1000, options.framerate,
+               session.isConverting() ? "converted" : "zero-copy");
+        if (session.isConverting()) {
+            printf(" in %.1f us per frame",
+                   static_cast<double>(session.conversionTime().InMicroseconds()) /
+                           std::max(session.numFrames(), static_cast<size_t>(1)));
+        }
+        printf(", waited %" PRId64 " ms for input buffers\n",
+               session.bufferWaitTime().InMilliseconds());
+        allLatenciesUs.insert(allLatenciesUs.end(), latenciesUs.begin(), latenciesUs.end());
+    }
+    printTotals(sessions.size(), std::move(allLatenciesUs), times);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,150 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdint.h>
+
+#include <memory>
+
+#include <C2PlatformSupport.h>
+#include <benchmark/benchmark.h>
+#include <system/graphics.h>
+
+#include <v4l2_codec2/common/FormatConverter.h>
+#include <v4l2_codec2/common/VideoPixelFormat.h>
+
+#include "BenchmarkHelpers.h"
+
+namespace android {
+namespace {
+
+// Allocate an input frame of |halFormat|, filled with a gradient. Returns nullptr on failure.
+std::shared_ptr<C2GraphicBlock> allocateInputBlock(uint32_t halFormat, const ui::Size& size) {
+    std::shared_ptr<C2BlockPool> pool;
+    std::shared_ptr<C2GraphicBlock> block;
+    if (GetCodec2BlockPool(C2BlockPool::BASIC_GRAPHIC, nullptr, &pool) != C2_OK ||
+        pool->fetchGraphicBlock(size.width, size.height, halFormat,
+                                C2MemoryUsage(C2MemoryUsage::CPU_READ | C2MemoryUsage::CPU_WRITE),
+                                &block) != C2_OK) {
+        return nullptr;
+    }
+    return fillGradient(block.get()) ? block : nullptr;
+}
+
+// Convert frames of |state.range(0)|x|state.range(1)| allocated in the |state.range(2)| HAL
+// format to |state.range(3)| VideoPixelFormat, the same way V4L2EncodeComponent does.
+void BM_ConvertBlock(benchmark::State& state) {
+    const ui::Size size(state.range(0), state.range(1));
+    const uint32_t inputFormat = static_cast<uint32_t>(state.range(2));
+    const VideoPixelFormat outputFormat = static_cast<VideoPixelFormat>(state.range(3));
+
+    std::shared_ptr<C2GraphicBlock> block = allocateInputBlock(inputFormat, size);
+    std::unique_ptr<FormatConverter> converter =
+            FormatConverter::Create(outputFormat, size, 1, size);
+    if (!block || !converter) {
+        state.SkipWithError("Failed to allocate the frames");
+        return;
+    }
+    const C2ConstGraphicBlock inputBlock =
+            block->share(C2Rect(size.width, size.height), C2Fence());
+
+    uint64_t frameIndex = 0;
+    for (auto _ : state) {
+        c2_status_t status = C2_CORRUPTED;
+        C2ConstGraphicBlock outputBlock = converter->convertBlock(frameIndex, inputBlock, &status);
+        benchmark::DoNotOptimize(outputBlock);
+        if (status != C2_OK || converter->returnBlock(frameIndex) != C2_OK) {
+            state.SkipWithError("Failed to convert the frame");
+            break;
+        }
+        frameIndex++;
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * size.width * size.height * 3 / 2);
+}
+
+// All the conversions supported by FormatConverter::convertBlock(), and the zero-copy case.
+void Conversions(benchmark::internal::Benchmark* b) {
+    const struct {
+        uint32_t input;
+        VideoPixelFormat output;
+    } kConversions[] = {
+            {HAL_PIXEL_FORMAT_YCBCR_420_888, VideoPixelFormat::NV12},  // zero-copy
+            {HAL_PIXEL_FORMAT_YV12, VideoPixelFormat::I420},
+            {HAL_PIXEL_FORMAT_YV12, VideoPixelFormat::NV12},
+            {HAL_PIXEL_FORMAT_YCBCR_420_888, VideoPixelFormat::I420},
+            {HAL_PIXEL_FORMAT_YCrCb_420_SP, VideoPixelFormat::I420},
+            {HAL_PIXEL_FORMAT_YCrCb_420_SP, VideoPixelFormat::NV12},
+            {HAL_PIXEL_FORMAT_RGBA_8888, VideoPixelFormat::I420},
+            {HAL_PIXEL_FORMAT_RGBA_8888, VideoPixelFormat::NV12},
+    };
+    const ui::Size kSizes[] = {ui::Size(1280, 720), ui::Size(1920, 1080), ui::Size(3840, 2160)};
+    b->ArgNames({"width", "height", "hal_format", "format"});
+    for (const auto& conversion : kConversions) {
+        for (const ui::Size& size : kSizes) {
+            b->Args({size.width, size.height, conversion.input,
+                     static_cast<int64_t>(conversion.output)});
+        }
+    }
+}
+
+// Scale 1080p frames allocated in the |state.range(2)| HAL format to |state.range(0)|x
+// |state.range(1)| |state.range(3)| frames, like the encoders of the lower resolution layers of a
+// simulcast session.
+void BM_ScaleBlock(benchmark::State& state) {
+    const ui::Size inputSize(1920, 1080);
+    const ui::Size size(state.range(0), state.range(1));
+    const uint32_t inputFormat = static_cast<uint32_t>(state.range(2));
+    const VideoPixelFormat outputFormat = static_cast<VideoPixelFormat>(state.range(3));
+
+    std::shared_ptr<C2GraphicBlock> block = allocateInputBlock(inputFormat, inputSize);
+    std::unique_ptr<FormatConverter> converter =
+            FormatConverter::Create(outputFormat, size, 1, size, 0, true);
+    if (!block || !converter) {
+        state.SkipWithError("Failed to allocate the frames");
+        return;
+    }
+    const C2ConstGraphicBlock inputBlock =
+            block->share(C2Rect(inputSize.width, inputSize.height), C2Fence());
+
+    uint64_t frameIndex = 0;
+    for (auto _ : state) {
+        c2_status_t status = C2_CORRUPTED;
+        C2ConstGraphicBlock outputBlock = converter->convertBlock(frameIndex, inputBlock, &status);
+        benchmark::DoNotOptimize(outputBlock);
+        if (status != C2_OK || converter->returnBlock(frameIndex) != C2_OK) {
+            state.SkipWithError("Failed to scale the frame");
+            break;
+        }
+        frameIndex++;
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * inputSize.width * inputSize.height * 3 / 2);
+}
+
+// Scaling straight into the output block (NV12 and YV12 to I420), and scaling before conversion.
+void Scalings(benchmark::internal::Benchmark* b) {
+    const struct {
+        uint32_t input;
+        VideoPixelFormat output;
+    } kScalings[] = {
+            {HAL_PIXEL_FORMAT_YCBCR_420_888, VideoPixelFormat::NV12},
+            {HAL_PIXEL_FORMAT_YV12, VideoPixelFormat::I420},
+            {HAL_PIXEL_FORMAT_YCrCb_420_SP, VideoPixelFormat::NV12},
+            {HAL_PIXEL_FORMAT_RGBA_8888, VideoPixelFormat::NV12},
+    };
+    const ui::Size kSizes[] = {ui::Size(960, 540), ui::Size(480, 270)};
+    b->ArgNames({"width", "height", "hal_format", "format"});
+    for (const auto& scaling : kScalings) {
+        for (const ui::Size& size : kSizes) {
+            b->Args({size.width, size.height, scaling.input,
+                     static_cast<int64_t>(scaling.output)});
+        }
+    }
+}
+
+BENCHMARK(BM_ConvertBlock)->Apply(Conversions);
+BENCHMARK(BM_ScaleBlock)->Apply(Scalings);
+
+}  // namespace
+}  // namespace android
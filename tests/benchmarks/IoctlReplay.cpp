@@ -0,0 +1,436 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Replays an ioctl trace recorded by V4L2IoctlRecorder (see the
+// ro.vendor.v4l2_codec2.ioctl_trace_dir property) against a V4L2 device of the same type, issuing
+// each ioctl at the time it was recorded, to reproduce and measure the stalls of a session without
+// the app, e.g.
+//   v4l2_codec2_ioctl_replay --trace=/data/local/tmp/v4l2_1234_0.trace
+//
+// The buffers shared with the recorded process can't be replayed, so the DMABUF and USERPTR
+// buffers are replaced by MMAP buffers of the device. The data queued to the MMAP buffers of the
+// OUTPUT queue was recorded, so the bitstream fed to a decoder is replayed as is. The ioctls of
+// the stateless devices, which go through media requests, aren't replayed.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "IoctlReplay"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <linux/videodev2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/strings/stringprintf.h>
+#include <base/time/time.h>
+#include <log/log.h>
+
+#include <v4l2_codec2/common/V4L2Device.h>
+#include <v4l2_codec2/common/V4L2IoctlRecorder.h>
+#include <v4l2_codec2/common/VideoPixelFormat.h>
+
+namespace android {
+namespace {
+
+struct Options {
+    std::string tracePath;
+    // Issue the ioctls back to back, instead of at the time they were recorded.
+    bool fast = false;
+    // The time to wait for a buffer or an event the recorded process dequeued, after which the
+    // dequeue is counted as a stall.
+    int dequeueTimeoutMs = 1000;
+};
+
+struct TracedCall {
+    V4L2TraceRecord record;
+    std::vector<uint8_t> payload;
+};
+
+struct RequestStats {
+    size_t count = 0;
+    // The ioctls which didn't return the same as when they were recorded.
+    size_t mismatches = 0;
+    ::base::TimeDelta recordedDuration;
+    ::base::TimeDelta duration;
+    ::base::TimeDelta maxDuration;
+};
+
+std::string getRequestName(uint32_t request) {
+    switch (request) {
+    case static_cast<uint32_t>(VIDIOC_QUERYCAP):
+        return "QUERYCAP";
+    case static_cast<uint32_t>(VIDIOC_S_FMT):
+        return "S_FMT";
+    case static_cast<uint32_t>(VIDIOC_G_FMT):
+        return "G_FMT";
+    case static_cast<uint32_t>(VIDIOC_TRY_FMT):
+        return "TRY_FMT";
+    case static_cast<uint32_t>(VIDIOC_REQBUFS):
+        return "REQBUFS";
+    case static_cast<uint32_t>(VIDIOC_QUERYBUF):
+        return "QUERYBUF";
+    case static_cast<uint32_t>(VIDIOC_QBUF):
+        return "QBUF";
+    case static_cast<uint32_t>(VIDIOC_DQBUF):
+        return "DQBUF";
+    case static_cast<uint32_t>(VIDIOC_STREAMON):
+        return "STREAMON";
+    case static_cast<uint32_t>(VIDIOC_STREAMOFF):
+        return "STREAMOFF";
+    case static_cast<uint32_t>(VIDIOC_S_EXT_CTRLS):
+        return "S_EXT_CTRLS";
+    case static_cast<uint32_t>(VIDIOC_G_EXT_CTRLS):
+        return "G_EXT_CTRLS";
+    case static_cast<uint32_t>(VIDIOC_DQEVENT):
+        return "DQEVENT";
+    case static_cast<uint32_t>(VIDIOC_DECODER_CMD):
+        return "DECODER_CMD";
+    case static_cast<uint32_t>(VIDIOC_ENCODER_CMD):
+        return "ENCODER_CMD";
+    default:
+        return ::base::StringPrintf("0x%08x", request);
+    }
+}
+
+bool readTrace(const std::string& path, V4L2TraceHeader* header, std::vector<TracedCall>* calls) {
+    FILE* file = fopen(path.c_str(), "rbe");
+    if (!file) {
+        fprintf(stderr, "Failed to open %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    if (fread(header, sizeof(*header), 1, file) != 1 ||
+        memcmp(header->magic, kV4L2TraceMagic, sizeof(header->magic)) != 0 ||
+        header->version != kV4L2TraceVersion) {
+        fprintf(stderr, "%s is not an ioctl trace of version %u\n", path.c_str(),
+                kV4L2TraceVersion);
+        fclose(file);
+        return false;
+    }
+
+    // The whole trace is read upfront, so reading it doesn't delay the replayed ioctls.
+    TracedCall call;
+    while (fread(&call.record, sizeof(call.record), 1, file) == 1) {
+        call.payload.resize(call.record.payloadSize);
+        if (call.record.payloadSize > 0 &&
+            fread(call.payload.data(), call.record.payloadSize, 1, file) != 1) {
+            fprintf(stderr, "The trace is truncated after %zu calls\n", calls->size());
+            break;
+        }
+        calls->push_back(std::move(call));
+    }
+    fclose(file);
+    return true;
+}
+
+class IoctlReplayer {
+public:
+    IoctlReplayer(scoped_refptr<V4L2Device> device, const Options& options)
+          : mDevice(std::move(device)), mOptions(options) {}
+    ~IoctlReplayer() { unmapBuffers(); }
+
+    void replay(const std::vector<TracedCall>& calls);
+    void printStats(const std::vector<TracedCall>& calls) const;
+
+private:
+    struct Plane {
+        uint8_t* addr;
+        size_t length;
+    };
+
+    // Replay the ioctl of |call|. Returns false if it was skipped.
+    bool replayIoctl(const TracedCall& call);
+    // Issue the dequeue |request| until it succeeds or |mOptions.dequeueTimeoutMs| elapses.
+    int dequeue(uint32_t request, void* arg);
+    // Write the recorded |data| of the |plane| of the MMAP buffer |index| of the OUTPUT queue.
+    bool writePlane(uint32_t index, uint32_t plane, const uint8_t* data, uint32_t size);
+    void unmapBuffers();
+
+    scoped_refptr<V4L2Device> mDevice;
+    const Options mOptions;
+
+    // The mappings of the MMAP buffers of the OUTPUT queue of the device, by index.
+    std::map<uint32_t, std::vector<Plane>> mOutputMappings;
+
+    ::base::TimeDelta mDuration;
+    std::map<uint32_t, RequestStats> mStats;
+    size_t mSkippedCalls = 0;
+    size_t mStalls = 0;
+    size_t mDequeuedCaptureBuffers = 0;
+};
+
+void IoctlReplayer::replay(const std::vector<TracedCall>& calls) {
+    const ::base::TimeTicks startTime = ::base::TimeTicks::Now();
+    for (const TracedCall& call : calls) {
+        // The polls are where the recorded process waited for the device, the replay waits in
+        // the dequeues instead.
+        if (call.record.kind != V4L2TraceRecordKind::kIoctl) continue;
+
+        if (!mOptions.fast) {
+            const ::base::TimeDelta delay =
+                    ::base::TimeDelta::FromNanoseconds(call.record.startNs) -
+                    (::base::TimeTicks::Now() - startTime);
+            if (delay > ::base::TimeDelta()) usleep(delay.InMicroseconds());
+        }
+        if (!replayIoctl(call)) mSkippedCalls++;
+    }
+    mDuration = ::base::TimeTicks::Now() - startTime;
+}
+
+bool IoctlReplayer::replayIoctl(const TracedCall& call) {
+    const uint32_t request = call.record.request;
+    const size_t argSize = _IOC_SIZE(request);
+    if (call.payload.size() < argSize) return false;
+
+    // The ioctls returning the fds of the buffers to the recorded process can't be replayed.
+    if (request == static_cast<uint32_t>(VIDIOC_EXPBUF)) return false;
+    // The buffers and events the recorded process failed to dequeue, e.g. when it polled the
+    // device, don't need to be dequeued again.
+    const bool isDequeue = request == static_cast<uint32_t>(VIDIOC_DQBUF) ||
+                           request == static_cast<uint32_t>(VIDIOC_DQEVENT);
+    if (isDequeue && call.record.ret != 0) return false;
+
+    std::vector<uint8_t> arg(call.payload.begin(), call.payload.begin() + argSize);
+    size_t offset = argSize;
+    std::vector<struct v4l2_plane> planes;
+    std::vector<struct v4l2_ext_control> controls;
+    std::vector<std::vector<uint8_t>> controlPayloads;
+
+    if (request == static_cast<uint32_t>(VIDIOC_REQBUFS)) {
+        auto* reqbufs = reinterpret_cast<struct v4l2_requestbuffers*>(arg.data());
+        reqbufs->memory = V4L2_MEMORY_MMAP;
+        // The buffers can't be freed while they are mapped.
+        if (reqbufs->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) unmapBuffers();
+    } else if (request == static_cast<uint32_t>(VIDIOC_CREATE_BUFS)) {
+        reinterpret_cast<struct v4l2_create_buffers*>(arg.data())->memory = V4L2_MEMORY_MMAP;
+    } else if (request == static_cast<uint32_t>(VIDIOC_QBUF) ||
+               request == static_cast<uint32_t>(VIDIOC_DQBUF) ||
+               request == static_cast<uint32_t>(VIDIOC_QUERYBUF) ||
+               request == static_cast<uint32_t>(VIDIOC_PREPARE_BUF)) {
+        auto* buffer = reinterpret_cast<struct v4l2_buffer*>(arg.data());
+        if (buffer->flags & V4L2_BUF_FLAG_REQUEST_FD) return false;
+        if (V4L2_TYPE_IS_MULTIPLANAR(buffer->type)) {
+            if (call.payload.size() < offset + buffer->length * sizeof(struct v4l2_plane)) {
+                return false;
+            }
+            planes.resize(buffer->length);
+            memcpy(planes.data(), call.payload.data() + offset,
+                   buffer->length * sizeof(struct v4l2_plane));
+            offset += buffer->length * sizeof(struct v4l2_plane);
+            buffer->m.planes = planes.data();
+        }
+
+        const bool hasData = request == static_cast<uint32_t>(VIDIOC_QBUF) &&
+                             buffer->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE &&
+                             buffer->memory == V4L2_MEMORY_MMAP;
+        for (uint32_t i = 0; hasData && i < planes.size(); i++) {
+            uint32_t size;
+            if (call.payload.size() < offset + sizeof(size)) return false;
+            memcpy(&size, call.payload.data() + offset, sizeof(size));
+            offset += sizeof(size);
+            if (call.payload.size() < offset + size) return false;
+            if (size > 0 && !writePlane(buffer->index, i, call.payload.data() + offset, size)) {
+                return false;
+            }
+            offset += size;
+        }
+
+        if (buffer->memory != V4L2_MEMORY_MMAP) {
+            buffer->memory = V4L2_MEMORY_MMAP;
+            for (struct v4l2_plane& plane : planes) plane.m.mem_offset = 0;
+        }
+    } else if (request == static_cast<uint32_t>(VIDIOC_S_EXT_CTRLS) ||
+               request == static_cast<uint32_t>(VIDIOC_G_EXT_CTRLS) ||
+               request == static_cast<uint32_t>(VIDIOC_TRY_EXT_CTRLS)) {
+        auto* ctrls = reinterpret_cast<struct v4l2_ext_controls*>(arg.data());
+        if (ctrls->which == V4L2_CTRL_WHICH_REQUEST_VAL) return false;
+        if (call.payload.size() < offset + ctrls->count * sizeof(struct v4l2_ext_control)) {
+            return false;
+        }
+        controls.resize(ctrls->count);
+        memcpy(controls.data(), call.payload.data() + offset,
+               ctrls->count * sizeof(struct v4l2_ext_control));
+        offset += ctrls->count * sizeof(struct v4l2_ext_control);
+        for (struct v4l2_ext_control& ctrl : controls) {
+            if (ctrl.size == 0) continue;
+            if (call.payload.size() < offset + ctrl.size) return false;
+            controlPayloads.emplace_back(call.payload.begin() + offset,
+                                         call.payload.begin() + offset + ctrl.size);
+            ctrl.ptr = controlPayloads.back().data();
+            offset += ctrl.size;
+        }
+        ctrls->controls = controls.data();
+    }
+
+    const ::base::TimeTicks start = ::base::TimeTicks::Now();
+    const int ret = isDequeue ? dequeue(request, arg.data())
+                              : mDevice->ioctl(static_cast<int>(request), arg.data());
+    const ::base::TimeDelta duration = ::base::TimeTicks::Now() - start;
+
+    if (request == static_cast<uint32_t>(VIDIOC_DQBUF) && ret == 0 &&
+        reinterpret_cast<struct v4l2_buffer*>(arg.data())->type ==
+                V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        mDequeuedCaptureBuffers++;
+    }
+
+    RequestStats& stats = mStats[request];
+    stats.count++;
+    if ((ret == 0) != (call.record.ret == 0)) stats.mismatches++;
+    stats.recordedDuration += ::base::TimeDelta::FromNanoseconds(call.record.durationNs);
+    stats.duration += duration;
+    stats.maxDuration = std::max(stats.maxDuration, duration);
+    return true;
+}
+
+int IoctlReplayer::dequeue(uint32_t request, void* arg) {
+    // The argument is overwritten by the failed dequeues.
+    const std::vector<uint8_t> initialArg(static_cast<uint8_t*>(arg),
+                                          static_cast<uint8_t*>(arg) + _IOC_SIZE(request));
+    const ::base::TimeTicks deadline =
+            ::base::TimeTicks::Now() +
+            ::base::TimeDelta::FromMilliseconds(mOptions.dequeueTimeoutMs);
+    while (true) {
+        const int ret = mDevice->ioctl(static_cast<int>(request), arg);
+        if (ret == 0 || (errno != EAGAIN && errno != ENOENT)) return ret;
+
+        const int timeoutMs =
+                static_cast<int>((deadline - ::base::TimeTicks::Now()).InMilliseconds());
+        bool eventPending = false;
+        if (timeoutMs <= 0 || !mDevice->poll(true, &eventPending, timeoutMs)) {
+            ALOGW("Stalled dequeueing with %s", getRequestName(request).c_str());
+            mStalls++;
+            return ret;
+        }
+        memcpy(arg, initialArg.data(), initialArg.size());
+    }
+}
+
+bool IoctlReplayer::writePlane(uint32_t index, uint32_t plane, const uint8_t* data,
+                               uint32_t size) {
+    auto it = mOutputMappings.find(index);
+    if (it == mOutputMappings.end()) {
+        struct v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+        struct v4l2_buffer buffer = {};
+        buffer.index = index;
+        buffer.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+        buffer.memory = V4L2_MEMORY_MMAP;
+        buffer.length = VIDEO_MAX_PLANES;
+        buffer.m.planes = planes;
+        if (mDevice->ioctl(VIDIOC_QUERYBUF, &buffer) != 0) {
+            ALOGE("Failed to query the OUTPUT buffer %u", index);
+            return false;
+        }
+
+        std::vector<Plane> mappings;
+        for (uint32_t i = 0; i < buffer.length; i++) {
+            void* addr = mDevice->mmap(nullptr, planes[i].length, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED, planes[i].m.mem_offset);
+            if (addr == MAP_FAILED) {
+                ALOGE("Failed to map the plane %u of the OUTPUT buffer %u", i, index);
+                for (const Plane& mapping : mappings) mDevice->munmap(mapping.addr, mapping.length);
+                return false;
+            }
+            mappings.push_back({static_cast<uint8_t*>(addr), planes[i].length});
+        }
+        it = mOutputMappings.emplace(index, std::move(mappings)).first;
+    }
+
+    if (plane >= it->second.size()) return false;
+    memcpy(it->second[plane].addr, data, std::min<size_t>(size, it->second[plane].length));
+    return true;
+}
+
+void IoctlReplayer::unmapBuffers() {
+    for (const auto& [index, mappings] : mOutputMappings) {
+        for (const Plane& mapping : mappings) mDevice->munmap(mapping.addr, mapping.length);
+    }
+    mOutputMappings.clear();
+}
+
+void IoctlReplayer::printStats(const std::vector<TracedCall>& calls) const {
+    // The recorded duration spans up to the end of the last call.
+    int64_t recordedDurationNs = 0;
+    size_t recordedCaptureBuffers = 0;
+    for (const TracedCall& call : calls) {
+        recordedDurationNs =
+                std::max(recordedDurationNs, call.record.startNs + call.record.durationNs);
+        if (call.record.kind == V4L2TraceRecordKind::kIoctl &&
+            call.record.request == static_cast<uint32_t>(VIDIOC_DQBUF) && call.record.ret == 0 &&
+            call.payload.size() >= sizeof(struct v4l2_buffer) &&
+            reinterpret_cast<const struct v4l2_buffer*>(call.payload.data())->type ==
+                    V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+            recordedCaptureBuffers++;
+        }
+    }
+    const double recordedDurationS = recordedDurationNs / 1e9;
+
+    printf("replayed in %" PRId64 " ms (recorded in %.0f ms), %zu calls skipped, %zu stalls\n",
+           mDuration.InMilliseconds(), recordedDurationS * 1000, mSkippedCalls, mStalls);
+    printf("CAPTURE buffers: %zu dequeued, %.2f fps (recorded %zu, %.2f fps)\n",
+           mDequeuedCaptureBuffers, mDequeuedCaptureBuffers / mDuration.InSecondsF(),
+           recordedCaptureBuffers,
+           recordedDurationS > 0 ? recordedCaptureBuffers / recordedDurationS : 0.0);
+    for (const auto& [request, stats] : mStats) {
+        printf("  %s: count %zu, mean %" PRId64 " us (recorded %" PRId64 " us), max %" PRId64
+               " us, %zu mismatched results\n",
+               getRequestName(request).c_str(), stats.count,
+               stats.duration.InMicroseconds() / static_cast<int64_t>(stats.count),
+               stats.recordedDuration.InMicroseconds() / static_cast<int64_t>(stats.count),
+               stats.maxDuration.InMicroseconds(), stats.mismatches);
+    }
+}
+
+bool parseOptions(int argc, char** argv, Options* options) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (strncmp(arg, "--trace=", 8) == 0) {
+            options->tracePath = arg + 8;
+        } else if (strcmp(arg, "--fast") == 0) {
+            options->fast = true;
+        } else if (strncmp(arg, "--dequeue_timeout_ms=", 21) == 0) {
+            options->dequeueTimeoutMs = std::max(atoi(arg + 21), 1);
+        } else {
+            return false;
+        }
+    }
+    return !options->tracePath.empty();
+}
+
+}  // namespace
+}  // namespace android
+
+int main(int argc, char** argv) {
+    using namespace android;
+
+    Options options;
+    if (!parseOptions(argc, argv, &options)) {
+        fprintf(stderr, "Usage: %s --trace=path [--fast] [--dequeue_timeout_ms=N]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    V4L2TraceHeader header;
+    std::vector<TracedCall> calls;
+    if (!readTrace(options.tracePath, &header, &calls)) return EXIT_FAILURE;
+
+    scoped_refptr<V4L2Device> device = V4L2Device::create();
+    if (!device->open(static_cast<V4L2Device::Type>(header.deviceType), header.pixFmt)) {
+        fprintf(stderr, "Failed to open a device of type %u for %s\n", header.deviceType,
+                fourccToString(header.pixFmt).c_str());
+        return EXIT_FAILURE;
+    }
+
+    IoctlReplayer replayer(device, options);
+    replayer.replay(calls);
+    replayer.printStats(calls);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,82 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <v4l2_codec2/common/SwapUVPlane.h>
+
+namespace android {
+namespace {
+
+// The per-byte helper previously used by FormatConverter to convert NV21 to NV12, kept here as the
+// baseline of the comparison.
+void copyPlaneByPixel(const uint8_t* src, int srcStride, int srcColInc, uint8_t* dst, int dstStride,
+                      int dstColInc, int width, int height) {
+    for (int row = 0; row < height; row++) {
+        const uint8_t* srcRow = src;
+        uint8_t* dstRow = dst;
+        for (int col = 0; col < width; col++) {
+            memcpy(dstRow, srcRow, 1);
+            srcRow += srcColInc;
+            dstRow += dstColInc;
+        }
+        src += srcStride;
+        dst += dstStride;
+    }
+}
+
+// The chroma plane of a 4:2:0 frame of |state.range(0)|x|state.range(1)|.
+struct ChromaPlanes {
+    explicit ChromaPlanes(const benchmark::State& state)
+          : width(state.range(0) / 2),
+            height(state.range(1) / 2),
+            stride(state.range(0)),
+            src(stride * height, 0x80),
+            dst(stride * height) {}
+
+    const int width;
+    const int height;
+    const int stride;
+    std::vector<uint8_t> src;
+    std::vector<uint8_t> dst;
+};
+
+void BM_CopyPlaneByPixel(benchmark::State& state) {
+    ChromaPlanes planes(state);
+    for (auto _ : state) {
+        copyPlaneByPixel(planes.src.data() + 1, planes.stride, 2, planes.dst.data(), planes.stride,
+                         2, planes.width, planes.height);
+        copyPlaneByPixel(planes.src.data(), planes.stride, 2, planes.dst.data() + 1, planes.stride,
+                         2, planes.width, planes.height);
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * planes.stride * planes.height);
+}
+
+void BM_SwapUVPlane(benchmark::State& state) {
+    ChromaPlanes planes(state);
+    for (auto _ : state) {
+        swapUVPlane(planes.src.data(), planes.stride, planes.dst.data(), planes.stride,
+                    planes.width, planes.height);
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * planes.stride * planes.height);
+}
+
+void FrameSizes(benchmark::internal::Benchmark* b) {
+    b->Args({1280, 720});
+    b->Args({1920, 1080});
+    b->Args({3840, 2160});
+}
+
+BENCHMARK(BM_CopyPlaneByPixel)->Apply(FrameSizes);
+BENCHMARK(BM_SwapUVPlane)->Apply(FrameSizes);
+
+}  // namespace
+}  // namespace android
@@ -7,9 +7,15 @@
 
 #include "common.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <sys/system_properties.h>
 #include <time.h>
 
+#include <inttypes.h>
+
 #include <algorithm>
 #include <cmath>
 #include <numeric>
@@ -17,6 +23,8 @@
 
 #include <log/log.h>
 
+#include <v4l2_codec2/common/Percentile.h>
+
 namespace android {
 
 InputFile::InputFile(std::string file_path) {
@@ -96,6 +104,9 @@ bool IVFWriter::WriteHeader(const Size& resolution, uint32_t frame_rate, uint32_
     case VideoCodecType::VP9:
         codec_str = "VP90";
         break;
+    case VideoCodecType::AV1:
+        codec_str = "AV01";
+        break;
     default:
         printf("[ERR] Unknown codec: \n");
         return false;
@@ -139,7 +150,8 @@ bool OutputFile::Open(const std::string& file_path, VideoCodecType codec) {
         return false;
     }
 
-    if ((codec == VideoCodecType::VP8) || (codec == VideoCodecType::VP9)) {
+    if ((codec == VideoCodecType::VP8) || (codec == VideoCodecType::VP9) ||
+        (codec == VideoCodecType::AV1)) {
         ivf_writer_ = std::make_unique<IVFWriter>(&output_file_, codec);
     }
     return true;
@@ -258,6 +270,7 @@ VideoCodecType VideoCodecProfileToType(VideoCodecProfile profile) {
     if (profile >= VP8PROFILE_MIN && profile <= VP8PROFILE_MAX) return VideoCodecType::VP8;
     if (profile >= VP9PROFILE_MIN && profile <= VP9PROFILE_MAX) return VideoCodecType::VP9;
     if (profile >= HEVCPROFILE_MIN && profile <= HEVCPROFILE_MAX) return VideoCodecType::HEVC;
+    if (profile >= AV1PROFILE_MIN && profile <= AV1PROFILE_MAX) return VideoCodecType::AV1;
     return VideoCodecType::UNKNOWN;
 }
 
@@ -271,6 +284,24 @@ std::vector<std::string> SplitString(const std::string& src, char delim) {
     return ret;
 }
 
+namespace {
+
+// The percentiles of the summaries of the frame timings, the maximum is reported as the 100th.
+constexpr int kFrameTimingPercentiles[] = {50, 90, 99, 100};
+
+void WritePercentilesJson(std::ofstream* file, const char* key,
+                          const std::map<int, int64_t>& percentiles) {
+    *file << "  \"" << key << "\": {";
+    const char* separator = "";
+    for (const auto& [percentile, value] : percentiles) {
+        *file << separator << "\"p" << percentile << "\": " << value;
+        separator = ", ";
+    }
+    *file << "}";
+}
+
+}  // namespace
+
 int64_t GetNowUs() {
     struct timespec t;
     t.tv_sec = t.tv_nsec = 0;
@@ -289,9 +320,149 @@ const char* GetMimeType(VideoCodecType type) {
         return "video/x-vnd.on2.vp9";
     case VideoCodecType::HEVC:
         return "video/hevc";
+    case VideoCodecType::AV1:
+        return "video/av01";
     default:  // unknown type
         return nullptr;
     }
 }
 
+int GetNumConcurrentSessions(int requested, const char* property) {
+    int num_sessions = requested;
+
+    char value[PROP_VALUE_MAX] = {};
+    if (__system_property_get(property, value) > 0) {
+        const int limit = atoi(value);
+        if (limit >= 0 && limit < num_sessions) {
+            printf("[LOG] Limited to %d concurrent sessions by %s\n", limit, property);
+            num_sessions = limit;
+        }
+    }
+    return num_sessions;
+}
+
+void PrintConcurrencyStats(const std::vector<SessionStats>& sessions, int64_t wall_time_us) {
+    if (sessions.empty() || wall_time_us <= 0) return;
+
+    int total_frames = 0;
+    int total_late_frames = 0;
+    double sum_fps = 0.0;
+    double sum_squared_fps = 0.0;
+    double min_fps = sessions[0].fps();
+    double max_fps = sessions[0].fps();
+    for (size_t i = 0; i < sessions.size(); i++) {
+        const double fps = sessions[i].fps();
+        printf("[LOG] Session #%zu: %d frames, %.2f fps, %d late frames\n", i,
+               sessions[i].num_frames, fps, sessions[i].num_late_frames);
+        total_frames += sessions[i].num_frames;
+        total_late_frames += sessions[i].num_late_frames;
+        sum_fps += fps;
+        sum_squared_fps += fps * fps;
+        min_fps = std::min(min_fps, fps);
+        max_fps = std::max(max_fps, fps);
+    }
+
+    const double fairness =
+            sum_squared_fps > 0.0 ? sum_fps * sum_fps / (sessions.size() * sum_squared_fps) : 0.0;
+    printf("[LOG] Concurrent sessions: %zu, aggregate FPS: %.2f\n", sessions.size(),
+           total_frames * 1000000.0 / wall_time_us);
+    printf("[LOG] Session FPS min: %.2f, max: %.2f, fairness: %.3f\n", min_fps, max_fps, fairness);
+    printf("[LOG] Dropped frames rate: %lf\n",
+           total_frames > 0 ? static_cast<double>(total_late_frames) / total_frames : 0.0);
+}
+
+void FrameTimingRecorder::OnFrameSubmitted(int64_t timestamp_us, size_t input_size) {
+    const int64_t now_us = GetNowUs();
+    if (start_us_ < 0) start_us_ = now_us;
+
+    FrameTiming& frame = frames_[timestamp_us];
+    frame.submit_us = now_us - start_us_;
+    frame.input_size = input_size;
+}
+
+void FrameTimingRecorder::OnFrameOutput(int64_t timestamp_us, size_t output_size) {
+    auto it = frames_.find(timestamp_us);
+    if (it == frames_.end()) {
+        printf("[WARN] Output frame of timestamp %" PRId64 " was never submitted\n", timestamp_us);
+        return;
+    }
+    it->second.output_us = GetNowUs() - start_us_;
+    it->second.output_size = output_size;
+}
+
+FrameTimingRecorder::Summary FrameTimingRecorder::ComputeSummary() const {
+    Summary summary;
+    summary.num_frames = frames_.size();
+
+    std::vector<int64_t> latencies_us;
+    std::vector<int64_t> output_times_us;
+    for (const auto& [timestamp_us, frame] : frames_) {
+        if (frame.output_us < 0) continue;
+        latencies_us.push_back(frame.output_us - frame.submit_us);
+        output_times_us.push_back(frame.output_us);
+    }
+    summary.num_output_frames = output_times_us.size();
+    // The frames might be output in another order than submitted, e.g. when reordered.
+    std::sort(output_times_us.begin(), output_times_us.end());
+    std::vector<int64_t> output_intervals_us;
+    for (size_t i = 1; i < output_times_us.size(); i++) {
+        output_intervals_us.push_back(output_times_us[i] - output_times_us[i - 1]);
+    }
+    if (!output_times_us.empty() && output_times_us.back() > 0) {
+        summary.fps = output_times_us.size() * 1000000.0 / output_times_us.back();
+    }
+
+    std::sort(latencies_us.begin(), latencies_us.end());
+    std::sort(output_intervals_us.begin(), output_intervals_us.end());
+    for (int percentile : kFrameTimingPercentiles) {
+        summary.latency_us[percentile] = getPercentile(latencies_us, percentile);
+        summary.output_interval_us[percentile] = getPercentile(output_intervals_us, percentile);
+    }
+    return summary;
+}
+
+void FrameTimingRecorder::PrintSummary() const {
+    const Summary summary = ComputeSummary();
+    printf("[LOG] Frame timings: %zu frames submitted, %zu output, %.2f fps\n", summary.num_frames,
+           summary.num_output_frames, summary.fps);
+    for (int percentile : kFrameTimingPercentiles) {
+        printf("[LOG] p%d latency: %" PRId64 " us, output interval: %" PRId64 " us\n", percentile,
+               summary.latency_us.at(percentile), summary.output_interval_us.at(percentile));
+    }
+}
+
+bool FrameTimingRecorder::WriteResults(const std::string& dir, const std::string& name) const {
+    const std::string csv_path = dir + "/" + name + ".csv";
+    std::ofstream csv_file(csv_path);
+    if (!csv_file.is_open()) {
+        printf("[ERR] Failed to open file: %s\n", csv_path.c_str());
+        return false;
+    }
+    csv_file << "timestamp_us,submit_us,output_us,latency_us,input_size,output_size\n";
+    for (const auto& [timestamp_us, frame] : frames_) {
+        csv_file << timestamp_us << "," << frame.submit_us << "," << frame.output_us << ","
+                 << (frame.output_us >= 0 ? frame.output_us - frame.submit_us : -1) << ","
+                 << frame.input_size << "," << frame.output_size << "\n";
+    }
+
+    const std::string json_path = dir + "/" + name + ".json";
+    std::ofstream json_file(json_path);
+    if (!json_file.is_open()) {
+        printf("[ERR] Failed to open file: %s\n", json_path.c_str());
+        return false;
+    }
+    const Summary summary = ComputeSummary();
+    json_file << "{\n";
+    json_file << "  \"num_frames\": " << summary.num_frames << ",\n";
+    json_file << "  \"num_output_frames\": " << summary.num_output_frames << ",\n";
+    json_file << "  \"fps\": " << summary.fps << ",\n";
+    WritePercentilesJson(&json_file, "latency_us", summary.latency_us);
+    json_file << ",\n";
+    WritePercentilesJson(&json_file, "output_interval_us", summary.output_interval_us);
+    json_file << "\n}\n";
+
+    printf("[LOG] Frame timings written to %s and %s\n", csv_path.c_str(), json_path.c_str());
+    return csv_file.good() && json_file.good();
+}
+
 }  // namespace android
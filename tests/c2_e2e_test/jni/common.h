@@ -5,8 +5,11 @@
 #ifndef C2_E2E_TEST_COMMON_H_
 #define C2_E2E_TEST_COMMON_H_
 
+#include <stdint.h>
+
 #include <fstream>
 #include <ios>
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
@@ -46,6 +49,12 @@ enum VideoCodecProfile {
     HEVCPROFILE_MAIN10 = 17,
     HEVCPROFILE_MAIN_STILL_PICTURE = 18,
     HEVCPROFILE_MAX = HEVCPROFILE_MAIN_STILL_PICTURE,
+    // The Dolby Vision and Theora profiles in between are not supported.
+    AV1PROFILE_MIN = 24,
+    AV1PROFILE_PROFILE_MAIN = AV1PROFILE_MIN,
+    AV1PROFILE_PROFILE_HIGH = 25,
+    AV1PROFILE_PROFILE_PRO = 26,
+    AV1PROFILE_MAX = AV1PROFILE_PROFILE_PRO,
 };
 
 // The enum class of video codec type.
@@ -55,6 +64,7 @@ enum class VideoCodecType {
     VP8,
     VP9,
     HEVC,
+    AV1,
 };
 
 // Structure to store resolution.
@@ -180,5 +190,65 @@ int64_t GetNowUs();
 // Get Mime type name from video codec type.
 const char* GetMimeType(VideoCodecType type);
 
+// Clamp the |requested| number of concurrent sessions to the limit the components enforce through
+// the system |property| (e.g. "ro.vendor.v4l2_codec2.decode_concurrent_instances"), if any.
+int GetNumConcurrentSessions(int requested, const char* property);
+
+// The results of one of the sessions run by a concurrency test.
+struct SessionStats {
+    // The number of output frames.
+    int num_frames = 0;
+    // The number of output frames which missed their deadline at the requested framerate.
+    int num_late_frames = 0;
+    // The time between the start of the session and its last output frame.
+    int64_t duration_us = 0;
+
+    double fps() const { return duration_us > 0 ? num_frames * 1000000.0 / duration_us : 0.0; }
+};
+
+// Print the aggregate FPS, the per-session FPS fairness and the frame-drop rate of |sessions| run
+// concurrently for |wall_time_us|. The fairness is Jain's index of the per-session FPS, 1.0 when
+// all the sessions run at the same speed and 1/N when a single session out of N makes progress.
+void PrintConcurrencyStats(const std::vector<SessionStats>& sessions, int64_t wall_time_us);
+
+// Records the submit time, the output time and the sizes of each frame of a session, to compare
+// the throughput and the jitter of the codec across driver and firmware versions. The frames are
+// keyed by their presentation timestamp, which must be unique.
+class FrameTimingRecorder {
+public:
+    // Record the submission of the frame of |timestamp_us|, of |input_size| bytes, to the codec.
+    void OnFrameSubmitted(int64_t timestamp_us, size_t input_size);
+    // Record the output of the frame of |timestamp_us|, of |output_size| bytes.
+    void OnFrameOutput(int64_t timestamp_us, size_t output_size);
+
+    // Print the percentiles of the latency and of the interval between the outputs of the frames.
+    void PrintSummary() const;
+    // Write the timings of the frames to <|dir|>/<|name|>.csv, and the summary to
+    // <|dir|>/<|name|>.json. Return false if a file can't be written.
+    bool WriteResults(const std::string& dir, const std::string& name) const;
+
+private:
+    struct FrameTiming {
+        // The times relative to the first submission, -1 if the frame wasn't output.
+        int64_t submit_us = -1;
+        int64_t output_us = -1;
+        size_t input_size = 0;
+        size_t output_size = 0;
+    };
+    struct Summary {
+        size_t num_frames = 0;
+        size_t num_output_frames = 0;
+        double fps = 0.0;
+        // The percentiles of the latencies and of the output intervals, by percentile.
+        std::map<int, int64_t> latency_us;
+        std::map<int, int64_t> output_interval_us;
+    };
+
+    Summary ComputeSummary() const;
+
+    int64_t start_us_ = -1;
+    std::map<int64_t, FrameTiming> frames_;
+};
+
 }  // namespace android
 #endif  // C2_E2E_TEST_COMMON_H_
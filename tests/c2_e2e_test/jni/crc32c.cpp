@@ -0,0 +1,118 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "crc32c.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+namespace android {
+
+namespace {
+
+// The reversed Castagnoli polynomial.
+constexpr uint32_t kCrc32cPolynomial = 0x82f63b78;
+
+struct Crc32cTable {
+    Crc32cTable() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc & 1) ? (crc >> 1) ^ kCrc32cPolynomial : crc >> 1;
+            }
+            entries[i] = crc;
+        }
+    }
+
+    uint32_t entries[256];
+};
+
+uint32_t Crc32cSoftware(uint32_t crc, const uint8_t* data, size_t length) {
+    static const Crc32cTable table;
+    for (size_t i = 0; i < length; i++) {
+        crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+bool HasHardwareCrc32c() {
+    return __builtin_cpu_supports("sse4.2");
+}
+
+__attribute__((target("sse4.2"))) uint32_t Crc32cHardware(uint32_t crc, const uint8_t* data,
+                                                           size_t length) {
+#if defined(__x86_64__)
+    uint64_t crc64 = crc;
+    for (; length >= 8; length -= 8, data += 8) {
+        uint64_t value;
+        memcpy(&value, data, sizeof(value));
+        crc64 = _mm_crc32_u64(crc64, value);
+    }
+    crc = static_cast<uint32_t>(crc64);
+#endif
+    for (; length >= 4; length -= 4, data += 4) {
+        uint32_t value;
+        memcpy(&value, data, sizeof(value));
+        crc = _mm_crc32_u32(crc, value);
+    }
+    for (; length > 0; length--, data++) crc = _mm_crc32_u8(crc, *data);
+    return crc;
+}
+
+#elif defined(__aarch64__)
+
+bool HasHardwareCrc32c() {
+    return getauxval(AT_HWCAP) & HWCAP_CRC32;
+}
+
+__attribute__((target("crc"))) uint32_t Crc32cHardware(uint32_t crc, const uint8_t* data,
+                                                        size_t length) {
+    for (; length >= 8; length -= 8, data += 8) {
+        uint64_t value;
+        memcpy(&value, data, sizeof(value));
+        crc = __builtin_arm_crc32cd(crc, value);
+    }
+    for (; length > 0; length--, data++) crc = __builtin_arm_crc32cb(crc, *data);
+    return crc;
+}
+
+#else
+
+bool HasHardwareCrc32c() {
+    return false;
+}
+
+uint32_t Crc32cHardware(uint32_t crc, const uint8_t* data, size_t length) {
+    return Crc32cSoftware(crc, data, length);
+}
+
+#endif
+
+}  // namespace
+
+uint32_t Crc32c(const void* data, size_t length, uint32_t crc) {
+    static const bool kHasHardwareCrc32c = HasHardwareCrc32c();
+
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    const uint32_t state = ~crc;
+    return ~(kHasHardwareCrc32c ? Crc32cHardware(state, bytes, length)
+                                : Crc32cSoftware(state, bytes, length));
+}
+
+std::string Crc32cToBase16(uint32_t crc) {
+    char str[9];
+    snprintf(str, sizeof(str), "%08x", crc);
+    return std::string(str);
+}
+
+}  // namespace android
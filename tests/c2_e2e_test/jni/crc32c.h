@@ -0,0 +1,32 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef C2_E2E_TEST_CRC32C_H_
+#define C2_E2E_TEST_CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+namespace android {
+
+// CRC32C (Castagnoli) is the CRC variant computed by the SSE4.2 and ARMv8 CRC32 instructions. It
+// is much cheaper than MD5 when they are available, so frames can be verified at full decode
+// speed, but it isn't collision-resistant. A software fallback is used on other CPUs.
+//
+// The CRC of data split into several buffers can be computed incrementally:
+//   uint32_t crc = Crc32c(data1, length1);
+//   crc = Crc32c(data2, length2, crc);
+
+// Computes the CRC32C of the given data buffer with the given length, continuing from the |crc| of
+// the preceding data if any.
+uint32_t Crc32c(const void* data, size_t length, uint32_t crc = 0);
+
+// Converts a CRC32C into human-readable hexadecimal.
+std::string Crc32cToBase16(uint32_t crc);
+
+}  // namespace android
+
+#endif  // C2_E2E_TEST_CRC32C_H_
@@ -101,9 +101,9 @@ EncodedDataHelper::EncodedDataHelper(const std::string& file_path, VideoCodecTyp
         return;
     }
 
-    int file_size = input.GetLength();
-    if (file_size <= 0) {
-        ALOGE("Stream byte size (=%d) is invalid", file_size);
+    const size_t file_size = input.GetLength();
+    if (file_size == 0) {
+        ALOGE("Stream byte size (=%zu) is invalid", file_size);
         return;
     }
     input.Rewind();
@@ -154,6 +154,7 @@ void EncodedDataHelper::SliceToFragments(const std::string& data) {
             break;
         case VideoCodecType::VP8:
         case VideoCodecType::VP9:
+        case VideoCodecType::AV1:
             fragment->data = GetBytesForNextFrame(data, &next_pos);
             break;
         default:
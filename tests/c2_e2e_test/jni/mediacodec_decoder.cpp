@@ -32,7 +32,7 @@ constexpr size_t kTimeoutMaxRetries = 500;
 
 // Helper function to get possible C2 hardware decoder names from |type|.
 // Note: A single test APK is built for both ARC++ and ARCVM, so both the VDA decoder and the new
-// V4L2 decoder names need to be specified here (except for HEVC, which is only on ARCVM).
+// V4L2 decoder names need to be specified here (except for HEVC and AV1, which are only on ARCVM).
 std::vector<const char*> GetC2VideoDecoderNames(VideoCodecType type) {
     switch (type) {
     case VideoCodecType::H264:
@@ -43,6 +43,8 @@ std::vector<const char*> GetC2VideoDecoderNames(VideoCodecType type) {
         return {"c2.v4l2.vp9.decoder", "c2.vda.vp9.decoder"};
     case VideoCodecType::HEVC:
         return {"c2.v4l2.hevc.decoder"};
+    case VideoCodecType::AV1:
+        return {"c2.v4l2.av1.decoder"};
     default:  // unknown type
         return {};
     }
@@ -59,6 +61,8 @@ std::vector<const char*> GetSwVideoDecoderNames(VideoCodecType type) {
         return {"c2.android.vp8.decoder", "OMX.google.vp8.decoder"};
     case VideoCodecType::VP9:
         return {"c2.android.vp9.decoder", "OMX.google.vp9.decoder"};
+    case VideoCodecType::AV1:
+        return {"c2.android.av1.decoder"};
     default:  // unknown type
         return {};
     }
@@ -342,8 +346,12 @@ bool MediaCodecDecoder::FeedInputBuffer(size_t index) {
     if (fragment->csd_flag) input_flag |= BUFFER_FLAG_CODEC_CONFIG;
 
     // We don't parse the display order of each bitstream buffer. Let's trust the order of received
-    // output buffers from |codec_|.
+    // output buffers from |codec_|. The timings of the frames are matched by their timestamps
+    // though, so each frame gets its own.
     uint64_t timestamp_us = 0;
+    if (frame_timing_recorder_ && !fragment->csd_flag) {
+        timestamp_us = input_fragment_index_ * 1000000ull / frame_rate_;
+    }
 
     ALOGV("queueInputBuffer(index=%zu, offset=0, size=%zu, time=%" PRIu64 ", flags=%u) #%d", index,
           fragment->data.size(), timestamp_us, input_flag, input_fragment_index_);
@@ -353,6 +361,9 @@ bool MediaCodecDecoder::FeedInputBuffer(size_t index) {
         ALOGE("Failed to queueInputBuffer: %d", status);
         return false;
     }
+    if (frame_timing_recorder_ && !fragment->csd_flag) {
+        frame_timing_recorder_->OnFrameSubmitted(timestamp_us, fragment->data.size());
+    }
     ++input_fragment_index_;
     return true;
 }
@@ -391,6 +402,9 @@ bool MediaCodecDecoder::ReceiveOutputBuffer(int32_t index, const AMediaCodecBuff
 
     // Do not callback for dummy EOS output (info.size == 0)
     if (info.size > 0) {
+        if (frame_timing_recorder_) {
+            frame_timing_recorder_->OnFrameOutput(info.presentationTimeUs, info.size);
+        }
         for (const auto& callback : output_buffer_ready_cbs_)
             callback(buf, info.size, received_outputs_);
     }
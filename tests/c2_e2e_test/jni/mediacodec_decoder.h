@@ -45,6 +45,12 @@ public:
                                int32_t /* color_format */)>;
     void AddOutputFormatChangedCb(const OutputFormatChangedCb& cb);
 
+    // Record the timings of the frames into |recorder|, which must outlive the decoder. The input
+    // buffers are then queued with distinct timestamps, to match the output buffers with them.
+    void SetFrameTimingRecorder(FrameTimingRecorder* recorder) {
+        frame_timing_recorder_ = recorder;
+    }
+
     // Decoder manipulation methods.
 
     // Rewind the input stream to the first frame as well as frame index.
@@ -134,6 +140,9 @@ private:
     // is changed.
     std::vector<OutputFormatChangedCb> output_format_changed_cbs_;
 
+    // The recorder of the timings of the frames, if any.
+    FrameTimingRecorder* frame_timing_recorder_ = nullptr;
+
     // The fragment index that indicates which frame is sent to the decoder at
     // next round.
     int64_t input_fragment_index_ = 0;
@@ -6,11 +6,14 @@
 #define LOG_TAG "Decoder_E2E"
 
 #include <getopt.h>
+#include <string.h>
 
+#include <algorithm>
 #include <fstream>
 #include <functional>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <gtest/gtest.h>
@@ -23,6 +26,17 @@
 
 namespace android {
 
+// The options of the verification of the decoded frames.
+struct VerifyOptions {
+    // The checksum the frames are compared with their golden file by.
+    ChecksumType checksum_type = ChecksumType::MD5;
+    // Only verify one frame out of |verify_every|, to reduce the CPU load of the verification.
+    int verify_every = 1;
+    // The path at which to save the CRC32C of the verified frames, e.g. to create the golden
+    // CRC32C file of a stream from a run verified against its golden MD5 file.
+    std::string output_crc32c_path;
+};
+
 // Environment to store test video data for all test cases.
 class C2VideoDecoderTestEnvironment;
 
@@ -34,13 +48,18 @@ C2VideoDecoderTestEnvironment* g_env;
 class C2VideoDecoderTestEnvironment : public testing::Environment {
 public:
     C2VideoDecoderTestEnvironment(bool loop, bool use_sw_decoder, bool use_fake_renderer,
+                                  int concurrent_sessions, const VerifyOptions& verify_options,
                                   const std::string& data, const std::string& output_frames_path,
-                                  ANativeWindow* surface, ConfigureCallback* cb)
+                                  const std::string& perf_output_dir, ANativeWindow* surface,
+                                  ConfigureCallback* cb)
           : loop_(loop),
             use_sw_decoder_(use_sw_decoder),
             use_fake_renderer_(use_fake_renderer),
+            concurrent_sessions_(concurrent_sessions),
+            verify_options_(verify_options),
             test_video_data_(data),
             output_frames_path_(output_frames_path),
+            perf_output_dir_(perf_output_dir),
             surface_(surface),
             configure_cb_(cb) {}
 
@@ -90,10 +109,15 @@ public:
         frame_rate_ = std::stoi(fields[8]);
     }
 
-    // Get the corresponding frame-wise golden MD5 file path.
-    std::string GoldenMD5FilePath() const { return input_file_path_ + ".frames.md5"; }
+    // Get the corresponding frame-wise golden checksum file path.
+    std::string GoldenFilePath() const {
+        return input_file_path_ + (verify_options_.checksum_type == ChecksumType::CRC32C
+                                           ? ".frames.crc32c"
+                                           : ".frames.md5");
+    }
 
     std::string output_frames_path() const { return output_frames_path_; }
+    std::string perf_output_dir() const { return perf_output_dir_; }
 
     std::string input_file_path() const { return input_file_path_; }
     Size visible_size() const { return visible_size_; }
@@ -105,6 +129,8 @@ public:
     bool loop() const { return loop_; }
     bool use_sw_decoder() const { return use_sw_decoder_; }
     bool use_fake_renderer() const { return use_fake_renderer_; }
+    int concurrent_sessions() const { return concurrent_sessions_; }
+    const VerifyOptions& verify_options() const { return verify_options_; }
 
     ANativeWindow* surface() const { return surface_; }
 
@@ -112,8 +138,11 @@ protected:
     bool loop_;
     bool use_sw_decoder_;
     bool use_fake_renderer_;
+    int concurrent_sessions_;
+    VerifyOptions verify_options_;
     std::string test_video_data_;
     std::string output_frames_path_;
+    std::string perf_output_dir_;
 
     std::string input_file_path_;
     Size visible_size_;
@@ -133,18 +162,41 @@ struct OutputFormat {
     int32_t color_format = 0;
 };
 
-// The helper class to validate video frame by MD5 and output to I420 raw stream
-// if needed.
+// The helper class to validate video frame by checksum and output to I420 raw
+// stream if needed.
 class VideoFrameValidator {
 public:
     VideoFrameValidator() = default;
-    ~VideoFrameValidator() { output_file_.close(); }
+    ~VideoFrameValidator() {
+        output_file_.close();
+        output_crc32c_file_.close();
+    }
 
-    // Set |md5_golden_path| as the path of golden frame-wise MD5 file. Return
-    // false if the file is failed to read.
-    bool SetGoldenMD5File(const std::string& md5_golden_path) {
-        golden_md5_file_ = std::unique_ptr<InputFileASCII>(new InputFileASCII(md5_golden_path));
-        return golden_md5_file_->IsValid();
+    // Set |golden_path| as the path of golden frame-wise checksum file, which
+    // holds the |options.checksum_type| checksums. Return false if the file is
+    // failed to read.
+    bool SetGoldenFile(const std::string& golden_path, const VerifyOptions& options) {
+        checksum_type_ = options.checksum_type;
+        verify_every_ = std::max(options.verify_every, 1);
+        golden_file_ = std::unique_ptr<InputFileASCII>(new InputFileASCII(golden_path));
+        return golden_file_->IsValid();
+    }
+
+    // Set |output_crc32c_path| as the path for the output CRC32C of the
+    // verified frames. Return false if the file is failed to open.
+    bool SetOutputCrc32cFile(const std::string& output_crc32c_path) {
+        if (output_crc32c_path.empty()) return false;
+
+        output_crc32c_file_.open(output_crc32c_path);
+        if (!output_crc32c_file_.is_open()) {
+            printf("[ERR] Failed to open file: %s\n", output_crc32c_path.c_str());
+            return false;
+        }
+        if (verify_every_ != 1) {
+            printf("[WARN] Only one frame out of %d is written to %s\n", verify_every_,
+                   output_crc32c_path.c_str());
+        }
+        return true;
     }
 
     // Set |output_frames_path| as the path for output raw I420 stream. Return
@@ -163,25 +215,33 @@ public:
     }
 
     // Callback function of output buffer ready to validate frame data by
-    // VideoFrameValidator, write into file if needed.
-    void VerifyMD5(const uint8_t* data, size_t buffer_size, int output_index) {
+    // VideoFrameValidator, write into file if needed. Only one frame out of
+    // |verify_every_| is verified, the first frame is always verified so the
+    // HAL format of flexible frames can be matched.
+    void VerifyFrame(const uint8_t* data, size_t buffer_size, int output_index) {
         ASSERT_TRUE(data != nullptr);
 
         std::string golden;
-        ASSERT_TRUE(golden_md5_file_ && golden_md5_file_->IsValid());
-        ASSERT_TRUE(golden_md5_file_->ReadLine(&golden))
-                << "Failed to read golden MD5 at frame#" << output_index;
+        ASSERT_TRUE(golden_file_ && golden_file_->IsValid());
+        ASSERT_TRUE(golden_file_->ReadLine(&golden))
+                << "Failed to read golden checksum at frame#" << output_index;
+        if (output_index % verify_every_ != 0) return;
 
         std::unique_ptr<VideoFrame> video_frame =
                 VideoFrame::Create(data, buffer_size, output_format_.coded_size,
                                    output_format_.visible_size, output_format_.color_format);
-        ASSERT_TRUE(video_frame) << "Failed to create video frame on VerifyMD5 at frame#"
+        ASSERT_TRUE(video_frame) << "Failed to create video frame on VerifyFrame at frame#"
                                  << output_index;
 
-        ASSERT_TRUE(video_frame->VerifyMD5(golden)) << "MD5 mismatched at frame#" << output_index;
+        ASSERT_TRUE(video_frame->VerifyChecksum(golden, checksum_type_))
+                << "Checksum mismatched at frame#" << output_index;
 
         // Update color_format.
         output_format_.color_format = video_frame->color_format();
+
+        if (output_crc32c_file_.is_open()) {
+            output_crc32c_file_ << video_frame->ComputeChecksum(ChecksumType::CRC32C) << "\n";
+        }
     }
 
     // Callback function of output buffer ready to validate frame data by
@@ -212,10 +272,16 @@ public:
     }
 
 private:
-    // The wrapper of input MD5 golden file.
-    std::unique_ptr<InputFileASCII> golden_md5_file_;
+    // The wrapper of input golden checksum file.
+    std::unique_ptr<InputFileASCII> golden_file_;
+    // The checksum held by |golden_file_|.
+    ChecksumType checksum_type_ = ChecksumType::MD5;
+    // Only one frame out of |verify_every_| is verified.
+    int verify_every_ = 1;
     // The output file to write the decoded raw video.
     std::ofstream output_file_;
+    // The output file to write the CRC32C of the verified frames.
+    std::ofstream output_crc32c_file_;
 
     // Only output video frame to file if True.
     bool write_to_file_ = false;
@@ -325,10 +391,12 @@ private:
 TEST_F(C2VideoDecoderByteBufferE2ETest, TestSimpleDecode) {
     VideoFrameValidator video_frame_validator;
 
-    ASSERT_TRUE(video_frame_validator.SetGoldenMD5File(g_env->GoldenMD5FilePath()))
-            << "Failed to open MD5 file: " << g_env->GoldenMD5FilePath();
+    ASSERT_TRUE(video_frame_validator.SetGoldenFile(g_env->GoldenFilePath(),
+                                                    g_env->verify_options()))
+            << "Failed to open golden file: " << g_env->GoldenFilePath();
+    video_frame_validator.SetOutputCrc32cFile(g_env->verify_options().output_crc32c_path);
 
-    decoder_->AddOutputBufferReadyCb(std::bind(&VideoFrameValidator::VerifyMD5,
+    decoder_->AddOutputBufferReadyCb(std::bind(&VideoFrameValidator::VerifyFrame,
                                                &video_frame_validator, std::placeholders::_1,
                                                std::placeholders::_2, std::placeholders::_3));
 
@@ -370,10 +438,90 @@ TEST_F(C2VideoDecoderSurfaceNoRenderE2ETest, TestFPS) {
     TestFPSBody();
 }
 
+// Decode the test stream as fast as the decoder goes, without rendering, and export the timings of
+// each frame to the directory given by --perf_output_dir, to compare them across driver and
+// firmware versions.
+TEST_F(C2VideoDecoderByteBufferE2ETest, PerfFrameTimings) {
+    if (g_env->perf_output_dir().empty()) {
+        printf("[LOG] Skipped, no output directory given by --perf_output_dir\n");
+        return;
+    }
+    // The frames of the successive loops would have the same timestamps.
+    if (g_env->loop()) {
+        printf("[LOG] Skipped, the frame timings can't be recorded with --loop\n");
+        return;
+    }
+
+    FrameTimingRecorder recorder;
+    decoder_->SetFrameTimingRecorder(&recorder);
+    EXPECT_TRUE(decoder_->Decode());
+
+    recorder.PrintSummary();
+    EXPECT_TRUE(recorder.WriteResults(g_env->perf_output_dir(), "decoder_frame_timings"));
+}
+
+// Decode the test stream with several decoders at once, each one on its own thread, to exercise
+// the multi-session load of e.g. a video call. The frames are decoded to byte buffers, as the
+// sessions can't share the surface.
+TEST(C2VideoDecoderConcurrentE2ETest, TestConcurrentDecode) {
+    const int num_sessions = GetNumConcurrentSessions(
+            g_env->concurrent_sessions(), "ro.vendor.v4l2_codec2.decode_concurrent_instances");
+    if (num_sessions <= 0) {
+        printf("[LOG] Skipped, no concurrent sessions requested by --concurrent_sessions\n");
+        return;
+    }
+
+    std::vector<std::unique_ptr<MediaCodecDecoder>> decoders;
+    for (int i = 0; i < num_sessions; i++) {
+        decoders.push_back(MediaCodecDecoder::Create(
+                g_env->input_file_path(), g_env->video_codec_profile(), g_env->use_sw_decoder(),
+                g_env->visible_size(), g_env->frame_rate(), nullptr /* surface */,
+                false /* renderOnRelease */, false /* loop */, false /* use_fake_renderer */));
+        ASSERT_TRUE(decoders.back()) << "Failed to create decoder #" << i;
+
+        decoders.back()->Rewind();
+        ASSERT_TRUE(decoders.back()->Configure());
+        ASSERT_TRUE(decoders.back()->Start());
+    }
+
+    // Each session's statistics are only accessed by the thread running the session, as the
+    // output callbacks are called by Decode().
+    std::vector<SessionStats> stats(num_sessions);
+    std::vector<char> succeeded(num_sessions, false);
+    std::vector<std::thread> threads;
+    const int64_t start_us = GetNowUs();
+    for (int i = 0; i < num_sessions; i++) {
+        SessionStats* session_stats = &stats[i];
+        decoders[i]->AddOutputBufferReadyCb([session_stats, start_us](const uint8_t* /* data */,
+                                                                      size_t /* buffer_size */,
+                                                                      int /* output_index */) {
+            session_stats->num_frames++;
+            session_stats->duration_us = GetNowUs() - start_us;
+        });
+        threads.emplace_back(
+                [&decoders, &succeeded, i]() { succeeded[i] = decoders[i]->Decode(); });
+    }
+    for (std::thread& thread : threads) thread.join();
+    const int64_t wall_time_us = GetNowUs() - start_us;
+
+    for (int i = 0; i < num_sessions; i++) {
+        EXPECT_TRUE(succeeded[i]) << "Decoder #" << i << " failed";
+        EXPECT_TRUE(decoders[i]->Stop());
+        EXPECT_EQ(g_env->num_frames(), stats[i].num_frames) << "Decoder #" << i;
+        if (stats[i].num_frames > 0) {
+            stats[i].num_late_frames = static_cast<int>(
+                    decoders[i]->dropped_frame_rate() * stats[i].num_frames + 0.5);
+        }
+    }
+    PrintConcurrencyStats(stats, wall_time_us);
+}
+
 }  // namespace android
 
 bool GetOption(int argc, char** argv, std::string* test_video_data, std::string* output_frames_path,
-               bool* loop, bool* use_sw_decoder, bool* use_fake_renderer) {
+               bool* loop, bool* use_sw_decoder, bool* use_fake_renderer,
+               int* concurrent_sessions, android::VerifyOptions* verify_options,
+               std::string* perf_output_dir) {
     const char* const optstring = "t:o:";
     static const struct option opts[] = {
             {"test_video_data", required_argument, nullptr, 't'},
@@ -381,6 +529,11 @@ bool GetOption(int argc, char** argv, std::string* test_video_data, std::string*
             {"loop", no_argument, nullptr, 'l'},
             {"use_sw_decoder", no_argument, nullptr, 's'},
             {"fake_renderer", no_argument, nullptr, 'f'},
+            {"concurrent_sessions", required_argument, nullptr, 'c'},
+            {"frame_checksum", required_argument, nullptr, 'k'},
+            {"verify_every", required_argument, nullptr, 'v'},
+            {"output_crc32c_path", required_argument, nullptr, 'p'},
+            {"perf_output_dir", required_argument, nullptr, 'd'},
             {nullptr, 0, nullptr, 0},
     };
 
@@ -403,6 +556,28 @@ bool GetOption(int argc, char** argv, std::string* test_video_data, std::string*
         case 'f':
             *use_fake_renderer = true;
             break;
+        case 'c':
+            *concurrent_sessions = atoi(optarg);
+            break;
+        case 'k':
+            if (!strcmp(optarg, "md5")) {
+                verify_options->checksum_type = android::ChecksumType::MD5;
+            } else if (!strcmp(optarg, "crc32c")) {
+                verify_options->checksum_type = android::ChecksumType::CRC32C;
+            } else {
+                printf("[ERR] Unknown frame checksum: %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'v':
+            verify_options->verify_every = atoi(optarg);
+            break;
+        case 'p':
+            verify_options->output_crc32c_path = optarg;
+            break;
+        case 'd':
+            *perf_output_dir = optarg;
+            break;
         default:
             printf("[WARN] Unknown option: getopt_long() returned code 0x%x.\n", opt);
             break;
@@ -423,8 +598,12 @@ int RunDecoderTests(char** test_args, int test_args_count, ANativeWindow* surfac
     bool loop = false;
     bool use_sw_decoder = false;
     bool use_fake_renderer = false;
+    int concurrent_sessions = 0;
+    android::VerifyOptions verify_options;
+    std::string perf_output_dir;
     if (!GetOption(test_args_count, test_args, &test_video_data, &output_frames_path, &loop,
-                   &use_sw_decoder, &use_fake_renderer)) {
+                   &use_sw_decoder, &use_fake_renderer, &concurrent_sessions, &verify_options,
+                   &perf_output_dir)) {
         ALOGE("GetOption failed");
         return EXIT_FAILURE;
     }
@@ -432,8 +611,9 @@ int RunDecoderTests(char** test_args, int test_args_count, ANativeWindow* surfac
     if (android::g_env == nullptr) {
         android::g_env = reinterpret_cast<android::C2VideoDecoderTestEnvironment*>(
                 testing::AddGlobalTestEnvironment(new android::C2VideoDecoderTestEnvironment(
-                        loop, use_sw_decoder, use_fake_renderer, test_video_data,
-                        output_frames_path, surface, cb)));
+                        loop, use_sw_decoder, use_fake_renderer, concurrent_sessions,
+                        verify_options, test_video_data, output_frames_path, perf_output_dir,
+                        surface, cb)));
     } else {
         ALOGE("Trying to reuse test process");
         return EXIT_FAILURE;
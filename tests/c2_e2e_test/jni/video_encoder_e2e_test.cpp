@@ -12,6 +12,7 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <gtest/gtest.h>
@@ -54,6 +55,8 @@ struct CmdlineArgs {
     bool run_at_fps = false;
     size_t num_encoded_frames = 0;
     bool use_sw_encoder = false;
+    int concurrent_sessions = 0;
+    std::string perf_output_dir;
 };
 
 class C2VideoEncoderTestEnvironment : public testing::Environment {
@@ -165,6 +168,8 @@ public:
     bool run_at_fps() const { return args_.run_at_fps; }
     size_t num_encoded_frames() const { return args_.num_encoded_frames; }
     bool use_sw_encoder() const { return args_.use_sw_encoder; }
+    int concurrent_sessions() const { return args_.concurrent_sessions; }
+    std::string perf_output_dir() const { return args_.perf_output_dir; }
 
     ConfigureCallback* configure_cb() const { return configure_cb_; }
 
@@ -344,6 +349,101 @@ TEST_F(C2VideoEncoderE2ETest, PerfLatency) {
     recorder.PrintResult();
 }
 
+// Encode the test stream as fast as the encoder goes, and export the timings of each frame to the
+// directory given by --perf_output_dir, to compare them across driver and firmware versions.
+TEST_F(C2VideoEncoderE2ETest, PerfFrameTimings) {
+    if (g_env->perf_output_dir().empty()) {
+        printf("[LOG] Skipped, no output directory given by --perf_output_dir\n");
+        return;
+    }
+
+    FrameTimingRecorder recorder;
+    // The input frames are all in the YUV420 format of the test stream.
+    const size_t input_size = g_env->visible_size().width * g_env->visible_size().height * 3 / 2;
+    encoder_->SetEncodeInputBufferCb([&recorder, input_size](uint64_t time_us) {
+        recorder.OnFrameSubmitted(time_us, input_size);
+    });
+    encoder_->SetOutputBufferReadyCb(
+            [&recorder](const uint8_t* /* data */, const AMediaCodecBufferInfo& info) {
+                // Ignore the CSD buffer and the empty EOS buffer.
+                if (!(info.flags & AMEDIACODEC_BUFFER_FLAG_CODEC_CONFIG) && info.size != 0) {
+                    recorder.OnFrameOutput(info.presentationTimeUs, info.size);
+                }
+            });
+    if (g_env->num_encoded_frames()) encoder_->set_num_encoded_frames(g_env->num_encoded_frames());
+
+    EXPECT_TRUE(encoder_->Encode());
+
+    recorder.PrintSummary();
+    EXPECT_TRUE(recorder.WriteResults(g_env->perf_output_dir(), "encoder_frame_timings"));
+}
+
+// Encode the test stream with several encoders at once, each one on its own thread. When run at
+// the requested framerate, the frames output later than one frame period after being fed count as
+// dropped.
+TEST(C2VideoEncoderConcurrentE2ETest, PerfConcurrentFPS) {
+    const int num_sessions = GetNumConcurrentSessions(
+            g_env->concurrent_sessions(), "ro.vendor.v4l2_codec2.encode_concurrent_instances");
+    if (num_sessions <= 0) {
+        printf("[LOG] Skipped, no concurrent sessions requested by --concurrent_sessions\n");
+        return;
+    }
+
+    std::vector<std::unique_ptr<MediaCodecEncoder>> encoders;
+    for (int i = 0; i < num_sessions; i++) {
+        encoders.push_back(MediaCodecEncoder::Create(g_env->input_file_path(), g_env->codec(),
+                                                     g_env->visible_size(),
+                                                     g_env->use_sw_encoder()));
+        ASSERT_TRUE(encoders.back()) << "Failed to create encoder #" << i;
+
+        encoders.back()->Rewind();
+        ASSERT_TRUE(encoders.back()->Configure(static_cast<int32_t>(g_env->requested_bitrate()),
+                                               static_cast<int32_t>(g_env->requested_framerate())));
+        ASSERT_TRUE(encoders.back()->Start());
+        encoders.back()->set_run_at_fps(g_env->run_at_fps());
+        if (g_env->num_encoded_frames()) {
+            encoders.back()->set_num_encoded_frames(g_env->num_encoded_frames());
+        }
+    }
+
+    // Each session's statistics are only accessed by the thread running the session, as the
+    // output callbacks are called by Encode().
+    std::vector<SessionStats> stats(num_sessions);
+    std::vector<char> succeeded(num_sessions, false);
+    std::vector<std::thread> threads;
+    const int64_t frame_period_us = 1000000 / g_env->requested_framerate();
+    const bool run_at_fps = g_env->run_at_fps();
+    const int64_t start_us = GetNowUs();
+    for (int i = 0; i < num_sessions; i++) {
+        SessionStats* session_stats = &stats[i];
+        encoders[i]->SetOutputBufferReadyCb([session_stats, start_us, frame_period_us, run_at_fps](
+                                                    const uint8_t* /* data */,
+                                                    const AMediaCodecBufferInfo& info) {
+            // Ignore the CSD buffer and the empty EOS buffer.
+            if ((info.flags & AMEDIACODEC_BUFFER_FLAG_CODEC_CONFIG) || info.size == 0) return;
+
+            session_stats->duration_us = GetNowUs() - start_us;
+            session_stats->num_frames++;
+            if (run_at_fps &&
+                session_stats->duration_us > session_stats->num_frames * frame_period_us) {
+                session_stats->num_late_frames++;
+            }
+        });
+        threads.emplace_back(
+                [&encoders, &succeeded, i]() { succeeded[i] = encoders[i]->Encode(); });
+    }
+    for (std::thread& thread : threads) thread.join();
+    const int64_t wall_time_us = GetNowUs() - start_us;
+
+    for (int i = 0; i < num_sessions; i++) {
+        EXPECT_TRUE(succeeded[i]) << "Encoder #" << i << " failed";
+        EXPECT_TRUE(encoders[i]->Stop());
+        EXPECT_EQ(encoders[i]->num_encoded_frames(), static_cast<size_t>(stats[i].num_frames))
+                << "Encoder #" << i;
+    }
+    PrintConcurrencyStats(stats, wall_time_us);
+}
+
 }  // namespace android
 
 bool GetOption(int argc, char** argv, android::CmdlineArgs* args) {
@@ -353,6 +453,8 @@ bool GetOption(int argc, char** argv, android::CmdlineArgs* args) {
             {"run_at_fps", no_argument, nullptr, 'r'},
             {"num_encoded_frames", required_argument, nullptr, 'n'},
             {"use_sw_encoder", no_argument, nullptr, 's'},
+            {"concurrent_sessions", required_argument, nullptr, 'c'},
+            {"perf_output_dir", required_argument, nullptr, 'd'},
             {nullptr, 0, nullptr, 0},
     };
 
@@ -371,6 +473,12 @@ bool GetOption(int argc, char** argv, android::CmdlineArgs* args) {
         case 's':
             args->use_sw_encoder = true;
             break;
+        case 'c':
+            args->concurrent_sessions = atoi(optarg);
+            break;
+        case 'd':
+            args->perf_output_dir = optarg;
+            break;
         default:
             printf("[WARN] Unknown option: getopt_long() returned code 0x%x.\n", opt);
             break;
@@ -147,7 +147,7 @@ void VideoFrame::CopyAndConvertToI420Frame(int32_t curr_format) {
     }
 }
 
-bool VideoFrame::MatchHalFormatByGoldenMD5(const std::string& golden) {
+bool VideoFrame::MatchHalFormatByGoldenChecksum(const std::string& golden, ChecksumType type) {
     if (!IsFlexibleFormat()) return true;
 
     // Try to match with HAL_PIXEL_FORMAT_NV12 first.
@@ -155,13 +155,13 @@ bool VideoFrame::MatchHalFormatByGoldenMD5(const std::string& golden) {
     for (int32_t format : format_candidates) {
         CopyAndConvertToI420Frame(format);
         color_format_ = format;
-        std::string frame_md5 = ComputeMD5FromFrame();
-        if (!strcmp(frame_md5.c_str(), golden.c_str())) {
+        std::string frame_checksum = ComputeChecksum(type);
+        if (!strcmp(frame_checksum.c_str(), golden.c_str())) {
             ALOGV("Matched YUV Flexible to HAL pixel format: 0x%x", format);
             return true;
         } else {
-            ALOGV("Tried HAL pixel format: 0x%x un-matched (%s vs %s)", format, frame_md5.c_str(),
-                  golden.c_str());
+            ALOGV("Tried HAL pixel format: 0x%x un-matched (%s vs %s)", format,
+                  frame_checksum.c_str(), golden.c_str());
         }
     }
 
@@ -189,18 +189,40 @@ std::string VideoFrame::ComputeMD5FromFrame() const {
     return MD5DigestToBase16(digest);
 }
 
-bool VideoFrame::VerifyMD5(const std::string& golden) {
+std::string VideoFrame::ComputeCRC32CFromFrame() const {
+    if (IsFlexibleFormat()) {
+        ALOGE("Cannot compute CRC32C with format YUV_420_FLEXIBLE");
+        return std::string();
+    }
+
+    uint32_t crc = Crc32c(frame_data_[0].get(), visible_size_.width * visible_size_.height);
+    crc = Crc32c(frame_data_[1].get(), visible_size_.width * visible_size_.height / 4, crc);
+    crc = Crc32c(frame_data_[2].get(), visible_size_.width * visible_size_.height / 4, crc);
+    return Crc32cToBase16(crc);
+}
+
+std::string VideoFrame::ComputeChecksum(ChecksumType type) const {
+    switch (type) {
+    case ChecksumType::MD5:
+        return ComputeMD5FromFrame();
+    case ChecksumType::CRC32C:
+        return ComputeCRC32CFromFrame();
+    }
+    return std::string();
+}
+
+bool VideoFrame::VerifyChecksum(const std::string& golden, ChecksumType type) {
     if (IsFlexibleFormat()) {
         // Color format is YUV_420_FLEXIBLE and we haven't match its HAL pixel
         // format yet. Try to match now.
-        if (!MatchHalFormatByGoldenMD5(golden)) {
+        if (!MatchHalFormatByGoldenChecksum(golden, type)) {
             ALOGE("Failed to match any HAL format");
             return false;
         }
     } else {
-        std::string md5 = ComputeMD5FromFrame();
-        if (strcmp(md5.c_str(), golden.c_str())) {
-            ALOGE("MD5 mismatched. expect: %s, got: %s", golden.c_str(), md5.c_str());
+        std::string checksum = ComputeChecksum(type);
+        if (strcmp(checksum.c_str(), golden.c_str())) {
+            ALOGE("Checksum mismatched. expect: %s, got: %s", golden.c_str(), checksum.c_str());
             return false;
         }
     }
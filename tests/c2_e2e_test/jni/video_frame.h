@@ -10,10 +10,18 @@
 #include <string>
 
 #include "common.h"
+#include "crc32c.h"
 #include "md5.h"
 
 namespace android {
 
+// The checksum the frames are verified with. The golden MD5 files are the reference, CRC32C is
+// much faster to compute but needs its own golden files.
+enum class ChecksumType {
+    MD5,
+    CRC32C,
+};
+
 // The helper class to convert video frame data to I420 format and make a copy
 // of planes, cropped within the visible window.
 class VideoFrame {
@@ -31,7 +39,7 @@ public:
         // Android color format which is flexible. For Chrome OS devices, it may be
         // either YV12 or NV12 as HAL pixel format.
         // Note: This format is not able to parse, client is required to call
-        //       MatchHalFormatByGoldenMD5() first to identify the corresponding HAL
+        //       MatchHalFormatByGoldenChecksum() first to identify the corresponding HAL
         //       pixel format.
         YUV_420_FLEXIBLE = 0x7f420888,
 
@@ -41,10 +49,14 @@ public:
         HAL_PIXEL_FORMAT_YV12 = 0x32315659,
     };
 
-    // Verify the calculated MD5 of video frame by comparing to |golden|.
-    // It will call MatchHalFormatByGoldenMD5() to find corresponding HAL format
-    // if current color format is YUV_420_FLEXIBLE
-    bool VerifyMD5(const std::string& golden);
+    // Verify the calculated |type| checksum of video frame by comparing to
+    // |golden|. It will call MatchHalFormatByGoldenChecksum() to find
+    // corresponding HAL format if current color format is YUV_420_FLEXIBLE
+    bool VerifyChecksum(const std::string& golden, ChecksumType type);
+
+    // Compute and return the |type| checksum for video frame planes as I420
+    // format.
+    std::string ComputeChecksum(ChecksumType type) const;
 
     // Write video frame planes to |output_file| as I420 format.
     bool WriteFrame(std::ofstream* output_file) const;
@@ -60,12 +72,15 @@ private:
     // crop window.
     void CopyAndConvertToI420Frame(int32_t curr_format);
 
-    // Try to match corresponding HAL pixel format by comparing to |golden| MD5.
-    // Return true on found and overwrite |color_format_| to HAL format.
-    bool MatchHalFormatByGoldenMD5(const std::string& golden);
+    // Try to match corresponding HAL pixel format by comparing to |golden|
+    // |type| checksum. Return true on found and overwrite |color_format_| to HAL
+    // format.
+    bool MatchHalFormatByGoldenChecksum(const std::string& golden, ChecksumType type);
 
     // Compute and return MD5 for video frame planes as I420 format.
     std::string ComputeMD5FromFrame() const;
+    // Compute and return CRC32C for video frame planes as I420 format.
+    std::string ComputeCRC32CFromFrame() const;
 
     // Return True if current color format is YUV_420_FLEXIBLE.
     bool IsFlexibleFormat() const;
@@ -77,7 +92,7 @@ private:
     // The specified visible size from output format.
     Size visible_size_;
     // The specified color format from output format. It may be overwritten by
-    // MatchHalFormatByGoldenMD5().
+    // MatchHalFormatByGoldenChecksum().
     int32_t color_format_;
 
     // Converted frame data stored by planes. [0]:Y, [1]:U, [2]:V